@@ -27,9 +27,12 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/io/load.h>
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/histogram.h>
 #include <freeradius-devel/util/pair_legacy.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/radius/list.h>
@@ -81,6 +84,12 @@ static fr_packet_list_t *packet_list = NULL;
 static rc_request_t *request_head = NULL;
 static rc_request_t *rc_request_tail = NULL;
 
+static fr_load_config_t load_config = {
+	.duration = fr_time_delta_wrap((int64_t)10 * NSEC)
+};
+static unsigned int load_sockets = 16;
+static char const *load_csv = NULL;
+
 static char const *radclient_version = RADIUSD_VERSION_STRING_BUILD("radclient");
 
 static fr_dict_t const *dict_freeradius;
@@ -153,7 +162,13 @@ static NEVER_RETURNS void usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -l <pps>[:<max>[:<step>]]\n");
+	fprintf(stderr, "                         Generate load, starting at 'pps' packets/s, and increasing\n");
+	fprintf(stderr, "                         by 'step' packets/s until 'max' packets/s.\n");
+	fprintf(stderr, "  -L <time>              Time to spend at each load step (default 10s).\n");
+	fprintf(stderr, "  -N <num>               Number of sockets to send load from (default 16).\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -o <file>              Write load statistics to 'file' as CSV, or '-' for stdout.\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>             Use proto (tcp or udp) for transport.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
@@ -196,7 +211,7 @@ static int _rc_request_free(rc_request_t *request)
 	return 0;
 }
 
-static int mschapv1_encode(fr_radius_packet_t *packet, fr_pair_list_t *list,
+static int mschapv1_encode(TALLOC_CTX *ctx, fr_pair_list_t *list,
 			   char const *password)
 {
 	unsigned int		i;
@@ -207,7 +222,7 @@ static int mschapv1_encode(fr_radius_packet_t *packet, fr_pair_list_t *list,
 	fr_pair_delete_by_da(list, attr_ms_chap_challenge);
 	fr_pair_delete_by_da(list, attr_ms_chap_response);
 
-	MEM(challenge = fr_pair_afrom_da(packet, attr_ms_chap_challenge));
+	MEM(challenge = fr_pair_afrom_da(ctx, attr_ms_chap_challenge));
 
 	fr_pair_append(list, challenge);
 
@@ -218,7 +233,7 @@ static int mschapv1_encode(fr_radius_packet_t *packet, fr_pair_list_t *list,
 		p[i] = fr_rand();
 	}
 
-	MEM(reply = fr_pair_afrom_da(packet, attr_ms_chap_response));
+	MEM(reply = fr_pair_afrom_da(ctx, attr_ms_chap_response));
 	fr_pair_append(list, reply);
 	p = talloc_array(reply, uint8_t, 50);
 	fr_pair_value_memdup_buffer_shallow(reply, p, false);
@@ -768,6 +783,55 @@ static void deallocate_id(rc_request_t *request)
 	if (request->reply) fr_radius_packet_free(&request->reply);
 }
 
+/*
+ *	Update the password in the request, so that it is
+ *	encrypted with the authentication vector of the packet
+ *	we're about to send.
+ */
+static void radclient_password_update(rc_request_t *request, fr_radius_packet_t *packet)
+{
+	fr_pair_t *vp;
+
+	if (!request->password) return;
+
+	if ((vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_user_password, 0)) != NULL) {
+		fr_pair_value_strdup(vp, request->password->vp_strvalue, false);
+
+	} else if ((vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_chap_password, 0)) != NULL) {
+		uint8_t		buffer[17];
+		fr_pair_t	*challenge;
+		uint8_t	const	*vector;
+
+		/*
+		 *	Use Chap-Challenge pair if present,
+		 *	Request Authenticator otherwise.
+		 */
+		challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_chap_challenge, 0);
+		if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
+			vector = challenge->vp_octets;
+		} else {
+			vector = packet->vector;
+		}
+
+		fr_radius_encode_chap_password(buffer,
+					       fr_rand() & 0xff, vector,
+					       request->password->vp_strvalue,
+					       request->password->vp_length);
+		fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
+
+	} else if (fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_password, 0) != NULL) {
+		/*
+		 *	The pairs go into the request's list, which
+		 *	outlives the packet in load mode, so they
+		 *	must be parented by the request.
+		 */
+		mschapv1_encode(request, &request->request_pairs, request->password->vp_strvalue);
+
+	} else {
+		DEBUG("WARNING: No password in the request");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -841,41 +905,7 @@ static int send_one_packet(rc_request_t *request)
 		 *	Update the password, so it can be encrypted with the
 		 *	new authentication vector.
 		 */
-		if (request->password) {
-			fr_pair_t *vp;
-
-			if ((vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_user_password, 0)) != NULL) {
-				fr_pair_value_strdup(vp, request->password->vp_strvalue, false);
-
-			} else if ((vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_chap_password, 0)) != NULL) {
-				uint8_t		buffer[17];
-				fr_pair_t	*challenge;
-				uint8_t	const	*vector;
-
-				/*
-				 *	Use Chap-Challenge pair if present,
-				 *	Request Authenticator otherwise.
-				 */
-				challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_chap_challenge, 0);
-				if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
-					vector = challenge->vp_octets;
-				} else {
-					vector = request->packet->vector;
-				}
-
-				fr_radius_encode_chap_password(buffer,
-							       fr_rand() & 0xff, vector,
-							       request->password->vp_strvalue,
-							       request->password->vp_length);
-				fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
-
-			} else if (fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_password, 0) != NULL) {
-				mschapv1_encode(request->packet, &request->request_pairs, request->password->vp_strvalue);
-
-			} else {
-				DEBUG("WARNING: No password in the request");
-			}
-		}
+		radclient_password_update(request, request->packet);
 
 		request->timestamp = fr_time();
 		request->tries = 1;
@@ -1120,6 +1150,489 @@ packet_done:
 	return 0;
 }
 
+/*
+ *	Load generation mode.
+ *
+ *	Packets are built from the templates read from the input
+ *	files, in round-robin order, at the rate given by the load
+ *	generator.  Sending is open-loop, i.e. we don't wait for a
+ *	reply before sending the next packet.  Packets are never
+ *	retransmitted, as that would distort the offered load.
+ */
+typedef struct rc_load_s rc_load_t;
+typedef struct rc_load_socket_s rc_load_socket_t;
+
+typedef struct {
+	rc_load_socket_t	*sock;		//!< The ID belongs to.
+	fr_radius_packet_t	*packet;	//!< Outstanding packet, or NULL if the ID is free.
+	fr_time_t		sent;		//!< When the packet was due to be sent.
+	fr_event_timer_t const	*ev;		//!< Timeout for the packet.
+} rc_load_id_t;
+
+struct rc_load_socket_s {
+	rc_load_t		*load;
+	int			fd;
+	uint16_t		port;		//!< Source port of the socket.
+	unsigned int		outstanding;	//!< Number of IDs in use.
+	unsigned int		next_id;	//!< Where to start looking for a free ID.
+	rc_load_id_t		id[256];
+};
+
+typedef struct {
+	uint64_t		sent;
+	uint64_t		lost;		//!< No reply within the timeout.
+	uint64_t		no_id;		//!< Not sent, as all IDs on all sockets were in use.
+	uint64_t		bad;		//!< Unexpected replies, or ones which failed verification.
+	fr_histogram_t		code[FR_RADIUS_CODE_MAX];	//!< Reply latency, by reply code.
+} rc_load_stats_t;
+
+struct rc_load_s {
+	fr_event_list_t		*el;
+	fr_load_t		*l;
+
+	fr_time_t		start;
+	fr_time_t		end;		//!< When the last step of the schedule finishes.
+
+	rc_request_t		*next;		//!< Template to send next.
+
+	rc_load_socket_t	*sockets;
+	unsigned int		num_sockets;
+	unsigned int		next_socket;	//!< Where to start looking for a free ID.
+	uint64_t		outstanding;	//!< Packets sent, but not yet replied to.
+
+	FILE			*csv;		//!< Where to write CSV statistics.
+	bool			csv_header;
+
+	fr_time_t		report_next;	//!< When the next statistics are due.
+	fr_event_timer_t const	*report_ev;
+
+	rc_load_stats_t		interval;	//!< Since the last report.
+	rc_load_stats_t		total;		//!< Since the start of the test.
+};
+
+static void load_have_reply(rc_load_t *load, fr_time_t sent)
+{
+	if (fr_load_generator_have_reply(load->l, sent) == FR_LOAD_DONE) fr_event_loop_exit(load->el, 1);
+}
+
+static void load_id_release(rc_load_id_t *id)
+{
+	rc_load_socket_t *sock = id->sock;
+
+	if (id->ev) fr_event_timer_delete(&id->ev);
+	fr_radius_packet_free(&id->packet);
+
+	sock->outstanding--;
+	sock->load->outstanding--;
+}
+
+static void load_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rc_load_id_t	*id = uctx;
+	rc_load_t	*load = id->sock->load;
+	fr_time_t	sent = id->sent;
+
+	load->interval.lost++;
+	load->total.lost++;
+
+	load_id_release(id);
+	load_have_reply(load, sent);
+}
+
+/** Find a free ID, spreading packets over all of the sockets
+ *
+ */
+static rc_load_id_t *load_id_alloc(rc_load_t *load)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < load->num_sockets; i++) {
+		rc_load_socket_t *sock = &load->sockets[(load->next_socket + i) % load->num_sockets];
+
+		if (sock->outstanding >= NUM_ELEMENTS(sock->id)) continue;
+
+		load->next_socket = (load->next_socket + i + 1) % load->num_sockets;
+
+		for (j = 0; j < NUM_ELEMENTS(sock->id); j++) {
+			unsigned int idx = (sock->next_id + j) & 0xff;
+
+			if (sock->id[idx].packet) continue;
+
+			sock->next_id = idx + 1;
+			sock->outstanding++;
+			load->outstanding++;
+
+			return &sock->id[idx];
+		}
+	}
+
+	return NULL;
+}
+
+/** Send one packet, called by the load generator
+ *
+ */
+static int load_send(fr_time_t now, void *uctx)
+{
+	rc_load_t		*load = uctx;
+	rc_request_t		*request = load->next;
+	rc_load_id_t		*id;
+	fr_radius_packet_t	*packet;
+
+	load->next = request->next ? request->next : request_head;
+
+	/*
+	 *	Tell the load generator that the packet is done, so
+	 *	that its idea of the backlog stays correct.
+	 */
+	id = load_id_alloc(load);
+	if (!id) {
+		load->interval.no_id++;
+		load->total.no_id++;
+		load_have_reply(load, now);
+		return -1;
+	}
+
+	packet = fr_radius_packet_alloc(load, true);
+	if (!packet) {
+	oom:
+		ERROR("Out of memory");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	packet->code = request->packet->code;
+	packet->id = id - id->sock->id;
+	packet->socket = request->packet->socket;
+	packet->socket.fd = id->sock->fd;
+	packet->socket.proto = IPPROTO_UDP;
+	packet->socket.inet.src_ipaddr = client_ipaddr;
+	packet->socket.inet.src_port = id->sock->port;
+
+	radclient_password_update(request, packet);
+
+	if (fr_radius_packet_send(packet, &request->request_pairs, NULL, secret) < 0) {
+		REDEBUG("Failed to send packet for ID %d", packet->id);
+		fr_radius_packet_free(&packet);
+		id->sock->outstanding--;
+		load->outstanding--;
+		load_have_reply(load, now);
+		return -1;
+	}
+
+	if (fr_debug_lvl > 1) fr_packet_log(&default_log, packet, &request->request_pairs, false);
+
+	/*
+	 *	Latency is measured from when the load generator
+	 *	wanted the packet sent, and not from when we managed
+	 *	to send it.  Otherwise delays in radclient would hide
+	 *	delays in the server.
+	 */
+	id->packet = packet;
+	id->sent = now;
+
+	if (fr_event_timer_in(load, load->el, &id->ev, timeout, load_timeout, id) < 0) goto oom;
+
+	load->interval.sent++;
+	load->total.sent++;
+
+	return 0;
+}
+
+/** Read replies from one socket
+ *
+ */
+static void load_recv(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rc_load_socket_t	*sock = uctx;
+	rc_load_t		*load = sock->load;
+	int			i;
+
+	/*
+	 *	Read a batch of replies, but don't starve the timers.
+	 */
+	for (i = 0; i < 64; i++) {
+		fr_radius_packet_t	*reply;
+		rc_load_id_t		*id;
+		fr_time_delta_t		rtt;
+		fr_time_t		sent;
+
+		reply = fr_radius_packet_recv(load, fd, 0, RADIUS_MAX_ATTRIBUTES, false);
+		if (!reply) break;
+
+		id = &sock->id[reply->id];
+		if (!id->packet || !FR_RADIUS_PACKET_CODE_VALID(reply->code) ||
+		    (fr_radius_packet_verify(reply, id->packet, secret) < 0)) {
+			load->interval.bad++;
+			load->total.bad++;
+			fr_radius_packet_free(&reply);
+			continue;
+		}
+
+		sent = id->sent;
+		rtt = fr_time_sub(fr_time(), sent);
+		fr_histogram_add(&load->interval.code[reply->code], rtt);
+		fr_histogram_add(&load->total.code[reply->code], rtt);
+
+		switch (reply->code) {
+		case FR_RADIUS_CODE_ACCESS_ACCEPT:
+			stats.accepted++;
+			break;
+
+		case FR_RADIUS_CODE_ACCESS_REJECT:
+			stats.rejected++;
+			break;
+
+		default:
+			break;
+		}
+
+		fr_radius_packet_free(&reply);
+		load_id_release(id);
+		load_have_reply(load, sent);
+	}
+}
+
+static void load_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rc_load_socket_t *sock = uctx;
+
+	ERROR("Socket with source port %u failed: %s", sock->port, fr_syserror(fd_errno));
+	fr_event_loop_exit(sock->load->el, 1);
+}
+
+/** Write one set of statistics as CSV, with one row per reply code
+ *
+ */
+static void load_csv_write(rc_load_t *load, char const *type, double elapsed, int pps, rc_load_stats_t const *s)
+{
+	unsigned int	code;
+	bool		written = false;
+
+	if (!load->csv) return;
+
+	if (!load->csv_header) {
+		fprintf(load->csv, "\"type\",\"time\",\"pps\",\"sent\",\"lost\",\"no_id\",\"bad\",\"code\",\"count\","
+			"\"mean_usec\",\"p50_usec\",\"p90_usec\",\"p99_usec\",\"p99.9_usec\",\"max_usec\"\n");
+		load->csv_header = true;
+	}
+
+	for (code = 1; code < FR_RADIUS_CODE_MAX; code++) {
+		fr_histogram_t const *h = &s->code[code];
+
+		if (!h->count) continue;
+
+		fprintf(load->csv, "%s,%f,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s,%" PRIu64 ","
+			"%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			type, elapsed, pps, s->sent, s->lost, s->no_id, s->bad,
+			fr_packet_codes[code], h->count,
+			fr_time_delta_unwrap(fr_histogram_mean(h)) / 1000.0,
+			fr_time_delta_unwrap(fr_histogram_percentile(h, 50)) / 1000.0,
+			fr_time_delta_unwrap(fr_histogram_percentile(h, 90)) / 1000.0,
+			fr_time_delta_unwrap(fr_histogram_percentile(h, 99)) / 1000.0,
+			fr_time_delta_unwrap(fr_histogram_percentile(h, 99.9)) / 1000.0,
+			h->max / 1000.0);
+		written = true;
+	}
+
+	/*
+	 *	Keep a row for intervals with no replies, so that
+	 *	stalls show up in the output.
+	 */
+	if (!written) {
+		fprintf(load->csv, "%s,%f,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",,0,,,,,,\n",
+			type, elapsed, pps, s->sent, s->lost, s->no_id, s->bad);
+	}
+
+	fflush(load->csv);
+}
+
+/** Print and reset the statistics for the last interval
+ *
+ */
+static void load_report(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	rc_load_t		*load = uctx;
+	fr_load_stats_t const	*ls = fr_load_generator_stats(load->l);
+	double			elapsed = fr_time_delta_unwrap(fr_time_sub(now, load->start)) / (double)NSEC;
+	unsigned int		code;
+
+	if (do_output && (load->csv != stdout)) {
+		fprintf(fr_log_fp, "%8.1fs  pps %d  sent %" PRIu64 "  lost %" PRIu64 "  backlog %" PRIu64 "%s\n",
+			elapsed, ls->pps, load->interval.sent, load->interval.lost, load->outstanding,
+			ls->blocked ? "  (blocked)" : "");
+
+		for (code = 1; code < FR_RADIUS_CODE_MAX; code++) {
+			fr_histogram_t const *h = &load->interval.code[code];
+
+			if (!h->count) continue;
+
+			fprintf(fr_log_fp, "          %-20s count %" PRIu64 "  p50 %.0fus  p99 %.0fus  p99.9 %.0fus  max %.0fus\n",
+				fr_packet_codes[code], h->count,
+				fr_time_delta_unwrap(fr_histogram_percentile(h, 50)) / 1000.0,
+				fr_time_delta_unwrap(fr_histogram_percentile(h, 99)) / 1000.0,
+				fr_time_delta_unwrap(fr_histogram_percentile(h, 99.9)) / 1000.0,
+				h->max / 1000.0);
+		}
+	}
+
+	load_csv_write(load, "interval", elapsed, ls->pps, &load->interval);
+	memset(&load->interval, 0, sizeof(load->interval));
+
+	/*
+	 *	The load generator only notices that it's done when a
+	 *	reply arrives, which may have happened already.
+	 */
+	if (fr_time_gteq(now, load->end) && !load->outstanding) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	load->report_next = fr_time_add(load->report_next, fr_time_delta_from_sec(1));
+	if (fr_event_timer_at(load, el, &load->report_ev, load->report_next, load_report, load) < 0) {
+		fr_perror("Failed inserting statistics timer");
+		fr_event_loop_exit(el, 1);
+	}
+}
+
+/** Run the load test, and print a summary at the end
+ *
+ */
+static int load_run(TALLOC_CTX *ctx)
+{
+	rc_load_t	*load;
+	unsigned int	i, steps;
+	unsigned int	code;
+	double		elapsed;
+	fr_time_t	now;
+
+	if (!load_config.max_pps) load_config.max_pps = load_config.start_pps;
+	if (!load_config.step) load_config.step = load_config.start_pps;
+
+	/*
+	 *	Packets are outstanding until they time out, so the
+	 *	backlog should be allowed to grow to that.
+	 */
+	load_config.milliseconds = fr_time_delta_to_msec(timeout);
+	if (!load_config.milliseconds) load_config.milliseconds = 1;
+
+	if (((uint64_t) load_sockets * 256 * 1000) < ((uint64_t) load_config.max_pps * load_config.milliseconds)) {
+		WARN("%u sockets may not have enough IDs for %u packets/s with a timeout of %ums",
+		     load_sockets, load_config.max_pps, load_config.milliseconds);
+	}
+
+	load = talloc_zero(ctx, rc_load_t);
+	if (!load) {
+	oom:
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	load->el = fr_event_list_alloc(load, NULL, NULL);
+	if (!load->el) {
+		fr_perror("Failed creating event list");
+		return -1;
+	}
+
+	load->next = request_head;
+	load->num_sockets = load_sockets;
+	load->sockets = talloc_zero_array(load, rc_load_socket_t, load->num_sockets);
+	if (!load->sockets) goto oom;
+
+	for (i = 0; i < load->num_sockets; i++) {
+		rc_load_socket_t	*sock = &load->sockets[i];
+		uint16_t		port = 0;
+		unsigned int		j;
+
+		sock->load = load;
+		for (j = 0; j < NUM_ELEMENTS(sock->id); j++) sock->id[j].sock = sock;
+
+		sock->fd = fr_socket_server_udp(&client_ipaddr, &port, NULL, true);
+		if (sock->fd < 0) {
+			fr_perror("Error opening socket");
+			return -1;
+		}
+
+		if (fr_socket_bind(sock->fd, &client_ipaddr, &port, NULL) < 0) {
+			fr_perror("Error binding socket");
+			return -1;
+		}
+		sock->port = port;
+
+		if (fr_event_fd_insert(load, load->el, sock->fd, load_recv, NULL, load_error, sock) < 0) {
+			fr_perror("Failed inserting socket into event list");
+			return -1;
+		}
+	}
+
+	if (load_csv) {
+		if (strcmp(load_csv, "-") == 0) {
+			load->csv = stdout;
+		} else {
+			load->csv = fopen(load_csv, "w");
+			if (!load->csv) {
+				ERROR("Error opening %s: %s", load_csv, fr_syserror(errno));
+				return -1;
+			}
+		}
+	}
+
+	load->l = fr_load_generator_create(load, load->el, &load_config, load_send, load);
+	if (!load->l) goto oom;
+
+	steps = ((load_config.max_pps - load_config.start_pps) / load_config.step) + 1;
+
+	load->start = fr_time();
+	load->end = fr_time_add(load->start, fr_time_delta_mul(load_config.duration, fr_time_delta_wrap(steps)));
+	load->report_next = fr_time_add(load->start, fr_time_delta_from_sec(1));
+
+	if (fr_event_timer_at(load, load->el, &load->report_ev, load->report_next, load_report, load) < 0) {
+		fr_perror("Failed inserting statistics timer");
+		return -1;
+	}
+
+	fr_load_generator_start(load->l);
+
+	fr_event_loop(load->el);
+
+	fr_load_generator_stop(load->l);
+
+	now = fr_time();
+	elapsed = fr_time_delta_unwrap(fr_time_sub(now, load->start)) / (double)NSEC;
+
+	/*
+	 *	Anything still outstanding counts as lost.
+	 */
+	load->total.lost += load->outstanding;
+
+	load_csv_write(load, "total", elapsed, fr_load_generator_stats(load->l)->pps, &load->total);
+	if (load->csv && (load->csv != stdout)) fclose(load->csv);
+
+	if (do_output && (load->csv != stdout)) {
+		fprintf(fr_log_fp, "time\t%.3f\n", elapsed);
+		fprintf(fr_log_fp, "sent\t%" PRIu64 "\n", load->total.sent);
+		fprintf(fr_log_fp, "lost\t%" PRIu64 "\n", load->total.lost);
+		fprintf(fr_log_fp, "no_id\t%" PRIu64 "\n", load->total.no_id);
+		fprintf(fr_log_fp, "bad\t%" PRIu64 "\n", load->total.bad);
+
+		for (code = 1; code < FR_RADIUS_CODE_MAX; code++) {
+			if (!load->total.code[code].count) continue;
+
+			fr_histogram_fprint(fr_log_fp, &load->total.code[code], fr_packet_codes[code]);
+		}
+	}
+
+	stats.lost += load->total.lost;
+
+	for (i = 0; i < load->num_sockets; i++) {
+		fr_event_fd_delete(load->el, load->sockets[i].fd, FR_EVENT_FILTER_IO);
+		close(load->sockets[i].fd);
+	}
+
+	talloc_free(load);
+
+	return 0;
+}
+
 /**
  *
  * @hidecallgraph
@@ -1177,7 +1690,7 @@ int main(int argc, char **argv)
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:n:p:P:r:sS:t:vx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:l:L:n:N:o:p:P:r:sS:t:vx")) != -1) switch (c) {
 		case '4':
 			force_af = AF_INET;
 			break;
@@ -1247,11 +1760,51 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'l':
+		{
+			char *p;
+
+			/*
+			 *	<pps>[:<max>[:<step>]]
+			 */
+			load_config.start_pps = strtoul(optarg, &p, 10);
+			if (!load_config.start_pps) usage();
+
+			if (*p == ':') {
+				load_config.max_pps = strtoul(p + 1, &p, 10);
+				if (load_config.max_pps < load_config.start_pps) usage();
+
+				if (*p == ':') {
+					load_config.step = strtoul(p + 1, &p, 10);
+					if (!load_config.step) usage();
+				}
+			}
+			if (*p) usage();
+		}
+			break;
+
+		case 'L':
+			if (fr_time_delta_from_str(&load_config.duration, optarg, strlen(optarg), FR_TIME_RES_SEC) < 0) {
+				fr_perror("Failed parsing load step time");
+				fr_exit_now(EXIT_FAILURE);
+			}
+			if (!fr_time_delta_ispos(load_config.duration)) usage();
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
 			break;
 
+		case 'N':
+			load_sockets = atoi(optarg);
+			if ((load_sockets == 0) || (load_sockets > 65535)) usage();
+			break;
+
+		case 'o':
+			load_csv = optarg;
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1342,6 +1895,11 @@ int main(int argc, char **argv)
 		ERROR("Insufficient arguments");
 		usage();
 	}
+
+	if (load_config.start_pps && (ipproto != IPPROTO_UDP)) {
+		ERROR("Load generation (-l) can only be used with UDP");
+		usage();
+	}
 	/*
 	 *	Mismatch between the binary and the libraries it depends on
 	 */
@@ -1504,6 +2062,18 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Generate load from the packets, instead of sending
+	 *	each one "count" times.
+	 */
+	if (load_config.start_pps) {
+		load_config.parallel = parallel;
+
+		if (load_run(autofree) < 0) fr_exit_now(EXIT_FAILURE);
+
+		goto finish;
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -1637,6 +2207,7 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+finish:
 	talloc_free(filename_tree);
 
 	fr_packet_list_free(packet_list);
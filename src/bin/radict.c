@@ -42,6 +42,7 @@ RCSID("$Id$")
 
 static fr_dict_t *dicts[255];
 static bool print_values = false;
+static bool compile = false;
 static fr_dict_t **dict_end = dicts;
 
 DIAG_OFF(unused-macros)
@@ -53,6 +54,7 @@ DIAG_ON(unused-macros)
 static void usage(void)
 {
 	fprintf(stderr, "usage: radict [OPTS] <attribute> [attribute...]\n");
+	fprintf(stderr, "  -C               Compile protocol dictionaries into " FR_DICTIONARY_CACHE_FILE " files.\n");
 	fprintf(stderr, "  -E               Export dictionary definitions.\n");
 	fprintf(stderr, "  -V               Write out all attribute values.\n");
 	fprintf(stderr, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -127,6 +129,16 @@ static int load_dicts(char const *dict_dir, char const *protocol)
 				if (fr_dict_protocol_afrom_file(dict_end, dp->d_name, NULL, __FILE__) < 0) {
 					goto error;
 				}
+
+				if (compile) {
+					char *cache_file;
+
+					cache_file = talloc_asprintf(NULL, "%s/%s", file_str, FR_DICTIONARY_CACHE_FILE);
+					INFO("Writing compiled dictionary: %s", cache_file);
+					ret = fr_dict_cache_write(*dict_end, cache_file);
+					talloc_free(cache_file);
+					if (ret < 0) goto error;
+				}
 				dict_end++;
 			}
 
@@ -268,7 +280,11 @@ int main(int argc, char *argv[])
 
 	fr_debug_lvl = 1;
 
-	while ((c = getopt(argc, argv, "fED:p:Vxh")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "CfED:p:Vxh")) != -1) switch (c) {
+		case 'C':
+			compile = true;
+			break;
+
 		case 'f':
 			file_export = true;
 			break;
@@ -319,6 +335,12 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Always compile from the dictionary files, never
+	 *	from an existing compiled dictionary.
+	 */
+	if (compile) fr_dict_global_ctx_use_cache(false);
+
 	INFO("Loading dictionary: %s/%s", dict_dir, FR_DICTIONARY_FILE);
 
 	if (fr_dict_internal_afrom_file(dict_end++, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) {
@@ -813,8 +813,11 @@ int main(int argc, char *argv[])
 		schedule->max_workers = config->max_workers;
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
+		schedule->numa = config->numa;
+		schedule->timer_wheel = config->timer_wheel;
 
 		schedule->network.max_outstanding = config->max_requests;
+		schedule->network.io_uring = config->io_uring;
 		schedule->worker.max_requests = config->max_requests;
 		schedule->worker.max_request_time = config->max_request_time;
 
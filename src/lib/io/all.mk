@@ -2,7 +2,6 @@ TARGET	:= libfreeradius-io.a
 
 SOURCES	:= \
 	app_io.c \
-	atomic_queue.c \
 	channel.c \
 	control.c \
 	load.c \
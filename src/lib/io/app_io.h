@@ -49,6 +49,7 @@ typedef struct {
 
 	fr_io_data_read_t		read;		//!< Read from a socket to a data buffer
 	fr_io_data_write_t		write;		//!< Write from a data buffer to a socket
+	fr_io_data_pending_t		read_pending;	//!< How many packets have been read, but not returned.
 
 	fr_io_data_inject_t		inject;		//!< Inject a packet into a socket.
 
@@ -57,7 +58,7 @@ typedef struct {
 	fr_io_decode_t			decode;		//!< Translate raw bytes into fr_pair_ts and metadata.
 	fr_io_encode_t			encode;		//!< Pack fr_pair_ts back into a byte array.
 
-	fr_io_signal_t			flush;		//!< Flush the data when the socket is ready for writing.
+	fr_io_signal_t			flush;		//!< Flush any data queued by write().
 
 	fr_io_signal_t			error;		//!< There was an error on the socket.
 	fr_io_close_t			close;		//!< Close the transport.
@@ -257,6 +257,19 @@ typedef int (*fr_io_data_inject_t)(fr_listen_t *li,uint8_t *buffer, size_t buffe
  */
 typedef void (*fr_io_data_vnode_t)(fr_listen_t *li, uint32_t fflags);
 
+/** Return how many packets the IO handler has already read from the socket
+ *
+ *  Datagram sockets may read multiple packets per system call
+ *  (e.g. recvmmsg()).  Once that happens, the socket may no longer be
+ *  readable, even though there are packets waiting to be returned by
+ *  the read() function.  The network side uses this function to keep
+ *  calling read() until all such packets have been processed.
+ *
+ * @param[in] li		the listener for this socket
+ * @return the number of packets which can be read without touching the socket.
+ */
+typedef size_t (*fr_io_data_pending_t)(fr_listen_t *li);
+
 typedef struct fr_io_track_s fr_io_track_t; /* in master.h */
 
 /** Convert a raw packet to a tracking structure
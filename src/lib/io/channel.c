@@ -44,11 +44,6 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
-/*
- *	We disable this until we fix all of the signaling issues...
- */
-#define ENABLE_SKIPS (0)
-
 typedef enum {
 	TO_RESPONDER = 0,
 	TO_REQUESTOR = 1
@@ -62,10 +57,6 @@ static fr_table_num_sorted_t const channel_direction[] = {
 size_t channel_direction_len = NUM_ELEMENTS(channel_direction);
 #endif
 
-#if 0
-#define SIGNAL_INTERVAL (1000000)	//!< The minimum interval between responder signals.
-#endif
-
 /** Size of the atomic queues
  *
  * The queue reader MUST service the queue occasionally,
@@ -89,9 +80,6 @@ typedef enum fr_channel_signal_t {
 	/*
 	 *	The preceding MUST be in the same order as fr_channel_event_t
 	 */
-
-	FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER,
-	FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING,
 } fr_channel_signal_t;
 
 typedef struct {
@@ -105,6 +93,11 @@ typedef struct {
  * Consists of a kqueue descriptor, and an atomic queue.
  * The atomic queue is there to get bulk data through, because it's more efficient
  * than pushing 1M+ events per second through a kqueue.
+ *
+ * The writer only signals the reader when the reader has drained the
+ * queue, and set must_signal.  While the reader is busy, it will see
+ * any new messages the next time it services the queue, so the writer
+ * doesn't need to wake it up.
  */
 typedef struct {
 	fr_channel_direction_t	direction;	//!< Use for debug messages.
@@ -118,17 +111,15 @@ typedef struct {
 	fr_channel_recv_callback_t recv;	//!< callback for receiving messages
 	void			*recv_uctx;	//!< context for receiving messages
 
-	bool			must_signal;	//!< we need to signal the other end
-
-
 	uint64_t		sequence;	//!< Sequence number for this channel.
 	uint64_t		ack;		//!< Sequence number of the other end.
 	uint64_t		their_view_of_my_sequence;	//!< Should be clear.
 
-	uint64_t		sequence_at_last_signal;	//!< When we last signaled.
-
 	fr_atomic_queue_t	*aq;		//!< The queue of messages - visible only to this channel.
 
+	atomic_bool		must_signal;	//!< Set by the reader of aq when it has drained the queue.
+						///< The writer must then signal it for new messages.
+
 	atomic_bool		active;		//!< Whether the channel is active.
 
 	fr_channel_stats_t	stats;		//!< channel statistics
@@ -156,8 +147,6 @@ fr_table_num_sorted_t const channel_signals[] = {
 	{ L("data-to-requestor"),	FR_CHANNEL_DATA_READY_REQUESTOR		},
 	{ L("open"),			FR_CHANNEL_OPEN				},
 	{ L("close"),			FR_CHANNEL_CLOSE			},
-	{ L("data-done-responder"),	FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER	},
-	{ L("responder-sleeping"),	FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING	},
 };
 size_t channel_signals_len = NUM_ELEMENTS(channel_signals);
 
@@ -239,11 +228,13 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_con
 	ch->end[TO_RESPONDER].stats.last_read_other = now;
 	ch->end[TO_RESPONDER].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_RESPONDER].active, true);
+	atomic_store(&ch->end[TO_RESPONDER].must_signal, true);
 
 	ch->end[TO_REQUESTOR].stats.last_write = now;
 	ch->end[TO_REQUESTOR].stats.last_read_other = now;
 	ch->end[TO_REQUESTOR].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_REQUESTOR].active, true);
+	atomic_store(&ch->end[TO_REQUESTOR].must_signal, true);
 
 	return ch;
 }
@@ -275,7 +266,6 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 
 	end->stats.last_sent_signal = when;
 	end->stats.signals++;
-	end->must_signal = false;
 
 	cc.signal = which;
 	cc.ack = end->ack;
@@ -288,6 +278,51 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Check whether the reader of a queue needs to be woken up
+ *
+ * Called by the writer after it has pushed a message onto the queue.
+ * The reader sets must_signal before it checks the queue for the
+ * last time, and the writer clears must_signal after pushing a
+ * message.  At least one of them will then see the other's update,
+ * so the reader never sleeps with messages in its queue.
+ *
+ * @param[in] end	of the channel that the message was written to.
+ * @return
+ *	- true if the reader is idle, and must be signalled.
+ *	- false if the reader will see the message without a signal.
+ */
+static inline bool fr_channel_must_signal(fr_channel_end_t *end)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_exchange(&end->must_signal, false)) return true;
+
+	end->stats.skipped++;
+	return false;
+}
+
+/** Pop a message from a queue, or tell the writer to signal us
+ *
+ * If the queue is empty, we set must_signal, and then check the
+ * queue again.  This closes the race where the writer pushes a
+ * message after our first check, but before it sees must_signal.
+ *
+ * @param[in] end	of the channel we're reading from.
+ * @param[out] p_cd	where the message is written.
+ * @return
+ *	- true if a message was read.
+ *	- false if the queue is empty.
+ */
+static inline bool fr_channel_pop(fr_channel_end_t *end, fr_channel_data_t **p_cd)
+{
+	if (fr_atomic_queue_pop(end->aq, (void **) p_cd)) return true;
+
+	atomic_store(&end->must_signal, true);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return fr_atomic_queue_pop(end->aq, (void **) p_cd);
+}
+
 #define IALPHA (8)
 #define RTT(_old, _new) fr_time_delta_wrap((fr_time_delta_unwrap(_new) + (fr_time_delta_unwrap(_old) * (IALPHA - 1))) / IALPHA)
 
@@ -357,44 +392,27 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
-#if ENABLE_SKIPS
 	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
+	 *	The responder is still servicing its queue, and
+	 *	will pick up this message without a signal.
 	 */
-	if (requestor->stats.outstanding == 1) {
-
-		/*
-		 *	There is at least one old packet which is
-		 *	outstanding, look for a reply.
-		 */
-	} else if (requestor->stats.outstanding > 1) {
-		bool has_reply;
-
-		has_reply = fr_channel_recv_reply(ch);
-
-		if (has_reply) while (fr_channel_recv_reply(ch));
-
-		/*
-		 *	There's no reply yet, so we still have packets outstanding.
-		 *	Or, there is a reply, and there are more packets outstanding.
-		 *	Skip the signal.
-		 */
-		if (!requestor->must_signal && (!has_reply || (has_reply && (requestor->stats.outstanding > 1)))) {
-			MPRINT("REQUESTOR SKIPS signal\n");
-			return 0;
-		}
+	if (!fr_channel_must_signal(requestor)) {
+		MPRINT("REQUESTOR SKIPS signal\n");
+		return 0;
 	}
-#endif
 
 	/*
 	 *	Tell the other end that there is new data ready.
 	 *
-	 *	Ignore errors on signalling.  The responder already has
-	 *	the packet in its inbound queue, so at some point, it
-	 *	will pick up the message.
+	 *	If the signal can't be sent, the responder is still
+	 *	asleep with the packet in its inbound queue.  Set
+	 *	must_signal again, so that the next packet we send
+	 *	wakes it up.
 	 */
 	MPRINT("REQUESTOR SIGNALS\n");
-	(void) fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
+	if (fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER) < 0) {
+		atomic_store(&requestor->must_signal, true);
+	}
 	return 0;
 }
 
@@ -409,17 +427,15 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 {
 	fr_channel_data_t *cd;
 	fr_channel_end_t *requestor;
-	fr_atomic_queue_t *aq;
 
 	fr_assert(ch->end[TO_RESPONDER].recv != NULL);
 
-	aq = ch->end[TO_REQUESTOR].aq;
 	requestor = &(ch->end[TO_RESPONDER]);
 
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	if (!fr_channel_pop(&ch->end[TO_REQUESTOR], &cd)) return false;
 
 	/*
 	 *	We want an exponential moving average for round trip
@@ -473,15 +489,13 @@ bool fr_channel_recv_request(fr_channel_t *ch)
 {
 	fr_channel_data_t *cd;
 	fr_channel_end_t *responder;
-	fr_atomic_queue_t *aq;
 
-	aq = ch->end[TO_RESPONDER].aq;
 	responder = &(ch->end[TO_REQUESTOR]);
 
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	if (!fr_channel_pop(&ch->end[TO_RESPONDER], &cd)) return false;
 
 	fr_assert(cd->live.sequence > responder->ack);
 	fr_assert(cd->live.sequence >= responder->sequence); /* must have more requests than replies */
@@ -563,51 +577,22 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	while (fr_channel_recv_request(ch));
 
 	/*
-	 *	No packets outstanding, we HAVE to signal the requestor
-	 *	thread.
+	 *	The requestor is still servicing its queue, and will
+	 *	pick up this reply without a signal.
 	 */
-	if (responder->stats.outstanding == 0) {
-		(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
+	if (!fr_channel_must_signal(responder)) {
+		MPRINT("\tRESPONDER SKIPS signal num_outstanding %"PRIu64"\n", responder->stats.outstanding);
 		return 0;
 	}
 
-	MPRINT("\twhen - last_read_other = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_read_other, when - responder->stats.last_read_other);
-	MPRINT("\twhen - last signal = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_sent_signal, when - responder->stats.last_sent_signal);
-	MPRINT("\tsequence - ack = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", responder->sequence, responder->their_view_of_my_sequence, responder->sequence - responder->their_view_of_my_sequence);
-
-#ifdef __APPLE__
 	/*
-	 *	If we've sent them a signal since the last ACK, they
-	 *	will receive it, and process the packets.  So we don't
-	 *	need to signal them again.
-	 *
-	 *	But... this doesn't appear to work on the Linux
-	 *	libkqueue implementation.
+	 *	As with requests, if the signal can't be sent, make
+	 *	sure that the next reply tries again.
 	 */
-	if (responder->sequence_at_last_signal > responder->their_view_of_my_sequence) return 0;
-#endif
-
-	/*
-	 *	If we've received a new packet in the last while, OR
-	 *	we've sent a signal in the last while, then we don't
-	 *	need to send a new signal.  But we DO send a signal if
-	 *	we haven't seen an ACK for a few packets.
-	 *
-	 *	FIXME: make these limits configurable, or include
-	 *	predictions about packet processing time?
-	 */
-	fr_assert(responder->their_view_of_my_sequence <= responder->sequence);
-#if 0
-	if (((responder->sequence - their_view_of_my_sequence) <= 1000) &&
-	    ((when - responder->stats.last_read_other < SIGNAL_INTERVAL) ||
-	     ((when - responder->stats.last_sent_signal) < SIGNAL_INTERVAL))) {
-		MPRINT("\tRESPONDER SKIPS signal\n");
-		return 0;
-	}
-#endif
-
 	MPRINT("\tRESPONDER SIGNALS num_outstanding %"PRIu64"\n", responder->stats.outstanding);
-	(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR);
+	if (fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR) < 0) {
+		atomic_store(&responder->must_signal, true);
+	}
 	return 0;
 }
 
@@ -627,48 +612,14 @@ int fr_channel_null_reply(fr_channel_t *ch)
 
 	responder = &(ch->end[TO_REQUESTOR]);
 
+	fr_assert(responder->stats.outstanding > 0);
+	responder->stats.outstanding--;
 	responder->sequence++;
 	return 0;
 }
 
 
 
-/** Signal a channel that the responder is sleeping
- *
- * This function should be called from the responders idle loop.
- * i.e. only when it has nothing else to do.
- *
- * @param[in] ch	the channel to signal we're no longer listening on.
- * @return
- *	- <0 on error
- *	- 0 on success
- */
-int fr_channel_responder_sleeping(fr_channel_t *ch)
-{
-	fr_channel_end_t *responder;
-	fr_channel_control_t cc;
-
-	responder = &(ch->end[TO_REQUESTOR]);
-
-	/*
-	 *	We don't have any outstanding requests to process for
-	 *	this channel, don't signal the network thread that
-	 *	we're sleeping.  It already knows.
-	 */
-	if (responder->stats.outstanding == 0) return 0;
-
-	responder->stats.signals++;
-
-	cc.signal = FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING;
-	cc.ack = responder->ack;
-	cc.ch = ch;
-
-	MPRINT("\tRESPONDER SLEEPING num_outstanding %"PRIu64", packets in %"PRIu64", packets out %"PRIu64"\n", responder->stats.outstanding,
-	       ch->end[TO_RESPONDER].stats.packets, responder->stats.packets);
-	return fr_control_message_send(responder->control, responder->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
-}
-
-
 /** Service a control-plane message
  *
  * @param[in] when		The current time.
@@ -682,25 +633,16 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
  *	- FR_CHANNEL_OPEN when a channel has been opened and sent to us
  *	- FR_CHANNEL_CLOSE when a channel should be closed
  */
-fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size)
+fr_channel_event_t fr_channel_service_message(UNUSED fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size)
 {
-	int rcode;
-#if ENABLE_SKIPS
-	uint64_t ack;
-#endif
 	fr_channel_control_t cc;
 	fr_channel_signal_t cs;
-	fr_channel_event_t ce = FR_CHANNEL_ERROR;
-	fr_channel_end_t *requestor;
 	fr_channel_t *ch;
 
 	fr_assert(data_size == sizeof(cc));
 	memcpy(&cc, data, data_size);
 
 	cs = cc.signal;
-#if ENABLE_SKIPS
-	ack = cc.ack;
-#endif
 	*p_channel = ch = cc.ch;
 
 	switch (cs) {
@@ -716,59 +658,9 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	case FR_CHANNEL_SIGNAL_CLOSE:
 		MPRINT("channel got %d\n", cs);
 		return (fr_channel_event_t) cs;
-
-	/*
-	 *	Only sent by the responder.  Both of these
-	 *	situations are largely the same, except for
-	 *	return codes.
-	 */
-	case FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER:
-		MPRINT("channel got data_done_responder\n");
-		ce = FR_CHANNEL_DATA_READY_REQUESTOR;
-		ch->end[TO_RESPONDER].must_signal = true;
-		break;
-
-	case FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING:
-		MPRINT("channel got responder_sleeping\n");
-		ce = FR_CHANNEL_NOOP;
-		ch->end[TO_RESPONDER].must_signal = true;
-		break;
-	}
-
-	/*
-	 *	Compare their ACK to the last sequence we
-	 *	sent.  If it's different, we signal the responder
-	 *	to wake up.
-	 */
-	requestor = &ch->end[TO_RESPONDER];
-#if ENABLE_SKIPS
-	if (!requestor->must_signal && (ack == requestor->sequence)) {
-		MPRINT("REQUESTOR SKIPS signal AFTER CE %d num_outstanding %"PRIu64"\n", cs, requestor->stats.outstanding);
-		MPRINT("REQUESTOR has ack %"PRIu64", my seq %"PRIu64" my_view %"PRIu64"\n", ack, requestor->sequence, requestor->their_view_of_my_sequence);
-		return ce;
 	}
 
-	/*
-	 *	The responder is sleeping or done.  There are more
-	 *	packets available, so we signal it to wake up again.
-	 */
-	fr_assert(ack <= requestor->sequence);
-#endif
-
-	/*
-	 *	We're signaling it again...
-	 */
-	requestor->stats.resignals++;
-
-	/*
-	 *	The responder hasn't seen our last few packets.  Signal
-	 *	that there is data ready.
-	 */
-	MPRINT("REQUESTOR SIGNALS AFTER CE %d\n", cs);
-	rcode = fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
-	if (rcode < 0) return FR_CHANNEL_ERROR;
-
-	return ce;
+	return FR_CHANNEL_ERROR;
 }
 
 
@@ -960,11 +852,27 @@ int fr_channel_signal_open(fr_channel_t *ch)
 	return fr_control_message_send(ch->end[TO_RESPONDER].control, ch->end[TO_RESPONDER].rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Copy the statistics for both ends of a channel
+ *
+ * Each end updates its own statistics without locks, so when this
+ * is called from another thread, the values may be slightly out of
+ * date.
+ *
+ * @param[in] ch		the channel.
+ * @param[out] requestor	statistics for the requestor, may be NULL.
+ * @param[out] responder	statistics for the responder, may be NULL.
+ */
+void fr_channel_stats(fr_channel_t const *ch, fr_channel_stats_t *requestor, fr_channel_stats_t *responder)
+{
+	if (requestor) *requestor = ch->end[TO_RESPONDER].stats;
+	if (responder) *responder = ch->end[TO_REQUESTOR].stats;
+}
+
 void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line)
 {
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
-	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.skipped);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -975,6 +883,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 
 	fr_log(log, L_INFO, file, line, "responder\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64"\n", ch->end[TO_REQUESTOR].stats.signals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.skipped);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.packets);
 	fr_log(log, L_INFO, file, line, "\tmessage interval (RTT) = %" PRIu64 "\n", fr_time_delta_unwrap(ch->end[TO_REQUESTOR].stats.message_interval));
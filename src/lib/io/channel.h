@@ -81,7 +81,7 @@ typedef enum fr_channel_event_t {
 typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
-	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		skipped;	//!< Number of signals skipped, as the other end was busy.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -171,8 +171,6 @@ typedef void (*fr_channel_recv_callback_t)(void *ctx, fr_channel_t *ch, fr_chann
 int	fr_channel_set_recv_reply(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 
-int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
-
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
 fr_channel_event_t	fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
 
@@ -189,6 +187,8 @@ void	fr_channel_requestor_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull)
 void	*fr_channel_requestor_uctx_get(fr_channel_t *ch) CC_HINT(nonnull);
 
 
+void	fr_channel_stats(fr_channel_t const *ch, fr_channel_stats_t *requestor, fr_channel_stats_t *responder) CC_HINT(nonnull(1));
+
 void	fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line);
 
 #ifdef __cplusplus
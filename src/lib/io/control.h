@@ -25,7 +25,7 @@
  */
 RCSIDH(control_h, "$Id$")
 
-#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/event.h>
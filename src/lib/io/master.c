@@ -31,6 +31,11 @@
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/syserror.h>
 
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#  include <linux/filter.h>
+#  define HAVE_REUSEPORT_CBPF
+#endif
+
 typedef struct {
 	fr_event_list_t			*el;				//!< event list, for the master socket.
 	fr_network_t			*nr;				//!< network for the master socket
@@ -1397,8 +1402,8 @@ do_read:
 			/*
 			 *	Look up the allowed networks.
 			 */
-			network = fr_trie_lookup_by_key(inst->networks, &address.socket.inet.src_ipaddr.addr,
-						 address.socket.inet.src_ipaddr.prefix);
+			network = fr_trie_frozen_lookup_by_key(inst->networks_frozen, &address.socket.inet.src_ipaddr.addr,
+							       address.socket.inet.src_ipaddr.prefix);
 			if (!network) goto ignore;
 
 			/*
@@ -2507,6 +2512,38 @@ reread:
 	return buffer_len;
 }
 
+/** Return how many packets the child has buffered.
+ *
+ */
+static size_t mod_read_pending(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->read_pending) return 0;
+
+	return inst->app_io->read_pending(child);
+}
+
+/** Flush any replies the child has queued.
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
 /** Close the socket.
  *
  */
@@ -2588,6 +2625,18 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 		inst->app_io->network_get(inst->app_io_instance, &inst->ipproto, &inst->dynamic_clients, &inst->networks);
 	}
 
+	/*
+	 *	The networks don't change after this, so we can
+	 *	freeze them, which makes the lookups faster.
+	 */
+	if (inst->networks) {
+		inst->networks_frozen = fr_trie_freeze(inst->app_io_instance, UNCONST(fr_trie_t *, inst->networks));
+		if (!inst->networks_frozen) {
+			cf_log_err(inst->app_io_conf, "Failed freezing networks for proto_%s", inst->app_io->name);
+			return -1;
+		}
+	}
+
 	/*
 	 *	The caller determines if we have dynamic clients.
 	 */
@@ -2617,6 +2666,24 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 		return -1;
 	}
 
+	/*
+	 *	Sharding relies on SO_REUSEPORT distributing
+	 *	datagrams across sockets.  That doesn't work for
+	 *	connected sockets, or for non-socket transports.
+	 */
+	if (inst->sharded && (inst->ipproto != IPPROTO_UDP)) {
+		cf_log_err(cs, "'sharded' can only be used with UDP transports");
+		return -1;
+	}
+
+#ifndef HAVE_REUSEPORT_CBPF
+	if (inst->shard_by_source) {
+		cf_log_warn(cs, "'shard_by_source' is not supported on this platform - "
+			    "packets will be distributed by the kernel");
+		inst->shard_by_source = false;
+	}
+#endif
+
 	return 0;
 }
 
@@ -2878,25 +2945,74 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+#ifdef HAVE_REUSEPORT_CBPF
+/** Steer packets to shards by source IP address
+ *
+ *  The default SO_REUSEPORT hash includes the source port, so a NAS
+ *  which changes source ports would have its packets spread across
+ *  all of the shards.  We instead hash only the source IP, so that
+ *  each NAS stays on one shard, and all of its packets are
+ *  deduplicated by the same network thread.
+ *
+ *  The program is attached to the reuseport group, so it only has to
+ *  be set on one socket.  The return value is an index into the
+ *  group, which is the order in which the shards were opened.
+ *
+ * @param[in] sockfd		of the first shard.
+ * @param[in] num_shards	the number of sockets in the group.
+ * @return
+ *	- 0 on success.
+ *	- <0 on error.
+ */
+static int master_io_shard_steer(int sockfd, unsigned int num_shards)
 {
-	fr_listen_t	*li, *child;
-	fr_io_thread_t	*thread;
-
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->thread_inst_size) {
-		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),		/* A = IP version */
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x40, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),	/* A = IPv4 source address */
+		BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),	/* A = low 32 bits of IPv6 source address */
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),				/* A ^= A >> 16 */
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_shards),		/* A %= num_shards */
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = NUM_ELEMENTS(code),
+		.filter = code,
+	};
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching shard filter: %s", fr_syserror(errno));
 		return -1;
 	}
 
+	return 0;
+}
+#endif
+
+/** Open one socket of a listener, and add it to the scheduler
+ *
+ * @param[in] ctx			to allocate the listener in.
+ * @param[in] inst			of the master IO handler.
+ * @param[in] sc			to add the listener to.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] shard			number of this socket.
+ * @param[in] num_shards		total number of sockets being opened.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int master_io_listen_shard(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+				  size_t default_message_size, size_t num_messages,
+				  unsigned int shard, unsigned int num_shards)
+{
+	fr_listen_t	*li, *child;
+	fr_io_thread_t	*thread;
+
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -3011,9 +3127,11 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->name = child->name;
 
 	/*
-	 *	Record which socket we opened.
+	 *	Record which socket we opened.  The other shards
+	 *	share the same address, and are opened with
+	 *	SO_REUSEPORT.
 	 */
-	if (child->app_io_addr) {
+	if (child->app_io_addr && (shard == 0)) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -3030,15 +3148,61 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 		(void) listen_record(child);
 	}
 
+#ifdef HAVE_REUSEPORT_CBPF
+	if (inst->shard_by_source && (num_shards > 1) && (shard == 0) &&
+	    (master_io_shard_steer(li->fd, num_shards) < 0)) {
+		PERROR("Failed opening %s", li->name);
+		talloc_free(li);
+		return -1;
+	}
+#endif
+
 	/*
 	 *	Add the socket to the scheduler, where it might end up
-	 *	in a different thread.
+	 *	in a different thread.  Each shard goes to a different
+	 *	network thread.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
+	if (!fr_schedule_listen_add_shard(sc, li, shard)) {
 		talloc_free(li);
 		return -1;
 	}
 
+	if (num_shards > 1) DEBUG2("Opened shard %u/%u of %s", shard + 1, num_shards, li->name);
+
+	return 0;
+}
+
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	unsigned int	i, num_shards;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->thread_inst_size) {
+		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+		return -1;
+	}
+
+	/*
+	 *	Open one socket per shard.  Each one gets its own
+	 *	fr_io_thread_t, and therefore its own clients and
+	 *	duplicate detection.  They never share state, so
+	 *	the network threads don't need to lock anything.
+	 */
+	num_shards = inst->sharded ? fr_schedule_num_networks(sc) : 1;
+
+	for (i = 0; i < num_shards; i++) {
+		if (master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages,
+					   i, num_shards) < 0) return -1;
+	}
+
 	return 0;
 }
 
@@ -3055,6 +3219,8 @@ fr_app_io_t fr_master_app_io = {
 
 	.read			= mod_read,
 	.write			= mod_write,
+	.read_pending		= mod_read_pending,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
 
 	.open			= mod_open,
@@ -88,6 +88,9 @@ typedef struct {
 	fr_time_delta_t			nak_lifetime;			//!< lifetime of NAKed clients
 	fr_time_delta_t			check_interval;			//!< polling for closed sockets
 
+	bool				sharded;			//!< open one SO_REUSEPORT socket per network thread.
+	bool				shard_by_source;		//!< steer packets to shards by source address.
+
 	bool				dynamic_clients;		//!< do we have dynamic clients.
 
 	CONF_SECTION			*server_cs;			//!< server CS for this listener
@@ -108,6 +111,7 @@ typedef struct {
 	char const			*transport;			//!< transport, typically name of IP proto
 
 	fr_trie_t const			*networks;     			//!< trie of allowed networks
+	fr_trie_frozen_t const		*networks_frozen;		//!< read-only copy of networks, for lookups.
 } fr_io_instance_t;
 
 extern fr_app_io_t fr_master_app_io;
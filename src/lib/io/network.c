@@ -82,6 +82,8 @@ typedef struct {
 
 	bool			dead;			//!< is it dead?
 	bool			blocked;		//!< is it blocked?
+	bool			read_external;		//!< the transport calls fr_network_listen_read() itself,
+							///< so we don't watch for the socket being readable.
 
 	size_t			outstanding;		//!< number of outstanding packets sent to the worker
 	fr_listen_t		*listen;		//!< I/O ctx and functions.
@@ -93,6 +95,7 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		write_entry;		//!< entry in the list of sockets with replies to write
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -144,6 +147,16 @@ struct fr_network_s {
 
 	fr_network_config_t	config;			//!< configuration
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+
+#ifdef HAVE_LINUX_IO_URING_H
+	fr_uring_t		*uring;			//!< for transports which can do packet I/O with io_uring.
+#endif
+
+	uint64_t		messages_used;		//!< in the message sets of all sockets, as of stats_published.
+	int			num_channel_stats;	//!< number of entries in channel_stats.
+	fr_channel_stats_t	channel_stats[MAX_WORKERS];	//!< requestor side of each worker's channel,
+								///< as of stats_published.
+	fr_time_t		stats_published;	//!< when the values above were last updated.
 };
 
 static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
@@ -306,6 +319,49 @@ void fr_network_listen_read(fr_network_t *nr, fr_listen_t *li)
 }
 
 
+/** Control whether a listener is read when its socket becomes readable
+ *
+ * Transports which find out about packets some other way, e.g. from an
+ * io_uring, disable this, and call fr_network_listen_read() themselves.
+ * Otherwise every packet would also wake up the event loop for a read
+ * which finds nothing.
+ *
+ * @param nr		the network
+ * @param li		the listener
+ * @param enable	whether to read the listener when its socket is readable.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the listener isn't in this network.
+ */
+int fr_network_listen_read_events(fr_network_t *nr, fr_listen_t *li, bool enable)
+{
+	static fr_event_update_t const pause_read[] = {
+		FR_EVENT_SUSPEND(fr_event_io_func_t, read),
+		{ 0 }
+	};
+	static fr_event_update_t const resume_read[] = {
+		FR_EVENT_RESUME(fr_event_io_func_t, read),
+		{ 0 }
+	};
+	fr_network_socket_t *s;
+
+	s = fr_rb_find(nr->sockets, &(fr_network_socket_t){ .listen = li });
+	if (!s) return -1;
+
+	if (s->read_external != enable) return 0;
+
+	s->read_external = !enable;
+
+	/*
+	 *	Suspending and resuming the network changes the
+	 *	filter for us.
+	 */
+	if (nr->suspended) return 0;
+
+	return fr_event_filter_update(nr->el, s->listen->fd, FR_EVENT_FILTER_IO, enable ? resume_read : pause_read);
+}
+
+
 /** Inject a packet for a listener to write
  *
  * @param nr		the network
@@ -401,8 +457,18 @@ static void fr_network_suspend(fr_network_t *nr)
 	for (socket = fr_rb_iter_init_inorder(&iter, nr->sockets);
 	     socket;
 	     socket = fr_rb_iter_next_inorder(&iter)) {
+		if (socket->read_external) continue;
+
 		fr_event_filter_update(socket->nr->el, socket->listen->fd, FR_EVENT_FILTER_IO, pause_read);
 	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/*
+	 *	Sockets read by the ring are left alone above, so
+	 *	stop the ring from taking datagrams off of them.
+	 */
+	if (nr->uring) fr_uring_recv_suspend(nr->uring);
+#endif
 	nr->suspended = true;
 }
 
@@ -420,8 +486,13 @@ static void fr_network_unsuspend(fr_network_t *nr)
 	for (socket = fr_rb_iter_init_inorder(&iter, nr->sockets);
 	     socket;
 	     socket = fr_rb_iter_next_inorder(&iter)) {
+		if (socket->read_external) continue;
+
 		fr_event_filter_update(socket->nr->el, socket->listen->fd, FR_EVENT_FILTER_IO, resume_read);
 	}
+#ifdef HAVE_LINUX_IO_URING_H
+	if (nr->uring) fr_uring_recv_resume(nr->uring);
+#endif
 	nr->suspended = false;
 }
 
@@ -543,6 +614,24 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 	}
 }
 
+/** Check if a worker can accept another packet
+ *
+ * @param nr the network
+ * @param worker to check
+ * @return
+ *	- true if the worker is available.
+ *	- false if the worker is blocked, or has too many outstanding packets.
+ */
+static inline bool fr_network_worker_available(fr_network_t *nr, fr_network_worker_t *worker)
+{
+	if (worker->blocked) return false;
+
+	if (nr->config.max_outstanding &&
+	    ((worker->stats.in - worker->stats.out) >= nr->config.max_outstanding)) return false;
+
+	return true;
+}
+
 /** Send a message on the "best" channel.
  *
  * @param nr the network
@@ -551,9 +640,19 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 {
 	fr_network_worker_t *worker;
+	fr_listen_t *li = cd->listen;
+	uint32_t affinity = 0;
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
+	/*
+	 *	Packets which are part of a conversation go to the
+	 *	same worker, so long as that worker is available.
+	 */
+	if (li->app && li->app->affinity) {
+		affinity = li->app->affinity(li->app_instance, cd->m.data, cd->m.data_size);
+	}
+
 retry:
 	if (nr->num_workers == 1) {
 		worker = nr->workers[0];
@@ -565,6 +664,10 @@ retry:
 			return -1;
 		}
 
+	} else if (affinity &&
+		   fr_network_worker_available(nr, nr->workers[affinity % nr->num_workers])) {
+		worker = nr->workers[affinity % nr->num_workers];
+
 	} else if (nr->num_blocked == 0) {
 		uint32_t one, two;
 
@@ -685,6 +788,16 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 	 */
 }
 
+/** Check if the transport has packets buffered which it hasn't returned to us
+ *
+ */
+static inline CC_HINT(always_inline) size_t fr_network_read_pending(fr_network_socket_t *s)
+{
+	if (!s->listen->app_io->read_pending) return 0;
+
+	return s->listen->app_io->read_pending(s->listen);
+}
+
 /** Read a packet from the network.
  *
  * @param[in] el	the event list.
@@ -748,6 +861,13 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover, &cd->priority, &cd->request.is_dup);
 	if (data_size == 0) {
+		/*
+		 *	The packet was discarded, but there are
+		 *	more packets buffered by the transport.
+		 *	Re-use the same message for the next one.
+		 */
+		if (fr_network_read_pending(s)) goto next_message;
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -850,6 +970,25 @@ next_message:
 		num_messages++;
 		goto next_message;
 	}
+
+	/*
+	 *	The transport read multiple packets from the socket
+	 *	in one system call.  The socket may no longer be
+	 *	readable, so we have to drain those packets now.
+	 *
+	 *	This loop is bounded by the transport's batch size,
+	 *	so we don't need to check num_messages.
+	 */
+	if (fr_network_read_pending(s)) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		if (!cd) {
+			ERROR("Failed allocating message size %zd! - Closing socket",
+			      s->listen->default_message_size);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+		goto next_message;
+	}
 }
 
 
@@ -1029,6 +1168,17 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(s->waiting);
 	}
 
+	/*
+	 *	Transports which batch writes may have queued the
+	 *	packets instead of writing them.  Write them now.
+	 *
+	 *	UDP is unreliable, so failure here only means that
+	 *	some replies were lost.
+	 */
+	if (li->app_io->flush && (li->app_io->flush(li) < 0)) {
+		RATE_LIMIT_GLOBAL(PERROR, "Failed flushing replies to socket %s", s->listen->name);
+	}
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
 	 *	the write callback.
@@ -1338,10 +1488,43 @@ static int fr_network_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wak
  * @param now	the current time (mostly)
  * @param uctx	the fr_network_t
  */
-static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+static void fr_network_post_event(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
 {
 	fr_channel_data_t *cd;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
+	fr_network_socket_t *s;
+	fr_dlist_head_t writable;
+
+	fr_dlist_init(&writable, fr_network_socket_t, write_entry);
+
+	/*
+	 *	The message sets and the worker channels belong to
+	 *	this thread, and are added and freed without locks,
+	 *	so other threads can't look at them.  Once a second,
+	 *	publish copies of their statistics, for
+	 *	fr_network_stats() and fr_network_channel_stats().
+	 */
+	if (fr_time_gteq(now, fr_time_add(nr->stats_published, fr_time_delta_from_sec(1)))) {
+		fr_rb_iter_inorder_t	iter;
+		uint64_t		used = 0;
+		int			i, num = 0;
+
+		for (s = fr_rb_iter_init_inorder(&iter, nr->sockets);
+		     s != NULL;
+		     s = fr_rb_iter_next_inorder(&iter)) {
+			used += fr_message_set_messages_used(s->ms);
+		}
+
+		for (i = 0; i < nr->max_workers; i++) {
+			if (!nr->workers[i]) continue;
+
+			fr_channel_stats(nr->workers[i]->channel, &nr->channel_stats[num++], NULL);
+		}
+
+		nr->messages_used = used;
+		nr->num_channel_stats = num;
+		nr->stats_published = now;
+	}
 
 	/*
 	 *	Pull the replies off of our global heap, and try to
@@ -1349,7 +1532,6 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 	 */
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1396,7 +1578,7 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		}
 
 		/*
-		 *	No pending message, let's try writing it.
+		 *	No pending message, queue it for writing.
 		 *
 		 *	If there is a pending message, then we're
 		 *	waiting for IO write to become ready.
@@ -1404,9 +1586,21 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		if (!s->pending) {
 			fr_assert(!s->blocked);
 			(void) fr_heap_insert(s->waiting, cd);
-			fr_network_write(nr->el, s->listen->fd, 0, s);
+			if (!fr_dlist_entry_in_list(&s->write_entry)) fr_dlist_insert_tail(&writable, s);
 		}
 	}
+
+	/*
+	 *	Write all of the replies for a socket in one pass.
+	 *	This lets transports which batch writes send them
+	 *	with as few system calls as possible.
+	 *
+	 *	The socket may be freed by fr_network_write(), so it
+	 *	has to be removed from the list first.
+	 */
+	while ((s = fr_dlist_pop_head(&writable)) != NULL) {
+		fr_network_write(nr->el, s->listen->fd, 0, s);
+	}
 }
 
 /** Stop a network thread in an orderly way
@@ -1710,9 +1904,39 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+#ifdef HAVE_LINUX_IO_URING_H
+	/*
+	 *	The ring submits after the network's post-event
+	 *	callback, so replies written there go out on the same
+	 *	pass of the event loop.  If the kernel doesn't support
+	 *	io_uring, the transports use their normal read and
+	 *	write paths.
+	 */
+	if (nr->config.io_uring) {
+		nr->uring = fr_uring_alloc(nr, nr->el, 256);
+		if (!nr->uring) PWARN("Not using io_uring");
+	}
+#endif
+
 	return nr;
 }
 
+#ifdef HAVE_LINUX_IO_URING_H
+/** Return the io_uring for a network
+ *
+ * Transports can use this from their event_list_set() callback.
+ *
+ * @param[in] nr	the network.
+ * @return
+ *	- The ring.
+ *	- NULL if io_uring is disabled, or unavailable.
+ */
+fr_uring_t *fr_network_uring(fr_network_t const *nr)
+{
+	return nr->uring;
+}
+#endif
+
 int fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats)
 {
 	if (num < 0) return -1;
@@ -1723,10 +1947,33 @@ int fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats)
 	if (num >= 3) stats[2] = nr->stats.dup;
 	if (num >= 4) stats[3] = nr->stats.dropped;
 	if (num >= 5) stats[4] = nr->num_workers;
+	if (num >= 6) stats[5] = nr->messages_used;
+
+	if (num <= 6) return num;
+
+	return 6;
+}
+
+/** Return the channel statistics for each worker used by a network
+ *
+ * May be called from other threads.  The statistics are copies,
+ * which the network thread publishes about once a second, so they
+ * may be slightly out of date.
+ *
+ * @param[in] nr	the network.
+ * @param[in] num	the number of entries in stats.
+ * @param[out] stats	requestor side statistics for each worker's channel.
+ * @return the number of entries filled in.
+ */
+int fr_network_channel_stats(fr_network_t const *nr, int num, fr_channel_stats_t *stats)
+{
+	int i;
+
+	if (num > nr->num_channel_stats) num = nr->num_channel_stats;
 
-	if (num <= 5) return num;
+	for (i = 0; i < num; i++) stats[i] = nr->channel_stats[i];
 
-	return 5;
+	return num;
 }
 
 void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
@@ -37,6 +37,7 @@ typedef struct fr_network_s fr_network_t;
 
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/uring.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,6 +45,7 @@ extern "C" {
 
 typedef struct {
 	uint32_t	max_outstanding;
+	bool		io_uring;		//!< Create an io_uring for transports to do packet I/O with.
 } fr_network_config_t;
 
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
@@ -56,6 +58,8 @@ int		fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnul
 
 void		fr_network_listen_read(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
+int		fr_network_listen_read_events(fr_network_t *nr, fr_listen_t *li, bool enable) CC_HINT(nonnull);
+
 void		fr_network_listen_write(fr_network_t *nr, fr_listen_t *li, uint8_t const *packet, size_t packet_len,
 					void *packet_ctx, fr_time_t request_time) CC_HINT(nonnull);
 
@@ -73,8 +77,14 @@ void		fr_network(fr_network_t *nr) CC_HINT(nonnull);
 
 int		fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats) CC_HINT(nonnull);
 
+int		fr_network_channel_stats(fr_network_t const *nr, int num, fr_channel_stats_t *stats) CC_HINT(nonnull);
+
 void		fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log) CC_HINT(nonnull);
 
+#ifdef HAVE_LINUX_IO_URING_H
+fr_uring_t	*fr_network_uring(fr_network_t const *nr) CC_HINT(nonnull);
+#endif
+
 extern fr_cmd_table_t cmd_network_table[];
 
 #ifdef __cplusplus
@@ -26,7 +26,7 @@
 RCSIDH(queue_h, "$Id$")
 
 #include <stdbool.h>
-#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/util/talloc.h>
 
 #ifdef __cplusplus
@@ -36,6 +36,16 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+/*
+ *	NUMA topology is read from sysfs, and threads are pinned
+ *	with the (Linux specific) CPU affinity API.
+ */
+#if defined(__linux__) && defined(CPU_SET)
+#  define HAVE_SCHEDULE_NUMA
+#  include <ctype.h>
+#  define SCHEDULE_NUMA_MAX_NODES	(64)
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -45,6 +55,12 @@ RCSID("$Id$")
 
 #define SEMAPHORE_LOCKED	(0)
 
+/*
+ *	Length of a tick, for event lists which keep their
+ *	timers in a timer wheel.
+ */
+#define SCHEDULE_TIMER_WHEEL_RESOLUTION	fr_time_delta_from_msec(1)
+
 #ifdef __APPLE__
 #include <mach/task.h>
 #include <mach/mach_init.h>
@@ -75,6 +91,19 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
 
+/** A NUMA node, and the CPUs which threads pinned to it may run on
+ *
+ */
+typedef struct {
+	unsigned int	id;			//!< the kernel's ID for this node
+	char const	*cpulist;		//!< CPUs on this node, as printed by the kernel
+#ifdef HAVE_SCHEDULE_NUMA
+	cpu_set_t	cpus;			//!< CPUs on this node which we're allowed to use
+#endif
+
+	fr_schedule_t	*sc;			//!< the scheduler we are running under
+} fr_schedule_numa_node_t;
+
 /** Scheduler specific information for worker threads
  *
  * Wraps a fr_worker_t, tracking additional information that
@@ -92,6 +121,7 @@ typedef struct {
 	fr_dlist_t	entry;			//!< our entry into the linked list of workers
 
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
+	fr_schedule_numa_node_t *node;		//!< the NUMA node we are pinned to, or NULL
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
@@ -111,6 +141,7 @@ typedef struct {
 	fr_dlist_t	entry;			//!< our entry into the linked list of networks
 
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
+	fr_schedule_numa_node_t *node;		//!< the NUMA node we are pinned to, or NULL
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_network_t	*nr;			//!< the receive data structure
@@ -146,6 +177,9 @@ struct fr_schedule_s {
 
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	fr_schedule_numa_node_t	*nodes;		//!< NUMA nodes which threads are pinned to
+	unsigned int	num_nodes;		//!< number of NUMA nodes in use
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +193,150 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+#ifdef HAVE_SCHEDULE_NUMA
+/** Parse a CPU list from sysfs, e.g. "0-7,16-23"
+ *
+ * @param[out] cpus	the CPUs in the list.
+ * @param[in] p		the list to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on parse error.
+ */
+static int fr_schedule_numa_cpulist_parse(cpu_set_t *cpus, char const *p)
+{
+	CPU_ZERO(cpus);
+
+	while (*p) {
+		unsigned long	first, last;
+		char		*end;
+
+		first = last = strtoul(p, &end, 10);
+		if (end == p) return -1;
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if ((end == p) || (last < first)) return -1;
+			p = end;
+		}
+
+		while ((first <= last) && (first < CPU_SETSIZE)) CPU_SET(first++, cpus);
+
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+
+		if (*p) return -1;
+	}
+
+	return 0;
+}
+
+/** Discover the NUMA nodes which we can run threads on
+ *
+ *  Nodes without CPUs (or where all of the CPUs are outside of our
+ *  affinity mask) are skipped.
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] max_nodes	the maximum number of nodes to use.
+ * @return
+ *	- <0 on error.
+ *	- the number of nodes found.
+ */
+static int fr_schedule_numa_discover(fr_schedule_t *sc, unsigned int max_nodes)
+{
+	cpu_set_t	allowed;
+	unsigned int	i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		fr_strerror_printf("Failed getting CPU affinity: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(sc->nodes = talloc_zero_array(sc, fr_schedule_numa_node_t, max_nodes));
+
+	for (i = 0; (i < SCHEDULE_NUMA_MAX_NODES) && (sc->num_nodes < max_nodes); i++) {
+		fr_schedule_numa_node_t	*node = &sc->nodes[sc->num_nodes];
+		char			path[64], buffer[1024];
+		size_t			len;
+		FILE			*fp;
+
+		/*
+		 *	Node IDs may be sparse.
+		 */
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", i);
+		fp = fopen(path, "r");
+		if (!fp) continue;
+
+		if (!fgets(buffer, sizeof(buffer), fp)) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+
+		len = strlen(buffer);
+		while ((len > 0) && isspace((uint8_t) buffer[len - 1])) buffer[--len] = '\0';
+
+		if (fr_schedule_numa_cpulist_parse(&node->cpus, buffer) < 0) {
+			WARN("Ignoring NUMA node %u - Invalid CPU list \"%s\"", i, buffer);
+			continue;
+		}
+
+		CPU_AND(&node->cpus, &node->cpus, &allowed);
+		if (CPU_COUNT(&node->cpus) == 0) continue;
+
+		node->id = i;
+		node->cpulist = talloc_strdup(sc->nodes, buffer);
+		node->sc = sc;
+		sc->num_nodes++;
+	}
+
+	if (!sc->num_nodes) {
+		fr_strerror_const("No NUMA nodes found");
+		return -1;
+	}
+
+	return sc->num_nodes;
+}
+
+/** Pin the current thread to the CPUs of a NUMA node
+ *
+ *  The kernel allocates memory from the node of the CPU which first
+ *  touches it.  So once a thread is pinned, its event list, message
+ *  sets and ring buffers all come from local memory.
+ *
+ * @param[in] node	to pin the thread to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_schedule_numa_pin(fr_schedule_numa_node_t const *node)
+{
+	int ret;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(node->cpus), &node->cpus);
+	if (ret != 0) {
+		fr_strerror_printf("Failed setting CPU affinity: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+static int fr_schedule_numa_discover(UNUSED fr_schedule_t *sc, UNUSED unsigned int max_nodes)
+{
+	fr_strerror_const("NUMA pinning is not supported on this platform");
+	return -1;
+}
+
+static int fr_schedule_numa_pin(UNUSED fr_schedule_numa_node_t const *node)
+{
+	return 0;
+}
+#endif
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -177,6 +355,14 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
 
+	/*
+	 *	Pin the thread before allocating anything, so that
+	 *	all of our memory comes from the local node.
+	 */
+	if (sw->node && (fr_schedule_numa_pin(sw->node) < 0)) {
+		PWARN("%s - Failed pinning to NUMA node %u", worker_name, sw->node->id);
+	}
+
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", worker_name);
@@ -191,6 +377,11 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
+	if (sc->config->timer_wheel && (fr_event_list_timer_wheel(sw->el, SCHEDULE_TIMER_WHEEL_RESOLUTION) < 0)) {
+		PERROR("%s - Failed creating timer wheel", worker_name);
+		goto fail;
+	}
+
 
 	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, &sc->config->worker);
 	if (!sw->worker) {
@@ -219,11 +410,16 @@ static void *fr_schedule_worker_thread(void *arg)
 	sw->status = FR_CHILD_RUNNING;
 
 	/*
-	 *	Add this worker to all network threads.
+	 *	Add this worker to all network threads.  Or if we're
+	 *	pinned to a NUMA node, only to the network threads on
+	 *	the same node.  Every node in use has at least one
+	 *	network thread and one worker.
 	 */
 	for (sn = fr_dlist_head(&sc->networks);
 	       sn != NULL;
 	       sn = fr_dlist_next(&sc->networks, sn)) {
+		if (sn->node != sw->node) continue;
+
 		(void) fr_network_worker_add(sn->nr, sw->worker);
 	}
 
@@ -280,6 +476,73 @@ static void stats_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	(void) fr_event_timer_at(sn, el, &sn->ev, fr_time_add(now, sn->sc->config->stats_interval), stats_timer, sn);
 }
 
+static int cmd_stats_numa(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_schedule_numa_node_t const	*node = ctx;
+	fr_schedule_t const		*sc = node->sc;
+	fr_schedule_network_t		*sn;
+	fr_schedule_worker_t		*sw;
+	unsigned int			num_networks = 0, num_workers = 0;
+	uint64_t			network[4] = { 0 }, worker[4] = { 0 };
+	uint64_t			stats[4];
+	size_t				i;
+
+	for (sn = fr_dlist_head(&sc->networks);
+	     sn != NULL;
+	     sn = fr_dlist_next(&sc->networks, sn)) {
+		if (sn->node != node) continue;
+
+		if (fr_network_stats(sn->nr, NUM_ELEMENTS(stats), stats) != NUM_ELEMENTS(stats)) continue;
+		for (i = 0; i < NUM_ELEMENTS(stats); i++) network[i] += stats[i];
+		num_networks++;
+	}
+
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = fr_dlist_next(&sc->workers, sw)) {
+		if (sw->node != node) continue;
+
+		if (fr_worker_stats(sw->worker, NUM_ELEMENTS(stats), stats) != NUM_ELEMENTS(stats)) continue;
+		for (i = 0; i < NUM_ELEMENTS(stats); i++) worker[i] += stats[i];
+		num_workers++;
+	}
+
+	fprintf(fp, "node.id			%u\n", node->id);
+	fprintf(fp, "node.cpus		%s\n", node->cpulist);
+	fprintf(fp, "count.networks		%u\n", num_networks);
+	fprintf(fp, "count.workers		%u\n", num_workers);
+	fprintf(fp, "network.count.in	%" PRIu64 "\n", network[0]);
+	fprintf(fp, "network.count.out	%" PRIu64 "\n", network[1]);
+	fprintf(fp, "network.count.dup	%" PRIu64 "\n", network[2]);
+	fprintf(fp, "network.count.dropped	%" PRIu64 "\n", network[3]);
+	fprintf(fp, "worker.count.in		%" PRIu64 "\n", worker[0]);
+	fprintf(fp, "worker.count.out	%" PRIu64 "\n", worker[1]);
+	fprintf(fp, "worker.count.dup	%" PRIu64 "\n", worker[2]);
+	fprintf(fp, "worker.count.dropped	%" PRIu64 "\n", worker[3]);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_numa_table[] = {
+	{
+		.parent = "stats",
+		.name = "numa",
+		.help = "Statistics for NUMA nodes.",
+		.read_only = true
+	},
+
+	{
+		.parent = "stats numa",
+		.add_name = true,
+		.name = "self",
+		.func = cmd_stats_numa,
+		.help = "Show statistics for the threads pinned to a specific NUMA node.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 /** Initialize and run the network thread.
  *
  * @param[in] arg the fr_schedule_network_t
@@ -298,6 +561,10 @@ static void *fr_schedule_network_thread(void *arg)
 
 	INFO("%s - Starting", network_name);
 
+	if (sn->node && (fr_schedule_numa_pin(sn->node) < 0)) {
+		PWARN("%s - Failed pinning to NUMA node %u", network_name, sn->node->id);
+	}
+
 	sn->ctx = ctx = talloc_init("%s", network_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", network_name);
@@ -310,6 +577,11 @@ static void *fr_schedule_network_thread(void *arg)
 		goto fail;
 	}
 
+	if (sc->config->timer_wheel && (fr_event_list_timer_wheel(el, SCHEDULE_TIMER_WHEEL_RESOLUTION) < 0)) {
+		PERROR("%s - Failed creating timer wheel", network_name);
+		goto fail;
+	}
+
 	sn->nr = fr_network_create(ctx, el, network_name, sc->log, sc->lvl, &sc->config->network);
 	if (!sn->nr) {
 		PERROR("%s - Failed creating network", network_name);
@@ -514,6 +786,32 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		if (sc->config->max_workers > 64) sc->config->max_workers = 64;
 	}
 
+	/*
+	 *	Spread the networks and workers over the NUMA nodes.
+	 *	Each node needs at least one of each, so we use no
+	 *	more nodes than there are networks or workers.
+	 */
+	if (sc->config->numa) {
+		unsigned int max_nodes = sc->config->max_networks;
+
+		if (max_nodes > sc->config->max_workers) max_nodes = sc->config->max_workers;
+
+		if (fr_schedule_numa_discover(sc, max_nodes) < 0) {
+			PWARN("Not pinning threads to NUMA nodes");
+			TALLOC_FREE(sc->nodes);
+			sc->num_nodes = 0;
+
+		} else if (sc->num_nodes == 1) {
+			INFO("Not pinning threads to NUMA nodes - %s", (max_nodes == 1) ?
+			     "there is only one network thread" : "there is only one NUMA node");
+			TALLOC_FREE(sc->nodes);
+			sc->num_nodes = 0;
+
+		} else {
+			INFO("Pinning threads to %u NUMA nodes", sc->num_nodes);
+		}
+	}
+
 	/*
 	 *	Create the lists which hold the workers and networks.
 	 */
@@ -551,6 +849,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 		sn->id = i;
 		sn->sc = sc;
+		if (sc->num_nodes) sn->node = &sc->nodes[i % sc->num_nodes];
 		sn->status = FR_CHILD_INITIALIZING;
 		fr_dlist_insert_head(&sc->networks, sn);
 
@@ -610,6 +909,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 		sw->id = i;
 		sw->sc = sc;
+		if (sc->num_nodes) sw->node = &sc->nodes[i % sc->num_nodes];
 		sw->status = FR_CHILD_INITIALIZING;
 		fr_dlist_insert_head(&sc->workers, sw);
 
@@ -681,6 +981,16 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
+	for (i = 0; i < sc->num_nodes; i++) {
+		char buffer[32];
+
+		snprintf(buffer, sizeof(buffer), "%u", sc->nodes[i].id);
+		if (fr_command_register_hook(NULL, buffer, &sc->nodes[i], cmd_numa_table) < 0) {
+			PERROR("Failed adding NUMA commands");
+			goto st_fail;
+		}
+	}
+
 	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
 		     sc->config->max_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
 
@@ -843,6 +1153,98 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	return nr;
 }
 
+/** Return the number of network threads in a scheduler.
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads.
+ */
+unsigned int fr_schedule_num_networks(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
+/** Call functions for each network and worker in a scheduler
+ *
+ * The functions are called from the current thread, and should only
+ * read counters which the networks and workers publish for other
+ * threads, e.g. via fr_network_stats() and fr_worker_stats().
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] network	called for each network thread, may be NULL.
+ * @param[in] worker	called for each worker thread, may be NULL.
+ * @param[in] uctx	passed to the functions.
+ */
+void fr_schedule_walk(fr_schedule_t const *sc,
+		      fr_schedule_network_walk_t network, fr_schedule_worker_walk_t worker, void *uctx)
+{
+	fr_schedule_network_t	*sn;
+	fr_schedule_worker_t	*sw;
+
+	if (sc->el) {
+		if (network && sc->single_network) network(sc->single_network, 0, uctx);
+		if (worker && sc->single_worker) worker(sc->single_worker, 0, uctx);
+		return;
+	}
+
+	if (network) for (sn = fr_dlist_head(&sc->networks);
+			  sn != NULL;
+			  sn = fr_dlist_next(&sc->networks, sn)) {
+		if (sn->status != FR_CHILD_RUNNING) continue;
+
+		network(sn->nr, sn->id, uctx);
+	}
+
+	if (worker) for (sw = fr_dlist_head(&sc->workers);
+			 sw != NULL;
+			 sw = fr_dlist_next(&sc->workers, sw)) {
+		if (sw->status != FR_CHILD_RUNNING) continue;
+
+		worker(sw->worker, sw->id, uctx);
+	}
+}
+
+/** Add one shard of a fr_listen_t to a scheduler.
+ *
+ *  Sharded listeners open multiple sockets for the same address,
+ *  and each shard is given to a different network thread.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] li	the ctx and callbacks for the transport.
+ * @param[in] shard	the shard number.  Shards are assigned to
+ *			network threads in order, wrapping around if
+ *			there are more shards than network threads.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, unsigned int shard)
+{
+	fr_network_t *nr;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn;
+
+		shard %= fr_dlist_num_elements(&sc->networks);
+
+		for (sn = fr_dlist_head(&sc->networks);
+		     shard > 0;
+		     sn = fr_dlist_next(&sc->networks, sn), shard--) {
+			fr_assert(sn != NULL);
+		}
+		nr = sn->nr;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
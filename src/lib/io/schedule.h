@@ -60,6 +60,22 @@ typedef int (*fr_schedule_thread_instantiate_t)(TALLOC_CTX *ctx, fr_event_list_t
  */
 typedef void (*fr_schedule_thread_detach_t)(void *uctx);
 
+/** Called by #fr_schedule_walk for each network thread
+ *
+ * @param[in] nr	the network.
+ * @param[in] id	of the network thread.
+ * @param[in] uctx	passed to #fr_schedule_walk.
+ */
+typedef void (*fr_schedule_network_walk_t)(fr_network_t const *nr, unsigned int id, void *uctx);
+
+/** Called by #fr_schedule_walk for each worker thread
+ *
+ * @param[in] worker	the worker.
+ * @param[in] id	of the worker thread.
+ * @param[in] uctx	passed to #fr_schedule_walk.
+ */
+typedef void (*fr_schedule_worker_walk_t)(fr_worker_t const *worker, unsigned int id, void *uctx);
+
 typedef struct {
 	uint32_t	max_networks;		//!< number of network threads
 	uint32_t	max_workers;		//!< number of network threads
@@ -68,6 +84,10 @@ typedef struct {
 	fr_network_config_t network;		//!< configuration for each network;
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	bool		numa;			//!< pin networks and workers to NUMA nodes
+
+	bool		timer_wheel;		//!< keep network and worker timers in a timer wheel
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
@@ -80,7 +100,14 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 /* schedulers are async, so there's no fr_schedule_run() */
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
+unsigned int		fr_schedule_num_networks(fr_schedule_t const *sc) CC_HINT(nonnull);
+
+void			fr_schedule_walk(fr_schedule_t const *sc,
+					 fr_schedule_network_walk_t network, fr_schedule_worker_walk_t worker,
+					 void *uctx) CC_HINT(nonnull(1));
+
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, unsigned int shard) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
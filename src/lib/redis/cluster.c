@@ -136,6 +136,10 @@
  *   The data from '-MOVE' responses, is not used to alter the cluster map.  That is only done
  *   on successful remap.
  *
+ *   Async callers (see pipeline.c) never remap in the worker.  A '-MOVE' marks the map as
+ *   stale, and the next lookup wakes a dedicated remap thread.  Until the remap completes,
+ *   lookups use the old map, and any further '-MOVE' redirects are followed as normal.
+ *
  *
  * Processing '-TRYAGAIN'
  * ----------------------
@@ -262,6 +266,14 @@ struct fr_redis_cluster {
 	fr_redis_cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
 
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
+
+	pthread_t		remap_thread;		//!< Remaps the cluster for async callers, so that
+							//!< workers never block on 'cluster slots'.
+	pthread_cond_t		remap_wakeup;		//!< Signalled when remap_node is set, or on exit.
+	bool			remap_thread_running;	//!< Whether remap_thread has been started.
+	bool			remap_thread_stop;	//!< Tell remap_thread to exit.
+	uint8_t			remap_node;		//!< Node to issue 'cluster slots' to.  0 if there's
+							//!< no remap pending.
 };
 
 fr_table_num_sorted_t const fr_redis_cluster_rcodes_table[] = {
@@ -1650,6 +1662,186 @@ int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node)
 	return 0;
 }
 
+/** Remap the cluster whenever an async caller finds the map is stale
+ *
+ * Fetching and applying the map blocks on a pooled connection, so it's done
+ * here instead of in a worker.
+ *
+ * @param[in] uctx	the cluster to remap.
+ * @return NULL.
+ */
+static void *cluster_remap_thread(void *uctx)
+{
+	fr_redis_cluster_t	*cluster = talloc_get_type_abort(uctx, fr_redis_cluster_t);
+
+	pthread_mutex_lock(&cluster->mutex);
+	for (;;) {
+		fr_redis_cluster_node_t		*node;
+		fr_pool_t			*pool;
+		fr_redis_conn_t			*conn;
+		fr_redis_cluster_rcode_t	ret = FR_REDIS_CLUSTER_RCODE_NO_CONNECTION;
+
+		while (!cluster->remap_thread_stop && !cluster->remap_node) {
+			pthread_cond_wait(&cluster->remap_wakeup, &cluster->mutex);
+		}
+		if (cluster->remap_thread_stop) break;
+
+		node = &cluster->node[cluster->remap_node];
+		pool = node->is_active ? node->pool : NULL;
+		pthread_mutex_unlock(&cluster->mutex);
+
+		if (pool) {
+			conn = fr_pool_connection_get(pool, NULL);
+			if (conn) {
+				ret = fr_redis_cluster_remap(NULL, cluster, conn);
+				fr_pool_connection_release(pool, NULL, conn);
+			}
+		}
+
+		pthread_mutex_lock(&cluster->mutex);
+
+		/*
+		 *	Don't hammer the cluster if it's not
+		 *	answering.  remap_node stays set while
+		 *	we wait, so callers keep using the old
+		 *	map without signalling us again.
+		 */
+		if ((ret != FR_REDIS_CLUSTER_RCODE_SUCCESS) && (ret != FR_REDIS_CLUSTER_RCODE_IGNORED)) {
+			struct timespec ts;
+
+			WARN("%s - Cluster remap failed (%s), retrying in 1 second", cluster->log_prefix,
+			     fr_table_str_by_value(fr_redis_cluster_rcodes_table, ret, "<INVALID>"));
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			if (!cluster->remap_thread_stop) {
+				(void) pthread_cond_timedwait(&cluster->remap_wakeup, &cluster->mutex, &ts);
+			}
+		}
+		cluster->remap_node = 0;
+	}
+	pthread_mutex_unlock(&cluster->mutex);
+
+	return NULL;
+}
+
+/** Ask the remap thread to remap the cluster, starting it if needed
+ *
+ * @note Must be called with the cluster mutex held.
+ *
+ * @param[in] cluster	to remap.
+ * @param[in] node	to issue 'cluster slots' to.
+ */
+static void cluster_remap_signal(fr_redis_cluster_t *cluster, fr_redis_cluster_node_t *node)
+{
+	int ret;
+
+	if (cluster->remap_node || cluster->remapping) return;	/* Already in progress */
+
+	if (!cluster->remap_thread_running) {
+		cluster->remap_thread_stop = false;
+		ret = pthread_create(&cluster->remap_thread, NULL, cluster_remap_thread, cluster);
+		if (ret != 0) {
+			ERROR("%s - Failed creating cluster remap thread: %s", cluster->log_prefix, fr_syserror(ret));
+			return;
+		}
+		cluster->remap_thread_running = true;
+	}
+
+	cluster->remap_node = node->id;
+	pthread_cond_signal(&cluster->remap_wakeup);
+}
+
+/** Return the address of the node which should service a key
+ *
+ * Used by the async pipeline code to determine which node's trunk a command
+ * set should be enqueued on.
+ *
+ * If the cluster map is known to be stale, the remap thread is told to
+ * refresh it, and the node from the current map is returned.  If that node
+ * no longer owns the key, the MOVED redirect is followed by the caller.
+ *
+ * @param[out] out	Where to write the address of the node.
+ * @param[in] cluster	to resolve key in.
+ * @param[in] request	The current request.  May be NULL.
+ * @param[in] key	to resolve.
+ * @param[in] key_len	Length of the key.
+ * @param[in] read_only	If true, a random active slave is used in preference
+ *			to the master, falling back to the master if no
+ *			slaves are active.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no node is available for the key.
+ */
+int fr_redis_cluster_node_addr_by_key(fr_socket_t *out, fr_redis_cluster_t *cluster, request_t *request,
+				      uint8_t const *key, size_t key_len, bool read_only)
+{
+	fr_redis_cluster_key_slot_t const	*key_slot;
+	fr_redis_cluster_node_t			*node;
+	uint8_t					first, i;
+
+	if (fr_rb_num_elements(cluster->used_nodes) == 0) {
+		fr_strerror_const("No nodes in cluster");
+		return -1;
+	}
+
+	key_slot = fr_redis_cluster_slot_by_key(cluster, request, key, key_len);
+	node = &cluster->node[key_slot->master];
+
+	pthread_mutex_lock(&cluster->mutex);
+	if (cluster->remap_needed) cluster_remap_signal(cluster, node);
+
+	if (read_only && (key_slot->slave_num > 0)) {
+		first = fr_rand() % key_slot->slave_num;
+		for (i = 0; i < key_slot->slave_num; i++) {
+			fr_redis_cluster_node_t *slave;
+
+			slave = &cluster->node[key_slot->slave[(first + i) % key_slot->slave_num]];
+			if (!slave->is_active) continue;
+
+			*out = slave->addr;
+			pthread_mutex_unlock(&cluster->mutex);
+
+			return 0;
+		}
+	}
+
+	if (!node->is_active) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_strerror_printf("No active master for key slot %zu", key_slot - cluster->key_slot);
+		return -1;
+	}
+	*out = node->addr;
+	pthread_mutex_unlock(&cluster->mutex);
+
+	return 0;
+}
+
+/** Return the address of the node we were redirected to
+ *
+ * If the redirect was a MOVED redirect the cluster map is marked as stale,
+ * so that it's refreshed before it's next used.
+ *
+ * @param[out] out	Where to write the address of the node.
+ * @param[in] cluster	the redirect was received from.
+ * @param[in] redirect	reply containing a MOVED or ASK error.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the redirect was invalid.
+ */
+int fr_redis_cluster_node_addr_by_redirect(fr_socket_t *out, fr_redis_cluster_t *cluster, redisReply *redirect)
+{
+	memset(out, 0, sizeof(*out));
+
+	if (cluster_node_conf_from_redirect(NULL, out, redirect) != FR_REDIS_CLUSTER_RCODE_SUCCESS) return -1;
+
+	if (strncmp(REDIS_ERROR_MOVED_STR, redirect->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) {
+		cluster->remap_needed = true;
+	}
+
+	return 0;
+}
+
 /** Resolve a key to a pool, and reserve a connection in that pool
  *
  * This should be used with #fr_redis_cluster_state_next, and #fr_redis_command_status, to
@@ -2135,6 +2327,16 @@ ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_t *out[],
  */
 static int _fr_redis_cluster_free(fr_redis_cluster_t *cluster)
 {
+	if (cluster->remap_thread_running) {
+		pthread_mutex_lock(&cluster->mutex);
+		cluster->remap_thread_stop = true;
+		pthread_cond_signal(&cluster->remap_wakeup);
+		pthread_mutex_unlock(&cluster->mutex);
+
+		pthread_join(cluster->remap_thread, NULL);
+	}
+
+	pthread_cond_destroy(&cluster->remap_wakeup);
 	pthread_mutex_destroy(&cluster->mutex);
 
 	return 0;
@@ -2325,6 +2527,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	cluster->conf = conf;
 
 	pthread_mutex_init(&cluster->mutex, NULL);
+	pthread_cond_init(&cluster->remap_wakeup, NULL);
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
 	/*
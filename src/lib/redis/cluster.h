@@ -100,6 +100,15 @@ int fr_redis_cluster_ipaddr(fr_ipaddr_t *out, fr_redis_cluster_node_t const *nod
 
 int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node);
 
+/*
+ *	Resolve keys and redirects to node addresses, for the
+ *	async pipeline code.
+ */
+int fr_redis_cluster_node_addr_by_key(fr_socket_t *out, fr_redis_cluster_t *cluster, request_t *request,
+				      uint8_t const *key, size_t key_len, bool read_only);
+
+int fr_redis_cluster_node_addr_by_redirect(fr_socket_t *out, fr_redis_cluster_t *cluster, redisReply *redirect);
+
 
 
 /*
@@ -290,6 +290,35 @@ static int _redis_handle_free(fr_redis_handle_t *h)
 	return 0;
 }
 
+#ifndef REDIS_NO_AUTO_FREE_REPLIES
+/** Don't free replies, the pipeline code holds onto them until the command set completes
+ *
+ */
+static void _redis_io_reply_no_free(UNUSED void *reply)
+{
+}
+#endif
+
+/** Check the response to a command sent when the connection was opened
+ *
+ */
+static void _redis_io_setup_reply(redisAsyncContext *ac, void *vreply, UNUSED void *privdata)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	redisReply		*reply = vreply;
+
+	if (!reply) return;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("Connection setup failed: %s", reply->str);
+		fr_redis_reply_free(&reply);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	fr_redis_reply_free(&reply);
+}
+
 /** Callback for the initialise state
  *
  * Should attempt to open a non-blocking connection and return it in h_out.
@@ -380,6 +409,35 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 
 	fr_dlist_talloc_init(&h->ignore, fr_redis_sqn_ignore_t, entry);
 
+	/*
+	 *	Replies are held until all the replies
+	 *	for a command set have been received.
+	 */
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	h->ac->c.flags |= REDIS_NO_AUTO_FREE_REPLIES;
+#else
+	h->reply_funcs = *h->ac->c.reader->fn;
+	h->reply_funcs.freeObject = _redis_io_reply_no_free;
+	h->ac->c.reader->fn = &h->reply_funcs;
+#endif
+
+	/*
+	 *	hiredis buffers these until the connection
+	 *	is open, so they're always the first commands
+	 *	sent, and are never subject to the handle's
+	 *	sequence numbers.
+	 */
+	if (conf->password &&
+	    (redisAsyncCommand(h->ac, _redis_io_setup_reply, NULL, "AUTH %s", conf->password) != REDIS_OK)) {
+		ERROR("Failed sending AUTH command");
+		goto error;
+	}
+	if (conf->database &&
+	    (redisAsyncCommand(h->ac, _redis_io_setup_reply, NULL, "SELECT %u", conf->database) != REDIS_OK)) {
+		ERROR("Failed sending SELECT command");
+		goto error;
+	}
+
 	return FR_CONNECTION_STATE_CONNECTING;
 }
 
@@ -83,6 +83,12 @@ typedef struct {
 							///< the user. It's one branch, and it makes me
 							///< happy, deal with it.
 	fr_redis_sqn_t		rsp_sqn;		//!< Current redis response number.
+
+#ifndef REDIS_NO_AUTO_FREE_REPLIES
+	redisReplyObjectFunctions reply_funcs;		//!< Reply functions which leave freeing replies
+							///< to us, as older versions of hiredis free them
+							///< as soon as the reply callback returns.
+#endif
 } fr_redis_handle_t;
 
 /** Tell the handle we sent a command, and get the SQN that command was assigned
@@ -107,7 +113,7 @@ static inline void fr_redis_connection_ignore_response(fr_redis_handle_t *h, fr_
 {
 	fr_redis_sqn_ignore_t *ignore;
 
-	fr_assert(sqn <= h->rsp_sqn);
+	fr_assert((sqn >= h->rsp_sqn) && (sqn < h->req_sqn));	/* Must be outstanding */
 
 	MEM(ignore = talloc_zero(h, fr_redis_sqn_ignore_t));
 	ignore->sqn = sqn;
@@ -27,6 +27,7 @@
 
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/rb.h>
 
 #include "pipeline.h"
 #include "io.h"
@@ -34,7 +35,7 @@
 
 /** Thread local state for a cluster
  *
- * MOVE ME TO NEW ASYNC CLUSTER CODE
+ * Holds a trunk for each cluster node this thread has sent commands to.
  */
 struct fr_redis_cluster_thread_s {
 	fr_event_list_t			*el;
@@ -42,6 +43,10 @@ struct fr_redis_cluster_thread_s {
 	char				*log_prefix;	//!< Common log prefix to use for all cluster related
 							///< messages.
 	bool				delay_start;	//!< Prevent connections from spawning immediately.
+
+	fr_redis_cluster_t		*cluster;	//!< Shared cluster state.  Used to map keys to nodes.
+	fr_redis_conf_t const		*conf;		//!< Common configuration (database, password, etc...).
+	fr_rb_tree_t			*trunks;	//!< Trunks for each node, keyed by node address.
 };
 
 /** The thread local free list
@@ -72,6 +77,9 @@ struct fr_redis_command_s {
 
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
+	bool				formatted;	//!< str is already in the redis protocol format.
+	bool				internal;	//!< Added by the pipeline code (i.e. ASKING).  The reply
+							///< is discarded, and not passed to the caller.
 
 	uint64_t			sqn;		//!< The sequence number of the command.  This is only
 							///< valid for a specific handle, and is unique within
@@ -96,6 +104,8 @@ struct fr_redis_command_set_s {
 	/** @} */
 
 	uint8_t				redirected;	//!< How many times this command set was redirected.
+	bool				requeued;	//!< Command set was moved to another trunk, and must
+							///< not be freed along with the original trunk request.
 
 	/** @name Request state
 	 *
@@ -142,6 +152,9 @@ struct fr_redis_command_set_s {
 };
 
 struct fr_redis_trunk_s {
+	fr_rb_node_t			node;		//!< Entry in the cluster thread's tree of trunks.
+	fr_socket_t			addr;		//!< Address of the node this trunk connects to.
+
 	fr_redis_io_conf_t const	*io_conf;	//!< Redis I/O configuration.  Specifies how to connect
 							///< to the host this trunk is used to communicate with.
 	fr_trunk_t			*trunk;		//!< Trunk containing all the connections to a specific
@@ -180,7 +193,8 @@ static int _redis_command_set_free(fr_redis_command_set_t *cmds)
 	}
 
 	talloc_free_children(cmds);
-	memset(&cmds, 0, sizeof(cmds));
+	memset(cmds, 0, sizeof(*cmds));
+	fr_dlist_entry_init(&cmds->entry);
 
 	fr_dlist_insert_head(command_set_free_list, cmds);
 
@@ -262,7 +276,7 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+	if (cmd->result) fr_redis_reply_free(&cmd->result);
 
 	return 0;
 }
@@ -272,43 +286,48 @@ redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
+/** Take ownership of the result of a command
  *
- * The command must either be entirely static, or parented by the command set.
+ * Results are otherwise freed with the command set, which happens as soon as
+ * the complete or fail callbacks return.
  *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+ * @param[in] cmd	to take the result from.
+ * @return The result, which must be freed with #fr_redis_reply_free.
+ */
+redisReply *fr_redis_command_steal_result(fr_redis_command_t *cmd)
+{
+	redisReply *reply = cmd->result;
+
+	cmd->result = NULL;
+
+	return reply;
+}
+
+/** Determine the type of a command, and check it doesn't leave a transaction block dangling
  *
- * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
- * @param[in] cmd_len	Length of the command.
+ * Because commands from many different requests share the same connection
+ * we need to ensure that transaction blocks aren't left dangling and
+ * that the commands are all in the right order.
+ *
+ * We try very hard to do this without incurring a performance penalty
+ * for non-transactional commands.
+ *
+ * @param[out] out	Type of the command.
+ * @param[in] cmds	Command set the command is being added to.
+ * @param[in] cmd_str	Command, or a format string starting with the command.
  * @return
  *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
- *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ *	- FR_REDIS_PIPELINE_OK if command may be added.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static fr_redis_pipeline_status_t redis_command_type(fr_redis_command_type_t *out,
+						     fr_redis_command_set_t *cmds, char const *cmd_str)
 {
-	request_t			*request = cmds->request;
-	fr_redis_command_t	*cmd;
+	request_t		*request = cmds->request;
 	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
 
-	/*
-	 *	Transaction sanity checks.
-	 *
-	 *	Because commands from many different requests share the same connection
-	 *	we need to ensure that transaction blocks aren't left dangling and
-	 *	that the commands are all in the right order.
-	 *
-	 *	We try very hard to do this without incurring a performance penalty
-	 *      for non-transactional commands.
-	 */
 	switch (tolower(cmd_str[0])) {
 	case 'm':
-		if (tolower(cmd_str[1] != 'u')) break;
+		if (tolower(cmd_str[1]) != 'u') break;
 		if (strncasecmp(cmd_str, "multi", sizeof("multi") - 1) != 0) break;
 		/*
 		 *	There should only ever be a difference of
@@ -328,7 +347,7 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 
 	case 'e':
-		if (tolower(cmd_str[1] != 'e')) break;
+		if (tolower(cmd_str[1]) != 'x') break;
 		if (strncasecmp(cmd_str, "exec", sizeof("exec") - 1) != 0) break;
 		goto txn_end;
 
@@ -338,7 +357,7 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	executing the commands.
 	 */
 	case 'd':
-		if (tolower(cmd_str[1] != 'i')) break;
+		if (tolower(cmd_str[1]) != 'i') break;
 		if (strncasecmp(cmd_str, "discard", sizeof("discard") - 1) != 0) break;
 	txn_end:
 		if (cmds->txn_start <= cmds->txn_end) {
@@ -350,7 +369,7 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 
 	case 'w':
-		if (tolower(cmd_str[1] != 'a')) break;
+		if (tolower(cmd_str[1]) != 'a') break;
 		if (strncasecmp(cmd_str, "watch", sizeof("watch") - 1) != 0) break;
 		if (cmds->txn_watch) {
 			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"WATCH\" commands");
@@ -366,17 +385,183 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 	}
 
+	*out = type;
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command to the pending list of a command set
+ *
+ */
+static inline fr_redis_command_t *redis_command_insert(fr_redis_command_set_t *cmds, fr_redis_command_type_t type,
+					char const *cmd_str, size_t cmd_len, bool formatted)
+{
+	fr_redis_command_t	*cmd;
+
 	MEM(cmd = talloc_zero(cmds, fr_redis_command_t));
 	talloc_set_destructor(cmd, _redis_command_free);
 	cmd->cmds = cmds;
 	cmd->type = type;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
+	cmd->formatted = formatted;
 	fr_dlist_insert_tail(&cmds->pending, cmd);
 
+	return cmd;
+}
+
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	fr_redis_command_type_t		type;
+	fr_redis_pipeline_status_t	ret;
+
+	ret = redis_command_type(&type, cmds, cmd_str);
+	if (ret != FR_REDIS_PIPELINE_OK) return ret;
+
+	redis_command_insert(cmds, type, cmd_str, cmd_len, false);
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command already encoded in the redis protocol format to the command set
+ *
+ * This is for commands which are sent more than once, i.e. an EVALSHA which
+ * needs to be retried after the script has been loaded.  The command is
+ * treated as a normal (non-transactional) command.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	Command produced by redisFormatCommand or similar.
+ *			Must be static, or have the same lifetime as the
+ *			command set.
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_formatted_add(fr_redis_command_set_t *cmds,
+							  char const *cmd_str, size_t cmd_len)
+{
+	redis_command_insert(cmds, FR_REDIS_COMMAND_NORMAL, cmd_str, cmd_len, true);
+
 	return FR_REDIS_PIPELINE_OK;
 }
 
+/** Format a command, and add it to the command set
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] fmt	hiredis format string.  Must start with the command
+ *			name, i.e. "EVALSHA %s 1 %b".
+ * @param[in] ...	Arguments for the format string.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued,
+ *	  or the format string was invalid.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_add(fr_redis_command_set_t *cmds, char const *fmt, ...)
+{
+	request_t			*request = cmds->request;
+	fr_redis_command_type_t		type;
+	fr_redis_pipeline_status_t	ret;
+	va_list				ap;
+	char				*formatted, *cmd_str;
+	int				len;
+
+	ret = redis_command_type(&type, cmds, fmt);
+	if (ret != FR_REDIS_PIPELINE_OK) return ret;
+
+	va_start(ap, fmt);
+	len = redisvFormatCommand(&formatted, fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		ROPTIONAL(ERROR, REDEBUG, "Failed formatting command \"%s\"", fmt);
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	MEM(cmd_str = talloc_memdup(cmds, formatted, (size_t)len));
+	redisFreeCommand(formatted);
+
+	redis_command_insert(cmds, type, cmd_str, (size_t)len, true);
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command made up of separate arguments to the command set
+ *
+ * Used where the arguments are the result of an expansion, and may contain
+ * spaces or binary data which shouldn't be interpreted by a format string.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments, including the command name.
+ * @param[in] argv	Arguments.  argv[0] must be the command name.
+ * @param[in] argvlen	Length of each argument.  If NULL, strlen() is
+ *			used to determine the length of each argument.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued,
+ *	  or the command could not be formatted.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argvlen)
+{
+	request_t			*request = cmds->request;
+	fr_redis_command_type_t		type;
+	fr_redis_pipeline_status_t	ret;
+	char				*formatted, *cmd_str;
+	int				len;
+
+	if (argc < 1) {
+		ROPTIONAL(ERROR, REDEBUG, "Missing command name");
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	ret = redis_command_type(&type, cmds, argv[0]);
+	if (ret != FR_REDIS_PIPELINE_OK) return ret;
+
+	len = redisFormatCommandArgv(&formatted, argc, argv, argvlen);
+	if (len < 0) {
+		ROPTIONAL(ERROR, REDEBUG, "Failed formatting command \"%s\"", argv[0]);
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	MEM(cmd_str = talloc_memdup(cmds, formatted, (size_t)len));
+	redisFreeCommand(formatted);
+
+	redis_command_insert(cmds, type, cmd_str, (size_t)len, true);
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Signal that a command set is no longer needed
+ *
+ * Must be called if the request the command set belongs to is cancelled.
+ * Any replies will be discarded, and the command set will be freed.
+ *
+ * @param[in] cmds	to cancel.
+ */
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) return;
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
 /** Enqueue a command set on a specific trunk
  *
  * The command set may be passed around several trunks before it is complete.
@@ -409,6 +594,112 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Compare two trunks by the address of the node they connect to
+ *
+ */
+static int8_t _redis_trunk_cmp(void const *one, void const *two)
+{
+	fr_redis_trunk_t const	*a = one;
+	fr_redis_trunk_t const	*b = two;
+	int8_t			ret;
+
+	ret = fr_ipaddr_cmp(&a->addr.inet.dst_ipaddr, &b->addr.inet.dst_ipaddr);
+	if (ret != 0) return ret;
+
+	return CMP(a->addr.inet.dst_port, b->addr.inet.dst_port);
+}
+
+/** Find or create the trunk for a cluster node
+ *
+ * @param[in] cluster_thread	to search for the trunk in.
+ * @param[in] addr		of the cluster node.
+ * @return
+ *	- The trunk for the node.
+ *	- NULL if a new trunk couldn't be created.
+ */
+static fr_redis_trunk_t *redis_cluster_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+						     fr_socket_t const *addr)
+{
+	fr_redis_trunk_t	find = { .addr = *addr }, *rtrunk;
+	fr_redis_io_conf_t	*io_conf;
+	char			buffer[INET6_ADDRSTRLEN];
+
+	rtrunk = fr_rb_find(cluster_thread->trunks, &find);
+	if (rtrunk) return rtrunk;
+
+	if (!inet_ntop(addr->inet.dst_ipaddr.af, &addr->inet.dst_ipaddr.addr, buffer, sizeof(buffer))) {
+		fr_strerror_printf("Failed converting node address to string: %s", fr_syserror(errno));
+		return NULL;
+	}
+
+	MEM(io_conf = talloc_zero(cluster_thread, fr_redis_io_conf_t));
+	MEM(io_conf->hostname = talloc_typed_strdup(io_conf, buffer));
+	io_conf->port = addr->inet.dst_port;
+	io_conf->database = cluster_thread->conf->database;
+	io_conf->password = cluster_thread->conf->password;
+	io_conf->connection_timeout = cluster_thread->conf->connection_timeout;
+	io_conf->reconnection_delay = cluster_thread->conf->reconnection_delay;
+	io_conf->log_prefix = cluster_thread->log_prefix;
+
+	rtrunk = fr_redis_trunk_alloc(cluster_thread, io_conf);
+	if (!rtrunk) {
+		talloc_free(io_conf);
+		return NULL;
+	}
+	talloc_steal(rtrunk, io_conf);
+	rtrunk->addr = *addr;
+
+	fr_rb_insert(cluster_thread->trunks, rtrunk);
+
+	return rtrunk;
+}
+
+/** Enqueue a command set on the trunk for the cluster node that owns a key
+ *
+ * The key is hashed (see crc16.c) to find its key slot, and the command set
+ * is sent to the master for that key slot, or to one of its slaves if
+ * read_only is true.  All commands in the set must operate on keys in the
+ * same key slot.
+ *
+ * MOVED and ASK redirects are followed automatically, up to max_redirects
+ * times.
+ *
+ * @param[in] cluster_thread	to enqueue the command set on.
+ * @param[in] cmds		Command set to enqueue.
+ * @param[in] key		to determine the cluster node from.
+ * @param[in] key_len		Length of the key.
+ * @param[in] read_only		Prefer a slave for the key slot.  The command set
+ *				should start with "READONLY", or the slave will
+ *				redirect it to the master.
+ * @return
+ *	- FR_REDIS_PIPELINE_OK if commands were immediately enqueued or placed in the backlog.
+ *	- FR_REDIS_PIPELINE_DST_UNAVAILABLE if no node is available for the key.
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if the command set contains unbalanced transactions.
+ *	- FR_REDIS_PIPELINE_FAIL any other general error.
+ */
+fr_redis_pipeline_status_t fr_redis_cluster_command_set_enqueue(fr_redis_cluster_thread_t *cluster_thread,
+								fr_redis_command_set_t *cmds,
+								uint8_t const *key, size_t key_len, bool read_only)
+{
+	request_t		*request = cmds->request;
+	fr_redis_trunk_t	*rtrunk;
+	fr_socket_t		addr;
+
+	if (fr_redis_cluster_node_addr_by_key(&addr, cluster_thread->cluster, request,
+					      key, key_len, read_only) < 0) {
+		ROPTIONAL(RPERROR, PERROR, "Failed finding cluster node");
+		return FR_REDIS_PIPELINE_DST_UNAVAILABLE;
+	}
+
+	rtrunk = redis_cluster_trunk_by_addr(cluster_thread, &addr);
+	if (!rtrunk) {
+		ROPTIONAL(RPERROR, PERROR, "Failed allocating trunk for cluster node");
+		return FR_REDIS_PIPELINE_FAIL;
+	}
+
+	return redis_command_set_enqueue(rtrunk, cmds);
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -431,6 +722,15 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	fr_connection_t		*conn = talloc_get_type_abort(ac->ev.data, fr_connection_t);
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
 	redisReply		*reply = vreply;
+
+	/*
+	 *	hiredis calls us with a NULL reply when
+	 *	the connection is being torn down.  The
+	 *	trunk will already have been told about
+	 *	any outstanding command sets.
+	 */
+	if (!reply) return;
+
 	/*
 	 *	First check if we should ignore the response
 	 */
@@ -440,22 +740,29 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 		return;
 	}
 
-	/*
-	 *	FIXME - Need to check TRYAGAIN, MOVED etc...
-	 *	I guess we might want to wait for the end of
-	 *	the command set to do that.
-	 */
 	cmd = talloc_get_type_abort(privdata, fr_redis_command_t);
 	cmds = cmd->cmds;
-	cmd->result = reply;
 
-	fr_dlist_remove(&cmds->sent, cmd);
-	fr_dlist_insert_tail(&cmds->completed, cmd);
+	/*
+	 *	Replies to commands we added ourselves
+	 *	are of no interest to the caller.
+	 */
+	if (cmd->internal) {
+		fr_redis_reply_free(&reply);
+		fr_dlist_remove(&cmds->sent, cmd);
+		talloc_free(cmd);
+	} else {
+		cmd->result = reply;
+
+		fr_dlist_remove(&cmds->sent, cmd);
+		fr_dlist_insert_tail(&cmds->completed, cmd);
+	}
 
 	/*
 	 *	Check is the command set is complete,
 	 *	and if it is, tell the trunk the treq
-	 *	is complete.
+	 *	is complete.  MOVED, ASK etc... are
+	 *	dealt with once we have all the replies.
 	 */
 	if ((fr_dlist_num_elements(&cmds->pending) == 0) &&
 	    (fr_dlist_num_elements(&cmds->sent) == 0)) fr_trunk_request_signal_complete(cmds->treq);
@@ -473,44 +780,83 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
 /** Enqueue one or more command sets onto a redis handle
  *
  * Because the trunk is in always writable mode, _redis_pipeline_mux
- * will be called any time fr_trunk_request_enqueue is called, so there'll only
- * ever be one command to dequeue.
+ * will be called any time fr_trunk_request_enqueue is called, so there'll
+ * usually only be one command set to dequeue.
  *
+ * @param[in] el		For timer management.  Unused.
  * @param[in] tconn		Trunk connection holding the commands to enqueue.
  * @param[in] conn		Connection handle containing the fr_redis_handle_t.
- * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ * @param[in] uctx		fr_redis_trunk_t.  Unused.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
 	fr_trunk_request_t	*treq;
 	fr_redis_command_set_t 	*cmds;
 	fr_redis_command_t	*cmd;
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	request_t			*request;
-
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
-	while ((cmd = fr_dlist_head(&cmds->pending))) {
-		/*
-		 *	If this fails it probably means the connection
-		 *	is disconnecting, but if that's happening then
-		 *	we shouldn't be enqueueing new requests?
-		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+	request_t		*request;
+	int			ret;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+		request = treq->request;
+
+		while ((cmd = fr_dlist_head(&cmds->pending))) {
+			if (cmd->formatted) {
+				ret = redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd, cmd->str, cmd->len);
+			} else {
+				ret = redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str);
+			}
 
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
-				fr_redis_connection_ignore_response(h, cmd->sqn);
-				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+			/*
+			 *	If this fails it probably means the connection
+			 *	is disconnecting, but if that's happening then
+			 *	we shouldn't be enqueueing new requests?
+			 */
+			if (unlikely(ret != REDIS_OK)) {
+				ROPTIONAL(RERROR, ERROR, "Unexpected error queueing REDIS command");
+
+				while ((cmd = fr_dlist_tail(&cmds->sent))) {
+					fr_redis_connection_ignore_response(h, cmd->sqn);
+					fr_dlist_remove(&cmds->sent, cmd);
+					fr_dlist_insert_head(&cmds->pending, cmd);
+				}
+				fr_trunk_request_signal_fail(treq);
+				goto next;
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			cmd->sqn = fr_redis_connection_sent_request(h);
+			fr_dlist_remove(&cmds->pending, cmd);
+			fr_dlist_insert_tail(&cmds->sent, cmd);
 		}
-		cmd->sqn = fr_redis_connection_sent_request(h);
-		fr_dlist_remove(&cmds->pending, cmd);
-		fr_dlist_insert_tail(&cmds->sent, cmd);
+		fr_trunk_request_signal_sent(treq);
+	next:
+		continue;
+	}
+}
+
+/** Put a command set back into the state it was in before it was sent
+ *
+ * Results are discarded, and any commands added by the pipeline code are removed.
+ */
+static void redis_command_set_reset(fr_redis_command_set_t *cmds)
+{
+	fr_redis_command_t	*cmd, *next;
+
+	fr_dlist_move_head(&cmds->pending, &cmds->sent);
+	fr_dlist_move_head(&cmds->pending, &cmds->completed);
+
+	for (cmd = fr_dlist_head(&cmds->pending); cmd; cmd = next) {
+		next = fr_dlist_next(&cmds->pending, cmd);
+
+		if (cmd->internal) {
+			fr_dlist_remove(&cmds->pending, cmd);
+			talloc_free(cmd);
+			continue;
+		}
+
+		if (cmd->result) fr_redis_reply_free(&cmd->result);
 	}
-	fr_trunk_request_signal_sent(treq);
 }
 
 /** Deal with cancellation of sent requests
@@ -519,11 +865,24 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 	fr_redis_handle_t	*h = conn->h;
+	fr_redis_command_t	*cmd;
+
+	/*
+	 *	Whatever the reason, we'll have responses
+	 *	coming back for the commands we sent (if
+	 *	the connection is still up).  Tell the
+	 *	handle to ignore them.
+	 */
+	for (cmd = fr_dlist_head(&cmds->sent);
+	     cmd;
+	     cmd = fr_dlist_next(&cmds->sent, cmd)) {
+		fr_redis_connection_ignore_response(h, cmd->sqn);
+	}
 
 	/*
 	 *	How we cancel is very different depending
@@ -531,39 +890,30 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 */
 	switch (reason) {
 	/*
-	 *	Cancel is only called for requests that
-	 *	have been sent, and only when the connection
-	 *	is about to be closed for some reason.
+	 *	The command set is being moved to another
+	 *	connection, or is being sent again on this
+	 *	one.
 	 *
-	 *	We don't need to tell the handle to ignore
-	 *	the responses, we just need to get the
+	 *	Partial results are no use, as the commands
+	 *	may form a transaction, so we get the whole
 	 *	command set back into the correct state for
 	 *	execution by another handle.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
-		fr_dlist_move(&cmds->pending, &cmds->sent);
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
+		redis_command_set_reset(cmds);
 		return;
 
 	/*
 	 *	If the request was cancelled due to a signal
 	 *	we'll have a response coming back for a
 	 *	request, pctx and rctx that no longer exist.
-	 *	Tell the handle to signal that the response
-	 *	should be ignored when it's received.
 	 *
 	 *      Free will take care of cleaning up the
 	 *	pending commands.
 	 */
 	case FR_TRUNK_CANCEL_REASON_SIGNAL:
-	{
-		fr_redis_command_t	*cmd;
-
-		for (cmd = fr_dlist_head(&cmds->sent);
-		     cmd;
-		     cmd = fr_dlist_next(&cmds->sent, cmd)) {
-			fr_redis_connection_ignore_response(h, cmd->sqn);
-		}
-	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -571,25 +921,133 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	}
 }
 
+/** Follow MOVED or ASK redirects
+ *
+ * If any of the commands in the set were redirected, the command set is reset
+ * and enqueued on the trunk for the node we were redirected to.
+ *
+ * @param[in] rtrunk	the command set was executed on.
+ * @param[in] cmds	to check for redirects.
+ * @return
+ *	- 1 if there were no redirects.
+ *	- 0 if the command set was redirected.
+ *	- -1 if the command set should be failed.
+ */
+static int redis_command_set_redirect(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = rtrunk->cluster;
+	request_t			*request = cmds->request;
+	fr_redis_command_t		*cmd;
+	redisReply			*reply = NULL;
+	fr_redis_trunk_t		*redirect;
+	fr_socket_t			addr;
+	bool				ask;
+
+	if (!cluster_thread->cluster) return 1;	/* Not a cluster trunk */
+
+	for (cmd = fr_dlist_head(&cmds->completed);
+	     cmd;
+	     cmd = fr_dlist_next(&cmds->completed, cmd)) {
+		if (!cmd->result || (cmd->result->type != REDIS_REPLY_ERROR)) continue;
+
+		if ((strncmp(REDIS_ERROR_MOVED_STR, cmd->result->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) ||
+		    (strncmp(REDIS_ERROR_ASK_STR, cmd->result->str, sizeof(REDIS_ERROR_ASK_STR) - 1) == 0)) {
+			reply = cmd->result;
+			break;
+		}
+	}
+	if (!reply) return 1;
+
+	if (cmds->redirected >= cluster_thread->conf->max_redirects) {
+		ROPTIONAL(RERROR, ERROR, "Too many redirects (%u)", cmds->redirected);
+		return -1;
+	}
+
+	if (fr_redis_cluster_node_addr_by_redirect(&addr, cluster_thread->cluster, reply) < 0) {
+		ROPTIONAL(RPERROR, PERROR, "Failed processing redirect");
+		return -1;
+	}
+	ask = (strncmp(REDIS_ERROR_ASK_STR, reply->str, sizeof(REDIS_ERROR_ASK_STR) - 1) == 0);
+
+	redirect = redis_cluster_trunk_by_addr(cluster_thread, &addr);
+	if (!redirect) {
+		ROPTIONAL(RPERROR, PERROR, "Failed allocating trunk for cluster node");
+		return -1;
+	}
+
+	/*
+	 *	The node sent us back to itself, the
+	 *	cluster must be in an inconsistent state.
+	 */
+	if (redirect == rtrunk) {
+		ROPTIONAL(RERROR, ERROR, "Redirected to the node which issued the redirect");
+		return -1;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Following %s redirect to %s:%u", ask ? "ASK" : "MOVED",
+		  redirect->io_conf->hostname, redirect->io_conf->port);
+
+	redis_command_set_reset(cmds);
+
+	/*
+	 *	An ASK redirect is only valid for the
+	 *	next command, and the node needs to
+	 *	be told we're following one.
+	 */
+	if (ask) {
+		cmd = redis_command_insert(cmds, FR_REDIS_COMMAND_NORMAL, "ASKING", sizeof("ASKING") - 1, false);
+		cmd->internal = true;
+		fr_dlist_remove(&cmds->pending, cmd);
+		fr_dlist_insert_head(&cmds->pending, cmd);
+	}
+
+	cmds->redirected++;
+	cmds->treq = NULL;	/* Freed by the trunk after the complete callback returns */
+
+	if (redis_command_set_enqueue(redirect, cmds) != FR_REDIS_PIPELINE_OK) {
+		ROPTIONAL(RERROR, ERROR, "Failed enqueueing redirected commands");
+		return -1;
+	}
+	cmds->requeued = true;
+
+	return 0;
+}
+
 /** Signal the API client that we got a complete set of responses to a command set
  *
  */
 static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void *preq,
-						 UNUSED void *rctx, UNUSED void *uctx)
+						 UNUSED void *rctx, void *uctx)
 {
+	fr_redis_trunk_t	*rtrunk = talloc_get_type_abort(uctx, fr_redis_trunk_t);
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
-	if (cmds->complete) cmds->complete(cmds->request, &cmds->completed, cmds->rctx);
+	switch (redis_command_set_redirect(rtrunk, cmds)) {
+	case 0:
+		return;
+
+	case 1:
+		cmds->treq = NULL;
+		if (cmds->complete) cmds->complete(cmds->request, &cmds->completed, cmds->rctx);
+		return;
+
+	default:
+		cmds->treq = NULL;
+		if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
+		return;
+	}
 }
 
 /** Signal the API client that we failed enqueuing the commands
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED request_t *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state,
+					     UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	cmds->treq = NULL;
 	if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
 }
 
@@ -601,6 +1059,15 @@ static void _redis_pipeline_command_set_free(UNUSED request_t *request, void *pr
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	/*
+	 *	Command set now belongs to the trunk
+	 *	we were redirected to.
+	 */
+	if (cmds->requeued) {
+		cmds->requeued = false;
+		return;
+	}
+
 	talloc_free(cmds);
 }
 
@@ -627,6 +1094,7 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 
 	MEM(rtrunk = talloc_zero(cluster_thread, fr_redis_trunk_t));
 	rtrunk->io_conf = io_conf;
+	rtrunk->cluster = cluster_thread;
 	rtrunk->trunk = fr_trunk_alloc(rtrunk, cluster_thread->el,
 				       &io_funcs, cluster_thread->tconf, cluster_thread->log_prefix, rtrunk,
 				       cluster_thread->delay_start);
@@ -643,20 +1111,38 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
  * This structure represents all the connections for a given thread for a given cluster.
  * The structures holds the trunk connections to talk to each cluster member.
  *
+ * @param[in] ctx		to allocate the cluster thread in.
+ * @param[in] el		to run the trunks in.
+ * @param[in] tconf		Configuration for each of the trunks.
+ * @param[in] cluster		Shared cluster state, used to map keys to cluster nodes.
+ *				May be NULL if the caller only uses #fr_redis_trunk_alloc.
+ * @param[in] conf		Database, password etc... to use when connecting to
+ *				cluster nodes.  May be NULL if cluster is NULL.
+ * @param[in] log_prefix	to use for all cluster related messages.
+ * @return
+ *	- A new cluster thread.
  */
-fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf)
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+							 fr_trunk_conf_t const *tconf,
+							 fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf,
+							 char const *log_prefix)
 {
 	fr_redis_cluster_thread_t *cluster_thread;
 	fr_trunk_conf_t *our_tconf;
 
+	fr_assert(!cluster || conf);
+
 	MEM(cluster_thread = talloc_zero(ctx, fr_redis_cluster_thread_t));
 	MEM(our_tconf = talloc_memdup(cluster_thread, tconf, sizeof(*tconf)));
 	our_tconf->always_writable = true;
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	cluster_thread->cluster = cluster;
+	cluster_thread->conf = conf;
+	if (log_prefix) MEM(cluster_thread->log_prefix = talloc_typed_strdup(cluster_thread, log_prefix));
+	MEM(cluster_thread->trunks = fr_rb_inline_alloc(cluster_thread, fr_redis_trunk_t, node,
+							_redis_trunk_cmp, NULL));
 
 	return cluster_thread;
 }
-
-
@@ -1,4 +1,7 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
+	detail_spool_tests.mk \
+	exfile_tests.mk \
 	pair_server_tests.mk \
+	state_test.mk \
 	trunk_tests.mk
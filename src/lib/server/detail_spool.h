@@ -0,0 +1,143 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail_spool.h
+ * @brief Binary detail file ("spool") record format.
+ *
+ * Shared by rlm_detail, which writes spool files, and proto_detail,
+ * which reads them back.
+ *
+ * A spool file is a sequence of records.  Each record is a fixed size
+ * header, followed by the attributes of the packet in the internal
+ * encoding, followed by zero padding to the next #FR_DETAIL_SPOOL_ALIGN
+ * byte boundary.  Every record therefore starts on an aligned offset,
+ * which lets a reader find the next valid record after a damaged one
+ * by scanning aligned offsets for #FR_DETAIL_SPOOL_MAGIC.
+ *
+ * Spool files are only read on the host which wrote them, so all
+ * fields are in host byte order.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(detail_spool_h, "$Id$")
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_SPOOL_MAGIC		(0x4672446c)	//!< "FrDl"
+#define FR_DETAIL_SPOOL_VERSION		(1)
+#define FR_DETAIL_SPOOL_ALIGN		(8)
+
+typedef enum {
+	FR_DETAIL_FORMAT_TEXT = 0,				//!< Traditional "Attribute = value" lines.
+	FR_DETAIL_FORMAT_BINARY					//!< Spool records described below.
+} fr_detail_format_t;
+
+typedef enum {
+	FR_DETAIL_SPOOL_PENDING = 0,				//!< Record hasn't been processed.
+	FR_DETAIL_SPOOL_DONE					//!< Record was processed by a reader.
+} fr_detail_spool_state_t;
+
+/** Header at the start of every spool record
+ *
+ * The reader marks a record as processed by overwriting the single
+ * state byte in place, so "state" is excluded from the checksum.
+ */
+typedef struct {
+	uint32_t	magic;				//!< #FR_DETAIL_SPOOL_MAGIC.
+	uint32_t	length;				//!< Of the encoded attributes, excluding header and padding.
+	uint32_t	checksum;			//!< fr_hash() of the header and the encoded attributes.
+	uint32_t	protocol;			//!< Number of the dictionary the attributes are from.
+	int64_t		timestamp;			//!< When the packet was received, as nanoseconds since the epoch.
+	uint8_t		version;			//!< #FR_DETAIL_SPOOL_VERSION.
+	uint8_t		state;				//!< One of #fr_detail_spool_state_t.
+	uint8_t		reserved[6];			//!< Must be zero.
+} fr_detail_spool_hdr_t;
+
+/** Return the total size of a record holding data_len bytes of attributes
+ *
+ */
+static inline size_t fr_detail_spool_record_size(size_t data_len)
+{
+	return (sizeof(fr_detail_spool_hdr_t) + data_len + (FR_DETAIL_SPOOL_ALIGN - 1)) & ~((size_t) FR_DETAIL_SPOOL_ALIGN - 1);
+}
+
+/** Calculate the checksum of a record
+ *
+ * @param[in] hdr	of the record.  The checksum and state fields are ignored.
+ * @param[in] data	the encoded attributes, hdr->length bytes.
+ * @return the checksum.
+ */
+static inline uint32_t fr_detail_spool_checksum(fr_detail_spool_hdr_t const *hdr, uint8_t const *data)
+{
+	fr_detail_spool_hdr_t tmp = *hdr;
+
+	tmp.checksum = 0;
+	tmp.state = FR_DETAIL_SPOOL_PENDING;
+
+	return fr_hash_update(data, hdr->length, fr_hash(&tmp, sizeof(tmp)));
+}
+
+/** Check that the record at the start of a buffer is complete and undamaged
+ *
+ * @param[in] p		start of the record.  Must be aligned.
+ * @param[in] room	how many bytes are available at p.
+ * @return
+ *	- >0 the total size of the record.
+ *	- 0 if the buffer ends part way through the record.
+ *	- -1 if the record is damaged.
+ */
+static inline ssize_t fr_detail_spool_record_check(uint8_t const *p, size_t room)
+{
+	fr_detail_spool_hdr_t const	*hdr = (fr_detail_spool_hdr_t const *) p;
+	size_t				record_len;
+
+	if (room < sizeof(*hdr)) return 0;
+
+	if ((hdr->magic != FR_DETAIL_SPOOL_MAGIC) || (hdr->version != FR_DETAIL_SPOOL_VERSION)) return -1;
+
+	/*
+	 *	Check the length before padding it, as a damaged
+	 *	length can wrap the record size where size_t is
+	 *	32 bits.  A length which runs past the end of the
+	 *	buffer can't be checksummed, so it's treated as
+	 *	damage, and the caller looks for the next record.
+	 */
+	if (hdr->length > (room - sizeof(*hdr))) return -1;
+
+	record_len = fr_detail_spool_record_size(hdr->length);
+	if (record_len > room) return 0;
+
+	if (fr_detail_spool_checksum(hdr, p + sizeof(*hdr)) != hdr->checksum) return -1;
+
+	return record_len;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,345 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for binary detail ("spool") records
+ *
+ * The records are scanned the same way proto_detail_work reads them:
+ * damaged records are skipped by searching forward on aligned offsets,
+ * and records which are marked as done are ignored.
+ *
+ * @file src/lib/server/detail_spool_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/server/detail_spool.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NUM_RECORDS	8
+
+/** A spool file, and where each record starts in it
+ *
+ */
+typedef struct {
+	uint8_t		*data;
+	size_t		len;
+	size_t		offset[NUM_RECORDS];
+} test_spool_t;
+
+/** Append a record holding "record <n>", padded by a varying amount
+ *
+ */
+static void test_record_add(test_spool_t *spool, unsigned int n)
+{
+	fr_detail_spool_hdr_t	hdr;
+	char			buff[64];
+	size_t			data_len, record_len;
+	uint8_t			*p;
+
+	/*
+	 *	Vary the length, so we test all of the padding sizes
+	 */
+	data_len = snprintf(buff, sizeof(buff), "record %u%.*s", n, (int) n, "........");
+	record_len = fr_detail_spool_record_size(data_len);
+
+	spool->data = talloc_realloc(NULL, spool->data, uint8_t, spool->len + record_len);
+	p = spool->data + spool->len;
+	memset(p, 0, record_len);
+	memcpy(p + sizeof(hdr), buff, data_len);
+
+	hdr = (fr_detail_spool_hdr_t) {
+		.magic = FR_DETAIL_SPOOL_MAGIC,
+		.length = data_len,
+		.protocol = 1,
+		.timestamp = n,
+		.version = FR_DETAIL_SPOOL_VERSION,
+		.state = FR_DETAIL_SPOOL_PENDING
+	};
+	hdr.checksum = fr_detail_spool_checksum(&hdr, p + sizeof(hdr));
+	memcpy(p, &hdr, sizeof(hdr));
+
+	spool->offset[n] = spool->len;
+	spool->len += record_len;
+}
+
+static void test_spool_init(test_spool_t *spool)
+{
+	unsigned int i;
+
+	*spool = (test_spool_t) { 0 };
+	for (i = 0; i < NUM_RECORDS; i++) test_record_add(spool, i);
+}
+
+/** Return the number of the record at offset, or -1 if it's not one of ours
+ *
+ */
+static int test_record_num(test_spool_t const *spool, size_t offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_RECORDS; i++) if (spool->offset[i] == offset) return i;
+
+	return -1;
+}
+
+/** Find the pending records in a spool file
+ *
+ * @param[in] spool	the records are from.
+ * @param[in] data	to scan.  May differ from spool->data.
+ * @param[in] len	of data.
+ * @param[out] found	whether each record was returned.
+ * @return the number of pending records found.
+ */
+static unsigned int test_spool_scan(test_spool_t const *spool, uint8_t const *data, size_t len,
+				    bool found[NUM_RECORDS])
+{
+	size_t		offset = 0;
+	unsigned int	count = 0;
+
+	memset(found, 0, sizeof(bool) * NUM_RECORDS);
+
+	while (offset < len) {
+		fr_detail_spool_hdr_t const	*hdr = (fr_detail_spool_hdr_t const *) (data + offset);
+		ssize_t				slen;
+		int				n;
+
+		slen = fr_detail_spool_record_check(data + offset, len - offset);
+		if (slen == 0) break;
+
+		if (slen < 0) {
+			offset += FR_DETAIL_SPOOL_ALIGN;
+			continue;
+		}
+
+		n = test_record_num(spool, offset);
+		TEST_CHECK(n >= 0);
+		TEST_MSG("Found a record at offset %zu, which isn't the start of a record", offset);
+
+		TEST_CHECK((offset + slen) <= len);
+		offset += slen;
+
+		if (n < 0) continue;
+		if (hdr->state == FR_DETAIL_SPOOL_DONE) continue;
+
+		TEST_CHECK(hdr->timestamp == n);
+		found[n] = true;
+		count++;
+	}
+
+	return count;
+}
+
+static void test_records(void)
+{
+	test_spool_t	spool;
+	bool		found[NUM_RECORDS];
+	unsigned int	i;
+
+	test_spool_init(&spool);
+
+	TEST_CHECK(test_spool_scan(&spool, spool.data, spool.len, found) == NUM_RECORDS);
+	for (i = 0; i < NUM_RECORDS; i++) {
+		TEST_CHECK(found[i]);
+		TEST_MSG("Record %u was not found", i);
+		TEST_CHECK((spool.offset[i] % FR_DETAIL_SPOOL_ALIGN) == 0);
+	}
+
+	talloc_free(spool.data);
+}
+
+static void test_damaged(void)
+{
+	test_spool_t	spool;
+	bool		found[NUM_RECORDS];
+	size_t		i;
+
+	test_spool_init(&spool);
+
+	/*
+	 *	Damage every byte of record 3 in turn.  Only
+	 *	record 3 should be skipped, except for damage to
+	 *	the state byte, which isn't covered by the checksum.
+	 */
+	for (i = spool.offset[3]; i < spool.offset[4]; i++) {
+		bool	pad = (i >= (spool.offset[3] + sizeof(fr_detail_spool_hdr_t) +
+				     ((fr_detail_spool_hdr_t *) (spool.data + spool.offset[3]))->length));
+		bool	state = (i == (spool.offset[3] + offsetof(fr_detail_spool_hdr_t, state)));
+
+		spool.data[i] ^= 0x40;
+
+		/*
+		 *	Neither padding nor state are covered by
+		 *	the checksum.
+		 */
+		if (!pad && !state) {
+			TEST_CHECK(test_spool_scan(&spool, spool.data, spool.len, found) == (NUM_RECORDS - 1));
+			TEST_MSG("Damage at offset %zu of record 3 wasn't detected", i - spool.offset[3]);
+			TEST_CHECK(!found[3]);
+			TEST_CHECK(found[2] && found[4]);
+			TEST_MSG("Damage at offset %zu of record 3 affected other records", i - spool.offset[3]);
+		}
+
+		spool.data[i] ^= 0x40;
+	}
+
+	TEST_CASE("Several damaged records in a row");
+	spool.data[spool.offset[1]] ^= 0xff;
+	spool.data[spool.offset[2] + sizeof(fr_detail_spool_hdr_t)] ^= 0xff;
+	spool.data[spool.offset[3] + offsetof(fr_detail_spool_hdr_t, version)] ^= 0xff;
+
+	TEST_CHECK(test_spool_scan(&spool, spool.data, spool.len, found) == (NUM_RECORDS - 3));
+	TEST_CHECK(found[0] && !found[1] && !found[2] && !found[3] && found[4]);
+
+	talloc_free(spool.data);
+}
+
+static void test_length(void)
+{
+	test_spool_t		spool;
+	bool			found[NUM_RECORDS];
+	fr_detail_spool_hdr_t	*hdr;
+	uint32_t		lengths[] = { UINT32_MAX, UINT32_MAX - sizeof(fr_detail_spool_hdr_t) + 1,
+					      UINT32_MAX - FR_DETAIL_SPOOL_ALIGN + 1, 0x80000000 };
+	size_t			i;
+
+	test_spool_init(&spool);
+
+	/*
+	 *	Lengths which would wrap the record size on a
+	 *	32-bit system, or which run past the end of the
+	 *	file.  These must be rejected before the checksum
+	 *	is calculated, as that reads length bytes.  Only
+	 *	the damaged record should be skipped.
+	 */
+	hdr = (fr_detail_spool_hdr_t *) (spool.data + spool.offset[5]);
+	for (i = 0; i < NUM_ELEMENTS(lengths) + 1; i++) {
+		uint32_t length = (i < NUM_ELEMENTS(lengths)) ? lengths[i] :
+				  (spool.len - spool.offset[5] - sizeof(*hdr) + 1);
+
+		hdr->length = length;
+		TEST_CHECK(fr_detail_spool_record_check((uint8_t const *) hdr, spool.len - spool.offset[5]) < 0);
+		TEST_MSG("Length %u was accepted", length);
+
+		TEST_CHECK(test_spool_scan(&spool, spool.data, spool.len, found) == (NUM_RECORDS - 1));
+		TEST_CHECK(!found[5] && found[6] && found[7]);
+	}
+
+	talloc_free(spool.data);
+}
+
+static void test_truncated(void)
+{
+	test_spool_t	spool;
+	bool		found[NUM_RECORDS];
+	size_t		len;
+
+	test_spool_init(&spool);
+
+	/*
+	 *	Copy each length to its own buffer, so anything
+	 *	which reads past the end can be caught by valgrind,
+	 *	or ASAN.
+	 */
+	for (len = 0; len <= spool.len; len++) {
+		uint8_t		*data = talloc_memdup(NULL, spool.data, len);
+		unsigned int	i, complete = 0;
+
+		for (i = 0; i < NUM_RECORDS; i++) {
+			if ((spool.offset[i] + fr_detail_spool_record_size(((fr_detail_spool_hdr_t *)
+			     (spool.data + spool.offset[i]))->length)) <= len) complete++;
+		}
+
+		TEST_CHECK(test_spool_scan(&spool, data, len, found) == complete);
+		TEST_MSG("Expected %u records from %zu bytes", complete, len);
+
+		talloc_free(data);
+	}
+
+	talloc_free(spool.data);
+}
+
+/** Mark records done with several outstanding, as the listener does with max_outstanding > 1
+ *
+ */
+static void test_mark_done(void)
+{
+	test_spool_t	spool;
+	bool		found[NUM_RECORDS];
+	char		filename[] = "/tmp/detail_spool_tests.XXXXXX";
+	uint8_t const	*map;
+	int		fd, i;
+	uint8_t		state = FR_DETAIL_SPOOL_DONE;
+
+	test_spool_init(&spool);
+
+	fd = mkstemp(filename);
+	TEST_ASSERT(fd >= 0);
+	unlink(filename);
+	TEST_ASSERT(write(fd, spool.data, spool.len) == (ssize_t) spool.len);
+
+	map = mmap(NULL, spool.len, PROT_READ, MAP_SHARED, fd, 0);
+	TEST_ASSERT(map != MAP_FAILED);
+
+	/*
+	 *	Reply to the outstanding records out of order.
+	 */
+	for (i = 0; i < NUM_RECORDS; i += 2) {
+		TEST_CHECK(pwrite(fd, &state, sizeof(state),
+				  spool.offset[i] + offsetof(fr_detail_spool_hdr_t, state)) == sizeof(state));
+	}
+	TEST_CHECK(pwrite(fd, &state, sizeof(state),
+			  spool.offset[NUM_RECORDS - 1] + offsetof(fr_detail_spool_hdr_t, state)) == sizeof(state));
+
+	TEST_CASE("Records which are done are skipped when the file is read again");
+	TEST_CHECK(test_spool_scan(&spool, map, spool.len, found) == ((NUM_RECORDS / 2) - 1));
+	for (i = 0; i < NUM_RECORDS; i++) {
+		TEST_CHECK(found[i] == ((i & 1) && (i != (NUM_RECORDS - 1))));
+		TEST_MSG("Record %d was %s", i, found[i] ? "found" : "not found");
+
+		/*
+		 *	Marking a record done doesn't affect the checksum
+		 */
+		TEST_CHECK(fr_detail_spool_record_check(map + spool.offset[i], spool.len - spool.offset[i]) > 0);
+	}
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		TEST_CHECK(pwrite(fd, &state, sizeof(state),
+				  spool.offset[i] + offsetof(fr_detail_spool_hdr_t, state)) == sizeof(state));
+	}
+
+	TEST_CASE("Nothing is left to replay once every record is done");
+	TEST_CHECK(test_spool_scan(&spool, map, spool.len, found) == 0);
+
+	munmap(UNCONST(uint8_t *, map), spool.len);
+	close(fd);
+	talloc_free(spool.data);
+}
+
+TEST_LIST = {
+	{ "records",		test_records },
+	{ "damaged",		test_damaged },
+	{ "length",		test_length },
+	{ "truncated",		test_truncated },
+	{ "mark_done",		test_mark_done },
+
+	{ NULL }
+};
@@ -0,0 +1,6 @@
+TARGET		:= detail_spool_tests
+
+SOURCES		:= detail_spool_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_PREREQS	:= libfreeradius-util.la
@@ -23,6 +23,7 @@
  * @author Alan DeKok (aland@freeradius.org)
  * @copyright 2014 The FreeRADIUS server project
  */
+#include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/exfile.h>
@@ -34,6 +35,11 @@
 
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#  define IOV_MAX 16
+#endif
 
 typedef struct {
 	int			fd;			//!< File descriptor associated with an entry.
@@ -44,6 +50,39 @@ typedef struct {
 	char			*filename;		//!< Filename.
 } exfile_entry_t;
 
+/** A record waiting to be written by the asynchronous writer
+ *
+ */
+typedef struct {
+	uint32_t		hash;			//!< Hash of the filename, for cheap comparison.
+	mode_t			permissions;		//!< To use if the file is created.
+	gid_t			gid;			//!< To set if the file is created, or -1.
+	char const		*filename;		//!< File to write to.  Stored after data.
+	size_t			len;			//!< Length of data.
+	uint8_t			data[];			//!< The formatted record.
+} exfile_record_t;
+
+/** State for the asynchronous writer
+ *
+ * Callers push records onto a lock-free queue.  A single writer thread
+ * pops them off, and writes all the records for a file with one writev()
+ * while holding the file's lock.
+ */
+typedef struct {
+	exfile_async_conf_t	conf;			//!< How batches are formed and committed.
+	fr_atomic_queue_t	*queue;			//!< Records waiting to be written.
+
+	pthread_t		thread;			//!< The writer thread.
+	pthread_mutex_t		mutex;			//!< Used with the condition variables below.
+	pthread_cond_t		wakeup;			//!< Signalled when the writer should wake up.
+	pthread_cond_t		space;			//!< Signalled when records have been removed from the queue.
+
+	_Atomic(int64_t)	queued;			//!< Number of records pushed, but not yet popped.
+	atomic_bool		sleeping;		//!< The writer is waiting for records.
+	atomic_bool		stop;			//!< The writer should drain the queue and exit.
+	_Atomic(uint32_t)	blocked;		//!< Number of callers waiting for space in the queue.
+} exfile_async_t;
+
 
 struct exfile_s {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
@@ -55,11 +94,26 @@ struct exfile_s {
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
 	fr_pair_list_t		trigger_args;		//!< Arguments to pass to trigger.
+	exfile_async_t		*async;			//!< Asynchronous writer, if enabled.
 };
 
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
 					//!< before giving up.
 
+#define EXFILE_ASYNC_MAX_BATCH 1024	//!< Maximum number of records the writer pops
+					//!< before writing them out.
+
+CONF_PARSER const exfile_async_config[] = {
+	{ FR_CONF_OFFSET("queue_size", FR_TYPE_UINT32, exfile_async_conf_t, queue_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("commit_delay", FR_TYPE_TIME_DELTA, exfile_async_conf_t, commit_delay), .dflt = "0" },
+	{ FR_CONF_OFFSET("commit_count", FR_TYPE_UINT32, exfile_async_conf_t, commit_count), .dflt = "1" },
+	{ FR_CONF_OFFSET("fsync", FR_TYPE_BOOL, exfile_async_conf_t, fsync), .dflt = "no" },
+	{ FR_CONF_OFFSET("block", FR_TYPE_BOOL, exfile_async_conf_t, block), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+
+static void exfile_async_stop(exfile_t *ef);
+
 /** Send an exfile trigger.
  *
  * @param[in] ef to send trigger for.
@@ -124,6 +178,14 @@ static int _exfile_free(exfile_t *ef)
 {
 	uint32_t i;
 
+	/*
+	 *	The writer uses the entries, so it has to
+	 *	finish before they're cleaned up.
+	 */
+	if (ef->async) exfile_async_stop(ef);
+
+	if (!ef->locking) return 0;
+
 	pthread_mutex_lock(&ef->mutex);
 
 	for (i = 0; i < ef->max_entries; i++) {
@@ -211,15 +273,46 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
 }
 
 
+/*
+ *	Open the file, creating it if necessary.  If a gid is
+ *	given, the group of the file is set when we create it,
+ *	so that nothing has to chown() it on every write.
+ */
+static int exfile_open_create(char const *filename, mode_t permissions, gid_t gid)
+{
+	int fd;
+
+	if (gid == (gid_t) -1) return open(filename, O_RDWR | O_CREAT, permissions);
+
+	for (;;) {
+		fd = open(filename, O_RDWR);
+		if ((fd >= 0) || (errno != ENOENT)) return fd;
+
+		fd = open(filename, O_RDWR | O_CREAT | O_EXCL, permissions);
+		if (fd >= 0) break;
+
+		/*
+		 *	Someone else created it first, open theirs.
+		 */
+		if (errno != EEXIST) return -1;
+	}
+
+	if (fchown(fd, -1, gid) < 0) {
+		WARN("Failed changing group of file %s to %u: %s", filename, (unsigned int) gid, fr_syserror(errno));
+	}
+
+	return fd;
+}
+
 /*
  *	Try to open the file. It it doesn't exist, try to
  *	create it's parent directories.
  */
-static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissions)
+static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissions, gid_t gid)
 {
 	int fd;
 
-	fd = open(filename, O_RDWR | O_CREAT, permissions);
+	fd = exfile_open_create(filename, permissions, gid);
 	if (fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
@@ -254,7 +347,7 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
 		}
 		talloc_free(dir);
 
-		fd = open(filename, O_RDWR | O_CREAT, permissions);
+		fd = exfile_open_create(filename, permissions, gid);
 		if (fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s", filename, fr_syserror(errno));
 			return -1;
@@ -265,19 +358,10 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
 }
 
 
-/** Open a new log file, or maybe an existing one.
- *
- * When multithreaded, the FD is locked via a mutex.  This way we're
- * sure that no other thread is writing to the file.
+/** Open a new log file, or maybe an existing one, setting its group if we create it
  *
- * @param ef The logfile context returned from exfile_init().
- * @param filename the file to open.
- * @param permissions to use.
- * @return
- *	- FD used to write to the file.
- *	- -1 on failure.
  */
-int exfile_open(exfile_t *ef, char const *filename, mode_t permissions)
+static int exfile_open_gid(exfile_t *ef, char const *filename, mode_t permissions, gid_t gid)
 {
 	int i, tries, unused = -1, found = -1, oldest = -1;
 	bool do_cleanup = false;
@@ -291,7 +375,7 @@ int exfile_open(exfile_t *ef, char const *filename, mode_t permissions)
 	 *	No locking: just return a new FD.
 	 */
 	if (!ef->locking) {
-		found = exfile_open_mkdir(ef, filename, permissions);
+		found = exfile_open_mkdir(ef, filename, permissions, gid);
 		if (found < 0) return -1;
 
 		(void) lseek(found, 0, SEEK_END);
@@ -402,7 +486,7 @@ int exfile_open(exfile_t *ef, char const *filename, mode_t permissions)
 	ef->entries[i].fd = -1;
 
 reopen:
-	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions);
+	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions, gid);
 	if (ef->entries[i].fd < 0) goto error;
 
 	exfile_trigger_exec(ef, &ef->entries[i], "open");
@@ -435,7 +519,7 @@ try_lock:
 		}
 
 		close(ef->entries[i].fd);
-		ef->entries[i].fd = open(filename, O_RDWR | O_CREAT, permissions);
+		ef->entries[i].fd = exfile_open_create(filename, permissions, gid);
 		if (ef->entries[i].fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s", filename, fr_syserror(errno));
 			goto error;
@@ -512,6 +596,23 @@ try_lock:
 	return ef->entries[i].fd;
 }
 
+/** Open a new log file, or maybe an existing one.
+ *
+ * When multithreaded, the FD is locked via a mutex.  This way we're
+ * sure that no other thread is writing to the file.
+ *
+ * @param ef The logfile context returned from exfile_init().
+ * @param filename the file to open.
+ * @param permissions to use.
+ * @return
+ *	- FD used to write to the file.
+ *	- -1 on failure.
+ */
+int exfile_open(exfile_t *ef, char const *filename, mode_t permissions)
+{
+	return exfile_open_gid(ef, filename, permissions, (gid_t) -1);
+}
+
 /** Close the log file.  Really just return it to the pool.
  *
  * When multithreaded, the FD is locked via a mutex. This way we're sure that no other thread is
@@ -555,3 +656,396 @@ int exfile_close(exfile_t *ef, int fd)
 	fr_strerror_const("Attempt to unlock file which is not tracked");
 	return -1;
 }
+
+/** Wait until the deadline, or until a caller wakes up the writer
+ *
+ * @param[in] async	writer state.
+ * @param[in] when	to stop waiting.
+ */
+static void exfile_async_wait(exfile_async_t *async, fr_time_t when)
+{
+	struct timespec ts = fr_time_to_timespec(when);
+
+	pthread_mutex_lock(&async->mutex);
+
+	/*
+	 *	Callers only signal the writer if it's sleeping, so
+	 *	check the queue again after saying that we are.
+	 */
+	atomic_store(&async->sleeping, true);
+	if ((atomic_load(&async->queued) <= 0) && !atomic_load(&async->stop)) {
+		(void) pthread_cond_timedwait(&async->wakeup, &async->mutex, &ts);
+	}
+	atomic_store(&async->sleeping, false);
+
+	pthread_mutex_unlock(&async->mutex);
+}
+
+/** Pop a batch of records off the queue
+ *
+ * Waits for up to commit_delay for commit_count records to arrive.
+ *
+ * @param[in] async	writer state.
+ * @param[out] batch	to write popped records to.
+ * @return
+ *	- The number of records popped.
+ *	- 0 if the writer has been told to stop, and the queue is empty.
+ */
+static unsigned int exfile_async_gather(exfile_async_t *async, exfile_record_t **batch)
+{
+	unsigned int	num = 0;
+	fr_time_t	deadline = fr_time_wrap(0);
+	void		*rec;
+
+	for (;;) {
+		unsigned int popped = 0;
+
+		while ((num < EXFILE_ASYNC_MAX_BATCH) && fr_atomic_queue_pop(async->queue, &rec)) {
+			batch[num++] = rec;
+			popped++;
+		}
+
+		if (popped) {
+			atomic_fetch_sub(&async->queued, popped);
+
+			/*
+			 *	Let any blocked callers know there's
+			 *	space in the queue again.
+			 */
+			if (atomic_load(&async->blocked) > 0) {
+				pthread_mutex_lock(&async->mutex);
+				pthread_cond_broadcast(&async->space);
+				pthread_mutex_unlock(&async->mutex);
+			}
+		}
+
+		if ((num >= EXFILE_ASYNC_MAX_BATCH) || (num >= async->conf.commit_count)) break;
+
+		if (atomic_load(&async->stop)) break;
+
+		if (num == 0) {
+			exfile_async_wait(async, fr_time_add(fr_time(), fr_time_delta_from_sec(1)));
+			continue;
+		}
+
+		/*
+		 *	Group commit.  Wait a little while for
+		 *	more records, so they can all be written
+		 *	(and synced) together.
+		 */
+		if (fr_time_eq(deadline, fr_time_wrap(0))) {
+			deadline = fr_time_add(fr_time(), async->conf.commit_delay);
+		} else if (fr_time_gteq(fr_time(), deadline)) {
+			break;
+		}
+
+		exfile_async_wait(async, deadline);
+	}
+
+	return num;
+}
+
+/** Write all of the data, even if writev() only does part of it
+ *
+ * @param[in] fd	to write to.
+ * @param[in] vector	to write.  Modified as data is written.
+ * @param[in] iovcnt	Number of elements in vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int exfile_async_writev(int fd, struct iovec *vector, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t	slen;
+
+		slen = writev(fd, vector, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		while ((iovcnt > 0) && ((size_t) slen >= vector->iov_len)) {
+			slen -= vector->iov_len;
+			vector++;
+			iovcnt--;
+		}
+
+		if (slen > 0) {
+			vector->iov_base = ((uint8_t *) vector->iov_base) + slen;
+			vector->iov_len -= slen;
+		}
+	}
+
+	return 0;
+}
+
+/** Write a batch of records out to their files
+ *
+ * All records for the same file are written with a single exfile_open(),
+ * so the file is locked (and checked for rotation) once per batch, not once
+ * per record.  Records for a file are written in the order they were queued.
+ *
+ * @param[in] ef	the records are for.
+ * @param[in] batch	of records.  All records are freed.
+ * @param[in] num	Number of records in the batch.
+ */
+static void exfile_async_flush(exfile_t *ef, exfile_record_t **batch, unsigned int num)
+{
+	exfile_record_t		*group[EXFILE_ASYNC_MAX_BATCH];
+	struct iovec		vector[EXFILE_ASYNC_MAX_BATCH];
+	unsigned int		i, j, cnt;
+
+	for (i = 0; i < num; i++) {
+		exfile_record_t	*rec = batch[i];
+		int		fd;
+
+		if (!rec) continue;	/* Already written as part of an earlier group */
+
+		cnt = 0;
+		for (j = i; j < num; j++) {
+			if (!batch[j] ||
+			    (batch[j]->hash != rec->hash) ||
+			    (strcmp(batch[j]->filename, rec->filename) != 0)) continue;
+
+			group[cnt] = batch[j];
+			vector[cnt].iov_base = batch[j]->data;
+			vector[cnt].iov_len = batch[j]->len;
+			cnt++;
+
+			batch[j] = NULL;
+		}
+
+		fd = exfile_open_gid(ef, rec->filename, rec->permissions, rec->gid);
+		if (fd < 0) {
+			PERROR("Failed writing %u record(s) to %s", cnt, rec->filename);
+			goto next;
+		}
+
+		if (exfile_async_writev(fd, vector, cnt) < 0) {
+			ERROR("Failed writing %u record(s) to %s: %s", cnt, rec->filename, fr_syserror(errno));
+
+		} else if (ef->async->conf.fsync && (fsync(fd) < 0)) {
+			ERROR("Failed syncing %s: %s", rec->filename, fr_syserror(errno));
+		}
+
+		exfile_close(ef, fd);
+
+	next:
+		for (j = 0; j < cnt; j++) talloc_free(group[j]);
+	}
+}
+
+/** Write records to their files until told to stop
+ *
+ * @param[in] uctx	the exfile_t to write records for.
+ * @return NULL.
+ */
+static void *exfile_async_writer(void *uctx)
+{
+	exfile_t		*ef = talloc_get_type_abort(uctx, exfile_t);
+	exfile_record_t		*batch[EXFILE_ASYNC_MAX_BATCH];
+	unsigned int		num;
+
+	while ((num = exfile_async_gather(ef->async, batch)) > 0) exfile_async_flush(ef, batch, num);
+
+	return NULL;
+}
+
+/** Tell the writer to stop, and wait for it to write out anything that's queued
+ *
+ * @param[in] ef	to stop the writer for.
+ */
+static void exfile_async_stop(exfile_t *ef)
+{
+	exfile_async_t	*async = ef->async;
+	void		*rec;
+
+	pthread_mutex_lock(&async->mutex);
+	atomic_store(&async->stop, true);
+	pthread_cond_signal(&async->wakeup);
+	pthread_mutex_unlock(&async->mutex);
+
+	pthread_join(async->thread, NULL);
+
+	while (fr_atomic_queue_pop(async->queue, &rec)) talloc_free(rec);
+
+	pthread_cond_destroy(&async->space);
+	pthread_cond_destroy(&async->wakeup);
+	pthread_mutex_destroy(&async->mutex);
+
+	ef->async = NULL;
+	talloc_free(async);
+}
+
+/** Write records from a dedicated thread, instead of in the caller
+ *
+ * After this is called, exfile_async_write() copies records onto a queue and
+ * returns immediately.  A writer thread collects the records for each file
+ * and writes them out together.
+ *
+ * Rotation and locking are handled exactly as for exfile_open(), but by the
+ * writer thread.  The file is locked once per batch, instead of once per record.
+ *
+ * @param[in] ef	to enable asynchronous writes for.
+ * @param[in] conf	controlling how batches are formed, and what happens when
+ *			the queue is full.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_async_enable(exfile_t *ef, exfile_async_conf_t const *conf)
+{
+	exfile_async_t	*async;
+	int		ret;
+
+	if (ef->async) {
+		fr_strerror_const("Asynchronous writes are already enabled");
+		return -1;
+	}
+
+	if (conf->queue_size < 2) {
+		fr_strerror_const("Asynchronous write queue_size must be at least 2");
+		return -1;
+	}
+
+	MEM(async = talloc_zero(ef, exfile_async_t));
+	async->conf = *conf;
+	if (!async->conf.commit_count) async->conf.commit_count = 1;
+
+	async->queue = fr_atomic_queue_alloc(async, conf->queue_size);
+	if (!async->queue) {
+		fr_strerror_const("Failed allocating asynchronous write queue");
+	error:
+		talloc_free(async);
+		return -1;
+	}
+
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->wakeup, NULL);
+	pthread_cond_init(&async->space, NULL);
+
+	ef->async = async;
+
+	ret = pthread_create(&async->thread, NULL, exfile_async_writer, ef);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(ret));
+		ef->async = NULL;
+		pthread_cond_destroy(&async->space);
+		pthread_cond_destroy(&async->wakeup);
+		pthread_mutex_destroy(&async->mutex);
+		goto error;
+	}
+
+	talloc_set_destructor(ef, _exfile_free);
+
+	return 0;
+}
+
+/** Queue a record to be written to a file by the writer thread
+ *
+ * The data is copied, so the caller can free it as soon as this function returns.
+ * All of the elements of vector are written together, and will not be interleaved
+ * with other records.
+ *
+ * @param[in] ef		with asynchronous writes enabled.
+ * @param[in] filename		to write to.
+ * @param[in] permissions	to use if the file has to be created.
+ * @param[in] gid		group to give the file if it has to be created,
+ *				or -1 to leave the group alone.  The writer thread
+ *				sets it, so callers don't need to chown() the file.
+ * @param[in] vector		Data to write.
+ * @param[in] vector_len	Number of elements in vector.
+ * @return
+ *	- 0 if the record was queued.
+ *	- -1 if the record could not be queued.
+ */
+int exfile_async_write(exfile_t *ef, char const *filename, mode_t permissions, gid_t gid,
+		       struct iovec const *vector, int vector_len)
+{
+	exfile_async_t	*async = ef->async;
+	exfile_record_t	*rec;
+	size_t		len = 0, name_len;
+	uint8_t		*p;
+	int		i;
+
+	if (!async) {
+		fr_strerror_const("Asynchronous writes are not enabled");
+		return -1;
+	}
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+	name_len = strlen(filename);
+
+	/*
+	 *	Allocated in the NULL ctx, as it's freed by the
+	 *	writer thread.
+	 */
+	rec = talloc_size(NULL, sizeof(*rec) + len + name_len + 1);
+	if (!rec) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	talloc_set_name_const(rec, "exfile_record_t");
+
+	rec->hash = fr_hash_string(filename);
+	rec->permissions = permissions;
+	rec->gid = gid;
+	rec->len = len;
+
+	p = rec->data;
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+	memcpy(p, filename, name_len + 1);
+	rec->filename = (char const *) p;
+
+	for (;;) {
+		fr_time_t	when;
+		struct timespec	ts;
+		bool		pushed;
+
+		if (fr_atomic_queue_push(async->queue, rec)) break;
+
+		if (!async->conf.block) {
+			talloc_free(rec);
+			fr_strerror_printf("Write queue for %s is full", filename);
+			return -1;
+		}
+
+		/*
+		 *	Backpressure.  Wait for the writer to make
+		 *	some space.  The writer may have done that
+		 *	before it saw we were blocked, so try again
+		 *	before going to sleep.
+		 */
+		when = fr_time_add(fr_time(), fr_time_delta_from_msec(10));
+		ts = fr_time_to_timespec(when);
+
+		pthread_mutex_lock(&async->mutex);
+		atomic_fetch_add(&async->blocked, 1);
+		pushed = fr_atomic_queue_push(async->queue, rec);
+		if (!pushed) {
+			pthread_cond_signal(&async->wakeup);
+			(void) pthread_cond_timedwait(&async->space, &async->mutex, &ts);
+		}
+		atomic_fetch_sub(&async->blocked, 1);
+		pthread_mutex_unlock(&async->mutex);
+
+		if (pushed) break;
+	}
+
+	/*
+	 *	Only take the mutex if the writer is waiting
+	 *	for records.  Under load it won't be.
+	 */
+	atomic_fetch_add(&async->queued, 1);
+	if (atomic_load(&async->sleeping)) {
+		pthread_mutex_lock(&async->mutex);
+		pthread_cond_signal(&async->wakeup);
+		pthread_mutex_unlock(&async->mutex);
+	}
+
+	return 0;
+}
@@ -25,8 +25,12 @@
  */
 RCSIDH(exfile_h, "$Id$")
 
+#include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/server/request.h>
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,6 +39,22 @@ extern "C" {
  */
 typedef struct exfile_s exfile_t;
 
+/** Configuration for the asynchronous writer
+ *
+ */
+typedef struct {
+	uint32_t		queue_size;		//!< Maximum number of records waiting to be written.
+	fr_time_delta_t		commit_delay;		//!< How long to wait for more records before
+							///< writing a batch.
+	uint32_t		commit_count;		//!< Write a batch as soon as this many records
+							///< are queued.
+	bool			fsync;			//!< fsync() each batch before releasing the file.
+	bool			block;			//!< Block the caller when the queue is full,
+							///< instead of failing the write.
+} exfile_async_conf_t;
+
+extern CONF_PARSER const exfile_async_config[];
+
 exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, fr_time_delta_t idle, bool locking);
 
 void		exfile_enable_triggers(exfile_t *ef, CONF_SECTION *cs, char const *trigger_prefix,
@@ -45,6 +65,11 @@ int		exfile_open(exfile_t *lf, char const *filename, mode_t permissions);
 
 int		exfile_close(exfile_t *lf, CC_RELEASE_HANDLE("exfile_fd") int fd);
 
+int		exfile_async_enable(exfile_t *ef, exfile_async_conf_t const *conf) CC_HINT(nonnull);
+
+int		exfile_async_write(exfile_t *ef, char const *filename, mode_t permissions, gid_t gid,
+				   struct iovec const *vector, int vector_len) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
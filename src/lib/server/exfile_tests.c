@@ -0,0 +1,359 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for asynchronous exfile writes
+ *
+ * @file src/lib/server/exfile_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#	define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NUM_WRITERS	4
+#define NUM_FILES	3
+#define NUM_RECORDS	3000
+
+static char const *filenames[] = { "one", "two", "three", "held", "full" };
+
+/** Global initialisation
+ *
+ * The writer converts fr_time_t deadlines to wallclock time for
+ * pthread_cond_timedwait(), which needs the time library to be started.
+ */
+static void test_init(void)
+{
+	if (fr_time_start() < 0) {
+		fr_perror("exfile_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+/** Create a directory for the test to write files to
+ *
+ * Each test gets its own, as tests may run in separate processes.
+ */
+static char *test_dir_alloc(void)
+{
+	char *dir;
+
+	dir = talloc_strdup(NULL, "/tmp/exfile_tests.XXXXXX");
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "exfile_tests: Failed creating %s: %s\n", dir, fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	return dir;
+}
+
+static void test_dir_free(char *dir)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(filenames); i++) {
+		char *path = talloc_asprintf(dir, "%s/%s", dir, filenames[i]);
+
+		(void) unlink(path);
+	}
+	(void) rmdir(dir);
+	talloc_free(dir);
+}
+
+/** Read a whole file into a nul terminated buffer
+ *
+ */
+static char *test_file_read(char const *dir, char const *name)
+{
+	char		*path, *data;
+	struct stat	st;
+	int		fd;
+
+	path = talloc_asprintf(NULL, "%s/%s", dir, name);
+	fd = open(path, O_RDONLY);
+	talloc_free(path);
+	if (fd < 0) return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	data = talloc_array(NULL, char, st.st_size + 1);
+	if (read(fd, data, st.st_size) != st.st_size) {
+		talloc_free(data);
+		close(fd);
+		return NULL;
+	}
+	data[st.st_size] = '\0';
+	close(fd);
+
+	return data;
+}
+
+static int test_record_write(exfile_t *ef, char const *dir, char const *name, unsigned int writer, unsigned int seq)
+{
+	char		path[PATH_MAX], line[64];
+	struct iovec	vector[2];
+	int		len;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	len = snprintf(line, sizeof(line), "writer %u record %u\n", writer, seq);
+
+	/*
+	 *	Split the record, so we can check that the
+	 *	elements of a vector aren't interleaved.
+	 */
+	vector[0].iov_base = line;
+	vector[0].iov_len = len - 1;
+	vector[1].iov_base = line + len - 1;
+	vector[1].iov_len = 1;
+
+	return exfile_async_write(ef, path, 0600, (gid_t) -1, vector, NUM_ELEMENTS(vector));
+}
+
+/** Check that a file contains count records from each writer, in order
+ *
+ */
+static void test_records_check(char const *dir, char const *name, unsigned int num_writers, unsigned int count)
+{
+	char		*data, *p, *eol;
+	unsigned int	next[NUM_WRITERS] = { 0 };
+	unsigned int	i, writer, seq;
+
+	data = test_file_read(dir, name);
+	TEST_CHECK(data != NULL);
+	TEST_MSG("Failed reading %s/%s", dir, name);
+	if (!data) return;
+
+	for (p = data; *p; p = eol + 1) {
+		eol = strchr(p, '\n');
+		TEST_CHECK(eol != NULL);
+		TEST_MSG("Truncated record in %s: %s", name, p);
+		if (!eol) break;
+		*eol = '\0';
+
+		if (!TEST_CHECK(sscanf(p, "writer %u record %u", &writer, &seq) == 2) ||
+		    !TEST_CHECK(writer < num_writers)) {
+			TEST_MSG("Bad record in %s: %s", name, p);
+			break;
+		}
+
+		/*
+		 *	Records from one writer must be in the
+		 *	order that writer queued them.
+		 */
+		TEST_CHECK(seq == next[writer]);
+		TEST_MSG("Expected writer %u record %u in %s, got record %u", writer, next[writer], name, seq);
+		next[writer] = seq + 1;
+	}
+
+	for (i = 0; i < num_writers; i++) {
+		TEST_CHECK(next[i] == count);
+		TEST_MSG("Expected %u records from writer %u in %s, got %u", count, i, name, next[i]);
+	}
+
+	talloc_free(data);
+}
+
+static void test_async_enable(void)
+{
+	exfile_t		*ef;
+	exfile_async_conf_t	conf = { .queue_size = 16, .commit_count = 1, .block = true };
+	char			*dir = test_dir_alloc();
+
+	ef = exfile_init(NULL, 16, fr_time_delta_from_sec(60), true);
+	TEST_ASSERT(ef != NULL);
+
+	TEST_CASE("Writes fail until async is enabled");
+	TEST_CHECK(test_record_write(ef, dir, "one", 0, 0) < 0);
+
+	TEST_CASE("Queues must hold at least two records");
+	conf.queue_size = 1;
+	TEST_CHECK(exfile_async_enable(ef, &conf) < 0);
+
+	TEST_CASE("Enable async writes");
+	conf.queue_size = 16;
+	TEST_CHECK(exfile_async_enable(ef, &conf) == 0);
+
+	TEST_CASE("Async writes can't be enabled twice");
+	TEST_CHECK(exfile_async_enable(ef, &conf) < 0);
+
+	TEST_CHECK(test_record_write(ef, dir, "one", 0, 0) == 0);
+
+	talloc_free(ef);
+
+	test_records_check(dir, "one", 1, 1);
+
+	test_dir_free(dir);
+}
+
+typedef struct {
+	exfile_t	*ef;
+	char const	*dir;
+	unsigned int	writer;
+	unsigned int	failed;
+} test_writer_t;
+
+static void *test_writer(void *uctx)
+{
+	test_writer_t	*w = uctx;
+	unsigned int	i;
+
+	for (i = 0; i < NUM_RECORDS; i++) {
+		if (test_record_write(w->ef, w->dir, filenames[i % NUM_FILES], w->writer, i / NUM_FILES) < 0) w->failed++;
+	}
+
+	return NULL;
+}
+
+static void test_async_ordering(void)
+{
+	exfile_t		*ef;
+	exfile_async_conf_t	conf = {
+					.queue_size = 64,
+					.commit_count = 16,
+					.commit_delay = fr_time_delta_from_msec(1),
+					.block = true
+				};
+	test_writer_t		writers[NUM_WRITERS];
+	pthread_t		threads[NUM_WRITERS];
+	char			*dir = test_dir_alloc();
+	unsigned int		i;
+
+	ef = exfile_init(NULL, 16, fr_time_delta_from_sec(60), true);
+	TEST_ASSERT(ef != NULL);
+	TEST_ASSERT(exfile_async_enable(ef, &conf) == 0);
+
+	/*
+	 *	The queue is much smaller than the number of
+	 *	records, so the writers will block, too.
+	 */
+	for (i = 0; i < NUM_WRITERS; i++) {
+		writers[i] = (test_writer_t) { .ef = ef, .dir = dir, .writer = i };
+		TEST_ASSERT(pthread_create(&threads[i], NULL, test_writer, &writers[i]) == 0);
+	}
+
+	for (i = 0; i < NUM_WRITERS; i++) {
+		pthread_join(threads[i], NULL);
+		TEST_CHECK(writers[i].failed == 0);
+		TEST_MSG("Writer %u failed to queue %u records", i, writers[i].failed);
+	}
+
+	talloc_free(ef);
+
+	for (i = 0; i < NUM_FILES; i++) test_records_check(dir, filenames[i], NUM_WRITERS, NUM_RECORDS / NUM_FILES);
+
+	test_dir_free(dir);
+}
+
+static void test_async_full(void)
+{
+	exfile_t		*ef;
+	exfile_async_conf_t	conf = { .queue_size = 8, .commit_count = 1, .block = false };
+	char			*dir = test_dir_alloc();
+	char			path[PATH_MAX];
+	unsigned int		i, queued = 0;
+	int			fd;
+	bool			failed = false;
+
+	ef = exfile_init(NULL, 16, fr_time_delta_from_sec(60), true);
+	TEST_ASSERT(ef != NULL);
+	TEST_ASSERT(exfile_async_enable(ef, &conf) == 0);
+
+	/*
+	 *	While we have a file open, the writer thread
+	 *	can't write anything, so the queue fills up.
+	 */
+	snprintf(path, sizeof(path), "%s/held", dir);
+	fd = exfile_open(ef, path, 0600);
+	TEST_ASSERT(fd >= 0);
+
+	TEST_CASE("Writes fail when the queue is full");
+	for (i = 0; i < 1000; i++) {
+		if (test_record_write(ef, dir, "full", 0, queued) < 0) {
+			failed = true;
+			break;
+		}
+		queued++;
+	}
+	TEST_CHECK(failed);
+	TEST_CHECK(queued >= conf.queue_size);
+	TEST_MSG("Expected at least %u records to be queued, got %u", conf.queue_size, queued);
+
+	exfile_close(ef, fd);
+
+	TEST_CASE("Records which were queued are all written");
+	talloc_free(ef);
+
+	test_records_check(dir, "full", 1, queued);
+
+	test_dir_free(dir);
+}
+
+static void test_async_drain(void)
+{
+	exfile_t		*ef;
+	exfile_async_conf_t	conf = {
+					.queue_size = 4096,
+					.commit_count = 4096,
+					.commit_delay = fr_time_delta_from_sec(60),
+					.block = true
+				};
+	char			*dir = test_dir_alloc();
+	unsigned int		i;
+
+	ef = exfile_init(NULL, 16, fr_time_delta_from_sec(60), true);
+	TEST_ASSERT(ef != NULL);
+	TEST_ASSERT(exfile_async_enable(ef, &conf) == 0);
+
+	/*
+	 *	The writer waits a long time for a full batch, so
+	 *	these are all still queued when we free the exfile.
+	 */
+	for (i = 0; i < 100; i++) TEST_CHECK(test_record_write(ef, dir, "one", 0, i) == 0);
+
+	TEST_CASE("Freeing the exfile writes everything out");
+	talloc_free(ef);
+
+	test_records_check(dir, "one", 1, 100);
+
+	test_dir_free(dir);
+}
+
+TEST_LIST = {
+	{ "async_enable",	test_async_enable },
+	{ "async_ordering",	test_async_ordering },
+	{ "async_full",		test_async_full },
+	{ "async_drain",	test_async_drain },
+
+	{ NULL }
+};
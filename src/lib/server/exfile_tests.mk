@@ -0,0 +1,6 @@
+TARGET		:= exfile_tests
+
+SOURCES		:= exfile_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_PREREQS	:= libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
@@ -33,6 +33,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
@@ -168,6 +169,14 @@ static const CONF_PARSER thread_config[] = {
 
 	{ FR_CONF_OFFSET("stats_interval", FR_TYPE_TIME_DELTA | FR_TYPE_HIDDEN, main_config_t, stats_interval), },
 
+	{ FR_CONF_OFFSET("numa", FR_TYPE_BOOL, main_config_t, numa), .dflt = "no" },
+
+#ifdef HAVE_LINUX_IO_URING_H
+	{ FR_CONF_OFFSET("io_uring", FR_TYPE_BOOL, main_config_t, io_uring), .dflt = "no" },
+#endif
+
+	{ FR_CONF_OFFSET("timer_wheel", FR_TYPE_BOOL, main_config_t, timer_wheel), .dflt = "no" },
+
 #ifdef HAVE_OPENSSL_CRYPTO_H
 	{ FR_CONF_OFFSET("openssl_async_pool_init", FR_TYPE_SIZE, main_config_t, openssl_async_pool_init), .dflt = "64" },
 	{ FR_CONF_OFFSET("openssl_async_pool_max", FR_TYPE_SIZE, main_config_t, openssl_async_pool_max), .dflt = "1024" },
@@ -1377,5 +1386,9 @@ void main_config_hup(main_config_t *config)
 	}
 	last_hup = when;
 
-	INFO("HUP - NYI in version 4");	/* Not yet implemented in v4 */
+	/*
+	 *	Re-reading the main configuration is not yet
+	 *	implemented in v4.  Module data files are.
+	 */
+	reload_hup();
 }
@@ -149,6 +149,9 @@ struct main_config_s {
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
+	bool		numa;				//!< for the scheduler
+	bool		io_uring;			//!< for the scheduler
+	bool		timer_wheel;			//!< for the scheduler
 
 };
 
@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/server/main_loop.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/state.h>
 #include <freeradius-devel/server/trigger.h>
@@ -287,6 +288,11 @@ int main_loop_init(void)
 		return -1;
 	}
 
+	/*
+	 *	Watch module data files for changes.
+	 */
+	if (reload_watch_start(event_list) < 0) return -1;
+
 	return 0;
 }
 
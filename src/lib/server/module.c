@@ -45,6 +45,19 @@ static size_t instance_num = 1;
  */
 static _Thread_local module_thread_instance_t **module_thread_inst_array;
 
+/** Entry in the list of all thread instance arrays
+ *
+ * Lets other threads, e.g. the one running radmin, read the
+ * per-thread statistics.
+ */
+typedef struct {
+	fr_dlist_t			entry;		//!< Entry in #module_thread_inst_list.
+	module_thread_instance_t	**array;	//!< The module_thread_inst_array of one thread.
+} module_thread_inst_list_entry_t;
+
+static fr_dlist_head_t module_thread_inst_list;
+static pthread_mutex_t module_thread_inst_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /** Lookup module instances by name and lineage
  */
 static fr_rb_tree_t *module_instance_name_tree;
@@ -179,6 +192,40 @@ static int cmd_set_module_status(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cm
 }
 
 
+static int cmd_show_module_latency(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_instance_t	*mi = ctx;
+	fr_histogram_t		*h;
+
+	MEM(h = talloc_zero(NULL, fr_histogram_t));
+	module_latency(h, mi);
+
+	fprintf(fp, "enabled\t%s\n", mi->latency ? "yes" : "no");
+	fr_histogram_fprint(fp, h, "latency");
+
+	talloc_free(h);
+
+	return 0;
+}
+
+static int cmd_set_module_latency(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	module_instance_t *mi = ctx;
+
+	if (strcmp(info->argv[0], "on") == 0) {
+		mi->latency = true;
+		return 0;
+	}
+
+	if (strcmp(info->argv[0], "off") == 0) {
+		mi->latency = false;
+		return 0;
+	}
+
+	fprintf(fp_err, "Unknown value '%s'\n", info->argv[0]);
+	return -1;
+}
+
 static fr_cmd_table_t cmd_module_table[] = {
 	{
 		.parent = "show module",
@@ -189,6 +236,15 @@ static fr_cmd_table_t cmd_module_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "latency",
+		.func = cmd_show_module_latency,
+		.help = "Show how long calls to a module take, in microseconds.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "show module",
 		.add_name = true,
@@ -209,6 +265,16 @@ static fr_cmd_table_t cmd_module_table[] = {
 		.read_only = false,
 	},
 
+	{
+		.parent = "set module",
+		.add_name = true,
+		.name = "latency",
+		.syntax = "(on|off)",
+		.func = cmd_set_module_latency,
+		.help = "Start or stop recording how long calls to a module take.",
+		.read_only = false,
+	},
+
 	CMD_TABLE_END
 };
 
@@ -1127,6 +1193,54 @@ module_thread_instance_t *module_thread_by_data(void const *data)
 	return array[mi->number];
 }
 
+/** Merge the latency histograms of all threads for a module
+ *
+ * The histograms are read whilst other threads write to them,
+ * see #fr_histogram_t.
+ *
+ * @param[out] out	to add the values to.
+ * @param[in] mi	to read the histograms of.
+ */
+void module_latency(fr_histogram_t *out, module_instance_t const *mi)
+{
+	module_thread_inst_list_entry_t *entry = NULL;
+
+	pthread_mutex_lock(&module_thread_inst_mutex);
+	while ((entry = fr_dlist_next(&module_thread_inst_list, entry))) {
+		module_thread_instance_t *ti;
+
+		if (mi->number >= talloc_array_length(entry->array)) continue;
+
+		ti = entry->array[mi->number];
+		if (!ti || !ti->latency) continue;
+
+		fr_histogram_merge(out, ti->latency);
+	}
+	pthread_mutex_unlock(&module_thread_inst_mutex);
+}
+
+/** Call a function for each module instance, in name order
+ *
+ * Modules are only added and removed before the server starts
+ * processing packets, so this can be called from any thread.
+ *
+ * @param[in] walk	to call for each module instance.
+ * @param[in] uctx	to pass to walk.
+ */
+void modules_walk(module_walk_t walk, void *uctx)
+{
+	fr_rb_iter_inorder_t	iter;
+	module_instance_t	*mi;
+
+	if (!module_instance_name_tree) return;
+
+	for (mi = fr_rb_iter_init_inorder(&iter, module_instance_name_tree);
+	     mi;
+	     mi = fr_rb_iter_next_inorder(&iter)) {
+		walk(mi, uctx);
+	}
+}
+
 /** Explicitly free a module if a fatal error occurs during bootstrap
  *
  * @param[in] mi	to free.
@@ -1173,6 +1287,7 @@ int modules_init(void)
 	MEM(virtual_module_name_tree = fr_rb_inline_alloc(NULL, virtual_module_t, name_node,
 							   virtual_module_name_cmp, NULL));
 	instance_ctx = talloc_init("module instance context");
+	fr_dlist_talloc_init(&module_thread_inst_list, module_thread_inst_list_entry_t, entry);
 
 	return 0;
 }
@@ -1181,7 +1296,20 @@ int modules_init(void)
  */
 static int _module_thread_inst_array_free(module_thread_instance_t **array)
 {
-	size_t i, len;
+	size_t				i, len;
+	module_thread_inst_list_entry_t	*entry = NULL;
+
+	/*
+	 *	Stop other threads reading our statistics.
+	 */
+	pthread_mutex_lock(&module_thread_inst_mutex);
+	while ((entry = fr_dlist_next(&module_thread_inst_list, entry))) {
+		if (entry->array != array) continue;
+
+		fr_dlist_remove(&module_thread_inst_list, entry);
+		break;
+	}
+	pthread_mutex_unlock(&module_thread_inst_mutex);
 
 	len = talloc_array_length(array);
 	for (i = 0; i < len; i++) {
@@ -1232,8 +1360,17 @@ int modules_thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el)
 	 *	Initialise the thread specific tree if this is the first time through
 	 */
 	if (!module_thread_inst_array) {
+		module_thread_inst_list_entry_t *entry;
+
 		MEM(module_thread_inst_array = talloc_zero_array(ctx, module_thread_instance_t *, instance_num + 1));
 		talloc_set_destructor(module_thread_inst_array, _module_thread_inst_array_free);
+
+		MEM(entry = talloc_zero(module_thread_inst_array, module_thread_inst_list_entry_t));
+		entry->array = module_thread_inst_array;
+
+		pthread_mutex_lock(&module_thread_inst_mutex);
+		fr_dlist_insert_tail(&module_thread_inst_list, entry);
+		pthread_mutex_unlock(&module_thread_inst_mutex);
 	}
 
 	/*
@@ -35,6 +35,7 @@ extern "C" {
 #include <freeradius-devel/unlang/action.h>
 #include <freeradius-devel/unlang/compile.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/histogram.h>
 
 typedef struct module_s				module_t;
 typedef struct module_method_names_s		module_method_names_t;
@@ -97,6 +98,13 @@ typedef int (*module_thread_instantiate_t)(module_thread_inst_ctx_t const *mctx)
  */
 typedef int (*module_thread_detach_t)(module_thread_inst_ctx_t const *mctx);
 
+/** Called by #modules_walk for each module instance
+ *
+ * @param[in] mi	The module instance.
+ * @param[in] uctx	passed to #modules_walk.
+ */
+typedef void (*module_walk_t)(module_instance_t const *mi, void *uctx);
+
 #define FR_MODULE_COMMON \
 	struct { \
 		module_instantiate_t		bootstrap;		\
@@ -219,6 +227,9 @@ struct module_instance_s {
 
 	/** @} */
 
+	bool				latency;	//!< Record how long calls to the module take.
+							///< Usually set via an administrative interface.
+
 	/** @name Tree insertion tracking
 	 * @{
  	 */
@@ -240,6 +251,8 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	fr_histogram_t			*latency;	//!< of calls, allocated on first use.
 };
 
 /** Map string values to module state method
@@ -300,6 +313,10 @@ module_thread_instance_t *module_thread(module_instance_t *mi);
 
 module_thread_instance_t *module_thread_by_data(void const *data);
 
+void			module_latency(fr_histogram_t *out, module_instance_t const *mi) CC_HINT(nonnull);
+
+void			modules_walk(module_walk_t walk, void *uctx) CC_HINT(nonnull(1));
+
 CONF_SECTION		*module_by_name_virtual(char const *asked_name);
 
 /** @} */
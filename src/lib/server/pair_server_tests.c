@@ -50,6 +50,7 @@ static void test_init(void);
 #include <freeradius-devel/util/talloc.h>
 
 #include <freeradius-devel/server/pair.h>
+#include <freeradius-devel/server/pairmove.h>
 #include <freeradius-devel/server/request.h>
 
 #ifdef HAVE_GPERFTOOLS_PROFILER_H
@@ -363,6 +364,86 @@ static void test_pair_delete_session_state(void)
 	TEST_CHECK_RET(talloc_free(request), 0);
 }
 
+static fr_pair_t *pairmove_test_pair(TALLOC_CTX *ctx, fr_pair_list_t *list, fr_dict_attr_t const *da,
+				     fr_token_t op, uint64_t value)
+{
+	fr_pair_t *vp;
+
+	TEST_CHECK(fr_pair_append_by_da(ctx, &vp, list, da) == 0);
+	vp->op = op;
+
+	switch (da->type) {
+	case FR_TYPE_UINT8:
+		vp->vp_uint8 = value;
+		break;
+
+	case FR_TYPE_UINT32:
+		vp->vp_uint32 = value;
+		break;
+
+	default:
+		vp->vp_uint64 = value;
+		break;
+	}
+
+	return vp;
+}
+
+static void test_pairmove_indexed(void)
+{
+	request_t      *request = request_fake_alloc();
+	fr_pair_list_t from;
+	fr_pair_t      *vp;
+	unsigned int   i;
+
+	fr_pair_list_init(&from);
+
+	TEST_CASE("Fill 'request->reply_pairs' so that it's indexed");
+	pairmove_test_pair(request->reply_ctx, &request->reply_pairs, fr_dict_attr_test_uint32, T_OP_EQ, 1);
+	pairmove_test_pair(request->reply_ctx, &request->reply_pairs, fr_dict_attr_test_uint64, T_OP_EQ, 10);
+	for (i = 0; i < FR_PAIR_LIST_INDEX_MIN; i++) {
+		pairmove_test_pair(request->reply_ctx, &request->reply_pairs, fr_dict_attr_test_uint8, T_OP_EQ, i);
+	}
+	pairmove_test_pair(request->reply_ctx, &request->reply_pairs, fr_dict_attr_test_uint32, T_OP_EQ, 2);
+
+	/*
+	 *	Build the index, so that it points to the
+	 *	pairs that radius_pairmove() replaces.
+	 */
+	TEST_CHECK(fr_pair_count_by_da(&request->reply_pairs, fr_dict_attr_test_uint32) == 2);
+	TEST_CHECK(fr_pair_count_by_da(&request->reply_pairs, fr_dict_attr_test_uint64) == 1);
+
+	/*
+	 *	radius_pairmove() doesn't reparent the pairs it
+	 *	moves, so they're allocated in the reply context.
+	 */
+	TEST_CASE("Overwrite and replace pairs using radius_pairmove()");
+	pairmove_test_pair(request->reply_ctx, &from, fr_dict_attr_test_uint32, T_OP_SET, 100);
+	pairmove_test_pair(request->reply_ctx, &from, fr_dict_attr_test_uint64, T_OP_LE, 5);
+	radius_pairmove(request, &request->reply_pairs, &from, false);
+
+	TEST_CASE("Lookups return the replacement pairs");
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, fr_dict_attr_test_uint32);
+	TEST_CHECK(vp && (vp->vp_uint32 == 100));
+	TEST_MSG("Expected first %s == 100", fr_dict_attr_test_uint32->name);
+
+	vp = fr_pair_find_by_da_idx(&request->reply_pairs, fr_dict_attr_test_uint32, 1);
+	TEST_CHECK(vp && (vp->vp_uint32 == 2));
+	TEST_MSG("Expected second %s == 2", fr_dict_attr_test_uint32->name);
+
+	TEST_CHECK(fr_pair_count_by_da(&request->reply_pairs, fr_dict_attr_test_uint32) == 2);
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, fr_dict_attr_test_uint64);
+	TEST_CHECK(vp && (vp->vp_uint64 == 5));
+	TEST_MSG("Expected %s == 5", fr_dict_attr_test_uint64->name);
+
+	TEST_CHECK(fr_pair_count_by_da(&request->reply_pairs, fr_dict_attr_test_uint8) == FR_PAIR_LIST_INDEX_MIN);
+
+	PAIR_LIST_VERIFY(&request->reply_pairs);
+
+	TEST_CHECK_RET(talloc_free(request), 0);
+}
+
 TEST_LIST = {
 	/*
 	 *	Add pairs
@@ -388,5 +469,10 @@ TEST_LIST = {
 	{ "pair_delete_control",       test_pair_delete_control },
 	{ "pair_delete_session_state", test_pair_delete_session_state },
 
+	/*
+	 *	Move pairs
+	 */
+	{ "pairmove_indexed",          test_pairmove_indexed },
+
 	{ NULL }
 };
@@ -0,0 +1,637 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/reload.c
+ * @brief Reload data read by modules without restarting the server.
+ *
+ * Modules such as rlm_files read their data once, during instantiation, and
+ * workers then read it without any locking.  To replace that data while the
+ * server is running, each complete copy is wrapped in a "generation".
+ *
+ * The initial generation is loaded during instantiation.  Later ones are loaded
+ * on HUP or when one of the watched files changes, by a separate thread, so the
+ * main thread isn't blocked while large files are parsed.  Once the load is
+ * complete, the main thread swaps the current pointer.
+ *
+ * Workers take a reference to the current generation for the duration of the
+ * lookup, without locking.  The main thread frees a retired generation once it
+ * has seen that no worker is part way through #reload_acquire, and that the
+ * last reference has been released.  Requests which were already using the old
+ * generation carry on with it until then.
+ *
+ * If the initial generation bootstrapped any xlats, it is never freed before
+ * the module is, as the workers have per-thread instance data for them.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/reload.h>
+#include <freeradius-devel/unlang/xlat.h>
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** How often we check whether retired generations can be freed
+ *
+ */
+#define RELOAD_REAP_INTERVAL	fr_time_delta_from_sec(1)
+
+struct reload_gen_s {
+	atomic_uint_fast32_t	refs;			//!< References from requests, plus one whilst current.
+	uint64_t		number;			//!< Generation number.
+	void			*data;			//!< Returned by the load callback.
+	bool			pinned;			//!< Has xlats with per-thread data, only freed with the reload_t.
+	bool			quiesced;		//!< No worker can still be taking a reference.
+	fr_time_delta_t		duration;		//!< How long the load took.
+	fr_dlist_t		entry;			//!< Entry in the retired list.
+};
+
+typedef struct {
+	char const		*filename;		//!< File to watch.
+	bool			exists;			//!< Whether the file existed last time we looked.
+	time_t			mtime;			//!< Modification time last time we looked.
+	off_t			size;			//!< Size last time we looked.
+	ino_t			ino;			//!< Inode last time we looked.
+} reload_file_t;
+
+struct reload_s {
+	char const		*name;			//!< For log messages, usually the module instance name.
+
+	reload_load_t		loader;			//!< Creates a new generation.
+	void			*uctx;			//!< Passed to loader.
+
+	_Atomic(reload_gen_t *)	current;		//!< Generation new requests will use.
+	atomic_uint_fast32_t	acquiring;		//!< Workers part way through reload_acquire().
+	fr_dlist_head_t		retired;		//!< Generations which are no longer current.
+
+	pthread_t		thread;			//!< Loading the next generation.
+	bool			loading;		//!< Whether the thread is running.
+	bool			load_again;		//!< Files changed whilst we were loading.
+	reload_gen_t		*loaded;		//!< Result of the thread, NULL on failure.
+
+	reload_file_t		*files;			//!< Files to watch for changes.
+
+	fr_time_delta_t		check_interval;		//!< How often to check the files.
+	fr_event_timer_t const	*ev_check;		//!< Next file check.
+	fr_event_timer_t const	*ev_reap;		//!< Next time we try to free retired generations.
+
+	reload_stats_t		stats;
+
+	fr_dlist_t		entry;			//!< Entry in the list of everything we can reload.
+};
+
+static fr_dlist_head_t	*reload_list;		//!< Everything to reload on HUP.
+static fr_event_list_t	*reload_el;		//!< Main thread event list.
+static int		reload_pipe[2] = { -1, -1 };	//!< Loader threads tell the main thread they're done.
+
+/** Free any retired generations which are no longer in use
+ *
+ */
+static void reload_reap(reload_t *rl)
+{
+	reload_gen_t	*gen, *next;
+
+	/*
+	 *	A worker may have read the current pointer just
+	 *	before we changed it, and not yet incremented the
+	 *	refs.  Once no worker is in reload_acquire(),
+	 *	anything which was retired before that point can
+	 *	no longer gain references.
+	 */
+	if (atomic_load(&rl->acquiring) == 0) {
+		for (gen = fr_dlist_head(&rl->retired); gen; gen = fr_dlist_next(&rl->retired, gen)) {
+			gen->quiesced = true;
+		}
+	}
+
+	for (gen = fr_dlist_head(&rl->retired); gen; gen = next) {
+		next = fr_dlist_next(&rl->retired, gen);
+
+		if (gen->pinned || !gen->quiesced || (atomic_load(&gen->refs) > 0)) continue;
+
+		DEBUG2("%s - Freeing generation %" PRIu64, rl->name, gen->number);
+		fr_dlist_remove(&rl->retired, gen);
+		talloc_free(gen);
+	}
+}
+
+static void _reload_reap_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	reload_t	*rl = talloc_get_type_abort(uctx, reload_t);
+	reload_gen_t	*gen;
+
+	reload_reap(rl);
+
+	/*
+	 *	Keep checking until every old generation which
+	 *	can be freed, has been.
+	 */
+	if (!reload_el) return;
+
+	for (gen = fr_dlist_head(&rl->retired); gen; gen = fr_dlist_next(&rl->retired, gen)) {
+		if (gen->pinned) continue;
+
+		if (fr_event_timer_in(rl, reload_el, &rl->ev_reap, RELOAD_REAP_INTERVAL,
+				      _reload_reap_timer, rl) < 0) {
+			PERROR("%s - Failed inserting reap timer", rl->name);
+		}
+		return;
+	}
+}
+
+/** Record the current state of the watched files
+ *
+ * @return true if any of the files changed since the last time we looked.
+ */
+static bool reload_files_changed(reload_t *rl)
+{
+	size_t	i, num = talloc_array_length(rl->files);
+	bool	changed = false;
+
+	for (i = 0; i < num; i++) {
+		reload_file_t	*file = &rl->files[i];
+		struct stat	st;
+
+		if (stat(file->filename, &st) < 0) {
+			if (file->exists) changed = true;
+			file->exists = false;
+			continue;
+		}
+
+		if (!file->exists || (file->mtime != st.st_mtime) ||
+		    (file->size != st.st_size) || (file->ino != st.st_ino)) changed = true;
+
+		file->exists = true;
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		file->ino = st.st_ino;
+	}
+
+	return changed;
+}
+
+static int cmd_show_module_reload(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	reload_t	*rl = talloc_get_type_abort(ctx, reload_t);
+	reload_stats_t	stats;
+
+	reload_stats(&stats, rl);
+
+	fprintf(fp, "generation\t%" PRIu64 "\n", stats.generation);
+	fprintf(fp, "reloaded\t%" PRIu64 "\n", stats.reloaded);
+	fprintf(fp, "failed\t%" PRIu64 "\n", stats.failed);
+	fprintf(fp, "retired\t%u\n", stats.retired);
+	fprintf(fp, "last_duration\t%.6f\n", fr_time_delta_unwrap(stats.last_duration) / (double)NSEC);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_reload_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "reload",
+		.func = cmd_show_module_reload,
+		.help = "Show the generation of the module's data files, and reload statistics.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+static int _reload_free(reload_t *rl)
+{
+	reload_gen_t *gen;
+
+	if (reload_list) fr_dlist_remove(reload_list, rl);
+
+	/*
+	 *	The loader thread writes to reload_pipe when it's
+	 *	done, but we're no longer in reload_list, so the
+	 *	main thread will ignore it.
+	 */
+	if (rl->loading) {
+		pthread_join(rl->thread, NULL);
+		talloc_free(rl->loaded);
+	}
+
+	/*
+	 *	Modules are only freed after all the workers have
+	 *	exited, so nothing can still hold a reference.
+	 */
+	while ((gen = fr_dlist_pop_head(&rl->retired))) talloc_free(gen);
+	gen = atomic_load(&rl->current);
+	talloc_free(gen);
+
+	return 0;
+}
+
+/** Allocate a new reloadable data set
+ *
+ * The caller must then call #reload_load to load the initial generation.
+ *
+ * @param[in] ctx		to allocate the reload_t in.  Usually module instance data.
+ * @param[in] name		for log messages.
+ * @param[in] load		Callback to load a new generation.
+ * @param[in] uctx		passed to load.
+ * @param[in] check_interval	How often to check the files added with #reload_file_add
+ *				for changes.  Zero means only reload on HUP.
+ * @return
+ *	- A new reload_t on success.
+ *	- NULL on failure.
+ */
+reload_t *reload_alloc(TALLOC_CTX *ctx, char const *name,
+		       reload_load_t load, void *uctx, fr_time_delta_t check_interval)
+{
+	reload_t *rl;
+
+	MEM(rl = talloc_zero(ctx, reload_t));
+	MEM(rl->name = talloc_typed_strdup(rl, name));
+	MEM(rl->files = talloc_zero_array(rl, reload_file_t, 0));
+	rl->loader = load;
+	rl->uctx = uctx;
+	rl->check_interval = check_interval;
+
+	atomic_init(&rl->current, NULL);
+	atomic_init(&rl->acquiring, 0);
+	fr_dlist_talloc_init(&rl->retired, reload_gen_t, entry);
+
+	if (!reload_list) {
+		MEM(reload_list = talloc_zero(NULL, fr_dlist_head_t));
+		fr_dlist_talloc_init(reload_list, reload_t, entry);
+	}
+	fr_dlist_insert_tail(reload_list, rl);
+	talloc_set_destructor(rl, _reload_free);
+
+	if (fr_command_register_hook(NULL, rl->name, rl, cmd_reload_table) < 0) {
+		PERROR("Failed registering radmin commands for %s", rl->name);
+		talloc_free(rl);
+		return NULL;
+	}
+
+	return rl;
+}
+
+/** Add a file to watch for changes
+ *
+ * @param[in] rl		to reload when the file changes.
+ * @param[in] filename		to watch.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int reload_file_add(reload_t *rl, char const *filename)
+{
+	size_t		num = talloc_array_length(rl->files);
+	reload_file_t	*files;
+
+	MEM(files = talloc_realloc(rl, rl->files, reload_file_t, num + 1));
+	files[num] = (reload_file_t) {
+		.filename = talloc_typed_strdup(files, filename)
+	};
+	rl->files = files;
+
+	return 0;
+}
+
+/** Call the loader to create a new generation
+ *
+ * @param[in] rl		to load.
+ * @param[in] at_runtime	passed to the loader.
+ * @return
+ *	- The new generation.  It has no talloc parent, as we may be
+ *	  running in the loader thread.
+ *	- NULL on failure.
+ */
+static reload_gen_t *reload_gen_alloc(reload_t *rl, bool at_runtime)
+{
+	reload_gen_t	*gen;
+	fr_time_t	start = fr_time();
+	uint64_t	xlats = xlat_instances_registered();
+
+	MEM(gen = talloc_zero(NULL, reload_gen_t));
+	if (rl->loader(gen, &gen->data, at_runtime, rl->uctx) < 0) {
+		talloc_free(gen);
+		return NULL;
+	}
+
+	atomic_init(&gen->refs, 1);
+	gen->duration = fr_time_sub(fr_time(), start);
+
+	/*
+	 *	Generations loaded at run time use ephemeral xlats,
+	 *	which carry their own thread instance data.
+	 */
+	gen->pinned = !at_runtime && (xlat_instances_registered() != xlats);
+
+	return gen;
+}
+
+/** Make a new generation current, and retire the old one
+ *
+ * Must be called from the main thread.
+ */
+static void reload_gen_install(reload_t *rl, reload_gen_t *gen)
+{
+	reload_gen_t	*old;
+
+	talloc_steal(rl, gen);
+	gen->number = ++rl->stats.generation;
+
+	old = atomic_exchange(&rl->current, gen);
+
+	rl->stats.last_reload = fr_time();
+	rl->stats.last_duration = gen->duration;
+
+	if (!old) {
+		DEBUG2("%s - Loaded generation %" PRIu64 " in %pVs%s", rl->name,
+		       gen->number, fr_box_time_delta(gen->duration),
+		       gen->pinned ? ", contains xlats so will be kept until exit" : "");
+		return;
+	}
+
+	rl->stats.reloaded++;
+	INFO("%s - Loaded generation %" PRIu64 " in %pVs", rl->name,
+	     gen->number, fr_box_time_delta(gen->duration));
+
+	/*
+	 *	Drop the reference held by the current pointer.
+	 *	Requests using the old generation keep it alive.
+	 */
+	fr_dlist_insert_tail(&rl->retired, old);
+	reload_release(old);
+
+	_reload_reap_timer(reload_el, rl->stats.last_reload, rl);
+}
+
+static void *reload_thread(void *uctx)
+{
+	reload_t	*rl = uctx;
+
+	rl->loaded = reload_gen_alloc(rl, true);
+	if (!rl->loaded) PERROR("%s - Reload failed", rl->name);
+
+	if (write(reload_pipe[1], &rl, sizeof(rl)) != sizeof(rl)) {
+		ERROR("%s - Failed signalling main thread: %s", rl->name, fr_syserror(errno));
+	}
+
+	return NULL;
+}
+
+/** Collect the results from loader threads which have finished
+ *
+ */
+static void reload_thread_done(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	reload_t	*rl, *found;
+
+	while (read(fd, &rl, sizeof(rl)) == sizeof(rl)) {
+		/*
+		 *	The reload_t may have been freed whilst the
+		 *	thread was running.
+		 */
+		for (found = fr_dlist_head(reload_list); found; found = fr_dlist_next(reload_list, found)) {
+			if (found == rl) break;
+		}
+		if (!found || !rl->loading) continue;
+
+		pthread_join(rl->thread, NULL);
+		rl->loading = false;
+
+		if (rl->loaded) {
+			reload_gen_install(rl, rl->loaded);
+			rl->loaded = NULL;
+		} else {
+			rl->stats.failed++;
+			ERROR("%s - Continuing to use generation %" PRIu64,
+			      rl->name, atomic_load(&rl->current)->number);
+		}
+
+		if (rl->load_again) {
+			rl->load_again = false;
+			(void) reload_load(rl);
+		}
+	}
+}
+
+/** Load a new generation and make it current
+ *
+ * Must be called from the main thread.  The first call (during module
+ * instantiation) loads the initial generation, and returns once it's
+ * current.  Later calls start a thread to load the new generation, which
+ * replaces the current one when it's done.
+ *
+ * @param[in] rl	to load.
+ * @return
+ *	- 0 on success, or if a load was started.
+ *	- -1 on failure.  The previous generation (if any) is still current.
+ */
+int reload_load(reload_t *rl)
+{
+	reload_gen_t	*gen;
+	bool		at_runtime = (atomic_load(&rl->current) != NULL);
+	int		ret;
+
+	/*
+	 *	Files changed again before the last load finished.
+	 *	Go round again once it has.
+	 */
+	if (rl->loading) {
+		rl->load_again = true;
+		return 0;
+	}
+
+	/*
+	 *	Record the state of the files before reading them,
+	 *	so that changes made while we're loading trigger
+	 *	another load.
+	 */
+	(void) reload_files_changed(rl);
+
+	/*
+	 *	Load in the background if we can.  Otherwise, e.g.
+	 *	when we're only checking the configuration, load it
+	 *	here.
+	 */
+	if (at_runtime && (reload_pipe[1] >= 0)) {
+		rl->loading = true;
+
+		ret = pthread_create(&rl->thread, NULL, reload_thread, rl);
+		if (ret == 0) return 0;
+
+		rl->loading = false;
+		ERROR("%s - Failed creating loader thread: %s", rl->name, fr_syserror(ret));
+		rl->stats.failed++;
+		return -1;
+	}
+
+	gen = reload_gen_alloc(rl, at_runtime);
+	if (!gen) {
+		rl->stats.failed++;
+		if (at_runtime) {
+			PERROR("%s - Reload failed, continuing to use generation %" PRIu64,
+			       rl->name, atomic_load(&rl->current)->number);
+		}
+		return -1;
+	}
+
+	reload_gen_install(rl, gen);
+
+	return 0;
+}
+
+/** Get a reference to the current generation
+ *
+ * May be called from any thread.  Every call must be matched by a call
+ * to #reload_release once the caller has finished with the data.
+ *
+ * @param[out] gen	to pass to #reload_release.
+ * @param[in] rl	to get the current generation of.
+ * @return the data returned by the load callback.
+ */
+void *reload_acquire(reload_gen_t **gen, reload_t *rl)
+{
+	/*
+	 *	The generation can't be freed between reading the
+	 *	pointer and taking the reference, as the main thread
+	 *	waits for acquiring to drop to zero.
+	 */
+	atomic_fetch_add(&rl->acquiring, 1);
+	*gen = atomic_load(&rl->current);
+	atomic_fetch_add(&(*gen)->refs, 1);
+	atomic_fetch_sub(&rl->acquiring, 1);
+
+	return (*gen)->data;
+}
+
+/** Release a reference to a generation
+ *
+ * The generation is freed later, in the main thread.
+ *
+ * @param[in] gen	returned by #reload_acquire.
+ */
+void reload_release(reload_gen_t *gen)
+{
+	fr_assert(atomic_load(&gen->refs) > 0);
+
+	atomic_fetch_sub(&gen->refs, 1);
+}
+
+/** Return statistics for a reloadable data set
+ *
+ */
+void reload_stats(reload_stats_t *stats, reload_t *rl)
+{
+	*stats = rl->stats;
+	stats->retired = fr_dlist_num_elements(&rl->retired);
+}
+
+/** Check the watched files, and reload if any have changed
+ *
+ */
+static void reload_check(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	reload_t	*rl = talloc_get_type_abort(uctx, reload_t);
+
+	if (reload_files_changed(rl)) {
+		INFO("%s - Data file changed, reloading", rl->name);
+		(void) reload_load(rl);
+	}
+
+	if (fr_event_timer_in(rl, reload_el, &rl->ev_check, rl->check_interval, reload_check, rl) < 0) {
+		PERROR("%s - Failed inserting file check timer", rl->name);
+	}
+}
+
+/** Reload everything
+ *
+ * Called from the main thread on HUP.
+ */
+void reload_hup(void)
+{
+	reload_t *rl;
+
+	if (!reload_list) return;
+
+	for (rl = fr_dlist_head(reload_list); rl; rl = fr_dlist_next(reload_list, rl)) {
+		INFO("HUP - Reloading %s", rl->name);
+		(void) reload_load(rl);
+	}
+}
+
+/** Start watching files for changes
+ *
+ * @param[in] el	Main thread event list.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int reload_watch_start(fr_event_list_t *el)
+{
+	reload_t *rl;
+
+	reload_el = el;
+
+	if (!reload_list) return 0;
+
+	/*
+	 *	Loader threads write the reload_t to this pipe when
+	 *	they're done, so we can install the new generation.
+	 */
+	if (reload_pipe[0] < 0) {
+		if (pipe(reload_pipe) < 0) {
+			ERROR("Failed creating reload pipe: %s", fr_syserror(errno));
+			return -1;
+		}
+		(void) fr_nonblock(reload_pipe[0]);
+
+		if (fr_event_fd_insert(NULL, el, reload_pipe[0], reload_thread_done, NULL, NULL, NULL) < 0) {
+			PERROR("Failed inserting reload pipe handler");
+			close(reload_pipe[0]);
+			close(reload_pipe[1]);
+			reload_pipe[0] = reload_pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	for (rl = fr_dlist_head(reload_list); rl; rl = fr_dlist_next(reload_list, rl)) {
+		if (!fr_time_delta_ispos(rl->check_interval) || (talloc_array_length(rl->files) == 0)) continue;
+
+		if (fr_event_timer_in(rl, el, &rl->ev_check, rl->check_interval, reload_check, rl) < 0) {
+			PERROR("%s - Failed inserting file check timer", rl->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
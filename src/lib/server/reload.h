@@ -0,0 +1,88 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief Reload data read by modules without restarting the server.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct reload_s reload_t;
+typedef struct reload_gen_s reload_gen_t;
+
+/** Load a new generation of data
+ *
+ * Called from the main thread for the initial load, and from a loader
+ * thread for later ones.  Only one load runs at a time for each reload_t.
+ * Must not modify anything which worker threads, or the main thread, may
+ * be using.
+ *
+ * @param[in] ctx		to allocate the new data in.
+ * @param[out] out		Where to write the new data.
+ * @param[in] at_runtime	false for the initial load during instantiation,
+ *				true for all loads after the workers have started.
+ *				Used to select #tmpl_rules_t.at_runtime and similar.
+ * @param[in] uctx		passed to #reload_alloc.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous generation stays in use.
+ */
+typedef int (*reload_load_t)(TALLOC_CTX *ctx, void **out, bool at_runtime, void *uctx);
+
+/** Reload statistics
+ *
+ */
+typedef struct {
+	uint64_t		generation;		//!< Number of the generation currently in use.
+	uint64_t		reloaded;		//!< Successful reloads, not counting the initial load.
+	uint64_t		failed;			//!< Reloads which failed.
+	uint32_t		retired;		//!< Old generations still in use by requests.
+	fr_time_t		last_reload;		//!< When the current generation was loaded.
+	fr_time_delta_t		last_duration;		//!< How long the last load took.
+} reload_stats_t;
+
+reload_t	*reload_alloc(TALLOC_CTX *ctx, char const *name,
+			      reload_load_t load, void *uctx, fr_time_delta_t check_interval);
+
+int		reload_file_add(reload_t *rl, char const *filename) CC_HINT(nonnull);
+
+int		reload_load(reload_t *rl) CC_HINT(nonnull);
+
+void		*reload_acquire(reload_gen_t **gen, reload_t *rl) CC_HINT(nonnull);
+
+void		reload_release(reload_gen_t *gen) CC_HINT(nonnull);
+
+void		reload_stats(reload_stats_t *stats, reload_t *rl) CC_HINT(nonnull);
+
+void		reload_hup(void);
+
+int		reload_watch_start(fr_event_list_t *el) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -240,6 +240,12 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 			memset(&request->pair_list, 0, sizeof(request->pair_list)); \
 			return -1; \
 		} \
+		if (unlikely(fr_pair_list_index_alloc(vp, &vp->children) < 0)) { \
+			talloc_free(vp); \
+			talloc_free(pair_root); \
+			memset(&request->pair_list, 0, sizeof(request->pair_list)); \
+			return -1; \
+		} \
 		fr_pair_append(&pair_root->children, vp); \
 		request->pair_list._list = vp; \
 	} while(0)
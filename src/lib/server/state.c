@@ -42,6 +42,10 @@
           \-> reply                 \-> reply                 \-> access-reject/access-accept
  * @endverbatim
  *
+ * The state entries are spread over a number of shards, based on a hash of
+ * the State value.  Each shard has its own lock, tree, and expiry list, so
+ * workers handling different conversations rarely contend with each other.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 RCSID("$Id$")
@@ -54,10 +58,23 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/*
+ *	Number of shards in a thread safe state tree.
+ *	Must be a power of 2.
+ */
+#define STATE_SHARDS		(64)
+
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
@@ -142,19 +159,31 @@ typedef struct {
 	request_t		*thawed;			//!< The request that thawed this entry.
 } state_child_entry_t;
 
+/** One independently locked part of a state tree
+ *
+ * Every entry has the same timeout, so appending entries to the expiry
+ * list keeps it ordered by cleanup time.  Expiry only ever has to look
+ * at the head of the list.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+} fr_state_shard_t;
+
 struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast64_t	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	uint32_t		used_sessions;			//!< How many sessions are currently in progress.
-	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	atomic_uint_fast32_t	used_sessions;			//!< How many sessions are currently in progress.
+
+	fr_state_shard_t	*shards;			//!< Entries, spread over shards by State value.
+	unsigned int		num_shards;			//!< Number of shards.  Always a power of 2.
 
 	fr_time_delta_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 	uint32_t		context_id;			//!< ID binding state values to a context such
@@ -166,7 +195,7 @@ struct fr_state_tree_s {
 #define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -185,22 +214,29 @@ static int8_t state_entry_cmp(void const *one, void const *two)
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	unsigned int		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		if (!shard->tree) continue;	/* Failed during init */
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	return 0;
 }
@@ -224,12 +260,14 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint8_t server_id, uint32_t context_id)
 {
 	fr_state_tree_t *state;
+	unsigned int	i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
+	state->num_shards = thread_safe ? STATE_SHARDS : 1;
 
 	/*
 	 *	Create a break in the contexts.
@@ -240,47 +278,70 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
+	state->thread_safe = thread_safe;
+	state->shards = talloc_zero_array(state, fr_state_shard_t, state->num_shards);
+	if (!state->shards) {
 		talloc_free(state);
 		return NULL;
 	}
+	talloc_set_destructor(state, _state_tree_free);
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, free_entry);
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, free_entry);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
+		if (!shard->tree) {
+			if (thread_safe) pthread_mutex_destroy(&shard->mutex);
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
 	state->context_id = context_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
 
+/** Return the shard which holds a given State value
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	if (state->num_shards == 1) return &state->shards[0];
+
+	return &state->shards[fr_hash(entry->state, sizeof(entry->state)) & (state->num_shards - 1)];
+}
+
 /** Unlink an entry and remove if from the tree
  *
+ * @note Called with the shard mutex held.
  */
 static inline CC_HINT(always_inline)
-void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
-	fr_rb_delete(state->tree, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
+	fr_rb_delete(shard->tree, entry);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -320,14 +381,87 @@ static int _state_entry_free(fr_state_entry_t *entry)
 
 	DEBUG4("State ID %" PRIu64 " freed", entry->id);
 
-	entry->state_tree->used_sessions--;
+	atomic_fetch_sub_explicit(&entry->state_tree->used_sessions, 1, memory_order_relaxed);
 
 	return 0;
 }
 
+/** Unlink any expired entries from a shard
+ *
+ * @note Called with the shard mutex held.
+ *
+ * @param[in] shard	to clean up.
+ * @param[out] to_free	expired entries.  These should be freed
+ *			after the shard mutex is released.
+ * @param[in] now	the current time.
+ * @return the number of expired entries.
+ */
+static uint64_t state_shard_expire(fr_state_shard_t *shard, fr_dlist_head_t *to_free, fr_time_t now)
+{
+	fr_state_entry_t	*entry;
+	uint64_t		timed_out = 0;
+
+	while ((entry = fr_dlist_head(&shard->to_expire)) != NULL) {
+ 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
+
+		/*
+		 *	The list is ordered by cleanup time, so
+		 *	everything after this is newer.
+		 */
+		if (!fr_time_lt(entry->cleanup, now)) break;
+
+		state_entry_unlink(shard, entry);
+		fr_dlist_insert_tail(to_free, entry);
+		timed_out++;
+	}
+
+	return timed_out;
+}
+
+/** Free entries unlinked by #state_shard_expire
+ *
+ * We do it outside of the shard mutex as freeing may involve
+ * significantly more work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now
+ * be freed also, and it may have complex destructors associated
+ * with it.
+ */
+static void state_entries_free(fr_state_tree_t *state, request_t *request, fr_dlist_head_t *to_free, uint64_t timed_out)
+{
+	fr_state_entry_t *entry;
+
+	if (timed_out == 0) return;
+
+	atomic_fetch_add_explicit(&state->timed_out, timed_out, memory_order_relaxed);
+
+	RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+
+	while ((entry = fr_dlist_head(to_free)) != NULL) {
+		fr_dlist_remove(to_free, entry);
+		talloc_free(entry);
+	}
+}
+
+/** Reserve a session, if we're not at the maximum
+ *
+ */
+static bool state_session_reserve(fr_state_tree_t *state)
+{
+	uint_fast32_t used = atomic_load_explicit(&state->used_sessions, memory_order_relaxed);
+
+	do {
+		if (used >= state->max_sessions) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&state->used_sessions, &used, used + 1,
+							memory_order_relaxed, memory_order_relaxed));
+
+	return true;
+}
+
 /** Create a new state entry
  *
- * @note Called with the mutex held.
+ * The entry is not inserted into the state tree.  That's done by
+ * #state_entry_insert, once the caller has given it the session data.
  */
 static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
 					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
@@ -336,13 +470,10 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	uint32_t		x;
 	fr_time_t		now = fr_time();
 	fr_pair_t		*vp;
-	fr_state_entry_t	*entry, *next;
+	fr_state_entry_t	*entry;
 
 	uint8_t			old_state[sizeof(old->state)];
 	int			old_tries = 0;
-	uint64_t		timed_out = 0;
-	bool			too_many = false;
-	fr_dlist_head_t		to_free;
 
 	/*
 	 *	Shouldn't be in any lists if it's being reused
@@ -351,73 +482,40 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		  (!fr_dlist_entry_in_list(&old->expire_entry) &&
 		   !fr_rb_node_inline_in_tree(&old->node)));
 
-	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
-
-	/*
-	 *	Clean up expired entries
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
-	     entry != NULL;
-	     entry = next) {
- 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
-
+	if (!old) {
 		/*
-		 *	Too old, we can delete it.
+		 *	Expired entries are normally cleaned up
+		 *	from one shard at a time, when new entries
+		 *	are inserted into it.  If we're at the
+		 *	limit, clean up all of the shards before
+		 *	giving up.
 		 */
-		if (fr_time_lt(entry->cleanup, now)) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
+		if (!state_session_reserve(state)) {
+			for (i = 0; i < state->num_shards; i++) {
+				fr_state_shard_t	*shard = &state->shards[i];
+				fr_dlist_head_t		to_free;
+				uint64_t		timed_out;
 
-		break;
-	}
+				fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
 
-	state->timed_out += timed_out;
+				PTHREAD_MUTEX_LOCK(&shard->mutex);
+				timed_out = state_shard_expire(shard, &to_free, now);
+				PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	if (!old) {
-		too_many = (state->used_sessions == (uint32_t) state->max_sessions);
-		if (!too_many) state->used_sessions++;	/* preemptively increment whilst we hold the mutex */
+				state_entries_free(state, request, &to_free, timed_out);
+			}
+
+			if (!state_session_reserve(state)) {
+				RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+				       state->max_sessions);
+				return NULL;
+			}
+		}
 	} else {
 		old_tries = old->tries;
 		memcpy(old_state, old->state, sizeof(old_state));
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
-
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
-
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
@@ -435,13 +533,18 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		talloc_free_children(old);
 		memset(old, 0, sizeof(*old));
 		entry = old;
+
+		/*
+		 *	The entry still counts as a session.
+		 */
+		atomic_fetch_add_explicit(&state->used_sessions, 1, memory_order_relaxed);
 	}
 
 	entry->state_tree = state;
 
 	request_data_list_init(&entry->data);
 
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -529,8 +632,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)),
 	       fr_box_time_delta(fr_time_sub(entry->cleanup, now)));
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -539,28 +640,51 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.context_id)) ^= state->context_id;
 
-	if (!fr_rb_insert(state->tree, entry)) {
-		RERROR("Failed inserting state entry - Insertion into state tree failed");
-		fr_pair_delete_by_da(reply_list, state->da);
-		talloc_free(entry);
-		return NULL;
+	return entry;
+}
+
+/** Insert a state entry into its shard, and clean up any expired entries in the shard
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the State value is already in use.
+ */
+static int state_entry_insert(fr_state_tree_t *state, request_t *request, fr_state_entry_t *entry)
+{
+	fr_state_shard_t	*shard = state_shard(state, entry);
+	fr_dlist_head_t		to_free;
+	uint64_t		timed_out;
+	int			ret = 0;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	timed_out = state_shard_expire(shard, &to_free, fr_time());
+
+	if (!fr_rb_insert(shard->tree, entry)) {
+		ret = -1;
+	} else {
+		/*
+		 *	Link it to the end of the list, which is implicitely
+		 *	ordered by cleanup time.
+		 */
+		fr_dlist_insert_tail(&shard->to_expire, entry);
 	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	/*
-	 *	Link it to the end of the list, which is implicitely
-	 *	ordered by cleanup time.
-	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	state_entries_free(state, request, &to_free, timed_out);
 
-	return entry;
+	return ret;
 }
 
 /** Find the entry based on the State attribute and remove it from the state tree
  *
+ * @note Called with the mutex free.
  */
 static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 
 	/*
 	 *	Assume our own State first.
@@ -589,11 +713,15 @@ static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_
 	 */
 	my_entry.state_comp.context_id ^= state->context_id;
 
-	entry = fr_rb_remove(state->tree, &my_entry);
+	shard = state_shard(state, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_rb_remove(shard->tree, &my_entry);
 	if (entry) {
 		(void) talloc_get_type_abort(entry, fr_state_entry_t);
-		fr_dlist_remove(&state->to_expire, entry);
+		fr_dlist_remove(&shard->to_expire, entry);
 	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	return entry;
 }
@@ -609,13 +737,8 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
 	vp = fr_pair_find_by_da_idx(&request->request_pairs, state->da, 0);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return;
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (!entry) return;
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -673,19 +796,15 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return 1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RDEBUG2("No state entry matching &request.%pP found", vp);
 		return 2;
 	}
-   	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/* Probably impossible in the current code */
 	if (unlikely(entry->thawed != NULL)) {
 		RERROR("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		return -2;
 	}
 	if (request->session_state_ctx) old_ctx = request->session_state_ctx;	/* Store for later freeing */
@@ -754,14 +873,12 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->session_state_pairs, "&session-state.");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	Reuses old if possible
 	 */
 	entry = state_entry_create(state, request, &request->reply_pairs, old);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	fail:
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
@@ -773,7 +890,19 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	entry->seq_start = request->seq_start;
 	entry->ctx = request->session_state_ctx;
 	fr_dlist_move(&entry->data, &data);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+
+	if (state_entry_insert(state, request, entry) < 0) {
+		RERROR("Failed inserting state entry - Insertion into state tree failed");
+		fr_pair_delete_by_da(&request->reply_pairs, state->da);
+
+		/*
+		 *	The request still owns the session data.
+		 */
+		entry->ctx = NULL;
+		fr_dlist_move(&data, &entry->data);
+		talloc_free(entry);
+		goto fail;
+	}
 
 	MEM(request->session_state_ctx = fr_pair_afrom_da(NULL, request_attr_state));	/* fixme - should use a pool */
 
@@ -926,7 +1055,7 @@ void fr_state_discard_child(request_t *parent, void const *unique_ptr, int uniqu
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -934,7 +1063,7 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	return atomic_load_explicit(&state->timed_out, memory_order_relaxed);
 }
 
 /** Return number of entries we're currently tracking
@@ -942,5 +1071,10 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return fr_rb_num_elements(state->tree);
+	uint64_t	tracked = 0;
+	unsigned int	i;
+
+	for (i = 0; i < state->num_shards; i++) tracked += fr_rb_num_elements(state->shards[i].tree);
+
+	return tracked;
 }
@@ -1,4 +1,31 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests and contention benchmark for the state tree
+ *
+ * @file src/lib/server/state_test.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+static void test_init(void) __attribute__((constructor));
+
 #include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/dict_test.h>
+
+#include <pthread.h>
 
 fr_time_t	test_time;
 
@@ -7,22 +34,295 @@ fr_time_t	test_time;
  */
 #define fr_time()	test_time
 
-#include <state_test.c>
+#include "state.c"
+
+/*
+ *	state.c uses this, but it's hidden in libfreeradius-server,
+ *	so we need our own copy.
+ */
+fr_dict_attr_t const	*request_attr_state;
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*test_dict;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("state_test");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+
+	request_attr_state = fr_dict_attr_by_name(NULL, fr_dict_root(fr_dict_internal()), "session-state");
+	if (!request_attr_state) goto error;
+
+	test_time = fr_time_wrap(NSEC);
+}
+
+static request_t *request_fake_alloc(TALLOC_CTX *ctx)
+{
+	request_t	*request;
+
+	request = request_local_alloc_external(ctx, NULL);
+	if (!request) return NULL;
+
+	MEM(request->async = talloc_zero(request, fr_async_t));
+
+	return request;
+}
+
+/** Start a conversation, saving some session-state
+ *
+ * @return the request, with the State attribute in its reply.
+ */
+static request_t *conversation_start(TALLOC_CTX *ctx, fr_state_tree_t *state, uint32_t value, int *ret)
+{
+	request_t	*request;
+	fr_pair_t	*vp;
+
+	request = request_fake_alloc(ctx);
+	if (!request) return NULL;
+
+	MEM(vp = fr_pair_afrom_da(request->session_state_ctx, fr_dict_attr_test_uint32));
+	vp->vp_uint32 = value;
+	fr_pair_append(&request->session_state_pairs, vp);
+
+	*ret = fr_request_to_state(state, request);
+
+	return request;
+}
+
+/** Continue a conversation, using the State from a previous reply
+ *
+ */
+static request_t *conversation_continue(TALLOC_CTX *ctx, fr_state_tree_t *state, request_t *previous, int *ret)
+{
+	request_t	*request;
+	fr_pair_t	*vp, *state_vp;
+
+	request = request_fake_alloc(ctx);
+	if (!request) return NULL;
+
+	state_vp = fr_pair_find_by_da_idx(&previous->reply_pairs, state->da, 0);
+	if (!state_vp) {
+		*ret = -1;
+		return request;
+	}
+
+	MEM(vp = fr_pair_copy(request->request_ctx, state_vp));
+	fr_pair_append(&request->request_pairs, vp);
+
+	*ret = fr_state_to_request(state, request);
+
+	return request;
+}
+
+static void test_state_entry_create(void)
+{
+	fr_state_tree_t		*state;
+	request_t		*first, *second;
+	fr_pair_t		*vp;
+	int			ret;
+
+	state = fr_state_tree_init(autofree, fr_dict_attr_test_octets, true, 16, fr_time_delta_from_sec(30), 0, 0);
+	TEST_CHECK(state != NULL);
+
+	TEST_CASE("Saving session-state adds a State attribute to the reply");
+	first = conversation_start(autofree, state, 42, &ret);
+	TEST_CHECK(first != NULL);
+	TEST_CHECK(ret == 0);
+	TEST_CHECK(fr_pair_find_by_da_idx(&first->reply_pairs, state->da, 0) != NULL);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+
+	TEST_CASE("The State attribute restores the session-state");
+	second = conversation_continue(autofree, state, first, &ret);
+	TEST_CHECK(second != NULL);
+	TEST_CHECK(ret == 0);
+	TEST_CHECK(fr_state_entries_tracked(state) == 0);
+
+	vp = fr_pair_find_by_da_idx(&second->session_state_pairs, fr_dict_attr_test_uint32, 0);
+	TEST_CHECK(vp != NULL);
+	if (vp) TEST_CHECK(vp->vp_uint32 == 42);
+
+	TEST_CASE("The State attribute can only be used once");
+	talloc_free(second);
+	second = conversation_continue(autofree, state, first, &ret);
+	TEST_CHECK(ret == 2);
+
+	talloc_free(second);
+	talloc_free(first);
+	talloc_free(state);
+}
+
+static void test_state_entry_too_many(void)
+{
+	fr_state_tree_t		*state;
+	request_t		*first, *second;
+	int			ret;
+
+	state = fr_state_tree_init(autofree, fr_dict_attr_test_octets, true, 1, fr_time_delta_from_sec(30), 0, 0);
+	TEST_CHECK(state != NULL);
+
+	TEST_CASE("Sessions past max_sessions are refused");
+	first = conversation_start(autofree, state, 1, &ret);
+	TEST_CHECK(ret == 0);
+
+	second = conversation_start(autofree, state, 2, &ret);
+	TEST_CHECK(ret < 0);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+
+	talloc_free(second);
+	talloc_free(first);
+	talloc_free(state);
+}
+
+static void test_state_entry_timeout(void)
+{
+	fr_state_tree_t		*state;
+	request_t		*first, *second;
+	int			ret;
+
+	state = fr_state_tree_init(autofree, fr_dict_attr_test_octets, true, 1, fr_time_delta_from_sec(30), 0, 0);
+	TEST_CHECK(state != NULL);
+
+	first = conversation_start(autofree, state, 1, &ret);
+	TEST_CHECK(ret == 0);
+
+	TEST_CASE("Expired sessions make room for new ones, even in other shards");
+	test_time = fr_time_add(test_time, fr_time_delta_from_sec(31));
+
+	second = conversation_start(autofree, state, 2, &ret);
+	TEST_CHECK(ret == 0);
+	TEST_CHECK(fr_state_entries_timeout(state) == 1);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+
+	TEST_CASE("Expired sessions can't be restored");
+	talloc_free(second);
+	second = conversation_continue(autofree, state, first, &ret);
+	TEST_CHECK(ret == 2);
+
+	talloc_free(second);
+	talloc_free(first);
+	talloc_free(state);
+}
+
+#define BENCH_CONVERSATIONS	(50000)
+#define BENCH_MAX_THREADS	(8)
 
-/** Test functions that read from dbuffs.
+typedef struct {
+	fr_state_tree_t		*state;
+	pthread_t		thread;
+	unsigned int		failed;
+} bench_thread_t;
+
+/** Run through many two-round conversations
+ *
+ */
+static void *bench_thread(void *arg)
+{
+	bench_thread_t	*bt = arg;
+	TALLOC_CTX	*ctx;
+	request_t	*first, *second;
+	int		ret;
+	unsigned int	i;
+
+	ctx = talloc_init_const("bench_thread");
+
+	for (i = 0; i < BENCH_CONVERSATIONS; i++) {
+		first = conversation_start(ctx, bt->state, i, &ret);
+		if (ret < 0) bt->failed++;
+
+		second = conversation_continue(ctx, bt->state, first, &ret);
+		if (ret != 0) bt->failed++;
+
+		fr_state_discard(bt->state, second);
+
+		talloc_free(second);
+		talloc_free(first);
+	}
+
+	talloc_free(ctx);
+
+	return NULL;
+}
+
+/** Measure throughput with many workers saving and restoring state
  *
+ * Run once with all entries in one shard (which is the same as a
+ * single mutex protecting one tree), and once with the shards.
  */
-static void state_entry_create(void)
+static void test_state_contention(void)
 {
+	bench_thread_t		threads[BENCH_MAX_THREADS];
+	unsigned int		num_threads, num_shards, i, failed;
+	fr_time_t		start;
+	fr_time_delta_t		used;
+
+	for (num_shards = 1; num_shards <= STATE_SHARDS; num_shards *= STATE_SHARDS) {
+		for (num_threads = 1; num_threads <= BENCH_MAX_THREADS; num_threads *= 2) {
+			fr_state_tree_t *state;
+
+			state = fr_state_tree_init(autofree, fr_dict_attr_test_octets, true,
+						   num_threads * BENCH_CONVERSATIONS, fr_time_delta_from_sec(30), 0, 0);
+			TEST_CHECK(state != NULL);
+			if (!state) return;
+
+			state->num_shards = num_shards;
+
+			/*
+			 *	fr_time() is redefined above, so call the
+			 *	real function.
+			 */
+			start = (fr_time)();
+
+			for (i = 0; i < num_threads; i++) {
+				threads[i] = (bench_thread_t) { .state = state };
+				TEST_CHECK(pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) == 0);
+			}
 
+			failed = 0;
+			for (i = 0; i < num_threads; i++) {
+				pthread_join(threads[i].thread, NULL);
+				failed += threads[i].failed;
+			}
+
+			used = fr_time_sub((fr_time)(), start);
+
+			TEST_CHECK(failed == 0);
+			TEST_MSG_ALWAYS("shards=%u threads=%u conversations=%u per_sec=%0.0lf",
+					num_shards, num_threads, num_threads * BENCH_CONVERSATIONS,
+					(num_threads * BENCH_CONVERSATIONS) / (fr_time_delta_unwrap(used) / (double)NSEC));
+
+			state->num_shards = STATE_SHARDS;
+			talloc_free(state);
+		}
+	}
 }
 
 TEST_LIST = {
 	/*
 	 *	Basic tests
 	 */
-	{ "state_entry_create",				state_entry_create },
-	{ "state_entry_too_many" }
+	{ "state_entry_create",		test_state_entry_create },
+	{ "state_entry_too_many",	test_state_entry_too_many },
+	{ "state_entry_timeout",	test_state_entry_timeout },
+
+	/*
+	 *	Benchmarks
+	 */
+	{ "state_contention",		test_state_contention },
 
 	{ NULL }
 };
@@ -0,0 +1,7 @@
+TARGET		:= state_test
+
+SOURCES		:= state_test.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
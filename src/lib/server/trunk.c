@@ -42,6 +42,7 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/minmax_heap.h>
+#include <pthread.h>
 
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -284,8 +285,17 @@ struct fr_trunk_s {
 
 	uint64_t		last_req_per_conn;	//!< The last request to connection ratio we calculated.
 	/** @} */
+
+	fr_dlist_t		trunk_entry;		//!< Entry in the list of all trunks.
 };
 
+/** All trunks, in all threads, so that their gauges can be read by #fr_trunk_walk
+ *
+ */
+static fr_dlist_head_t	trunk_list;
+static bool		trunk_list_init;
+static pthread_mutex_t	trunk_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static CONF_PARSER const fr_trunk_config_request[] = {
 	{ FR_CONF_OFFSET("per_connection_max", FR_TYPE_UINT32, fr_trunk_conf_t, max_req_per_conn), .dflt = "2000" },
 	{ FR_CONF_OFFSET("per_connection_target", FR_TYPE_UINT32, fr_trunk_conf_t, target_req_per_conn), .dflt = "1000" },
@@ -897,6 +907,7 @@ static void trunk_connection_enter_active(fr_trunk_connection_t *tconn);
 static void trunk_rebalance(fr_trunk_t *trunk);
 static void trunk_manage(fr_trunk_t *trunk, fr_time_t now);
 static void _trunk_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+static void trunk_gauges_update(fr_trunk_t *trunk);
 static void trunk_backlog_drain(fr_trunk_t *trunk);
 
 /** Compare two protocol requests
@@ -4264,6 +4275,31 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 	}
 }
 
+/** Copy the connection and request counts to the public gauges
+ *
+ * @param[in] trunk	to update.
+ */
+static void trunk_gauges_update(fr_trunk_t *trunk)
+{
+	trunk->pub.conn_connecting = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_INIT |
+									       FR_TRUNK_CONN_CONNECTING);
+	trunk->pub.conn_active = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE);
+	trunk->pub.conn_full = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_FULL);
+	trunk->pub.conn_inactive = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_INACTIVE |
+									     FR_TRUNK_CONN_INACTIVE_DRAINING);
+	trunk->pub.conn_draining = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_DRAINING |
+									     FR_TRUNK_CONN_DRAINING_TO_FREE);
+
+	trunk->pub.req_backlog = fr_heap_num_elements(trunk->backlog);
+	trunk->pub.req_pending = fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL,
+								 FR_TRUNK_REQUEST_STATE_PENDING |
+								 FR_TRUNK_REQUEST_STATE_PARTIAL);
+	trunk->pub.req_sent = fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL,
+							      FR_TRUNK_REQUEST_STATE_SENT);
+	trunk->pub.req_cancel = fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL,
+								FR_TRUNK_REQUEST_STATE_CANCEL_ALL);
+}
+
 /** Event to periodically call the connection management function
  *
  * @param[in] el	this event belongs to.
@@ -4275,6 +4311,7 @@ static void _trunk_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	fr_trunk_t *trunk = talloc_get_type_abort(uctx, fr_trunk_t);
 
 	trunk_manage(trunk, now);
+	trunk_gauges_update(trunk);
 
 	if (fr_time_delta_ispos(trunk->conf.manage_interval)) {
 		if (fr_event_timer_in(trunk, el, &trunk->manage_ev, trunk->conf.manage_interval,
@@ -4327,6 +4364,31 @@ do { \
 	return count;
 }
 
+/** Call a function for every trunk, in every thread
+ *
+ * Trunks can't be freed while the function is running, but they
+ * can change, so the function should only read the statistics and
+ * gauges in the public fields of the trunk.  The gauges are updated
+ * by the management timer.
+ *
+ * @param[in] walk	to call for each trunk.
+ * @param[in] uctx	to pass to walk.
+ */
+void fr_trunk_walk(fr_trunk_walk_t walk, void *uctx)
+{
+	fr_trunk_t *trunk;
+
+	pthread_mutex_lock(&trunk_list_mutex);
+	if (trunk_list_init) {
+		for (trunk = fr_dlist_head(&trunk_list);
+		     trunk != NULL;
+		     trunk = fr_dlist_next(&trunk_list, trunk)) {
+			walk(trunk, trunk->log_prefix, uctx);
+		}
+	}
+	pthread_mutex_unlock(&trunk_list_mutex);
+}
+
 /** Update timestamps for when we last had a transition from above target to below target or vice versa
  *
  * Should be called on every time a connection or request is allocated or freed.
@@ -4628,6 +4690,10 @@ static int _trunk_free(fr_trunk_t *trunk)
 
 	trunk->freeing = true;	/* Prevent re-enqueuing */
 
+	pthread_mutex_lock(&trunk_list_mutex);
+	fr_dlist_remove(&trunk_list, trunk);
+	pthread_mutex_unlock(&trunk_list_mutex);
+
 	/*
 	 *	We really don't want this firing after
 	 *	we've freed everything.
@@ -4761,6 +4827,14 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 		fr_dlist_talloc_init(&trunk->watch[i], fr_trunk_watch_entry_t, entry);
 	}
 
+	pthread_mutex_lock(&trunk_list_mutex);
+	if (!trunk_list_init) {
+		fr_dlist_init(&trunk_list, fr_trunk_t, trunk_entry);
+		trunk_list_init = true;
+	}
+	fr_dlist_insert_tail(&trunk_list, trunk);
+	pthread_mutex_unlock(&trunk_list_mutex);
+
 	DEBUG4("Trunk allocated %p", trunk);
 
 	if (!delay_start) {
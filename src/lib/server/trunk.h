@@ -298,6 +298,25 @@ struct fr_trunk_pub_s {
 	uint64_t _CONST		req_alloc_reused;	//!< How many requests were reused.
 	/** @} */
 
+	/** @name Gauges
+	 *
+	 * Copied from the connection and request lists by the management
+	 * timer, so that other threads can read them without walking
+	 * lists which belong to this trunk's thread.
+	 * @{
+	 */
+	uint16_t _CONST		conn_connecting;	//!< Connections in the init or connecting states.
+	uint16_t _CONST		conn_active;		//!< Connections in the active state.
+	uint16_t _CONST		conn_full;		//!< Connections in the full state.
+	uint16_t _CONST		conn_inactive;		//!< Connections in the inactive states.
+	uint16_t _CONST		conn_draining;		//!< Connections in the draining states.
+
+	uint64_t _CONST		req_backlog;		//!< Requests in the backlog.
+	uint64_t _CONST		req_pending;		//!< Requests queued on a connection, or partially written.
+	uint64_t _CONST		req_sent;		//!< Requests waiting for a response.
+	uint64_t _CONST		req_cancel;		//!< Requests being cancelled.
+	/** @} */
+
 	bool _CONST		triggers;		//!< do we run the triggers?
 
 	fr_trunk_state_t _CONST	state;			//!< Current state of the trunk.
@@ -678,6 +697,17 @@ typedef void (*fr_trunk_request_fail_t)(request_t *request, void *preq, void *rc
  */
 typedef void (*fr_trunk_request_free_t)(request_t *request, void *preq_to_free, void *uctx);
 
+/** Called by #fr_trunk_walk for each trunk
+ *
+ * The trunk usually belongs to a different thread, so only the
+ * statistics and gauges should be read.
+ *
+ * @param[in] trunk	Being walked.
+ * @param[in] name	The log prefix the trunk was allocated with.
+ * @param[in] uctx	passed to #fr_trunk_walk.
+ */
+typedef void (*fr_trunk_walk_t)(fr_trunk_t const *trunk, char const *name, void *uctx);
+
 /** Receive a notification when a trunk enters a particular state
  *
  * @param[in] trunk	Being watched.
@@ -735,6 +765,8 @@ uint16_t	fr_trunk_connection_count_by_state(fr_trunk_t *trunk, int conn_state) C
 uint32_t	fr_trunk_request_count_by_connection(fr_trunk_connection_t const *tconn, int req_state) CC_HINT(nonnull);
 
 uint64_t	fr_trunk_request_count_by_state(fr_trunk_t *trunk, int conn_state, int req_state) CC_HINT(nonnull);
+
+void		fr_trunk_walk(fr_trunk_walk_t walk, void *uctx) CC_HINT(nonnull(1));
 /** @} */
 
 /** @name Request state signalling
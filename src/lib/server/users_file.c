@@ -144,7 +144,7 @@ static fr_sbuff_parse_rules_t const rhs_term = {
  *	Caller saw a $INCLUDE at the start of a line.
  */
 static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbuff, PAIR_LIST_LIST *list,
-			 char const *file, int lineno)
+			 char const *file, int lineno, bool at_runtime)
 {
 	size_t		len;
 	char		*newfile, *p, c;
@@ -224,7 +224,7 @@ static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbu
 	/*
 	 *	Read the $INCLUDEd file recursively.
 	 */
-	if (pairlist_read(ctx, dict, newfile, list, 0) != 0) {
+	if (pairlist_read(ctx, dict, newfile, list, 0, at_runtime) != 0) {
 		ERROR("%s[%d]: Could not read included file %s: %s",
 		      file, lineno, newfile, fr_syserror(errno));
 		talloc_free(newfile);
@@ -238,8 +238,12 @@ static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbu
 
 /*
  *	Read the users file. Return a PAIR_LIST.
+ *
+ *	at_runtime must be set if the file is being read after the
+ *	worker threads have started, e.g. when reloading on HUP.
  */
-int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list, int complain)
+int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list, int complain,
+		  bool at_runtime)
 {
 	char			*q;
 	int			order = 0;
@@ -282,12 +286,14 @@ int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR
 		 *	thing isn't known.
 		 */
 		.allow_unresolved = true,
+		.at_runtime = at_runtime,
 	};
 	rhs_rules = (tmpl_rules_t) {
 		.dict_def = dict,
 		.request_def = REQUEST_CURRENT,
 		.prefix = TMPL_ATTR_REF_PREFIX_YES,
 		.disallow_qualifiers = true, /* for now, until rlm_files supports it */
+		.at_runtime = at_runtime,
 	};
 
 	while (true) {
@@ -332,7 +338,7 @@ int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR
 			PAIR_LIST_LIST tmp_list;
 
 			pairlist_list_init(&tmp_list);
-			if (users_include(ctx, dict, &sbuff, &tmp_list, file, lineno) < 0) goto fail;
+			if (users_include(ctx, dict, &sbuff, &tmp_list, file, lineno, at_runtime) < 0) goto fail;
 
 			/*
 			 *	The file may have read no entries, one
@@ -607,6 +607,109 @@ static int cmd_show_server_list(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx,
 	return 0;
 }
 
+static int cmd_show_server_latency(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	CONF_SECTION	*server_cs = ctx;
+	CONF_SECTION	*subcs = NULL;
+	fr_histogram_t	*h;
+
+	MEM(h = talloc_zero(NULL, fr_histogram_t));
+
+	/*
+	 *	Only sections which have been compiled can have
+	 *	statistics.
+	 */
+	while ((subcs = cf_section_next(server_cs, subcs))) {
+		char const	*name2 = cf_section_name2(subcs);
+		char		prefix[256];
+		bool		enabled;
+
+		fr_histogram_clear(h);
+		if (unlang_section_latency(h, &enabled, subcs) < 0) continue;
+
+		if (name2) {
+			snprintf(prefix, sizeof(prefix), "%s.%s", cf_section_name1(subcs), name2);
+		} else {
+			strlcpy(prefix, cf_section_name1(subcs), sizeof(prefix));
+		}
+
+		fprintf(fp, "%s.enabled\t%s\n", prefix, enabled ? "yes" : "no");
+		fr_histogram_fprint(fp, h, prefix);
+	}
+
+	talloc_free(h);
+
+	return 0;
+}
+
+static int cmd_set_server_latency(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	CONF_SECTION	*server_cs = ctx;
+	CONF_SECTION	*subcs = NULL;
+	bool		enable;
+
+	if (strcmp(info->argv[0], "on") == 0) {
+		enable = true;
+
+	} else if (strcmp(info->argv[0], "off") == 0) {
+		enable = false;
+
+	} else {
+		fprintf(fp_err, "Unknown value '%s'\n", info->argv[0]);
+		return -1;
+	}
+
+	while ((subcs = cf_section_next(server_cs, subcs))) (void) unlang_section_latency_set(subcs, enable);
+
+	return 0;
+}
+
+static int cmd_show_policy_latency(FILE *fp, FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	CONF_SECTION	*policy_cs = ctx;
+	fr_histogram_t	*h;
+	bool		enabled;
+
+	MEM(h = talloc_zero(NULL, fr_histogram_t));
+
+	if (unlang_policy_latency(h, &enabled, policy_cs) < 0) {
+		fprintf(fp_err, "Policy %s is not used\n", cf_section_name1(policy_cs));
+		talloc_free(h);
+		return -1;
+	}
+
+	fprintf(fp, "enabled\t%s\n", enabled ? "yes" : "no");
+	fr_histogram_fprint(fp, h, "latency");
+
+	talloc_free(h);
+
+	return 0;
+}
+
+static int cmd_set_policy_latency(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	CONF_SECTION	*policy_cs = ctx;
+	bool		enable;
+
+	if (strcmp(info->argv[0], "on") == 0) {
+		enable = true;
+
+	} else if (strcmp(info->argv[0], "off") == 0) {
+		enable = false;
+
+	} else {
+		fprintf(fp_err, "Unknown value '%s'\n", info->argv[0]);
+		return -1;
+	}
+
+	if (unlang_policy_latency_set(policy_cs, enable) < 0) {
+		fprintf(fp_err, "Policy %s is not used\n", cf_section_name1(policy_cs));
+		return -1;
+	}
+
+	return 0;
+}
+
 static fr_cmd_table_t cmd_table[] = {
 	{
 		.parent = "show",
@@ -623,10 +726,77 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "set",
+		.name = "server",
+		.help = "Change virtual server settings.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "show",
+		.name = "policy",
+		.help = "Show policy settings.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set",
+		.name = "policy",
+		.help = "Change policy settings.",
+		.read_only = false,
+	},
+
 	CMD_TABLE_END
 
 };
 
+static fr_cmd_table_t cmd_server_table[] = {
+	{
+		.parent = "show server",
+		.add_name = true,
+		.name = "latency",
+		.func = cmd_show_server_latency,
+		.help = "Show how long each processing section of a virtual server takes, in microseconds.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set server",
+		.add_name = true,
+		.name = "latency",
+		.syntax = "(on|off)",
+		.func = cmd_set_server_latency,
+		.help = "Start or stop recording how long each processing section of a virtual server takes.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
+static fr_cmd_table_t cmd_policy_table[] = {
+	{
+		.parent = "show policy",
+		.add_name = true,
+		.name = "latency",
+		.func = cmd_show_policy_latency,
+		.help = "Show how long calls to a policy take, in microseconds.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set policy",
+		.add_name = true,
+		.name = "latency",
+		.syntax = "(on|off)",
+		.func = cmd_set_policy_latency,
+		.help = "Start or stop recording how long calls to a policy take.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
 /** Compare listeners by app_io_addr
  *
  *  Only works for IP addresses, and will blow up on file names
@@ -757,6 +927,7 @@ static int process_instantiate(CONF_SECTION *server_cs, dl_module_inst_t *dl_ins
 int virtual_servers_instantiate(void)
 {
 	size_t		i, server_cnt = virtual_servers ? talloc_array_length(virtual_servers) : 0;
+	CONF_SECTION	*policy_cs;
 
 	fr_assert(virtual_servers);
 
@@ -812,6 +983,11 @@ int virtual_servers_instantiate(void)
 
 		if (process_instantiate(server_cs, virtual_servers[i]->process_module, dict->dict) < 0) return -1;
 
+		if (fr_command_register_hook(NULL, cf_section_name2(server_cs), server_cs, cmd_server_table) < 0) {
+			PERROR("Failed registering radmin commands for virtual server %s", cf_section_name2(server_cs));
+			return -1;
+		}
+
 		if (virtual_servers[i]->dynamic_client_module &&
 		    (process_instantiate(server_cs, virtual_servers[i]->dynamic_client_module, dict->dict) < 0)) return -1;
 
@@ -851,6 +1027,22 @@ int virtual_servers_instantiate(void)
 		}
 	}
 
+	/*
+	 *	Policies are compiled into the virtual servers
+	 *	which call them, so their commands go here, too.
+	 */
+	policy_cs = cf_section_find(virtual_server_root, "policy", NULL);
+	if (policy_cs) {
+		CONF_SECTION *subcs = NULL;
+
+		while ((subcs = cf_section_next(policy_cs, subcs))) {
+			if (fr_command_register_hook(NULL, cf_section_name1(subcs), subcs, cmd_policy_table) < 0) {
+				PERROR("Failed registering radmin commands for policy %s", cf_section_name1(subcs));
+				return -1;
+			}
+		}
+	}
+
 	return 0;
 }
 
@@ -36,7 +36,17 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/unlang/function.h>
 #include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/atexit.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
 
 #include "attrs.h"
 #include "base.h"
@@ -108,6 +118,450 @@ void tls_cache_clear_state_reset(fr_tls_cache_t *cache)
 	cache->clear.state = FR_TLS_CACHE_CLEAR_INIT;
 }
 
+/*
+ *	In-memory session cache
+ *
+ *	Each worker keeps an LRU of serialised sessions for every TLS
+ *	configuration it uses, so that resuming a session on the worker
+ *	which created it requires no locks, and no subrequests to an
+ *	external store.
+ *
+ *	Sessions can also be written to a tier shared between workers,
+ *	for clients whose packets are handled by a different worker
+ *	when they resume.  The shared tier is split into stripes, each
+ *	protected by its own mutex, to limit contention.
+ *
+ *	Clearing a session increments a counter on the stripe the
+ *	session ID hashes to.  Entries in the per-worker LRUs record
+ *	the value of the counter when they were last validated, and
+ *	are re-validated against the shared tier (or discarded) if it
+ *	has changed.  This stops a session cleared by one worker being
+ *	resumed on another.
+ */
+#define TLS_CACHE_MEMORY_STRIPE_BITS	(5)
+#define TLS_CACHE_MEMORY_STRIPES	(1 << TLS_CACHE_MEMORY_STRIPE_BITS)
+
+/** A serialised session
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+	uint32_t		hash;			//!< Of the session ID.
+	uint64_t		cleared;		//!< Value of the stripe's clear counter when this
+							///< entry was last validated.
+	fr_time_t		expires;		//!< When the session can no longer be resumed.
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];	//!< Session ID.
+	unsigned int		id_len;			//!< Length of the session ID.
+	size_t			len;			//!< Length of the serialised session.
+	uint8_t			data[];			//!< Serialised session.
+} tls_cache_memory_entry_t;
+
+/** A size limited set of sessions
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*ht;			//!< Entries by session ID.
+	fr_dlist_head_t		lru;			//!< Most recently used entries at the head.
+	uint32_t		max_entries;		//!< Maximum number of entries.
+} tls_cache_memory_tier_t;
+
+/** One stripe of the shared tier
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects the tier.
+	tls_cache_memory_tier_t	tier;			//!< Only initialised if the shared tier is enabled.
+	atomic_uint_fast64_t	cleared;		//!< Incremented whenever a session which hashes
+							///< to this stripe is cleared.
+} tls_cache_memory_stripe_t;
+
+struct fr_tls_cache_memory_s {
+	uint64_t		id;			//!< Identifies the per-worker caches for this
+							///< configuration.
+	uint32_t		max_entries;		//!< Maximum number of sessions per worker.
+	bool			shared;			//!< Whether the shared tier is enabled.
+
+	tls_cache_memory_stripe_t stripe[TLS_CACHE_MEMORY_STRIPES];
+};
+
+/** The sessions a worker holds for one TLS configuration
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the worker's list of caches.
+	uint64_t		id;			//!< Of the #fr_tls_cache_memory_t this belongs to.
+	tls_cache_memory_tier_t	tier;			//!< Sessions private to this worker.
+} tls_cache_memory_local_t;
+
+static atomic_uint_fast64_t		tls_cache_memory_id;
+
+/** Per-worker caches, one for each TLS configuration the worker uses
+ */
+static _Thread_local fr_dlist_head_t	*tls_cache_memory_local;
+
+static uint32_t tls_cache_memory_entry_hash(void const *data)
+{
+	tls_cache_memory_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int8_t tls_cache_memory_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_memory_entry_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->id_len, b->id_len);
+	if (ret != 0) return ret;
+
+	return CMP(memcmp(a->id, b->id, a->id_len), 0);
+}
+
+static void tls_cache_memory_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Populate a lookup key for a session ID
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the session ID is too long to cache.
+ */
+static inline CC_HINT(always_inline)
+int tls_cache_memory_key(tls_cache_memory_entry_t *key, uint8_t const *id, size_t id_len)
+{
+	if (!id_len || (id_len > sizeof(key->id))) return -1;
+
+	memcpy(key->id, id, id_len);
+	key->id_len = id_len;
+	key->hash = fr_hash(id, id_len);
+
+	return 0;
+}
+
+/** Allocate an entry holding a copy of a serialised session
+ *
+ * Entries are allocated in the NULL ctx, as they may be created
+ * and freed by any worker.
+ */
+static tls_cache_memory_entry_t *tls_cache_memory_entry_alloc(tls_cache_memory_entry_t const *key,
+							      uint8_t const *data, size_t len, fr_time_t expires)
+{
+	tls_cache_memory_entry_t *entry;
+
+	MEM(entry = talloc_zero_size(NULL, sizeof(*entry) + len));
+	talloc_set_name_const(entry, "tls_cache_memory_entry_t");
+
+	memcpy(entry->id, key->id, key->id_len);
+	entry->id_len = key->id_len;
+	entry->hash = key->hash;
+	entry->expires = expires;
+	entry->len = len;
+	memcpy(entry->data, data, len);
+
+	return entry;
+}
+
+static void tls_cache_memory_tier_init(TALLOC_CTX *ctx, tls_cache_memory_tier_t *tier, uint32_t max_entries)
+{
+	MEM(tier->ht = fr_hash_table_alloc(ctx, tls_cache_memory_entry_hash, tls_cache_memory_entry_cmp,
+					   tls_cache_memory_entry_free));
+	fr_dlist_init(&tier->lru, tls_cache_memory_entry_t, entry);
+	tier->max_entries = max_entries;
+}
+
+static inline CC_HINT(always_inline)
+void tls_cache_memory_tier_delete(tls_cache_memory_tier_t *tier, tls_cache_memory_entry_t *entry)
+{
+	fr_dlist_remove(&tier->lru, entry);
+	fr_hash_table_delete(tier->ht, entry);
+}
+
+/** Find an unexpired entry, and mark it as most recently used
+ *
+ */
+static tls_cache_memory_entry_t *tls_cache_memory_tier_find(tls_cache_memory_tier_t *tier,
+							    tls_cache_memory_entry_t const *key, fr_time_t now)
+{
+	tls_cache_memory_entry_t *entry;
+
+	entry = fr_hash_table_find(tier->ht, key);
+	if (!entry) return NULL;
+
+	if (fr_time_lteq(entry->expires, now)) {
+		tls_cache_memory_tier_delete(tier, entry);
+		return NULL;
+	}
+
+	fr_dlist_remove(&tier->lru, entry);
+	fr_dlist_insert_head(&tier->lru, entry);
+
+	return entry;
+}
+
+/** Insert an entry, replacing any with the same session ID, and evicting the least recently used
+ *
+ */
+static void tls_cache_memory_tier_insert(tls_cache_memory_tier_t *tier, tls_cache_memory_entry_t *entry)
+{
+	tls_cache_memory_entry_t *old;
+
+	old = fr_hash_table_find(tier->ht, entry);
+	if (old) tls_cache_memory_tier_delete(tier, old);
+
+	while (fr_hash_table_num_elements(tier->ht) >= tier->max_entries) {
+		tls_cache_memory_tier_delete(tier, fr_dlist_tail(&tier->lru));
+	}
+
+	if (unlikely(!fr_hash_table_insert(tier->ht, entry))) {
+		talloc_free(entry);
+		return;
+	}
+	fr_dlist_insert_head(&tier->lru, entry);
+}
+
+static void _tls_cache_memory_local_free(void *list)
+{
+	talloc_free(list);
+}
+
+/** Return this worker's cache for a TLS configuration, creating it if needed
+ *
+ */
+static tls_cache_memory_local_t *tls_cache_memory_local_find(fr_tls_cache_memory_t const *mem)
+{
+	tls_cache_memory_local_t *local = NULL;
+
+	if (unlikely(!tls_cache_memory_local)) {
+		fr_dlist_head_t *list;
+
+		MEM(list = talloc_zero(NULL, fr_dlist_head_t));
+		fr_dlist_talloc_init(list, tls_cache_memory_local_t, entry);
+		fr_atexit_thread_local(tls_cache_memory_local, _tls_cache_memory_local_free, list);
+	}
+
+	while ((local = fr_dlist_next(tls_cache_memory_local, local))) {
+		if (local->id == mem->id) return local;
+	}
+
+	MEM(local = talloc_zero(tls_cache_memory_local, tls_cache_memory_local_t));
+	local->id = mem->id;
+	tls_cache_memory_tier_init(local, &local->tier, mem->max_entries);
+	fr_dlist_insert_tail(tls_cache_memory_local, local);
+
+	return local;
+}
+
+static inline CC_HINT(always_inline)
+tls_cache_memory_stripe_t *tls_cache_memory_stripe(fr_tls_cache_memory_t *mem, tls_cache_memory_entry_t const *key)
+{
+	/*
+	 *	Use the top bits, the hash tables use the bottom ones.
+	 */
+	return &mem->stripe[key->hash >> (32 - TLS_CACHE_MEMORY_STRIPE_BITS)];
+}
+
+/** Add a serialised session to the in-memory cache
+ *
+ * @param[in] request	The current request.
+ * @param[in] mem	In-memory cache to add the session to.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ * @param[in] data	Serialised session.
+ * @param[in] len	Length of the serialised session.
+ * @param[in] expires	When the session can no longer be resumed.
+ */
+static void tls_cache_memory_store(request_t *request, fr_tls_cache_memory_t *mem,
+				   uint8_t const *id, size_t id_len,
+				   uint8_t const *data, size_t len, fr_time_t expires)
+{
+	tls_cache_memory_entry_t	key, *entry;
+	tls_cache_memory_stripe_t	*stripe;
+	tls_cache_memory_local_t	*local;
+
+	if (tls_cache_memory_key(&key, id, id_len) < 0) return;
+
+	local = tls_cache_memory_local_find(mem);
+	stripe = tls_cache_memory_stripe(mem, &key);
+
+	entry = tls_cache_memory_entry_alloc(&key, data, len, expires);
+	entry->cleared = atomic_load(&stripe->cleared);
+
+	if (mem->shared) {
+		tls_cache_memory_entry_t *copy;
+
+		copy = tls_cache_memory_entry_alloc(&key, data, len, expires);
+
+		pthread_mutex_lock(&stripe->mutex);
+		tls_cache_memory_tier_insert(&stripe->tier, copy);
+		pthread_mutex_unlock(&stripe->mutex);
+	}
+
+	tls_cache_memory_tier_insert(&local->tier, entry);
+
+	RDEBUG3("Stored %zu bytes of session data in memory", len);
+}
+
+/** Retrieve a session from the in-memory cache
+ *
+ * @param[in] request	The current request.
+ * @param[in] mem	In-memory cache to search.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ * @return
+ *	- A deserialised session.
+ *	- NULL if no valid session was found.
+ */
+static SSL_SESSION *tls_cache_memory_load(request_t *request, fr_tls_cache_memory_t *mem,
+					  uint8_t const *id, size_t id_len)
+{
+	tls_cache_memory_entry_t	key, *entry;
+	tls_cache_memory_stripe_t	*stripe;
+	tls_cache_memory_local_t	*local;
+	fr_time_t			now = fr_time();
+	uint64_t			cleared;
+	uint8_t const			*q;
+	SSL_SESSION			*sess;
+
+	if (tls_cache_memory_key(&key, id, id_len) < 0) return NULL;
+
+	local = tls_cache_memory_local_find(mem);
+	stripe = tls_cache_memory_stripe(mem, &key);
+
+	/*
+	 *	Must be read before we search the shared tier
+	 *	so that we notice any clear which races with us.
+	 */
+	cleared = atomic_load(&stripe->cleared);
+
+	entry = tls_cache_memory_tier_find(&local->tier, &key, now);
+	if (entry && (entry->cleared != cleared)) {
+		bool found = false;
+
+		if (mem->shared) {
+			pthread_mutex_lock(&stripe->mutex);
+			found = (tls_cache_memory_tier_find(&stripe->tier, &key, now) != NULL);
+			pthread_mutex_unlock(&stripe->mutex);
+		}
+
+		if (found) {
+			entry->cleared = cleared;
+		} else {
+			tls_cache_memory_tier_delete(&local->tier, entry);
+			entry = NULL;
+		}
+	}
+
+	if (!entry && mem->shared) {
+		tls_cache_memory_entry_t *shared;
+
+		pthread_mutex_lock(&stripe->mutex);
+		shared = tls_cache_memory_tier_find(&stripe->tier, &key, now);
+		if (shared) entry = tls_cache_memory_entry_alloc(shared, shared->data, shared->len, shared->expires);
+		pthread_mutex_unlock(&stripe->mutex);
+
+		if (entry) {
+			RDEBUG3("Found session in shared memory cache");
+			entry->cleared = cleared;
+			tls_cache_memory_tier_insert(&local->tier, entry);
+		}
+	}
+
+	if (!entry) return NULL;
+
+	q = entry->data;	/* openssl will mutate q */
+	sess = d2i_SSL_SESSION(NULL, &q, entry->len);
+	if (!sess) {
+		fr_tls_log_error(request, "Failed loading session from memory");
+		tls_cache_memory_tier_delete(&local->tier, entry);
+		return NULL;
+	}
+	RDEBUG3("Read %zu bytes of session data from memory.  Session deserialized successfully", entry->len);
+
+	return sess;
+}
+
+/** Remove a session from the in-memory cache
+ *
+ * @param[in] mem	In-memory cache to remove the session from.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ */
+static void tls_cache_memory_clear(fr_tls_cache_memory_t *mem, uint8_t const *id, size_t id_len)
+{
+	tls_cache_memory_entry_t	key, *entry;
+	tls_cache_memory_stripe_t	*stripe;
+	tls_cache_memory_local_t	*local;
+
+	if (tls_cache_memory_key(&key, id, id_len) < 0) return;
+
+	local = tls_cache_memory_local_find(mem);
+	stripe = tls_cache_memory_stripe(mem, &key);
+
+	entry = fr_hash_table_find(local->tier.ht, &key);
+	if (entry) tls_cache_memory_tier_delete(&local->tier, entry);
+
+	pthread_mutex_lock(&stripe->mutex);
+	if (mem->shared) {
+		entry = fr_hash_table_find(stripe->tier.ht, &key);
+		if (entry) tls_cache_memory_tier_delete(&stripe->tier, entry);
+	}
+	atomic_fetch_add(&stripe->cleared, 1);
+	pthread_mutex_unlock(&stripe->mutex);
+}
+
+static int _tls_cache_memory_free(fr_tls_cache_memory_t *mem)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(mem->stripe); i++) pthread_mutex_destroy(&mem->stripe[i].mutex);
+
+	return 0;
+}
+
+/** Allocate the in-memory session cache for a TLS configuration
+ *
+ * Per-worker caches are created on first use.
+ *
+ * @param[in] ctx	to allocate the cache in.  Usually the #fr_tls_conf_t.
+ * @param[in] conf	In-memory cache configuration.
+ * @return
+ *	- A new in-memory cache.
+ *	- NULL on error.
+ */
+fr_tls_cache_memory_t *fr_tls_cache_memory_alloc(TALLOC_CTX *ctx, fr_tls_cache_memory_conf_t const *conf)
+{
+	fr_tls_cache_memory_t	*mem;
+	uint32_t		stripe_max = 0;
+	size_t			i;
+
+	fr_assert(conf->max_entries > 0);
+
+	mem = talloc_zero(ctx, fr_tls_cache_memory_t);
+	if (!mem) {
+		ERROR("Out of memory");
+		return NULL;
+	}
+
+	mem->id = atomic_fetch_add(&tls_cache_memory_id, 1);
+	mem->max_entries = conf->max_entries;
+	mem->shared = (conf->shared_max_entries > 0);
+	if (mem->shared) {
+		stripe_max = conf->shared_max_entries / TLS_CACHE_MEMORY_STRIPES;
+		if (stripe_max == 0) stripe_max = 1;
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(mem->stripe); i++) {
+		pthread_mutex_init(&mem->stripe[i].mutex, NULL);
+		atomic_init(&mem->stripe[i].cleared, 0);
+		if (mem->shared) tls_cache_memory_tier_init(mem, &mem->stripe[i].tier, stripe_max);
+	}
+	talloc_set_destructor(mem, _tls_cache_memory_free);
+
+	return mem;
+}
+
 /** Serialize the session-state list and store it in the SSL_SESSION *
  *
  */
@@ -259,6 +713,7 @@ static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSE
 {
 	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	fr_tls_conf_t		*conf = fr_tls_session_conf(tls_session->ssl);
 	fr_pair_t		*vp;
 	uint8_t const		*q, **p;
 	SSL_SESSION		*sess;
@@ -299,6 +754,17 @@ static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSE
 	 */
 	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, fr_tls_session(tls_session->ssl));
 
+	/*
+	 *	Keep a copy in memory so the next resumption
+	 *	doesn't need a round trip to the external store.
+	 */
+	if (conf->cache.mem) {
+		tls_cache_memory_store(request, conf->cache.mem,
+				       tls_cache->load.id, talloc_array_length(tls_cache->load.id),
+				       vp->vp_octets, vp->vp_length,
+				       fr_time_from_sec((time_t)(SSL_SESSION_get_time(sess) + SSL_get_timeout(sess))));
+	}
+
 	tls_cache->load.state = FR_TLS_CACHE_LOAD_RETRIEVED;
 	tls_cache->load.sess = sess;	/* This is consumed in tls_cache_load_cb */
 
@@ -417,6 +883,49 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	 */
 	if (tls_cache_app_data_set(request, sess) < 0) return UNLANG_ACTION_FAIL;
 
+	/*
+	 *	Serialize the session
+	 */
+	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
+	if (len < 1) {
+		/* something went wrong */
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session serialisation failed, couldn't determine required buffer length");
+	error:
+		tls_cache_store_state_reset(tls_cache);
+		talloc_free(data);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	MEM(data = talloc_array(tls_cache, uint8_t, len));
+
+	/* openssl mutates &p */
+	p = data;
+	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
+	if (ret != len) {
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session serialisation failed");
+		goto error;
+	}
+
+	if (conf->cache.mem) {
+		unsigned int	id_len;
+		uint8_t const	*id;
+
+		id = SSL_SESSION_get_id(sess, &id_len);
+		tls_cache_memory_store(request, conf->cache.mem, id, id_len, data, len, expires);
+	}
+
+	/*
+	 *	Nothing else to store the session in
+	 */
+	if (!conf->cache.external) {
+		talloc_free(data);
+		tls_cache_store_state_reset(tls_cache);
+		tls_cache->store.state = FR_TLS_CACHE_STORE_PERSISTED;	/* Avoid spurious clear calls */
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -440,40 +949,19 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	MEM(pair_update_request(&vp, attr_tls_session_ttl) >= 0);
 	vp->vp_time_delta = fr_time_sub(expires, now);
 
-	/*
-	 *	Serialize the session
-	 */
-	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
-	if (len < 1) {
-		/* something went wrong */
-		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session serialisation failed, couldn't determine required buffer length");
-	error:
-		tls_cache_store_state_reset(tls_cache);
-		talloc_free(child);
-		return UNLANG_ACTION_FAIL;
-	}
-
 	MEM(pair_update_request(&vp, attr_tls_session_data) >= 0);
-	MEM(data = talloc_array(vp, uint8_t, len));
-
-	/* openssl mutates &p */
-	p = data;
-	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
-	if (ret != len) {
-		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session serialisation failed");
-		talloc_free(data);
-		goto error;
-	}
-	fr_pair_value_memdup_buffer_shallow(vp, data, true);
+	fr_pair_value_memdup_buffer_shallow(vp, talloc_steal(vp, data), true);
 
 	/*
 	 *	Allocate a child, and set it up to call
 	 *      the TLS virtual server.
 	 */
 	ua = fr_tls_call_push(child, tls_cache_store_result, conf, tls_session);
-	if (ua < 0) goto error;
+	if (ua < 0) {
+		tls_cache_store_state_reset(tls_cache);
+		talloc_free(child);
+		return UNLANG_ACTION_FAIL;
+	}
 
 	return ua;
 }
@@ -521,6 +1009,15 @@ unlang_action_t tls_cache_clear_push(request_t *request, fr_tls_conf_t *conf, fr
 	fr_assert(tls_cache->clear.state == FR_TLS_CACHE_CLEAR_REQUESTED);
 	fr_assert(tls_cache->clear.id);
 
+	if (conf->cache.mem) {
+		tls_cache_memory_clear(conf->cache.mem, tls_cache->clear.id, talloc_array_length(tls_cache->clear.id));
+	}
+
+	if (!conf->cache.external) {
+		tls_cache_clear_state_reset(tls_cache);
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -668,11 +1165,13 @@ static SSL_SESSION *tls_cache_load_cb(SSL *ssl,
 {
 	fr_tls_session_t	*tls_session;
 	fr_tls_cache_t		*tls_cache;
+	fr_tls_conf_t		*conf;
 	request_t		*request;
 
 	tls_session = fr_tls_session(ssl);
 	request = fr_tls_session_request(tls_session->ssl);
 	tls_cache = tls_session->cache;
+	conf = fr_tls_session_conf(ssl);
 
 	/*
 	 *	Request was cancelled, don't return any session and hopefully
@@ -703,6 +1202,29 @@ again:
 	case FR_TLS_CACHE_LOAD_INIT:
 		fr_assert(!tls_cache->load.id);
 
+		/*
+		 *	Sessions found in memory don't need a
+		 *	subrequest, so we can carry straight on
+		 *	with the certificate re-validation.
+		 */
+		if (conf->cache.mem) {
+			SSL_SESSION *sess;
+
+			sess = tls_cache_memory_load(request, conf->cache.mem, key, key_len);
+			if (sess) {
+				SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+
+				tls_cache->load.state = FR_TLS_CACHE_LOAD_RETRIEVED;
+				tls_cache->load.sess = sess;
+				goto again;
+			}
+		}
+
+		if (!conf->cache.external) {
+			RDEBUG3("Session not found in memory");
+			return NULL;
+		}
+
 		tls_cache->load.state = FR_TLS_CACHE_LOAD_REQUESTED;
 		MEM(tls_cache->load.id = talloc_typed_memdup(tls_cache, (uint8_t const *)key, key_len));
 
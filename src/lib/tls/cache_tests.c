@@ -0,0 +1,428 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the in-memory TLS session cache
+ *
+ * @file src/lib/tls/cache_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#	define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+
+#include "cache.c"
+
+/*
+ *	These are hidden in libfreeradius-tls, so the copy of
+ *	cache.c compiled into the test can't see them.  Only
+ *	the subrequest code uses them.
+ */
+fr_dict_t const *dict_tls;
+fr_dict_attr_t const *attr_allow_session_resumption;
+fr_dict_attr_t const *attr_tls_packet_type;
+fr_dict_attr_t const *attr_tls_session_data;
+fr_dict_attr_t const *attr_tls_session_id;
+fr_dict_attr_t const *attr_tls_session_ttl;
+
+/** The cache only uses the request for logging
+ *
+ * A zeroed request has no log destinations, and a log level of 0.
+ */
+static request_t test_request;
+
+/** A cipher for the test sessions, OpenSSL won't serialise a session without one
+ */
+static SSL_CIPHER const *test_cipher;
+
+static void test_init(void)
+{
+	SSL_CTX	*ctx;
+
+	if (fr_time_start() < 0) {
+		fr_perror("cache_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	ctx = SSL_CTX_new(TLS_method());
+	if (!ctx) {
+	error:
+		fprintf(stderr, "cache_tests: Failed finding a cipher\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+	test_cipher = sk_SSL_CIPHER_value(SSL_CTX_get_ciphers(ctx), 0);
+	SSL_CTX_free(ctx);	/* Ciphers are static, so test_cipher remains valid */
+	if (!test_cipher) goto error;
+}
+
+/** Create a session ID, which is all zeros apart from the first four bytes
+ *
+ */
+static void test_id(uint8_t id[SSL_MAX_SSL_SESSION_ID_LENGTH], uint32_t num)
+{
+	memset(id, 0, SSL_MAX_SSL_SESSION_ID_LENGTH);
+	memcpy(id, &num, sizeof(num));
+}
+
+/** Serialise a session with a particular ID
+ *
+ * @return the length of the serialised session.
+ */
+static size_t test_session(uint8_t **out, uint32_t num)
+{
+	SSL_SESSION	*sess;
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t		*p;
+	int		len;
+
+	test_id(id, num);
+
+	sess = SSL_SESSION_new();
+	TEST_ASSERT(sess != NULL);
+	TEST_ASSERT(SSL_SESSION_set_protocol_version(sess, TLS1_2_VERSION) == 1);
+	TEST_ASSERT(SSL_SESSION_set1_id(sess, id, sizeof(id)) == 1);
+	TEST_ASSERT(SSL_SESSION_set_cipher(sess, test_cipher) == 1);
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	TEST_ASSERT(len > 0);
+
+	*out = p = talloc_array(NULL, uint8_t, len);
+	TEST_ASSERT(i2d_SSL_SESSION(sess, &p) == len);
+	SSL_SESSION_free(sess);
+
+	return len;
+}
+
+/** Store a session which expires after lifetime
+ *
+ */
+static void test_store(fr_tls_cache_memory_t *mem, uint32_t num, fr_time_delta_t lifetime)
+{
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t		*data;
+	size_t		len;
+
+	test_id(id, num);
+	len = test_session(&data, num);
+
+	tls_cache_memory_store(&test_request, mem, id, sizeof(id), data, len, fr_time_add(fr_time(), lifetime));
+	talloc_free(data);
+}
+
+/** Load a session, and check that it's the one we asked for
+ *
+ * @return true if the session was found.
+ */
+static bool test_load(fr_tls_cache_memory_t *mem, uint32_t num)
+{
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t const	*sess_id;
+	unsigned int	sess_id_len;
+	SSL_SESSION	*sess;
+
+	test_id(id, num);
+
+	sess = tls_cache_memory_load(&test_request, mem, id, sizeof(id));
+	if (!sess) return false;
+
+	sess_id = SSL_SESSION_get_id(sess, &sess_id_len);
+	TEST_CHECK((sess_id_len == sizeof(id)) && (memcmp(sess_id, id, sizeof(id)) == 0));
+	TEST_MSG("Loaded the wrong session for ID %u", num);
+	SSL_SESSION_free(sess);
+
+	return true;
+}
+
+static void test_clear(fr_tls_cache_memory_t *mem, uint32_t num)
+{
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+
+	test_id(id, num);
+	tls_cache_memory_clear(mem, id, sizeof(id));
+}
+
+/** Return the number of entries in this thread's tier
+ *
+ */
+static uint32_t test_local_count(fr_tls_cache_memory_t *mem)
+{
+	return fr_hash_table_num_elements(tls_cache_memory_local_find(mem)->tier.ht);
+}
+
+static tls_cache_memory_stripe_t *test_stripe(fr_tls_cache_memory_t *mem, uint32_t num)
+{
+	tls_cache_memory_entry_t	key;
+	uint8_t				id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+
+	test_id(id, num);
+	TEST_ASSERT(tls_cache_memory_key(&key, id, sizeof(id)) == 0);
+
+	return tls_cache_memory_stripe(mem, &key);
+}
+
+/** Run a function in a new thread, which has its own per-thread tier
+ *
+ * This is what happens when a session is resumed on another worker.
+ */
+typedef void (*test_thread_func_t)(fr_tls_cache_memory_t *mem, uint32_t num);
+
+typedef struct {
+	test_thread_func_t	func;
+	fr_tls_cache_memory_t	*mem;
+	uint32_t		num;
+} test_thread_t;
+
+static void *_test_thread(void *uctx)
+{
+	test_thread_t *t = uctx;
+
+	t->func(t->mem, t->num);
+
+	return NULL;
+}
+
+static void test_in_thread(test_thread_func_t func, fr_tls_cache_memory_t *mem, uint32_t num)
+{
+	test_thread_t	t = { .func = func, .mem = mem, .num = num };
+	pthread_t	thread;
+
+	TEST_ASSERT(pthread_create(&thread, NULL, _test_thread, &t) == 0);
+	pthread_join(thread, NULL);
+}
+
+static void _test_store(fr_tls_cache_memory_t *mem, uint32_t num)
+{
+	test_store(mem, num, fr_time_delta_from_sec(60));
+}
+
+static void test_memory_insert(void)
+{
+	fr_tls_cache_memory_conf_t	conf = { .max_entries = 16 };
+	fr_tls_cache_memory_t		*mem;
+	uint8_t				id[SSL_MAX_SSL_SESSION_ID_LENGTH + 1] = { 0 };
+	uint32_t			i;
+
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	TEST_CASE("Sessions which haven't been stored aren't found");
+	TEST_CHECK(!test_load(mem, 1));
+
+	TEST_CASE("Stored sessions are found");
+	for (i = 1; i <= 8; i++) test_store(mem, i, fr_time_delta_from_sec(60));
+	for (i = 1; i <= 8; i++) {
+		TEST_CHECK(test_load(mem, i));
+		TEST_MSG("Session %u wasn't found", i);
+	}
+	TEST_CHECK(test_local_count(mem) == 8);
+
+	TEST_CASE("Storing a session with the same ID replaces it");
+	test_store(mem, 1, fr_time_delta_from_sec(60));
+	TEST_CHECK(test_local_count(mem) == 8);
+	TEST_CHECK(test_load(mem, 1));
+
+	TEST_CASE("Cleared sessions aren't found");
+	test_clear(mem, 1);
+	TEST_CHECK(!test_load(mem, 1));
+	TEST_CHECK(test_load(mem, 2));
+	TEST_CHECK(test_local_count(mem) == 7);
+
+	TEST_CASE("Session IDs which are empty or too long are ignored");
+	tls_cache_memory_store(&test_request, mem, id, 0, id, 1, fr_time_add(fr_time(), fr_time_delta_from_sec(60)));
+	tls_cache_memory_store(&test_request, mem, id, sizeof(id), id, 1, fr_time_add(fr_time(), fr_time_delta_from_sec(60)));
+	TEST_CHECK(test_local_count(mem) == 7);
+	TEST_CHECK(tls_cache_memory_load(&test_request, mem, id, sizeof(id)) == NULL);
+
+	talloc_free(mem);
+}
+
+static void test_memory_evict(void)
+{
+	fr_tls_cache_memory_conf_t	conf = { .max_entries = 4 };
+	fr_tls_cache_memory_t		*mem;
+	uint32_t			i;
+
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	TEST_CASE("The tier doesn't grow past max_entries");
+	for (i = 1; i <= 5; i++) test_store(mem, i, fr_time_delta_from_sec(60));
+	TEST_CHECK(test_local_count(mem) == 4);
+
+	TEST_CASE("The oldest session is evicted");
+	TEST_CHECK(!test_load(mem, 1));
+	for (i = 2; i <= 5; i++) {
+		TEST_CHECK(test_load(mem, i));
+		TEST_MSG("Session %u was evicted", i);
+	}
+
+	/*
+	 *	Loading moves a session to the head of the LRU,
+	 *	so 3 is now the least recently used.
+	 */
+	TEST_CASE("The least recently used session is evicted");
+	TEST_CHECK(test_load(mem, 2));
+	test_store(mem, 6, fr_time_delta_from_sec(60));
+	TEST_CHECK(test_local_count(mem) == 4);
+	TEST_CHECK(!test_load(mem, 3));
+	TEST_CHECK(test_load(mem, 2));
+	TEST_CHECK(test_load(mem, 6));
+
+	talloc_free(mem);
+}
+
+static void test_memory_expire(void)
+{
+	fr_tls_cache_memory_conf_t	conf = { .max_entries = 16, .shared_max_entries = 64 };
+	fr_tls_cache_memory_t		*mem;
+
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	test_store(mem, 1, fr_time_delta_from_sec(60));
+	test_store(mem, 2, fr_time_delta_from_msec(10));
+	test_store(mem, 3, fr_time_delta_wrap(0));
+
+	TEST_CASE("Sessions which have expired aren't found");
+	TEST_CHECK(!test_load(mem, 3));
+	TEST_CHECK(test_load(mem, 2));
+
+	TEST_CASE("Sessions expire after their lifetime");
+	usleep(20 * 1000);
+	TEST_CHECK(!test_load(mem, 2));
+	TEST_CHECK(test_load(mem, 1));
+
+	TEST_CASE("Expired sessions are removed from both tiers");
+	TEST_CHECK(test_local_count(mem) == 1);
+	TEST_CHECK(fr_hash_table_num_elements(test_stripe(mem, 2)->tier.ht) == 0);
+	TEST_CHECK(fr_hash_table_num_elements(test_stripe(mem, 3)->tier.ht) == 0);
+
+	talloc_free(mem);
+}
+
+static void test_memory_shared(void)
+{
+	fr_tls_cache_memory_conf_t	conf = { .max_entries = 16, .shared_max_entries = 64 };
+	fr_tls_cache_memory_t		*mem;
+
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	TEST_CASE("Sessions stored by another thread are found in the shared tier");
+	test_in_thread(_test_store, mem, 1);
+	TEST_CHECK(test_local_count(mem) == 0);
+	TEST_CHECK(test_load(mem, 1));
+
+	TEST_CASE("Sessions found in the shared tier are copied to the per-thread tier");
+	TEST_CHECK(test_local_count(mem) == 1);
+	TEST_CHECK(fr_hash_table_num_elements(test_stripe(mem, 1)->tier.ht) == 1);
+
+	TEST_CASE("Sessions stay in the per-thread tier if they're removed from the shared tier");
+	tls_cache_memory_tier_delete(&test_stripe(mem, 1)->tier,
+				     fr_dlist_head(&test_stripe(mem, 1)->tier.lru));
+	TEST_CHECK(test_load(mem, 1));
+
+	talloc_free(mem);
+
+	TEST_CASE("Without a shared tier, sessions stored by another thread aren't found");
+	conf.shared_max_entries = 0;
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	test_in_thread(_test_store, mem, 1);
+	TEST_CHECK(!test_load(mem, 1));
+
+	talloc_free(mem);
+}
+
+static void test_memory_cleared(void)
+{
+	fr_tls_cache_memory_conf_t	conf = { .max_entries = 16, .shared_max_entries = 64 };
+	fr_tls_cache_memory_t		*mem;
+	tls_cache_memory_stripe_t	*stripe;
+	tls_cache_memory_entry_t	*entry;
+	uint64_t			cleared, total = 0;
+	uint32_t			other;
+	size_t				i;
+
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	/*
+	 *	Find another session ID in the same stripe as 1.
+	 */
+	stripe = test_stripe(mem, 1);
+	for (other = 2; test_stripe(mem, other) != stripe; other++);
+
+	test_store(mem, 1, fr_time_delta_from_sec(60));
+	test_store(mem, other, fr_time_delta_from_sec(60));
+
+	TEST_CASE("Clearing a session increments the stripe's counter");
+	cleared = atomic_load(&stripe->cleared);
+	test_in_thread(test_clear, mem, 1);
+	TEST_CHECK(atomic_load(&stripe->cleared) == cleared + 1);
+	for (i = 0; i < NUM_ELEMENTS(mem->stripe); i++) total += atomic_load(&mem->stripe[i].cleared);
+	TEST_CHECK(total == cleared + 1);
+	TEST_MSG("Expected only one stripe's counter to change");
+
+	TEST_CASE("Sessions cleared by another thread aren't found in the per-thread tier");
+	TEST_CHECK(test_local_count(mem) == 2);
+	TEST_CHECK(!test_load(mem, 1));
+	TEST_CHECK(test_local_count(mem) == 1);
+
+	TEST_CASE("Other sessions in the stripe are re-validated against the shared tier");
+	TEST_CHECK(test_load(mem, other));
+	TEST_CHECK(test_local_count(mem) == 1);
+	entry = fr_dlist_head(&tls_cache_memory_local_find(mem)->tier.lru);
+	TEST_CHECK(entry && (entry->cleared == atomic_load(&stripe->cleared)));
+
+	talloc_free(mem);
+
+	/*
+	 *	Without a shared tier there's nothing to re-validate
+	 *	against, so all the sessions in the stripe are dropped.
+	 */
+	TEST_CASE("Without a shared tier, clearing drops all the stripe's per-thread sessions");
+	conf.shared_max_entries = 0;
+	mem = fr_tls_cache_memory_alloc(NULL, &conf);
+	TEST_ASSERT(mem != NULL);
+
+	test_store(mem, 1, fr_time_delta_from_sec(60));
+	test_store(mem, other, fr_time_delta_from_sec(60));
+	test_in_thread(test_clear, mem, 1);
+	TEST_CHECK(!test_load(mem, other));
+	TEST_CHECK(!test_load(mem, 1));
+	TEST_CHECK(test_local_count(mem) == 0);
+
+	talloc_free(mem);
+}
+
+TEST_LIST = {
+	{ "memory_insert",	test_memory_insert },
+	{ "memory_evict",	test_memory_evict },
+	{ "memory_expire",	test_memory_expire },
+	{ "memory_shared",	test_memory_shared },
+	{ "memory_cleared",	test_memory_cleared },
+
+	{ NULL }
+};
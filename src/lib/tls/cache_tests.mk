@@ -0,0 +1,9 @@
+ifneq ($(OPENSSL_LIBS),)
+TARGET		:= cache_tests
+endif
+
+SOURCES		:= cache_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(OPENSSL_FLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-tls.a libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
@@ -77,6 +77,13 @@ static fr_table_num_sorted_t const verify_mode_table[] = {
 };
 static size_t verify_mode_table_len = NUM_ELEMENTS(verify_mode_table);
 
+static CONF_PARSER tls_cache_memory_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_cache_memory_conf_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("shared_max_entries", FR_TYPE_UINT32, fr_tls_cache_memory_conf_t, shared_max_entries), .dflt = "0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER tls_cache_config[] = {
 	{ FR_CONF_OFFSET("mode", FR_TYPE_UINT32, fr_tls_cache_conf_t, mode),
 			 .func = cf_table_parse_int,
@@ -88,6 +95,8 @@ static CONF_PARSER tls_cache_config[] = {
 	{ FR_CONF_OFFSET("name", FR_TYPE_TMPL, fr_tls_cache_conf_t, id_name),
 			 .dflt = "%{EAP-Type}%{Virtual-Server}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, fr_tls_cache_conf_t, lifetime), .dflt = "1d" },
+	{ FR_CONF_OFFSET("memory", FR_TYPE_SUBSECTION, fr_tls_cache_conf_t, memory),
+			 .subcs = (void const *) tls_cache_memory_config },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_cache_conf_t, require_extms), .dflt = "yes" },
@@ -351,6 +360,32 @@ fr_tls_conf_t *fr_tls_conf_alloc(TALLOC_CTX *ctx)
 	return conf;
 }
 
+/** Check whether a virtual server can be used to persist sessions
+ *
+ * @param[in] server	to check.  May be NULL.
+ * @return
+ *	- true if the server contains load, store and clear session sections.
+ *	- false if it doesn't.
+ */
+static bool conf_cache_sections(CONF_SECTION *server)
+{
+	int found = 0;
+
+	if (!server) return false;
+
+	if (cf_section_find(server, "load", "session")) found++;
+	if (cf_section_find(server, "store", "session")) found++;
+	if (cf_section_find(server, "clear", "session")) found++;
+
+	if (found == 3) return true;
+
+	if (found) WARN("Specified virtual_server must contain \"load session { ... }\", "
+			"\"store session { ... }\" and \"clear session { ... }\" sections to persist sessions.  "
+			"Sessions will only be stored in memory");
+
+	return false;
+}
+
 fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 {
 	fr_tls_conf_t *conf;
@@ -398,6 +433,16 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		break;
 
 	case FR_TLS_CACHE_STATEFUL:
+		/*
+		 *	With the in-memory cache the virtual server
+		 *	is optional.  If it has the session sections
+		 *	it's used as a second level cache.
+		 */
+		if (conf->cache.memory.max_entries && (conf->tls_min_version < (float)1.3)) {
+			conf->cache.external = conf_cache_sections(conf->virtual_server);
+			break;
+		}
+
 		if (!conf->virtual_server) {
 			ERROR("A virtual_server must be set when cache.mode = \"stateful\"");
 			goto error;
@@ -425,9 +470,15 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 			ERROR("cache.mode = \"stateful\" is not supported with tls_min_version >= 1.3");
 			goto error;
 		}
+		conf->cache.external = true;
 		break;
 
 	case FR_TLS_CACHE_AUTO:
+		if (conf->cache.memory.max_entries && (conf->tls_min_version < (float)1.3)) {
+			conf->cache.external = conf_cache_sections(conf->virtual_server);
+			break;
+		}
+
 		if (!conf->virtual_server) {
 			WARN("A virtual_server must be provided for stateful caching. "
 			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
@@ -459,9 +510,19 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 			      "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
 			goto error;
 		}
+		conf->cache.external = true;
 		break;
 	}
 
+	/*
+	 *	Allocate the in-memory cache shared by all the
+	 *	SSL_CTX created from this configuration.
+	 */
+	if ((conf->cache.mode & FR_TLS_CACHE_STATEFUL) && conf->cache.memory.max_entries) {
+		conf->cache.mem = fr_tls_cache_memory_alloc(conf, &conf->cache.memory);
+		if (!conf->cache.mem) goto error;
+	}
+
 	/*
 	 *	Generate random, ephemeral, session-ticket keys.
 	 */
@@ -25,6 +25,7 @@
  */
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/compile.h>
+#include <freeradius-devel/unlang/compute.h>
 #include <freeradius-devel/unlang/function.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/unlang/module.h>
@@ -51,8 +51,32 @@ static unsigned int unlang_number = 1;
  */
 static _Thread_local unlang_thread_t *unlang_thread_array;
 
+/** Entry in the list of all thread arrays
+ *
+ * Lets other threads, e.g. the one running radmin, read the
+ * per-thread statistics.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in #unlang_thread_list.
+	unlang_thread_t		*array;		//!< The unlang_thread_array of one thread.
+} unlang_thread_list_entry_t;
+
+static fr_dlist_head_t unlang_thread_list;
+static pthread_mutex_t unlang_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static fr_rb_tree_t *unlang_instruction_tree = NULL;
 
+/** The calls to a policy
+ *
+ * Each call to a policy compiles it again, so this is kept with the
+ * policy's section, to find all the calls when recording and reporting
+ * latency for the policy.
+ */
+typedef struct {
+	unlang_group_t		**calls;	//!< Compiled calls to the policy.
+	bool			latency;	//!< Record how long calls to the policy take.
+} unlang_policy_t;
+
 /* Here's where we recognize all of our keywords: first the rcodes, then the
  * actions */
 fr_table_num_sorted_t const mod_rcode_table[] = {
@@ -3493,6 +3517,23 @@ static unlang_t *compile_function(unlang_t *parent, unlang_compile_t *unlang_ctx
 	if (!c) return NULL;
 	fr_assert(c != UNLANG_IGNORE);
 
+	if (c->type == UNLANG_TYPE_POLICY) {
+		unlang_policy_t	*p;
+		size_t		num;
+
+		p = cf_data_value(cf_data_find(subcs, unlang_policy_t, NULL));
+		if (!p) {
+			MEM(p = talloc_zero(subcs, unlang_policy_t));
+			MEM(p->calls = talloc_array(p, unlang_group_t *, 0));
+			cf_data_add(subcs, p, NULL, true);
+		}
+
+		num = talloc_array_length(p->calls);
+		MEM(p->calls = talloc_realloc(p, p->calls, unlang_group_t *, num + 1));
+		p->calls[num] = unlang_generic_to_group(c);
+		p->calls[num]->latency = p->latency;
+	}
+
 	/*
 	 *	Return the compiled thing if we can.
 	 */
@@ -3987,6 +4028,12 @@ int unlang_compile(CONF_SECTION *cs, rlm_components_t component, tmpl_rules_t co
 			    cs, &group_ext);
 	if (!c) return -1;
 
+	/*
+	 *	Give the section a number, so that it can have
+	 *	thread-specific data.
+	 */
+	c->number = unlang_number++;
+
 	if (DEBUG_ENABLED4) unlang_dump(c, 2);
 
 	/*
@@ -4029,6 +4076,7 @@ static int8_t instruction_cmp(void const *one, void const *two)
 void unlang_compile_init()
 {
 	unlang_instruction_tree = fr_rb_talloc_alloc(NULL, unlang_t, instruction_cmp, NULL);
+	fr_dlist_talloc_init(&unlang_thread_list, unlang_thread_list_entry_t, entry);
 }
 
 void unlang_compile_free()
@@ -4037,13 +4085,33 @@ void unlang_compile_free()
 }
 
 
+/** Remove a thread array from the list of all thread arrays
+ *
+ */
+static int _unlang_thread_array_free(unlang_thread_t *array)
+{
+	unlang_thread_list_entry_t *entry = NULL;
+
+	pthread_mutex_lock(&unlang_thread_mutex);
+	while ((entry = fr_dlist_next(&unlang_thread_list, entry))) {
+		if (entry->array != array) continue;
+
+		fr_dlist_remove(&unlang_thread_list, entry);
+		break;
+	}
+	pthread_mutex_unlock(&unlang_thread_mutex);
+
+	return 0;
+}
+
 /** Create thread-specific data structures for unlang
  *
  */
 int unlang_thread_instantiate(TALLOC_CTX *ctx)
 {
-	fr_rb_iter_inorder_t	iter;
-	unlang_t		*instruction;
+	fr_rb_iter_inorder_t		iter;
+	unlang_t			*instruction;
+	unlang_thread_list_entry_t	*entry;
 
 	if (unlang_thread_array) {
 		fr_strerror_const("already initialized");
@@ -4051,7 +4119,14 @@ int unlang_thread_instantiate(TALLOC_CTX *ctx)
 	}
 
 	MEM(unlang_thread_array = talloc_zero_array(ctx, unlang_thread_t, unlang_number + 1));
-//	talloc_set_destructor(unlang_thread_array, _unlang_thread_array_free);
+	talloc_set_destructor(unlang_thread_array, _unlang_thread_array_free);
+
+	MEM(entry = talloc_zero(unlang_thread_array, unlang_thread_list_entry_t));
+	entry->array = unlang_thread_array;
+
+	pthread_mutex_lock(&unlang_thread_mutex);
+	fr_dlist_insert_tail(&unlang_thread_list, entry);
+	pthread_mutex_unlock(&unlang_thread_mutex);
 
 	/*
 	 *	Instantiate each instruction with thread-specific data.
@@ -4082,6 +4157,141 @@ int unlang_thread_instantiate(TALLOC_CTX *ctx)
 	return 0;
 }
 
+/** Record how long a section or policy took to run
+ *
+ * Called when the frame of a section with latency recording
+ * enabled is cleaned up, or when a frame moves past a call
+ * to a policy with latency recording enabled.
+ *
+ * @param[in] frame	of the section or policy.
+ */
+void unlang_frame_latency_record(unlang_stack_frame_t *frame)
+{
+	unlang_t const	*instruction = frame->instruction;
+	unlang_thread_t	*t;
+	fr_time_t	start = frame->latency_start;
+
+	frame->latency_start = fr_time_wrap(0);
+
+	if (!instruction || !instruction->number || !unlang_thread_array ||
+	    (instruction->number >= talloc_array_length(unlang_thread_array))) return;
+
+	t = &unlang_thread_array[instruction->number];
+	if (unlikely(!t->latency)) MEM(t->latency = talloc_zero(unlang_thread_array, fr_histogram_t));
+
+	fr_histogram_add(t->latency, fr_time_sub(fr_time(), start));
+}
+
+/** Start or stop recording how long a section takes to run
+ *
+ * @param[in] cs	a compiled section, e.g. "recv Access-Request".
+ * @param[in] enable	recording.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the section hasn't been compiled.
+ */
+int unlang_section_latency_set(CONF_SECTION *cs, bool enable)
+{
+	unlang_group_t *g;
+
+	g = (unlang_group_t *)cf_data_value(cf_data_find(cs, unlang_group_t, NULL));
+	if (!g) return -1;
+
+	g->latency = enable;
+
+	return 0;
+}
+
+/** Merge the latency histograms of all threads for an instruction
+ *
+ * The histograms are read whilst other threads write to them,
+ * see #fr_histogram_t.
+ */
+static void unlang_latency_merge(fr_histogram_t *out, unsigned int number)
+{
+	unlang_thread_list_entry_t	*entry = NULL;
+
+	if (!number) return;
+
+	pthread_mutex_lock(&unlang_thread_mutex);
+	while ((entry = fr_dlist_next(&unlang_thread_list, entry))) {
+		if (number >= talloc_array_length(entry->array)) continue;
+		if (!entry->array[number].latency) continue;
+
+		fr_histogram_merge(out, entry->array[number].latency);
+	}
+	pthread_mutex_unlock(&unlang_thread_mutex);
+}
+
+/** Merge the latency histograms of all threads for a section
+ *
+ * @param[out] out	to add the values to.
+ * @param[out] enabled	whether latency is being recorded for the section.  May be NULL.
+ * @param[in] cs	a compiled section, e.g. "recv Access-Request".
+ * @return
+ *	- 0 on success.
+ *	- -1 if the section hasn't been compiled.
+ */
+int unlang_section_latency(fr_histogram_t *out, bool *enabled, CONF_SECTION *cs)
+{
+	unlang_group_t const		*g;
+
+	g = (unlang_group_t const *)cf_data_value(cf_data_find(cs, unlang_group_t, NULL));
+	if (!g) return -1;
+
+	if (enabled) *enabled = g->latency;
+
+	unlang_latency_merge(out, g->self.number);
+
+	return 0;
+}
+
+/** Start or stop recording how long calls to a policy take
+ *
+ * @param[in] cs	of the policy, i.e. a subsection of "policy".
+ * @param[in] enable	recording.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the policy isn't called from anywhere.
+ */
+int unlang_policy_latency_set(CONF_SECTION *cs, bool enable)
+{
+	unlang_policy_t	*p;
+	size_t		i;
+
+	p = cf_data_value(cf_data_find(cs, unlang_policy_t, NULL));
+	if (!p) return -1;
+
+	p->latency = enable;
+	for (i = 0; i < talloc_array_length(p->calls); i++) p->calls[i]->latency = enable;
+
+	return 0;
+}
+
+/** Merge the latency histograms of all threads, and all calls, for a policy
+ *
+ * @param[out] out	to add the values to.
+ * @param[out] enabled	whether latency is being recorded for the policy.  May be NULL.
+ * @param[in] cs	of the policy, i.e. a subsection of "policy".
+ * @return
+ *	- 0 on success.
+ *	- -1 if the policy isn't called from anywhere.
+ */
+int unlang_policy_latency(fr_histogram_t *out, bool *enabled, CONF_SECTION *cs)
+{
+	unlang_policy_t const	*p;
+	size_t			i;
+
+	p = cf_data_value(cf_data_find(cs, unlang_policy_t, NULL));
+	if (!p) return -1;
+
+	if (enabled) *enabled = p->latency;
+
+	for (i = 0; i < talloc_array_length(p->calls); i++) unlang_latency_merge(out, p->calls[i]->self.number);
+
+	return 0;
+}
+
 #ifdef WITH_PERF
 void unlang_frame_perf_init(unlang_t const *instruction)
 {
@@ -31,6 +31,7 @@ extern "C" {
 #include <freeradius-devel/server/cf_util.h>
 #include <freeradius-devel/server/components.h>
 #include <freeradius-devel/server/tmpl.h>
+#include <freeradius-devel/util/histogram.h>
 #include <freeradius-devel/util/retry.h>
 
 typedef struct {
@@ -48,6 +49,14 @@ bool		unlang_compile_is_keyword(const char *name);
 
 bool		unlang_compile_actions(unlang_actions_t *actions, CONF_SECTION *parent, bool module_retry);
 
+int		unlang_section_latency_set(CONF_SECTION *cs, bool enable);
+
+int		unlang_section_latency(fr_histogram_t *out, bool *enabled, CONF_SECTION *cs);
+
+int		unlang_policy_latency_set(CONF_SECTION *cs, bool enable);
+
+int		unlang_policy_latency(fr_histogram_t *out, bool *enabled, CONF_SECTION *cs);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,486 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file unlang/compute.c
+ * @brief Offload CPU heavy work from worker threads to a pool of compute threads.
+ *
+ * A pool is shared by all the workers.  Each worker has an #unlang_compute_thread_t
+ * with a pipe registered in its event list.  Compute threads pull jobs from the pool
+ * queue, run them, put them on the done list of the worker which submitted them,
+ * and poke its pipe.  The worker then marks the request runnable.
+ *
+ * Requests are never touched outside of their worker thread.  If a request is
+ * cancelled while its job is running, the job is orphaned and freed when it
+ * completes.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/unlang/compute.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef TESTING_COMPUTE
+static void test_mark_runnable(request_t *request);
+#  define unlang_interpret_mark_runnable test_mark_runnable
+#endif
+
+typedef enum {
+	COMPUTE_JOB_QUEUED = 0,				//!< Waiting for a compute thread.
+	COMPUTE_JOB_RUNNING,				//!< Being run by a compute thread.
+	COMPUTE_JOB_DONE				//!< On the done list of its worker.
+} compute_job_state_t;
+
+typedef struct {
+	fr_dlist_t		entry;			//!< In the pool queue, or the done list of ct.
+
+	unlang_compute_thread_t	*ct;			//!< Worker which submitted the job.
+	request_t		*request;		//!< To resume.  NULL if the request was cancelled.
+							///< Only accessed from the worker thread.
+
+	unlang_compute_func_t	func;			//!< To run in the compute thread.
+	void			*uctx;			//!< Parented by the job until it completes.
+
+	compute_job_state_t	state;			//!< Protected by the pool mutex.
+	fr_time_t		queued;			//!< When the job was submitted.
+} compute_job_t;
+
+struct unlang_compute_pool_s {
+	char const		*name;			//!< For errors and debug messages.
+
+	uint32_t		num_threads;		//!< How many compute threads to start.
+	uint32_t		max_queue;		//!< Jobs submitted past this many are refused.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below, and the
+							///< done lists and run counts of the workers.
+	pthread_cond_t		work;			//!< Signalled when a job is queued, or on shutdown.
+	pthread_cond_t		idle;			//!< Signalled when a worker has no running jobs.
+
+	fr_dlist_head_t		queue;			//!< Of jobs waiting for a compute thread.
+
+	pthread_t		*threads;		//!< Compute threads.
+	uint32_t		started;		//!< How many compute threads are running.
+	bool			shutdown;		//!< Tell the compute threads to exit.
+
+	unlang_compute_stats_t	stats;			//!< Counters and latencies.
+};
+
+struct unlang_compute_thread_s {
+	unlang_compute_pool_t	*pool;			//!< We submit jobs to.
+	fr_event_list_t		*el;			//!< Of the worker.
+
+	int			pipe[2];		//!< Compute threads write to pipe[1] when
+							///< they add to an empty done list.
+
+	fr_dlist_head_t		done;			//!< Completed jobs.  Protected by the pool mutex.
+	uint32_t		running;		//!< Jobs being run for us.  Protected by the pool mutex.
+};
+
+/** Main loop of a compute thread
+ *
+ */
+static void *compute_thread(void *arg)
+{
+	unlang_compute_pool_t	*pool = arg;
+	compute_job_t		*job;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		unlang_compute_thread_t	*ct;
+		fr_time_t		started, stopped;
+		fr_time_delta_t		wait, run;
+		bool			notify;
+
+		while (!(job = fr_dlist_pop_head(&pool->queue))) {
+			if (pool->shutdown) goto done;
+			pthread_cond_wait(&pool->work, &pool->mutex);
+		}
+
+		ct = job->ct;
+		job->state = COMPUTE_JOB_RUNNING;
+		ct->running++;
+		pool->stats.depth--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		started = fr_time();
+		job->func(job->uctx);
+		stopped = fr_time();
+
+		wait = fr_time_sub(started, job->queued);
+		run = fr_time_sub(stopped, started);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->stats.completed++;
+		pool->stats.wait_total = fr_time_delta_add(pool->stats.wait_total, wait);
+		if (fr_time_delta_gt(wait, pool->stats.wait_max)) pool->stats.wait_max = wait;
+		pool->stats.run_total = fr_time_delta_add(pool->stats.run_total, run);
+		if (fr_time_delta_gt(run, pool->stats.run_max)) pool->stats.run_max = run;
+
+		/*
+		 *	Only poke the worker if it doesn't already
+		 *	have completions waiting.  It takes the whole
+		 *	done list each time the pipe is readable.
+		 *
+		 *	The write is done with the mutex held, so that
+		 *	the worker can't free ct underneath us.
+		 */
+		job->state = COMPUTE_JOB_DONE;
+		notify = (fr_dlist_num_elements(&ct->done) == 0);
+		fr_dlist_insert_tail(&ct->done, job);
+		if (notify) {
+			while (write(ct->pipe[1], ".", 1) == 0) {
+				/* nothing */
+			}
+		}
+
+		if (--ct->running == 0) pthread_cond_broadcast(&pool->idle);
+	}
+
+done:
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Resume the requests whose jobs have completed
+ *
+ */
+static void compute_done(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	unlang_compute_thread_t	*ct = talloc_get_type_abort(uctx, unlang_compute_thread_t);
+	fr_dlist_head_t		done;
+	compute_job_t		*job;
+	char			buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0) {
+		/* nothing */
+	}
+
+	fr_dlist_init(&done, compute_job_t, entry);
+
+	pthread_mutex_lock(&ct->pool->mutex);
+	fr_dlist_move(&done, &ct->done);
+	pthread_mutex_unlock(&ct->pool->mutex);
+
+	while ((job = fr_dlist_pop_head(&done))) {
+		request_t *request = job->request;
+
+		/*
+		 *	The request went away while the
+		 *	job was running, nothing to resume.
+		 */
+		if (!request) {
+			talloc_free(job);
+			continue;
+		}
+
+		/*
+		 *	Give the results back to the request
+		 */
+		(void) talloc_steal(request, job->uctx);
+		talloc_free(job);
+
+		unlang_interpret_mark_runnable(request);
+	}
+}
+
+/** Stop the compute threads, and wait for them to exit
+ *
+ */
+static int _compute_pool_free(unlang_compute_pool_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->started; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Allocate a compute pool
+ *
+ * The compute threads are not started until the first worker calls
+ * #unlang_compute_thread_alloc, so the pool can be allocated before
+ * the server forks.
+ *
+ * @param[in] ctx		to allocate the pool in.  Must be freed after
+ *				all the #unlang_compute_thread_t using the pool.
+ * @param[in] name		of the pool, used in error messages.
+ * @param[in] num_threads	how many compute threads to start.
+ * @param[in] max_queue		how many jobs can be waiting for a compute thread.
+ *				Past this, #unlang_compute_submit fails.
+ * @return
+ *	- A new compute pool.
+ *	- NULL on error.
+ */
+unlang_compute_pool_t *unlang_compute_pool_alloc(TALLOC_CTX *ctx, char const *name,
+						 uint32_t num_threads, uint32_t max_queue)
+{
+	unlang_compute_pool_t	*pool;
+
+	if (!num_threads) {
+		fr_strerror_printf("%s - Compute pool needs at least one thread", name);
+		return NULL;
+	}
+
+	MEM(pool = talloc_zero(ctx, unlang_compute_pool_t));
+	pool->name = talloc_strdup(pool, name);
+	pool->num_threads = num_threads;
+	pool->max_queue = max_queue;
+	MEM(pool->threads = talloc_zero_array(pool, pthread_t, num_threads));
+
+	fr_dlist_init(&pool->queue, compute_job_t, entry);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	talloc_set_destructor(pool, _compute_pool_free);
+
+	return pool;
+}
+
+/** Copy the current statistics for a compute pool
+ *
+ * @param[out] stats		Where to write the statistics.
+ * @param[in] pool		to get statistics for.
+ */
+void unlang_compute_pool_stats(unlang_compute_stats_t *stats, unlang_compute_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Discard jobs we queued, and wait for any we have running to complete
+ *
+ */
+static int _compute_thread_free(unlang_compute_thread_t *ct)
+{
+	unlang_compute_pool_t *pool = ct->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	fr_dlist_foreach_safe(&pool->queue, compute_job_t, job) {
+		if (job->ct != ct) continue;
+
+		fr_dlist_remove(&pool->queue, job);
+		pool->stats.depth--;
+	}}
+
+	while (ct->running > 0) pthread_cond_wait(&pool->idle, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	(void) fr_event_fd_delete(ct->el, ct->pipe[0], FR_EVENT_FILTER_IO);
+
+	close(ct->pipe[0]);
+	close(ct->pipe[1]);
+
+	return 0;
+}
+
+/** Allocate the per-worker side of a compute pool
+ *
+ * Starts the compute threads of the pool if they're not already running.
+ *
+ * @param[in] ctx		to allocate the thread data in.  Usually the
+ *				thread instance data of a module.
+ * @param[in] pool		to submit jobs to.
+ * @param[in] el		of the worker.  Completions are delivered here.
+ * @return
+ *	- Per-worker compute data.
+ *	- NULL on error.
+ */
+unlang_compute_thread_t *unlang_compute_thread_alloc(TALLOC_CTX *ctx, unlang_compute_pool_t *pool,
+						     fr_event_list_t *el)
+{
+	unlang_compute_thread_t	*ct;
+	int			ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->started < pool->num_threads) {
+		ret = pthread_create(&pool->threads[pool->started], NULL, compute_thread, pool);
+		if (ret != 0) {
+			pthread_mutex_unlock(&pool->mutex);
+			fr_strerror_printf("%s - Failed starting compute thread: %s", pool->name, fr_syserror(ret));
+			return NULL;
+		}
+		pool->started++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	MEM(ct = talloc_zero(ctx, unlang_compute_thread_t));
+	ct->pool = pool;
+	ct->el = el;
+	fr_dlist_init(&ct->done, compute_job_t, entry);
+
+	if (pipe((int *) &ct->pipe) < 0) {
+		fr_strerror_printf("%s - Failed opening compute pipe: %s", pool->name, fr_syserror(errno));
+		talloc_free(ct);
+		return NULL;
+	}
+
+	if ((fcntl(ct->pipe[0], F_SETFL, O_NONBLOCK) < 0) ||
+	    (fcntl(ct->pipe[0], F_SETFD, FD_CLOEXEC) < 0) ||
+	    (fcntl(ct->pipe[1], F_SETFL, O_NONBLOCK) < 0) ||
+	    (fcntl(ct->pipe[1], F_SETFD, FD_CLOEXEC) < 0)) {
+		fr_strerror_printf("%s - Failed setting compute pipe flags: %s", pool->name, fr_syserror(errno));
+	error:
+		close(ct->pipe[0]);
+		close(ct->pipe[1]);
+		talloc_free(ct);
+		return NULL;
+	}
+
+	if (fr_event_fd_insert(ct, el, ct->pipe[0], compute_done, NULL, NULL, ct) < 0) {
+		fr_strerror_printf_push("%s - Failed adding compute pipe to event list", pool->name);
+		goto error;
+	}
+	talloc_set_destructor(ct, _compute_thread_free);
+
+	return ct;
+}
+
+/** Run a function in a compute thread
+ *
+ * If the job is queued, the caller should yield the request with
+ * uctx as the resume ctx.  The request is marked runnable when
+ * the job completes.  Cancellation is handled by passing
+ * #unlang_compute_signal as the signal callback, or calling it
+ * from the module's signal callback.
+ *
+ * If there's no compute pool, the function is run immediately and
+ * the caller should continue without yielding.
+ *
+ * If too many jobs are already waiting, the job is refused rather
+ * than being run in the worker.  Running it inline would stall the
+ * worker under exactly the load the pool is meant to absorb.
+ *
+ * @param[in] ct		Per-worker compute data.  May be NULL, in which
+ *				case the function is always run inline.
+ * @param[in] request		The job is running on behalf of.
+ * @param[in] func		to run.  See #unlang_compute_func_t for restrictions.
+ * @param[in] uctx		A talloced chunk holding all input and output for func.
+ *				It is reparented while the job is in progress, and
+ *				given back to the request when the job completes.
+ * @return
+ *	- 1 if func was run inline.  Results are available immediately.
+ *	- 0 if the job was queued.  The caller must yield.
+ *	- -1 if the queue is full.  func was not run, and uctx is unchanged.
+ */
+int unlang_compute_submit(unlang_compute_thread_t *ct, request_t *request,
+			  unlang_compute_func_t func, void *uctx)
+{
+	unlang_compute_pool_t	*pool;
+	compute_job_t		*job;
+
+	if (!ct) goto run;
+
+	pool = ct->pool;
+
+	MEM(job = talloc(ct, compute_job_t));
+	*job = (compute_job_t) {
+		.ct = ct,
+		.request = request,
+		.func = func,
+		.uctx = uctx,
+		.state = COMPUTE_JOB_QUEUED,
+		.queued = fr_time()
+	};
+
+	pthread_mutex_lock(&pool->mutex);
+	if (fr_dlist_num_elements(&pool->queue) >= pool->max_queue) {
+		pool->stats.full++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		talloc_free(job);
+		fr_strerror_printf("%s - Compute queue full (%u jobs waiting)", pool->name, pool->max_queue);
+		return -1;
+	}
+
+	(void) talloc_steal(job, uctx);
+	fr_dlist_insert_tail(&pool->queue, job);
+
+	pool->stats.queued++;
+	if (++pool->stats.depth > pool->stats.depth_max) pool->stats.depth_max = pool->stats.depth;
+
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	RDEBUG3("%s - Queued compute job", pool->name);
+
+	return 0;
+
+run:
+	func(uctx);
+
+	return 1;
+}
+
+/** Cancel the job for a request which has yielded waiting on the compute pool
+ *
+ * Can be used directly as the signal callback for #unlang_module_yield,
+ * where the resume ctx is the uctx passed to #unlang_compute_submit.
+ *
+ * Queued jobs are discarded.  Running jobs are left to complete,
+ * and their results are freed.
+ *
+ * Once the job has completed, uctx is given back to the request,
+ * and the job is freed before the request resumes.  A cancellation
+ * arriving in that window has nothing to do.
+ */
+void unlang_compute_signal(module_ctx_t const *mctx, request_t *request, fr_state_signal_t action)
+{
+	compute_job_t		*job;
+	unlang_compute_pool_t	*pool;
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	job = talloc_get_type(talloc_parent(mctx->rctx), compute_job_t);
+	if (!job) return;
+
+	pool = job->ct->pool;
+
+	RDEBUG2("%s - Cancelling compute job", pool->name);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stats.cancelled++;
+	if (job->state == COMPUTE_JOB_QUEUED) {
+		fr_dlist_remove(&pool->queue, job);
+		pool->stats.depth--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		talloc_free(job);
+		return;
+	}
+	job->request = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,91 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * $Id$
+ *
+ * @file unlang/compute.h
+ * @brief Offload CPU heavy work from worker threads to a pool of compute threads.
+ *
+ * Work such as deliberately slow password hashing blocks the worker, and every
+ * other request it owns, for as long as the hash takes.  Modules can instead
+ * hand the work to a compute pool and yield the request.  When the work is
+ * complete the request is marked runnable again in its own worker thread.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(unlang_compute_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/module_ctx.h>
+#include <freeradius-devel/server/signal.h>
+#include <freeradius-devel/util/event.h>
+
+typedef struct unlang_compute_pool_s unlang_compute_pool_t;
+typedef struct unlang_compute_thread_s unlang_compute_thread_t;
+
+/** Work to run in a compute thread
+ *
+ * The function runs outside of the worker thread which owns the request.
+ * It must not touch the request, log against it, or allocate memory from any
+ * talloc context other than one it owns exclusively.  All input and output
+ * should be done via uctx.
+ *
+ * @param[in,out] uctx		Provided to #unlang_compute_submit.
+ */
+typedef void (*unlang_compute_func_t)(void *uctx);
+
+/** Statistics for a compute pool
+ *
+ */
+typedef struct {
+	uint64_t		queued;			//!< Jobs passed to the compute threads.
+	uint64_t		completed;		//!< Jobs the compute threads finished.
+	uint64_t		cancelled;		//!< Jobs whose request went away first.
+	uint64_t		full;			//!< Jobs refused because the queue was full.
+
+	uint32_t		depth;			//!< Jobs currently waiting for a compute thread.
+	uint32_t		depth_max;		//!< High water mark of depth.
+
+	fr_time_delta_t		wait_total;		//!< Total time jobs spent waiting in the queue.
+	fr_time_delta_t		wait_max;		//!< Longest time a job spent waiting in the queue.
+	fr_time_delta_t		run_total;		//!< Total time spent running jobs.
+	fr_time_delta_t		run_max;		//!< Longest time spent running a single job.
+} unlang_compute_stats_t;
+
+unlang_compute_pool_t	*unlang_compute_pool_alloc(TALLOC_CTX *ctx, char const *name,
+						   uint32_t num_threads, uint32_t max_queue);
+
+void			unlang_compute_pool_stats(unlang_compute_stats_t *stats, unlang_compute_pool_t *pool)
+			CC_HINT(nonnull);
+
+unlang_compute_thread_t	*unlang_compute_thread_alloc(TALLOC_CTX *ctx, unlang_compute_pool_t *pool,
+						     fr_event_list_t *el);
+
+int			unlang_compute_submit(unlang_compute_thread_t *ct, request_t *request,
+					      unlang_compute_func_t func, void *uctx)
+			CC_HINT(nonnull(2,3,4));
+
+void			unlang_compute_signal(module_ctx_t const *mctx, request_t *request, fr_state_signal_t action);
+
+#ifdef __cplusplus
+}
+#endif
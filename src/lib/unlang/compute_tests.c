@@ -0,0 +1,394 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the compute offload pool
+ *
+ * @file src/lib/unlang/compute_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include "compute.c"
+
+typedef struct {
+	int		value;			//!< Input.
+	int		result;			//!< Output.
+	bool		block;			//!< Wait for test_gate_release() before completing.
+} test_job_t;
+
+/*
+ *	Lets the tests hold a job in a compute thread.
+ */
+static pthread_mutex_t	gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	gate_cond = PTHREAD_COND_INITIALIZER;
+static bool		gate_started;
+static bool		gate_released;
+static unsigned int	jobs_run;
+
+/*
+ *	Only touched by the worker, i.e. the test thread.
+ */
+static unsigned int	runnable_count;
+static request_t	*runnable_last;
+
+static void test_mark_runnable(request_t *request)
+{
+	runnable_count++;
+	runnable_last = request;
+}
+
+static void test_func(void *uctx)
+{
+	test_job_t *job = uctx;
+
+	pthread_mutex_lock(&gate_mutex);
+	jobs_run++;
+	if (job->block) {
+		gate_started = true;
+		pthread_cond_broadcast(&gate_cond);
+		while (!gate_released) pthread_cond_wait(&gate_cond, &gate_mutex);
+	}
+	pthread_mutex_unlock(&gate_mutex);
+
+	job->result = job->value * 2;
+}
+
+static void test_reset(void)
+{
+	pthread_mutex_lock(&gate_mutex);
+	gate_started = false;
+	gate_released = false;
+	jobs_run = 0;
+	pthread_mutex_unlock(&gate_mutex);
+
+	runnable_count = 0;
+	runnable_last = NULL;
+}
+
+static void test_gate_wait_started(void)
+{
+	pthread_mutex_lock(&gate_mutex);
+	while (!gate_started) pthread_cond_wait(&gate_cond, &gate_mutex);
+	pthread_mutex_unlock(&gate_mutex);
+}
+
+static void test_gate_release(void)
+{
+	pthread_mutex_lock(&gate_mutex);
+	gate_released = true;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_mutex);
+}
+
+static unsigned int test_jobs_run(void)
+{
+	unsigned int ret;
+
+	pthread_mutex_lock(&gate_mutex);
+	ret = jobs_run;
+	pthread_mutex_unlock(&gate_mutex);
+
+	return ret;
+}
+
+/** Run the event loop until enough requests have been marked runnable, or we give up
+ *
+ */
+static bool test_service_until(fr_event_list_t *el, unsigned int target)
+{
+	int i;
+
+	for (i = 0; (i < 5000) && (runnable_count < target); i++) {
+		if (fr_event_corral(el, fr_time(), false) > 0) {
+			fr_event_service(el);
+			continue;
+		}
+		usleep(1000);
+	}
+
+	return (runnable_count >= target);
+}
+
+static test_job_t *test_job_alloc(TALLOC_CTX *ctx, int value, bool block)
+{
+	test_job_t *job;
+
+	job = talloc_zero(ctx, test_job_t);
+	job->value = value;
+	job->block = block;
+
+	return job;
+}
+
+/** With no compute pool, jobs run inline
+ *
+ */
+static void test_inline_no_pool(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	request_t	*request = talloc_zero(ctx, request_t);
+	test_job_t	*job = test_job_alloc(request, 21, false);
+
+	test_reset();
+
+	TEST_CHECK(unlang_compute_submit(NULL, request, test_func, job) == 1);
+	TEST_CHECK(job->result == 42);
+	TEST_CHECK(runnable_count == 0);
+
+	talloc_free(ctx);
+}
+
+/** The pipe is non-blocking, and closed on exec
+ *
+ */
+static void test_pipe_flags(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 1, 4);
+	unlang_compute_thread_t	*ct;
+	int			i;
+
+	TEST_CHECK(pool != NULL);
+	ct = unlang_compute_thread_alloc(ctx, pool, el);
+	TEST_CHECK(ct != NULL);
+
+	for (i = 0; i < 2; i++) {
+		TEST_CHECK((fcntl(ct->pipe[i], F_GETFL) & O_NONBLOCK) != 0);
+		TEST_MSG("pipe[%i] is blocking", i);
+		TEST_CHECK((fcntl(ct->pipe[i], F_GETFD) & FD_CLOEXEC) != 0);
+		TEST_MSG("pipe[%i] is not close on exec", i);
+	}
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+/** Queued jobs complete, and their requests are marked runnable
+ *
+ */
+static void test_queued(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 2, 64);
+	unlang_compute_thread_t	*ct = unlang_compute_thread_alloc(ctx, pool, el);
+	unlang_compute_stats_t	stats;
+	request_t		*request[10];
+	test_job_t		*job[10];
+	size_t			i;
+
+	test_reset();
+
+	for (i = 0; i < NUM_ELEMENTS(request); i++) {
+		request[i] = talloc_zero(ctx, request_t);
+		job[i] = test_job_alloc(request[i], i, false);
+
+		TEST_CHECK(unlang_compute_submit(ct, request[i], test_func, job[i]) == 0);
+	}
+
+	TEST_CHECK(test_service_until(el, NUM_ELEMENTS(request)));
+	TEST_MSG("Expected %zu runnable requests, got %u", NUM_ELEMENTS(request), runnable_count);
+
+	for (i = 0; i < NUM_ELEMENTS(request); i++) {
+		TEST_CHECK(job[i]->result == (int) (i * 2));
+		TEST_CHECK(talloc_parent(job[i]) == request[i]);
+	}
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.queued == NUM_ELEMENTS(request));
+	TEST_CHECK(stats.completed == NUM_ELEMENTS(request));
+	TEST_CHECK(stats.full == 0);
+	TEST_CHECK(stats.depth == 0);
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+/** Jobs past max_queue are refused
+ *
+ */
+static void test_queue_full(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 1, 1);
+	unlang_compute_thread_t	*ct = unlang_compute_thread_alloc(ctx, pool, el);
+	unlang_compute_stats_t	stats;
+	request_t		*request = talloc_zero(ctx, request_t);
+	test_job_t		*running, *queued, *full;
+
+	test_reset();
+
+	running = test_job_alloc(request, 1, true);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, running) == 0);
+	test_gate_wait_started();
+
+	queued = test_job_alloc(request, 2, false);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, queued) == 0);
+
+	full = test_job_alloc(request, 3, false);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, full) < 0);
+	TEST_CHECK(full->result == 0);
+	TEST_CHECK(talloc_parent(full) == request);
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.full == 1);
+	TEST_CHECK(stats.depth == 1);
+	TEST_CHECK(stats.depth_max == 1);
+
+	test_gate_release();
+	TEST_CHECK(test_service_until(el, 2));
+
+	TEST_CHECK(running->result == 2);
+	TEST_CHECK(queued->result == 4);
+	TEST_CHECK(test_jobs_run() == 2);
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+/** Cancelled jobs which haven't started are discarded
+ *
+ */
+static void test_cancel_queued(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 1, 4);
+	unlang_compute_thread_t	*ct = unlang_compute_thread_alloc(ctx, pool, el);
+	unlang_compute_stats_t	stats;
+	request_t		*request = talloc_zero(ctx, request_t);
+	request_t		*cancelled = talloc_zero(ctx, request_t);
+	test_job_t		*running, *queued;
+
+	test_reset();
+
+	running = test_job_alloc(request, 1, true);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, running) == 0);
+	test_gate_wait_started();
+
+	queued = test_job_alloc(cancelled, 2, false);
+	TEST_CHECK(unlang_compute_submit(ct, cancelled, test_func, queued) == 0);
+
+	unlang_compute_signal(&(module_ctx_t){ .rctx = queued }, cancelled, FR_SIGNAL_CANCEL);
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.cancelled == 1);
+	TEST_CHECK(stats.depth == 0);
+
+	test_gate_release();
+	TEST_CHECK(test_service_until(el, 1));
+	TEST_CHECK(runnable_last == request);
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.completed == 1);
+	TEST_CHECK(test_jobs_run() == 1);
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+/** Cancelled jobs which are running complete, but their requests aren't resumed
+ *
+ */
+static void test_cancel_running(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 1, 4);
+	unlang_compute_thread_t	*ct = unlang_compute_thread_alloc(ctx, pool, el);
+	unlang_compute_stats_t	stats;
+	request_t		*cancelled = talloc_zero(ctx, request_t);
+	request_t		*request = talloc_zero(ctx, request_t);
+	test_job_t		*running, *after;
+
+	test_reset();
+
+	running = test_job_alloc(cancelled, 1, true);
+	TEST_CHECK(unlang_compute_submit(ct, cancelled, test_func, running) == 0);
+	test_gate_wait_started();
+
+	unlang_compute_signal(&(module_ctx_t){ .rctx = running }, cancelled, FR_SIGNAL_CANCEL);
+	talloc_free(cancelled);
+
+	/*
+	 *	Queued behind the cancelled job, so once it's
+	 *	runnable, the cancelled job has been delivered too.
+	 */
+	after = test_job_alloc(request, 2, false);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, after) == 0);
+
+	test_gate_release();
+	TEST_CHECK(test_service_until(el, 1));
+	TEST_CHECK(runnable_count == 1);
+	TEST_CHECK(runnable_last == request);
+	TEST_CHECK(after->result == 4);
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.cancelled == 1);
+	TEST_CHECK(stats.completed == 2);
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+/** Cancelling after the job has completed, but before the request resumes, does nothing
+ *
+ */
+static void test_cancel_completed(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	unlang_compute_pool_t	*pool = unlang_compute_pool_alloc(ctx, "test", 1, 4);
+	unlang_compute_thread_t	*ct = unlang_compute_thread_alloc(ctx, pool, el);
+	unlang_compute_stats_t	stats;
+	request_t		*request = talloc_zero(ctx, request_t);
+	test_job_t		*job;
+
+	test_reset();
+
+	job = test_job_alloc(request, 5, false);
+	TEST_CHECK(unlang_compute_submit(ct, request, test_func, job) == 0);
+
+	TEST_CHECK(test_service_until(el, 1));
+	TEST_CHECK(talloc_parent(job) == request);
+
+	unlang_compute_signal(&(module_ctx_t){ .rctx = job }, request, FR_SIGNAL_CANCEL);
+
+	TEST_CHECK(job->result == 10);
+	TEST_CHECK(talloc_parent(job) == request);
+
+	unlang_compute_pool_stats(&stats, pool);
+	TEST_CHECK(stats.cancelled == 0);
+	TEST_CHECK(stats.completed == 1);
+
+	talloc_free(ct);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "inline_no_pool",	test_inline_no_pool },
+	{ "pipe_flags",		test_pipe_flags },
+	{ "queued",		test_queued },
+	{ "queue_full",		test_queue_full },
+	{ "cancel_queued",	test_cancel_queued },
+	{ "cancel_running",	test_cancel_running },
+	{ "cancel_completed",	test_cancel_completed },
+
+	{ NULL }
+};
@@ -0,0 +1,9 @@
+TARGET		:= compute_tests
+
+SOURCES		:= compute_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
+SRC_CFLAGS	+= -DTESTING_COMPUTE
@@ -56,6 +56,12 @@ static unlang_action_t unlang_policy(rlm_rcode_t *result, request_t *request, un
 	 */
 	return_point_set(frame);
 
+	/*
+	 *	The time is recorded when the frame moves past
+	 *	the policy, i.e. after all of its children have run.
+	 */
+	if (unlikely(unlang_generic_to_group(frame->instruction)->latency)) frame->latency_start = fr_time();
+
 	return unlang_group(result, request, frame);
 }
 
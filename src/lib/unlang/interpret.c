@@ -777,6 +777,13 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 	stack->result = frame->result;
 
+	/*
+	 *	Top frames which return early, e.g. via "handled",
+	 *	don't go through frame_cleanup(), so record the
+	 *	latency of the section here.
+	 */
+	if (unlikely(fr_time_gt(frame->latency_start, fr_time_wrap(0)))) unlang_frame_latency_record(frame);
+
 	stack->depth--;
 	DUMP_STACK;
 
@@ -837,7 +844,16 @@ int unlang_interpret_push_section(request_t *request, CONF_SECTION *cs, rlm_rcod
 		}
 	}
 
-	return unlang_interpret_push_instruction(request, instruction, default_rcode, top_frame);
+	if (unlang_interpret_push_instruction(request, instruction, default_rcode, top_frame) < 0) return -1;
+
+	/*
+	 *	The time is recorded when the frame is cleaned up.
+	 */
+	if (instruction && unlikely(unlang_generic_to_group(instruction)->latency)) {
+		frame_current(request)->latency_start = fr_time();
+	}
+
+	return 0;
 }
 
 /** Push an instruction onto the request stack for later interpretation.
@@ -658,6 +658,19 @@ static unlang_action_t unlang_module_done(rlm_rcode_t *p_result, request_t *requ
 	RDEBUG("%s (%s)", frame->instruction->name ? frame->instruction->name : "",
 	       fr_table_str_by_value(mod_rcode_table, rcode, "<invalid>"));
 
+	/*
+	 *	Includes any time spent yielded, or running
+	 *	child sections.
+	 */
+	if (unlikely(fr_time_gt(state->latency_start, fr_time_wrap(0)))) {
+		module_thread_instance_t *thread = state->thread;
+
+		if (unlikely(!thread->latency)) MEM(thread->latency = talloc_zero(thread, fr_histogram_t));
+
+		fr_histogram_add(thread->latency, fr_time_sub(fr_time(), state->latency_start));
+		state->latency_start = fr_time_wrap(0);
+	}
+
 	request->rcode = rcode;
 	if (state->p_result) *state->p_result = rcode;	/* Inform our caller if we have one */
 	*p_result = rcode;
@@ -912,6 +925,8 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	 */
 	state->thread->total_calls++;
 
+	if (unlikely(mc->instance->latency)) state->latency_start = fr_time();
+
 	/*
 	 *	If we're doing retries, remember when we started
 	 *	running the module.
@@ -79,6 +79,9 @@ typedef struct {
 
 	/** @} */
 
+	fr_time_t			latency_start;	//!< When the module was called, if the
+							///< module is recording latency.
+
 } unlang_frame_state_module_t;
 
 static inline unlang_module_t *unlang_generic_to_module(unlang_t const *p)
@@ -148,6 +148,9 @@ typedef struct {
 	unlang_t		**tail;		//!< pointer to the tail which gets updated
 	CONF_SECTION		*cs;
 	int			num_children;
+	bool			latency;	//!< Record how long the section takes to run.
+						///< Set from radmin, and only used for top level
+						///< sections and calls to policies.
 } unlang_group_t;
 
 /** A naked xlat
@@ -229,6 +232,7 @@ typedef struct {
 typedef struct {
 	unlang_t const		*instruction;			//!< instruction which we're executing
 	void			*thread_inst;			//!< thread-specific instance data
+	fr_histogram_t		*latency;			//!< of the section, allocated on first use.
 #ifdef WITH_PERF
 	uint64_t		use_count;
 	fr_time_t		enter;
@@ -237,6 +241,8 @@ typedef struct {
 #endif
 } unlang_thread_t;
 
+void		unlang_frame_latency_record(unlang_stack_frame_t *frame);
+
 #ifdef WITH_PERF
 void		unlang_frame_perf_init(unlang_t const *instruction);
 
@@ -294,6 +300,9 @@ struct unlang_stack_frame_s {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+	fr_time_t		latency_start;			//!< When a section or policy with latency
+								///< recording enabled started running.
 };
 
 /** An unlang stack associated with a request
@@ -437,6 +446,8 @@ static inline void frame_cleanup(unlang_stack_frame_t *frame)
 		TALLOC_FREE(frame->state);
 	}
 
+	if (unlikely(fr_time_gt(frame->latency_start, fr_time_wrap(0)))) unlang_frame_latency_record(frame);
+
 	unlang_frame_perf_cleanup(frame->instruction);
 }
 
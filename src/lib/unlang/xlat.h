@@ -440,6 +440,8 @@ int		xlat_bootstrap_func(xlat_exp_t *node);
 
 int		xlat_bootstrap(xlat_exp_t *root);
 
+uint64_t	xlat_instances_registered(void);
+
 void		xlat_instances_free(void);
 
 /*
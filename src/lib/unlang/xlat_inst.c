@@ -35,6 +35,10 @@ RCSID("$Id$")
  */
 static fr_rb_tree_t *xlat_inst_tree;
 
+/** Number of instances ever added to xlat_inst_tree
+ */
+static uint64_t xlat_inst_registered;
+
 /** Holds thread specific instance data created by xlat_instantiate
  */
 static _Thread_local fr_rb_tree_t *xlat_thread_inst_tree;
@@ -438,10 +442,25 @@ int xlat_bootstrap_func(xlat_exp_t *node)
 		TALLOC_FREE(node->call.inst);
 		return -1;
 	}
+	xlat_inst_registered++;
 
 	return 0;
 }
 
+/** Return how many "permanent" xlat instances have been created
+ *
+ * Workers create thread instance data for every one of these, so
+ * anything which bootstrapped an xlat must outlive the workers.
+ * Comparing the count before and after parsing something tells
+ * the caller whether that's the case.
+ *
+ * @return the number of calls to #xlat_bootstrap_func which succeeded.
+ */
+uint64_t xlat_instances_registered(void)
+{
+	return xlat_inst_registered;
+}
+
 static int _xlat_bootstrap_walker(xlat_exp_t *node, UNUSED void *uctx)
 {
 	return xlat_bootstrap_func(node);
@@ -3,9 +3,11 @@ SUBMAKEFILES := \
 	cursor_tests.mk \
 	dbuff_tests.mk \
 	dcursor_tests.mk \
+	dict_cache_tests.mk \
 	dlist_tests.mk \
 	edit_tests.mk \
 	heap_tests.mk \
+	histogram_tests.mk \
 	hmac_tests.mk \
 	libfreeradius-util.mk \
 	lst_tests.mk \
@@ -15,5 +17,8 @@ SUBMAKEFILES := \
 	pair_tests.mk \
 	rb_tests.mk \
 	sbuff_tests.mk \
-	strerror_tests.mk
+	strerror_tests.mk \
+	timer_wheel_tests.mk \
+	trie_tests.mk \
+	uring_tests.mk
 
@@ -18,7 +18,7 @@
  * $Id$
  *
  * @brief Thread-safe queues.
- * @file io/atomic_queue.c
+ * @file util/atomic_queue.c
  *
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  * @copyright 2016 Alister Winfield
@@ -30,7 +30,7 @@ RCSID("$Id$")
 #include <inttypes.h>
 
 #include <freeradius-devel/autoconf.h>
-#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/util/talloc.h>
 
 #define CACHE_LINE_SIZE	64
@@ -67,6 +67,8 @@ typedef struct fr_dict fr_dict_t;
 #endif
 
 /** Values of the encryption flags
+ *
+ * @note New fields must also be added to dict_cache_layout().
  */
 typedef struct {
 	unsigned int		is_root : 1;			//!< Is root of a dictionary.
@@ -569,6 +571,8 @@ int			fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char
 						    char const *dependent);
 
 int			fr_dict_read(fr_dict_t *dict, char const *dict_dir, char const *filename);
+
+int			fr_dict_cache_write(fr_dict_t const *dict, char const *filename) CC_HINT(nonnull);
 /** @} */
 
 /** @name Autoloader interface
@@ -621,6 +625,8 @@ int			fr_dict_global_ctx_dir_set(char const *dict_dir);
 
 void			fr_dict_global_ctx_read_only(void);
 
+void			fr_dict_global_ctx_use_cache(bool use_cache);
+
 void			fr_dict_global_ctx_debug(void);
 
 char const		*fr_dict_global_ctx_dir(void);
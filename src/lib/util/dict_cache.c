@@ -0,0 +1,1280 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Compiled protocol dictionaries
+ *
+ * A compiled dictionary is a flattened copy of a protocol dictionary
+ * as it exists after all the files have been parsed and all the
+ * fixups have been applied.  Loading one skips tokenizing, OID
+ * resolution, flag validation and fixups, and just replays the
+ * vendors, attributes, aliases and enumeration values into a new
+ * #fr_dict_t.
+ *
+ * The file is mapped into memory and read in place.  It records the
+ * path, size, modification time and a hash of the contents of every
+ * file the dictionary was built from.  If any of those have changed,
+ * or the file was written by a build with a different layout, it's
+ * ignored, and the text files are parsed instead.  A checksum of the
+ * whole file is appended, so a damaged file is ignored too.
+ *
+ * All integers are in network byte order.  Attribute flags and
+ * enumeration values are stored in host format, which is why the
+ * layout of those structures and a byte order marker are checked
+ * on load.
+ *
+ * @file src/lib/util/dict_cache.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dbuff.h>
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/value.h>
+#include <freeradius-devel/util/version.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DICT_CACHE_MAGIC	"FRDC"
+#define DICT_CACHE_VERSION	3
+#define DICT_CACHE_BYTE_ORDER	0x01020304
+
+/*
+ *	Attribute record flags
+ */
+#define DICT_CACHE_ATTR_NAMESPACE	0x01	//!< Attribute is in its parent's namespace.
+#define DICT_CACHE_ATTR_DETACHED	0x02	//!< Attribute isn't one of its parent's children.
+#define DICT_CACHE_ATTR_REF_DICT	0x04	//!< Attribute belongs to the dictionary it references.
+
+/*
+ *	Attribute reference types
+ */
+#define DICT_CACHE_REF_NONE	0	//!< No reference.
+#define DICT_CACHE_REF_LOCAL	1	//!< Reference to an attribute in the same dictionary.
+#define DICT_CACHE_REF_FOREIGN	2	//!< Reference to an attribute in another dictionary.
+
+/** Hash the contents of a dictionary file
+ *
+ * Modification times may only have a resolution of one second, so a
+ * file which is edited straight after the dictionary is compiled
+ * could otherwise go unnoticed.
+ */
+static int dict_src_file_hash(uint32_t *out, char const *filename)
+{
+	uint8_t		buffer[8192];
+	uint32_t	hash = 0;
+	ssize_t		len;
+	int		fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while ((len = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+			close(fd);
+			return -1;
+		}
+		hash = fr_hash_update(buffer, (size_t) len, hash);
+	}
+	close(fd);
+
+	*out = hash;
+
+	return 0;
+}
+
+/** Record which files a protocol dictionary is being built from
+ *
+ * @param[in] filename	of the file being read.
+ * @param[in] st	stat of the file.
+ * @return
+ *	- 0 on success (or if no protocol dictionary is being loaded).
+ *	- -1 on failure.
+ */
+int dict_src_file_add(char const *filename, struct stat const *st)
+{
+	dict_src_file_t	*src_files;
+	size_t		num;
+
+	if (!dict_gctx || !dict_gctx->src_files) return 0;
+
+	num = talloc_array_length(dict_gctx->src_files);
+
+	src_files = talloc_realloc(dict_gctx, dict_gctx->src_files, dict_src_file_t, num + 1);
+	if (!src_files) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	dict_gctx->src_files = src_files;
+
+	src_files[num] = (dict_src_file_t) {
+		.mtime = st->st_mtime,
+		.size = st->st_size
+	};
+	src_files[num].filename = talloc_typed_strdup(src_files, filename);
+	if (!src_files[num].filename) goto oom;
+
+	return dict_src_file_hash(&src_files[num].hash, filename);
+}
+
+/** Return a key for the layout of the structures which are copied into the file
+ *
+ * Flags and enumeration values are copied in host format.  Development
+ * builds all share the same #RADIUSD_MAGIC_NUMBER, so a change to any of
+ * these structures would otherwise go unnoticed.
+ *
+ * @note New fields in #fr_dict_attr_flags_t must be added here.
+ */
+static uint32_t dict_cache_layout(void)
+{
+	static uint32_t		layout;
+	fr_dict_attr_flags_t	flags;
+	uint32_t		num;
+
+	if (layout) return layout;
+
+	num = sizeof(flags);
+	layout = fr_hash(&num, sizeof(num));
+	num = FR_TYPE_MAX;
+	layout = fr_hash_update(&num, sizeof(num), layout);
+
+	/*
+	 *	Where each flag lives.  Bit fields have no
+	 *	offsetof(), so set each one, and hash the result.
+	 */
+#define FLAG_LAYOUT(_field, _value) \
+	do { \
+		memset(&flags, 0, sizeof(flags)); \
+		flags._field = _value; \
+		layout = fr_hash_update(&flags, sizeof(flags), layout); \
+	} while (0)
+
+	FLAG_LAYOUT(is_root, 1);
+	FLAG_LAYOUT(is_unknown, 1);
+	FLAG_LAYOUT(is_raw, 1);
+	FLAG_LAYOUT(is_alias, 1);
+	FLAG_LAYOUT(internal, 1);
+	FLAG_LAYOUT(array, 1);
+	FLAG_LAYOUT(is_known_width, 1);
+	FLAG_LAYOUT(has_value, 1);
+	FLAG_LAYOUT(virtual, 1);
+	FLAG_LAYOUT(is_unsigned, 1);
+	FLAG_LAYOUT(extra, 1);
+	FLAG_LAYOUT(subtype, UINT8_MAX);
+	FLAG_LAYOUT(length, UINT8_MAX);
+	FLAG_LAYOUT(type_size, UINT8_MAX);
+
+	/*
+	 *	Where each type of value lives in a value box.
+	 */
+	layout = fr_hash_update(fr_value_box_offsets, sizeof(fr_value_box_offsets[0]) * (FR_TYPE_MAX + 1), layout);
+	layout = fr_hash_update(fr_value_box_field_sizes, sizeof(fr_value_box_field_sizes[0]) * (FR_TYPE_MAX + 1), layout);
+
+	if (!layout) layout = 1;
+
+	return layout;
+}
+
+/** Maps attributes to their position in the compiled dictionary
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;			//!< Attribute being written.
+	uint32_t		idx;			//!< Its index.  The root is always 0.
+} dict_cache_idx_t;
+
+typedef struct {
+	fr_dict_t const		*dict;			//!< Dictionary being written.
+	fr_hash_table_t		*by_da;			//!< Index of each attribute.
+	fr_dict_attr_t const	**attrs;		//!< Attributes in the order they're written.
+	uint32_t		num;			//!< How many attributes have been indexed.
+} dict_cache_wctx_t;
+
+static uint32_t dict_cache_idx_hash(void const *data)
+{
+	dict_cache_idx_t const *entry = data;
+
+	return fr_hash(&entry->da, sizeof(entry->da));
+}
+
+static int8_t dict_cache_idx_cmp(void const *one, void const *two)
+{
+	dict_cache_idx_t const *a = one, *b = two;
+
+	return CMP(a->da, b->da);
+}
+
+static int dict_cache_idx_add(dict_cache_wctx_t *wctx, fr_dict_attr_t const *da)
+{
+	dict_cache_idx_t	*entry;
+
+	entry = talloc(wctx->by_da, dict_cache_idx_t);
+	if (!entry) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	entry->da = da;
+	entry->idx = wctx->num;
+
+	if (!fr_hash_table_insert(wctx->by_da, entry)) {
+		fr_strerror_printf("Attribute '%s' found twice while compiling dictionary", da->name);
+		talloc_free(entry);
+		return -1;
+	}
+
+	if (wctx->num >= talloc_array_length(wctx->attrs)) {
+		fr_dict_attr_t const **attrs;
+
+		attrs = talloc_realloc(wctx->by_da, wctx->attrs, fr_dict_attr_t const *, (wctx->num + 1) * 2);
+		if (!attrs) goto oom;
+		wctx->attrs = attrs;
+	}
+	wctx->attrs[wctx->num++] = da;
+
+	return 0;
+}
+
+static int dict_cache_idx_find(uint32_t *out, dict_cache_wctx_t *wctx, fr_dict_attr_t const *da)
+{
+	dict_cache_idx_t	*entry;
+
+	entry = fr_hash_table_find(wctx->by_da, &(dict_cache_idx_t){ .da = da });
+	if (!entry) return -1;
+
+	*out = entry->idx;
+
+	return 0;
+}
+
+/** Index an attribute and everything below it, parents first
+ *
+ * Children sharing a bin are indexed in reverse, so that re-adding them
+ * with #dict_attr_child_add() gives the same ordering within the bin.
+ *
+ * Child structures of key fields which were produced by cloning aren't
+ * children of anything, so they're indexed here as well.
+ */
+static int dict_cache_index(dict_cache_wctx_t *wctx, fr_dict_attr_t const *da)
+{
+	fr_dict_attr_t const		**children;
+	fr_dict_attr_ext_enumv_t	*ext;
+	size_t				i, len;
+
+	if (dict_cache_idx_add(wctx, da) < 0) return -1;
+
+	children = dict_attr_children(da);
+	len = talloc_array_length(children);
+	for (i = 0; i < len; i++) {
+		fr_dict_attr_t const	*bin[256], *p;
+		size_t			num = 0;
+
+		for (p = children[i]; p; p = p->next) {
+			if (num == NUM_ELEMENTS(bin)) {
+				fr_strerror_printf("Too many children of '%s' in bin %zu", da->name, i);
+				return -1;
+			}
+			bin[num++] = p;
+		}
+
+		while (num > 0) if (dict_cache_index(wctx, bin[--num]) < 0) return -1;
+	}
+
+	if (!fr_dict_attr_is_key_field(da)) return 0;
+
+	ext = fr_dict_attr_ext(da, FR_DICT_ATTR_EXT_ENUMV);
+	if (ext && ext->value_by_name) {
+		fr_hash_iter_t		iter;
+		fr_dict_enum_value_t	*enumv;
+		uint32_t		idx;
+
+		for (enumv = fr_hash_table_iter_init(ext->value_by_name, &iter);
+		     enumv;
+		     enumv = fr_hash_table_iter_next(ext->value_by_name, &iter)) {
+			if (!enumv->child_struct[0]) continue;
+			if (dict_cache_idx_find(&idx, wctx, enumv->child_struct[0]) == 0) continue;
+
+			if (dict_cache_index(wctx, enumv->child_struct[0]) < 0) return -1;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t dict_cache_str_write(fr_dbuff_t *dbuff, char const *str)
+{
+	size_t		len = strlen(str);
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+
+	if (len > UINT16_MAX) {
+		fr_strerror_printf("String \"%.32s...\" too long", str);
+		return -1;
+	}
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t) len);
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, str, len + 1);	/* Include the \0 so it can be used in place */
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+#define CACHE_WRITE(_x) do { if ((_x) < 0) goto error; } while (0)
+
+static int dict_cache_write_vendors(fr_dbuff_t *dbuff, fr_dict_t const *dict)
+{
+	fr_hash_iter_t		iter;
+	fr_dict_vendor_t const	*dv;
+	fr_dbuff_marker_t	count_m;
+	uint32_t		count = 0;
+	int			pass;
+
+	fr_dbuff_marker(&count_m, dbuff);
+	CACHE_WRITE(fr_dbuff_in(dbuff, count));
+
+	/*
+	 *	Vendors which are also the by-number entry are
+	 *	written last, so they're the ones that win.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (dv = fr_hash_table_iter_init(dict->vendors_by_name, &iter);
+		     dv;
+		     dv = fr_hash_table_iter_next(dict->vendors_by_name, &iter)) {
+			bool primary = (fr_dict_vendor_by_num(dict, dv->pen) == dv);
+
+			if (primary != (pass == 1)) continue;
+
+			CACHE_WRITE(dict_cache_str_write(dbuff, dv->name));
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint32_t) dv->pen));
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) dv->type));
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) dv->length));
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) dv->continuation));
+			count++;
+		}
+	}
+
+	fr_dbuff_in(&count_m, count);
+	fr_dbuff_marker_release(&count_m);
+	return 0;
+
+error:
+	fr_dbuff_marker_release(&count_m);
+	return -1;
+}
+
+static int dict_cache_write_attrs(fr_dbuff_t *dbuff, dict_cache_wctx_t *wctx)
+{
+	uint32_t	i;
+
+	CACHE_WRITE(fr_dbuff_in(dbuff, (uint32_t) (wctx->num - 1)));
+
+	for (i = 1; i < wctx->num; i++) {
+		fr_dict_attr_t const	*da = wctx->attrs[i];
+		fr_dict_attr_t const	*ref = NULL;
+		fr_hash_table_t		*namespace;
+		uint32_t		parent_idx, ref_idx;
+		uint8_t			flags = 0;
+
+		if (dict_cache_idx_find(&parent_idx, wctx, da->parent) < 0) {
+			fr_strerror_printf("Parent of '%s' is not part of the dictionary", da->name);
+			return -1;
+		}
+
+		namespace = dict_attr_namespace(da->parent);
+		if (namespace && (fr_hash_table_find(namespace, da) == da)) flags |= DICT_CACHE_ATTR_NAMESPACE;
+
+		if (dict_attr_child_by_num(da->parent, da->attr) != da) {
+			fr_dict_attr_t const *p;
+
+			flags |= DICT_CACHE_ATTR_DETACHED;
+
+			/*
+			 *	The lookup only returns the first
+			 *	attribute in the bin with this
+			 *	number, so check the rest too.
+			 */
+			for (p = dict_attr_children(da->parent) ? dict_attr_children(da->parent)[da->attr & 0xff] : NULL;
+			     p; p = p->next) {
+				if (p == da) {
+					flags &= ~DICT_CACHE_ATTR_DETACHED;
+					break;
+				}
+			}
+		}
+
+		if (fr_dict_attr_has_ext(da, FR_DICT_ATTR_EXT_REF)) ref = fr_dict_attr_ref(da);
+		if (ref && (da->dict != wctx->dict) && (da->dict == ref->dict)) flags |= DICT_CACHE_ATTR_REF_DICT;
+
+		CACHE_WRITE(fr_dbuff_in(dbuff, parent_idx));
+		CACHE_WRITE(dict_cache_str_write(dbuff, da->name));
+		CACHE_WRITE(fr_dbuff_in(dbuff, (uint32_t) da->attr));
+		CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) da->type));
+		CACHE_WRITE(fr_dbuff_in_memcpy(dbuff, (uint8_t const *) &da->flags, sizeof(da->flags)));
+		CACHE_WRITE(fr_dbuff_in(dbuff, flags));
+
+		if (!ref) {
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) DICT_CACHE_REF_NONE));
+
+		} else if (dict_cache_idx_find(&ref_idx, wctx, ref) == 0) {
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) DICT_CACHE_REF_LOCAL));
+			CACHE_WRITE(fr_dbuff_in(dbuff, ref_idx));
+
+		} else {
+			char	oid[512];
+
+			if (ref->dict == wctx->dict) {
+				fr_strerror_printf("Reference from '%s' to '%s' is not part of the dictionary",
+						   da->name, ref->name);
+				return -1;
+			}
+
+			if (fr_dict_attr_oid_print(&FR_SBUFF_OUT(oid, sizeof(oid)), NULL, ref, false) <= 0) {
+				fr_strerror_printf("Failed printing OID for '%s'", ref->name);
+				return -1;
+			}
+
+			CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) DICT_CACHE_REF_FOREIGN));
+			CACHE_WRITE(dict_cache_str_write(dbuff, fr_dict_root(ref->dict)->name));
+			CACHE_WRITE(dict_cache_str_write(dbuff, ref->flags.is_root ? "" : oid));
+		}
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+static int dict_cache_write_aliases(fr_dbuff_t *dbuff, dict_cache_wctx_t *wctx)
+{
+	fr_dbuff_marker_t	count_m;
+	uint32_t		count = 0, i;
+
+	fr_dbuff_marker(&count_m, dbuff);
+	CACHE_WRITE(fr_dbuff_in(dbuff, count));
+
+	for (i = 0; i < wctx->num; i++) {
+		fr_hash_table_t		*namespace;
+		fr_hash_iter_t		iter;
+		fr_dict_attr_t const	*da;
+
+		namespace = dict_attr_namespace(wctx->attrs[i]);
+		if (!namespace) continue;
+
+		for (da = fr_hash_table_iter_init(namespace, &iter);
+		     da;
+		     da = fr_hash_table_iter_next(namespace, &iter)) {
+			uint32_t ref_idx;
+
+			if (!da->flags.is_alias) {
+				if (da->parent == wctx->attrs[i]) continue;
+
+				fr_strerror_printf("Namespace of '%s' contains '%s' which is not one of its children",
+						   wctx->attrs[i]->name, da->name);
+				goto error;
+			}
+
+			if (dict_cache_idx_find(&ref_idx, wctx, fr_dict_attr_ref(da)) < 0) {
+				fr_strerror_printf("ALIAS '%s' refers to an attribute which is not part of the dictionary",
+						   da->name);
+				goto error;
+			}
+
+			CACHE_WRITE(fr_dbuff_in(dbuff, i));
+			CACHE_WRITE(dict_cache_str_write(dbuff, da->name));
+			CACHE_WRITE(fr_dbuff_in(dbuff, ref_idx));
+			CACHE_WRITE(fr_dbuff_in_memcpy(dbuff, (uint8_t const *) &da->flags, sizeof(da->flags)));
+			count++;
+		}
+	}
+
+	fr_dbuff_in(&count_m, count);
+	fr_dbuff_marker_release(&count_m);
+	return 0;
+
+error:
+	fr_dbuff_marker_release(&count_m);
+	return -1;
+}
+
+static int dict_cache_write_enum(fr_dbuff_t *dbuff, dict_cache_wctx_t *wctx, uint32_t idx,
+				 fr_dict_enum_value_t const *enumv)
+{
+	fr_value_box_t const	*value = enumv->value;
+	uint32_t		child_idx = 0;
+
+	if (fr_dict_attr_is_key_field(wctx->attrs[idx]) && enumv->child_struct[0] &&
+	    (dict_cache_idx_find(&child_idx, wctx, enumv->child_struct[0]) < 0)) {
+		fr_strerror_printf("Child structure of VALUE '%s' is not part of the dictionary", enumv->name);
+		return -1;
+	}
+
+	CACHE_WRITE(fr_dbuff_in(dbuff, idx));
+	CACHE_WRITE(dict_cache_str_write(dbuff, enumv->name));
+	CACHE_WRITE(fr_dbuff_in(dbuff, child_idx));
+	CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) value->type));
+
+	switch (value->type) {
+	case FR_TYPE_VARIABLE_SIZE:
+		CACHE_WRITE(fr_dbuff_in(dbuff, (uint32_t) value->vb_length));
+		CACHE_WRITE(fr_dbuff_in_memcpy(dbuff, value->vb_octets, value->vb_length));
+		CACHE_WRITE(fr_dbuff_in(dbuff, (uint8_t) 0));
+		break;
+
+	default:
+		if (!fr_type_is_leaf(value->type)) {
+			fr_strerror_printf("VALUE '%s' has invalid data type %s", enumv->name,
+					   fr_table_str_by_value(fr_value_box_type_table, value->type, "<INVALID>"));
+			return -1;
+		}
+
+		CACHE_WRITE(fr_dbuff_in(dbuff, (uint32_t) value->vb_length));
+		CACHE_WRITE(fr_dbuff_in_memcpy(dbuff,
+					       ((uint8_t const *) &value->datum) + fr_value_box_offsets[value->type],
+					       fr_value_box_field_sizes[value->type]));
+		break;
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+static int dict_cache_write_enums(fr_dbuff_t *dbuff, dict_cache_wctx_t *wctx)
+{
+	fr_dbuff_marker_t	count_m;
+	uint32_t		count = 0, i;
+
+	fr_dbuff_marker(&count_m, dbuff);
+	CACHE_WRITE(fr_dbuff_in(dbuff, count));
+
+	for (i = 1; i < wctx->num; i++) {
+		fr_dict_attr_ext_enumv_t	*ext;
+		fr_hash_iter_t			iter;
+		fr_dict_enum_value_t		*enumv;
+
+		ext = fr_dict_attr_ext(wctx->attrs[i], FR_DICT_ATTR_EXT_ENUMV);
+		if (!ext || !ext->value_by_name) continue;
+
+		/*
+		 *	Names which are used when printing values go
+		 *	first.  The others are then only added to the
+		 *	by-name table when loaded.
+		 */
+		for (enumv = fr_hash_table_iter_init(ext->value_by_name, &iter);
+		     enumv;
+		     enumv = fr_hash_table_iter_next(ext->value_by_name, &iter)) {
+			if (fr_hash_table_find(ext->name_by_value, enumv) != enumv) continue;
+
+			if (dict_cache_write_enum(dbuff, wctx, i, enumv) < 0) goto error;
+			count++;
+		}
+
+		for (enumv = fr_hash_table_iter_init(ext->value_by_name, &iter);
+		     enumv;
+		     enumv = fr_hash_table_iter_next(ext->value_by_name, &iter)) {
+			if (fr_hash_table_find(ext->name_by_value, enumv) == enumv) continue;
+
+			if (dict_cache_write_enum(dbuff, wctx, i, enumv) < 0) goto error;
+			count++;
+		}
+	}
+
+	fr_dbuff_in(&count_m, count);
+	fr_dbuff_marker_release(&count_m);
+	return 0;
+
+error:
+	fr_dbuff_marker_release(&count_m);
+	return -1;
+}
+
+/** Write a compiled copy of a protocol dictionary
+ *
+ * The dictionary must have been loaded with #fr_dict_protocol_afrom_file,
+ * so that we know which files it was built from.
+ *
+ * The file is written to a temporary name and renamed into place, so
+ * processes starting at the same time never see a partial file.
+ *
+ * @param[in] dict	to compile.
+ * @param[in] filename	to write to.  Usually the #FR_DICTIONARY_CACHE_FILE
+ *			in the protocol's dictionary directory.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_cache_write(fr_dict_t const *dict, char const *filename)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	dict_cache_wctx_t	wctx = { .dict = dict };
+	uint32_t		byte_order = DICT_CACHE_BYTE_ORDER;
+	size_t			i;
+	char			*tmp = NULL;
+	int			fd = -1, ret = -1;
+	uint8_t const		*p, *end;
+	uint32_t		checksum;
+
+	if (!dict->src_files) {
+		fr_strerror_printf("Dictionary \"%s\" was not loaded from dictionary files", dict->root->name);
+		return -1;
+	}
+
+	if (!fr_dbuff_init_talloc(NULL, &dbuff, &tctx, 64 * 1024, SIZE_MAX)) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	wctx.by_da = fr_hash_table_talloc_alloc(NULL, dict_cache_idx_t, dict_cache_idx_hash, dict_cache_idx_cmp, NULL);
+	if (!wctx.by_da) goto error;
+
+	if (dict_cache_index(&wctx, dict->root) < 0) goto finish;
+
+	/*
+	 *	Header
+	 */
+	CACHE_WRITE(fr_dbuff_in_memcpy(&dbuff, (uint8_t const *) DICT_CACHE_MAGIC, 4));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint32_t) DICT_CACHE_VERSION));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint64_t) RADIUSD_MAGIC_NUMBER));
+	CACHE_WRITE(fr_dbuff_in_memcpy(&dbuff, (uint8_t const *) &byte_order, sizeof(byte_order)));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, dict_cache_layout()));
+
+	/*
+	 *	Source files
+	 */
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint32_t) talloc_array_length(dict->src_files)));
+	for (i = 0; i < talloc_array_length(dict->src_files); i++) {
+		CACHE_WRITE(dict_cache_str_write(&dbuff, dict->src_files[i].filename));
+		CACHE_WRITE(fr_dbuff_in(&dbuff, dict->src_files[i].mtime));
+		CACHE_WRITE(fr_dbuff_in(&dbuff, dict->src_files[i].size));
+		CACHE_WRITE(fr_dbuff_in(&dbuff, dict->src_files[i].hash));
+	}
+
+	/*
+	 *	Root
+	 */
+	CACHE_WRITE(dict_cache_str_write(&dbuff, dict->root->name));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint32_t) dict->root->attr));
+	CACHE_WRITE(fr_dbuff_in_memcpy(&dbuff, (uint8_t const *) &dict->root->flags, sizeof(dict->root->flags)));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint8_t) (dict->dl != NULL)));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint32_t) dict->vsa_parent));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, (uint32_t) dict->self_allocated));
+
+	if (dict_cache_write_vendors(&dbuff, dict) < 0) goto finish;
+	if (dict_cache_write_attrs(&dbuff, &wctx) < 0) goto finish;
+	if (dict_cache_write_aliases(&dbuff, &wctx) < 0) goto finish;
+	if (dict_cache_write_enums(&dbuff, &wctx) < 0) goto finish;
+
+	/*
+	 *	Trailer
+	 */
+	checksum = fr_hash(fr_dbuff_start(&dbuff), fr_dbuff_used(&dbuff));
+	CACHE_WRITE(fr_dbuff_in(&dbuff, checksum));
+
+	tmp = talloc_typed_asprintf(NULL, "%s.%u.tmp", filename, (unsigned int) getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+
+	p = fr_dbuff_start(&dbuff);
+	end = fr_dbuff_current(&dbuff);
+	while (p < end) {
+		ssize_t slen;
+
+		slen = write(fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+			goto finish;
+		}
+		p += slen;
+	}
+
+	if (close(fd) < 0) {
+		fd = -1;
+		fr_strerror_printf("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+	fd = -1;
+
+	if (rename(tmp, filename) < 0) {
+		fr_strerror_printf("Failed renaming \"%s\" to \"%s\": %s", tmp, filename, fr_syserror(errno));
+		goto finish;
+	}
+
+	ret = 0;
+
+finish:
+	if (fd >= 0) close(fd);
+	if ((ret < 0) && tmp) unlink(tmp);
+	talloc_free(tmp);
+	talloc_free(wctx.by_da);
+	talloc_free(fr_dbuff_buff(&dbuff));
+
+	return ret;
+
+error:
+	fr_strerror_const("Out of memory");
+	goto finish;
+}
+
+/** Pending reference, resolved once all attributes have been created
+ *
+ */
+typedef struct {
+	fr_dict_attr_t		*da;			//!< Attribute with the reference.
+	uint8_t			type;			//!< One of the DICT_CACHE_REF_* values.
+	uint32_t		idx;			//!< Local attribute.
+	char const		*proto;			//!< Foreign dictionary.
+	char const		*oid;			//!< Foreign attribute.
+	bool			ref_dict;		//!< Move the attribute into the foreign dictionary.
+} dict_cache_ref_t;
+
+#define CACHE_READ(_x) do { if ((_x) <= 0) goto truncated; } while (0)
+
+static int dict_cache_str_read(char const **out, fr_dbuff_t *dbuff)
+{
+	uint16_t	len;
+	char const	*str;
+
+	if (fr_dbuff_out(&len, dbuff) <= 0) return -1;
+	if (fr_dbuff_remaining(dbuff) < ((size_t) len + 1)) return -1;
+
+	str = (char const *) fr_dbuff_current(dbuff);
+	if (str[len] != '\0') return -1;
+
+	fr_dbuff_advance(dbuff, len + 1);
+	*out = str;
+
+	return 1;
+}
+
+#define CACHE_READ_STR(_x) do { if (dict_cache_str_read(_x, dbuff) < 0) goto truncated; } while (0)
+
+static int dict_cache_check(fr_dbuff_t *dbuff, TALLOC_CTX *ctx, dict_src_file_t **src_files_out)
+{
+	uint8_t		magic[4];
+	uint32_t	version, byte_order, layout, num, i;
+	uint64_t	build;
+	dict_src_file_t	*src_files = NULL;
+
+	CACHE_READ(fr_dbuff_out_memcpy(magic, dbuff, sizeof(magic)));
+	if (memcmp(magic, DICT_CACHE_MAGIC, sizeof(magic)) != 0) {
+		fr_strerror_const("Not a compiled dictionary");
+		return -1;
+	}
+
+	CACHE_READ(fr_dbuff_out(&version, dbuff));
+	CACHE_READ(fr_dbuff_out(&build, dbuff));
+	CACHE_READ(fr_dbuff_out_memcpy((uint8_t *) &byte_order, dbuff, sizeof(byte_order)));
+	CACHE_READ(fr_dbuff_out(&layout, dbuff));
+	if ((version != DICT_CACHE_VERSION) || (build != RADIUSD_MAGIC_NUMBER) ||
+	    (byte_order != DICT_CACHE_BYTE_ORDER) || (layout != dict_cache_layout())) {
+		fr_strerror_const("Compiled dictionary was written by a different build");
+		return -1;
+	}
+
+	CACHE_READ(fr_dbuff_out(&num, dbuff));
+	if (num > fr_dbuff_remaining(dbuff)) goto truncated;
+
+	src_files = talloc_zero_array(ctx, dict_src_file_t, num);
+	if (!src_files) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	for (i = 0; i < num; i++) {
+		struct stat	st;
+		char const	*filename;
+		uint32_t	hash;
+
+		CACHE_READ_STR(&filename);
+		CACHE_READ(fr_dbuff_out(&src_files[i].mtime, dbuff));
+		CACHE_READ(fr_dbuff_out(&src_files[i].size, dbuff));
+		CACHE_READ(fr_dbuff_out(&src_files[i].hash, dbuff));
+
+		/*
+		 *	The size and modification time are cheap to
+		 *	check, the hash catches everything else.
+		 */
+		if ((stat(filename, &st) < 0) ||
+		    (st.st_mtime != src_files[i].mtime) || ((uint64_t) st.st_size != src_files[i].size) ||
+		    (dict_src_file_hash(&hash, filename) < 0) || (hash != src_files[i].hash)) {
+			fr_strerror_printf("Compiled dictionary is out of date with \"%s\"", filename);
+			talloc_free(src_files);
+			return -1;
+		}
+
+		src_files[i].filename = talloc_typed_strdup(src_files, filename);
+		if (!src_files[i].filename) {
+			talloc_free(src_files);
+			goto oom;
+		}
+	}
+
+	*src_files_out = src_files;
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	talloc_free(src_files);
+	return -1;
+}
+
+static int dict_cache_read_vendors(fr_dbuff_t *dbuff, fr_dict_t *dict)
+{
+	uint32_t	num, i;
+
+	CACHE_READ(fr_dbuff_out(&num, dbuff));
+
+	for (i = 0; i < num; i++) {
+		char const		*name;
+		uint32_t		pen;
+		uint8_t			type, length, continuation;
+		fr_dict_vendor_t	*dv;
+
+		CACHE_READ_STR(&name);
+		CACHE_READ(fr_dbuff_out(&pen, dbuff));
+		CACHE_READ(fr_dbuff_out(&type, dbuff));
+		CACHE_READ(fr_dbuff_out(&length, dbuff));
+		CACHE_READ(fr_dbuff_out(&continuation, dbuff));
+
+		if (dict_vendor_add(dict, name, pen) < 0) return -1;
+
+		dv = UNCONST(fr_dict_vendor_t *, fr_dict_vendor_by_name(dict, name));
+		if (!dv) {
+			fr_strerror_printf("Failed adding VENDOR %s", name);
+			return -1;
+		}
+		dv->type = type;
+		dv->length = length;
+		dv->continuation = continuation;
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	return -1;
+}
+
+static int dict_cache_read_attrs(fr_dbuff_t *dbuff, fr_dict_t *dict,
+				 fr_dict_attr_t ***attrs_out, dict_cache_ref_t **refs_out)
+{
+	fr_dict_attr_t		**attrs;
+	dict_cache_ref_t	*refs;
+	uint32_t		num, num_refs = 0, i;
+
+	CACHE_READ(fr_dbuff_out(&num, dbuff));
+	if (num > fr_dbuff_remaining(dbuff)) goto truncated;
+
+	attrs = talloc_array(dict, fr_dict_attr_t *, num + 1);
+	if (!attrs) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	refs = talloc_array(attrs, dict_cache_ref_t, num);
+	if (!refs) goto oom;
+	attrs[0] = dict->root;
+
+	for (i = 1; i <= num; i++) {
+		uint32_t		parent_idx, attr;
+		uint8_t			type, flags, ref_type;
+		char const		*name;
+		fr_dict_attr_flags_t	da_flags;
+		fr_dict_attr_t		*parent, *n;
+
+		CACHE_READ(fr_dbuff_out(&parent_idx, dbuff));
+		CACHE_READ_STR(&name);
+		CACHE_READ(fr_dbuff_out(&attr, dbuff));
+		CACHE_READ(fr_dbuff_out(&type, dbuff));
+		CACHE_READ(fr_dbuff_out_memcpy((uint8_t *) &da_flags, dbuff, sizeof(da_flags)));
+		CACHE_READ(fr_dbuff_out(&flags, dbuff));
+		CACHE_READ(fr_dbuff_out(&ref_type, dbuff));
+
+		if ((parent_idx >= i) || (type >= FR_TYPE_MAX)) {
+		invalid:
+			fr_strerror_printf("Invalid definition for attribute '%s'", name);
+			return -1;
+		}
+		parent = attrs[parent_idx];
+
+		n = dict_attr_alloc(dict->pool, parent, name, attr, type, &(dict_attr_args_t){ .flags = &da_flags });
+		if (!n) return -1;
+		attrs[i] = n;
+
+		if (!(flags & DICT_CACHE_ATTR_DETACHED)) {
+			if ((flags & DICT_CACHE_ATTR_NAMESPACE) && (dict_attr_add_to_namespace(parent, n) < 0)) return -1;
+			if (dict_attr_child_add(parent, n) < 0) return -1;
+		}
+
+		switch (ref_type) {
+		case DICT_CACHE_REF_NONE:
+			break;
+
+		case DICT_CACHE_REF_LOCAL:
+			refs[num_refs] = (dict_cache_ref_t) { .da = n, .type = ref_type };
+			CACHE_READ(fr_dbuff_out(&refs[num_refs].idx, dbuff));
+			if (refs[num_refs].idx > num) goto invalid;
+			num_refs++;
+			break;
+
+		case DICT_CACHE_REF_FOREIGN:
+			refs[num_refs] = (dict_cache_ref_t) {
+				.da = n,
+				.type = ref_type,
+				.ref_dict = (flags & DICT_CACHE_ATTR_REF_DICT)
+			};
+			CACHE_READ_STR(&refs[num_refs].proto);
+			CACHE_READ_STR(&refs[num_refs].oid);
+			num_refs++;
+			break;
+
+		default:
+			goto invalid;
+		}
+	}
+
+	*attrs_out = attrs;
+	*refs_out = talloc_realloc(attrs, refs, dict_cache_ref_t, num_refs);
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	return -1;
+}
+
+static int dict_cache_resolve_refs(fr_dict_t *dict, fr_dict_attr_t **attrs, dict_cache_ref_t *refs,
+				   char const *dependent)
+{
+	size_t	i;
+
+	for (i = 0; i < talloc_array_length(refs); i++) {
+		fr_dict_attr_t const	*ref;
+		fr_dict_t		*other;
+
+		if (refs[i].type == DICT_CACHE_REF_LOCAL) {
+			if (dict_attr_ref_set(refs[i].da, attrs[refs[i].idx]) < 0) return -1;
+			continue;
+		}
+
+		/*
+		 *	Same rules as references resolved during
+		 *	fixups.  Load the other dictionary if it isn't
+		 *	already loaded.
+		 */
+		if (dict_gctx->internal && (strcasecmp(fr_dict_root(dict_gctx->internal)->name, refs[i].proto) == 0)) {
+			other = dict_gctx->internal;
+		} else {
+			other = dict_by_protocol_name(refs[i].proto);
+			if (!other && (fr_dict_protocol_afrom_file(&other, refs[i].proto, NULL, dependent) < 0)) return -1;
+		}
+
+		if (other == dict) {
+			fr_strerror_printf("Compiled dictionary refers to itself as \"%s\"", refs[i].proto);
+			return -1;
+		}
+
+		if (!*refs[i].oid) {
+			ref = other->root;
+		} else {
+			ref = fr_dict_attr_by_oid(NULL, other->root, refs[i].oid);
+			if (!ref) {
+				fr_strerror_printf("No such attribute '%s.%s' in reference from '%s'",
+						   refs[i].proto, refs[i].oid, refs[i].da->name);
+				return -1;
+			}
+		}
+
+		if (dict_attr_ref_set(refs[i].da, ref) < 0) return -1;
+		if (refs[i].ref_dict) refs[i].da->dict = other;
+	}
+
+	return 0;
+}
+
+static int dict_cache_read_aliases(fr_dbuff_t *dbuff, fr_dict_t *dict, fr_dict_attr_t **attrs)
+{
+	uint32_t	num, i, max = talloc_array_length(attrs);
+
+	CACHE_READ(fr_dbuff_out(&num, dbuff));
+
+	for (i = 0; i < num; i++) {
+		uint32_t		parent_idx, ref_idx;
+		char const		*name;
+		fr_dict_attr_flags_t	flags;
+		fr_dict_attr_t		*parent, *self;
+		fr_dict_attr_t const	*da;
+
+		CACHE_READ(fr_dbuff_out(&parent_idx, dbuff));
+		CACHE_READ_STR(&name);
+		CACHE_READ(fr_dbuff_out(&ref_idx, dbuff));
+		CACHE_READ(fr_dbuff_out_memcpy((uint8_t *) &flags, dbuff, sizeof(flags)));
+
+		if ((parent_idx >= max) || (ref_idx >= max)) {
+			fr_strerror_printf("Invalid definition for ALIAS '%s'", name);
+			return -1;
+		}
+		parent = attrs[parent_idx];
+		da = attrs[ref_idx];
+
+		/*
+		 *	Same as dict_read_process_alias(), without the
+		 *	checks, which were done when the dictionary was
+		 *	compiled.
+		 */
+		self = dict_attr_alloc(dict->pool, parent, name, da->attr, da->type,
+				       &(dict_attr_args_t){ .flags = &flags, .ref = da });
+		if (unlikely(!self)) return -1;
+		self->dict = dict;
+
+		if (!fr_hash_table_insert(dict_attr_namespace(parent), self)) {
+			fr_strerror_printf("Failed adding ALIAS '%s'", name);
+			talloc_free(self);
+			return -1;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	return -1;
+}
+
+static int dict_cache_read_enums(fr_dbuff_t *dbuff, fr_dict_attr_t **attrs)
+{
+	uint32_t	num, i, max = talloc_array_length(attrs);
+
+	CACHE_READ(fr_dbuff_out(&num, dbuff));
+
+	for (i = 0; i < num; i++) {
+		uint32_t		idx, child_idx, len;
+		uint8_t			type;
+		char const		*name;
+		fr_value_box_t		value;
+		fr_dict_attr_t		*da;
+
+		CACHE_READ(fr_dbuff_out(&idx, dbuff));
+		CACHE_READ_STR(&name);
+		CACHE_READ(fr_dbuff_out(&child_idx, dbuff));
+		CACHE_READ(fr_dbuff_out(&type, dbuff));
+		CACHE_READ(fr_dbuff_out(&len, dbuff));
+
+		if ((idx == 0) || (idx >= max) || (child_idx >= max) || (type != attrs[idx]->type)) {
+		invalid:
+			fr_strerror_printf("Invalid definition for VALUE '%s'", name);
+			return -1;
+		}
+		da = attrs[idx];
+
+		switch (type) {
+		case FR_TYPE_VARIABLE_SIZE:
+		{
+			uint8_t const *data = fr_dbuff_current(dbuff);
+
+			if (fr_dbuff_remaining(dbuff) < ((size_t) len + 1)) goto truncated;
+			fr_dbuff_advance(dbuff, len + 1);
+
+			if (type == FR_TYPE_STRING) {
+				fr_value_box_bstrndup_shallow(&value, NULL, (char const *) data, len, false);
+			} else {
+				fr_value_box_memdup_shallow(&value, NULL, data, len, false);
+			}
+		}
+			break;
+
+		default:
+			if (!fr_type_is_leaf(type)) goto invalid;
+
+			fr_value_box_init(&value, type, NULL, false);
+			CACHE_READ(fr_dbuff_out_memcpy(((uint8_t *) &value.datum) + fr_value_box_offsets[type],
+						       dbuff, fr_value_box_field_sizes[type]));
+			value.vb_length = len;
+			break;
+		}
+
+		if (dict_attr_enum_add_name(da, name, &value, false, false, child_idx ? attrs[child_idx] : NULL) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	return -1;
+}
+
+static int dict_cache_load(fr_dict_t **out, fr_dbuff_t *dbuff, char const *proto_name, char const *dependent)
+{
+	fr_dict_t		*dict;
+	fr_dict_attr_t		**attrs;
+	dict_cache_ref_t	*refs;
+	dict_src_file_t		*src_files;
+	char const		*name;
+	uint32_t		attr, vsa_parent, self_allocated;
+	uint8_t			has_dl;
+	fr_dict_attr_flags_t	flags;
+
+	if (dict_cache_check(dbuff, NULL, &src_files) < 0) return -1;
+
+	CACHE_READ_STR(&name);
+	CACHE_READ(fr_dbuff_out(&attr, dbuff));
+	CACHE_READ(fr_dbuff_out_memcpy((uint8_t *) &flags, dbuff, sizeof(flags)));
+	CACHE_READ(fr_dbuff_out(&has_dl, dbuff));
+	CACHE_READ(fr_dbuff_out(&vsa_parent, dbuff));
+	CACHE_READ(fr_dbuff_out(&self_allocated, dbuff));
+
+	if (strcasecmp(name, proto_name) != 0) {
+		fr_strerror_printf("Compiled dictionary is for protocol \"%s\", not \"%s\"", name, proto_name);
+	error_files:
+		talloc_free(src_files);
+		return -1;
+	}
+
+	if (dict_by_protocol_name(name) || dict_by_protocol_num(attr)) {
+		fr_strerror_printf("Protocol \"%s\" (%u) is already defined", name, attr);
+		goto error_files;
+	}
+
+	dict = fr_dict_alloc(name, attr);
+	if (!dict) goto error_files;
+	dict->src_files = talloc_steal(dict, src_files);
+
+	if (has_dl && (dict_dlopen(dict, name) < 0)) {
+	error:
+		talloc_free(dict);
+		return -1;
+	}
+
+	UNCONST(fr_dict_attr_t *, dict->root)->flags = flags;
+	dict->vsa_parent = vsa_parent;
+	dict->self_allocated = self_allocated;
+
+	if (dict_cache_read_vendors(dbuff, dict) < 0) goto error;
+	if (dict_cache_read_attrs(dbuff, dict, &attrs, &refs) < 0) goto error;
+	if (dict_cache_resolve_refs(dict, attrs, refs, dependent) < 0) goto error;
+	if (dict_cache_read_aliases(dbuff, dict, attrs) < 0) goto error;
+	if (dict_cache_read_enums(dbuff, attrs) < 0) goto error;
+
+	if (fr_dbuff_remaining(dbuff) != 0) {
+		fr_strerror_const("Trailing data in compiled dictionary");
+		goto error;
+	}
+
+	talloc_free(attrs);
+
+	if (dict_protocol_add(dict) < 0) goto error;
+
+	dict->autoloaded = true;
+	*out = dict;
+
+	return 0;
+
+truncated:
+	fr_strerror_const("Compiled dictionary is truncated");
+	goto error_files;
+}
+
+/** Load a protocol dictionary from its compiled copy
+ *
+ * @param[out] out		Where to write the new dictionary.
+ * @param[in] proto_name	of the dictionary.
+ * @param[in] dict_dir		containing the dictionary files.
+ * @param[in] dependent		Either C src file, or another dictionary.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no usable compiled dictionary.  The caller
+ *	  should parse the dictionary files instead.
+ */
+int dict_from_cache(fr_dict_t **out, char const *proto_name, char const *dict_dir, char const *dependent)
+{
+	char		*filename;
+	int		fd, ret;
+	struct stat	st;
+	void		*map;
+	fr_dbuff_t	dbuff;
+	fr_dict_t	*dict;
+	size_t		len;
+	uint32_t	checksum;
+
+	filename = talloc_typed_asprintf(NULL, "%s%c%s", dict_dir, FR_DIR_SEP, FR_DICTIONARY_CACHE_FILE);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		talloc_free(filename);
+		return -1;
+	}
+
+	if ((fstat(fd, &st) < 0) || (st.st_size <= (off_t) sizeof(checksum))) {
+		fr_strerror_printf("Failed reading \"%s\"", filename);
+		close(fd);
+		talloc_free(filename);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping \"%s\": %s", filename, fr_syserror(errno));
+		talloc_free(filename);
+		return -1;
+	}
+
+	/*
+	 *	Check the whole file before we look at any of it
+	 */
+	len = (size_t) st.st_size - sizeof(checksum);
+	fr_dbuff_init(&dbuff, (uint8_t const *) map + len, sizeof(checksum));
+	if ((fr_dbuff_out(&checksum, &dbuff) <= 0) || (fr_hash(map, len) != checksum)) {
+		fr_strerror_printf("Compiled dictionary \"%s\" is damaged", filename);
+		munmap(map, st.st_size);
+		talloc_free(filename);
+		return -1;
+	}
+
+	fr_dbuff_init(&dbuff, (uint8_t const *) map, len);
+	ret = dict_cache_load(&dict, &dbuff, proto_name, filename);
+	munmap(map, st.st_size);
+	talloc_free(filename);
+
+	if (ret < 0) return -1;
+
+	dict_dependent_add(dict, dependent);
+	*out = dict;
+
+	return 0;
+}
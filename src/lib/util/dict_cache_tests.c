@@ -0,0 +1,500 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for compiled dictionaries
+ *
+ * A small protocol dictionary is written to a temporary directory,
+ * compiled, and loaded back.  The internal dictionary is read from
+ * share/dictionary, so the tests must be run from the top of the tree.
+ *
+ * @file src/lib/util/dict_cache_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#	define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define PROTO_NAME	"CacheTest"
+#define PROTO_DIR	"cachetest"
+
+static TALLOC_CTX		*autofree;
+static fr_dict_gctx_t const	*gctx;
+static fr_dict_t		*dict_internal;
+static char			*dict_dir;
+static char			*proto_dir;
+static char			*cache_file;
+
+static char const dictionary[] =
+	"PROTOCOL	" PROTO_NAME "	200\n"
+	"BEGIN-PROTOCOL	" PROTO_NAME "\n"
+	"$INCLUDE dictionary.vendor\n"
+	"ATTRIBUTE	Test-String		1	string\n"
+	"ATTRIBUTE	Test-Integer		2	uint32\n"
+	"VALUE	Test-Integer		One	1\n"
+	"VALUE	Test-Integer		Two	2\n"
+	"ATTRIBUTE	Test-TLV		3	tlv\n"
+	"ATTRIBUTE	Test-TLV-Addr		3.1	ipaddr\n"
+	"ATTRIBUTE	Test-TLV-Octets		3.2	octets\n"
+	"ALIAS		Test-Alias		3.1\n"
+	"END-PROTOCOL	" PROTO_NAME "\n";
+
+static char const dictionary_vendor[] =
+	"ATTRIBUTE	Vendor-Specific		26	vsa\n"
+	"VENDOR		Example			32473\n"
+	"BEGIN-VENDOR	Example	parent=Vendor-Specific\n"
+	"ATTRIBUTE	Example-Integer		1	uint16\n"
+	"VALUE	Example-Integer		Low	10\n"
+	"END-VENDOR	Example\n";
+
+static void test_file_write(char const *dir, char const *name, char const *data, size_t len)
+{
+	char	*path;
+	int	fd;
+
+	path = talloc_asprintf(autofree, "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (write(fd, data, len) != (ssize_t) len) || (close(fd) < 0)) {
+		fprintf(stderr, "dict_cache_tests: Failed writing %s: %s\n", path, fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+	talloc_free(path);
+}
+
+static void test_dict_files_write(void)
+{
+	test_file_write(proto_dir, "dictionary", dictionary, sizeof(dictionary) - 1);
+	test_file_write(proto_dir, "dictionary.vendor", dictionary_vendor, sizeof(dictionary_vendor) - 1);
+	unlink(cache_file);
+}
+
+/** Create a directory for the protocol dictionary
+ *
+ * Each test gets its own, as tests may run in separate processes.
+ */
+static void test_dir_alloc(void)
+{
+	dict_dir = talloc_strdup(autofree, "/tmp/dict_cache_tests.XXXXXX");
+	if (!mkdtemp(dict_dir)) {
+	error:
+		fprintf(stderr, "dict_cache_tests: Failed creating %s: %s\n", dict_dir, fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Protocol dictionaries are loaded from our own directory
+	 */
+	if (fr_dict_global_ctx_dir_set(dict_dir) < 0) goto error;
+
+	proto_dir = talloc_asprintf(autofree, "%s/%s", dict_dir, PROTO_DIR);
+	if (mkdir(proto_dir, 0755) < 0) goto error;
+
+	cache_file = talloc_asprintf(autofree, "%s/%s", proto_dir, FR_DICTIONARY_CACHE_FILE);
+
+	test_dict_files_write();
+}
+
+static void test_dir_free(void)
+{
+	static char const	*files[] = { "dictionary", "dictionary.vendor", FR_DICTIONARY_CACHE_FILE };
+	size_t			i;
+	char			*path;
+
+	for (i = 0; i < NUM_ELEMENTS(files); i++) {
+		path = talloc_asprintf(autofree, "%s/%s", proto_dir, files[i]);
+		unlink(path);
+		talloc_free(path);
+	}
+	rmdir(proto_dir);
+	rmdir(dict_dir);
+
+	TALLOC_FREE(cache_file);
+	TALLOC_FREE(proto_dir);
+	TALLOC_FREE(dict_dir);
+}
+
+static void test_dict_gctx_alloc(void)
+{
+	gctx = fr_dict_global_ctx_init(autofree, "share/dictionary");
+	if (!gctx ||
+	    (fr_dict_internal_afrom_file(&dict_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) ||
+	    (dict_dir && (fr_dict_global_ctx_dir_set(dict_dir) < 0))) {
+		fr_perror("dict_cache_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+/** Unload a protocol dictionary
+ *
+ * Protocol dictionaries are only freed with the global dictionary
+ * context, so a new one is created to load the next dictionary into.
+ */
+static void test_dict_unload(fr_dict_t **dict)
+{
+	if (*dict) fr_dict_free(dict, __FILE__);
+	*dict = NULL;
+
+	fr_dict_free(&dict_internal, __FILE__);
+	if (!TEST_CHECK(fr_dict_global_ctx_free(gctx) == 0)) fr_perror("dict_cache_tests");
+
+	test_dict_gctx_alloc();
+}
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("dict_cache_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	test_dict_gctx_alloc();
+}
+
+/** Parse the dictionary files, and write a compiled copy
+ *
+ */
+static void test_cache_compile(void)
+{
+	fr_dict_t	*dict = NULL;
+
+	test_dict_files_write();
+
+	fr_dict_global_ctx_use_cache(false);
+	TEST_CHECK(fr_dict_protocol_afrom_file(&dict, PROTO_DIR, NULL, __FILE__) == 0);
+	fr_dict_global_ctx_use_cache(true);
+	if (!TEST_CHECK(dict != NULL)) {
+		fr_perror("dict_cache_tests");
+		return;
+	}
+
+	TEST_CHECK(fr_dict_cache_write(dict, cache_file) == 0);
+	test_dict_unload(&dict);
+}
+
+/** Check the attributes of the test dictionary are all there, and correct
+ *
+ */
+static void test_dict_check(fr_dict_t const *dict)
+{
+	fr_dict_attr_t const	*root = fr_dict_root(dict);
+	fr_dict_attr_t const	*da, *vsa;
+	fr_dict_vendor_t const	*dv;
+	fr_dict_enum_value_t	*ev;
+
+	TEST_CHECK(strcmp(root->name, PROTO_NAME) == 0);
+	TEST_CHECK(root->attr == 200);
+
+	da = fr_dict_attr_by_name(NULL, root, "Test-String");
+	TEST_CHECK(da && (da->attr == 1) && (da->type == FR_TYPE_STRING));
+
+	da = fr_dict_attr_by_name(NULL, root, "Test-Integer");
+	TEST_CHECK(da && (da->attr == 2) && (da->type == FR_TYPE_UINT32));
+	if (da) {
+		ev = fr_dict_enum_by_name(da, "Two", -1);
+		TEST_CHECK(ev && (ev->value->vb_uint32 == 2));
+		TEST_CHECK(fr_dict_enum_by_name(da, "One", -1) != NULL);
+	}
+
+	da = fr_dict_attr_by_oid(NULL, root, "3.1");
+	TEST_CHECK(da && (da->type == FR_TYPE_IPV4_ADDR || da->type == FR_TYPE_COMBO_IP_ADDR));
+	TEST_CHECK(da && (strcmp(da->name, "Test-TLV-Addr") == 0));
+	TEST_CHECK(da && (strcmp(da->parent->name, "Test-TLV") == 0));
+	TEST_CHECK(fr_dict_attr_by_name(NULL, root, "Test-Alias") == da);
+
+	dv = fr_dict_vendor_by_name(dict, "Example");
+	TEST_CHECK(dv && (dv->pen == 32473));
+
+	vsa = fr_dict_attr_by_name(NULL, root, "Vendor-Specific");
+	TEST_CHECK(vsa && (vsa->type == FR_TYPE_VSA));
+
+	da = fr_dict_attr_by_oid(NULL, root, "26.32473.1");
+	TEST_CHECK(da && (da->type == FR_TYPE_UINT16) && (strcmp(da->name, "Example-Integer") == 0));
+	if (da) {
+		ev = fr_dict_enum_by_name(da, "Low", -1);
+		TEST_CHECK(ev && (ev->value->vb_uint16 == 10));
+	}
+}
+
+static void test_file_read(uint8_t **out, size_t *len, char const *path)
+{
+	struct stat	st;
+	int		fd;
+
+	*out = NULL;
+	*len = 0;
+
+	fd = open(path, O_RDONLY);
+	if (!TEST_CHECK(fd >= 0)) return;
+	if (TEST_CHECK(fstat(fd, &st) == 0)) {
+		*out = talloc_array(autofree, uint8_t, st.st_size);
+		*len = st.st_size;
+		TEST_CHECK(read(fd, *out, *len) == (ssize_t) *len);
+	}
+	close(fd);
+}
+
+/** Load a dictionary from its compiled copy, and compile it again
+ *
+ * The second compiled copy should be identical to the first.
+ */
+static void test_round_trip(void)
+{
+	fr_dict_t	*dict = NULL;
+	char		*again;
+	uint8_t		*first, *second;
+	size_t		first_len, second_len;
+
+	test_dir_alloc();
+	test_cache_compile();
+
+	TEST_CASE("Compiled dictionary is used");
+	TEST_CHECK(dict_from_cache(&dict, PROTO_NAME, proto_dir, __FILE__) == 0);
+	if (!TEST_CHECK(dict != NULL)) {
+		fr_perror("dict_cache_tests");
+		test_dir_free();
+		return;
+	}
+	test_dict_check(dict);
+
+	TEST_CASE("Compiled dictionary can be compiled again");
+	again = talloc_asprintf(autofree, "%s.again", cache_file);
+	TEST_CHECK(fr_dict_cache_write(dict, again) == 0);
+	test_dict_unload(&dict);
+
+	test_file_read(&first, &first_len, cache_file);
+	test_file_read(&second, &second_len, again);
+	TEST_CHECK(first_len == second_len);
+	TEST_MSG("Expected %zu bytes, got %zu", first_len, second_len);
+	TEST_CHECK((first_len == second_len) && (memcmp(first, second, first_len) == 0));
+
+	unlink(again);
+	talloc_free(again);
+	talloc_free(first);
+	talloc_free(second);
+
+	TEST_CASE("Dictionary is loaded from its compiled copy");
+	TEST_CHECK(fr_dict_protocol_afrom_file(&dict, PROTO_DIR, NULL, __FILE__) == 0);
+	if (TEST_CHECK(dict != NULL)) {
+		test_dict_check(dict);
+		test_dict_unload(&dict);
+	}
+
+	test_dir_free();
+}
+
+/** Check the compiled copy is rejected, and the dictionary files are parsed instead
+ *
+ */
+static void test_fallback(char const *new_attr)
+{
+	fr_dict_t	*dict = NULL;
+
+	TEST_CHECK(dict_from_cache(&dict, PROTO_NAME, proto_dir, __FILE__) < 0);
+	TEST_CHECK(dict == NULL);
+	if (dict) test_dict_unload(&dict);
+
+	TEST_CHECK(fr_dict_protocol_afrom_file(&dict, PROTO_DIR, NULL, __FILE__) == 0);
+	if (!TEST_CHECK(dict != NULL)) {
+		fr_perror("dict_cache_tests");
+		return;
+	}
+	test_dict_check(dict);
+	if (new_attr) TEST_CHECK(fr_dict_attr_by_oid(NULL, fr_dict_root(dict), new_attr) != NULL);
+	test_dict_unload(&dict);
+}
+
+/** Replace text in one of the dictionary files, keeping its size and times
+ *
+ */
+static void test_file_same_size_write(char const *name, char const *from, char const *to)
+{
+	struct stat	st;
+	struct utimbuf	times;
+	char		*path, *p;
+	uint8_t		*data;
+	size_t		len;
+
+	TEST_ASSERT(strlen(from) == strlen(to));
+
+	path = talloc_asprintf(autofree, "%s/%s", proto_dir, name);
+	TEST_ASSERT(stat(path, &st) == 0);
+
+	test_file_read(&data, &len, path);
+	TEST_ASSERT(data != NULL);
+
+	p = memmem(data, len, from, strlen(from));
+	TEST_ASSERT(p != NULL);
+	memcpy(p, to, strlen(to));
+	test_file_write(proto_dir, name, (char const *) data, len);
+
+	times.actime = st.st_atime;
+	times.modtime = st.st_mtime;
+	TEST_CHECK(utime(path, &times) == 0);
+
+	talloc_free(data);
+	talloc_free(path);
+}
+
+/** A dictionary file changing after compilation means the compiled copy isn't used
+ *
+ */
+static void test_stale(void)
+{
+	static char const	extra[] = "ATTRIBUTE	Test-Extra		4	uint8\n";
+	char			*vendor_file;
+	int			fd;
+	fr_dict_t		*dict;
+
+	test_dir_alloc();
+	test_cache_compile();
+
+	/*
+	 *	Changes the size of an included file
+	 */
+	vendor_file = talloc_asprintf(autofree, "%s/dictionary.vendor", proto_dir);
+	fd = open(vendor_file, O_WRONLY | O_APPEND);
+	TEST_CHECK(fd >= 0);
+	TEST_CHECK(write(fd, extra, sizeof(extra) - 1) == (ssize_t) (sizeof(extra) - 1));
+	close(fd);
+	talloc_free(vendor_file);
+
+	test_fallback("Test-Extra");
+
+	/*
+	 *	Changes a file without changing its size or
+	 *	modification time.  Only the hash notices.
+	 */
+	test_cache_compile();
+	test_file_same_size_write("dictionary", "Test-TLV-Octets\t\t", "Test-TLV-Bytes\t\t\t");
+	test_fallback("Test-TLV.Test-TLV-Bytes");
+
+	/*
+	 *	Removes a file the compiled copy was built from
+	 */
+	test_cache_compile();
+	vendor_file = talloc_asprintf(autofree, "%s/dictionary.vendor", proto_dir);
+	TEST_CHECK(unlink(vendor_file) == 0);
+
+	dict = NULL;
+	TEST_CHECK(dict_from_cache(&dict, PROTO_NAME, proto_dir, __FILE__) < 0);
+	if (dict) test_dict_unload(&dict);
+	talloc_free(vendor_file);
+
+	test_dir_free();
+}
+
+/** Every truncation of the compiled copy is rejected
+ *
+ */
+static void test_truncated(void)
+{
+	uint8_t		*data;
+	size_t		len, i;
+	fr_dict_t	*dict;
+
+	test_dir_alloc();
+	test_cache_compile();
+	test_file_read(&data, &len, cache_file);
+	TEST_CHECK(len > 0);
+
+	for (i = 0; i < len; i++) {
+		test_file_write(proto_dir, FR_DICTIONARY_CACHE_FILE, (char const *) data, i);
+
+		dict = NULL;
+		if (!TEST_CHECK(dict_from_cache(&dict, PROTO_NAME, proto_dir, __FILE__) < 0)) {
+			TEST_MSG("Compiled dictionary truncated to %zu of %zu bytes was used", i, len);
+			test_dict_unload(&dict);
+			break;
+		}
+	}
+
+	test_file_write(proto_dir, FR_DICTIONARY_CACHE_FILE, (char const *) data, len / 2);
+	test_fallback(NULL);
+
+	talloc_free(data);
+	test_dir_free();
+}
+
+/** Changing any byte of the compiled copy means it's rejected
+ *
+ */
+static void test_corrupted(void)
+{
+	uint8_t		*data;
+	size_t		len, i;
+	fr_dict_t	*dict;
+
+	test_dir_alloc();
+	test_cache_compile();
+	test_file_read(&data, &len, cache_file);
+	TEST_CHECK(len > 0);
+
+	for (i = 0; i < len; i++) {
+		data[i] ^= 0x5a;
+		test_file_write(proto_dir, FR_DICTIONARY_CACHE_FILE, (char const *) data, len);
+		data[i] ^= 0x5a;
+
+		dict = NULL;
+		if (!TEST_CHECK(dict_from_cache(&dict, PROTO_NAME, proto_dir, __FILE__) < 0)) {
+			TEST_MSG("Compiled dictionary with byte %zu of %zu changed was used", i, len);
+			test_dict_unload(&dict);
+			break;
+		}
+	}
+
+	/*
+	 *	Not a compiled dictionary at all
+	 */
+	test_file_write(proto_dir, FR_DICTIONARY_CACHE_FILE, dictionary, sizeof(dictionary) - 1);
+	test_fallback(NULL);
+
+	talloc_free(data);
+	test_dir_free();
+}
+
+TEST_LIST = {
+	{ "round_trip",		test_round_trip },
+	{ "stale",		test_stale },
+	{ "truncated",		test_truncated },
+	{ "corrupted",		test_corrupted },
+
+	{ NULL }
+};
@@ -0,0 +1,7 @@
+TARGET		:= dict_cache_tests
+
+SOURCES		:= dict_cache_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util.la
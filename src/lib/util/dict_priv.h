@@ -33,6 +33,8 @@ extern "C" {
 #include <freeradius-devel/util/dl.h>
 #include <freeradius-devel/util/hash.h>
 
+#include <sys/stat.h>
+
 #define DICT_POOL_SIZE		(1024 * 1024 * 2)
 #define DICT_FIXUP_POOL_SIZE	(1024)
 
@@ -61,6 +63,17 @@ typedef struct {
 	char const	        *dependent;		//!< File holding the reference.
 } fr_dict_dependent_t;
 
+/** A dictionary file read while loading a protocol dictionary
+ *
+ * Used to check whether a compiled dictionary is still current.
+ */
+typedef struct {
+	char const		*filename;		//!< Path of the file.
+	int64_t			mtime;			//!< Modification time when the file was read.
+	uint64_t		size;			//!< Size of the file when it was read.
+	uint32_t		hash;			//!< Of the file's contents.
+} dict_src_file_t;
+
 /** Vendors and attribute names
  *
  * It's very likely that the same vendors will operate in multiple
@@ -108,6 +121,8 @@ struct fr_dict {
 	fr_dict_attr_t		**fixups;		//!< Attributes that need fixing up.
 
 	fr_rb_tree_t		*dependents;		//!< Which files are using this dictionary.
+
+	dict_src_file_t		*src_files;		//!< Files this dictionary was read from.
 };
 
 struct fr_dict_gctx_s {
@@ -131,6 +146,12 @@ struct fr_dict_gctx_s {
 	 * protocol.
 	 */
 	fr_dict_t		*internal;
+
+	dict_src_file_t		*src_files;		//!< Files read so far by the protocol dictionary
+							///< being loaded.
+
+	bool			no_cache;		//!< Always parse the dictionary files, ignoring
+							///< any compiled dictionaries.
 };
 
 extern fr_dict_gctx_t *dict_gctx;
@@ -203,6 +224,11 @@ fr_dict_t		*dict_by_da(fr_dict_attr_t const *da);
 
 bool			dict_attr_can_have_children(fr_dict_attr_t const *da);
 
+int			dict_src_file_add(char const *filename, struct stat const *st);
+
+int			dict_from_cache(fr_dict_t **out, char const *proto_name, char const *dict_dir,
+					char const *dependent);
+
 int			dict_attr_enum_add_name(fr_dict_attr_t *da, char const *name, fr_value_box_t const *value,
 					   bool coerce, bool replace, fr_dict_attr_t const *child_struct);
 
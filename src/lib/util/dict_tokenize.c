@@ -1859,6 +1859,15 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 		return -1;
 	}
 
+	/*
+	 *	Remember which files a protocol dictionary was
+	 *	built from, so a compiled copy can be checked.
+	 */
+	if (dict_src_file_add(fn, &statbuf) < 0) {
+		fclose(fp);
+		return -1;
+	}
+
 	/*
 	 *	Globally writable dictionaries means that users can control
 	 *	the server configuration with little difficulty.
@@ -2652,6 +2661,7 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 {
 	char		*dict_dir = NULL;
 	fr_dict_t	*dict;
+	dict_src_file_t	*src_files;
 
 	*out = NULL;
 
@@ -2682,8 +2692,33 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 		dict_dir = talloc_asprintf(NULL, "%s%c%s", fr_dict_global_ctx_dir(), FR_DIR_SEP, proto_dir);
 	}
 
+	/*
+	 *	Use the compiled dictionary if there is one, and
+	 *	it's newer than all of the files it was built from.
+	 *	Otherwise parse the dictionary files.
+	 */
+	if (!dict && !dict_gctx->no_cache && (dict_from_cache(&dict, proto_name, dict_dir, dependent) == 0)) {
+		talloc_free(dict_dir);
+		*out = dict;
+		return 0;
+	}
+
 	fr_strerror_clear();	/* Ensure we don't report spurious errors */
 
+	/*
+	 *	Record the files we read while loading this
+	 *	dictionary.  Protocol dictionaries loaded as
+	 *	references get their own list.
+	 */
+	src_files = dict_gctx->src_files;
+	dict_gctx->src_files = talloc_zero_array(dict_gctx, dict_src_file_t, 0);
+	if (!dict_gctx->src_files) {
+		dict_gctx->src_files = src_files;
+		fr_strerror_const("Out of memory");
+		talloc_free(dict_dir);
+		return -1;
+	}
+
 	/*
 	 *	Start in the context of the internal dictionary,
 	 *	and switch to the context of a protocol dictionary
@@ -2695,6 +2730,8 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 	 */
 	if (dict_from_file(dict_gctx->internal, dict_dir, FR_DICTIONARY_FILE, NULL, 0) < 0) {
 	error:
+		TALLOC_FREE(dict_gctx->src_files);
+		dict_gctx->src_files = src_files;
 		talloc_free(dict_dir);
 		return -1;
 	}
@@ -2708,6 +2745,10 @@ int fr_dict_protocol_afrom_file(fr_dict_t **out, char const *proto_name, char co
 		goto error;
 	}
 
+	talloc_free(dict->src_files);
+	dict->src_files = talloc_steal(dict, dict_gctx->src_files);
+	dict_gctx->src_files = src_files;
+
 	talloc_free(dict_dir);
 
 	/*
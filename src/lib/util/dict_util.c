@@ -3613,6 +3613,17 @@ void fr_dict_global_ctx_read_only(void)
 	dict_gctx->read_only = true;
 }
 
+/** Control whether compiled dictionaries are used when loading protocol dictionaries
+ *
+ * @param[in] use_cache	If false, the dictionary files are always parsed.
+ */
+void fr_dict_global_ctx_use_cache(bool use_cache)
+{
+	if (!dict_gctx) return;
+
+	dict_gctx->no_cache = !use_cache;
+}
+
 /** Dump information about currently loaded dictionaries
  *
  * Intended to be called from a debugger
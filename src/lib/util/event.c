@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/timer_wheel.h>
 #include <freeradius-devel/util/token.h>
 #include <freeradius-devel/util/atexit.h>
 
@@ -55,6 +56,12 @@ DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 
 #define FR_EV_BATCH_FDS (256)
 
+/** Maximum number of deleted timer events kept for re-use
+ *
+ * Only used when the event list has a timer wheel.
+ */
+#define FR_EV_TIMER_FREE_MAX (1024)
+
 DIAG_OFF(unused-macros)
 #define fr_time() static_assert(0, "Use el->time for event loop timing")
 DIAG_ON(unused-macros)
@@ -105,7 +112,11 @@ struct fr_event_timer {
 	fr_event_timer_t const	**parent;		//!< A pointer to the parent structure containing the timer
 							///< event.
 
+	fr_talloc_destructor_t	*link;			//!< Destructor which frees this event when
+							///< linked_ctx is freed.
+
 	fr_lst_index_t		lst_id;	     	  	//!< Where to store opaque lst data.
+	fr_timer_wheel_entry_t	wheel_entry;		//!< Where to store timer wheel data.
 	fr_dlist_t		entry;			//!< List of deferred timer events.
 
 	fr_event_list_t		*el;			//!< Event list containing this timer.
@@ -387,6 +398,10 @@ typedef struct {
  */
 struct fr_event_list {
 	fr_lst_t		*times;			//!< of timer events to be executed.
+	fr_timer_wheel_t	*wheel;			//!< of timer events to be executed.  If set, this
+							///< is used instead of times.
+	fr_event_timer_t	**ev_free;		//!< Deleted timer events kept for re-use.
+	unsigned int		num_ev_free;		//!< Number of entries in ev_free.
 	fr_rb_tree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			will_exit;		//!< Will exit on next call to fr_event_corral.
@@ -551,6 +566,58 @@ static int8_t fr_event_timer_cmp(void const *a, void const *b)
 	return fr_time_cmp(ev_a->when, ev_b->when);
 }
 
+/** Insert a timer event into the lst or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) int event_timer_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel) return fr_timer_wheel_insert(el->wheel, ev, ev->when);
+
+	return fr_lst_insert(el->times, ev);
+}
+
+/** Remove a timer event from the lst or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) int event_timer_extract(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel) return fr_timer_wheel_extract(el->wheel, ev);
+
+	return fr_lst_extract(el->times, ev);
+}
+
+/** Return the number of timer events in the lst or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) unsigned int event_timer_num(fr_event_list_t *el)
+{
+	if (el->wheel) return fr_timer_wheel_num_elements(el->wheel);
+
+	return fr_lst_num_elements(el->times);
+}
+
+/** Return when the event list next needs to run timer events
+ *
+ * @param[in] el	to check.
+ * @param[out] when	the first timer event fires.  With a timer wheel
+ *			this may be earlier, as the wheel needs servicing.
+ * @return
+ *	- true if there are timer events.
+ *	- false if there are no timer events.
+ */
+static inline CC_HINT(always_inline) bool event_timer_next(fr_event_list_t *el, fr_time_t *when)
+{
+	fr_event_timer_t *ev;
+
+	if (el->wheel) return fr_timer_wheel_next(el->wheel, when);
+
+	ev = fr_lst_peek(el->times);
+	if (!ev) return false;
+
+	*when = ev->when;
+	return true;
+}
+
 /** Compare two file descriptor handles
  *
  * @param[in] one the first file descriptor handle.
@@ -585,7 +652,7 @@ uint64_t fr_event_list_num_timers(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_lst_num_elements(el->times);
+	return event_timer_num(el);
 }
 
 /** Return the kq associated with an event list.
@@ -1368,10 +1435,15 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	fr_event_list_t		*el = ev->el;
 	fr_event_timer_t const	**ev_p;
 
+	/*
+	 *	Event was deleted, and is waiting to be re-used.
+	 */
+	if (!ev->parent) return 0;
+
 	if (fr_dlist_entry_in_list(&ev->entry)) {
 		(void) fr_dlist_remove(&el->ev_to_add, ev);
-	} else {
-		int		ret = fr_lst_extract(el->times, ev);
+	} else if (!el->wheel || fr_timer_wheel_entry_inserted(&ev->wheel_entry)) {
+		int		ret = event_timer_extract(el, ev);
 		char const	*err_file = "not-available";
 		int		err_line = 0;
 
@@ -1396,6 +1468,29 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	return 0;
 }
 
+/** Free a timer event when the ctx it's linked to is freed
+ *
+ */
+static int _event_timer_link_free(UNUSED void *fire_ctx, void *uctx)
+{
+	talloc_free(uctx);
+
+	return 0;
+}
+
+/** Bind the lifetime of a timer event to a talloc ctx
+ *
+ * Unlike talloc_link_ctx() the link can be disarmed, which allows
+ * deleted events to be re-used.
+ */
+static inline CC_HINT(always_inline) int event_timer_link(TALLOC_CTX *ctx, fr_event_timer_t *ev)
+{
+	ev->link = talloc_destructor_add(ctx, ev, _event_timer_link_free, ev);
+	if (unlikely(!ev->link)) return -1;
+
+	return 0;
+}
+
 /** Insert a timer event into an event list
  *
  * @note The talloc parent of the memory returned in ev_p must not be changed.
@@ -1447,20 +1542,36 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 	 */
 	if (!*ev_p) {
 	new_event:
-		ev = talloc_zero(el, fr_event_timer_t);
-		if (unlikely(!ev)) return -1;
+		/*
+		 *	Event lists using a timer wheel keep deleted
+		 *	events around, so that a busy list doesn't
+		 *	have to go back to the allocator for every
+		 *	timer.
+		 */
+		if (el->num_ev_free > 0) {
+			ev = el->ev_free[--el->num_ev_free];
+			memset(ev, 0, sizeof(*ev));
 
-		EVENT_DEBUG("%p - %s[%i] Added new timer %p", el, file, line, ev);
+			EVENT_DEBUG("%p - %s[%i] Re-used timer %p", el, file, line, ev);
+		} else {
+			ev = talloc_zero(el, fr_event_timer_t);
+			if (unlikely(!ev)) return -1;
+
+			EVENT_DEBUG("%p - %s[%i] Added new timer %p", el, file, line, ev);
+
+			talloc_set_destructor(ev, _event_timer_free);
+		}
 
 		/*
 		 *	Bind the lifetime of the event to the specified
 		 *	talloc ctx.  If the talloc ctx is freed, the
 		 *	event will also be freed.
 		 */
-		if (ctx != el) talloc_link_ctx(ctx, ev);
-
-		talloc_set_destructor(ev, _event_timer_free);
-		ev->lst_id = 0;
+		if ((ctx != el) && unlikely(event_timer_link(ctx, ev) < 0)) {
+			talloc_set_destructor(ev, NULL);
+			talloc_free(ev);
+			return -1;
+		}
 
 	} else {
 		ev = UNCONST(fr_event_timer_t *, *ev_p);
@@ -1468,15 +1579,13 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		EVENT_DEBUG("%p - %s[%i] Re-armed timer %p", el, file, line, ev);
 
 		/*
-		 *	We can't disarm the linking context due to
-		 *	limitations in talloc, so if the linking
-		 *	context changes, we need to free the old
-		 *	event, and allocate a new one.
+		 *	If the linking context changes, we need to
+		 *	free the old event, and allocate a new one.
 		 *
 		 *	Freeing the event also removes it from the lst.
 		 */
 		if (unlikely(ev->linked_ctx != ctx)) {
-			talloc_free(ev);
+			fr_event_timer_delete(ev_p);
 			goto new_event;
 		}
 
@@ -1485,12 +1594,13 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	will no longer be in the event loop, so check
 		 *	if it's in the lst before extracting it.
 		 */
-		if (!fr_dlist_entry_in_list(&ev->entry)) {
+		if (!fr_dlist_entry_in_list(&ev->entry) &&
+		    (!el->wheel || fr_timer_wheel_entry_inserted(&ev->wheel_entry))) {
 			int		ret;
 			char const	*err_file = "not-available";
 			int		err_line = 0;
 
-			ret = fr_lst_extract(el->times, ev);
+			ret = event_timer_extract(el, ev);
 
 #ifndef NDEBUG
 			err_file = ev->file;
@@ -1525,7 +1635,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	multiple times.
 		 */
 		if (!fr_dlist_entry_in_list(&ev->entry)) fr_dlist_insert_head(&el->ev_to_add, ev);
-	} else if (unlikely(fr_lst_insert(el->times, ev) < 0)) {
+	} else if (unlikely(event_timer_insert(el, ev) < 0)) {
 		fr_strerror_const_push("Failed inserting event");
 		talloc_set_destructor(ev, NULL);
 		*ev_p = NULL;
@@ -1573,11 +1683,30 @@ int _fr_event_timer_in(NDEBUG_LOCATION_ARGS
  */
 int fr_event_timer_delete(fr_event_timer_t const **ev_p)
 {
-	fr_event_timer_t *ev;
+	fr_event_timer_t	*ev;
+	fr_event_list_t		*el;
 
 	if (unlikely(!*ev_p)) return 0;
 
 	ev = UNCONST(fr_event_timer_t *, *ev_p);
+	el = ev->el;
+
+	/*
+	 *	Keep the event for re-use, if there's room.
+	 */
+	if (el->ev_free && (el->num_ev_free < FR_EV_TIMER_FREE_MAX)) {
+		if (_event_timer_free(ev) < 0) return -1;
+
+		if (ev->link) {
+			talloc_destructor_disarm(ev->link);
+			ev->link = NULL;
+		}
+		ev->parent = NULL;
+
+		el->ev_free[el->num_ev_free++] = ev;
+		return 0;
+	}
+
 	return talloc_free(ev);
 }
 
@@ -2114,6 +2243,19 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 
 	if (unlikely(!el)) return 0;
 
+	if (el->wheel) {
+		/*
+		 *	The wheel removes the event, so the
+		 *	delete below only has to unlink it.
+		 */
+		ev = fr_timer_wheel_pop(el->wheel, *when);
+		if (!ev) {
+			if (!fr_timer_wheel_next(el->wheel, when)) *when = fr_time_wrap(0);
+			return 0;
+		}
+		goto run;
+	}
+
 	if (fr_lst_num_elements(el->times) == 0) {
 		*when = fr_time_wrap(0);
 		return 0;
@@ -2133,6 +2275,8 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 		return 0;
 	}
 
+run:
+
 	callback = ev->callback;
 	memcpy(&uctx, &ev->uctx, sizeof(uctx));
 
@@ -2164,7 +2308,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	fr_event_pre_t		*pre;
 	int			num_fd_events;
 	bool			timer_event_ready = false;
-	fr_event_timer_t	*ev;
+	fr_time_t		next;
 
 	el->num_fd_events = 0;
 
@@ -2188,13 +2332,12 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	events are in the past.  Or, we wait for a future
 	 *	timer event.
 	 */
-	ev = fr_lst_peek(el->times);
-	if (ev) {
-		if (fr_time_lteq(ev->when, el->now)) {
+	if (event_timer_next(el, &next)) {
+		if (fr_time_lteq(next, el->now)) {
 			timer_event_ready = true;
 
 		} else if (wait) {
-			when = fr_time_sub(ev->when, el->now);
+			when = fr_time_sub(next, el->now);
 
 		} /* else we're not waiting, leave "when == 0" */
 
@@ -2465,7 +2608,7 @@ void fr_event_service(fr_event_list_t *el)
 	 *	Run all of the timer events.  Note that these can add
 	 *	new timers!
 	 */
-	if (fr_lst_num_elements(el->times) > 0) {
+	if (event_timer_num(el) > 0) {
 		el->in_handler = true;
 
 		do {
@@ -2491,7 +2634,7 @@ void fr_event_service(fr_event_list_t *el)
 	 */
 	while ((ev = fr_dlist_head(&el->ev_to_add)) != NULL) {
 		(void)fr_dlist_remove(&el->ev_to_add, ev);
-		if (unlikely(fr_lst_insert(el->times, ev) < 0)) {
+		if (unlikely(event_timer_insert(el, ev) < 0)) {
 			talloc_free(ev);
 			fr_assert_msg(0, "failed inserting lst event: %s", fr_strerror());	/* Die in debug builds */
 		}
@@ -2569,7 +2712,13 @@ static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t const *ev;
 
-	while ((ev = fr_lst_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
+	if (el->wheel) {
+		fr_timer_wheel_iter_t iter;
+
+		while ((ev = fr_timer_wheel_iter_init(el->wheel, &iter)) != NULL) fr_event_timer_delete(&ev);
+	} else {
+		while ((ev = fr_lst_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
+	}
 
 	fr_event_list_reap_signal(el, fr_time_delta_wrap(0), SIGKILL);
 
@@ -2680,12 +2829,64 @@ void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t fun
 	el->time = func;
 }
 
+/** Switch an event list to using a hierarchical timer wheel for timer events
+ *
+ * Inserting and deleting timers becomes O(1), and deleted timers are kept
+ * for re-use.  In exchange, timers fire at the end of the tick containing
+ * their expiry time, and timers which expire in the same tick may fire in
+ * any order.
+ *
+ * This is intended for event lists which handle large numbers of short
+ * lived timers, like per-request timeouts.
+ *
+ * @note If the time source is changed with #fr_event_list_set_time_func,
+ *	 that must be done first, as the wheel starts from the current time.
+ *
+ * @param[in] el		to switch.
+ * @param[in] resolution	Length of a tick.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_timer_wheel(fr_event_list_t *el, fr_time_delta_t resolution)
+{
+	fr_timer_wheel_t	*wheel;
+	fr_event_timer_t	*ev;
+
+	if (el->wheel) {
+		fr_strerror_const("Event list already uses a timer wheel");
+		return -1;
+	}
+
+	wheel = fr_timer_wheel_talloc_alloc(el, fr_event_timer_t, wheel_entry, resolution, el->time());
+	if (!wheel) return -1;
+
+	el->ev_free = talloc_array(el, fr_event_timer_t *, FR_EV_TIMER_FREE_MAX);
+	if (!el->ev_free) {
+		talloc_free(wheel);
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	Move any existing timers over.  Inserting into
+	 *	the wheel can only fail if the event is already
+	 *	in a wheel.
+	 */
+	while ((ev = fr_lst_pop(el->times)) != NULL) (void) fr_timer_wheel_insert(wheel, ev, ev->when);
+
+	TALLOC_FREE(el->times);
+	el->wheel = wheel;
+
+	return 0;
+}
+
 /** Return whether the event loop has any active events
  *
  */
 bool fr_event_list_empty(fr_event_list_t *el)
 {
-	return !fr_lst_num_elements(el->times) && !fr_rb_num_elements(el->fds);
+	return !event_timer_num(el) && !fr_rb_num_elements(el->fds);
 }
 
 #ifdef WITH_EVENT_DEBUG
@@ -2728,9 +2929,31 @@ static int8_t event_timer_location_cmp(void const *one, void const *two)
 /** Print out information about the number of events in the event loop
  *
  */
+/** Iterator over the timer events in the lst or timer wheel
+ *
+ */
+typedef union {
+	fr_lst_iter_t		lst;
+	fr_timer_wheel_iter_t	wheel;
+} event_timer_iter_t;
+
+static fr_event_timer_t *event_timer_iter_init(fr_event_list_t *el, event_timer_iter_t *iter)
+{
+	if (el->wheel) return fr_timer_wheel_iter_init(el->wheel, &iter->wheel);
+
+	return fr_lst_iter_init(el->times, &iter->lst);
+}
+
+static fr_event_timer_t *event_timer_iter_next(fr_event_list_t *el, event_timer_iter_t *iter)
+{
+	if (el->wheel) return fr_timer_wheel_iter_next(el->wheel, &iter->wheel);
+
+	return fr_lst_iter_next(el->times, &iter->lst);
+}
+
 void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
-	fr_lst_iter_t		iter;
+	event_timer_iter_t	iter;
 	fr_event_timer_t const	*ev;
 	size_t			i;
 
@@ -2756,9 +2979,9 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	Show which events are due, when they're due,
 	 *	and where they were allocated
 	 */
-	for (ev = fr_lst_iter_init(el->times, &iter);
+	for (ev = event_timer_iter_init(el, &iter);
 	     ev != NULL;
-	     ev = fr_lst_iter_next(el->times, &iter)) {
+	     ev = event_timer_iter_next(el, &iter)) {
 		fr_time_delta_t diff = fr_time_sub(ev->when, now);
 
 		for (i = 0; i < NUM_ELEMENTS(decades); i++) {
@@ -2822,7 +3045,7 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 #ifndef NDEBUG
 void fr_event_timer_dump(fr_event_list_t *el)
 {
-	fr_lst_iter_t		iter;
+	event_timer_iter_t	iter;
 	fr_event_timer_t 	*ev;
 	fr_time_t		now;
 
@@ -2830,9 +3053,9 @@ void fr_event_timer_dump(fr_event_list_t *el)
 
 	EVENT_DEBUG("Time is now %"PRId64"", fr_time_unwrap(now));
 
-	for (ev = fr_lst_iter_init(el->times, &iter);
+	for (ev = event_timer_iter_init(el, &iter);
 	     ev;
-	     ev = fr_lst_iter_next(el->times, &iter)) {
+	     ev = event_timer_iter_next(el, &iter)) {
 		(void)talloc_get_type_abort(ev, fr_event_timer_t);
 		EVENT_DEBUG("%s[%u]: %p time=%" PRId64 " (%c), callback=%p",
 			    ev->file, ev->line, ev, fr_time_unwrap(ev->when),
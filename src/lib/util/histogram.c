@@ -0,0 +1,167 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Functions for log-linear latency histograms
+ *
+ * @file src/lib/util/histogram.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/histogram.h>
+
+#include <string.h>
+
+/** Return the largest value which is counted in a bucket
+ *
+ */
+static uint64_t histogram_bucket_upper(unsigned int idx)
+{
+	unsigned int	shift;
+	uint64_t	top;
+
+	if (idx < (1 << FR_HISTOGRAM_SUB_BITS)) return idx;
+
+	shift = (idx >> (FR_HISTOGRAM_SUB_BITS - 1)) - 1;
+	top = idx - (shift << (FR_HISTOGRAM_SUB_BITS - 1));
+
+	return ((top + 1) << shift) - 1;
+}
+
+/** Remove all values from a histogram
+ *
+ * @param[in] h	to clear.
+ */
+void fr_histogram_clear(fr_histogram_t *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/** Add the values from one histogram to another
+ *
+ * Used to combine per-thread histograms when they are read, so that
+ * recording values never needs locks.
+ *
+ * @param[in,out] out	to add values to.
+ * @param[in] in	to take values from.
+ */
+void fr_histogram_merge(fr_histogram_t *out, fr_histogram_t const *in)
+{
+	unsigned int i;
+
+	if (!in->count) return;
+
+	if (!out->count || (in->min < out->min)) out->min = in->min;
+	if (in->max > out->max) out->max = in->max;
+
+	out->count += in->count;
+	out->sum += in->sum;
+
+	for (i = 0; i < FR_HISTOGRAM_BUCKETS; i++) out->bucket[i] += in->bucket[i];
+}
+
+/** Return the value below which a given percentage of the values fall
+ *
+ * The result is the largest value in the bucket containing the
+ * percentile, limited to the smallest and largest values recorded.
+ *
+ * @param[in] h			to examine.
+ * @param[in] percentile	0..100, e.g. 99.9
+ * @return
+ *	- The value at the percentile.
+ *	- 0 if the histogram is empty.
+ */
+fr_time_delta_t fr_histogram_percentile(fr_histogram_t const *h, double percentile)
+{
+	uint64_t	target, seen = 0, value;
+	unsigned int	i;
+
+	if (!h->count) return fr_time_delta_wrap(0);
+
+	if (percentile <= 0) return fr_time_delta_wrap(h->min);
+	if (percentile >= 100) return fr_time_delta_wrap(h->max);
+
+	/*
+	 *	Round up, so that p50 of two values is the first one,
+	 *	and p99.9 of ten values is the last one.
+	 */
+	target = (uint64_t) ((percentile * h->count) / 100.0);
+	if (((double) target * 100.0) < (percentile * h->count)) target++;
+	if (!target) target = 1;
+
+	for (i = 0; i < FR_HISTOGRAM_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target) break;
+	}
+
+	if (i == (FR_HISTOGRAM_BUCKETS - 1)) return fr_time_delta_wrap(h->max);
+
+	value = histogram_bucket_upper(i);
+	if (value < h->min) value = h->min;
+	if (value > h->max) value = h->max;
+
+	return fr_time_delta_wrap(value);
+}
+
+/** Return the mean of the values in a histogram
+ *
+ * @param[in] h	to examine.
+ * @return the mean, or 0 if the histogram is empty.
+ */
+fr_time_delta_t fr_histogram_mean(fr_histogram_t const *h)
+{
+	if (!h->count) return fr_time_delta_wrap(0);
+
+	return fr_time_delta_wrap(h->sum / h->count);
+}
+
+/** Print a summary of a histogram, one "name value" pair per line
+ *
+ * Times are printed in microseconds.
+ *
+ * @param[in] fp	to print to.
+ * @param[in] h		to print.
+ * @param[in] prefix	for the names, e.g. "latency".
+ */
+void fr_histogram_fprint(FILE *fp, fr_histogram_t const *h, char const *prefix)
+{
+	static struct {
+		char const	*name;
+		double		percentile;
+	} const percentiles[] = {
+		{ "p50",	50 },
+		{ "p90",	90 },
+		{ "p99",	99 },
+		{ "p99.9",	99.9 },
+	};
+	size_t i;
+
+	if (!prefix) prefix = "latency";
+
+	fprintf(fp, "%s.count\t%" PRIu64 "\n", prefix, h->count);
+	if (!h->count) return;
+
+	fprintf(fp, "%s.min_usec\t%.3f\n", prefix, h->min / 1000.0);
+	fprintf(fp, "%s.mean_usec\t%.3f\n", prefix, fr_time_delta_unwrap(fr_histogram_mean(h)) / 1000.0);
+
+	for (i = 0; i < NUM_ELEMENTS(percentiles); i++) {
+		fprintf(fp, "%s.%s_usec\t%.3f\n", prefix, percentiles[i].name,
+			fr_time_delta_unwrap(fr_histogram_percentile(h, percentiles[i].percentile)) / 1000.0);
+	}
+
+	fprintf(fp, "%s.max_usec\t%.3f\n", prefix, h->max / 1000.0);
+}
@@ -0,0 +1,118 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Fixed size, log-linear latency histograms
+ *
+ * Values are recorded with a relative error of at most
+ * 1 / 2^(#FR_HISTOGRAM_SUB_BITS - 1), which is good enough to report
+ * p99.9 latencies, while keeping the histogram a flat array which can
+ * be embedded in other structures, copied, and merged.
+ *
+ * Values below 2^#FR_HISTOGRAM_SUB_BITS nanoseconds get a bucket each.
+ * Above that, every power of two is split into 2^(#FR_HISTOGRAM_SUB_BITS - 1)
+ * equal buckets.  Values of 2^#FR_HISTOGRAM_MAX_BITS nanoseconds
+ * (about 18 minutes) or more go into an extra overflow bucket.
+ *
+ * @file src/lib/util/histogram.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(histogram_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FR_HISTOGRAM_SUB_BITS	(5)
+#define FR_HISTOGRAM_MAX_BITS	(40)
+#define FR_HISTOGRAM_BUCKETS	(((FR_HISTOGRAM_MAX_BITS - FR_HISTOGRAM_SUB_BITS) << (FR_HISTOGRAM_SUB_BITS - 1)) + \
+				 (1 << FR_HISTOGRAM_SUB_BITS) + 1)
+
+/** A latency histogram
+ *
+ * The counters aren't atomic.  Each histogram should have a single
+ * writer, usually a worker thread.  Other threads, e.g. radmin, may
+ * merge it whilst it's being written to.  Such a read can miss values
+ * recorded at the same time, or see a count which doesn't yet match
+ * the buckets, which is accepted for statistics.  Aligned 64bit loads
+ * and stores don't tear on the platforms we support.
+ */
+typedef struct {
+	uint64_t	count;				//!< Number of values recorded.
+	uint64_t	sum;				//!< Of all values, in nanoseconds.
+	uint64_t	min;				//!< Smallest value recorded.
+	uint64_t	max;				//!< Largest value recorded.
+	uint64_t	bucket[FR_HISTOGRAM_BUCKETS];	//!< Counts, indexed by fr_histogram_index().
+} fr_histogram_t;
+
+/** Return the bucket a value is counted in
+ *
+ * @param[in] value	in nanoseconds.
+ * @return the bucket index.
+ */
+static inline unsigned int fr_histogram_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < (1 << FR_HISTOGRAM_SUB_BITS)) return value;
+
+	if (value >= ((uint64_t) 1 << FR_HISTOGRAM_MAX_BITS)) return FR_HISTOGRAM_BUCKETS - 1;
+
+	/*
+	 *	Keep the top FR_HISTOGRAM_SUB_BITS bits of the value.
+	 */
+	shift = (63 - __builtin_clzll(value)) - FR_HISTOGRAM_SUB_BITS + 1;
+
+	return (shift << (FR_HISTOGRAM_SUB_BITS - 1)) + (unsigned int) (value >> shift);
+}
+
+/** Record one value
+ *
+ * @param[in] h		to record the value in.
+ * @param[in] delta	to record.  Negative values are recorded as zero.
+ */
+static inline void fr_histogram_add(fr_histogram_t *h, fr_time_delta_t delta)
+{
+	uint64_t value = fr_time_delta_ispos(delta) ? (uint64_t) fr_time_delta_unwrap(delta) : 0;
+
+	if (!h->count || (value < h->min)) h->min = value;
+	if (value > h->max) h->max = value;
+
+	h->count++;
+	h->sum += value;
+	h->bucket[fr_histogram_index(value)]++;
+}
+
+void		fr_histogram_clear(fr_histogram_t *h) CC_HINT(nonnull);
+
+void		fr_histogram_merge(fr_histogram_t *out, fr_histogram_t const *in) CC_HINT(nonnull);
+
+fr_time_delta_t	fr_histogram_percentile(fr_histogram_t const *h, double percentile) CC_HINT(nonnull);
+
+fr_time_delta_t	fr_histogram_mean(fr_histogram_t const *h) CC_HINT(nonnull);
+
+void		fr_histogram_fprint(FILE *fp, fr_histogram_t const *h, char const *prefix) CC_HINT(nonnull(1,2));
+
+#ifdef __cplusplus
+}
+#endif
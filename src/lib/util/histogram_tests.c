@@ -0,0 +1,138 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for log-linear latency histograms
+ *
+ * @file src/lib/util/histogram_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/rand.h>
+
+/*
+ *	The largest relative error of a bucket.
+ */
+#define MAX_ERROR	(1.0 / (1 << (FR_HISTOGRAM_SUB_BITS - 1)))
+
+static fr_histogram_t h1, h2;
+
+/** Bucket indexes are contiguous, and increase with the value
+ *
+ */
+static void histogram_index(void)
+{
+	uint64_t	value;
+	unsigned int	idx, last = 0;
+
+	for (value = 0; value < (1 << 20); value++) {
+		idx = fr_histogram_index(value);
+		TEST_CHECK((idx == last) || (idx == (last + 1)));
+		TEST_MSG("value %" PRIu64 " index %u after %u", value, idx, last);
+		last = idx;
+	}
+
+	TEST_CHECK(fr_histogram_index(((uint64_t) 1 << FR_HISTOGRAM_MAX_BITS) - 1) == (FR_HISTOGRAM_BUCKETS - 2));
+	TEST_CHECK(fr_histogram_index((uint64_t) 1 << FR_HISTOGRAM_MAX_BITS) == (FR_HISTOGRAM_BUCKETS - 1));
+	TEST_CHECK(fr_histogram_index(UINT64_MAX) == (FR_HISTOGRAM_BUCKETS - 1));
+}
+
+/** Percentiles of uniformly distributed values are within the bucket error
+ *
+ */
+static void histogram_percentile(void)
+{
+	uint64_t	i;
+	double		pct[] = { 50, 90, 99, 99.9 };
+	size_t		j;
+
+	fr_histogram_clear(&h1);
+
+	for (i = 1; i <= 100000; i++) fr_histogram_add(&h1, fr_time_delta_from_usec(i));
+
+	TEST_CHECK(h1.count == 100000);
+	TEST_CHECK(h1.min == 1000);
+	TEST_CHECK(h1.max == 100000000);
+	TEST_CHECK(fr_time_delta_unwrap(fr_histogram_mean(&h1)) == 50000500);
+
+	for (j = 0; j < NUM_ELEMENTS(pct); j++) {
+		double expected = pct[j] * 1000000;
+		double got = fr_time_delta_unwrap(fr_histogram_percentile(&h1, pct[j]));
+
+		TEST_CHECK(got >= expected);
+		TEST_CHECK(got <= (expected * (1 + MAX_ERROR)));
+		TEST_MSG("p%g expected %g got %g", pct[j], expected, got);
+	}
+
+	TEST_CHECK(fr_time_delta_unwrap(fr_histogram_percentile(&h1, 0)) == 1000);
+	TEST_CHECK(fr_time_delta_unwrap(fr_histogram_percentile(&h1, 100)) == 100000000);
+}
+
+/** Merging two histograms is the same as recording all values in one
+ *
+ */
+static void histogram_merge(void)
+{
+	fr_histogram_t	all;
+	int		i;
+
+	fr_histogram_clear(&h1);
+	fr_histogram_clear(&h2);
+	fr_histogram_clear(&all);
+
+	for (i = 0; i < 10000; i++) {
+		fr_time_delta_t delta = fr_time_delta_wrap(fr_rand() & 0x0fffffff);
+
+		fr_histogram_add((i & 1) ? &h1 : &h2, delta);
+		fr_histogram_add(&all, delta);
+	}
+
+	fr_histogram_merge(&h1, &h2);
+	TEST_CHECK(memcmp(&h1, &all, sizeof(all)) == 0);
+
+	/*
+	 *	Merging into an empty histogram copies it.
+	 */
+	fr_histogram_clear(&h2);
+	fr_histogram_merge(&h2, &all);
+	TEST_CHECK(memcmp(&h2, &all, sizeof(all)) == 0);
+}
+
+/** An empty histogram reports zero for everything
+ *
+ */
+static void histogram_empty(void)
+{
+	fr_histogram_clear(&h1);
+
+	TEST_CHECK(fr_time_delta_unwrap(fr_histogram_percentile(&h1, 99)) == 0);
+	TEST_CHECK(fr_time_delta_unwrap(fr_histogram_mean(&h1)) == 0);
+
+	fr_histogram_add(&h1, fr_time_delta_wrap(-5));
+	TEST_CHECK(h1.count == 1);
+	TEST_CHECK(h1.bucket[0] == 1);
+}
+
+TEST_LIST = {
+	{ "histogram_index",		histogram_index },
+	{ "histogram_percentile",	histogram_percentile },
+	{ "histogram_merge",		histogram_merge },
+	{ "histogram_empty",		histogram_empty },
+
+	{ NULL }
+};
@@ -7,6 +7,7 @@ TARGET		:= libfreeradius-util.a
 
 SOURCES		:= \
 		   atexit.c \
+		   atomic_queue.c \
 		   base16.c \
 		   base32.c \
 		   base64.c \
@@ -16,6 +17,7 @@ SOURCES		:= \
 		   dbuff.c \
 		   dcursor.c \
 		   debug.c \
+		   dict_cache.c \
 		   dict_ext.c \
 		   dict_fixup.c \
 		   dict_print.c \
@@ -36,6 +38,7 @@ SOURCES		:= \
 		   getaddrinfo.c \
 		   hash.c \
 		   heap.c \
+		   histogram.c \
 		   hmac_md5.c \
 		   hmac_sha1.c \
 		   htrie.c \
@@ -78,14 +81,17 @@ SOURCES		:= \
 		   table.c \
 		   talloc.c \
 		   time.c \
+		   timer_wheel.c \
 		   timeval.c \
 		   token.c \
 		   trie.c \
 		   types.c \
 		   udp.c \
+		   udp_batch.c \
 		   udpfromto.c \
 		   udp_queue.c \
 		   uri.c \
+		   uring.c \
 		   value.c \
 		   version.c
 
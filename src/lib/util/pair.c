@@ -46,6 +46,7 @@ void fr_pair_list_init(fr_pair_list_t *list)
 	 *	all of them.
 	 */
 	fr_dlist_talloc_init(&list->order, fr_pair_t, order_entry);
+	list->index = NULL;
 }
 
 /** Free a fr_pair_t
@@ -100,6 +101,318 @@ fr_pair_list_t *fr_pair_list_alloc(TALLOC_CTX *ctx)
 	return pl;
 }
 
+/** Index entry for all the pairs in a list with a given da
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;			//!< Attribute, or NULL if the slot is free.
+	fr_pair_t		*first;			//!< First pair in the list with this da.
+	fr_pair_t		*last;			//!< Last pair in the list with this da.
+	unsigned int		count;			//!< Number of pairs in the list with this da.
+} pair_index_slot_t;
+
+/** Open addressed index of the pairs in a list
+ *
+ * The index is built the first time a lookup is done on a list which
+ * is at least #FR_PAIR_LIST_INDEX_MIN pairs long.  Appending, prepending
+ * and removing pairs keeps it up to date.  Anything which can change the
+ * relative order of pairs with the same da (sorting, moving lists, most
+ * cursor operations) marks it as invalid, and it's rebuilt by the next
+ * lookup.
+ */
+struct fr_pair_list_index_s {
+	pair_index_slot_t	*slots;			//!< Slots, with linear probing.
+	uint32_t		num_slots;		//!< Always a power of 2.
+	uint32_t		used;			//!< Number of slots in use.  Kept at or
+							///< below half of num_slots.
+	size_t			num_pairs;		//!< Number of pairs in the index.
+	bool			valid;			//!< Whether the index matches the list.
+};
+
+/** Add an index to a pair list
+ *
+ * The index is only populated once the list gets long enough for it to
+ * be faster than walking the list.  Insertion order is unaffected.
+ *
+ * @param[in] ctx	to allocate the index in.  Must not be freed before
+ *			the list.  For the children of a pair, use the pair.
+ * @param[in] list	to index.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_pair_list_index_alloc(TALLOC_CTX *ctx, fr_pair_list_t *list)
+{
+	if (list->index) return 0;
+
+	list->index = talloc_zero(ctx, fr_pair_list_index_t);
+	if (unlikely(!list->index)) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline CC_HINT(always_inline) uint32_t pair_index_hash(fr_dict_attr_t const *da)
+{
+	uint64_t h = (uintptr_t)da;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return (uint32_t)h;
+}
+
+/** Return the slot for a da, or the free slot where it should go
+ *
+ */
+static inline CC_HINT(always_inline) pair_index_slot_t *pair_index_slot(fr_pair_list_index_t *index,
+									 fr_dict_attr_t const *da)
+{
+	uint32_t mask = index->num_slots - 1;
+	uint32_t i;
+
+	for (i = pair_index_hash(da) & mask; ; i = (i + 1) & mask) {
+		pair_index_slot_t *slot = &index->slots[i];
+
+		if (!slot->da || (slot->da == da)) return slot;
+	}
+}
+
+/** Free a slot, moving later entries in the probe sequence back into the gap
+ *
+ */
+static void pair_index_slot_free(fr_pair_list_index_t *index, pair_index_slot_t *slot)
+{
+	uint32_t mask = index->num_slots - 1;
+	uint32_t i = slot - index->slots, j = i, k;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!index->slots[j].da) break;
+
+		/*
+		 *	Leave the entry where it is if its
+		 *	home slot is cyclically in (i, j].
+		 */
+		k = pair_index_hash(index->slots[j].da) & mask;
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+
+	index->slots[i] = (pair_index_slot_t){ .da = NULL };
+	index->used--;
+}
+
+/** (Re)build the index from the contents of the list
+ *
+ */
+static int pair_index_build(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t	*index = list->index;
+	size_t			num = fr_dlist_num_elements(&list->order);
+	uint32_t		num_slots = 32;
+	fr_pair_t		*vp = NULL;
+
+	/*
+	 *	Leave room for more pairs to be appended
+	 *	before the index has to be rebuilt.
+	 */
+	while (num_slots < (num * 2)) num_slots <<= 1;
+
+	if (num_slots > index->num_slots) {
+		pair_index_slot_t *slots;
+
+		slots = talloc_realloc(index, index->slots, pair_index_slot_t, num_slots);
+		if (unlikely(!slots)) return -1;
+
+		index->slots = slots;
+		index->num_slots = num_slots;
+	}
+	memset(index->slots, 0, sizeof(index->slots[0]) * index->num_slots);
+	index->used = 0;
+
+	while ((vp = fr_dlist_next(&list->order, vp))) {
+		pair_index_slot_t *slot = pair_index_slot(index, vp->da);
+
+		if (!slot->da) {
+			slot->da = vp->da;
+			slot->first = vp;
+			index->used++;
+		}
+		slot->last = vp;
+		slot->count++;
+	}
+
+	index->num_pairs = num;
+	index->valid = true;
+
+	return 0;
+}
+
+/** Return the index for a list if it should be used for lookups
+ *
+ */
+static inline CC_HINT(always_inline) fr_pair_list_index_t *pair_index(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t *index = list->index;
+
+	if (likely(!index)) return NULL;
+
+	/*
+	 *	The number of pairs is a cheap check that nothing
+	 *	has modified the list behind our back.
+	 */
+	if (index->valid && (index->num_pairs == fr_dlist_num_elements(&list->order))) return index;
+
+	index->valid = false;
+	if (fr_dlist_num_elements(&list->order) < FR_PAIR_LIST_INDEX_MIN) return NULL;
+
+	if (pair_index_build(list) < 0) return NULL;
+
+	return index;
+}
+
+/** Find the slot for a da in a valid index
+ *
+ */
+static inline CC_HINT(always_inline) pair_index_slot_t *pair_index_find(fr_pair_list_index_t *index,
+									 fr_dict_attr_t const *da)
+{
+	pair_index_slot_t *slot = pair_index_slot(index, da);
+
+	if (!slot->da) return NULL;
+
+	/*
+	 *	The da of an indexed pair was changed without
+	 *	the list being passed in.  Fall back to walking
+	 *	the list until the next rebuild.  Changes to pairs
+	 *	in the middle of the list can't be seen here, those
+	 *	are caught by PAIR_LIST_VERIFY().
+	 */
+	if (unlikely((slot->first->da != da) || (slot->last->da != da))) {
+		index->valid = false;
+		return NULL;
+	}
+
+	return slot;
+}
+
+/** Mark a list's index as needing to be rebuilt
+ *
+ */
+static inline CC_HINT(always_inline) void pair_index_invalidate(fr_pair_list_t const *list)
+{
+	if (list->index) list->index->valid = false;
+}
+
+/** Reset a list's index after the list has been emptied
+ *
+ */
+static inline CC_HINT(always_inline) void pair_index_reset(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t *index = list->index;
+
+	if (!index) return;
+
+	if (!index->slots) {
+		index->valid = false;
+		return;
+	}
+
+	memset(index->slots, 0, sizeof(index->slots[0]) * index->num_slots);
+	index->used = 0;
+	index->num_pairs = 0;
+	index->valid = true;
+}
+
+/** Update the index after a pair has been inserted into a list
+ *
+ */
+static inline CC_HINT(always_inline) void pair_index_insert(fr_pair_list_t *list, fr_pair_t *vp)
+{
+	fr_pair_list_index_t	*index = list->index;
+	pair_index_slot_t	*slot;
+
+	if (likely(!index) || !index->valid) return;
+
+	slot = pair_index_slot(index, vp->da);
+	if (!slot->da) {
+		/*
+		 *	Index is full, grow it on the next lookup.
+		 */
+		if (((index->used + 1) * 2) > index->num_slots) {
+			index->valid = false;
+			return;
+		}
+
+		*slot = (pair_index_slot_t){
+			.da = vp->da,
+			.first = vp,
+			.last = vp,
+			.count = 1
+		};
+		index->used++;
+		index->num_pairs++;
+		return;
+	}
+
+	if (!fr_dlist_next(&list->order, vp)) {
+		slot->last = vp;
+	} else if (!fr_dlist_prev(&list->order, vp)) {
+		slot->first = vp;
+	} else {
+		/*
+		 *	Somewhere in the middle, we don't
+		 *	know where relative to first and last.
+		 */
+		index->valid = false;
+		return;
+	}
+	slot->count++;
+	index->num_pairs++;
+}
+
+/** Update the index before a pair is removed from a list
+ *
+ */
+static inline CC_HINT(always_inline) void pair_index_remove(fr_pair_list_t *list, fr_pair_t *vp)
+{
+	fr_pair_list_index_t	*index = list->index;
+	pair_index_slot_t	*slot;
+	fr_pair_t		*p;
+
+	if (likely(!index) || !index->valid) return;
+
+	slot = pair_index_slot(index, vp->da);
+	if (unlikely(!slot->da)) {
+		index->valid = false;
+		return;
+	}
+
+	index->num_pairs--;
+	if (--slot->count == 0) {
+		pair_index_slot_free(index, slot);
+		return;
+	}
+
+	if (slot->first == vp) {
+		for (p = fr_dlist_next(&list->order, vp); p && (p->da != vp->da); p = fr_dlist_next(&list->order, p));
+		slot->first = p;
+	}
+
+	if (slot->last == vp) {
+		for (p = fr_dlist_prev(&list->order, vp); p && (p->da != vp->da); p = fr_dlist_prev(&list->order, p));
+		slot->last = p;
+	}
+
+	if (unlikely(!slot->first || !slot->last)) index->valid = false;
+}
+
 /** Initialise fields in an fr_pair_t without assigning a da
  *
  * @note Internal use by the allocation functions only.
@@ -520,6 +833,7 @@ int fr_pair_steal_prepend(TALLOC_CTX *list_ctx, fr_pair_list_t *list, fr_pair_t
 void fr_pair_list_free(fr_pair_list_t *list)
 {
 	fr_dlist_talloc_free(&list->order);
+	pair_index_reset(list);
 }
 
 /** Is a valuepair list empty
@@ -617,11 +931,20 @@ void *fr_pair_iter_next_by_ancestor(fr_dlist_head_t *list, void *to_eval, void *
  */
 unsigned int fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t const *da)
 {
-	fr_pair_t	*vp = NULL;
-	unsigned int	count = 0;
+	fr_pair_t		*vp = NULL;
+	unsigned int		count = 0;
+	fr_pair_list_index_t	*index;
 
 	if (fr_dlist_empty(&list->order)) return 0;
 
+	index = pair_index(list);
+	if (index) {
+		pair_index_slot_t *slot = pair_index_find(index, da);
+
+		if (slot) return slot->count;
+		if (index->valid) return 0;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) if (da == vp->da) count++;
 
 	return count;
@@ -640,12 +963,25 @@ unsigned int fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t cons
  */
 fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_pair_t const *prev, fr_dict_attr_t const *da)
 {
-	fr_pair_t *vp = UNCONST(fr_pair_t *, prev);
+	fr_pair_t		*vp = UNCONST(fr_pair_t *, prev);
+	fr_pair_list_index_t	*index;
 
 	if (fr_dlist_empty(&list->order)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	index = pair_index(list);
+	if (index) {
+		pair_index_slot_t *slot = pair_index_find(index, da);
+
+		if (slot) {
+			if (!prev) return slot->first;
+			if (prev == slot->last) return NULL;
+		} else if (index->valid) {
+			return NULL;
+		}
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) if (da == vp->da) return vp;
 
 	return NULL;
@@ -664,12 +1000,32 @@ fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_pair_t const *prev,
  */
 fr_pair_t *fr_pair_find_by_da_idx(fr_pair_list_t const *list, fr_dict_attr_t const *da, unsigned int idx)
 {
-	fr_pair_t *vp = NULL;
+	fr_pair_t		*vp = NULL;
+	fr_pair_list_index_t	*index;
 
 	if (fr_dlist_empty(&list->order)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	index = pair_index(list);
+	if (index) {
+		pair_index_slot_t *slot = pair_index_find(index, da);
+
+		if (slot) {
+			if (idx >= slot->count) return NULL;
+			if (idx == 0) return slot->first;
+			if (idx == (slot->count - 1)) return slot->last;
+
+			/*
+			 *	Start from the first instance
+			 */
+			vp = slot->first;
+			idx--;
+		} else if (index->valid) {
+			return NULL;
+		}
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) {
 		if (da != vp->da) continue;
 
@@ -814,8 +1170,10 @@ fr_pair_list_t *fr_pair_children(fr_pair_t *vp)
  * @return
  *	- 0 on success.
  */
-static int _pair_list_dcursor_insert(UNUSED fr_dlist_head_t *list, UNUSED void *to_insert, UNUSED void *uctx)
+static int _pair_list_dcursor_insert(UNUSED fr_dlist_head_t *list, UNUSED void *to_insert, void *uctx)
 {
+	pair_index_invalidate(uctx);
+
 	return 0;
 }
 
@@ -827,8 +1185,10 @@ static int _pair_list_dcursor_insert(UNUSED fr_dlist_head_t *list, UNUSED void *
  * @return
  *	- 0 on success.
  */
-static int _pair_list_dcursor_remove(UNUSED fr_dlist_head_t *list, UNUSED void *to_remove, UNUSED void *uctx)
+static int _pair_list_dcursor_remove(UNUSED fr_dlist_head_t *list, UNUSED void *to_remove, void *uctx)
 {
+	pair_index_invalidate(uctx);
+
 	return 0;
 }
 
@@ -990,6 +1350,7 @@ int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_dlist_insert_head(&list->order, to_add);
+	pair_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1014,6 +1375,7 @@ int fr_pair_append(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_dlist_insert_tail(&list->order, to_add);
+	pair_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1042,6 +1404,7 @@ int fr_pair_insert_after(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_add
 	}
 
 	fr_dlist_insert_after(fr_pair_list_order(list), pos, to_add);
+	pair_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1070,6 +1433,7 @@ int fr_pair_insert_before(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_ad
 	}
 
 	fr_dlist_insert_before(fr_pair_list_order(list), pos, to_add);
+	pair_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1092,7 +1456,7 @@ void fr_pair_replace(fr_pair_list_t *list, fr_pair_t *to_replace, fr_pair_t *vp)
 	PAIR_VERIFY(vp);
 
 	fr_pair_insert_after(list, to_replace, vp);
-	fr_pair_remove(list, to_replace);
+	fr_pair_delete(list, to_replace);
 }
 
 /** Alloc a new fr_pair_t (and append)
@@ -1244,6 +1608,7 @@ fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
 	fr_pair_t *prev;
 
 	prev = fr_pair_list_prev(list, vp);
+	pair_index_remove(list, vp);
 	fr_dlist_remove(&list->order, vp);
 
 	return prev;
@@ -1260,6 +1625,7 @@ fr_pair_t *fr_pair_delete(fr_pair_list_t *list, fr_pair_t *vp)
 	fr_pair_t *prev;
 
 	prev = fr_pair_list_prev(list, vp);
+	pair_index_remove(list, vp);
 	fr_dlist_remove(&list->order, vp);
 	talloc_free(vp);
 
@@ -1498,6 +1864,7 @@ int fr_pair_list_cmp(fr_pair_list_t const *a, fr_pair_list_t const *b)
 void fr_pair_list_sort(fr_pair_list_t *list, fr_cmp_t cmp)
 {
 	fr_dlist_sort(&list->order, cmp);
+	pair_index_invalidate(list);
 }
 
 /** Write an error to the library errorbuff detailing the mismatch
@@ -2701,6 +3068,58 @@ void fr_pair_verify(char const *file, int line, fr_pair_t const *vp)
  * @param[in] expected	talloc ctx pairs should have been allocated in
  * @param[in] list	of fr_pair_ts to verify
  */
+/** Check that a list's index matches the contents of the list
+ *
+ * Lookups only check the first and last pair for each da.  This also
+ * catches pairs in the middle of the list whose da has been changed
+ * without going through #fr_pair_reinit_from_da.
+ */
+static void pair_index_verify(char const *file, int line, fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t	*index = list->index;
+	unsigned int		*seen;
+	fr_pair_t		*vp = NULL;
+	uint32_t		i;
+
+	/*
+	 *	Stale indexes are rebuilt by the next lookup.
+	 */
+	if (!index || !index->valid || (index->num_pairs != fr_dlist_num_elements(&list->order))) return;
+
+	seen = talloc_zero_array(NULL, unsigned int, index->num_slots);
+	if (!seen) return;
+
+	while ((vp = fr_dlist_next(&list->order, vp))) {
+		pair_index_slot_t *slot = pair_index_slot(index, vp->da);
+
+		fr_fatal_assert_msg(slot->da != NULL,
+				    "CONSISTENCY CHECK FAILED %s[%u]: Pair \"%s\" is missing from the list index",
+				    file, line, vp->da->name);
+
+		i = slot - index->slots;
+		if (seen[i]++ == 0) {
+			fr_fatal_assert_msg(slot->first == vp,
+					    "CONSISTENCY CHECK FAILED %s[%u]: Index has the wrong first \"%s\"",
+					    file, line, vp->da->name);
+		}
+		if (seen[i] == slot->count) {
+			fr_fatal_assert_msg(slot->last == vp,
+					    "CONSISTENCY CHECK FAILED %s[%u]: Index has the wrong last \"%s\"",
+					    file, line, vp->da->name);
+		}
+	}
+
+	for (i = 0; i < index->num_slots; i++) {
+		if (!index->slots[i].da) continue;
+
+		fr_fatal_assert_msg(seen[i] == index->slots[i].count,
+				    "CONSISTENCY CHECK FAILED %s[%u]: Index expected %u \"%s\", list has %u",
+				    file, line, index->slots[i].count, index->slots[i].da->name, seen[i]);
+	}
+
+	talloc_free(seen);
+}
+
 void fr_pair_list_verify(char const *file, int line, TALLOC_CTX const *expected, fr_pair_list_t const *list)
 {
 	fr_pair_t		*slow, *fast;
@@ -2734,6 +3153,8 @@ void fr_pair_list_verify(char const *file, int line, TALLOC_CTX const *expected,
 					     parent, parent ? talloc_get_name(parent) : "NULL");
 		}
 	}
+
+	pair_index_verify(file, line, list);
 }
 #endif
 
@@ -2771,7 +3192,15 @@ void fr_pair_list_tainted(fr_pair_list_t *list)
  */
 void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
 {
+	/*
+	 *	Callers often pass empty lists, there's no
+	 *	need to rebuild the index for those.
+	 */
+	if (fr_pair_list_empty(src)) return;
+
 	fr_dlist_move(&dst->order, &src->order);
+	pair_index_invalidate(dst);
+	pair_index_reset(src);
 }
 
 /** Move a list of fr_pair_t from a temporary list to the head of a destination list
@@ -2781,7 +3210,11 @@ void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
  */
 void fr_pair_list_prepend(fr_pair_list_t *dst, fr_pair_list_t *src)
 {
+	if (fr_pair_list_empty(src)) return;
+
 	fr_dlist_move_head(&dst->order, &src->order);
+	pair_index_invalidate(dst);
+	pair_index_reset(src);
 }
 
 /** Evaluation function for matching if vp matches a given da
@@ -61,10 +61,20 @@ typedef enum value_type {
 
 typedef struct value_pair_s fr_pair_t;
 
+typedef struct fr_pair_list_index_s fr_pair_list_index_t;
+
 typedef struct {
         fr_dlist_head_t		order;				//!< Maintains the relative order of pairs in a list.
+        fr_pair_list_index_t	*index;				//!< Optional index of pairs by #fr_dict_attr_t.
 } fr_pair_list_t;
 
+/** Indexed lists shorter than this are searched linearly
+ *
+ * Below this length, walking the list is as fast as building or
+ * consulting the index.  See pair_list_perf_test.c.
+ */
+#define FR_PAIR_LIST_INDEX_MIN	16
+
 static inline fr_dlist_head_t _CONST *fr_pair_list_order(fr_pair_list_t _CONST *list)
 {
 	return &list->order;
@@ -218,6 +228,8 @@ fr_pair_t	*fr_pair_alloc_null(TALLOC_CTX *ctx) CC_HINT(warn_unused_result);
 
 fr_pair_list_t	*fr_pair_list_alloc(TALLOC_CTX *ctx) CC_HINT(warn_unused_result);
 
+int		fr_pair_list_index_alloc(TALLOC_CTX *ctx, fr_pair_list_t *list) CC_HINT(nonnull(2));
+
 fr_pair_t	*fr_pair_root_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da) CC_HINT(warn_unused_result) CC_HINT(nonnull(2));
 
 /** @hidecallergraph */
@@ -337,7 +337,8 @@ static void do_test_fr_pair_append(unsigned int len, unsigned int perc, unsigned
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used) / (double)NSEC));
 }
 
-static void do_test_fr_pair_find_by_da_idx(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+static void find_by_da_idx(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[],
+			   bool indexed)
 {
 	fr_pair_list_t		test_vps;
 	unsigned int		i, j;
@@ -346,8 +347,10 @@ static void do_test_fr_pair_find_by_da_idx(unsigned int len, unsigned int perc,
 	fr_time_delta_t		used = fr_time_delta_wrap(0);
 	fr_dict_attr_t const	*da;
 	size_t			input_count = talloc_array_length(source_vps);
+	TALLOC_CTX		*index_ctx = talloc_new(autofree);
 
 	fr_pair_list_init(&test_vps);
+	if (indexed) TEST_CHECK(fr_pair_list_index_alloc(index_ctx, &test_vps) == 0);
 	if (input_count > len) input_count = len;
 
 	/*
@@ -373,14 +376,27 @@ static void do_test_fr_pair_find_by_da_idx(unsigned int len, unsigned int perc,
 		}
 	}
 	fr_pair_list_free(&test_vps);
+	talloc_free(index_ctx);
 	TEST_MSG_ALWAYS("repetitions=%d", reps);
 	TEST_MSG_ALWAYS("perc_rep=%d", perc);
 	TEST_MSG_ALWAYS("list_length=%d", len);
+	TEST_MSG_ALWAYS("indexed=%s", indexed ? "yes" : "no");
 	TEST_MSG_ALWAYS("used=%"PRId64, fr_time_delta_unwrap(used));
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used) / (double)NSEC));
 }
 
-static void do_test_find_nth(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+static void do_test_fr_pair_find_by_da_idx(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+{
+	find_by_da_idx(len, perc, reps, source_vps, false);
+}
+
+static void do_test_fr_pair_find_by_da_idx_indexed(unsigned int len, unsigned int perc, unsigned int reps,
+						   fr_pair_t *source_vps[])
+{
+	find_by_da_idx(len, perc, reps, source_vps, true);
+}
+
+static void find_nth(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[], bool indexed)
 {
 	fr_pair_list_t	  	test_vps;
 	unsigned int		i, j, nth_item;
@@ -389,8 +405,10 @@ static void do_test_find_nth(unsigned int len, unsigned int perc, unsigned int r
 	fr_time_delta_t		used = fr_time_delta_wrap(0);
 	fr_dict_attr_t const	*da;
 	size_t			input_count = talloc_array_length(source_vps);
+	TALLOC_CTX		*index_ctx = talloc_new(autofree);
 
 	fr_pair_list_init(&test_vps);
+	if (indexed) TEST_CHECK(fr_pair_list_index_alloc(index_ctx, &test_vps) == 0);
 	if (input_count > len) input_count = len;
 
 	/*
@@ -419,13 +437,84 @@ static void do_test_find_nth(unsigned int len, unsigned int perc, unsigned int r
 		}
 	}
 	fr_pair_list_free(&test_vps);
+	talloc_free(index_ctx);
 	TEST_MSG_ALWAYS("repetitions=%d", reps);
 	TEST_MSG_ALWAYS("perc_rep=%d", perc);
 	TEST_MSG_ALWAYS("list_length=%d", len);
+	TEST_MSG_ALWAYS("indexed=%s", indexed ? "yes" : "no");
 	TEST_MSG_ALWAYS("used=%"PRId64, fr_time_delta_unwrap(used));
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used) / (double)NSEC));
 }
 
+static void do_test_find_nth(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+{
+	find_nth(len, perc, reps, source_vps, false);
+}
+
+static void do_test_find_nth_indexed(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+{
+	find_nth(len, perc, reps, source_vps, true);
+}
+
+/** Time lookups of the first instance of an attribute in a list
+ *
+ */
+static fr_time_delta_t find_first_time(unsigned int len, unsigned int reps, fr_pair_t *source_vps[], bool indexed)
+{
+	fr_pair_list_t		test_vps;
+	unsigned int		i, j;
+	fr_time_t		start, end;
+	fr_time_delta_t		used = fr_time_delta_wrap(0);
+	size_t			input_count = talloc_array_length(source_vps);
+	TALLOC_CTX		*index_ctx = talloc_new(autofree);
+
+	fr_pair_list_init(&test_vps);
+	if (indexed) TEST_CHECK(fr_pair_list_index_alloc(index_ctx, &test_vps) == 0);
+	if (input_count > len) input_count = len;
+
+	for (i = 0; i < len; i++) fr_pair_append(&test_vps, fr_pair_copy(autofree, source_vps[i % input_count]));
+
+	for (i = 0; i < reps; i++) {
+		for (j = 0; j < len; j++) {
+			fr_dict_attr_t const *da = source_vps[rand() % input_count]->da;
+
+			start = fr_time();
+			(void) fr_pair_find_by_da_idx(&test_vps, da, 0);
+			end = fr_time();
+			used = fr_time_delta_add(used, fr_time_sub(end, start));
+		}
+	}
+	fr_pair_list_free(&test_vps);
+	talloc_free(index_ctx);
+
+	return used;
+}
+
+/** Compare walking the list with using the index, to find where the index starts to win
+ *
+ * #FR_PAIR_LIST_INDEX_MIN should be around the length where indexed
+ * lookups become faster.  Uses lists without duplicates, as that's
+ * the worst case for linear searches.
+ */
+static void test_find_crossover(void)
+{
+	static unsigned int const	lengths[] = { 4, 8, 12, 16, 24, 32, 48, 64, 96 };
+	unsigned int			reps = 10000;
+	size_t				i;
+
+	for (i = 0; i < NUM_ELEMENTS(lengths); i++) {
+		fr_time_delta_t	linear, indexed;
+		unsigned int	len = lengths[i];
+
+		linear = find_first_time(len, reps, source_vps_0, false);
+		indexed = find_first_time(len, reps, source_vps_0, true);
+
+		TEST_MSG_ALWAYS("list_length=%u linear_per_sec=%0.0lf indexed_per_sec=%0.0lf", len,
+				(reps * len) / (fr_time_delta_unwrap(linear) / (double)NSEC),
+				(reps * len) / (fr_time_delta_unwrap(indexed) / (double)NSEC));
+	}
+}
+
 static void do_test_fr_pair_list_free(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
 {
 	fr_pair_list_t  test_vps;
@@ -480,6 +569,8 @@ static void test_ ## _func ## _ ## _count ## _ ## _perc(void)\
 all_test_funcs(fr_pair_append)
 all_test_funcs(fr_pair_find_by_da_idx)
 all_test_funcs(find_nth)
+all_test_funcs(fr_pair_find_by_da_idx_indexed)
+all_test_funcs(find_nth_indexed)
 all_test_funcs(fr_pair_list_free)
 
 #define repetition_tests(_func, _perc) \
@@ -500,6 +591,9 @@ TEST_LIST = {
 	all_repetition_tests(fr_pair_append)
 	all_repetition_tests(fr_pair_find_by_da_idx)
 	all_repetition_tests(find_nth)
+	all_repetition_tests(fr_pair_find_by_da_idx_indexed)
+	all_repetition_tests(find_nth_indexed)
+	{ "find_crossover", test_find_crossover },
 	all_repetition_tests(fr_pair_list_free)
 
 	{ NULL }
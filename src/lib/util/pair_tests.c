@@ -244,6 +244,75 @@ static void test_fr_pair_find_by_da_idx(void)
 	TEST_CHECK(vp && vp->da == fr_dict_attr_test_tlv_string);
 }
 
+static void test_fr_pair_list_index(void)
+{
+	TALLOC_CTX		*ctx = talloc_new(autofree);
+	fr_pair_list_t		list;
+	fr_pair_t		*vp, *first = NULL, *last = NULL;
+	fr_dcursor_t		cursor;
+	unsigned int		i;
+
+	fr_pair_list_init(&list);
+	TEST_CHECK(fr_pair_list_index_alloc(ctx, &list) == 0);
+
+	/*
+	 *	Alternate uint32 and string, so there's enough to
+	 *	build the index.
+	 */
+	for (i = 0; i < (FR_PAIR_LIST_INDEX_MIN * 2); i++) {
+		vp = fr_pair_afrom_da(ctx, (i & 0x01) ? fr_dict_attr_test_string : fr_dict_attr_test_uint32);
+		if (!vp) break;
+		if (i & 0x01) {
+			fr_pair_value_strdup(vp, "hello", false);
+		} else {
+			vp->vp_uint32 = i;
+		}
+		fr_pair_append(&list, vp);
+		if (!first) first = vp;
+	}
+
+	TEST_CASE("Indexed lookups match the list contents");
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_uint32) == FR_PAIR_LIST_INDEX_MIN);
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_octets) == 0);
+	TEST_CHECK(fr_pair_find_by_da_idx(&list, fr_dict_attr_test_uint32, 0) == first);
+	TEST_CHECK((vp = fr_pair_find_by_da_idx(&list, fr_dict_attr_test_uint32, 3)) != NULL);
+	TEST_CHECK(vp && (vp->vp_uint32 == 6));
+	TEST_CHECK(fr_pair_find_by_da_idx(&list, fr_dict_attr_test_uint32, FR_PAIR_LIST_INDEX_MIN) == NULL);
+	TEST_CHECK(fr_pair_find_by_da(&list, NULL, fr_dict_attr_test_octets) == NULL);
+
+	TEST_CASE("Appending and prepending updates the index");
+	MEM(last = fr_pair_afrom_da(ctx, fr_dict_attr_test_uint32));
+	fr_pair_append(&list, last);
+	MEM(vp = fr_pair_afrom_da(ctx, fr_dict_attr_test_octets));
+	fr_pair_prepend(&list, vp);
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_uint32) == FR_PAIR_LIST_INDEX_MIN + 1);
+	TEST_CHECK(fr_pair_find_by_da_idx(&list, fr_dict_attr_test_uint32, FR_PAIR_LIST_INDEX_MIN) == last);
+	TEST_CHECK(fr_pair_find_by_da(&list, NULL, fr_dict_attr_test_octets) == vp);
+	TEST_CHECK(fr_pair_find_by_da(&list, last, fr_dict_attr_test_uint32) == NULL);
+
+	TEST_CASE("Removing the first and last instance updates the index");
+	fr_pair_delete(&list, first);
+	fr_pair_delete(&list, last);
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_uint32) == FR_PAIR_LIST_INDEX_MIN - 1);
+	TEST_CHECK((vp = fr_pair_find_by_da_idx(&list, fr_dict_attr_test_uint32, 0)) != NULL);
+	TEST_CHECK(vp && (vp->vp_uint32 == 2));
+
+	TEST_CASE("Removing pairs with a cursor invalidates the index");
+	for (vp = fr_pair_dcursor_by_da_init(&cursor, &list, fr_dict_attr_test_string);
+	     vp;
+	     vp = fr_dcursor_current(&cursor)) talloc_free(fr_dcursor_remove(&cursor));
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_string) == 0);
+	TEST_CHECK(fr_pair_find_by_da_idx(&list, fr_dict_attr_test_string, 0) == NULL);
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_uint32) == FR_PAIR_LIST_INDEX_MIN - 1);
+
+	TEST_CASE("Freeing the list empties the index");
+	fr_pair_list_free(&list);
+	TEST_CHECK(fr_pair_count_by_da(&list, fr_dict_attr_test_uint32) == 0);
+	TEST_CHECK(fr_pair_find_by_da(&list, NULL, fr_dict_attr_test_uint32) == NULL);
+
+	talloc_free(ctx);
+}
+
 static void test_fr_pair_find_by_child_num_idx(void)
 {
 	fr_pair_t *vp;
@@ -1136,6 +1205,7 @@ TEST_LIST = {
 	{ "fr_pair_to_unknown",                   test_fr_pair_to_unknown },
 	{ "fr_pair_find_by_da_idx",                   test_fr_pair_find_by_da_idx },
 	{ "fr_pair_find_by_child_num_idx",            test_fr_pair_find_by_child_num_idx },
+	{ "fr_pair_list_index",                   test_fr_pair_list_index },
 	{ "fr_pair_append",                       test_fr_pair_append },
 	{ "fr_pair_prepend_by_da",                test_fr_pair_prepend_by_da },
 	{ "fr_pair_delete_by_child_num",          test_fr_pair_delete_by_child_num },
@@ -0,0 +1,481 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Functions for a hierarchical timer wheel
+ *
+ * @file src/lib/util/timer_wheel.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/timer_wheel.h>
+
+/*
+ *	Hierarchical timer wheels are described in "Hashed and
+ *	Hierarchical Timing Wheels: Data Structures for the Efficient
+ *	Implementation of a Timer Facility" (George Varghese and
+ *	Tony Lauck), SOSP 1987.
+ *
+ *	Time is divided into ticks of a fixed resolution.  Each level
+ *	of the wheel has 64 slots, and each slot in level n covers 64^n
+ *	ticks.  An element is placed in the lowest level where its
+ *	expiry tick only differs from the current tick in that level's
+ *	digit, so insertion and extraction are O(1), and don't need to
+ *	compare elements.
+ *
+ *	As the current tick advances past the start of a slot in a
+ *	higher level, the slot's elements are re-inserted, and move
+ *	down to a lower level.  Elements which are too far in the
+ *	future for the highest level are kept in an overflow list,
+ *	which is re-inserted every time the highest level wraps.
+ *
+ *	Each level has a bitmap of occupied slots, which allows us to
+ *	skip over empty slots, and to work out when the next element
+ *	will expire, without walking the slots.
+ *
+ *	Elements expire at the end of the tick containing their expiry
+ *	time, and elements which expire in the same tick are returned
+ *	in the order they were moved onto the expired list, rather than
+ *	strictly by time.
+ */
+#define WHEEL_BITS	(6)
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	(6)
+
+struct fr_timer_wheel_s {
+	char const		*type;				//!< Talloc type of elements.
+	size_t			offset;				//!< Offset of the fr_timer_wheel_entry_t in elements.
+	int64_t			resolution;			//!< Length of a tick in nanoseconds.
+
+	uint64_t		now;				//!< Next tick to process.
+	unsigned int		num_elements;			//!< Elements in all lists.
+
+	uint64_t		occupied[WHEEL_LEVELS];		//!< Bitmap of non-empty slots, per level.
+	fr_dlist_head_t		slot[WHEEL_LEVELS][WHEEL_SLOTS];
+
+	fr_dlist_head_t		overflow;			//!< Elements beyond the range of the highest level.
+	fr_dlist_head_t		expired;			//!< Elements which are ready to be popped.
+};
+
+#define wheel_entry(_tw, _data)	((fr_timer_wheel_entry_t *)(((uint8_t *)(_data)) + (_tw)->offset))
+
+/** Convert a time to the tick it expires on
+ *
+ */
+static inline CC_HINT(always_inline) uint64_t wheel_tick_ceil(fr_timer_wheel_t const *tw, fr_time_t when)
+{
+	int64_t ns = fr_time_unwrap(when);
+
+	if (ns <= 0) return 0;
+
+	return ((uint64_t)ns / tw->resolution) + (((uint64_t)ns % tw->resolution) != 0);
+}
+
+/** Convert a time to the tick containing it
+ *
+ */
+static inline CC_HINT(always_inline) uint64_t wheel_tick_floor(fr_timer_wheel_t const *tw, fr_time_t when)
+{
+	int64_t ns = fr_time_unwrap(when);
+
+	if (ns <= 0) return 0;
+
+	return (uint64_t)ns / tw->resolution;
+}
+
+static inline CC_HINT(always_inline) fr_time_t wheel_tick_to_time(fr_timer_wheel_t const *tw, uint64_t tick)
+{
+	if (tick > (uint64_t)(INT64_MAX / tw->resolution)) return fr_time_max();
+
+	return fr_time_wrap((int64_t)tick * tw->resolution);
+}
+
+/** Add an element to the list appropriate for its expiry tick
+ *
+ */
+static inline CC_HINT(always_inline) void wheel_add(fr_timer_wheel_t *tw, void *data, fr_timer_wheel_entry_t *entry)
+{
+	fr_dlist_head_t	*list;
+	uint64_t	diff;
+	unsigned int	level, idx;
+
+	if (entry->tick < tw->now) {
+		list = &tw->expired;
+		goto done;
+	}
+
+	/*
+	 *	The highest digit which differs between the
+	 *	expiry tick and the current tick determines
+	 *	the level.
+	 */
+	diff = entry->tick ^ tw->now;
+	level = diff ? ((63 - __builtin_clzll(diff)) / WHEEL_BITS) : 0;
+	if (level >= WHEEL_LEVELS) {
+		list = &tw->overflow;
+		goto done;
+	}
+
+	idx = (entry->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	list = &tw->slot[level][idx];
+	tw->occupied[level] |= ((uint64_t)1 << idx);
+
+done:
+	entry->slot = list;
+	fr_dlist_insert_tail(list, data);
+}
+
+/** Re-insert all the elements in a list
+ *
+ */
+static void wheel_cascade_list(fr_timer_wheel_t *tw, fr_dlist_head_t *list)
+{
+	fr_dlist_head_t	tmp;
+	void		*data;
+
+	if (fr_dlist_empty(list)) return;
+
+	/*
+	 *	Elements may be re-inserted into the list
+	 *	they came from, so move them out first.
+	 */
+	_fr_dlist_init(&tmp, list->offset, list->type);
+	fr_dlist_move(&tmp, list);
+
+	while ((data = fr_dlist_pop_head(&tmp))) wheel_add(tw, data, wheel_entry(tw, data));
+}
+
+/** Move elements from higher levels down, as the current tick reaches the start of their slots
+ *
+ * Called when the current tick is at the start of a level 0 rotation.
+ */
+static void wheel_cascade(fr_timer_wheel_t *tw)
+{
+	unsigned int level, idx;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		idx = (tw->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+		if (tw->occupied[level] & ((uint64_t)1 << idx)) {
+			tw->occupied[level] &= ~((uint64_t)1 << idx);
+			wheel_cascade_list(tw, &tw->slot[level][idx]);
+		}
+
+		if (idx != 0) return;
+	}
+
+	wheel_cascade_list(tw, &tw->overflow);
+}
+
+/** Return the start of the first occupied slot, or when the overflow list next needs re-inserting
+ *
+ * @return
+ *	- The tick.
+ *	- UINT64_MAX if there are no elements in the slots or the overflow list.
+ */
+static uint64_t wheel_next_tick(fr_timer_wheel_t const *tw)
+{
+	uint64_t	next = UINT64_MAX;
+	unsigned int	level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int	shift = WHEEL_BITS * level;
+		unsigned int	digit = (tw->now >> shift) & WHEEL_MASK;
+		uint64_t	bits = tw->occupied[level] >> digit;
+		uint64_t	tick;
+
+		if (!bits) continue;
+
+		/*
+		 *	Start of the first occupied slot at this level.
+		 */
+		tick = ((tw->now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS)) |
+		       ((uint64_t)(digit + __builtin_ctzll(bits)) << shift);
+		if (tick < tw->now) tick = tw->now;
+		if (tick < next) next = tick;
+	}
+
+	if ((next == UINT64_MAX) && !fr_dlist_empty(&tw->overflow)) {
+		next = ((tw->now >> (WHEEL_BITS * WHEEL_LEVELS)) + 1) << (WHEEL_BITS * WHEEL_LEVELS);
+	}
+
+	return next;
+}
+
+/** Move the contents of every slot up to and including tick to the expired list
+ *
+ */
+static void wheel_advance(fr_timer_wheel_t *tw, uint64_t tick)
+{
+	while (tw->now <= tick) {
+		unsigned int	idx = tw->now & WHEEL_MASK;
+		uint64_t	bits;
+		void		*data;
+
+		if (idx == 0) wheel_cascade(tw);
+
+		/*
+		 *	Skip empty slots.  If there's nothing left
+		 *	in this rotation, jump straight to the next
+		 *	slot which has elements, which is always at
+		 *	the start of a rotation.
+		 */
+		bits = tw->occupied[0] >> idx;
+		if (!bits) {
+			uint64_t next = wheel_next_tick(tw);
+
+			if (next <= tw->now) next = (tw->now | WHEEL_MASK) + 1;
+			tw->now = (next > tick) ? tick + 1 : next;
+			continue;
+		}
+
+		idx += __builtin_ctzll(bits);
+		if (((tw->now & ~((uint64_t)WHEEL_MASK)) | idx) > tick) {
+			tw->now = tick + 1;
+			break;
+		}
+
+		tw->occupied[0] &= ~((uint64_t)1 << idx);
+		while ((data = fr_dlist_pop_head(&tw->slot[0][idx]))) {
+			wheel_entry(tw, data)->slot = &tw->expired;
+			fr_dlist_insert_tail(&tw->expired, data);
+		}
+		tw->now = (tw->now & ~((uint64_t)WHEEL_MASK)) + idx + 1;
+	}
+}
+
+/** Allocate a new timer wheel
+ *
+ * @param[in] ctx		Talloc ctx to allocate the wheel in.
+ * @param[in] type		Talloc type of elements.  May be NULL.
+ * @param[in] offset		Of the #fr_timer_wheel_entry_t in elements.
+ * @param[in] resolution	Length of a tick.
+ * @param[in] now		The current time.
+ * @return
+ *	- A new timer wheel.
+ *	- NULL on error.
+ */
+fr_timer_wheel_t *_fr_timer_wheel_alloc(TALLOC_CTX *ctx, char const *type, size_t offset,
+					fr_time_delta_t resolution, fr_time_t now)
+{
+	fr_timer_wheel_t	*tw;
+	size_t			list_offset = offset + offsetof(fr_timer_wheel_entry_t, entry);
+	unsigned int		i, j;
+
+	if (fr_time_delta_unwrap(resolution) <= 0) {
+		fr_strerror_const("Timer wheel resolution must be greater than zero");
+		return NULL;
+	}
+
+	tw = talloc_zero(ctx, fr_timer_wheel_t);
+	if (!tw) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	tw->type = type;
+	tw->offset = offset;
+	tw->resolution = fr_time_delta_unwrap(resolution);
+	tw->now = wheel_tick_floor(tw, now);
+
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		for (j = 0; j < WHEEL_SLOTS; j++) _fr_dlist_init(&tw->slot[i][j], list_offset, type);
+	}
+	_fr_dlist_init(&tw->overflow, list_offset, type);
+	_fr_dlist_init(&tw->expired, list_offset, type);
+
+	return tw;
+}
+
+/** Insert an element into a timer wheel
+ *
+ * @param[in] tw	to insert the element into.
+ * @param[in] data	element to insert.  Must not already be in a timer wheel.
+ * @param[in] when	the element expires.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the element is already inserted.
+ */
+int fr_timer_wheel_insert(fr_timer_wheel_t *tw, void *data, fr_time_t when)
+{
+	fr_timer_wheel_entry_t *entry = wheel_entry(tw, data);
+
+#ifndef TALLOC_GET_TYPE_ABORT_NOOP
+	if (tw->type) (void)_talloc_get_type_abort(data, tw->type, __location__);
+#endif
+
+	if (unlikely(entry->slot != NULL)) {
+		fr_strerror_const("Element is already in a timer wheel");
+		return -1;
+	}
+
+	entry->tick = wheel_tick_ceil(tw, when);
+	wheel_add(tw, data, entry);
+	tw->num_elements++;
+
+	return 0;
+}
+
+/** Remove an element from a timer wheel
+ *
+ * @param[in] tw	to remove the element from.
+ * @param[in] data	element to remove.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the element wasn't inserted.
+ */
+int fr_timer_wheel_extract(fr_timer_wheel_t *tw, void *data)
+{
+	fr_timer_wheel_entry_t	*entry = wheel_entry(tw, data);
+	fr_dlist_head_t		*list = entry->slot;
+
+	if (unlikely(!list)) {
+		fr_strerror_const("Tried to extract element not in timer wheel");
+		return -1;
+	}
+
+	fr_dlist_remove(list, data);
+	entry->slot = NULL;
+	tw->num_elements--;
+
+	/*
+	 *	Keep the occupied bitmaps up to date.
+	 */
+	if (fr_dlist_empty(list) &&
+	    (list >= &tw->slot[0][0]) && (list <= &tw->slot[WHEEL_LEVELS - 1][WHEEL_MASK])) {
+		size_t idx = list - &tw->slot[0][0];
+
+		tw->occupied[idx / WHEEL_SLOTS] &= ~((uint64_t)1 << (idx % WHEEL_SLOTS));
+	}
+
+	return 0;
+}
+
+/** Remove and return an expired element
+ *
+ * @param[in] tw	to pop the element from.
+ * @param[in] now	The current time.
+ * @return
+ *	- An element which expired at or before now.
+ *	- NULL if no elements have expired.
+ */
+void *fr_timer_wheel_pop(fr_timer_wheel_t *tw, fr_time_t now)
+{
+	void *data;
+
+	if (fr_dlist_empty(&tw->expired)) {
+		if (!tw->num_elements) return NULL;
+
+		wheel_advance(tw, wheel_tick_floor(tw, now));
+	}
+
+	data = fr_dlist_pop_head(&tw->expired);
+	if (!data) return NULL;
+
+	wheel_entry(tw, data)->slot = NULL;
+	tw->num_elements--;
+
+	return data;
+}
+
+/** Return when the wheel next needs servicing
+ *
+ * This may be earlier than when the first element expires, as
+ * elements in higher levels need to be moved down.
+ *
+ * @param[in] tw	to check.
+ * @param[out] when	fr_timer_wheel_pop() should next be called.
+ * @return
+ *	- true if there are elements in the wheel.
+ *	- false if the wheel is empty.
+ */
+bool fr_timer_wheel_next(fr_timer_wheel_t *tw, fr_time_t *when)
+{
+	if (!tw->num_elements) return false;
+
+	if (!fr_dlist_empty(&tw->expired)) {
+		*when = wheel_tick_to_time(tw, tw->now ? tw->now - 1 : 0);
+		return true;
+	}
+
+	*when = wheel_tick_to_time(tw, wheel_next_tick(tw));
+
+	return true;
+}
+
+/** Return the number of elements in a timer wheel
+ *
+ */
+unsigned int fr_timer_wheel_num_elements(fr_timer_wheel_t *tw)
+{
+	return tw->num_elements;
+}
+
+/** Return the list at a given iterator position
+ *
+ */
+static inline CC_HINT(always_inline) fr_dlist_head_t *wheel_iter_list(fr_timer_wheel_t *tw, unsigned int list)
+{
+	if (list == 0) return &tw->expired;
+	if (list == 1) return &tw->overflow;
+
+	list -= 2;
+	if (list >= (WHEEL_LEVELS * WHEEL_SLOTS)) return NULL;
+
+	return &tw->slot[list / WHEEL_SLOTS][list % WHEEL_SLOTS];
+}
+
+/** Iterate over the elements in a timer wheel, in no particular order
+ *
+ * @note The wheel must not be modified during iteration.
+ *
+ * @param[in] tw	to iterate over.
+ * @param[in] iter	State of the iteration.
+ * @return
+ *	- The first element.
+ *	- NULL if the wheel is empty.
+ */
+void *fr_timer_wheel_iter_init(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter)
+{
+	*iter = (fr_timer_wheel_iter_t){ .list = 0, .item = NULL };
+
+	return fr_timer_wheel_iter_next(tw, iter);
+}
+
+/** Return the next element in a timer wheel
+ *
+ * @param[in] tw	to iterate over.
+ * @param[in] iter	State of the iteration.
+ * @return
+ *	- The next element.
+ *	- NULL if there are no more elements.
+ */
+void *fr_timer_wheel_iter_next(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter)
+{
+	fr_dlist_head_t *list;
+
+	while ((list = wheel_iter_list(tw, iter->list))) {
+		iter->item = fr_dlist_next(list, iter->item);
+		if (iter->item) return iter->item;
+
+		iter->list++;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,117 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Structures and prototypes for hierarchical timer wheels
+ *
+ * @file src/lib/util/timer_wheel.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(timer_wheel_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdint.h>
+
+typedef struct fr_timer_wheel_s fr_timer_wheel_t;
+
+/** Embedded in every element inserted into a timer wheel
+ *
+ * The type passed to fr_timer_wheel_alloc() and fr_timer_wheel_talloc_alloc() in _type
+ * must be the type of a structure with a member of type fr_timer_wheel_entry_t.
+ * That member's name must be passed as the _field argument.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in a slot.
+	fr_dlist_head_t		*slot;		//!< Slot the element is in.  NULL if not inserted.
+	uint64_t		tick;		//!< Tick the element expires on.
+} fr_timer_wheel_entry_t;
+
+/** Iterator state
+ *
+ */
+typedef struct {
+	unsigned int		list;		//!< Current list.
+	void			*item;		//!< Current item.
+} fr_timer_wheel_iter_t;
+
+/** Creates a timer wheel that can be used with non-talloced elements
+ *
+ * @param[in] _ctx		Talloc ctx to allocate the wheel in.
+ * @param[in] _type		Of elements.
+ * @param[in] _field		to store wheel state in.
+ * @param[in] _resolution	Length of a tick.  Elements expire at the end
+ *				of the tick containing their expiry time.
+ * @param[in] _now		The current time.
+ * @return
+ *	- A pointer to the new timer wheel.
+ *	- NULL on error.
+ */
+#define fr_timer_wheel_alloc(_ctx, _type, _field, _resolution, _now) \
+	_fr_timer_wheel_alloc(_ctx, NULL, (size_t)offsetof(_type, _field), _resolution, _now)
+
+/** Creates a timer wheel that verifies elements are of a specific talloc type
+ *
+ * @param[in] _ctx		Talloc ctx to allocate the wheel in.
+ * @param[in] _talloc_type	of elements.
+ * @param[in] _field		to store wheel state in.
+ * @param[in] _resolution	Length of a tick.  Elements expire at the end
+ *				of the tick containing their expiry time.
+ * @param[in] _now		The current time.
+ * @return
+ *	- A pointer to the new timer wheel.
+ *	- NULL on error.
+ */
+#define fr_timer_wheel_talloc_alloc(_ctx, _talloc_type, _field, _resolution, _now) \
+	_fr_timer_wheel_alloc(_ctx, #_talloc_type, (size_t)offsetof(_talloc_type, _field), _resolution, _now)
+
+fr_timer_wheel_t *_fr_timer_wheel_alloc(TALLOC_CTX *ctx, char const *type, size_t offset,
+					fr_time_delta_t resolution, fr_time_t now);
+
+/** Check if an entry is inserted into a timer wheel
+ *
+ * @param[in] entry	as stored in an element.
+ */
+static inline bool fr_timer_wheel_entry_inserted(fr_timer_wheel_entry_t const *entry)
+{
+	return (entry->slot != NULL);
+}
+
+int		fr_timer_wheel_insert(fr_timer_wheel_t *tw, void *data, fr_time_t when) CC_HINT(nonnull);
+
+int		fr_timer_wheel_extract(fr_timer_wheel_t *tw, void *data) CC_HINT(nonnull);
+
+void		*fr_timer_wheel_pop(fr_timer_wheel_t *tw, fr_time_t now) CC_HINT(nonnull);
+
+bool		fr_timer_wheel_next(fr_timer_wheel_t *tw, fr_time_t *when) CC_HINT(nonnull);
+
+unsigned int	fr_timer_wheel_num_elements(fr_timer_wheel_t *tw) CC_HINT(nonnull);
+
+void		*fr_timer_wheel_iter_init(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter) CC_HINT(nonnull);
+
+void		*fr_timer_wheel_iter_next(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,338 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for hierarchical timer wheels
+ *
+ * @file src/lib/util/timer_wheel_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/lst.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/timer_wheel.h>
+
+#define NUM_TIMERS	(10000)
+#define NUM_CHURN	(1000000)
+
+#define RESOLUTION	fr_time_delta_from_msec(1)
+
+typedef struct {
+	fr_time_t		when;
+	fr_timer_wheel_entry_t	entry;
+	fr_lst_index_t		idx;
+	bool			fired;
+} wheel_thing;
+
+static int8_t wheel_thing_cmp(void const *one, void const *two)
+{
+	wheel_thing const *a = one, *b = two;
+
+	return fr_time_cmp(a->when, b->when);
+}
+
+/** Pop everything which has expired, checking nothing fires early, or unreasonably late
+ *
+ * Timers fire at the end of the tick containing their expiry time, and
+ * the callers below may advance the clock by up to a tick between pops.
+ */
+static unsigned int pop_expired(fr_timer_wheel_t *tw, fr_time_t now)
+{
+	wheel_thing	*t;
+	unsigned int	count = 0;
+
+	while ((t = fr_timer_wheel_pop(tw, now))) {
+		TEST_CHECK(!t->fired);
+		TEST_CHECK(fr_time_lteq(t->when, now));
+		TEST_MSG("timer for %" PRId64 " fired early at %" PRId64,
+			 fr_time_unwrap(t->when), fr_time_unwrap(now));
+		TEST_CHECK(fr_time_gt(fr_time_add(t->when, fr_time_delta_wrap(2 * fr_time_delta_unwrap(RESOLUTION))), now));
+		TEST_MSG("timer for %" PRId64 " fired late at %" PRId64,
+			 fr_time_unwrap(t->when), fr_time_unwrap(now));
+		t->fired = true;
+		count++;
+	}
+
+	return count;
+}
+
+static void timer_wheel_basic(void)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		*things;
+	fr_time_t		now = fr_time_wrap(0), when;
+	unsigned int		i, fired = 0;
+
+	tw = fr_timer_wheel_alloc(NULL, wheel_thing, entry, RESOLUTION, now);
+	TEST_CHECK(tw != NULL);
+
+	TEST_CHECK(fr_timer_wheel_pop(tw, now) == NULL);
+	TEST_CHECK(!fr_timer_wheel_next(tw, &when));
+
+	things = talloc_zero_array(tw, wheel_thing, NUM_TIMERS);
+
+	/*
+	 *	Spread the timers over 10 seconds, so they use
+	 *	the first three levels.
+	 */
+	for (i = 0; i < NUM_TIMERS; i++) {
+		things[i].when = fr_time_add(now, fr_time_delta_wrap(fr_rand() % fr_time_delta_unwrap(fr_time_delta_from_sec(10))));
+		TEST_CHECK(fr_timer_wheel_insert(tw, &things[i], things[i].when) == 0);
+	}
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == NUM_TIMERS);
+
+	TEST_CASE("Inserting twice fails");
+	TEST_CHECK(fr_timer_wheel_insert(tw, &things[0], things[0].when) < 0);
+
+	while (fr_timer_wheel_next(tw, &when)) {
+		TEST_CHECK(fr_time_gteq(when, now));
+
+		/*
+		 *	Advance by a random fraction of a tick,
+		 *	so we don't only pop on tick boundaries.
+		 */
+		now = fr_time_add(now, fr_time_delta_wrap(fr_rand() % fr_time_delta_unwrap(RESOLUTION)));
+		fired += pop_expired(tw, now);
+	}
+
+	TEST_CHECK(fired == NUM_TIMERS);
+	TEST_MSG("expected %u timers to fire, %u did", NUM_TIMERS, fired);
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == 0);
+
+	talloc_free(tw);
+}
+
+static void timer_wheel_extract(void)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		*things;
+	fr_time_t		now = fr_time_add(fr_time_wrap(0), fr_time_delta_from_sec(1000)), when;
+	unsigned int		i, fired = 0;
+
+	tw = fr_timer_wheel_alloc(NULL, wheel_thing, entry, RESOLUTION, now);
+	TEST_CHECK(tw != NULL);
+
+	things = talloc_zero_array(tw, wheel_thing, NUM_TIMERS);
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		things[i].when = fr_time_add(now, fr_time_delta_from_msec(fr_rand() % 100000));
+		TEST_CHECK(fr_timer_wheel_insert(tw, &things[i], things[i].when) == 0);
+	}
+
+	for (i = 0; i < NUM_TIMERS; i += 2) {
+		TEST_CHECK(fr_timer_wheel_extract(tw, &things[i]) == 0);
+		TEST_CHECK(!fr_timer_wheel_entry_inserted(&things[i].entry));
+		things[i].fired = true;		/* Must not be returned */
+	}
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == NUM_TIMERS / 2);
+
+	TEST_CASE("Extracting twice fails");
+	TEST_CHECK(fr_timer_wheel_extract(tw, &things[0]) < 0);
+
+	/*
+	 *	Jump straight to when the wheel needs servicing.
+	 */
+	while (fr_timer_wheel_next(tw, &when)) {
+		if (fr_time_lt(now, when)) now = when;
+		fired += pop_expired(tw, now);
+	}
+
+	TEST_CHECK(fired == NUM_TIMERS / 2);
+	TEST_MSG("expected %u timers to fire, %u did", NUM_TIMERS / 2, fired);
+
+	talloc_free(tw);
+}
+
+/** Check timers in the past, and timers beyond the range of the highest level
+ *
+ */
+static void timer_wheel_range(void)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		past = {}, near = {}, far = {}, farther = {};
+	fr_time_t		now = fr_time_add(fr_time_wrap(0), fr_time_delta_from_sec(1000)), when;
+
+	tw = fr_timer_wheel_alloc(NULL, wheel_thing, entry, fr_time_delta_wrap(1), now);
+	TEST_CHECK(tw != NULL);
+
+	past.when = fr_time_sub(now, fr_time_delta_from_sec(1));
+	near.when = fr_time_add(now, fr_time_delta_wrap(1));
+	far.when = fr_time_add(now, fr_time_delta_from_sec(3600));
+	farther.when = fr_time_add(now, fr_time_delta_from_sec(86400 * 365));
+
+	TEST_CHECK(fr_timer_wheel_insert(tw, &farther, farther.when) == 0);
+	TEST_CHECK(fr_timer_wheel_insert(tw, &far, far.when) == 0);
+	TEST_CHECK(fr_timer_wheel_insert(tw, &near, near.when) == 0);
+	TEST_CHECK(fr_timer_wheel_insert(tw, &past, past.when) == 0);
+
+	TEST_CASE("Timers in the past expire immediately");
+	TEST_CHECK(fr_timer_wheel_pop(tw, now) == &past);
+	TEST_CHECK(fr_timer_wheel_pop(tw, now) == NULL);
+
+	TEST_CASE("Timers expire in order across levels");
+	TEST_CHECK(fr_timer_wheel_pop(tw, near.when) == &near);
+
+	TEST_CHECK(fr_timer_wheel_pop(tw, fr_time_sub(far.when, fr_time_delta_wrap(1))) == NULL);
+	TEST_CHECK(fr_timer_wheel_next(tw, &when));
+	TEST_CHECK(fr_time_lteq(when, far.when));
+	TEST_CHECK(fr_timer_wheel_pop(tw, far.when) == &far);
+
+	TEST_CHECK(fr_timer_wheel_pop(tw, fr_time_sub(farther.when, fr_time_delta_wrap(1))) == NULL);
+	TEST_CHECK(fr_timer_wheel_pop(tw, farther.when) == &farther);
+
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == 0);
+	TEST_CHECK(!fr_timer_wheel_next(tw, &when));
+
+	talloc_free(tw);
+}
+
+static void timer_wheel_iter(void)
+{
+	fr_timer_wheel_t	*tw;
+	fr_timer_wheel_iter_t	iter;
+	wheel_thing		*things, *t;
+	fr_time_t		now = fr_time_wrap(0);
+	unsigned int		i, count = 0;
+
+	tw = fr_timer_wheel_alloc(NULL, wheel_thing, entry, RESOLUTION, now);
+	TEST_CHECK(tw != NULL);
+
+	things = talloc_zero_array(tw, wheel_thing, NUM_TIMERS);
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		things[i].when = fr_time_add(now, fr_time_delta_from_sec(fr_rand() % 100000));
+		TEST_CHECK(fr_timer_wheel_insert(tw, &things[i], things[i].when) == 0);
+	}
+
+	for (t = fr_timer_wheel_iter_init(tw, &iter); t; t = fr_timer_wheel_iter_next(tw, &iter)) {
+		TEST_CHECK(!t->fired);
+		t->fired = true;
+		count++;
+	}
+
+	TEST_CHECK(count == NUM_TIMERS);
+
+	talloc_free(tw);
+}
+
+/** Compare the timer wheel with the LST under a timer-like workload
+ *
+ * Each step advances the clock by a fraction of a millisecond, expires
+ * any due timers, re-arms a random timer (as a request would when it
+ * receives a packet), and deletes and re-inserts another.
+ */
+static void timer_wheel_lst_cmp(void)
+{
+	fr_timer_wheel_t	*tw;
+	fr_lst_t		*lst;
+	wheel_thing		*things, *t;
+	fr_time_t		now, start, end;
+	fr_time_delta_t		wheel_time, lst_time;
+	unsigned int		i, wheel_fired = 0, lst_fired = 0;
+
+#define TIMEOUT(_i)	fr_time_delta_from_msec(1000 + (_i) % 30000)
+
+	things = talloc_zero_array(NULL, wheel_thing, NUM_TIMERS);
+
+	/*
+	 *	Timer wheel
+	 */
+	now = fr_time_wrap(0);
+	tw = fr_timer_wheel_alloc(things, wheel_thing, entry, RESOLUTION, now);
+	TEST_CHECK(tw != NULL);
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		things[i].when = fr_time_add(now, TIMEOUT(fr_rand()));
+		(void) fr_timer_wheel_insert(tw, &things[i], things[i].when);
+	}
+
+	start = fr_time();
+	for (i = 0; i < NUM_CHURN; i++) {
+		now = fr_time_add(now, fr_time_delta_from_usec(100));
+
+		while ((t = fr_timer_wheel_pop(tw, now))) {
+			t->when = fr_time_add(now, TIMEOUT(i));
+			(void) fr_timer_wheel_insert(tw, t, t->when);
+			wheel_fired++;
+		}
+
+		t = &things[fr_rand() % NUM_TIMERS];
+		(void) fr_timer_wheel_extract(tw, t);
+		t->when = fr_time_add(now, TIMEOUT(i));
+		(void) fr_timer_wheel_insert(tw, t, t->when);
+	}
+	end = fr_time();
+	wheel_time = fr_time_sub(end, start);
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == NUM_TIMERS);
+
+	/*
+	 *	LST
+	 */
+	now = fr_time_wrap(0);
+	lst = fr_lst_alloc(things, wheel_thing_cmp, wheel_thing, idx, 0);
+	TEST_CHECK(lst != NULL);
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		things[i].when = fr_time_add(now, TIMEOUT(fr_rand()));
+		(void) fr_lst_insert(lst, &things[i]);
+	}
+
+	start = fr_time();
+	for (i = 0; i < NUM_CHURN; i++) {
+		now = fr_time_add(now, fr_time_delta_from_usec(100));
+
+		while ((t = fr_lst_peek(lst)) && fr_time_lteq(t->when, now)) {
+			(void) fr_lst_extract(lst, t);
+			t->when = fr_time_add(now, TIMEOUT(i));
+			(void) fr_lst_insert(lst, t);
+			lst_fired++;
+		}
+
+		t = &things[fr_rand() % NUM_TIMERS];
+		(void) fr_lst_extract(lst, t);
+		t->when = fr_time_add(now, TIMEOUT(i));
+		(void) fr_lst_insert(lst, t);
+	}
+	end = fr_time();
+	lst_time = fr_time_sub(end, start);
+	TEST_CHECK(fr_lst_num_elements(lst) == NUM_TIMERS);
+
+	TEST_MSG_ALWAYS("\ntimers: %u, steps: %u\n", NUM_TIMERS, NUM_CHURN);
+	TEST_MSG_ALWAYS("timer wheel: %" PRIu64 " μs (%u fired)\n",
+			fr_time_delta_unwrap(wheel_time) / 1000, wheel_fired);
+	TEST_MSG_ALWAYS("lst: %" PRIu64 " μs (%u fired)\n",
+			fr_time_delta_unwrap(lst_time) / 1000, lst_fired);
+
+	/*
+	 *	Checking performance with a debug build
+	 *	or on a loaded machine isn't useful.
+	 */
+	if (!getenv("NO_PERFORMANCE_TESTS")) TEST_CHECK(fr_time_delta_lt(wheel_time, lst_time));
+
+	talloc_free(things);
+}
+
+TEST_LIST = {
+	{ "timer_wheel_basic",		timer_wheel_basic },
+	{ "timer_wheel_extract",	timer_wheel_extract },
+	{ "timer_wheel_range",		timer_wheel_range },
+	{ "timer_wheel_iter",		timer_wheel_iter },
+	{ "timer_wheel_lst_cmp",	timer_wheel_lst_cmp },
+
+	{ NULL }
+};
@@ -421,7 +421,7 @@ static void write_chunk(uint8_t *out, int start_bit, int num_bits, uint16_t chun
 	 *	Special-case 1-bit writes.
 	 */
 	if (num_bits == 1) {
-		out[0] &= ~((1 << (7 - start_bit)) - 1);
+		out[0] &= ~((1 << (8 - start_bit)) - 1);
 		out[0] |= chunk << (7 - start_bit);
 		return;
 	}
@@ -2622,6 +2622,390 @@ int fr_trie_walk(fr_trie_t *ft, void *ctx, fr_trie_walk_t callback)
 }
 
 
+/* FROZEN TRIES */
+
+/*
+ *	A frozen trie is a read-only copy of a trie, compiled into a
+ *	few contiguous arrays.  The layout follows Poptrie:
+ *
+ *	Every node consumes FROZEN_BITS of the key.  Instead of an
+ *	array of 2^FROZEN_BITS pointers, a node has a bitmap saying
+ *	which edges have children.  The children of a node are stored
+ *	next to each other, so the child for an edge is found by
+ *	counting the bits set below it.
+ *
+ *	Keys which end part way through a node, i.e. with length
+ *	"depth" to "depth + FROZEN_BITS - 1", are stored in the node
+ *	twice.  The "prefixes" are indexed by ((1 << length) | bits),
+ *	and are used when the key being looked up also ends part way
+ *	through the node.  The "leaves" are the same data pushed down
+ *	to every edge, and then run-length compressed, so that the
+ *	common case of consuming a full chunk of the key needs only
+ *	one array access to track the longest match.
+ */
+#define FROZEN_BITS	(6)
+#define FROZEN_EDGES	(1 << FROZEN_BITS)
+
+typedef struct {
+	uint64_t	children;	//!< Bit N is set if edge N has a child node.
+	uint64_t	leaves;		//!< Bit N is set if the longest match changes at edge N.
+	uint64_t	prefixes;	//!< Bit N is set if prefix N has data.
+	uint32_t	child_base;	//!< Index of the first child in fr_trie_frozen_t.nodes.
+	uint32_t	leaf_base;	//!< Index of the first leaf in fr_trie_frozen_t.leaves.
+	uint32_t	prefix_base;	//!< Index of the first prefix in fr_trie_frozen_t.prefixes.
+} fr_trie_frozen_node_t;
+
+struct fr_trie_frozen_s {
+	fr_trie_frozen_node_t	*nodes;		//!< nodes[0] is the root.
+	void			**leaves;
+	void			**prefixes;
+
+	uint32_t		num_nodes;
+	uint32_t		num_leaves;
+	uint32_t		num_prefixes;
+};
+
+typedef struct {
+	uint8_t		*key;
+	int		keylen;
+	void		*data;
+} trie_freeze_entry_t;
+
+typedef struct {
+	TALLOC_CTX		*ctx;		//!< Temporary ctx for the entries.
+	trie_freeze_entry_t	*entries;
+	size_t			num_entries;
+
+	fr_trie_frozen_t	*ff;
+} trie_freeze_ctx_t;
+
+/** Return a chunk of at most 8 bits, without any of the checks done by get_chunk()
+ *
+ */
+static inline CC_HINT(always_inline) uint8_t frozen_chunk(uint8_t const *key, int start_bit, int num_bits)
+{
+	uint8_t const	*p = key + BYTEOF(start_bit);
+	int		shift = start_bit & 0x07;
+	uint16_t	chunk = p[0] << 8;
+
+	if ((shift + num_bits) > 8) chunk |= p[1];
+
+	return (uint16_t)(chunk << shift) >> (16 - num_bits);
+}
+
+#define FROZEN_COUNT(_bitmap, _bit) ((unsigned int) __builtin_popcountll((_bitmap) & ((_bit) - 1)))
+
+static int _trie_freeze_collect(uint8_t const *key, size_t keylen, void *data, void *uctx)
+{
+	trie_freeze_ctx_t	*fc = uctx;
+	trie_freeze_entry_t	*entry;
+
+	if ((fc->num_entries & (fc->num_entries - 1)) == 0) {
+		fc->entries = talloc_realloc(fc->ctx, fc->entries, trie_freeze_entry_t,
+					     fc->num_entries ? fc->num_entries * 2 : 64);
+		if (!fc->entries) {
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+	}
+
+	entry = &fc->entries[fc->num_entries++];
+	entry->key = talloc_memdup(fc->ctx, key, BYTES(keylen) + 1);
+	if (!entry->key) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	entry->keylen = keylen;
+	entry->data = data;
+
+	return 0;
+}
+
+/** Sort keys by their bits, with shorter keys first
+ *
+ */
+static int trie_freeze_cmp(void const *one, void const *two)
+{
+	trie_freeze_entry_t const *a = one, *b = two;
+	int	bits = (a->keylen < b->keylen) ? a->keylen : b->keylen;
+	int	ret;
+
+	ret = memcmp(a->key, b->key, BYTEOF(bits));
+	if (ret != 0) return ret;
+
+	if (bits & 0x07) {
+		uint8_t mask = used_bit_mask[(bits & 0x07) - 1];
+		uint8_t x = a->key[BYTEOF(bits)] & mask;
+		uint8_t y = b->key[BYTEOF(bits)] & mask;
+
+		if (x != y) return CMP(x, y);
+	}
+
+	return CMP(a->keylen, b->keylen);
+}
+
+/** Grow one of the frozen arrays
+ *
+ */
+#define FROZEN_GROW(_ff, _field, _type, _num, _add) do { \
+	if (((_num) + (_add)) > talloc_array_length((_ff)->_field)) { \
+		size_t _size = talloc_array_length((_ff)->_field) * 2; \
+		if (_size < ((_num) + (_add))) _size = (_num) + (_add); \
+		(_ff)->_field = talloc_realloc(_ff, (_ff)->_field, _type, _size); \
+		if (!(_ff)->_field) { \
+			fr_strerror_const("Out of memory"); \
+			return -1; \
+		} \
+	} \
+} while (0)
+
+/** Compile the entries in [lo, hi) into node idx
+ *
+ * All of the entries share the first "depth" bits.  They are sorted,
+ * so the entries which continue past this node through the same
+ * edge are next to each other.
+ */
+static int trie_freeze_node(trie_freeze_ctx_t *fc, uint32_t idx, size_t lo, size_t hi, int depth)
+{
+	fr_trie_frozen_t	*ff = fc->ff;
+	void			*prefix[FROZEN_EDGES];
+	void			*leaf, *last;
+	uint64_t		children = 0, prefixes = 0, leaves = 0;
+	uint32_t		child_base, i;
+	size_t			j, k;
+	int			l;
+
+	memset(prefix, 0, sizeof(prefix));
+
+	for (j = lo; j < hi; j++) {
+		trie_freeze_entry_t *entry = &fc->entries[j];
+
+		l = entry->keylen - depth;
+		if (l >= FROZEN_BITS) {
+			children |= ((uint64_t) 1) << frozen_chunk(entry->key, depth, FROZEN_BITS);
+			continue;
+		}
+
+		i = (1 << l) | (l ? frozen_chunk(entry->key, depth, l) : 0);
+		prefix[i] = entry->data;
+		prefixes |= ((uint64_t) 1) << i;
+	}
+
+	/*
+	 *	Keys which end inside of this node.
+	 */
+	if (prefixes) {
+		FROZEN_GROW(ff, prefixes, void *, ff->num_prefixes, FROZEN_EDGES);
+		ff->nodes[idx].prefixes = prefixes;
+		ff->nodes[idx].prefix_base = ff->num_prefixes;
+
+		for (i = 1; i < FROZEN_EDGES; i++) {
+			if (prefix[i]) ff->prefixes[ff->num_prefixes++] = prefix[i];
+		}
+
+		/*
+		 *	Push the longest match for each edge down to the
+		 *	edge, and only record where it changes.
+		 */
+		FROZEN_GROW(ff, leaves, void *, ff->num_leaves, FROZEN_EDGES);
+		ff->nodes[idx].leaf_base = ff->num_leaves;
+
+		last = NULL;
+		for (i = 0; i < FROZEN_EDGES; i++) {
+			leaf = NULL;
+			for (l = FROZEN_BITS - 1; l >= 0; l--) {
+				leaf = prefix[(1 << l) | (i >> (FROZEN_BITS - l))];
+				if (leaf) break;
+			}
+
+			if ((i > 0) && (leaf == last)) continue;
+
+			leaves |= ((uint64_t) 1) << i;
+			ff->leaves[ff->num_leaves++] = leaf;
+			last = leaf;
+		}
+		ff->nodes[idx].leaves = leaves;
+	}
+
+	if (!children) return 0;
+
+	/*
+	 *	The children have to be contiguous, so allocate all
+	 *	of them before recursing.
+	 */
+	FROZEN_GROW(ff, nodes, fr_trie_frozen_node_t, ff->num_nodes, (size_t) __builtin_popcountll(children));
+	child_base = ff->num_nodes;
+	memset(&ff->nodes[child_base], 0, sizeof(ff->nodes[0]) * __builtin_popcountll(children));
+	ff->num_nodes += __builtin_popcountll(children);
+
+	ff->nodes[idx].children = children;
+	ff->nodes[idx].child_base = child_base;
+
+	for (j = lo; j < hi; j = k) {
+		uint8_t chunk;
+
+		if ((fc->entries[j].keylen - depth) < FROZEN_BITS) {
+			k = j + 1;
+			continue;
+		}
+
+		chunk = frozen_chunk(fc->entries[j].key, depth, FROZEN_BITS);
+		for (k = j + 1; k < hi; k++) {
+			if ((fc->entries[k].keylen - depth) < FROZEN_BITS) break;
+			if (frozen_chunk(fc->entries[k].key, depth, FROZEN_BITS) != chunk) break;
+		}
+
+		if (trie_freeze_node(fc, child_base + FROZEN_COUNT(children, ((uint64_t) 1) << chunk),
+				     j, k, depth + FROZEN_BITS) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Compile a trie into a read-only form which is faster to search
+ *
+ * The frozen trie is a copy of the structure of the trie, but not of the
+ * user data, which is shared.  It is not updated when the trie changes.
+ * Instead, the trie should be used as a builder, and then frozen again
+ * once all of the changes have been made.
+ *
+ * @param[in] ctx	to allocate the frozen trie in.
+ * @param[in] ft	to freeze.
+ * @return
+ *	- A new frozen trie on success.
+ *	- NULL on error.
+ */
+fr_trie_frozen_t *fr_trie_freeze(TALLOC_CTX *ctx, fr_trie_t *ft)
+{
+	trie_freeze_ctx_t	fc = {};
+	fr_trie_frozen_t	*ff;
+
+	fc.ctx = talloc_init_const("trie_freeze");
+	if (!fc.ctx) return NULL;
+
+	if (fr_trie_walk(ft, &fc, _trie_freeze_collect) < 0) {
+	error:
+		talloc_free(fc.ctx);
+		return NULL;
+	}
+
+	if (fc.num_entries) qsort(fc.entries, fc.num_entries, sizeof(fc.entries[0]), trie_freeze_cmp);
+
+	fc.ff = ff = talloc_zero(ctx, fr_trie_frozen_t);
+	if (!ff) goto error;
+
+	ff->nodes = talloc_zero_array(ff, fr_trie_frozen_node_t, 1);
+	ff->leaves = talloc_array(ff, void *, FROZEN_EDGES);
+	ff->prefixes = talloc_array(ff, void *, FROZEN_EDGES);
+	if (!ff->nodes || !ff->leaves || !ff->prefixes) {
+	error_free:
+		talloc_free(ff);
+		goto error;
+	}
+	ff->num_nodes = 1;
+
+	if (trie_freeze_node(&fc, 0, 0, fc.num_entries, 0) < 0) goto error_free;
+
+	talloc_free(fc.ctx);
+
+	/*
+	 *	Trim the arrays to what we actually used.
+	 */
+	ff->nodes = talloc_realloc(ff, ff->nodes, fr_trie_frozen_node_t, ff->num_nodes);
+	if (ff->num_leaves) ff->leaves = talloc_realloc(ff, ff->leaves, void *, ff->num_leaves);
+	if (ff->num_prefixes) ff->prefixes = talloc_realloc(ff, ff->prefixes, void *, ff->num_prefixes);
+
+	return ff;
+}
+
+/** Lookup a key in a frozen trie and return user ctx, if any
+ *
+ *  The key may be LONGER than entries in the trie.  In which case the
+ *  closest match is returned.  This is the same as #fr_trie_lookup_by_key.
+ *
+ * @param ff	 the frozen trie
+ * @param key	 the key bytes
+ * @param keylen length in bits of the key
+ * @return
+ *	- NULL on not found
+ *	- void* user ctx on found
+ */
+void *fr_trie_frozen_lookup_by_key(fr_trie_frozen_t const *ff, void const *key, size_t keylen)
+{
+	fr_trie_frozen_node_t const	*node = ff->nodes;
+	void				*best = NULL;
+	int				depth = 0, rem, l;
+	uint8_t				chunk;
+	uint64_t			bit;
+
+	if (keylen > MAX_KEY_BITS) return NULL;
+
+	while ((rem = (int) keylen - depth) >= FROZEN_BITS) {
+		chunk = frozen_chunk(key, depth, FROZEN_BITS);
+		bit = ((uint64_t) 1) << chunk;
+
+		if (node->leaves) {
+			void *leaf = ff->leaves[node->leaf_base + FROZEN_COUNT(node->leaves, bit << 1) - 1];
+
+			if (leaf) best = leaf;
+		}
+
+		if (!(node->children & bit)) return best;
+
+		node = &ff->nodes[node->child_base + FROZEN_COUNT(node->children, bit)];
+		depth += FROZEN_BITS;
+	}
+
+	if (!node->prefixes) return best;
+
+	/*
+	 *	The key ends inside of this node.  Check the prefixes
+	 *	from longest to shortest.
+	 */
+	chunk = rem ? frozen_chunk(key, depth, rem) : 0;
+	for (l = rem; l >= 0; l--) {
+		bit = ((uint64_t) 1) << ((1 << l) | (chunk >> (rem - l)));
+
+		if (node->prefixes & bit) return ff->prefixes[node->prefix_base + FROZEN_COUNT(node->prefixes, bit)];
+	}
+
+	return best;
+}
+
+/** Match a key and length in a frozen trie and return user ctx, if any
+ *
+ * Only the exact match is returned.  This is the same as #fr_trie_match_by_key.
+ *
+ * @param ff	 the frozen trie
+ * @param key	 the key bytes
+ * @param keylen length in bits of the key
+ * @return
+ *	- NULL on not found
+ *	- void* user ctx on found
+ */
+void *fr_trie_frozen_match_by_key(fr_trie_frozen_t const *ff, void const *key, size_t keylen)
+{
+	fr_trie_frozen_node_t const	*node = ff->nodes;
+	int				depth = 0, rem;
+	uint64_t			bit;
+
+	if (keylen > MAX_KEY_BITS) return NULL;
+
+	while ((rem = (int) keylen - depth) >= FROZEN_BITS) {
+		bit = ((uint64_t) 1) << frozen_chunk(key, depth, FROZEN_BITS);
+
+		if (!(node->children & bit)) return NULL;
+
+		node = &ff->nodes[node->child_base + FROZEN_COUNT(node->children, bit)];
+		depth += FROZEN_BITS;
+	}
+
+	bit = ((uint64_t) 1) << ((1 << rem) | (rem ? frozen_chunk(key, depth, rem) : 0));
+	if (!(node->prefixes & bit)) return NULL;
+
+	return ff->prefixes[node->prefix_base + FROZEN_COUNT(node->prefixes, bit)];
+}
+
 /**********************************************************************/
 
 /*
@@ -67,6 +67,17 @@ void		*fr_trie_remove_by_key(fr_trie_t *ft, void const *key, size_t keylen) CC_H
 
 int		fr_trie_walk(fr_trie_t *ft, void *ctx, fr_trie_walk_t callback) CC_HINT(nonnull(1,3));
 
+/*
+ *	Read-only API.
+ */
+typedef struct fr_trie_frozen_s fr_trie_frozen_t;
+
+fr_trie_frozen_t *fr_trie_freeze(TALLOC_CTX *ctx, fr_trie_t *ft) CC_HINT(nonnull(2));
+
+void		*fr_trie_frozen_lookup_by_key(fr_trie_frozen_t const *ff, void const *key, size_t keylen) CC_HINT(nonnull);
+
+void		*fr_trie_frozen_match_by_key(fr_trie_frozen_t const *ff, void const *key, size_t keylen) CC_HINT(nonnull);
+
 /*
  *	Data oriented API.
  */
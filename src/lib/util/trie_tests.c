@@ -0,0 +1,190 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for frozen tries
+ *
+ * @file src/lib/util/trie_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/trie.h>
+
+#define NUM_ENTRIES	(4096)
+#define NUM_QUERIES	(65536)
+#define NUM_PREFIXES	(100000)
+#define NUM_LOOKUPS	(1000000)
+
+static void random_key(uint8_t key[static 8], size_t *keylen, size_t max_bits)
+{
+	uint32_t a = fr_rand(), b = fr_rand();
+
+	memcpy(key, &a, sizeof(a));
+	memcpy(key + 4, &b, sizeof(b));
+	*keylen = fr_rand() % (max_bits + 1);
+
+	/*
+	 *	Keep most keys in a small part of the space, so that
+	 *	there are lots of overlapping prefixes.
+	 */
+	if (fr_rand() & 0x01) key[0] &= 0x0f;
+}
+
+static void trie_frozen_empty(void)
+{
+	fr_trie_t		*ft;
+	fr_trie_frozen_t	*ff;
+	uint8_t			key[8] = {};
+
+	ft = fr_trie_alloc(NULL, NULL, NULL);
+	TEST_CHECK(ft != NULL);
+
+	ff = fr_trie_freeze(NULL, ft);
+	TEST_CHECK(ff != NULL);
+
+	TEST_CHECK(fr_trie_frozen_lookup_by_key(ff, key, 0) == NULL);
+	TEST_CHECK(fr_trie_frozen_lookup_by_key(ff, key, 32) == NULL);
+	TEST_CHECK(fr_trie_frozen_match_by_key(ff, key, 32) == NULL);
+
+	talloc_free(ff);
+	talloc_free(ft);
+}
+
+/** Check that the frozen trie returns the same results as the trie it was built from
+ *
+ */
+static void trie_frozen_equivalent(void)
+{
+	fr_trie_t		*ft;
+	fr_trie_frozen_t	*ff;
+	int			*data;
+	uint8_t			key[8];
+	size_t			keylen;
+	int			i;
+
+	ft = fr_trie_alloc(NULL, NULL, NULL);
+	TEST_CHECK(ft != NULL);
+
+	data = talloc_array(ft, int, NUM_ENTRIES);
+
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		random_key(key, &keylen, 40);
+		data[i] = i;
+
+		/*
+		 *	Duplicates are allowed to fail.
+		 */
+		(void) fr_trie_insert_by_key(ft, key, keylen, &data[i]);
+	}
+
+	ff = fr_trie_freeze(NULL, ft);
+	TEST_CHECK(ff != NULL);
+
+	for (i = 0; i < NUM_QUERIES; i++) {
+		void *a, *b;
+
+		random_key(key, &keylen, 64);
+
+		a = fr_trie_lookup_by_key(ft, key, keylen);
+		b = fr_trie_frozen_lookup_by_key(ff, key, keylen);
+		TEST_CHECK(a == b);
+		TEST_MSG("lookup of %zu bits returned %p, expected %p", keylen, b, a);
+
+		a = fr_trie_match_by_key(ft, key, keylen);
+		b = fr_trie_frozen_match_by_key(ff, key, keylen);
+		TEST_CHECK(a == b);
+		TEST_MSG("match of %zu bits returned %p, expected %p", keylen, b, a);
+	}
+
+	talloc_free(ff);
+	talloc_free(ft);
+}
+
+/** Compare lookup rates for a routing table sized set of IPv4 prefixes
+ *
+ */
+static void trie_frozen_lookup_speed(void)
+{
+	fr_trie_t		*ft;
+	fr_trie_frozen_t	*ff;
+	int			*data;
+	uint32_t		*addrs;
+	fr_time_t		start, stop;
+	uint64_t		rate, frozen_rate;
+	int			i, found = 0;
+
+	ft = fr_trie_alloc(NULL, NULL, NULL);
+	TEST_CHECK(ft != NULL);
+
+	data = talloc_array(ft, int, NUM_PREFIXES);
+	addrs = talloc_array(ft, uint32_t, NUM_LOOKUPS);
+
+	for (i = 0; i < NUM_PREFIXES; i++) {
+		uint32_t addr = htonl(fr_rand());
+
+		data[i] = i;
+		(void) fr_trie_insert_by_key(ft, &addr, 8 + (fr_rand() % 25), &data[i]);
+	}
+
+	for (i = 0; i < NUM_LOOKUPS; i++) addrs[i] = htonl(fr_rand());
+
+	start = fr_time();
+	ff = fr_trie_freeze(NULL, ft);
+	stop = fr_time();
+	TEST_CHECK(ff != NULL);
+	printf("freeze of %u prefixes took %" PRId64 " ms\n", NUM_PREFIXES,
+	       fr_time_delta_to_msec(fr_time_sub(stop, start)));
+
+	start = fr_time();
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		if (fr_trie_lookup_by_key(ft, &addrs[i], 32)) found++;
+	}
+	stop = fr_time();
+
+	rate = (uint64_t)((float)NSEC / ((float)fr_time_delta_unwrap(fr_time_sub(stop, start)) / NUM_LOOKUPS));
+	printf("trie lookup rate %" PRIu64 "\n", rate);
+
+	start = fr_time();
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		if (fr_trie_frozen_lookup_by_key(ff, &addrs[i], 32)) found--;
+	}
+	stop = fr_time();
+
+	frozen_rate = (uint64_t)((float)NSEC / ((float)fr_time_delta_unwrap(fr_time_sub(stop, start)) / NUM_LOOKUPS));
+	printf("frozen trie lookup rate %" PRIu64 "\n", frozen_rate);
+
+	TEST_CHECK(found == 0);
+
+	/*
+	 *	Checking performance with a debug build
+	 *	or on a loaded machine isn't useful.
+	 */
+	if (!getenv("NO_PERFORMANCE_TESTS")) TEST_CHECK(frozen_rate > rate);
+
+	talloc_free(ff);
+	talloc_free(ft);
+}
+
+TEST_LIST = {
+	{ "trie_frozen_empty",		trie_frozen_empty },
+	{ "trie_frozen_equivalent",	trie_frozen_equivalent },
+	{ "trie_frozen_lookup_speed",	trie_frozen_lookup_speed },
+
+	{ NULL }
+};
@@ -0,0 +1,608 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Read and write multiple UDP packets per system call
+ *
+ * Packets are read from the socket with recvmmsg(), and handed out
+ * one at a time via fr_udp_batch_recv().  Replies are copied into a
+ * local queue by fr_udp_batch_send(), and written with sendmmsg()
+ * when the queue fills up, or when fr_udp_batch_flush() is called.
+ *
+ * Where recvmmsg() isn't available, reads fall back to udp_recv().
+ * sendmmsg() is emulated in missing.c where necessary.
+ *
+ * @file src/lib/util/udp_batch.c
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/udp_batch.h>
+
+#include <sys/uio.h>
+
+/*
+ *	Large enough for a PKTINFO and a timestamp.
+ */
+#define UDP_BATCH_CBUF_SIZE	(256)
+
+typedef struct {
+	struct iovec		iov;			//!< points to the packet data.
+	struct sockaddr_storage	addr;			//!< src on receive, dst on send.
+	uint8_t			cbuf[UDP_BATCH_CBUF_SIZE]; //!< ancillary data.
+} fr_udp_batch_slot_t;
+
+struct fr_udp_batch_s {
+	int			sockfd;			//!< the socket we read from and write to.
+	unsigned int		num;			//!< maximum number of packets per system call.
+	size_t			max_packet_size;	//!< size of each packet buffer.
+
+	struct sockaddr_storage	bound;			//!< local address of the socket.
+	socklen_t		bound_len;		//!< length of the local address.
+	bool			bound_any;		//!< whether the socket is bound to a wildcard address.
+
+	struct mmsghdr		*rx;			//!< headers for recvmmsg().
+	fr_udp_batch_slot_t	*rx_slot;		//!< receive buffers.
+	unsigned int		rx_count;		//!< number of packets in the current batch.
+	unsigned int		rx_next;		//!< next packet to hand to the caller.
+	fr_time_t		rx_time;		//!< when the current batch was read.
+
+	struct mmsghdr		*tx;			//!< headers for sendmmsg().
+	fr_udp_batch_slot_t	*tx_slot;		//!< transmit buffers.
+	unsigned int		tx_count;		//!< number of packets waiting to be written.
+	unsigned int		tx_dropped;		//!< packets discarded since fr_udp_batch_flush() last returned.
+	int			tx_errno;		//!< from the last write which failed.
+};
+
+/** Allocate a batched reader / writer for a UDP socket
+ *
+ * The socket should already be bound.  Its local address is used as
+ * the destination address for received packets, unless the kernel
+ * gives us a more specific one via PKTINFO.
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] sockfd		the UDP socket.
+ * @param[in] num		maximum number of packets to read or write per system call.
+ * @param[in] max_packet_size	size of the largest packet we will read or write.
+ * @return
+ *	- NULL on error.
+ *	- the new batch on success.
+ */
+fr_udp_batch_t *fr_udp_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size)
+{
+	fr_udp_batch_t	*ub;
+	uint8_t		*buffer;
+	unsigned int	i;
+
+	if (!num || !max_packet_size) {
+		fr_strerror_const("Invalid batch size");
+		return NULL;
+	}
+
+	ub = talloc_zero(ctx, fr_udp_batch_t);
+	if (!ub) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(ub);
+		return NULL;
+	}
+
+	ub->sockfd = sockfd;
+	ub->num = num;
+	ub->max_packet_size = max_packet_size;
+
+	/*
+	 *	We only need to do this once, instead of once per
+	 *	packet as recvfromto() does.
+	 */
+	ub->bound_len = sizeof(ub->bound);
+	if (getsockname(sockfd, (struct sockaddr *) &ub->bound, &ub->bound_len) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		talloc_free(ub);
+		return NULL;
+	}
+
+	switch (ub->bound.ss_family) {
+	case AF_INET:
+		ub->bound_any = (((struct sockaddr_in *) &ub->bound)->sin_addr.s_addr == htonl(INADDR_ANY));
+		break;
+
+#ifdef AF_INET6
+	case AF_INET6:
+		ub->bound_any = IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &ub->bound)->sin6_addr);
+		break;
+#endif
+
+	default:
+		fr_strerror_printf("Unsupported address family %u", ub->bound.ss_family);
+		talloc_free(ub);
+		return NULL;
+	}
+
+	ub->rx = talloc_zero_array(ub, struct mmsghdr, num);
+	ub->rx_slot = talloc_zero_array(ub, fr_udp_batch_slot_t, num);
+	ub->tx = talloc_zero_array(ub, struct mmsghdr, num);
+	ub->tx_slot = talloc_zero_array(ub, fr_udp_batch_slot_t, num);
+	if (!ub->rx || !ub->rx_slot || !ub->tx || !ub->tx_slot) goto oom;
+
+	/*
+	 *	One contiguous block of packet buffers for each
+	 *	direction.
+	 */
+	buffer = talloc_array(ub, uint8_t, max_packet_size * num * 2);
+	if (!buffer) goto oom;
+
+	for (i = 0; i < num; i++) {
+		ub->rx_slot[i].iov.iov_base = buffer + (i * max_packet_size);
+		ub->rx_slot[i].iov.iov_len = max_packet_size;
+
+		ub->tx_slot[i].iov.iov_base = buffer + ((num + i) * max_packet_size);
+		ub->tx_slot[i].iov.iov_len = 0;
+
+		ub->rx[i].msg_hdr.msg_iov = &ub->rx_slot[i].iov;
+		ub->rx[i].msg_hdr.msg_iovlen = 1;
+
+		ub->tx[i].msg_hdr.msg_iov = &ub->tx_slot[i].iov;
+		ub->tx[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return ub;
+}
+
+#ifdef HAVE_RECVMMSG
+/** Read as many packets as are available, up to the batch size
+ *
+ * @return
+ *	- <0 on error.
+ *	- 0 if there is no data.
+ *	- >0 the number of packets read.
+ */
+static int udp_batch_fill(fr_udp_batch_t *ub, int flags)
+{
+	unsigned int	i;
+	int		ret;
+
+	ub->rx_count = ub->rx_next = 0;
+
+	for (i = 0; i < ub->num; i++) {
+		struct msghdr *msgh = &ub->rx[i].msg_hdr;
+
+		/*
+		 *	The kernel updates these on every read, so
+		 *	they have to be reset each time.
+		 */
+		ub->rx_slot[i].iov.iov_len = ub->max_packet_size;
+
+		if ((flags & UDP_FLAGS_CONNECTED) == 0) {
+			msgh->msg_name = &ub->rx_slot[i].addr;
+			msgh->msg_namelen = sizeof(ub->rx_slot[i].addr);
+		} else {
+			msgh->msg_name = NULL;
+			msgh->msg_namelen = 0;
+		}
+
+		msgh->msg_control = ub->rx_slot[i].cbuf;
+		msgh->msg_controllen = sizeof(ub->rx_slot[i].cbuf);
+		msgh->msg_flags = 0;
+		ub->rx[i].msg_len = 0;
+	}
+
+	ret = recvmmsg(ub->sockfd, ub->rx, ub->num, MSG_DONTWAIT |
+		       (((flags & UDP_FLAGS_PEEK) != 0) ? MSG_PEEK : 0), NULL);
+	if (ret < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	ub->rx_count = ret;
+	ub->rx_time = fr_time();
+
+	return ret;
+}
+
+/** Find the destination address, interface, and timestamp for a received packet
+ *
+ */
+static void udp_batch_cmsg_parse(fr_udp_batch_t *ub, struct msghdr *msgh,
+				 struct sockaddr_storage *dst, socklen_t *dst_len, int *ifindex, fr_time_t *when)
+{
+	struct cmsghdr *cmsg;
+
+	memcpy(dst, &ub->bound, ub->bound_len);
+	*dst_len = ub->bound_len;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *) dst)->sin_addr = i->ipi_addr;
+			*ifindex = i->ipi_ifindex;
+			continue;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *) dst)->sin_addr = *i;
+			continue;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *) dst)->sin6_addr = i->ipi6_addr;
+			*ifindex = i->ipi6_ifindex;
+			continue;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			*when = fr_time_from_timeval((struct timeval *) CMSG_DATA(cmsg));
+		}
+#endif
+	}
+}
+#endif	/* HAVE_RECVMMSG */
+
+/** Read one UDP packet, refilling the batch from the socket if necessary
+ *
+ * This function has the same semantics as udp_recv().  The only
+ * difference is that the packet may have been read from the socket
+ * by a previous call.  Callers MUST keep calling this function until
+ * fr_udp_batch_recv_pending() returns zero, as the socket may no
+ * longer be readable while packets are still queued here.
+ *
+ * @param[in] ub		the batch to read from.
+ * @param[in] flags		for things.
+ * @param[out] socket_out	Information about the src/dst address of the packet
+ *				and the interface it was received on.
+ * @param[out] data		pointer where data will be written
+ * @param[in] data_len		length of data to read
+ * @param[out] when		the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there is no data, or the packet was discarded.
+ *	- < 0 on failure.
+ */
+ssize_t fr_udp_batch_recv(fr_udp_batch_t *ub, int flags,
+			  fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when)
+{
+#ifndef HAVE_RECVMMSG
+	return udp_recv(ub->sockfd, flags, socket_out, data, data_len, when);
+#else
+	struct mmsghdr		*msg;
+	fr_udp_batch_slot_t	*slot;
+	struct sockaddr_storage	dst;
+	socklen_t		dst_len;
+	size_t			packet_len;
+	fr_time_t		recv_time = fr_time_wrap(0);
+
+	/*
+	 *	Always initialise the output socket structure
+	 */
+	*socket_out = (fr_socket_t){
+		.fd = ub->sockfd,
+		.proto = IPPROTO_UDP
+	};
+	if (when) *when = fr_time_wrap(0);
+
+	if (ub->rx_next >= ub->rx_count) {
+		int ret;
+
+		ret = udp_batch_fill(ub, flags);
+		if (ret <= 0) return ret;
+	}
+
+	msg = &ub->rx[ub->rx_next];
+	slot = &ub->rx_slot[ub->rx_next];
+	ub->rx_next++;
+
+	/*
+	 *	The OS discards any data in the packet after
+	 *	"max_packet_size" bytes.  We do the same for the
+	 *	caller's buffer.
+	 */
+	packet_len = msg->msg_len;
+	if (packet_len > data_len) packet_len = data_len;
+	memcpy(data, slot->iov.iov_base, packet_len);
+
+	if ((flags & UDP_FLAGS_CONNECTED) == 0) {
+		udp_batch_cmsg_parse(ub, &msg->msg_hdr, &dst, &dst_len, &socket_out->inet.ifindex, &recv_time);
+
+		if (fr_ipaddr_from_sockaddr(&socket_out->inet.src_ipaddr, &socket_out->inet.src_port,
+					    &slot->addr, msg->msg_hdr.msg_namelen) < 0) {
+			fr_strerror_const_push("Failed converting src sockaddr to ipaddr");
+			return 0;
+		}
+		if (fr_ipaddr_from_sockaddr(&socket_out->inet.dst_ipaddr, &socket_out->inet.dst_port,
+					    &dst, dst_len) < 0) {
+			fr_strerror_const_push("Failed converting dst sockaddr to ipaddr");
+			return 0;
+		}
+	}
+
+	/*
+	 *	We didn't get it from the kernel so use the time the
+	 *	batch was read.
+	 */
+	if (when) *when = fr_time_eq(recv_time, fr_time_wrap(0)) ? ub->rx_time : recv_time;
+
+	return packet_len;
+#endif
+}
+
+/** Return how many packets have been read from the socket, but not yet returned to the caller
+ *
+ */
+unsigned int fr_udp_batch_recv_pending(fr_udp_batch_t const *ub)
+{
+	return ub->rx_count - ub->rx_next;
+}
+
+/** Set the source address of an outgoing packet
+ *
+ *  This is the same logic as sendfromto(), but done once per packet
+ *  in a batch.
+ */
+static void udp_batch_cmsg_src(fr_udp_batch_t *ub, fr_udp_batch_slot_t *slot, struct msghdr *msgh,
+			       fr_socket_t const *socket)
+{
+	struct cmsghdr *cmsg;
+
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+
+	/*
+	 *	Sockets bound to a specific address always send from
+	 *	that address.  Some platforms (e.g. FreeBSD) will
+	 *	also refuse to send if we try to set the source address.
+	 */
+	if (!ub->bound_any || fr_ipaddr_is_inaddr_any(&socket->inet.src_ipaddr)) return;
+
+	memset(slot->cbuf, 0, sizeof(slot->cbuf));
+
+	switch (socket->inet.src_ipaddr.af) {
+	case AF_INET:
+#ifdef IP_PKTINFO
+	{
+		struct in_pktinfo *pkt;
+
+		msgh->msg_control = slot->cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		pkt->ipi_spec_dst = socket->inet.src_ipaddr.addr.v4;
+		pkt->ipi_ifindex = socket->inet.ifindex;
+	}
+#elif defined(IP_SENDSRCADDR)
+	{
+		struct in_addr *in;
+
+		msgh->msg_control = slot->cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_SENDSRCADDR;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
+
+		in = (struct in_addr *) CMSG_DATA(cmsg);
+		*in = socket->inet.src_ipaddr.addr.v4;
+	}
+#endif
+		break;
+
+#ifdef IPV6_PKTINFO
+	case AF_INET6:
+	{
+		struct in6_pktinfo *pkt;
+
+		msgh->msg_control = slot->cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		pkt->ipi6_addr = socket->inet.src_ipaddr.addr.v6;
+		pkt->ipi6_ifindex = socket->inet.ifindex;
+	}
+		break;
+#endif
+
+	default:
+		break;
+	}
+}
+
+/** Write all queued packets to the socket
+ *
+ * UDP is unreliable, so packets which can't be written are discarded,
+ * just as they would be if the kernel dropped them.  They're counted,
+ * so that fr_udp_batch_flush() can report them.
+ */
+static void udp_batch_write(fr_udp_batch_t *ub)
+{
+	unsigned int	sent = 0;
+
+	while (sent < ub->tx_count) {
+		int ret;
+
+		ret = sendmmsg(ub->sockfd, ub->tx + sent, ub->tx_count - sent, 0);
+		if (ret >= 0) {
+			sent += ret;
+			continue;
+		}
+
+		if (errno == EINTR) continue;
+
+		ub->tx_errno = errno;
+
+		switch (errno) {
+		/*
+		 *	The socket buffer is full.  Nothing else is
+		 *	going to be written, so discard the rest.
+		 */
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:
+		case ENOBUFS:
+		case ENOMEM:
+			ub->tx_dropped += ub->tx_count - sent;
+			sent = ub->tx_count;
+			break;
+
+		/*
+		 *	sendmmsg() only returns an error if the first
+		 *	packet failed.  Discard that one, and try the
+		 *	rest.
+		 */
+		default:
+			ub->tx_dropped++;
+			sent++;
+			break;
+		}
+	}
+
+	ub->tx_count = 0;
+}
+
+/** Queue a UDP packet for sending
+ *
+ * The data is copied, so the caller can free it as soon as this
+ * function returns.  The queue is written to the socket when it is
+ * full, or when fr_udp_batch_flush() is called.
+ *
+ * Packets which are too large for the batch buffers are sent
+ * immediately, after any queued packets.
+ *
+ * @param[in] ub		the batch to write to.
+ * @param[in] socket		src/dst address of the packet.
+ * @param[in] flags		UDP_FLAGS_CONNECTED, or UDP_FLAGS_NONE.
+ * @param[in] data		to send.
+ * @param[in] data_len		length of data to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_udp_batch_send(fr_udp_batch_t *ub, fr_socket_t const *socket, int flags, void const *data, size_t data_len)
+{
+	fr_udp_batch_slot_t	*slot;
+	struct msghdr		*msgh;
+
+	if (unlikely(socket->proto != IPPROTO_UDP)) {
+		fr_strerror_printf("Invalid proto type %u", socket->proto);
+		return -1;
+	}
+
+	if (unlikely(data_len > ub->max_packet_size)) {
+		char *packet;
+
+		udp_batch_write(ub);
+
+		memcpy(&packet, &data, sizeof(packet)); /* const issues */
+		return (udp_send(socket, flags, packet, data_len) < 0) ? -1 : 0;
+	}
+
+	slot = &ub->tx_slot[ub->tx_count];
+	msgh = &ub->tx[ub->tx_count].msg_hdr;
+
+	memcpy(slot->iov.iov_base, data, data_len);
+	slot->iov.iov_len = data_len;
+
+	if ((flags & UDP_FLAGS_CONNECTED) != 0) {
+		msgh->msg_name = NULL;
+		msgh->msg_namelen = 0;
+		msgh->msg_control = NULL;
+		msgh->msg_controllen = 0;
+
+	} else {
+		socklen_t sizeof_dst;
+
+		if (fr_ipaddr_to_sockaddr(&slot->addr, &sizeof_dst,
+					  &socket->inet.dst_ipaddr, socket->inet.dst_port) < 0) return -1;
+
+		msgh->msg_name = &slot->addr;
+		msgh->msg_namelen = sizeof_dst;
+
+		udp_batch_cmsg_src(ub, slot, msgh, socket);
+	}
+
+	ub->tx_count++;
+
+	/*
+	 *	The packet has been queued, so it's ours now.  Any
+	 *	failure writing the queue is reported by the next
+	 *	call to fr_udp_batch_flush(), and not here.  Otherwise
+	 *	the caller would think that this packet hadn't been
+	 *	sent, and try to send it again.
+	 */
+	if (ub->tx_count == ub->num) udp_batch_write(ub);
+
+	return 0;
+}
+
+/** Write all queued packets to the socket
+ *
+ * Also reports packets which were discarded when fr_udp_batch_send()
+ * wrote a full queue.
+ *
+ * @param[in] ub	the batch to flush.
+ * @return
+ *	- 0 if all packets were written.
+ *	- -1 if one or more packets were discarded since the last call.
+ */
+int fr_udp_batch_flush(fr_udp_batch_t *ub)
+{
+	unsigned int	dropped;
+
+	udp_batch_write(ub);
+
+	if (!ub->tx_dropped) return 0;
+
+	dropped = ub->tx_dropped;
+	ub->tx_dropped = 0;
+
+	fr_strerror_printf("udp_send failed, discarded %u packet%s: %s",
+			   dropped, (dropped == 1) ? "" : "s", fr_syserror(ub->tx_errno));
+
+	return -1;
+}
@@ -0,0 +1,53 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/util/udp_batch.h
+ * @brief Read and write multiple UDP packets per system call.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(udp_batch_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/udp.h>
+
+typedef struct fr_udp_batch_s fr_udp_batch_t;
+
+fr_udp_batch_t	*fr_udp_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size);
+
+ssize_t		fr_udp_batch_recv(fr_udp_batch_t *ub, int flags,
+				  fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when) CC_HINT(nonnull(1,3,4));
+
+unsigned int	fr_udp_batch_recv_pending(fr_udp_batch_t const *ub) CC_HINT(nonnull);
+
+int		fr_udp_batch_send(fr_udp_batch_t *ub, fr_socket_t const *socket, int flags,
+				  void const *data, size_t data_len) CC_HINT(nonnull);
+
+int		fr_udp_batch_flush(fr_udp_batch_t *ub) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1144 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Asynchronous I/O using Linux io_uring, driven from an event list
+ *
+ * The event list still uses kqueue (or libkqueue) for readiness, timers,
+ * signals and processes.  The ring's file descriptor is inserted into the
+ * event list like any other, and becomes readable when operations
+ * complete, so completions are dispatched from #fr_event_service along
+ * with everything else.
+ *
+ * Operations queued while the event list is being serviced are submitted
+ * together with a single system call once servicing finishes.
+ *
+ * We talk to the kernel directly rather than using liburing, so that
+ * there's no additional dependency.
+ *
+ * @file src/lib/util/uring.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/uring.h>
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ *	The kernel and userspace share the ring indexes, so they
+ *	must be accessed with the appropriate barriers.
+ */
+#define uring_load_acquire(_p)		atomic_load_explicit((_Atomic __typeof__(*(_p)) *)(_p), memory_order_acquire)
+#define uring_store_release(_p, _v)	atomic_store_explicit((_Atomic __typeof__(*(_p)) *)(_p), (_v), memory_order_release)
+
+/** Largest number of buffers which can be provided for a multishot receive
+ *
+ */
+#define URING_RECV_BUFFERS_MAX	(32768)
+
+/** Room for a PKTINFO control message, and a timestamp
+ *
+ */
+#define URING_CONTROL_LEN	(CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct timeval)))
+
+typedef enum {
+	URING_OP_INVALID = 0,
+	URING_OP_WRITE,					//!< write(), write_fixed() or sendmsg().
+	URING_OP_RECV					//!< Multishot recvmsg().
+} uring_op_type_t;
+
+typedef struct uring_op_s uring_op_t;
+
+/** A single shot operation
+ *
+ */
+struct uring_op_s {
+	uring_op_type_t		type;			//!< Must be first.
+
+	int			fd;			//!< Operation is for.
+	fr_uring_cb_t		cb;			//!< Called on completion.
+	void			*uctx;			//!< Passed to cb.
+
+	struct msghdr		msg;			//!< For sendmsg().
+	struct iovec		iov;			//!< For sendmsg().
+	struct sockaddr_storage	dst;			//!< For sendmsg().
+	uint8_t			control[URING_CONTROL_LEN];	//!< For sendmsg() with a source address.
+
+	uring_op_t		*next;			//!< Next free operation.
+};
+
+/** A multishot receive, and the buffers the kernel fills
+ *
+ */
+typedef struct {
+	uring_op_type_t		type;			//!< Must be first.
+
+	fr_uring_t		*u;			//!< Ring the receive was started on.
+	int			fd;			//!< Socket we're receiving from.
+	bool			cancelled;		//!< Whether the receive is being cancelled.
+	bool			armed;			//!< Whether the kernel has a recvmsg() outstanding.
+	bool			stopping;		//!< Whether we've asked the kernel to stop the recvmsg().
+	bool			stop_pending;		//!< No room to queue the request to stop it, try
+							///< again before the next submission.
+
+	uint16_t		bgid;			//!< Buffer group the kernel selects buffers from.
+	struct io_uring_buf_ring *br;			//!< Ring of buffers shared with the kernel.
+	unsigned int		num_buffers;		//!< Always a power of 2.
+	uint8_t			*buffers;		//!< Memory for the buffers.
+	size_t			buffer_len;		//!< Length of each buffer.
+
+	struct msghdr		msg;			//!< Tells the kernel how to lay out each buffer.
+
+	struct sockaddr_storage	local;			//!< Address the socket is bound to.
+	socklen_t		local_len;		//!< Length of local.
+
+	fr_uring_recv_cb_t	recv;			//!< Called for each datagram.
+	fr_uring_error_cb_t	error;			//!< Called if the receive fails.
+	void			*uctx;			//!< Passed to the callbacks.
+
+	fr_dlist_t		entry;			//!< Entry in the list of receives.
+} uring_recv_t;
+
+struct fr_uring_s {
+	int			fd;			//!< Of the ring.
+	fr_event_list_t		*el;			//!< Event list the ring is driven from.
+
+	void			*sq_ring;		//!< Mapped submission queue ring.
+	size_t			sq_ring_size;		//!< Size of the mapping.
+	unsigned int		*sq_khead;		//!< Consumed by the kernel up to here.
+	unsigned int		*sq_ktail;		//!< Published to the kernel up to here.
+	unsigned int		*sq_kflags;		//!< Flags set by the kernel.
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	unsigned int		sq_tail;		//!< Filled in by us up to here.
+	struct io_uring_sqe	*sqes;			//!< Mapped submission queue entries.
+	size_t			sqes_size;		//!< Size of the mapping.
+
+	void			*cq_ring;		//!< Mapped completion queue ring.
+	size_t			cq_ring_size;		//!< Size of the mapping.  0 if shared with sq_ring.
+	unsigned int		*cq_khead;		//!< Consumed by us up to here.
+	unsigned int		*cq_ktail;		//!< Filled in by the kernel up to here.
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	uring_op_t		*ops;			//!< Array of single shot operations.
+	uring_op_t		*ops_free;		//!< Operations which aren't in use.
+
+	fr_dlist_head_t		recvs;			//!< Multishot receives.
+	uint16_t		next_bgid;		//!< Next buffer group ID to use.
+	bool			recv_suspended;		//!< Don't receive until fr_uring_recv_resume() is called.
+
+	bool			buffers_registered;	//!< Whether fixed buffers have been registered.
+};
+
+static inline int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned int opcode, void const *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Return the next free submission queue entry
+ *
+ * If the submission queue is full, what's already in it is submitted.
+ */
+static struct io_uring_sqe *uring_sqe_get(fr_uring_t *u)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		idx;
+
+	if ((u->sq_tail - uring_load_acquire(u->sq_khead)) >= u->sq_entries) {
+		if (fr_uring_submit(u) < 0) return NULL;
+
+		if ((u->sq_tail - uring_load_acquire(u->sq_khead)) >= u->sq_entries) {
+			fr_strerror_const("io_uring submission queue is full");
+			return NULL;
+		}
+	}
+
+	idx = u->sq_tail & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_tail++;
+
+	return sqe;
+}
+
+/** Return a free single shot operation
+ *
+ * The number of operations is limited to the size of the completion
+ * queue, so that single shot completions can never overflow it.
+ */
+static uring_op_t *uring_op_get(fr_uring_t *u, int fd, fr_uring_cb_t cb, void *uctx)
+{
+	uring_op_t *op = u->ops_free;
+
+	if (!op) {
+		fr_strerror_const("Too many outstanding io_uring operations");
+		return NULL;
+	}
+	u->ops_free = op->next;
+
+	op->type = URING_OP_WRITE;
+	op->fd = fd;
+	op->cb = cb;
+	op->uctx = uctx;
+	op->next = NULL;
+
+	return op;
+}
+
+static inline CC_HINT(always_inline) void uring_op_release(fr_uring_t *u, uring_op_t *op)
+{
+	op->type = URING_OP_INVALID;
+	op->next = u->ops_free;
+	u->ops_free = op;
+}
+
+/** Give a buffer back to the kernel, once we're done with its contents
+ *
+ */
+static inline CC_HINT(always_inline) void uring_recv_buffer_add(uring_recv_t *rx, uint16_t bid)
+{
+	uint16_t		tail = rx->br->tail;
+	struct io_uring_buf	*buf = &rx->br->bufs[tail & (rx->num_buffers - 1)];
+
+	buf->addr = (uintptr_t)(rx->buffers + (bid * rx->buffer_len));
+	buf->len = rx->buffer_len;
+	buf->bid = bid;
+
+	uring_store_release(&rx->br->tail, (uint16_t)(tail + 1));
+}
+
+/** Queue a multishot recvmsg() for a receive
+ *
+ */
+static int uring_recv_arm(uring_recv_t *rx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe_get(rx->u);
+	if (!sqe) return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = rx->fd;
+	sqe->addr = (uintptr_t)&rx->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = rx->bgid;
+	sqe->user_data = (uintptr_t)rx;
+	rx->armed = true;
+
+	return 0;
+}
+
+/** Ask the kernel to stop a multishot recvmsg()
+ *
+ * The kernel tells us it's stopped with a final completion.  If there's
+ * no room in the submission queue, the request is queued before the
+ * next submission.
+ */
+static void uring_recv_stop(uring_recv_t *rx)
+{
+	struct io_uring_sqe *sqe;
+
+	rx->stopping = true;
+
+	sqe = uring_sqe_get(rx->u);
+	if (!sqe) {
+		rx->stop_pending = true;
+		return;
+	}
+	rx->stop_pending = false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)rx;
+	sqe->user_data = 0;
+}
+
+/** Stop the kernel using a receive's buffers, and free it
+ *
+ */
+static void uring_recv_free(uring_recv_t *rx)
+{
+	fr_uring_t		*u = rx->u;
+	struct io_uring_buf_reg	reg = { .bgid = rx->bgid };
+
+	(void) uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	fr_dlist_remove(&u->recvs, rx);
+	talloc_free(rx);
+}
+
+/** Find the address a datagram was sent to
+ *
+ * Starts with the address the socket is bound to, and replaces the IP
+ * address with a more specific one from PKTINFO, if there is one.
+ */
+static void uring_recv_dst(uring_recv_t *rx, struct sockaddr_storage *dst, int *if_index,
+			   uint8_t *control, size_t control_len)
+{
+	struct msghdr	msgh = { .msg_control = control, .msg_controllen = control_len };
+	struct cmsghdr	*cmsg;
+
+	memcpy(dst, &rx->local, rx->local_len);
+	*if_index = 0;
+
+	if (!control_len) return;
+
+	for (cmsg = CMSG_FIRSTHDR(&msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_PKTINFO) &&
+		    (dst->ss_family == AF_INET)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *) dst)->sin_addr = i->ipi_addr;
+			*if_index = i->ipi_ifindex;
+			break;
+		}
+
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_PKTINFO) &&
+		    (dst->ss_family == AF_INET6)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *) dst)->sin6_addr = i->ipi6_addr;
+			*if_index = i->ipi6_ifindex;
+			break;
+		}
+	}
+}
+
+/** Process a completion for a multishot receive
+ *
+ */
+static void uring_recv_complete(fr_uring_t *u, uring_recv_t *rx, struct io_uring_cqe const *cqe)
+{
+	bool stopped;
+
+	/*
+	 *	Datagram received.  Hand it to the caller, then
+	 *	give the buffer straight back to the kernel.
+	 */
+	if ((cqe->res >= 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		uint16_t			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint8_t				*buffer = rx->buffers + (bid * rx->buffer_len);
+		struct io_uring_recvmsg_out	*out = (struct io_uring_recvmsg_out *)buffer;
+		size_t				hdr_len, data_len, control_len;
+		socklen_t			src_len;
+		struct sockaddr_storage		dst;
+		int				if_index;
+
+		hdr_len = sizeof(*out) + rx->msg.msg_namelen + rx->msg.msg_controllen;
+		if (((size_t)cqe->res >= hdr_len) && !rx->cancelled) {
+			data_len = out->payloadlen;
+			if (data_len > ((size_t)cqe->res - hdr_len)) data_len = (size_t)cqe->res - hdr_len;
+
+			src_len = out->namelen;
+			if (src_len > rx->msg.msg_namelen) src_len = rx->msg.msg_namelen;
+
+			control_len = out->controllen;
+			if (control_len > rx->msg.msg_controllen) control_len = rx->msg.msg_controllen;
+
+			uring_recv_dst(rx, &dst, &if_index,
+				       buffer + sizeof(*out) + rx->msg.msg_namelen, control_len);
+
+			rx->recv(u, rx->fd, buffer + hdr_len, data_len,
+				 (struct sockaddr const *)(buffer + sizeof(*out)), src_len,
+				 (struct sockaddr const *)&dst, rx->local_len, if_index, rx->uctx);
+		}
+
+		uring_recv_buffer_add(rx, bid);
+	}
+
+	/*
+	 *	The kernel will keep producing completions.
+	 */
+	if (cqe->flags & IORING_CQE_F_MORE) return;
+
+	stopped = rx->stopping;
+	rx->armed = false;
+	rx->stopping = false;
+	rx->stop_pending = false;
+
+	if (rx->cancelled) {
+		uring_recv_free(rx);
+		return;
+	}
+
+	/*
+	 *	Leave datagrams in the socket until we're resumed,
+	 *	so that senders see the kernel's backpressure.
+	 */
+	if (u->recv_suspended) return;
+
+	/*
+	 *	The kernel stops a multishot receive if it runs out
+	 *	of buffers.  We've given them all back now, so start
+	 *	it again straight away, as there are likely more
+	 *	datagrams waiting.  It's also stopped if we were
+	 *	suspended, and resumed before it finished.
+	 */
+	if ((cqe->res >= 0) || (cqe->res == -ENOBUFS) || (stopped && (cqe->res == -ECANCELED))) {
+		if (uring_recv_arm(rx) == 0) {
+			if (fr_uring_submit(u) < 0) fr_perror("io_uring");
+			return;
+		}
+
+		rx->error(u, rx->fd, ENOSPC, rx->uctx);
+	} else {
+		rx->error(u, rx->fd, -cqe->res, rx->uctx);
+	}
+
+	uring_recv_free(rx);
+}
+
+/** Process completions
+ *
+ * Called automatically when the ring's file descriptor becomes readable.
+ *
+ * @param[in] u		to process completions for.
+ * @return
+ *	- The number of completions processed.
+ *	- -1 on error.
+ */
+int fr_uring_reap(fr_uring_t *u)
+{
+	unsigned int	head, tail;
+	int		count = 0;
+
+again:
+	head = *u->cq_khead;
+	tail = uring_load_acquire(u->cq_ktail);
+
+	while (head != tail) {
+		struct io_uring_cqe	cqe = u->cqes[head & u->cq_mask];
+		uring_op_type_t		*type;
+
+		/*
+		 *	Release the completion queue entry before
+		 *	running callbacks, which may queue more
+		 *	operations.
+		 */
+		head++;
+		uring_store_release(u->cq_khead, head);
+		count++;
+
+		type = (uring_op_type_t *)(uintptr_t)cqe.user_data;
+		if (!type) continue;		/* Cancellation requests */
+
+		switch (*type) {
+		case URING_OP_WRITE:
+		{
+			uring_op_t	*op = (uring_op_t *)type;
+			fr_uring_cb_t	cb = op->cb;
+			void		*uctx = op->uctx;
+			int		fd = op->fd;
+
+			uring_op_release(u, op);
+			if (cb) cb(u, fd, cqe.res, uctx);
+		}
+			break;
+
+		case URING_OP_RECV:
+			uring_recv_complete(u, (uring_recv_t *)type, &cqe);
+			break;
+
+		default:
+			fr_assert_fail("Invalid io_uring operation type %u", *type);
+			break;
+		}
+
+		tail = uring_load_acquire(u->cq_ktail);
+	}
+
+	/*
+	 *	Completions which didn't fit in the completion
+	 *	queue are held by the kernel until we ask for them.
+	 */
+	if (uring_load_acquire(u->sq_kflags) & IORING_SQ_CQ_OVERFLOW) {
+		if (uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS) < 0) {
+			fr_strerror_printf("Failed flushing io_uring completions: %s", fr_syserror(errno));
+			return -1;
+		}
+		goto again;
+	}
+
+	return count;
+}
+
+/** Submit all queued operations
+ *
+ * Called automatically once each time the event list is serviced.
+ *
+ * @param[in] u		to submit operations for.
+ * @return
+ *	- The number of operations submitted.
+ *	- -1 on error.
+ */
+int fr_uring_submit(fr_uring_t *u)
+{
+	unsigned int	to_submit;
+	int		ret;
+
+	uring_store_release(u->sq_ktail, u->sq_tail);
+
+	to_submit = u->sq_tail - uring_load_acquire(u->sq_khead);
+	if (!to_submit) return 0;
+
+	do {
+		ret = uring_enter(u->fd, to_submit, 0, 0);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0) {
+		/*
+		 *	The kernel is short of resources, or the
+		 *	completion queue needs reaping.  Try again
+		 *	on the next loop.
+		 */
+		if ((errno == EAGAIN) || (errno == EBUSY)) return 0;
+
+		fr_strerror_printf("Failed submitting io_uring operations: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return ret;
+}
+
+static void _uring_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_uring_t *u = talloc_get_type_abort(uctx, fr_uring_t);
+
+	if (fr_uring_reap(u) < 0) fr_perror("io_uring");
+}
+
+static void _uring_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, UNUSED void *uctx)
+{
+	fr_strerror_printf("io_uring file descriptor failed: %s", fr_syserror(fd_errno));
+	fr_perror("io_uring");
+}
+
+static void _uring_submit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_uring_t	*u = talloc_get_type_abort(uctx, fr_uring_t);
+	uring_recv_t	*rx = NULL;
+
+	while ((rx = fr_dlist_next(&u->recvs, rx))) {
+		if (rx->stop_pending) uring_recv_stop(rx);
+	}
+
+	if (fr_uring_submit(u) < 0) fr_perror("io_uring");
+}
+
+static int _uring_free(fr_uring_t *u)
+{
+	if (u->el) {
+		(void) fr_event_post_delete(u->el, _uring_submit, u);
+		(void) fr_event_fd_delete(u->el, u->fd, FR_EVENT_FILTER_IO);
+	}
+
+	/*
+	 *	Closing the ring cancels anything which is
+	 *	outstanding, and releases the buffers.
+	 */
+	if (u->sqes) munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring_size) munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring) munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0) close(u->fd);
+
+	return 0;
+}
+
+/** Create an io_uring instance, and drive it from an event list
+ *
+ * @note Buffers passed to operations must remain valid until the
+ *	 operation completes.  Freeing the ring cancels all operations,
+ *	 and must be done before the event list is freed.
+ *
+ * @param[in] ctx	to allocate the ring in.
+ * @param[in] el	to process submissions and completions from.
+ * @param[in] entries	Size of the submission queue.  The completion
+ *			queue is twice this size.
+ * @return
+ *	- A new ring.
+ *	- NULL if io_uring isn't available, or on error.
+ */
+fr_uring_t *fr_uring_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, unsigned int entries)
+{
+	fr_uring_t		*u;
+	struct io_uring_params	p = {};
+	unsigned int		i;
+
+	u = talloc_zero(ctx, fr_uring_t);
+	if (!u) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	u->fd = -1;
+	fr_dlist_talloc_init(&u->recvs, uring_recv_t, entry);
+	talloc_set_destructor(u, _uring_free);
+
+	u->fd = uring_setup(entries, &p);
+	if (u->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+	error:
+		talloc_free(u);
+		return NULL;
+	}
+
+	/*
+	 *	Multishot receives need provided buffer rings,
+	 *	which came after all the features we check for.
+	 */
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+		fr_strerror_const("Kernel io_uring implementation is too old");
+		goto error;
+	}
+
+	u->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	u->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+
+	/*
+	 *	Newer kernels let the two rings share one mapping.
+	 */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = 0;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+	map_error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (u->cq_ring_size) {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			u->cq_ring_size = 0;
+			goto map_error;
+		}
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto map_error;
+	}
+
+	u->sq_khead = (unsigned int *)((uint8_t *)u->sq_ring + p.sq_off.head);
+	u->sq_ktail = (unsigned int *)((uint8_t *)u->sq_ring + p.sq_off.tail);
+	u->sq_kflags = (unsigned int *)((uint8_t *)u->sq_ring + p.sq_off.flags);
+	u->sq_mask = *(unsigned int *)((uint8_t *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_tail = *u->sq_ktail;
+
+	/*
+	 *	We always fill in entries in order, so the
+	 *	indirection array never changes.
+	 */
+	for (i = 0; i < p.sq_entries; i++) {
+		((unsigned int *)((uint8_t *)u->sq_ring + p.sq_off.array))[i] = i;
+	}
+
+	u->cq_khead = (unsigned int *)((uint8_t *)u->cq_ring + p.cq_off.head);
+	u->cq_ktail = (unsigned int *)((uint8_t *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)((uint8_t *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ring + p.cq_off.cqes);
+
+	u->ops = talloc_zero_array(u, uring_op_t, p.cq_entries);
+	if (!u->ops) {
+		fr_strerror_const("Out of memory");
+		goto error;
+	}
+	for (i = 0; i < p.cq_entries; i++) uring_op_release(u, &u->ops[i]);
+
+	if (fr_event_fd_insert(u, el, u->fd, _uring_read, NULL, _uring_error, u) < 0) goto error;
+	u->el = el;
+
+	if (fr_event_post_insert(el, _uring_submit, u) < 0) goto error;
+
+	return u;
+}
+
+/** Register buffers which can be written from with #fr_uring_write_fixed
+ *
+ * The kernel pins and maps registered buffers once, instead of for every
+ * operation.  Any previously registered buffers are unregistered.
+ *
+ * @param[in] u		to register buffers with.
+ * @param[in] iov	Array of buffers.
+ * @param[in] num	Number of buffers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_buffers_register(fr_uring_t *u, struct iovec const *iov, unsigned int num)
+{
+	if (u->buffers_registered) {
+		(void) uring_register(u->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		u->buffers_registered = false;
+	}
+
+	if (uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, num) < 0) {
+		fr_strerror_printf("Failed registering io_uring buffers: %s", fr_syserror(errno));
+		return -1;
+	}
+	u->buffers_registered = true;
+
+	return 0;
+}
+
+/** Queue a write
+ *
+ * @param[in] u		to queue the write on.
+ * @param[in] fd	to write to.
+ * @param[in] data	to write.  Must remain valid until the write completes.
+ * @param[in] data_len	Length of data.
+ * @param[in] cb	Called when the write completes.  May be NULL.
+ * @param[in] uctx	Passed to cb.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_write(fr_uring_t *u, int fd, void const *data, size_t data_len, fr_uring_cb_t cb, void *uctx)
+{
+	struct io_uring_sqe	*sqe;
+	uring_op_t		*op;
+
+	op = uring_op_get(u, fd, cb, uctx);
+	if (!op) return -1;
+
+	sqe = uring_sqe_get(u);
+	if (!sqe) {
+		uring_op_release(u, op);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = data_len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = (uintptr_t)op;
+
+	return 0;
+}
+
+/** Queue a write from a registered buffer
+ *
+ * @param[in] u		to queue the write on.
+ * @param[in] fd	to write to.
+ * @param[in] data	to write.  Must be within the registered buffer.
+ * @param[in] data_len	Length of data.
+ * @param[in] buf_index	Index of the buffer passed to #fr_uring_buffers_register.
+ * @param[in] cb	Called when the write completes.  May be NULL.
+ * @param[in] uctx	Passed to cb.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_write_fixed(fr_uring_t *u, int fd, void const *data, size_t data_len, unsigned int buf_index,
+			 fr_uring_cb_t cb, void *uctx)
+{
+	struct io_uring_sqe	*sqe;
+	uring_op_t		*op;
+
+	if (!u->buffers_registered) {
+		fr_strerror_const("No io_uring buffers registered");
+		return -1;
+	}
+
+	op = uring_op_get(u, fd, cb, uctx);
+	if (!op) return -1;
+
+	sqe = uring_sqe_get(u);
+	if (!sqe) {
+		uring_op_release(u, op);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = data_len;
+	sqe->off = (uint64_t)-1;
+	sqe->buf_index = buf_index;
+	sqe->user_data = (uintptr_t)op;
+
+	return 0;
+}
+
+/** Queue a datagram to send
+ *
+ * @param[in] u		to queue the send on.
+ * @param[in] fd	to send with.
+ * @param[in] data	to send.  Must remain valid until the send completes.
+ * @param[in] data_len	Length of data.
+ * @param[in] dst	Address to send to.  Copied, so it doesn't need to
+ *			remain valid.  May be NULL for connected sockets.
+ * @param[in] dst_len	Length of dst.
+ * @param[in] cb	Called when the send completes.  May be NULL.
+ * @param[in] uctx	Passed to cb.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_sendto(fr_uring_t *u, int fd, void const *data, size_t data_len,
+		    struct sockaddr const *dst, socklen_t dst_len,
+		    fr_uring_cb_t cb, void *uctx)
+{
+	return fr_uring_sendfromto(u, fd, data, data_len, 0, NULL, 0, dst, dst_len, cb, uctx);
+}
+
+/** Queue a datagram to send from a specific address
+ *
+ * This is the io_uring equivalent of sendfromto().  Sockets bound to a
+ * wildcard address need it so that replies come from the address the
+ * request was sent to.
+ *
+ * @param[in] u		to queue the send on.
+ * @param[in] fd	to send with.
+ * @param[in] data	to send.  Must remain valid until the send completes.
+ * @param[in] data_len	Length of data.
+ * @param[in] if_index	Interface to send on.  0 lets the kernel choose.
+ * @param[in] src	Address to send from.  Copied, so it doesn't need to
+ *			remain valid.  May be NULL to use the socket's address.
+ * @param[in] src_len	Length of src.
+ * @param[in] dst	Address to send to.  Copied, so it doesn't need to
+ *			remain valid.  May be NULL for connected sockets.
+ * @param[in] dst_len	Length of dst.
+ * @param[in] cb	Called when the send completes.  May be NULL.
+ * @param[in] uctx	Passed to cb.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_sendfromto(fr_uring_t *u, int fd, void const *data, size_t data_len, int if_index,
+			struct sockaddr const *src, socklen_t src_len,
+			struct sockaddr const *dst, socklen_t dst_len,
+			fr_uring_cb_t cb, void *uctx)
+{
+	struct io_uring_sqe	*sqe;
+	uring_op_t		*op;
+
+	if (dst && (dst_len > sizeof(op->dst))) {
+		fr_strerror_const("Destination address is too long");
+		return -1;
+	}
+
+	if (src && (src_len > 0) && (src->sa_family != AF_INET) && (src->sa_family != AF_INET6)) {
+		fr_strerror_const("Source address must be IPv4 or IPv6");
+		return -1;
+	}
+
+	op = uring_op_get(u, fd, cb, uctx);
+	if (!op) return -1;
+
+	sqe = uring_sqe_get(u);
+	if (!sqe) {
+		uring_op_release(u, op);
+		return -1;
+	}
+
+	op->iov = (struct iovec){ .iov_base = UNCONST(void *, data), .iov_len = data_len };
+	op->msg = (struct msghdr){ .msg_iov = &op->iov, .msg_iovlen = 1 };
+	if (dst) {
+		memcpy(&op->dst, dst, dst_len);
+		op->msg.msg_name = &op->dst;
+		op->msg.msg_namelen = dst_len;
+	}
+
+	/*
+	 *	Same as sendfromto(), the source address is passed
+	 *	as PKTINFO.
+	 */
+	if (src && (src_len > 0)) {
+		struct cmsghdr *cmsg;
+
+		memset(op->control, 0, sizeof(op->control));
+		op->msg.msg_control = op->control;
+
+		if (src->sa_family == AF_INET) {
+			struct in_pktinfo *pkt;
+
+			op->msg.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+			cmsg = CMSG_FIRSTHDR(&op->msg);
+			cmsg->cmsg_level = SOL_IP;
+			cmsg->cmsg_type = IP_PKTINFO;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+			pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+			pkt->ipi_spec_dst = ((struct sockaddr_in const *) src)->sin_addr;
+			pkt->ipi_ifindex = if_index;
+		} else {
+			struct in6_pktinfo *pkt;
+
+			op->msg.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+			cmsg = CMSG_FIRSTHDR(&op->msg);
+			cmsg->cmsg_level = IPPROTO_IPV6;
+			cmsg->cmsg_type = IPV6_PKTINFO;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+			pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+			pkt->ipi6_addr = ((struct sockaddr_in6 const *) src)->sin6_addr;
+			pkt->ipi6_ifindex = if_index;
+		}
+	}
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&op->msg;
+	sqe->len = 1;
+	sqe->user_data = (uintptr_t)op;
+
+	return 0;
+}
+
+/** Start receiving datagrams on a socket
+ *
+ * A single multishot recvmsg() stays active in the kernel, which selects
+ * a buffer from a ring we provide for each datagram.  This replaces a
+ * readiness notification followed by a recvfrom() per packet.
+ *
+ * @param[in] u			to receive with.
+ * @param[in] fd		to receive from.
+ * @param[in] max_len		Longest datagram.  Longer datagrams are truncated.
+ * @param[in] num_buffers	Datagrams which can be received before we
+ *				have to process them.  Rounded up to a power of 2.
+ * @param[in] recv_cb		Called for each datagram.
+ * @param[in] error		Called if the receive fails.
+ * @param[in] uctx		Passed to the callbacks.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_uring_recv_multishot(fr_uring_t *u, int fd, size_t max_len, unsigned int num_buffers,
+			    fr_uring_recv_cb_t recv_cb, fr_uring_error_cb_t error, void *uctx)
+{
+	uring_recv_t		*rx;
+	struct io_uring_buf_reg	reg;
+	void			*br;
+	unsigned int		i;
+
+	if (!num_buffers || (num_buffers > URING_RECV_BUFFERS_MAX)) {
+		fr_strerror_printf("Number of buffers must be between 1 and %u", URING_RECV_BUFFERS_MAX);
+		return -1;
+	}
+
+	rx = talloc(u, uring_recv_t);
+	if (!rx) {
+	oom:
+		talloc_free(rx);
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	*rx = (uring_recv_t){
+		.type = URING_OP_RECV,
+		.u = u,
+		.fd = fd,
+		.bgid = u->next_bgid++,
+		.num_buffers = 1 << fr_high_bit_pos(num_buffers - 1),
+		.msg = { .msg_namelen = sizeof(struct sockaddr_storage), .msg_controllen = URING_CONTROL_LEN },
+		.local_len = sizeof(rx->local),
+		.recv = recv_cb,
+		.error = error,
+		.uctx = uctx
+	};
+
+	if (getsockname(fd, (struct sockaddr *)&rx->local, &rx->local_len) < 0) {
+		fr_strerror_printf("Failed getting socket address: %s", fr_syserror(errno));
+		talloc_free(rx);
+		return -1;
+	}
+	if (rx->local_len > sizeof(rx->local)) rx->local_len = sizeof(rx->local);
+
+	/*
+	 *	The kernel writes a header, then the source
+	 *	address, then any control messages, then the
+	 *	datagram into each buffer.
+	 */
+	rx->buffer_len = sizeof(struct io_uring_recvmsg_out) + rx->msg.msg_namelen + rx->msg.msg_controllen + max_len;
+	rx->buffers = talloc_array(rx, uint8_t, rx->buffer_len * rx->num_buffers);
+	if (!rx->buffers) goto oom;
+
+	if (!talloc_aligned_array(rx, &br, (size_t)getpagesize(),
+				  rx->num_buffers * sizeof(struct io_uring_buf))) goto oom;
+	memset(br, 0, rx->num_buffers * sizeof(struct io_uring_buf));
+	rx->br = br;
+
+	reg = (struct io_uring_buf_reg){
+		.ring_addr = (uintptr_t)rx->br,
+		.ring_entries = rx->num_buffers,
+		.bgid = rx->bgid
+	};
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fr_strerror_printf("Failed registering io_uring buffer ring: %s", fr_syserror(errno));
+		talloc_free(rx);
+		return -1;
+	}
+
+	for (i = 0; i < rx->num_buffers; i++) uring_recv_buffer_add(rx, i);
+
+	fr_dlist_insert_tail(&u->recvs, rx);
+
+	if (u->recv_suspended) return 0;
+
+	if (uring_recv_arm(rx) < 0) {
+		uring_recv_free(rx);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop receiving datagrams on a socket
+ *
+ * Datagrams which have already been received are discarded, and the
+ * callbacks passed to #fr_uring_recv_multishot are never called again,
+ * so their uctx can be freed as soon as this function returns.
+ *
+ * @param[in] u		the receive was started on.
+ * @param[in] fd	to stop receiving from.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no receive for the socket.
+ */
+int fr_uring_recv_cancel(fr_uring_t *u, int fd)
+{
+	uring_recv_t		*rx = NULL;
+
+	while ((rx = fr_dlist_next(&u->recvs, rx))) {
+		if ((rx->fd == fd) && !rx->cancelled) break;
+	}
+	if (!rx) {
+		fr_strerror_printf("No io_uring receive for fd %i", fd);
+		return -1;
+	}
+
+	rx->cancelled = true;
+
+	/*
+	 *	Suspended, so the kernel isn't using it.
+	 */
+	if (!rx->armed) {
+		uring_recv_free(rx);
+		return 0;
+	}
+
+	/*
+	 *	The receive is freed when the kernel tells us
+	 *	it's finished with it.
+	 */
+	if (!rx->stopping) uring_recv_stop(rx);
+
+	return 0;
+}
+
+/** Stop taking datagrams from sockets, until #fr_uring_recv_resume is called
+ *
+ * Datagrams queue in the socket buffers, and are dropped by the kernel
+ * when those are full.  Datagrams which the kernel has already received
+ * are still passed to the callbacks.
+ *
+ * @param[in] u		to suspend receives for.
+ */
+void fr_uring_recv_suspend(fr_uring_t *u)
+{
+	uring_recv_t	*rx = NULL;
+
+	if (u->recv_suspended) return;
+	u->recv_suspended = true;
+
+	while ((rx = fr_dlist_next(&u->recvs, rx))) {
+		if (rx->cancelled || !rx->armed || rx->stopping) continue;
+
+		uring_recv_stop(rx);
+	}
+}
+
+/** Start taking datagrams from sockets again
+ *
+ * @param[in] u		to resume receives for.
+ */
+void fr_uring_recv_resume(fr_uring_t *u)
+{
+	uring_recv_t	*rx = NULL, *next;
+
+	if (!u->recv_suspended) return;
+	u->recv_suspended = false;
+
+	for (rx = fr_dlist_head(&u->recvs); rx; rx = next) {
+		next = fr_dlist_next(&u->recvs, rx);
+
+		if (rx->cancelled) continue;
+
+		/*
+		 *	We never got as far as asking the kernel
+		 *	to stop, so it's still receiving.
+		 */
+		if (rx->stop_pending) {
+			rx->stop_pending = false;
+			rx->stopping = false;
+			continue;
+		}
+
+		/*
+		 *	Still stopping, or never stopped.  The
+		 *	final completion re-arms it.
+		 */
+		if (rx->armed) continue;
+
+		if (uring_recv_arm(rx) < 0) {
+			rx->error(u, rx->fd, ENOSPC, rx->uctx);
+			uring_recv_free(rx);
+		}
+	}
+}
+#endif
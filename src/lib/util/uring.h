@@ -0,0 +1,114 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifdef HAVE_LINUX_IO_URING_H
+/** Asynchronous I/O using Linux io_uring, driven from an event list
+ *
+ * @file src/lib/util/uring.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(uring_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+typedef struct fr_uring_s fr_uring_t;
+
+/** Called when a write or send completes
+ *
+ * @param[in] u		the operation was submitted to.
+ * @param[in] fd	the operation was for.
+ * @param[in] result	Bytes written on success, or a negative errno.
+ * @param[in] uctx	passed when the operation was queued.
+ */
+typedef void (*fr_uring_cb_t)(fr_uring_t *u, int fd, int result, void *uctx);
+
+/** Called for each datagram received by a multishot receive
+ *
+ * The data and addresses are only valid for the duration of the callback.
+ *
+ * @param[in] u		the receive was started on.
+ * @param[in] fd	the datagram was received on.
+ * @param[in] data	of the datagram.
+ * @param[in] data_len	Length of the datagram.
+ * @param[in] src	Address the datagram came from.
+ * @param[in] src_len	Length of src.
+ * @param[in] dst	Address the datagram was sent to.  For sockets
+ *			bound to a wildcard address, this is only specific
+ *			if IP_PKTINFO or IPV6_RECVPKTINFO are set.
+ * @param[in] dst_len	Length of dst.
+ * @param[in] if_index	Interface the datagram was received on, or 0 if unknown.
+ * @param[in] uctx	passed to #fr_uring_recv_multishot.
+ */
+typedef void (*fr_uring_recv_cb_t)(fr_uring_t *u, int fd, uint8_t const *data, size_t data_len,
+				   struct sockaddr const *src, socklen_t src_len,
+				   struct sockaddr const *dst, socklen_t dst_len, int if_index, void *uctx);
+
+/** Called when a multishot receive fails, and can't be restarted
+ *
+ * @param[in] u		the receive was started on.
+ * @param[in] fd	the receive was for.
+ * @param[in] err	errno describing the failure.
+ * @param[in] uctx	passed to #fr_uring_recv_multishot.
+ */
+typedef void (*fr_uring_error_cb_t)(fr_uring_t *u, int fd, int err, void *uctx);
+
+fr_uring_t	*fr_uring_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, unsigned int entries);
+
+int		fr_uring_buffers_register(fr_uring_t *u, struct iovec const *iov, unsigned int num) CC_HINT(nonnull);
+
+int		fr_uring_write(fr_uring_t *u, int fd, void const *data, size_t data_len,
+			       fr_uring_cb_t cb, void *uctx) CC_HINT(nonnull(1,3));
+
+int		fr_uring_write_fixed(fr_uring_t *u, int fd, void const *data, size_t data_len, unsigned int buf_index,
+				     fr_uring_cb_t cb, void *uctx) CC_HINT(nonnull(1,3));
+
+int		fr_uring_sendto(fr_uring_t *u, int fd, void const *data, size_t data_len,
+				struct sockaddr const *dst, socklen_t dst_len,
+				fr_uring_cb_t cb, void *uctx) CC_HINT(nonnull(1,3));
+
+int		fr_uring_sendfromto(fr_uring_t *u, int fd, void const *data, size_t data_len, int if_index,
+				    struct sockaddr const *src, socklen_t src_len,
+				    struct sockaddr const *dst, socklen_t dst_len,
+				    fr_uring_cb_t cb, void *uctx) CC_HINT(nonnull(1,3));
+
+int		fr_uring_recv_multishot(fr_uring_t *u, int fd, size_t max_len, unsigned int num_buffers,
+					fr_uring_recv_cb_t recv_cb, fr_uring_error_cb_t error, void *uctx)
+					CC_HINT(nonnull(1,5,6));
+
+int		fr_uring_recv_cancel(fr_uring_t *u, int fd) CC_HINT(nonnull);
+
+void		fr_uring_recv_suspend(fr_uring_t *u) CC_HINT(nonnull);
+
+void		fr_uring_recv_resume(fr_uring_t *u) CC_HINT(nonnull);
+
+int		fr_uring_submit(fr_uring_t *u) CC_HINT(nonnull);
+
+int		fr_uring_reap(fr_uring_t *u) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
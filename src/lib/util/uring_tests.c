@@ -0,0 +1,362 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the io_uring engine
+ *
+ * @file src/lib/util/uring_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/uring.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NUM_PACKETS	(100)
+
+typedef struct {
+	unsigned int		received;		//!< Datagrams received.
+	unsigned int		sent;			//!< Sends or writes which completed.
+	unsigned int		errors;			//!< Calls to the error callback.
+	int			last_result;		//!< Of the last send or write.
+
+	uint8_t			data[64];		//!< Last datagram received.
+	size_t			data_len;
+
+	struct sockaddr_storage	dst;			//!< Last destination address.
+	socklen_t		dst_len;
+	int			if_index;		//!< Last interface index.
+} test_ctx_t;
+
+static void test_recv(UNUSED fr_uring_t *u, UNUSED int fd, uint8_t const *data, size_t data_len,
+		      UNUSED struct sockaddr const *src, UNUSED socklen_t src_len,
+		      struct sockaddr const *dst, socklen_t dst_len, int if_index, void *uctx)
+{
+	test_ctx_t *t = uctx;
+
+	t->received++;
+
+	t->data_len = data_len;
+	if (t->data_len > sizeof(t->data)) t->data_len = sizeof(t->data);
+	memcpy(t->data, data, t->data_len);
+
+	t->dst_len = dst_len;
+	if (t->dst_len > sizeof(t->dst)) t->dst_len = sizeof(t->dst);
+	memcpy(&t->dst, dst, t->dst_len);
+	t->if_index = if_index;
+}
+
+static void test_error(UNUSED fr_uring_t *u, UNUSED int fd, UNUSED int err, void *uctx)
+{
+	test_ctx_t *t = uctx;
+
+	t->errors++;
+}
+
+static void test_sent(UNUSED fr_uring_t *u, UNUSED int fd, int result, void *uctx)
+{
+	test_ctx_t *t = uctx;
+
+	t->sent++;
+	t->last_result = result;
+}
+
+/** Allocate a ring, or explain why the test is being skipped
+ *
+ */
+static fr_uring_t *test_uring_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	fr_uring_t *u;
+
+	u = fr_uring_alloc(ctx, el, 64);
+	if (!u) TEST_MSG_ALWAYS("Skipping, io_uring is unavailable: %s", fr_strerror());
+
+	return u;
+}
+
+/** Run the event loop until enough operations have completed, or we give up
+ *
+ */
+static bool test_service_until(fr_uring_t *u, fr_event_list_t *el, unsigned int const *counter, unsigned int target)
+{
+	int i;
+
+	for (i = 0; (i < 5000) && (*counter < target); i++) {
+		TEST_CHECK(fr_uring_submit(u) >= 0);
+
+		if (fr_event_corral(el, fr_time(), false) > 0) {
+			fr_event_service(el);
+			continue;
+		}
+		usleep(1000);
+	}
+
+	return (*counter >= target);
+}
+
+/** Run the event loop for a while, to check nothing happens
+ *
+ */
+static void test_service_idle(fr_uring_t *u, fr_event_list_t *el)
+{
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		TEST_CHECK(fr_uring_submit(u) >= 0);
+
+		if (fr_event_corral(el, fr_time(), false) > 0) fr_event_service(el);
+		usleep(1000);
+	}
+}
+
+/** Datagrams sent with the ring are received by a multishot receive
+ *
+ */
+static void test_socketpair(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_event_list_t	*el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_uring_t	*u;
+	test_ctx_t	t = {};
+	int		sv[2];
+	unsigned int	i;
+	char		msg[NUM_PACKETS][16];	/* Have to stay valid until the sends complete */
+
+	u = test_uring_alloc(ctx, el);
+	if (!u) goto done;
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+
+	/*
+	 *	Fewer buffers than datagrams, so the receive has to be
+	 *	restarted when the kernel runs out.
+	 */
+	TEST_CHECK(fr_uring_recv_multishot(u, sv[0], 64, 8, test_recv, test_error, &t) == 0);
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		snprintf(msg[i], sizeof(msg[i]), "packet %u", i);
+		TEST_CHECK(fr_uring_sendto(u, sv[1], msg[i], strlen(msg[i]), NULL, 0, test_sent, &t) == 0);
+	}
+
+	TEST_CHECK(test_service_until(u, el, &t.sent, NUM_PACKETS));
+	TEST_MSG("Expected %u sends, got %u", NUM_PACKETS, t.sent);
+	TEST_CHECK(t.last_result > 0);
+
+	TEST_CHECK(test_service_until(u, el, &t.received, NUM_PACKETS));
+	TEST_MSG("Expected %u datagrams, got %u", NUM_PACKETS, t.received);
+	TEST_CHECK(t.errors == 0);
+
+	TEST_CHECK((t.data_len == strlen(msg[NUM_PACKETS - 1])) &&
+		   (memcmp(t.data, msg[NUM_PACKETS - 1], t.data_len) == 0));
+
+	/*
+	 *	Datagrams sent after the receive is cancelled aren't
+	 *	passed to the callback.
+	 */
+	TEST_CHECK(fr_uring_recv_cancel(u, sv[0]) == 0);
+	TEST_CHECK(fr_uring_recv_cancel(u, sv[0]) < 0);
+	TEST_CHECK(fr_uring_submit(u) >= 0);
+
+	TEST_CHECK(send(sv[1], "after", 5, 0) == 5);
+	test_service_idle(u, el);
+	TEST_CHECK(t.received == NUM_PACKETS);
+	TEST_CHECK(t.errors == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+
+done:
+	talloc_free(ctx);
+}
+
+/** Datagrams stay in the socket while receives are suspended
+ *
+ */
+static void test_suspend(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_event_list_t	*el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_uring_t	*u;
+	test_ctx_t	t = {};
+	int		sv[2];
+	unsigned int	i;
+	char		buffer[16];
+
+	u = test_uring_alloc(ctx, el);
+	if (!u) goto done;
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+	TEST_CHECK(fr_uring_recv_multishot(u, sv[0], 64, 8, test_recv, test_error, &t) == 0);
+	test_service_idle(u, el);
+
+	fr_uring_recv_suspend(u);
+	test_service_idle(u, el);
+
+	for (i = 0; i < 4; i++) TEST_CHECK(send(sv[1], "suspended", 9, 0) == 9);
+	test_service_idle(u, el);
+	TEST_CHECK(t.received == 0);
+	TEST_MSG("Expected no datagrams while suspended, got %u", t.received);
+	TEST_CHECK(t.errors == 0);
+
+	TEST_CHECK(recv(sv[0], buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT) == 9);
+
+	fr_uring_recv_resume(u);
+	TEST_CHECK(test_service_until(u, el, &t.received, 4));
+	TEST_MSG("Expected 4 datagrams after resuming, got %u", t.received);
+	TEST_CHECK(t.errors == 0);
+
+	/*
+	 *	Suspending and resuming before the kernel has
+	 *	stopped the receive leaves it running.
+	 */
+	fr_uring_recv_suspend(u);
+	fr_uring_recv_resume(u);
+	test_service_idle(u, el);
+
+	TEST_CHECK(send(sv[1], "resumed", 7, 0) == 7);
+	TEST_CHECK(test_service_until(u, el, &t.received, 5));
+	TEST_CHECK(t.errors == 0);
+
+	/*
+	 *	Cancelling a suspended receive frees it straight
+	 *	away, and it's not started again on resume.
+	 */
+	fr_uring_recv_suspend(u);
+	test_service_idle(u, el);
+	TEST_CHECK(fr_uring_recv_cancel(u, sv[0]) == 0);
+	TEST_CHECK(fr_uring_recv_cancel(u, sv[0]) < 0);
+	fr_uring_recv_resume(u);
+
+	TEST_CHECK(send(sv[1], "after", 5, 0) == 5);
+	test_service_idle(u, el);
+	TEST_CHECK(t.received == 5);
+	TEST_CHECK(t.errors == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+
+done:
+	talloc_free(ctx);
+}
+
+/** Writes, and writes from registered buffers
+ *
+ */
+static void test_write(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_event_list_t	*el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_uring_t	*u;
+	test_ctx_t	t = {};
+	int		sv[2];
+	char		fixed[16] = "fixed";
+	struct iovec	iov = { .iov_base = fixed, .iov_len = sizeof(fixed) };
+	char		buffer[16];
+
+	u = test_uring_alloc(ctx, el);
+	if (!u) goto done;
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+
+	TEST_CHECK(fr_uring_write_fixed(u, sv[1], fixed, 5, 0, test_sent, &t) < 0);
+	TEST_CHECK(fr_uring_buffers_register(u, &iov, 1) == 0);
+
+	TEST_CHECK(fr_uring_write(u, sv[1], "plain", 5, test_sent, &t) == 0);
+	TEST_CHECK(fr_uring_write_fixed(u, sv[1], fixed, 5, 0, test_sent, &t) == 0);
+	TEST_CHECK(test_service_until(u, el, &t.sent, 2));
+	TEST_CHECK(t.last_result == 5);
+
+	TEST_CHECK(recv(sv[0], buffer, sizeof(buffer), MSG_DONTWAIT) == 5);
+	TEST_CHECK(memcmp(buffer, "plain", 5) == 0);
+	TEST_CHECK(recv(sv[0], buffer, sizeof(buffer), MSG_DONTWAIT) == 5);
+	TEST_CHECK(memcmp(buffer, "fixed", 5) == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+
+done:
+	talloc_free(ctx);
+}
+
+/** Sockets bound to a wildcard address get the specific destination address
+ *
+ */
+static void test_pktinfo(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_event_list_t		*el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_uring_t		*u;
+	test_ctx_t		t = {};
+	int			rx, tx, on = 1;
+	struct sockaddr_in	addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+	struct sockaddr_in	src = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t		addr_len = sizeof(addr);
+	struct sockaddr_in	*dst;
+
+	u = test_uring_alloc(ctx, el);
+	if (!u) goto done;
+
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	TEST_ASSERT((rx >= 0) && (tx >= 0));
+
+	TEST_CHECK(setsockopt(rx, SOL_IP, IP_PKTINFO, &on, sizeof(on)) == 0);
+	TEST_CHECK(bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	TEST_CHECK(getsockname(rx, (struct sockaddr *)&addr, &addr_len) == 0);
+
+	TEST_CHECK(fr_uring_recv_multishot(u, rx, 64, 4, test_recv, test_error, &t) == 0);
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(fr_uring_sendfromto(u, tx, "hello", 5, 0,
+				       (struct sockaddr *)&src, sizeof(src),
+				       (struct sockaddr *)&addr, sizeof(addr), test_sent, &t) == 0);
+	TEST_CHECK(test_service_until(u, el, &t.received, 1));
+	TEST_CHECK(t.last_result == 5);
+
+	dst = (struct sockaddr_in *)&t.dst;
+	TEST_CHECK(t.dst_len == sizeof(*dst));
+	TEST_CHECK(dst->sin_family == AF_INET);
+	TEST_CHECK(dst->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+	TEST_MSG("Expected destination 127.0.0.1, got %s", inet_ntoa(dst->sin_addr));
+	TEST_CHECK(dst->sin_port == addr.sin_port);
+	TEST_CHECK(t.if_index > 0);
+
+	close(rx);
+	close(tx);
+
+done:
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "socketpair",		test_socketpair },
+	{ "suspend",		test_suspend },
+	{ "write",		test_write },
+	{ "pktinfo",		test_pktinfo },
+
+	{ NULL }
+};
+#else
+TEST_LIST = {
+	{ NULL }
+};
+#endif
@@ -25,6 +25,7 @@
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/util/pair_legacy.h>
 
@@ -66,9 +67,17 @@ static CONF_PARSER const proto_detail_config[] = {
 
 	{ FR_CONF_OFFSET("priority", FR_TYPE_UINT32, proto_detail_t, priority) },
 
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, proto_detail_t, format_str), .dflt = "text" },
+
 	CONF_PARSER_TERMINATOR
 };
 
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	FR_DETAIL_FORMAT_BINARY	},
+	{ L("text"),	FR_DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 static fr_dict_t const *dict_freeradius;
 
 extern fr_dict_autoload_t proto_detail_dict[];
@@ -181,6 +190,94 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 	return dl_module_instance(ctx, out, transport_cs, parent_inst, name, DL_MODULE_TYPE_SUBMODULE);
 }
 
+/** Set the original src/dst ip/port, or the dictionary, from an attribute in the entry
+ *
+ */
+static int detail_pair_apply(request_t *request, fr_pair_t const *vp)
+{
+	if ((vp->da == attr_packet_src_ip_address) ||
+	    (vp->da == attr_packet_src_ipv6_address)) {
+		request->packet->socket.inet.src_ipaddr = vp->vp_ip;
+	} else if ((vp->da == attr_packet_dst_ip_address) ||
+		   (vp->da == attr_packet_dst_ipv6_address)) {
+		request->packet->socket.inet.dst_ipaddr = vp->vp_ip;
+	} else if (vp->da == attr_packet_src_port) {
+		request->packet->socket.inet.src_port = vp->vp_uint16;
+	} else if (vp->da == attr_packet_dst_port) {
+		request->packet->socket.inet.dst_port = vp->vp_uint16;
+	} else if (vp->da == attr_protocol) {
+		request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
+		if (!request->dict) {
+			REDEBUG("Invalid protocol: %pP", vp);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Decode a binary spool record
+ *
+ * The reader has already checked the header and the checksum.
+ */
+static int detail_decode_binary(request_t *request, uint8_t const *data, size_t data_len)
+{
+	fr_detail_spool_hdr_t	hdr;
+	fr_dbuff_t		dbuff;
+	fr_pair_list_t		tmp_list;
+	fr_pair_t		*vp;
+
+	if (data_len < sizeof(hdr)) {
+		REDEBUG("Truncated record");
+		return -1;
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.length > (data_len - sizeof(hdr))) {
+		REDEBUG("Record length %u overflows the entry", hdr.length);
+		return -1;
+	}
+
+	if (hdr.protocol) {
+		request->dict = fr_dict_by_protocol_num(hdr.protocol);
+		if (!request->dict) {
+			REDEBUG("Invalid protocol %u", hdr.protocol);
+			return -1;
+		}
+	}
+
+	fr_pair_list_init(&tmp_list);
+	fr_dbuff_init(&dbuff, data + sizeof(hdr), (size_t) hdr.length);
+
+	while (fr_dbuff_remaining(&dbuff) > 0) {
+		if (fr_internal_decode_pair_dbuff(request->request_ctx, &tmp_list, request->dict, &dbuff, NULL) < 0) {
+			RPEDEBUG("Failed decoding record");
+		error:
+			fr_pair_list_free(&tmp_list);
+			return -1;
+		}
+	}
+
+	for (vp = fr_pair_list_head(&tmp_list);
+	     vp;
+	     vp = fr_pair_list_next(&tmp_list, vp)) {
+		if (detail_pair_apply(request, vp) < 0) goto error;
+	}
+
+	/*
+	 *	The original time at which we received the packet.
+	 *	We need this to properly calculate Acct-Delay-Time.
+	 */
+	MEM(vp = fr_pair_afrom_da(request->request_ctx, attr_packet_original_timestamp));
+	vp->vp_date = fr_unix_time_wrap(hdr.timestamp);
+	vp->type = VT_DATA;
+	fr_pair_append(&tmp_list, vp);
+
+	fr_pair_list_append(&request->request_pairs, &tmp_list);
+
+	return 0;
+}
+
 /** Decode the packet, and set the request->process function
  *
  */
@@ -210,6 +307,12 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->socket.inet.src_ipaddr = request->packet->socket.inet.src_ipaddr;
 	request->reply->socket.inet.dst_ipaddr = request->packet->socket.inet.src_ipaddr;
 
+	if (inst->format == FR_DETAIL_FORMAT_BINARY) {
+		if (detail_decode_binary(request, data, data_len) < 0) return -1;
+
+		return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+	}
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -304,25 +407,7 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 		/*
 		 *	Set the original src/dst ip/port
 		 */
-		if (vp) {
-			if ((vp->da == attr_packet_src_ip_address) ||
-			    (vp->da == attr_packet_src_ipv6_address)) {
-				request->packet->socket.inet.src_ipaddr = vp->vp_ip;
-			} else if ((vp->da == attr_packet_dst_ip_address) ||
-				   (vp->da == attr_packet_dst_ipv6_address)) {
-				request->packet->socket.inet.dst_ipaddr = vp->vp_ip;
-			} else if (vp->da == attr_packet_src_port) {
-				request->packet->socket.inet.src_port = vp->vp_uint16;
-			} else if (vp->da == attr_packet_dst_port) {
-				request->packet->socket.inet.dst_port = vp->vp_uint16;
-			} else if (vp->da == attr_protocol) {
-				request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
-				if (!request->dict) {
-					REDEBUG("Invalid protocol: %pP", vp);
-					goto error;
-				}
-			}
-		}
+		if (vp && (detail_pair_apply(request, vp) < 0)) goto error;
 
 	next:
 		lineno++;
@@ -492,6 +577,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	proto_detail_t 		*inst = talloc_get_type_abort(instance, proto_detail_t);
+	int			format;
 
 	/*
 	 *	The listener is inside of a virtual server.
@@ -500,6 +586,13 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	inst->cs = conf;
 	inst->self = &proto_detail;
 
+	format = fr_table_value_by_str(detail_format_table, inst->format_str, -1);
+	if (format < 0) {
+		cf_log_err(conf, "Invalid 'format' value \"%s\", expected 'text' or 'binary'", inst->format_str);
+		return -1;
+	}
+	inst->format = format;
+
 	virtual_server_dict_set(inst->server_cs, inst->dict, false);
 
 	/*
@@ -25,6 +25,7 @@
  */
 RCSIDH(detail_h, "$Id$")
 
+#include <freeradius-devel/server/detail_spool.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/retry.h>
 #include <freeradius-devel/util/dlist.h>
@@ -62,6 +63,9 @@ typedef struct {
 	uint32_t			num_messages;			//!< for message ring buffer
 	uint32_t			priority;			//!< for packet processing, larger == higher
 
+	char const			*format_str;			//!< format of the detail files, "text" or "binary"
+	fr_detail_format_t		format;				//!< parsed version of format_str
+
 	fr_schedule_t			*sc;				//!< the scheduler, where we insert new readers
 
 	fr_listen_t			*listen;			//!< The listener structure which describes
@@ -133,6 +137,8 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t const			*map;			//!< binary spool file, mapped read-only
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
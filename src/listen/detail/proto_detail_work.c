@@ -31,6 +31,8 @@
 #include "proto_detail.h"
 
 #include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #ifndef NDEBUG
@@ -140,6 +142,149 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+/** Pause reading, if we have as many outstanding packets as we're allowed
+ *
+ */
+static inline void work_pause_check(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread)
+{
+	if (thread->paused || (!thread->closing && (thread->outstanding < inst->max_outstanding))) return;
+
+	(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+	thread->paused = true;
+}
+
+/** Read the next record from a binary spool file
+ *
+ * The file is mapped into memory, so there's no need for the
+ * "leftover" handling of the text format.  Each call returns one
+ * record, and mod_read_pending() tells the network side to keep
+ * calling us until we have max_outstanding packets in flight.
+ *
+ * Records which are damaged are skipped, by searching forward for
+ * the next aligned record header.  Records which have already been
+ * marked as done are skipped.
+ */
+static ssize_t work_read_binary(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+				uint32_t *priority)
+{
+	fr_detail_spool_hdr_t const	*hdr;
+	fr_detail_entry_t		*track;
+	ssize_t				slen;
+	size_t				record_len;
+	off_t				offset;
+	bool				resync = false;
+
+	while (thread->read_offset < thread->file_size) {
+		offset = thread->read_offset;
+
+		slen = fr_detail_spool_record_check(thread->map + offset, thread->file_size - offset);
+		if (slen == 0) {
+			ERROR("proto_detail (%s): Ignoring truncated record at offset %zu in file %s",
+			      thread->name, (size_t) offset, thread->filename_work);
+			break;
+		}
+
+		if (slen < 0) {
+			if (!resync) {
+				ERROR("proto_detail (%s): Malformed record found at offset %zu in file %s",
+				      thread->name, (size_t) offset, thread->filename_work);
+				resync = true;
+			}
+			thread->read_offset += FR_DETAIL_SPOOL_ALIGN;
+			continue;
+		}
+
+		if (resync) {
+			DEBUG("%s - found next valid record at offset %zu", thread->name, (size_t) offset);
+			resync = false;
+		}
+
+		hdr = (fr_detail_spool_hdr_t const *) (thread->map + offset);
+		record_len = slen;
+		thread->read_offset += record_len;
+
+		if (hdr->state == FR_DETAIL_SPOOL_DONE) continue;
+
+		if ((record_len > buffer_len) || (record_len > inst->parent->max_packet_size)) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) offset, thread->filename_work);
+			DEBUG("Entry size %zu is greater than allowed maximum %u",
+			      record_len, inst->parent->max_packet_size);
+			continue;
+		}
+
+		memcpy(buffer, hdr, record_len);
+
+		track = talloc_zero(thread, fr_detail_entry_t);
+		track->parent = thread;
+		track->timestamp = fr_time();
+		track->id = thread->count++;
+
+		/*
+		 *	Always > 0, so mod_write() knows it can mark
+		 *	the record as done.
+		 */
+		track->done_offset = offset + offsetof(fr_detail_spool_hdr_t, state);
+
+		/*
+		 *	Retransmissions are copied from the mapped
+		 *	file, so there's no need for our own copy.
+		 */
+		if (inst->retransmit) {
+			track->packet = UNCONST(uint8_t *, thread->map + offset);
+			track->packet_len = record_len;
+		}
+
+		*packet_ctx = track;
+		*recv_time_p = track->timestamp;
+		*priority = inst->parent->priority;
+
+		thread->outstanding++;
+		thread->eof = (thread->read_offset >= thread->file_size);
+		thread->closing = thread->eof;
+		work_pause_check(inst, thread);
+
+		MPRINT("Returning NUM %u - record at offset %zu", thread->outstanding, (size_t) offset);
+		return record_len;
+	}
+
+	/*
+	 *	Nothing more to read.  The file is closed by
+	 *	mod_write() when the last reply comes back.  If there
+	 *	are no outstanding packets, it's closed now.
+	 */
+	thread->read_offset = thread->file_size;
+	thread->eof = thread->closing = true;
+	work_pause_check(inst, thread);
+
+	if (!thread->outstanding) {
+		DEBUG("%s - no more records to process", thread->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Tell the network side if we can return another packet now
+ *
+ * Only binary spool files are read one record at a time.  The text
+ * format relies on its "leftover" buffer instead.
+ */
+static size_t mod_read_pending(fr_listen_t *li)
+{
+	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
+	proto_detail_work_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_work_thread_t);
+
+	if (inst->parent->format != FR_DETAIL_FORMAT_BINARY) return 0;
+
+	if (fr_dlist_num_elements(&thread->list) > 0) return 1;
+
+	if (thread->closing || (thread->outstanding >= inst->max_outstanding)) return 0;
+
+	return (thread->read_offset < thread->file_size);
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -193,6 +338,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 *	without locking it first.  So too bad for them.
 	 */
 	if (thread->closing) {
+		if (inst->parent->format == FR_DETAIL_FORMAT_BINARY) {
+			work_pause_check(inst, thread);
+			return 0;
+		}
+
 		if (inst->track_progress) thread->read_offset = lseek(thread->fd, 0, SEEK_END);
 		return 0;
 	}
@@ -207,6 +357,10 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		return 0;
 	}
 
+	if (inst->parent->format == FR_DETAIL_FORMAT_BINARY) {
+		return work_read_binary(inst, thread, packet_ctx, recv_time_p, buffer, buffer_len, priority);
+	}
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -622,6 +776,20 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 	} else if (inst->track_progress && (track->done_offset > 0)) {
 	mark_done:
+		/*
+		 *	Binary records have a state byte in the header.
+		 *	Overwrite just that byte, so that a crash
+		 *	part-way through can't damage the record.
+		 */
+		if (inst->parent->format == FR_DETAIL_FORMAT_BINARY) {
+			uint8_t state = FR_DETAIL_SPOOL_DONE;
+
+			if (pwrite(thread->fd, &state, sizeof(state), track->done_offset) < 0) {
+				ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+			}
+			goto free_track;
+		}
+
 		/*
 		 *	Seek to the entry, mark it as done, and then seek to
 		 *	the point in the file where we were reading from.
@@ -692,10 +860,34 @@ static int mod_open(fr_listen_t *li)
 		}
 	}
 
+	/*
+	 *	Binary spool files are mapped into memory, and read
+	 *	from there.
+	 */
+	if (inst->parent->format == FR_DETAIL_FORMAT_BINARY) {
+		struct stat buf;
+
+		if (fstat(thread->fd, &buf) < 0) {
+			cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+			return -1;
+		}
+
+		thread->file_size = buf.st_size;
+		if (thread->file_size > 0) {
+			void *map;
+
+			map = mmap(NULL, thread->file_size, PROT_READ, MAP_SHARED, thread->fd, 0);
+			if (map == MAP_FAILED) {
+				cf_log_err(inst->cs, "Failed mapping %s: %s", thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+			thread->map = map;
+		}
+
 	/*
 	 *	If we're tracking progress, learn where the EOF is.
 	 */
-	if (inst->track_progress) {
+	} else if (inst->track_progress) {
 		struct stat buf;
 
 		if (fstat(thread->fd, &buf) < 0) {
@@ -741,6 +933,11 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(UNCONST(uint8_t *, thread->map), thread->file_size);
+		thread->map = NULL;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -896,6 +1093,7 @@ fr_app_io_t proto_detail_work = {
 	.open			= mod_open,
 	.close			= mod_close,
 	.read			= mod_read,
+	.read_pending		= mod_read_pending,
 	.decode			= mod_decode,
 	.write			= mod_write,
 	.event_list_set		= mod_event_list_set,
@@ -78,6 +78,8 @@ static CONF_PARSER const proto_dhcpv4_config[] = {
 			  allowed_types), .func = type_parse },
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_dhcpv4_t, io.submodule),
 	  .func = transport_parse },
+	{ FR_CONF_OFFSET("sharded", FR_TYPE_BOOL, proto_dhcpv4_t, io.sharded) } ,
+	{ FR_CONF_OFFSET("shard_by_source", FR_TYPE_BOOL, proto_dhcpv4_t, io.shard_by_source) } ,
 
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 
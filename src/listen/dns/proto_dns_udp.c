@@ -25,6 +25,7 @@
 
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/util/udp_batch.h>
 #include <freeradius-devel/util/trie.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
@@ -37,6 +38,7 @@ extern fr_app_io_t proto_dns_udp;
 typedef struct {
 	char const			*name;			//!< socket name
 	int				sockfd;
+	fr_udp_batch_t			*batch;			//!< for reading and writing multiple packets per system call.
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
@@ -53,6 +55,7 @@ typedef struct {
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			max_batch;		//!< maximum number of packets per recvmmsg() / sendmmsg().
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
 	uint16_t			port;			//!< Port to listen on.
@@ -90,6 +93,7 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_dns_udp_t, max_packet_size), .dflt = "576" } ,
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_UINT32, proto_dns_udp_t, max_batch), .dflt = "1" } ,
 	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_dns_udp_t, max_attributes), .dflt = STRINGIFY(DHCPV4_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -140,7 +144,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (thread->batch) {
+		data_size = fr_udp_batch_recv(thread->batch, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
 		return data_size;
@@ -219,7 +227,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	/*
 	 *	proto_dns takes care of suppressing do-not-respond, etc.
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	if (thread->batch) {
+		data_size = fr_udp_batch_send(thread->batch, &socket, flags, buffer, buffer_len);
+		if (data_size == 0) data_size = buffer_len;
+	} else {
+		data_size = udp_send(&socket, flags, buffer, buffer_len);
+	}
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -297,6 +310,18 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read and write multiple packets per system call.
+	 */
+	if (inst->max_batch > 1) {
+		thread->batch = fr_udp_batch_alloc(thread, sockfd, inst->max_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			PERROR("Failed allocating packet batch");
+			close(sockfd);
+			return -1;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dns_udp,
@@ -326,6 +351,30 @@ static int mod_fd_set(fr_listen_t *li, int fd)
 }
 
 
+/** Return how many packets were read by recvmmsg(), but not yet processed.
+ *
+ */
+static size_t mod_read_pending(fr_listen_t *li)
+{
+	proto_dns_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dns_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_recv_pending(thread->batch);
+}
+
+/** Write any replies queued by mod_write().
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_dns_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dns_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_flush(thread->batch);
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_dns_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dns_udp_thread_t);
@@ -374,6 +423,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, <=, 1024);
+
 	/*
 	 *	Parse and create the trie for dynamic clients, even if
 	 *	there's no dynamic clients.
@@ -457,6 +509,8 @@ fr_app_io_t proto_dns_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.read_pending		= mod_read_pending,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
@@ -0,0 +1 @@
+SUBMAKEFILES := proto_metrics.mk proto_metrics_tcp.mk libfreeradius-metrics.mk
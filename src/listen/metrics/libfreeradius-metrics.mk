@@ -0,0 +1,5 @@
+TARGET		:= libfreeradius-metrics.a
+
+SOURCES		:= metrics.c
+
+SRC_CFLAGS	:= 
@@ -0,0 +1,439 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file metrics.c
+ * @brief Print server statistics in the Prometheus / OpenMetrics text formats.
+ *
+ * Every value printed here is a counter or gauge which the thread
+ * owning it publishes for other threads to read.  Nothing is locked
+ * against the network or worker threads, and nothing is sent to them,
+ * so a scrape costs packet processing nothing but cache misses.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include "metrics.h"
+
+#define METRICS_MAX_CHANNELS	(64)
+
+typedef struct {
+	unsigned int		id;
+	int			num_stats;
+	uint64_t		stats[6];			//!< From fr_network_stats().
+	int			num_channels;
+	fr_channel_stats_t	channel[METRICS_MAX_CHANNELS];	//!< From fr_network_channel_stats().
+} metrics_network_t;
+
+typedef struct {
+	unsigned int		id;
+	int			num_stats;
+	uint64_t		stats[6];			//!< From fr_worker_stats().
+} metrics_worker_t;
+
+/** Gauges and counters of all trunks with the same name, i.e. one module in all threads
+ *
+ */
+typedef struct {
+	char const		*name;
+	uint64_t		conn[5];			//!< Indexed as trunk_conn_states.
+	uint64_t		req[4];				//!< Indexed as trunk_req_states.
+	uint64_t		req_alloc_new;
+	uint64_t		req_alloc_reused;
+} metrics_trunk_t;
+
+typedef struct {
+	char const		*name;
+	uint64_t		count;
+	uint64_t		sum;				//!< In nanoseconds.
+	fr_time_delta_t		quantile[5];			//!< Indexed as module_quantiles.
+} metrics_module_t;
+
+typedef struct {
+	metrics_network_t	*network;
+	unsigned int		num_networks;
+
+	metrics_worker_t	*worker;
+	unsigned int		num_workers;
+
+	metrics_trunk_t		*trunk;
+	unsigned int		num_trunks;
+
+	metrics_module_t	*module;
+	unsigned int		num_modules;
+
+	fr_histogram_t		*latency;			//!< Scratch space for merging module histograms.
+} metrics_t;
+
+static char const *trunk_conn_states[] = { "connecting", "active", "full", "inactive", "draining" };
+static char const *trunk_req_states[] = { "backlog", "pending", "sent", "cancel" };
+
+static double const module_quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+/** Escape label values, as described in the exposition format
+ *
+ */
+static fr_sbuff_escape_rules_t const label_escape = {
+	.name = "metrics_label",
+	.chr = '\\',
+	.subs = {
+		['"'] = '"',
+		['\\'] = '\\',
+		['\n'] = 'n'
+	}
+};
+
+static void metrics_network_walk(fr_network_t const *nr, unsigned int id, void *uctx)
+{
+	metrics_t		*m = uctx;
+	metrics_network_t	*n;
+
+	MEM(m->network = talloc_realloc(m, m->network, metrics_network_t, m->num_networks + 1));
+	n = &m->network[m->num_networks++];
+
+	n->id = id;
+	n->num_stats = fr_network_stats(nr, NUM_ELEMENTS(n->stats), n->stats);
+	n->num_channels = fr_network_channel_stats(nr, NUM_ELEMENTS(n->channel), n->channel);
+}
+
+static void metrics_worker_walk(fr_worker_t const *worker, unsigned int id, void *uctx)
+{
+	metrics_t		*m = uctx;
+	metrics_worker_t	*w;
+
+	MEM(m->worker = talloc_realloc(m, m->worker, metrics_worker_t, m->num_workers + 1));
+	w = &m->worker[m->num_workers++];
+
+	w->id = id;
+	w->num_stats = fr_worker_stats(worker, NUM_ELEMENTS(w->stats), w->stats);
+}
+
+static void metrics_trunk_walk(fr_trunk_t const *trunk, char const *name, void *uctx)
+{
+	metrics_t		*m = uctx;
+	metrics_trunk_t		*t = NULL;
+	unsigned int		i;
+
+	if (!name) name = "unknown";
+
+	for (i = 0; i < m->num_trunks; i++) {
+		if (strcmp(m->trunk[i].name, name) == 0) {
+			t = &m->trunk[i];
+			break;
+		}
+	}
+
+	if (!t) {
+		MEM(m->trunk = talloc_realloc(m, m->trunk, metrics_trunk_t, m->num_trunks + 1));
+		t = &m->trunk[m->num_trunks++];
+		memset(t, 0, sizeof(*t));
+
+		/*
+		 *	The trunk may be freed as soon as we return.
+		 */
+		MEM(t->name = talloc_strdup(m, name));
+	}
+
+	t->conn[0] += trunk->conn_connecting;
+	t->conn[1] += trunk->conn_active;
+	t->conn[2] += trunk->conn_full;
+	t->conn[3] += trunk->conn_inactive;
+	t->conn[4] += trunk->conn_draining;
+
+	t->req[0] += trunk->req_backlog;
+	t->req[1] += trunk->req_pending;
+	t->req[2] += trunk->req_sent;
+	t->req[3] += trunk->req_cancel;
+
+	t->req_alloc_new += trunk->req_alloc_new;
+	t->req_alloc_reused += trunk->req_alloc_reused;
+}
+
+static void metrics_module_walk(module_instance_t const *mi, void *uctx)
+{
+	metrics_t		*m = uctx;
+	metrics_module_t	*mod;
+	size_t			i;
+
+	/*
+	 *	Modules only have histograms after latency
+	 *	recording has been turned on for them.
+	 */
+	fr_histogram_clear(m->latency);
+	module_latency(m->latency, mi);
+	if (!m->latency->count) return;
+
+	MEM(m->module = talloc_realloc(m, m->module, metrics_module_t, m->num_modules + 1));
+	mod = &m->module[m->num_modules++];
+
+	mod->name = mi->name;
+	mod->count = m->latency->count;
+	mod->sum = m->latency->sum;
+
+	for (i = 0; i < NUM_ELEMENTS(module_quantiles); i++) {
+		mod->quantile[i] = fr_histogram_percentile(m->latency, module_quantiles[i] * 100.0);
+	}
+}
+
+/** Print the "# TYPE" and "# HELP" lines for a metric family
+ *
+ * OpenMetrics names counter families without the "_total" suffix
+ * which their samples have.  The Prometheus format uses the sample
+ * name.
+ */
+static ssize_t metrics_family(fr_sbuff_t *out, bool openmetrics, char const *name, char const *type, char const *help)
+{
+	char const *suffix = "";
+
+	if (!openmetrics && (strcmp(type, "counter") == 0)) suffix = "_total";
+
+	FR_SBUFF_IN_SPRINTF_RETURN(out, "# TYPE %s%s %s\n", name, suffix, type);
+	FR_SBUFF_IN_SPRINTF_RETURN(out, "# HELP %s%s %s\n", name, suffix, help);
+
+	return 0;
+}
+
+/** Print a label with a string value
+ *
+ */
+static ssize_t metrics_label(fr_sbuff_t *out, char const *name, char const *value)
+{
+	FR_SBUFF_IN_SPRINTF_RETURN(out, "%s=\"", name);
+	FR_SBUFF_IN_ESCAPE_BUFFER_RETURN(out, value, &label_escape);
+	FR_SBUFF_IN_CHAR_RETURN(out, '"');
+
+	return 0;
+}
+
+/** Print all of the server statistics
+ *
+ * @param[out] out		Where to write the metrics.  Should be an
+ *				sbuff which extends, as the size of the
+ *				output depends on the number of threads,
+ *				trunks, and modules.
+ * @param[in] sc		the scheduler, to find the network and worker threads.
+ * @param[in] openmetrics	use the OpenMetrics format, instead of the
+ *				Prometheus text format.
+ * @return
+ *	- The number of bytes written on success.
+ *	- <= 0 on failure.
+ */
+ssize_t fr_metrics_print(fr_sbuff_t *out, fr_schedule_t const *sc, bool openmetrics)
+{
+	fr_sbuff_t	our_out = FR_SBUFF(out);
+	metrics_t	*m;
+	unsigned int	i, j;
+	ssize_t		slen = -1;
+
+	static struct {
+		char const	*name;
+		char const	*help;
+	} const packet_counters[] = {
+		{ "received",	"Packets received." },
+		{ "sent",	"Replies sent." },
+		{ "duplicate",	"Duplicate packets received." },
+		{ "dropped",	"Packets dropped." },
+	};
+
+	MEM(m = talloc_zero(NULL, metrics_t));
+	MEM(m->latency = talloc_zero(m, fr_histogram_t));
+
+	fr_schedule_walk(sc, metrics_network_walk, metrics_worker_walk, m);
+	fr_trunk_walk(metrics_trunk_walk, m);
+	modules_walk(metrics_module_walk, m);
+
+#undef RETURN
+#define RETURN(_x) do { if ((_x) < 0) goto done; } while (0)
+
+	/*
+	 *	Network threads.
+	 */
+	for (j = 0; j < NUM_ELEMENTS(packet_counters); j++) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "freeradius_network_%s", packet_counters[j].name);
+		RETURN(metrics_family(&our_out, openmetrics, name, "counter", packet_counters[j].help));
+
+		for (i = 0; i < m->num_networks; i++) {
+			if ((int) j >= m->network[i].num_stats) continue;
+
+			RETURN(fr_sbuff_in_sprintf(&our_out, "%s_total{network=\"%u\"} %" PRIu64 "\n",
+						   name, m->network[i].id, m->network[i].stats[j]));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_network_workers", "gauge",
+			      "Workers which the network thread sends packets to."));
+	for (i = 0; i < m->num_networks; i++) {
+		if (m->network[i].num_stats < 5) continue;
+
+		RETURN(fr_sbuff_in_sprintf(&our_out, "freeradius_network_workers{network=\"%u\"} %" PRIu64 "\n",
+					   m->network[i].id, m->network[i].stats[4]));
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_network_messages_used", "gauge",
+			      "Messages in use in the message sets of the network thread's sockets."));
+	for (i = 0; i < m->num_networks; i++) {
+		if (m->network[i].num_stats < 6) continue;
+
+		RETURN(fr_sbuff_in_sprintf(&our_out, "freeradius_network_messages_used{network=\"%u\"} %" PRIu64 "\n",
+					   m->network[i].id, m->network[i].stats[5]));
+	}
+
+	/*
+	 *	Channels from network threads to workers.
+	 */
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_channel_outstanding", "gauge",
+			      "Packets sent to a worker which have not been replied to."));
+	for (i = 0; i < m->num_networks; i++) {
+		for (j = 0; j < (unsigned int) m->network[i].num_channels; j++) {
+			RETURN(fr_sbuff_in_sprintf(&our_out,
+						   "freeradius_channel_outstanding{network=\"%u\",channel=\"%u\"} %" PRIu64 "\n",
+						   m->network[i].id, j, m->network[i].channel[j].outstanding));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_channel_packets", "counter",
+			      "Packets sent to a worker."));
+	for (i = 0; i < m->num_networks; i++) {
+		for (j = 0; j < (unsigned int) m->network[i].num_channels; j++) {
+			RETURN(fr_sbuff_in_sprintf(&our_out,
+						   "freeradius_channel_packets_total{network=\"%u\",channel=\"%u\"} %" PRIu64 "\n",
+						   m->network[i].id, j, m->network[i].channel[j].packets));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_channel_signals", "counter",
+			      "Times a worker had to be woken up to read packets."));
+	for (i = 0; i < m->num_networks; i++) {
+		for (j = 0; j < (unsigned int) m->network[i].num_channels; j++) {
+			RETURN(fr_sbuff_in_sprintf(&our_out,
+						   "freeradius_channel_signals_total{network=\"%u\",channel=\"%u\"} %" PRIu64 "\n",
+						   m->network[i].id, j, m->network[i].channel[j].signals));
+		}
+	}
+
+	/*
+	 *	Worker threads.
+	 */
+	for (j = 0; j < NUM_ELEMENTS(packet_counters); j++) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "freeradius_worker_%s", packet_counters[j].name);
+		RETURN(metrics_family(&our_out, openmetrics, name, "counter", packet_counters[j].help));
+
+		for (i = 0; i < m->num_workers; i++) {
+			if ((int) j >= m->worker[i].num_stats) continue;
+
+			RETURN(fr_sbuff_in_sprintf(&our_out, "%s_total{worker=\"%u\"} %" PRIu64 "\n",
+						   name, m->worker[i].id, m->worker[i].stats[j]));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_worker_naks", "counter",
+			      "Packets which the worker refused to process."));
+	for (i = 0; i < m->num_workers; i++) {
+		if (m->worker[i].num_stats < 5) continue;
+
+		RETURN(fr_sbuff_in_sprintf(&our_out, "freeradius_worker_naks_total{worker=\"%u\"} %" PRIu64 "\n",
+					   m->worker[i].id, m->worker[i].stats[4]));
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_worker_active", "gauge",
+			      "Requests being processed by the worker."));
+	for (i = 0; i < m->num_workers; i++) {
+		if (m->worker[i].num_stats < 6) continue;
+
+		RETURN(fr_sbuff_in_sprintf(&our_out, "freeradius_worker_active{worker=\"%u\"} %" PRIu64 "\n",
+					   m->worker[i].id, m->worker[i].stats[5]));
+	}
+
+	/*
+	 *	Trunks, summed over all threads.
+	 */
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_trunk_connections", "gauge",
+			      "Trunk connections in each state."));
+	for (i = 0; i < m->num_trunks; i++) {
+		for (j = 0; j < NUM_ELEMENTS(trunk_conn_states); j++) {
+			RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_trunk_connections{"));
+			RETURN(metrics_label(&our_out, "trunk", m->trunk[i].name));
+			RETURN(fr_sbuff_in_sprintf(&our_out, ",state=\"%s\"} %" PRIu64 "\n",
+						   trunk_conn_states[j], m->trunk[i].conn[j]));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_trunk_requests", "gauge",
+			      "Trunk requests in each state."));
+	for (i = 0; i < m->num_trunks; i++) {
+		for (j = 0; j < NUM_ELEMENTS(trunk_req_states); j++) {
+			RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_trunk_requests{"));
+			RETURN(metrics_label(&our_out, "trunk", m->trunk[i].name));
+			RETURN(fr_sbuff_in_sprintf(&our_out, ",state=\"%s\"} %" PRIu64 "\n",
+						   trunk_req_states[j], m->trunk[i].req[j]));
+		}
+	}
+
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_trunk_requests_allocated", "counter",
+			      "Trunk requests allocated, either new or reused from the free list."));
+	for (i = 0; i < m->num_trunks; i++) {
+		RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_trunk_requests_allocated_total{"));
+		RETURN(metrics_label(&our_out, "trunk", m->trunk[i].name));
+		RETURN(fr_sbuff_in_sprintf(&our_out, ",source=\"new\"} %" PRIu64 "\n", m->trunk[i].req_alloc_new));
+
+		RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_trunk_requests_allocated_total{"));
+		RETURN(metrics_label(&our_out, "trunk", m->trunk[i].name));
+		RETURN(fr_sbuff_in_sprintf(&our_out, ",source=\"reused\"} %" PRIu64 "\n", m->trunk[i].req_alloc_reused));
+	}
+
+	/*
+	 *	Module latency, for modules which have it enabled.
+	 */
+	RETURN(metrics_family(&our_out, openmetrics, "freeradius_module_latency_seconds", "summary",
+			      "How long calls to a module take."));
+	for (i = 0; i < m->num_modules; i++) {
+		for (j = 0; j < NUM_ELEMENTS(module_quantiles); j++) {
+			RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_module_latency_seconds{"));
+			RETURN(metrics_label(&our_out, "module", m->module[i].name));
+			RETURN(fr_sbuff_in_sprintf(&our_out, ",quantile=\"%g\"} %.9f\n", module_quantiles[j],
+						   fr_time_delta_unwrap(m->module[i].quantile[j]) / (double) NSEC));
+		}
+
+		RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_module_latency_seconds_sum{"));
+		RETURN(metrics_label(&our_out, "module", m->module[i].name));
+		RETURN(fr_sbuff_in_sprintf(&our_out, "} %.9f\n", m->module[i].sum / (double) NSEC));
+
+		RETURN(fr_sbuff_in_strcpy(&our_out, "freeradius_module_latency_seconds_count{"));
+		RETURN(metrics_label(&our_out, "module", m->module[i].name));
+		RETURN(fr_sbuff_in_sprintf(&our_out, "} %" PRIu64 "\n", m->module[i].count));
+	}
+
+	if (openmetrics) RETURN(fr_sbuff_in_strcpy(&our_out, "# EOF\n"));
+
+	slen = fr_sbuff_set(out, &our_out);
+
+done:
+	talloc_free(m);
+
+	return slen;
+}
@@ -0,0 +1,42 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file metrics.h
+ * @brief Print server statistics in the Prometheus / OpenMetrics text formats.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/util/sbuff.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_METRICS_CONTENT_TYPE_PROMETHEUS	"text/plain; version=0.0.4; charset=utf-8"
+#define FR_METRICS_CONTENT_TYPE_OPENMETRICS	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+ssize_t	fr_metrics_print(fr_sbuff_t *out, fr_schedule_t const *sc, bool openmetrics) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
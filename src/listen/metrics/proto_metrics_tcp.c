@@ -0,0 +1,554 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_metrics_tcp.c
+ * @brief METRICS handler for HTTP over TCP.
+ *
+ * Implements just enough of HTTP/1.1 for Prometheus style scrapers.
+ * Each request is answered as soon as its headers have been read, in
+ * the network thread, and nothing is passed to a worker.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <netdb.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <sys/uio.h>
+#include "proto_metrics.h"
+
+extern fr_app_io_t proto_metrics_tcp;
+
+typedef struct {
+	char const			*name;			//!< socket name
+	int				sockfd;
+
+	fr_io_address_t			*connection;		//!< for connected sockets.
+
+	fr_stats_t			stats;			//!< statistics for this socket
+
+	RADCLIENT			radclient;		//!< for faking out clients
+} proto_metrics_tcp_thread_t;
+
+typedef struct {
+	CONF_SECTION			*cs;			//!< our configuration
+
+	fr_ipaddr_t			ipaddr;			//!< IP address to listen on.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*path;			//!< URL path which serves metrics.
+
+	uint32_t			send_buff;		//!< How big the kernel's send buffer should be.
+
+	uint16_t			port;			//!< Port to listen on.
+
+	fr_ipaddr_t			*allow;			//!< allowed networks.
+} proto_metrics_tcp_t;
+
+
+static const CONF_PARSER networks_config[] = {
+	{ FR_CONF_OFFSET("allow", FR_TYPE_COMBO_IP_PREFIX | FR_TYPE_MULTI, proto_metrics_tcp_t, allow) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+
+static const CONF_PARSER tcp_listen_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_metrics_tcp_t, ipaddr), .dflt = "127.0.0.1" },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, proto_metrics_tcp_t, ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, proto_metrics_tcp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_metrics_tcp_t, interface) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_metrics_tcp_t, port), .dflt = "9812" },
+	{ FR_CONF_OFFSET("path", FR_TYPE_STRING, proto_metrics_tcp_t, path), .dflt = "/metrics" },
+
+	{ FR_CONF_OFFSET("send_buff", FR_TYPE_UINT32, proto_metrics_tcp_t, send_buff), .dflt = "1048576" },
+
+	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Write an HTTP response
+ *
+ * The socket is non-blocking, and we're in the network thread, so
+ * we can't wait for it to become writable.  The send buffer is
+ * sized by "send_buff" so that a response normally fits in one go.
+ * If it doesn't, the scrape fails, and the connection is closed.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the response couldn't be written.
+ */
+static int metrics_reply(proto_metrics_tcp_thread_t *thread, char const *status, char const *headers,
+			 char const *body, size_t body_len, bool head, bool keep_alive)
+{
+	char		hdr[512];
+	struct iovec	iov[2];
+	int		iovcnt = 1;
+	ssize_t		hdr_len, data_size;
+
+	hdr_len = snprintf(hdr, sizeof(hdr),
+			   "HTTP/1.1 %s\r\n"
+			   "%s"
+			   "Content-Length: %zu\r\n"
+			   "Connection: %s\r\n"
+			   "\r\n",
+			   status, headers, body_len, keep_alive ? "keep-alive" : "close");
+	if ((hdr_len < 0) || ((size_t) hdr_len >= sizeof(hdr))) return -1;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdr_len;
+
+	if (!head && body_len) {
+		memcpy(&iov[1].iov_base, &body, sizeof(iov[1].iov_base));
+		iov[1].iov_len = body_len;
+		iovcnt = 2;
+	}
+
+	while (iovcnt > 0) {
+		data_size = writev(thread->sockfd, iov, iovcnt);
+		if (data_size < 0) {
+			if (errno == EINTR) continue;
+
+			DEBUG("proto_metrics_tcp - Failed writing response on %s: %s",
+			      thread->name, fr_syserror(errno));
+			return -1;
+		}
+
+		/*
+		 *	Skip over whatever was written.
+		 */
+		while ((iovcnt > 0) && ((size_t) data_size >= iov[0].iov_len)) {
+			data_size -= iov[0].iov_len;
+			if (iovcnt > 1) iov[0] = iov[1];
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov[0].iov_base = ((uint8_t *) iov[0].iov_base) + data_size;
+			iov[0].iov_len -= data_size;
+		}
+	}
+
+	thread->stats.total_responses++;
+
+	return 0;
+}
+
+/** Find a header in a request
+ *
+ * @return the value of the header, or NULL if the header wasn't found.
+ */
+static char const *metrics_header(char const *headers, char const *end, char const *name, size_t *value_len)
+{
+	size_t		name_len = strlen(name);
+	char const	*p = headers, *eol;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		if (((size_t) (eol - p) > name_len) && (strncasecmp(p, name, name_len) == 0) && (p[name_len] == ':')) {
+			p += name_len + 1;
+			while ((p < eol) && ((*p == ' ') || (*p == '\t'))) p++;
+
+			*value_len = eol - p;
+			if (*value_len && (p[*value_len - 1] == '\r')) (*value_len)--;
+			return p;
+		}
+
+		p = eol + 1;
+	}
+
+	return NULL;
+}
+
+/** Answer a request
+ *
+ * @return
+ *	- 0 if the connection should stay open.
+ *	- -1 if the connection should be closed.
+ */
+static ssize_t metrics_request(fr_listen_t *li, char const *request, size_t request_len)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+	proto_metrics_t const		*app = talloc_get_type_abort_const(li->app_instance, proto_metrics_t);
+	char const			*end = request + request_len;
+	char const			*method, *path, *version, *headers, *value;
+	size_t				method_len, path_len, version_len, value_len;
+	bool				head, keep_alive, openmetrics = false;
+	fr_sbuff_t			sbuff;
+	fr_sbuff_uctx_talloc_t		tctx;
+	ssize_t				slen;
+	int				ret;
+
+	/*
+	 *	Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+	 */
+	method = request;
+	path = memchr(method, ' ', end - method);
+	if (!path) goto bad_request;
+	method_len = path - method;
+	path++;
+
+	version = memchr(path, ' ', end - path);
+	if (!version) goto bad_request;
+	path_len = version - path;
+	version++;
+
+	headers = memchr(version, '\n', end - version);
+	if (!headers) goto bad_request;
+	version_len = headers - version;
+	if (version_len && (version[version_len - 1] == '\r')) version_len--;
+	headers++;
+
+	if ((version_len != 8) || (strncmp(version, "HTTP/1.", 7) != 0)) {
+	bad_request:
+		DEBUG("proto_metrics_tcp - Malformed request on %s", thread->name);
+		thread->stats.total_malformed_requests++;
+		(void) metrics_reply(thread, "400 Bad Request", "", NULL, 0, false, false);
+		return -1;
+	}
+
+	thread->stats.total_requests++;
+
+	/*
+	 *	HTTP/1.1 connections are persistent unless the client
+	 *	says otherwise.  HTTP/1.0 connections aren't.
+	 */
+	keep_alive = (version[7] == '1');
+	value = metrics_header(headers, end, "Connection", &value_len);
+	if (value) {
+		if ((value_len == 5) && (strncasecmp(value, "close", 5) == 0)) keep_alive = false;
+		if ((value_len == 10) && (strncasecmp(value, "keep-alive", 10) == 0)) keep_alive = true;
+	}
+
+	if ((method_len == 3) && (strncmp(method, "GET", 3) == 0)) {
+		head = false;
+
+	} else if ((method_len == 4) && (strncmp(method, "HEAD", 4) == 0)) {
+		head = true;
+
+	} else {
+		if (metrics_reply(thread, "405 Method Not Allowed", "Allow: GET, HEAD\r\n",
+				  NULL, 0, false, keep_alive) < 0) return -1;
+		return keep_alive ? 0 : -1;
+	}
+
+	/*
+	 *	Ignore any query string.
+	 */
+	value = memchr(path, '?', path_len);
+	if (value) path_len = value - path;
+
+	if ((path_len != strlen(inst->path)) || (strncmp(path, inst->path, path_len) != 0)) {
+		if (metrics_reply(thread, "404 Not Found", "", NULL, 0, head, keep_alive) < 0) return -1;
+		return keep_alive ? 0 : -1;
+	}
+
+	/*
+	 *	Scrapers which understand OpenMetrics ask for it.
+	 */
+	value = metrics_header(headers, end, "Accept", &value_len);
+	if (value && memmem(value, value_len, "application/openmetrics-text", 28)) openmetrics = true;
+
+	DEBUG2("proto_metrics_tcp - Received %.*s %.*s on %s",
+	       (int) method_len, method, (int) path_len, path, thread->name);
+
+	if (!fr_sbuff_init_talloc(thread, &sbuff, &tctx, 16384, SIZE_MAX)) return -1;
+
+	slen = fr_metrics_print(&sbuff, app->sc, openmetrics);
+	if (slen <= 0) {
+		talloc_free(sbuff.buff);
+		if (metrics_reply(thread, "500 Internal Server Error", "", NULL, 0, head, false) < 0) return -1;
+		return -1;
+	}
+
+	ret = metrics_reply(thread, "200 OK",
+			    openmetrics ? "Content-Type: " FR_METRICS_CONTENT_TYPE_OPENMETRICS "\r\n" :
+					  "Content-Type: " FR_METRICS_CONTENT_TYPE_PROMETHEUS "\r\n",
+			    fr_sbuff_start(&sbuff), fr_sbuff_used(&sbuff), head, keep_alive);
+	talloc_free(sbuff.buff);
+
+	if (ret < 0) return -1;
+
+	return keep_alive ? 0 : -1;
+}
+
+static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, UNUSED fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+	ssize_t				data_size;
+	size_t				in_buffer;
+	uint8_t				*end;
+
+	/*
+	 *      Read data into the buffer.
+	 */
+	data_size = read(thread->sockfd, buffer + *leftover, buffer_len - *leftover);
+	if (data_size < 0) {
+		PDEBUG2("proto_metrics_tcp got read error %zd", data_size);
+		return data_size;
+	}
+
+	/*
+	 *	TCP read of zero means the socket is dead.
+	 */
+	if (!data_size) {
+		DEBUG2("proto_metrics_tcp - other side closed the socket.");
+		return -1;
+	}
+
+	in_buffer = data_size + *leftover;
+
+	/*
+	 *	Wait until we have all of the headers.
+	 */
+	end = memmem(buffer, in_buffer, "\r\n\r\n", 4);
+	if (!end) {
+		if (in_buffer >= buffer_len) {
+			DEBUG("proto_metrics_tcp - Request headers on %s are larger than 'limit { max_packet_size }'", thread->name);
+			return -1;
+		}
+
+		*leftover = in_buffer;
+		return 0;
+	}
+
+	/*
+	 *	Scrapers don't send bodies, and don't pipeline
+	 *	requests, so anything after the headers is discarded.
+	 */
+	*leftover = 0;
+
+	/*
+	 *	Always return 0, so that the network side never sends
+	 *	anything to a worker.
+	 */
+	return metrics_request(li, (char const *) buffer, (end - buffer) + 2);
+}
+
+
+static ssize_t mod_write(UNUSED fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_time_t request_time,
+			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	/*
+	 *	Responses are written by mod_read(), workers never
+	 *	send us anything.
+	 */
+	return buffer_len;
+}
+
+
+static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	thread->connection = connection;
+	return 0;
+}
+
+
+static void mod_network_get(UNUSED void *instance, int *ipproto, bool *dynamic_clients, fr_trie_t const **trie)
+{
+	*ipproto = IPPROTO_TCP;
+	*dynamic_clients = false;
+	*trie = NULL;
+}
+
+
+/** Open a TCP listener for METRICS
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_metrics_tcp_t const      	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	int				sockfd;
+	uint16_t			port = inst->port;
+	CONF_SECTION			*server_cs;
+
+	fr_assert(!thread->connection);
+
+	li->fd = sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, NULL, true);
+	if (sockfd < 0) {
+		PERROR("Failed opening TCP socket");
+	error:
+		return -1;
+	}
+
+	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
+		close(sockfd);
+		PERROR("Failed binding socket");
+		goto error;
+	}
+
+	if (listen(sockfd, 8) < 0) {
+		close(sockfd);
+		PERROR("Failed listening on socket");
+		goto error;
+	}
+
+	thread->sockfd = sockfd;
+
+	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
+
+	server_cs = cf_item_to_section(cf_parent(cf_parent(inst->cs)));
+
+	thread->name = fr_app_io_socket_name(thread, &proto_metrics_tcp,
+					     NULL, 0,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	/*
+	 *	Set up the fake client
+	 */
+	thread->radclient.longname = thread->name;
+	thread->radclient.ipaddr.af = inst->ipaddr.af;
+	thread->radclient.src_ipaddr.af = inst->ipaddr.af;
+
+	thread->radclient.server_cs = server_cs;
+	thread->radclient.server = cf_section_name2(server_cs);
+
+	return 0;
+}
+
+
+/** Set the file descriptor for this socket.
+ */
+static int mod_fd_set(fr_listen_t *li, int fd)
+{
+	proto_metrics_tcp_t const  *inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+	int			   size = inst->send_buff;
+
+	thread->sockfd = fd;
+
+	thread->name = fr_app_io_socket_name(thread, &proto_metrics_tcp,
+					     &thread->connection->socket.inet.src_ipaddr, thread->connection->socket.inet.src_port,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	/*
+	 *	Responses are written in one go, see metrics_reply().
+	 */
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+		WARN("proto_metrics_tcp - Failed setting 'SO_SNDBUF' on %s: %s", thread->name, fr_syserror(errno));
+	}
+
+	return 0;
+}
+
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	return thread->name;
+}
+
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	proto_metrics_tcp_t	*inst = talloc_get_type_abort(instance, proto_metrics_tcp_t);
+	size_t			i, num;
+
+	inst->cs = cs;
+
+	if (!inst->port) {
+		cf_log_err(cs, "No 'port' was specified in the 'tcp' section");
+		return -1;
+	}
+
+	if (inst->path[0] != '/') {
+		cf_log_err(cs, "The 'path' must start with '/'");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, 65536);
+	FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, INT_MAX);
+
+	num = talloc_array_length(inst->allow);
+	for (i = 0; i < num; i++) {
+		if (inst->allow[i].af != inst->ipaddr.af) {
+			cf_log_err(cs, "Address family in entry %zd - 'allow = %pV' does not match 'ipaddr'",
+				   i + 1, fr_box_ipaddr(inst->allow[i]));
+			return -1;
+		}
+
+		fr_ipaddr_mask(&inst->allow[i], inst->allow[i].prefix);
+	}
+
+	return 0;
+}
+
+/** Accept connections from any address, unless "allow" networks are configured
+ *
+ */
+static RADCLIENT *mod_client_find(fr_listen_t *li, fr_ipaddr_t const *ipaddr, UNUSED int ipproto)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t    	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+	size_t				i, num;
+
+	num = talloc_array_length(inst->allow);
+	if (!num) return &thread->radclient;
+
+	for (i = 0; i < num; i++) {
+		fr_ipaddr_t network = *ipaddr;
+
+		if (network.af != inst->allow[i].af) continue;
+
+		fr_ipaddr_mask(&network, inst->allow[i].prefix);
+		network.scope_id = inst->allow[i].scope_id;
+
+		if (fr_ipaddr_cmp(&network, &inst->allow[i]) == 0) return &thread->radclient;
+	}
+
+	DEBUG("proto_metrics_tcp - Refusing connection from %pV, which is not in an 'allow' network",
+	      fr_box_ipaddr(*ipaddr));
+
+	return NULL;
+}
+
+fr_app_io_t proto_metrics_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "metrics_tcp",
+	.config			= tcp_listen_config,
+	.inst_size		= sizeof(proto_metrics_tcp_t),
+	.thread_inst_size	= sizeof(proto_metrics_tcp_thread_t),
+	.bootstrap		= mod_bootstrap,
+
+	.default_message_size	= 4096,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.fd_set			= mod_fd_set,
+	.connection_set		= mod_connection_set,
+	.network_get		= mod_network_get,
+	.client_find		= mod_client_find,
+	.get_name		= mod_name,
+};
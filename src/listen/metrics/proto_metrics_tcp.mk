@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_metrics_tcp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_metrics_tcp.c
+
+TGT_PREREQS	:= libfreeradius-metrics.a
@@ -73,6 +73,8 @@ static CONF_PARSER const proto_radius_config[] = {
 			  allowed_types), .func = type_parse },
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_radius_t, io.submodule),
 	  .func = transport_parse },
+	{ FR_CONF_OFFSET("sharded", FR_TYPE_BOOL, proto_radius_t, io.sharded) } ,
+	{ FR_CONF_OFFSET("shard_by_source", FR_TYPE_BOOL, proto_radius_t, io.shard_by_source) } ,
 
 	/*
 	 *	Check whether or not the *trailing* bits of a
@@ -80,6 +82,12 @@ static CONF_PARSER const proto_radius_config[] = {
 	 */
 	{ FR_CONF_OFFSET("tunnel_password_zeros", FR_TYPE_BOOL, proto_radius_t, tunnel_password_zeros) } ,
 
+	/*
+	 *	Send all packets in a multi-round conversation
+	 *	(e.g. EAP) to the same worker thread.
+	 */
+	{ FR_CONF_OFFSET("session_affinity", FR_TYPE_BOOL, proto_radius_t, session_affinity) } ,
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) priority_config },
 
@@ -441,6 +449,37 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[0]];
 }
 
+/** Associate packets with the same State attribute
+ *
+ *  The first packet of a conversation has no State, and can go to
+ *  any worker.  All of the following packets carry the State which
+ *  was sent in the first reply, and go to the same worker.
+ */
+static uint32_t mod_affinity_get(void const *instance, uint8_t const *buffer, size_t buflen)
+{
+	proto_radius_t const	*inst = talloc_get_type_abort_const(instance, proto_radius_t);
+	uint8_t const		*attr, *end;
+
+	if (!inst->session_affinity || (buflen < RADIUS_HEADER_LENGTH)) return 0;
+
+	attr = buffer + RADIUS_HEADER_LENGTH;
+	end = buffer + buflen;
+
+	/*
+	 *	The packet has already been verified by the
+	 *	transport, so the attribute lengths are sane.
+	 */
+	while ((attr + 2) <= end) {
+		if (attr[1] < 2) return 0;
+
+		if (attr[0] == FR_STATE) return fr_hash(attr + 2, attr[1] - 2);
+
+		attr += attr[1];
+	}
+
+	return 0;
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -595,5 +634,6 @@ fr_app_t proto_radius = {
 	.open			= mod_open,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.affinity		= mod_affinity_get
 };
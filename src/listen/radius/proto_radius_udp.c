@@ -25,19 +25,39 @@
 #include <netdb.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/util/udp_batch.h>
 #include <freeradius-devel/util/trie.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/network.h>
 #include <freeradius-devel/io/schedule.h>
 
 #include "proto_radius.h"
 
 extern fr_app_io_t proto_radius_udp;
 
+/** Datagrams which io_uring can receive before we process them
+ *
+ */
+#define URING_RECV_BUFFERS	(128)
+
 typedef struct {
 	char const			*name;			//!< socket name
 	int				sockfd;
+	fr_udp_batch_t			*batch;			//!< for reading and writing multiple packets per system call.
+
+#ifdef HAVE_LINUX_IO_URING_H
+	fr_uring_t			*uring;			//!< for receiving and sending packets, if the
+								///< network has one.
+	fr_network_t			*nr;			//!< network we tell about datagrams received by the ring.
+	fr_listen_t			*parent;		//!< listener the network knows about.
+
+	uint8_t const			*uring_data;		//!< datagram received by the ring, and not yet read.
+	size_t				uring_data_len;		//!< length of uring_data.
+	fr_socket_t			uring_socket;		//!< addresses for uring_data.
+	fr_time_t			uring_recv_time;	//!< when uring_data was received.
+#endif
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 	fr_hash_table_t			*sessions;		//!< hash of states for multiple rounds
@@ -67,6 +87,7 @@ typedef struct {
 	uint32_t			send_buff;		//!< How big the kernel's send buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			max_batch;		//!< maximum number of packets per recvmmsg() / sendmmsg().
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
 	uint16_t			port;			//!< Port to listen on.
@@ -113,6 +134,7 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_radius_udp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_UINT32, proto_radius_udp_t, max_batch), .dflt = "1" } ,
        	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_radius_udp_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -145,7 +167,27 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+#ifdef HAVE_LINUX_IO_URING_H
+	/*
+	 *	Called from mod_uring_recv(), so the datagram has
+	 *	already been received.
+	 */
+	if (thread->uring_data) {
+		data_size = thread->uring_data_len;
+		if ((size_t) data_size > buffer_len) data_size = buffer_len;
+
+		memcpy(buffer, thread->uring_data, data_size);
+		address->socket = thread->uring_socket;
+		*recv_time_p = thread->uring_recv_time;
+
+		thread->uring_data = NULL;
+	} else
+#endif
+	if (thread->batch) {
+		data_size = fr_udp_batch_recv(thread->batch, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		PDEBUG2("proto_radius_udp got read error");
 		return data_size;
@@ -230,6 +272,45 @@ static uint8_t const *state_find(uint8_t const *packet, size_t packet_len)
 	return NULL;
 }
 
+#ifdef HAVE_LINUX_IO_URING_H
+static void mod_uring_sent(UNUSED fr_uring_t *u, UNUSED int fd, int result, void *uctx)
+{
+	if (result < 0) DEBUG2("proto_radius_udp failed sending reply: %s", fr_syserror(-result));
+
+	talloc_free(uctx);
+}
+
+/** Queue a reply on the ring
+ *
+ * The ring needs the reply until it's been sent, so it's copied.  If the
+ * reply can't be queued, it's sent immediately instead.
+ */
+static ssize_t udp_uring_send(proto_radius_udp_thread_t *thread, fr_socket_t const *socket, int flags,
+			      uint8_t const *packet, size_t packet_len)
+{
+	struct sockaddr_storage	src, dst;
+	socklen_t		src_len, dst_len;
+	uint8_t			*copy;
+
+	if ((fr_ipaddr_to_sockaddr(&src, &src_len, &socket->inet.src_ipaddr, socket->inet.src_port) < 0) ||
+	    (fr_ipaddr_to_sockaddr(&dst, &dst_len, &socket->inet.dst_ipaddr, socket->inet.dst_port) < 0)) {
+		goto send;
+	}
+
+	MEM(copy = talloc_memdup(thread->uring, packet, packet_len));
+
+	if (fr_uring_sendfromto(thread->uring, socket->fd, copy, packet_len, socket->inet.ifindex,
+				(struct sockaddr *)&src, src_len, (struct sockaddr *)&dst, dst_len,
+				mod_uring_sent, copy) < 0) {
+		talloc_free(copy);
+	send:
+		return udp_send(socket, flags, UNCONST(uint8_t *, packet), packet_len);
+	}
+
+	return packet_len;
+}
+#endif
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -273,6 +354,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
+#ifdef HAVE_LINUX_IO_URING_H
+			if (thread->uring) {
+				(void) udp_uring_send(thread, &socket, flags, (uint8_t *) packet, track->reply_len);
+				return buffer_len;
+			}
+#endif
 			(void) udp_send(&socket, flags, packet, track->reply_len);
 		}
 
@@ -288,7 +375,17 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+#ifdef HAVE_LINUX_IO_URING_H
+	if (thread->uring) {
+		data_size = udp_uring_send(thread, &socket, flags, buffer, buffer_len);
+	} else
+#endif
+	if (thread->batch) {
+		data_size = fr_udp_batch_send(thread->batch, &socket, flags, buffer, buffer_len);
+		if (data_size == 0) data_size = buffer_len;
+	} else {
+		data_size = udp_send(&socket, flags, buffer, buffer_len);
+	}
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -470,6 +567,18 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read and write multiple packets per system call.
+	 */
+	if (inst->max_batch > 1) {
+		thread->batch = fr_udp_batch_alloc(thread, sockfd, inst->max_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			PERROR("Failed allocating packet batch");
+			close(sockfd);
+			return -1;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_udp,
@@ -571,6 +680,143 @@ static int mod_track_compare(void const *instance, UNUSED void *thread_instance,
 }
 
 
+#ifdef HAVE_LINUX_IO_URING_H
+/** Hand a datagram received by the ring to the network
+ *
+ * The network calls mod_read() straight away, which copies the datagram
+ * into the network's message buffer.
+ */
+static void mod_uring_recv(UNUSED fr_uring_t *u, UNUSED int fd, uint8_t const *data, size_t data_len,
+			   struct sockaddr const *src, socklen_t src_len,
+			   struct sockaddr const *dst, socklen_t dst_len, int if_index, void *uctx)
+{
+	fr_listen_t			*li = talloc_get_type_abort(uctx, fr_listen_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	thread->uring_socket = (fr_socket_t){
+		.fd = thread->sockfd,
+		.proto = IPPROTO_UDP,
+		.inet.ifindex = if_index
+	};
+
+	if ((fr_ipaddr_from_sockaddr(&thread->uring_socket.inet.src_ipaddr, &thread->uring_socket.inet.src_port,
+				     (struct sockaddr_storage const *)src, src_len) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&thread->uring_socket.inet.dst_ipaddr, &thread->uring_socket.inet.dst_port,
+				     (struct sockaddr_storage const *)dst, dst_len) < 0)) {
+		PDEBUG2("proto_radius_udp got datagram with invalid address");
+		return;
+	}
+
+	thread->uring_data = data;
+	thread->uring_data_len = data_len;
+	thread->uring_recv_time = fr_time();
+
+	fr_network_listen_read(thread->nr, thread->parent);
+
+	/*
+	 *	The network couldn't read it, e.g. it was out of
+	 *	message buffers.  That's the same as the kernel
+	 *	dropping it.
+	 */
+	if (thread->uring_data) {
+		thread->uring_data = NULL;
+		thread->stats.total_packets_dropped++;
+	}
+}
+
+static void mod_uring_error(UNUSED fr_uring_t *u, UNUSED int fd, int err, void *uctx)
+{
+	fr_listen_t			*li = talloc_get_type_abort(uctx, fr_listen_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	ERROR("proto_radius_udp - Stopped receiving with io_uring on %s: %s", thread->name, fr_syserror(err));
+
+	/*
+	 *	Go back to reading the socket when it's readable.
+	 */
+	(void) fr_network_listen_read_events(thread->nr, thread->parent, true);
+}
+
+/** Start receiving packets with the network's io_uring, if it has one
+ *
+ * The network then stops watching the socket, and the ring tells it when
+ * there are packets to read.
+ */
+static void mod_event_list_set(fr_listen_t *li, UNUSED fr_event_list_t *el, void *nr)
+{
+	proto_radius_udp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_radius_udp_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+	fr_uring_t			*uring;
+
+	/*
+	 *	Connected sockets are only read when the parent
+	 *	socket receives a packet for them.
+	 */
+	if (thread->connection) return;
+
+	uring = fr_network_uring(nr);
+	if (!uring) return;
+
+	thread->nr = nr;
+	thread->parent = talloc_parent(li);
+
+	if (fr_uring_recv_multishot(uring, thread->sockfd, inst->max_packet_size, URING_RECV_BUFFERS,
+				    mod_uring_recv, mod_uring_error, li) < 0) {
+		PWARN("proto_radius_udp - Not using io_uring for %s", thread->name);
+		return;
+	}
+
+	thread->uring = uring;
+
+	(void) fr_network_listen_read_events(nr, thread->parent, false);
+
+	DEBUG2("proto_radius_udp - Using io_uring for %s", thread->name);
+}
+
+static int mod_close(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	/*
+	 *	Once cancelled, the ring never calls us again, even
+	 *	if the kernel hasn't finished with the receive.  It
+	 *	only fails if the receive already stopped with an
+	 *	error.
+	 */
+	if (thread->uring && (fr_uring_recv_cancel(thread->uring, thread->sockfd) < 0)) {
+		PDEBUG2("proto_radius_udp - Not cancelling io_uring receive for %s", thread->name);
+	}
+
+	close(li->fd);
+
+	return 0;
+}
+#endif
+
+/** Return how many packets were read by recvmmsg(), but not yet processed.
+ *
+ */
+static size_t mod_read_pending(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_recv_pending(thread->batch);
+}
+
+/** Write any replies queued by mod_write().
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_flush(thread->batch);
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -609,6 +855,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -691,6 +940,9 @@ fr_app_io_t proto_radius_udp = {
 	.inst_size		= sizeof(proto_radius_udp_t),
 	.thread_inst_size	= sizeof(proto_radius_udp_thread_t),
 	.bootstrap		= mod_bootstrap,
+#ifdef HAVE_LINUX_IO_URING_H
+	.event_list_set		= mod_event_list_set,
+#endif
 
 	.default_message_size	= 4096,
 	.track_duplicates	= true,
@@ -698,6 +950,11 @@ fr_app_io_t proto_radius_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.read_pending		= mod_read_pending,
+	.flush			= mod_flush,
+#ifdef HAVE_LINUX_IO_URING_H
+	.close			= mod_close,
+#endif
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
@@ -57,6 +57,8 @@ static const CONF_PARSER proto_tacacs_config[] = {
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL),
 	  .subcs = (void const *) priority_config },
 
+	{ FR_CONF_OFFSET("session_affinity", FR_TYPE_BOOL, proto_tacacs_t, session_affinity) } ,
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -423,6 +425,21 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[1]];
 }
 
+/** Associate packets with the same session_id
+ *
+ *  Every packet in a TACACS+ session carries the same session_id in
+ *  the (unencrypted) header, so all of them go to the same worker.
+ */
+static uint32_t mod_affinity_get(void const *instance, uint8_t const *buffer, size_t buflen)
+{
+	proto_tacacs_t const		*inst = talloc_get_type_abort_const(instance, proto_tacacs_t);
+	fr_tacacs_packet_t const	*pkt = (fr_tacacs_packet_t const *) buffer;
+
+	if (!inst->session_affinity || (buflen < sizeof(pkt->hdr))) return 0;
+
+	return fr_hash(&pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -567,5 +584,6 @@ fr_app_t proto_tacacs = {
 	.open			= mod_open,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.affinity		= mod_affinity_get
 };
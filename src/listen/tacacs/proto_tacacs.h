@@ -39,6 +39,8 @@ typedef struct {
 	uint32_t		num_messages;			//!< for message ring buffer.
 
 	uint32_t		priorities[FR_TACACS_CODE_MAX];	//!< priorities for individual packets
+
+	bool			session_affinity;		//!< send packets with the same session_id to the same worker.
 } proto_tacacs_t;
 
 /*
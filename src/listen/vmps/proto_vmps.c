@@ -70,6 +70,8 @@ static CONF_PARSER const proto_vmps_config[] = {
 			  allowed_types), .func = type_parse },
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_vmps_t, io.submodule),
 	  .func = transport_parse },
+	{ FR_CONF_OFFSET("sharded", FR_TYPE_BOOL, proto_vmps_t, io.sharded) } ,
+	{ FR_CONF_OFFSET("shard_by_source", FR_TYPE_BOOL, proto_vmps_t, io.shard_by_source) } ,
 
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) priority_config },
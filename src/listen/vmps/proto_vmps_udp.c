@@ -25,6 +25,7 @@
 #include <netdb.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/util/udp_batch.h>
 #include <freeradius-devel/util/trie.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
@@ -40,6 +41,7 @@ typedef struct {
 	char const			*name;			//!< socket name
 
 	int				sockfd;
+	fr_udp_batch_t			*batch;			//!< for reading and writing multiple packets per system call.
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
@@ -57,6 +59,7 @@ typedef struct {
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			max_batch;		//!< maximum number of packets per recvmmsg() / sendmmsg().
 
 	uint16_t			port;			//!< Port to listen on.
 
@@ -95,6 +98,7 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_vmps_udp_t, max_packet_size), .dflt = "1024" } ,
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_UINT32, proto_vmps_udp_t, max_batch), .dflt = "1" } ,
 
 	CONF_PARSER_TERMINATOR
 };
@@ -126,7 +130,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (thread->batch) {
+		data_size = fr_udp_batch_recv(thread->batch, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		PDEBUG2("proto_vmps_udp got read error %zd", data_size);
 		return data_size;
@@ -246,7 +254,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're VMPS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	if (thread->batch) {
+		data_size = fr_udp_batch_send(thread->batch, &socket, flags, buffer, buffer_len);
+		if (data_size == 0) data_size = buffer_len;
+	} else {
+		data_size = udp_send(&socket, flags, buffer, buffer_len);
+	}
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -317,6 +330,18 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read and write multiple packets per system call.
+	 */
+	if (inst->max_batch > 1) {
+		thread->batch = fr_udp_batch_alloc(thread, sockfd, inst->max_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			PERROR("Failed allocating packet batch");
+			close(sockfd);
+			return -1;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_vmps_udp,
@@ -412,6 +437,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 32);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_batch", inst->max_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -494,6 +522,30 @@ static RADCLIENT *mod_client_find(fr_listen_t *li, fr_ipaddr_t const *ipaddr, in
 	return client_find(NULL, ipaddr, ipproto);
 }
 
+/** Return how many packets were read by recvmmsg(), but not yet processed.
+ *
+ */
+static size_t mod_read_pending(fr_listen_t *li)
+{
+	proto_vmps_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_vmps_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_recv_pending(thread->batch);
+}
+
+/** Write any replies queued by mod_write().
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_vmps_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_vmps_udp_thread_t);
+
+	if (!thread->batch) return 0;
+
+	return fr_udp_batch_flush(thread->batch);
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_vmps_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_vmps_udp_thread_t);
@@ -515,6 +567,8 @@ fr_app_io_t proto_vmps_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.read_pending		= mod_read_pending,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
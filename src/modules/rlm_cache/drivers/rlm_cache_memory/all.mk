@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_memory.a
+SOURCES		:= rlm_cache_memory.c
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,638 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_memory.c
+ * @brief Sharded in memory cache.
+ *
+ * Entries are spread over a number of shards by a hash of their key.  Each
+ * shard has its own mutex, hash table, expiry heap, and CLOCK list, so that
+ * workers looking up different keys rarely contend with each other.
+ *
+ * The shard for a key is locked the first time the key is used, and stays
+ * locked until the handle is released.  rlm_cache only ever uses one key
+ * per handle.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#define LOG_PREFIX "cache - memory"
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/heap.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	uint32_t		hash;		//!< Hash of the key.
+	size_t			size;		//!< Memory used by the entry when it was inserted.
+	bool			referenced;	//!< Found since the CLOCK hand last passed this entry.
+
+	fr_heap_index_t		heap_id;	//!< Offset used for expiry heap.
+	fr_dlist_t		clock_entry;	//!< Entry in the CLOCK list.
+} rlm_cache_memory_entry_t;
+
+/** One independently locked part of the cache
+ *
+ * The counters are only modified with the mutex held, but are atomic so
+ * that they can be read without it.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protect the shard from multiple readers/writers.
+
+	fr_hash_table_t		*cache;		//!< Hash table for looking up cache keys.
+	fr_heap_t		*heap;		//!< For managing entry expiry.
+	fr_dlist_head_t		clock;		//!< All entries, for CLOCK eviction.
+	rlm_cache_memory_entry_t *hand;		//!< The next entry to consider for eviction.
+
+	atomic_uint_fast64_t	size;		//!< Memory used by entries in this shard.
+	atomic_uint_fast64_t	entries;	//!< Number of entries in this shard.
+	atomic_uint_fast64_t	hits;		//!< Lookups which found an entry.
+	atomic_uint_fast64_t	misses;		//!< Lookups which didn't find an entry.
+	atomic_uint_fast64_t	evictions;	//!< Entries removed to stay under max_size.
+} rlm_cache_memory_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< Number of shards.  Rounded up to a power of 2.
+	size_t			max_size;	//!< Maximum memory used by entries.  0 means no limit.
+
+	uint32_t		shard_bits;	//!< log2(num_shards).
+	size_t			shard_max_size;	//!< max_size for each shard.
+	rlm_cache_memory_shard_t *shards;	//!< The shards.
+} rlm_cache_memory_t;
+
+/** Tracks which shard a handle has locked
+ *
+ */
+typedef struct {
+	rlm_cache_memory_shard_t *locked;	//!< Shard locked by this handle, or NULL.
+} rlm_cache_memory_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("num_shards", FR_TYPE_UINT32, rlm_cache_memory_t, num_shards), .dflt = "64" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_memory_t, max_size), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_memory_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int8_t cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+
+	MEMCMP_RETURN(a, b, key, key_len);
+	return 0;
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int8_t cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+
+	return fr_unix_time_cmp(a->expires, b->expires);
+}
+
+/** Lock the shard holding a key, unlocking any other shard held by the handle
+ *
+ */
+static rlm_cache_memory_shard_t *cache_shard_lock(rlm_cache_memory_t *driver, rlm_cache_memory_handle_t *handle,
+						  uint32_t hash)
+{
+	rlm_cache_memory_shard_t *shard;
+
+	/*
+	 *	The hash table uses the low bits of the hash,
+	 *	so pick the shard from the high bits of a
+	 *	mixed version.
+	 */
+	if (driver->shard_bits == 0) {
+		shard = &driver->shards[0];
+	} else {
+		shard = &driver->shards[(uint32_t)(hash * 2654435761U) >> (32 - driver->shard_bits)];
+	}
+
+	if (handle->locked == shard) return shard;
+
+	if (handle->locked) pthread_mutex_unlock(&handle->locked->mutex);
+	pthread_mutex_lock(&shard->mutex);
+	handle->locked = shard;
+
+	return shard;
+}
+
+/** Remove an entry from a shard, and free it
+ *
+ * @note Called with the shard mutex held.
+ */
+static void cache_entry_remove(rlm_cache_memory_shard_t *shard, rlm_cache_memory_entry_t *c)
+{
+	if (shard->hand == c) shard->hand = fr_dlist_next(&shard->clock, c);
+
+	fr_heap_extract(shard->heap, c);
+	fr_hash_table_remove(shard->cache, c);
+	fr_dlist_remove(&shard->clock, c);
+
+	atomic_fetch_sub_explicit(&shard->size, c->size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&shard->entries, 1, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
+/** Evict entries using the CLOCK algorithm until there is room for a new entry
+ *
+ * Entries which have been found since the hand last passed them get a
+ * second chance.  Everything else is evicted, oldest first.
+ *
+ * @note Called with the shard mutex held.
+ */
+static void cache_shard_evict(rlm_cache_memory_t *driver, rlm_cache_memory_shard_t *shard, size_t needed)
+{
+	rlm_cache_memory_entry_t *c;
+
+	while ((atomic_load_explicit(&shard->size, memory_order_relaxed) + needed) > driver->shard_max_size) {
+		c = shard->hand ? shard->hand : fr_dlist_head(&shard->clock);
+		if (!c) break;
+
+		shard->hand = fr_dlist_next(&shard->clock, c);
+
+		if (c->referenced) {
+			c->referenced = false;
+			continue;
+		}
+
+		cache_entry_remove(shard, c);
+		atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+	}
+}
+
+/** Cleanup a cache_memory instance
+ *
+ */
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_cache_memory_t	*driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_memory_t);
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_memory_shard_t	*shard = &driver->shards[i];
+		rlm_cache_memory_entry_t	*c;
+
+		if (!shard->cache) continue;	/* Failed during instantiation */
+
+		while ((c = fr_dlist_head(&shard->clock))) cache_entry_remove(shard, c);
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+static xlat_arg_parser_t const cache_memory_stats_xlat_args[] = {
+	{ .required = true, .single = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Return statistics for the cache
+ *
+ * Example:
+@verbatim
+%(cache_stats:hits)
+@endverbatim
+ *
+ * The counters are `hits`, `misses`, `evictions`, `entries`, and `size`.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t cache_memory_stats_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+					     request_t *request, void const *xlat_inst,
+					     UNUSED void *xlat_thread_inst,
+					     fr_value_box_list_t *in)
+{
+	rlm_cache_memory_t const	*driver = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									      rlm_cache_memory_t);
+	fr_value_box_t			*name = fr_dlist_head(in);
+	fr_value_box_t			*vb;
+	size_t				offset;
+	uint64_t			total = 0;
+	uint32_t			i;
+
+	if (strcmp(name->vb_strvalue, "hits") == 0) {
+		offset = offsetof(rlm_cache_memory_shard_t, hits);
+	} else if (strcmp(name->vb_strvalue, "misses") == 0) {
+		offset = offsetof(rlm_cache_memory_shard_t, misses);
+	} else if (strcmp(name->vb_strvalue, "evictions") == 0) {
+		offset = offsetof(rlm_cache_memory_shard_t, evictions);
+	} else if (strcmp(name->vb_strvalue, "entries") == 0) {
+		offset = offsetof(rlm_cache_memory_shard_t, entries);
+	} else if (strcmp(name->vb_strvalue, "size") == 0) {
+		offset = offsetof(rlm_cache_memory_shard_t, size);
+	} else {
+		REDEBUG("Unknown statistic \"%pV\"", name);
+		return XLAT_ACTION_FAIL;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		total += atomic_load_explicit((atomic_uint_fast64_t *)(((uint8_t *)&driver->shards[i]) + offset),
+					      memory_order_relaxed);
+	}
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+	vb->vb_uint64 = total;
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
+static int cache_memory_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	*((rlm_cache_memory_t **)xlat_inst) = talloc_get_type_abort(uctx, rlm_cache_memory_t);
+
+	return 0;
+}
+
+/** Register the stats xlat
+ *
+ * It's named after the cache module, as %(<cache>_stats:<counter>).
+ */
+static int mod_bootstrap(module_inst_ctx_t const *mctx)
+{
+	rlm_cache_memory_t	*driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_memory_t);
+	char			*name;
+	xlat_t			*xlat;
+
+	name = talloc_asprintf(NULL, "%s_stats", mctx->inst->parent ? mctx->inst->parent->name : mctx->inst->name);
+	xlat = xlat_register(driver, name, cache_memory_stats_xlat, false);
+	talloc_free(name);
+	if (!xlat) return -1;
+
+	xlat_func_args(xlat, cache_memory_stats_xlat_args);
+	xlat_async_instantiate_set(xlat, cache_memory_xlat_instantiate, rlm_cache_memory_t *, NULL, driver);
+
+	return 0;
+}
+
+/** Create a new cache_memory instance
+ *
+ * @param[in] mctx		Data required for instantiation.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_cache_memory_t	*driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_memory_t);
+	uint32_t		i;
+
+	FR_INTEGER_BOUND_CHECK("num_shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_shards", driver->num_shards, <=, 1024);
+
+	/*
+	 *	Round up to a power of 2.
+	 */
+	while ((1U << driver->shard_bits) < driver->num_shards) driver->shard_bits++;
+	driver->num_shards = 1U << driver->shard_bits;
+
+	driver->shard_max_size = driver->max_size ? (driver->max_size / driver->num_shards) : SIZE_MAX;
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_memory_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed to create cache");
+		return -1;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_memory_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = fr_hash_table_talloc_alloc(driver->shards, rlm_cache_memory_entry_t,
+							  cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_talloc_alloc(driver->shards, cache_heap_cmp, rlm_cache_memory_entry_t, heap_id, 0);
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		fr_dlist_init(&shard->clock, rlm_cache_memory_entry_t, clock_entry);
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			shard->cache = NULL;	/* Don't destroy the mutex in mod_detach */
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    request_t *request)
+{
+	rlm_cache_memory_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_memory_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       request_t *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_memory_t		*driver = talloc_get_type_abort(instance, rlm_cache_memory_t);
+	rlm_cache_memory_shard_t	*shard;
+	rlm_cache_memory_entry_t	*c;
+	fr_unix_time_t			now = fr_time_to_unix_time(request->packet->timestamp);
+	uint32_t			hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(driver, handle, hash);
+
+	/*
+	 *	Clear out old entries
+	 */
+	while ((c = fr_heap_peek(shard->heap)) && fr_unix_time_lt(c->fields.expires, now)) {
+		cache_entry_remove(shard, c);
+	}
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	c = fr_hash_table_find(shard->cache, &(rlm_cache_memory_entry_t){
+					.fields = { .key = key, .key_len = key_len },
+					.hash = hash
+				});
+	if (!c) {
+		atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+	c->referenced = true;
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_memory_t		*driver = talloc_get_type_abort(instance, rlm_cache_memory_t);
+	rlm_cache_memory_shard_t	*shard;
+	rlm_cache_memory_entry_t	*c;
+	uint32_t			hash = fr_hash(key, key_len);
+
+	if (!request) return CACHE_ERROR;
+
+	shard = cache_shard_lock(driver, handle, hash);
+
+	c = fr_hash_table_find(shard->cache, &(rlm_cache_memory_entry_t){
+					.fields = { .key = key, .key_len = key_len },
+					.hash = hash
+				});
+	if (!c) return CACHE_MISS;
+
+	cache_entry_remove(shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 rlm_cache_entry_t const *entry)
+{
+	rlm_cache_memory_t		*driver = talloc_get_type_abort(instance, rlm_cache_memory_t);
+	rlm_cache_memory_shard_t	*shard;
+	rlm_cache_memory_entry_t	*c = UNCONST(rlm_cache_memory_entry_t *, entry);
+
+	if (!request) return CACHE_ERROR;
+
+	c->hash = fr_hash(c->fields.key, c->fields.key_len);
+	c->size = talloc_total_size(c);
+
+	if (c->size > driver->shard_max_size) {
+		RERROR("Entry is larger than the maximum size of a shard (%zu bytes)", driver->shard_max_size);
+		return CACHE_ERROR;
+	}
+
+	shard = cache_shard_lock(driver, handle, c->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		cache_status_t status;
+
+		status = cache_entry_expire(config, instance, request, handle, c->fields.key, c->fields.key_len);
+		if ((status != CACHE_OK) && !fr_cond_assert(0)) return CACHE_ERROR;
+
+		if (!fr_hash_table_insert(shard->cache, c)) {
+			RERROR("Failed adding entry");
+			return CACHE_ERROR;
+		}
+	}
+
+	if (fr_heap_insert(shard->heap, c) < 0) {
+		fr_hash_table_remove(shard->cache, c);
+		RERROR("Failed adding entry to expiry heap");
+		return CACHE_ERROR;
+	}
+
+	/*
+	 *	Make room for the entry before adding it, so
+	 *	that it isn't evicted itself.  New entries go
+	 *	behind the hand, so that they're the last to
+	 *	be considered.
+	 */
+	if (driver->max_size) cache_shard_evict(driver, shard, c->size);
+
+	if (shard->hand) {
+		fr_dlist_insert_before(&shard->clock, shard->hand, c);
+	} else {
+		fr_dlist_insert_tail(&shard->clock, c);
+	}
+
+	atomic_fetch_add_explicit(&shard->size, c->size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&shard->entries, 1, memory_order_relaxed);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
+					  request_t *request, void *handle,
+					  rlm_cache_entry_t *entry)
+{
+	rlm_cache_memory_t		*driver = talloc_get_type_abort(instance, rlm_cache_memory_t);
+	rlm_cache_memory_shard_t	*shard;
+	rlm_cache_memory_entry_t	*c = (rlm_cache_memory_entry_t *)entry;
+
+#ifdef NDEBUG
+	if (!request) return CACHE_ERROR;
+#endif
+
+	shard = cache_shard_lock(driver, handle, c->hash);
+
+	if (!fr_cond_assert(fr_heap_extract(shard->heap, c) == 0)) {
+		RERROR("Entry not in heap");
+		return CACHE_ERROR;
+	}
+
+	if (fr_heap_insert(shard->heap, c) < 0) {
+		cache_entry_remove(shard, c);	/* make sure we don't leak entries... */
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  request_t *request, UNUSED void *handle)
+{
+	rlm_cache_memory_t	*driver = talloc_get_type_abort(instance, rlm_cache_memory_t);
+	uint64_t		count = 0;
+	uint32_t		i;
+
+	if (!request) return CACHE_ERROR;
+
+	/*
+	 *	Don't lock the shards.  The caller may already
+	 *	hold one of them.
+	 */
+	for (i = 0; i < driver->num_shards; i++) {
+		count += atomic_load_explicit(&driver->shards[i].entries, memory_order_relaxed);
+	}
+
+	return count;
+}
+
+/** Allocate a handle
+ *
+ * The shard is only locked once we know which key is being used.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 request_t *request)
+{
+	rlm_cache_memory_handle_t *h;
+
+	MEM(h = talloc_zero(request, rlm_cache_memory_handle_t));
+	*handle = h;
+
+	return 0;
+}
+
+/** Release a handle, unlocking any shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, request_t *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_memory_handle_t *h = talloc_get_type_abort(handle, rlm_cache_memory_handle_t);
+
+	if (h->locked) {
+		pthread_mutex_unlock(&h->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern rlm_cache_driver_t rlm_cache_memory;
+rlm_cache_driver_t rlm_cache_memory = {
+	.name		= "rlm_cache_memory",
+	.magic		= RLM_MODULE_INIT,
+	.config		= driver_config,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_memory_t),
+	.inst_type	= "rlm_cache_memory_t",
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
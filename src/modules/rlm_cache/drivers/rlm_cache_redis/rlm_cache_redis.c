@@ -19,6 +19,9 @@
  * @file rlm_cache_redis.c
  * @brief redis based cache.
  *
+ * Uses the blocking cluster API and connection pool, not the pipelined
+ * trunk, as rlm_cache calls its drivers synchronously.
+ *
  * @copyright 2015 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  */
 #define LOG_PREFIX "cache - redis"
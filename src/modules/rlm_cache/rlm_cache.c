@@ -241,7 +241,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_strvalue_len((char const *)key, key_len),
 			fr_box_time_delta(fr_unix_time_sub(fr_time_to_unix_time(request->packet->timestamp), c->expires)));
 
-		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		RETURN_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -304,7 +304,7 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		RETURN_MODULE_FAIL;
 	}
@@ -866,10 +866,9 @@ static xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *r
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
-		return XLAT_ACTION_FAIL;
-
 	default:
 		talloc_free(target);
+		cache_release(xti->inst, request, &handle);
 		return XLAT_ACTION_FAIL;
 	}
 
@@ -885,14 +884,14 @@ static xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *r
 
 	talloc_free(target);
 
+	cache_free(xti->inst, &c);
+	cache_release(xti->inst, request, &handle);
+
 	/*
 	 *	Check if we found a matching map
 	 */
 	if (!map) return XLAT_ACTION_FAIL;
 
-	cache_free(xti->inst, &c);
-	cache_release(xti->inst, request, &handle);
-
 	return XLAT_ACTION_DONE;
 }
 
@@ -1,3 +1,5 @@
 TARGET		:= rlm_detail.a
 SOURCES		:= rlm_detail.c
+
+TGT_PREREQS	:= libfreeradius-internal.a
 LOG_ID_LIB	= 11
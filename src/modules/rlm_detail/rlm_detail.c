@@ -17,7 +17,7 @@
 /**
  * $Id$
  * @file rlm_detail.c
- * @brief Write plaintext versions of packets to flatfiles.
+ * @brief Write plaintext or binary versions of packets to flatfiles.
  *
  * @copyright 2000,2006 The FreeRADIUS server project
  */
@@ -26,8 +26,10 @@ RCSID("$Id$")
 #define LOG_PREFIX mctx->inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail_spool.h>
 #include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/perm.h>
 
@@ -53,8 +55,13 @@ typedef struct {
 	char const	*filename;	//!< File/path to write to.
 	uint32_t	perm;		//!< Permissions to use for new files.
 	char const	*group;		//!< Group to use for new files.
+	gid_t		gid;		//!< Resolved version of group, or -1.
 
 	tmpl_t		*header;	//!< Header format.
+
+	char const	*format_str;	//!< Format of the entries, "text" or "binary".
+	fr_detail_format_t format;	//!< Parsed version of format_str.
+
 	bool		locking;	//!< Whether the file should be locked.
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
@@ -65,6 +72,9 @@ typedef struct {
 
 	exfile_t    	*ef;		//!< Log file handler
 
+	exfile_async_conf_t async;	//!< Asynchronous writer configuration.
+	bool		async_is_set;	//!< Whether records should be written by a writer thread.
+
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
@@ -72,11 +82,13 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_TMPL | FR_TYPE_XLAT | FR_TYPE_NON_BLOCKING, rlm_detail_t, header),
 	  .dflt = "%t", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format_str), .dflt = "text" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_detail_t, perm), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_detail_t, group) },
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET_IS_SET("async", FR_TYPE_SUBSECTION, rlm_detail_t, async), .subcs = (void const *) exfile_async_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -115,6 +127,12 @@ fr_dict_attr_autoload_t rlm_detail_dict_attr[] = {
 	{ NULL }
 };
 
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	FR_DETAIL_FORMAT_BINARY	},
+	{ L("text"),	FR_DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 static uint32_t detail_hash(void const *data)
 {
 	fr_dict_attr_t const *da = data;
@@ -134,6 +152,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	rlm_detail_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_detail_t);
 	CONF_SECTION	*conf = mctx->inst->conf;
 	CONF_SECTION	*cs;
+	int		format;
 
 	/*
 	 *	Escape filenames only if asked.
@@ -144,12 +163,37 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	format = fr_table_value_by_str(detail_format_table, inst->format_str, -1);
+	if (format < 0) {
+		cf_log_err(conf, "Invalid 'format' value \"%s\", expected 'text' or 'binary'", inst->format_str);
+		return -1;
+	}
+	inst->format = format;
+
 	inst->ef = module_exfile_init(inst, conf, 256, fr_time_delta_from_sec(30), inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
 		return -1;
 	}
 
+	if (inst->async_is_set && (exfile_async_enable(inst->ef, &inst->async) < 0)) {
+		cf_log_perr(conf, "Failed enabling asynchronous writes");
+		return -1;
+	}
+
+	inst->gid = (gid_t) -1;
+#ifdef HAVE_GRP_H
+	if (inst->group) {
+		char *endptr;
+
+		inst->gid = strtol(inst->group, &endptr, 10);
+		if ((*endptr != '\0') && (fr_perm_gid_from_str(inst, &inst->gid, inst->group) < 0)) {
+			cf_log_err(conf, "Unable to find system group \"%s\"", inst->group);
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -354,6 +398,279 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	return 0;
 }
 
+/** Encode a single detail entry as a binary spool record
+ *
+ * The record contains the same attributes as the text format, in the
+ * internal encoding.  See detail_spool.h for the layout.
+ *
+ * @param[out] dbuff Where to write the record.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply...).
+ * @param[in] list of attributes to encode.
+ * @param[in] compat Write out entry in compatibility mode.
+ * @return
+ *	- >0 the length of the record.
+ *	- 0 if there was nothing to write.
+ *	- <0 on error.
+ */
+static ssize_t detail_encode(fr_dbuff_t *dbuff, rlm_detail_t const *inst, request_t *request,
+			     fr_radius_packet_t *packet, fr_pair_list_t *list, bool compat)
+{
+	fr_detail_spool_hdr_t	hdr;
+	fr_dbuff_marker_t	hdr_m;
+	fr_dcursor_t		cursor;
+	fr_pair_list_t		extra;
+	fr_pair_t		*vp;
+	size_t			data_len;
+
+	if (fr_pair_list_empty(list)) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	/*
+	 *	Leave room for the header, we fill it in once we
+	 *	know the length of the attributes.
+	 */
+	fr_dbuff_marker(&hdr_m, dbuff);
+	if (fr_dbuff_memset(dbuff, 0, sizeof(hdr)) <= 0) {
+	oom:
+		RERROR("Failed allocating detail record");
+		return -1;
+	}
+
+	/*
+	 *	Add the same extra attributes as the text format.
+	 */
+	fr_pair_list_init(&extra);
+
+	if (!compat) {
+		fr_dict_attr_t const *da;
+
+		da = fr_dict_attr_by_name(NULL, fr_dict_root(request->dict), "Packet-Type");
+		if (da) {
+			MEM(vp = fr_pair_afrom_da(request, da));
+			vp->vp_uint32 = packet->code;
+			fr_pair_append(&extra, vp);
+		}
+	}
+
+	if (inst->log_srcdst) {
+		fr_dict_attr_t const *src_da = NULL, *dst_da = NULL;
+
+		switch (packet->socket.inet.src_ipaddr.af) {
+		case AF_INET:
+			src_da = attr_packet_src_ipv4_address;
+			dst_da = attr_packet_dst_ipv4_address;
+			break;
+
+		case AF_INET6:
+			src_da = attr_packet_src_ipv6_address;
+			dst_da = attr_packet_dst_ipv6_address;
+			break;
+
+		default:
+			break;
+		}
+
+		if (src_da) {
+			MEM(vp = fr_pair_afrom_da(request, src_da));
+			fr_value_box_shallow(&vp->data, &packet->socket.inet.src_ipaddr, true);
+			fr_pair_append(&extra, vp);
+
+			MEM(vp = fr_pair_afrom_da(request, dst_da));
+			fr_value_box_shallow(&vp->data, &packet->socket.inet.dst_ipaddr, true);
+			fr_pair_append(&extra, vp);
+		}
+
+		MEM(vp = fr_pair_afrom_da(request, attr_packet_src_port));
+		vp->vp_uint16 = packet->socket.inet.src_port;
+		fr_pair_append(&extra, vp);
+
+		MEM(vp = fr_pair_afrom_da(request, attr_packet_dst_port));
+		vp->vp_uint16 = packet->socket.inet.dst_port;
+		fr_pair_append(&extra, vp);
+	}
+
+	for (vp = fr_pair_dcursor_init(&cursor, &extra);
+	     vp;
+	     vp = fr_dcursor_current(&cursor)) {
+		if (fr_internal_encode_pair(dbuff, &cursor, NULL) < 0) {
+		error:
+			RPERROR("Failed encoding detail record");
+			fr_pair_list_free(&extra);
+			return -1;
+		}
+	}
+	fr_pair_list_free(&extra);
+
+	for (vp = fr_pair_dcursor_init(&cursor, list);
+	     vp;
+	     vp = fr_dcursor_current(&cursor)) {
+		if ((inst->ht && fr_hash_table_find(inst->ht, vp->da)) ||
+		    (compat && (vp->da == attr_user_password))) {
+			fr_dcursor_next(&cursor);
+			continue;
+		}
+
+		if (fr_internal_encode_pair(dbuff, &cursor, NULL) < 0) goto error;
+	}
+
+	/*
+	 *	Pad the record so that the next one is aligned.
+	 */
+	data_len = fr_dbuff_used(dbuff) - sizeof(hdr);
+	if ((fr_detail_spool_record_size(data_len) > fr_dbuff_used(dbuff)) &&
+	    (fr_dbuff_memset(dbuff, 0, fr_detail_spool_record_size(data_len) - fr_dbuff_used(dbuff)) <= 0)) goto oom;
+
+	hdr = (fr_detail_spool_hdr_t) {
+		.magic = FR_DETAIL_SPOOL_MAGIC,
+		.length = data_len,
+		.protocol = fr_dict_root(request->dict)->attr,
+		.timestamp = fr_unix_time_unwrap(fr_time_to_unix_time(request->packet->timestamp)),
+		.version = FR_DETAIL_SPOOL_VERSION,
+		.state = FR_DETAIL_SPOOL_PENDING
+	};
+	hdr.checksum = fr_detail_spool_checksum(&hdr, fr_dbuff_start(dbuff) + sizeof(hdr));
+
+	if (fr_dbuff_in_memcpy(&hdr_m, (uint8_t const *) &hdr, sizeof(hdr)) <= 0) goto oom;
+
+	return fr_dbuff_used(dbuff);
+}
+
+/** Change the group of a detail file opened by this thread, if one was configured
+ *
+ * When records are written by the writer thread, it sets the
+ * group when it creates the file.
+ */
+static void detail_group_set(rlm_detail_t const *inst, request_t *request, int fd, char const *filename)
+{
+#ifdef HAVE_GRP_H
+	if (inst->gid == (gid_t) -1) return;
+
+	if (fchown(fd, -1, inst->gid) == -1) {
+		RDEBUG2("Unable to change system group of '%s'", filename);
+	}
+#endif
+}
+
+/** Append data written to a detail stream to an sbuff
+ *
+ */
+static ssize_t _detail_sbuff_write(void *cookie, char const *buf, size_t size)
+{
+	fr_sbuff_t *sbuff = cookie;
+
+	if (fr_sbuff_in_bstrncpy(sbuff, buf, size) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return size;
+}
+
+/** Format a detail record in memory, and queue it for the writer thread
+ *
+ */
+static unlang_action_t detail_do_async(rlm_rcode_t *p_result, rlm_detail_t const *inst, request_t *request,
+				       char const *filename, fr_radius_packet_t *packet, fr_pair_list_t *list,
+				       bool compat)
+{
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	FILE			*outfp;
+	struct iovec		vector;
+	int			ret;
+
+	if (!fr_sbuff_init_talloc(request, &sbuff, &tctx, 1024, SIZE_MAX)) {
+		RERROR("Failed allocating detail buffer");
+		RETURN_MODULE_FAIL;
+	}
+
+	outfp = fopencookie(&sbuff, "w", (cookie_io_functions_t){ .write = _detail_sbuff_write });
+	if (!outfp) {
+		RERROR("Failed opening detail buffer: %s", fr_syserror(errno));
+	fail:
+		talloc_free(sbuff.buff);
+		RETURN_MODULE_FAIL;
+	}
+
+	ret = detail_write(outfp, inst, request, packet, list, compat);
+	if ((fclose(outfp) < 0) || (ret < 0)) goto fail;
+
+	vector.iov_base = fr_sbuff_start(&sbuff);
+	vector.iov_len = fr_sbuff_used(&sbuff);
+
+	if (exfile_async_write(inst->ef, filename, inst->perm, inst->gid, &vector, 1) < 0) {
+		RPERROR("Failed queueing record for %s", filename);
+		goto fail;
+	}
+	talloc_free(sbuff.buff);
+
+	RETURN_MODULE_OK;
+}
+
+/** Encode a binary detail record, and write it, or queue it for the writer thread
+ *
+ */
+static unlang_action_t detail_do_binary(rlm_rcode_t *p_result, rlm_detail_t const *inst, request_t *request,
+					char const *filename, fr_radius_packet_t *packet, fr_pair_list_t *list,
+					bool compat)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	struct iovec		vector;
+	ssize_t			slen;
+	int			outfd;
+
+	if (!fr_dbuff_init_talloc(request, &dbuff, &tctx, 1024, SIZE_MAX)) {
+		RERROR("Failed allocating detail buffer");
+		RETURN_MODULE_FAIL;
+	}
+
+	slen = detail_encode(&dbuff, inst, request, packet, list, compat);
+	if (slen <= 0) {
+		fr_dbuff_free_talloc(&dbuff);
+		if (slen < 0) RETURN_MODULE_FAIL;
+		RETURN_MODULE_OK;
+	}
+
+	vector.iov_base = dbuff.buff;
+	vector.iov_len = slen;
+
+	if (inst->async_is_set) {
+		if (exfile_async_write(inst->ef, filename, inst->perm, inst->gid, &vector, 1) < 0) {
+			RPERROR("Failed queueing record for %s", filename);
+		fail:
+			fr_dbuff_free_talloc(&dbuff);
+			RETURN_MODULE_FAIL;
+		}
+		fr_dbuff_free_talloc(&dbuff);
+
+		RETURN_MODULE_OK;
+	}
+
+	outfd = exfile_open(inst->ef, filename, inst->perm);
+	if (outfd < 0) {
+		RPERROR("Couldn't open file %s", filename);
+		goto fail;
+	}
+
+	detail_group_set(inst, request, outfd, filename);
+
+	if (fr_writev(outfd, &vector, 1, fr_time_delta_wrap(0)) < 0) {
+		RERROR("Failed writing to detail file %s: %s", filename, fr_syserror(errno));
+		exfile_close(inst->ef, outfd);
+		goto fail;
+	}
+
+	exfile_close(inst->ef, outfd);
+	fr_dbuff_free_talloc(&dbuff);
+
+	RETURN_MODULE_OK;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -366,11 +683,6 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 
 	FILE		*outfp;
 
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	char		*endptr;
-#endif
-
 	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_detail_t);
 
 	/*
@@ -384,6 +696,12 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
+	if (inst->format == FR_DETAIL_FORMAT_BINARY) {
+		return detail_do_binary(p_result, inst, request, buffer, packet, list, compat);
+	}
+
+	if (inst->async_is_set) return detail_do_async(p_result, inst, request, buffer, packet, list, compat);
+
 	outfd = exfile_open(inst->ef, buffer, inst->perm);
 	if (outfd < 0) {
 		RPERROR("Couldn't open file %s", buffer);
@@ -391,21 +709,8 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 		RETURN_MODULE_FAIL;
 	}
 
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (fr_perm_gid_from_str(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
-		}
-	}
+	detail_group_set(inst, request, outfd, buffer);
 
-skip_group:
 	outfp = NULL;
 	dupfd = dup(outfd);
 	if (dupfd < 0) {
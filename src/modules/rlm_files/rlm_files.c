@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/users_file.h>
 #include <freeradius-devel/util/htrie.h>
 
@@ -38,29 +39,48 @@ typedef struct {
 	fr_type_t	key_data_type;
 
 	char const *filename;
-	fr_htrie_t *common;
-	PAIR_LIST_LIST *common_def;
 
 	/* autz */
 	char const *usersfile;
-	fr_htrie_t *users;
-	PAIR_LIST_LIST *users_def;
 
 	/* authenticate */
 	char const *auth_usersfile;
-	fr_htrie_t *auth_users;
-	PAIR_LIST_LIST *auth_users_def;
 
 	/* preacct */
 	char const *acct_usersfile;
-	fr_htrie_t *acct_users;
-	PAIR_LIST_LIST *acct_users_def;
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
+
+	fr_time_delta_t	reload_check_interval;	//!< How often to check the files for changes.
+	reload_t	*reload;		//!< Current and previous contents of the files.
+} rlm_files_t;
+
+/** Parsed contents of the files
+ *
+ * Replaced as a whole when the files are reloaded.
+ */
+typedef struct {
+	fr_htrie_t *common;
+	fr_trie_frozen_t *common_frozen;
+	PAIR_LIST_LIST *common_def;
+
+	fr_htrie_t *users;
+	fr_trie_frozen_t *users_frozen;
+	PAIR_LIST_LIST *users_def;
+
+	fr_htrie_t *auth_users;
+	fr_trie_frozen_t *auth_users_frozen;
+	PAIR_LIST_LIST *auth_users_def;
+
+	fr_htrie_t *acct_users;
+	fr_trie_frozen_t *acct_users_frozen;
+	PAIR_LIST_LIST *acct_users_def;
+
 	fr_htrie_t *postauth_users;
+	fr_trie_frozen_t *postauth_users_frozen;
 	PAIR_LIST_LIST *postauth_users_def;
-} rlm_files_t;
+} rlm_files_data_t;
 
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
@@ -91,6 +111,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, rlm_files_t, key), .dflt = "%{%{Stripped-User-Name}:-%{User-Name}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("reload_check_interval", FR_TYPE_TIME_DELTA, rlm_files_t, reload_check_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -113,7 +134,8 @@ static int pairlist_to_key(uint8_t **out, size_t *outlen, void const *a)
 	return fr_value_box_to_key(out, outlen, ((PAIR_LIST_LIST const *)a)->box);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault, fr_type_t data_type)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, fr_trie_frozen_t **pfrozen,
+			PAIR_LIST_LIST **pdefault, fr_type_t data_type, bool at_runtime)
 {
 	int rcode;
 	PAIR_LIST_LIST users;
@@ -130,7 +152,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 	}
 
 	pairlist_list_init(&users);
-	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1);
+	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1, at_runtime);
 	if (rcode < 0) {
 		return -1;
 	}
@@ -340,6 +362,20 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 		fr_dlist_insert_tail(&user_list->head, entry);
 	}
 
+	/*
+	 *	The entries don't change until the files are
+	 *	reloaded, which builds a new tree.  So prefix tries
+	 *	can be frozen, which makes the lookups faster.
+	 */
+	if (htype == FR_HTRIE_TRIE) {
+		*pfrozen = fr_trie_freeze(ctx, tree->store);
+		if (!*pfrozen) {
+			ERROR("Failed freezing entries from %s", filename);
+			talloc_free(tree);
+			return -1;
+		}
+	}
+
 	*ptree = tree;
 
 	return 0;
@@ -348,8 +384,29 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	(Re-)read the "users" files into a new rlm_files_data_t.
  */
+static int files_load(TALLOC_CTX *ctx, void **out, bool at_runtime, void *uctx)
+{
+	rlm_files_t const	*inst = talloc_get_type_abort_const(uctx, rlm_files_t);
+	rlm_files_data_t	*data;
+
+	MEM(data = talloc_zero(ctx, rlm_files_data_t));
+
+#undef READFILE
+#define READFILE(_x, _y, _f, _d) do { if (getusersfile(data, inst->_x, &data->_y, &data->_f, &data->_d, inst->key_data_type, at_runtime) != 0) { ERROR("Failed reading %s", inst->_x); talloc_free(data); return -1;} } while (0)
+
+	READFILE(filename, common, common_frozen, common_def);
+	READFILE(usersfile, users, users_frozen, users_def);
+	READFILE(acct_usersfile, acct_users, acct_users_frozen, acct_users_def);
+	READFILE(auth_usersfile, auth_users, auth_users_frozen, auth_users_def);
+	READFILE(postauth_usersfile, postauth_users, postauth_users_frozen, postauth_users_def);
+
+	*out = data;
+
+	return 0;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
@@ -361,23 +418,24 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-#undef READFILE
-#define READFILE(_x, _y, _d) do { if (getusersfile(inst, inst->_x, &inst->_y, &inst->_d, inst->key_data_type) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+	inst->reload = reload_alloc(inst, mctx->inst->name, files_load, inst, inst->reload_check_interval);
+	if (!inst->reload) return -1;
 
-	READFILE(filename, common, common_def);
-	READFILE(usersfile, users, users_def);
-	READFILE(acct_usersfile, acct_users, acct_users_def);
-	READFILE(auth_usersfile, auth_users, auth_users_def);
-	READFILE(postauth_usersfile, postauth_users, postauth_users_def);
+	if (inst->filename) reload_file_add(inst->reload, inst->filename);
+	if (inst->usersfile) reload_file_add(inst->reload, inst->usersfile);
+	if (inst->acct_usersfile) reload_file_add(inst->reload, inst->acct_usersfile);
+	if (inst->auth_usersfile) reload_file_add(inst->reload, inst->auth_usersfile);
+	if (inst->postauth_usersfile) reload_file_add(inst->reload, inst->postauth_usersfile);
 
-	return 0;
+	return reload_load(inst->reload);
 }
 
 /*
  *	Common code called by everything below.
  */
 static unlang_action_t file_common(rlm_rcode_t *p_result, rlm_files_t const *inst,
-				   request_t *request, char const *filename, fr_htrie_t *tree, PAIR_LIST_LIST *default_list)
+				   request_t *request, char const *filename, fr_htrie_t *tree, fr_trie_frozen_t const *frozen,
+				   PAIR_LIST_LIST *default_list)
 {
 	PAIR_LIST_LIST const	*user_list;
 	PAIR_LIST const 	*user_pl, *default_pl;
@@ -396,18 +454,20 @@ static unlang_action_t file_common(rlm_rcode_t *p_result, rlm_files_t const *ins
 			RETURN_MODULE_FAIL;
 		}
 
-		my_list.name = NULL;
-		my_list.box = box;
-		user_list = fr_htrie_find(tree, &my_list);
-
 		/*
-		 *	Grab our own copy of the key if necessary.
+		 *	Prefix tries are looked up in the frozen copy,
+		 *	and we grab our own copy of the key for walking
+		 *	back up the trie.
 		 */
-		if (user_list && (tree->type == FR_HTRIE_TRIE)) {
+		if (frozen) {
 			key = key_buffer;
 			keylen = sizeof(key_buffer) * 8;
 
-			(void) fr_value_box_to_key(&key, &keylen, box);
+			if (fr_value_box_to_key(&key, &keylen, box) < 0) {
+				REDEBUG("Failed creating key from %s", inst->key->name);
+				talloc_free(box);
+				RETURN_MODULE_FAIL;
+			}
 
 			RDEBUG3("Keylen %ld", keylen);
 			RHEXDUMP3(key, (keylen + 7) >> 3, "KEY ");
@@ -426,6 +486,18 @@ static unlang_action_t file_common(rlm_rcode_t *p_result, rlm_files_t const *ins
 				memcpy(key_buffer, key, (keylen + 7) >> 3);
 				key = key_buffer;
 			}
+
+			user_list = fr_trie_frozen_lookup_by_key(frozen, key, keylen);
+
+			/*
+			 *	Only walk back up the trie from an
+			 *	entry we found.
+			 */
+			if (!user_list) keylen = 0;
+		} else {
+			my_list.name = NULL;
+			my_list.box = box;
+			user_list = fr_htrie_find(tree, &my_list);
 		}
 
 		talloc_free(box);
@@ -592,7 +664,7 @@ redo:
 
 				do {
 					keylen--;
-					user_list = fr_trie_lookup_by_key(tree->store, key, keylen);
+					user_list = fr_trie_frozen_lookup_by_key(frozen, key, keylen);
 					if (!user_list) continue;
 
 					user_pl = fr_dlist_head(&user_list->head);
@@ -624,11 +696,19 @@ redo:
  */
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
-
-	return file_common(p_result, inst, request, inst->filename,
-			   inst->users ? inst->users : inst->common,
-			   inst->users ? inst->users_def : inst->common_def);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_data_t const	*data;
+	reload_gen_t		*gen;
+	unlang_action_t		ret;
+
+	data = reload_acquire(&gen, inst->reload);
+	ret = file_common(p_result, inst, request, inst->filename,
+			  data->users ? data->users : data->common,
+			  data->users ? data->users_frozen : data->common_frozen,
+			  data->users ? data->users_def : data->common_def);
+	reload_release(gen);
+
+	return ret;
 }
 
 
@@ -639,29 +719,53 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
  */
 static unlang_action_t CC_HINT(nonnull) mod_preacct(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
-
-	return file_common(p_result, inst, request, inst->acct_usersfile,
-			   inst->acct_users ? inst->acct_users : inst->common,
-			   inst->acct_users ? inst->acct_users_def : inst->common_def);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_data_t const	*data;
+	reload_gen_t		*gen;
+	unlang_action_t		ret;
+
+	data = reload_acquire(&gen, inst->reload);
+	ret = file_common(p_result, inst, request, inst->acct_usersfile,
+			  data->acct_users ? data->acct_users : data->common,
+			  data->acct_users ? data->acct_users_frozen : data->common_frozen,
+			  data->acct_users ? data->acct_users_def : data->common_def);
+	reload_release(gen);
+
+	return ret;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
-
-	return file_common(p_result, inst, request, inst->auth_usersfile,
-			   inst->auth_users ? inst->auth_users : inst->common,
-			   inst->auth_users ? inst->auth_users_def : inst->common_def);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_data_t const	*data;
+	reload_gen_t		*gen;
+	unlang_action_t		ret;
+
+	data = reload_acquire(&gen, inst->reload);
+	ret = file_common(p_result, inst, request, inst->auth_usersfile,
+			  data->auth_users ? data->auth_users : data->common,
+			  data->auth_users ? data->auth_users_frozen : data->common_frozen,
+			  data->auth_users ? data->auth_users_def : data->common_def);
+	reload_release(gen);
+
+	return ret;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
-
-	return file_common(p_result, inst, request, inst->postauth_usersfile,
-			   inst->postauth_users ? inst->postauth_users : inst->common,
-			   inst->postauth_users ? inst->postauth_users_def : inst->common_def);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_data_t const	*data;
+	reload_gen_t		*gen;
+	unlang_action_t		ret;
+
+	data = reload_acquire(&gen, inst->reload);
+	ret = file_common(p_result, inst, request, inst->postauth_usersfile,
+			  data->postauth_users ? data->postauth_users : data->common,
+			  data->postauth_users ? data->postauth_users_frozen : data->common_frozen,
+			  data->postauth_users ? data->postauth_users_def : data->common_def);
+	reload_release(gen);
+
+	return ret;
 }
 
 
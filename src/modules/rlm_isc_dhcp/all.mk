@@ -1,3 +1 @@
-TARGET		:= rlm_isc_dhcp.a
-SOURCES		:= rlm_isc_dhcp.c
-LOG_ID_LIB	= 23
+SUBMAKEFILES := rlm_isc_dhcp.mk isc_lease_tests.mk
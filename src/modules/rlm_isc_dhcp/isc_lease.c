@@ -0,0 +1,1175 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file isc_lease.c
+ * @brief Dynamic address allocation from ISC DHCP "range" statements.
+ *
+ * Each range has an array of leases, one per address, and a bitmap of
+ * the free addresses.  Allocation is a next-fit scan of the bitmap.
+ * Leases which are offered, active or abandoned are also kept in a heap
+ * ordered by expiry time.  Expired leases are moved back to the free
+ * bitmap whenever the range is used, so there are no timers.
+ *
+ * A free lease remembers the last client it was bound to, so that
+ * clients which come back get the same address, if nobody else has
+ * taken it in the mean time.
+ *
+ * Each range has its own mutex.  Allocations in a subnet with several
+ * ranges start at a different range each time, so that workers don't
+ * all queue up on the same lock.
+ *
+ * Changes to active and abandoned leases, and releases, are appended to
+ * a text journal.  Records carry a sequence number so they can be written
+ * after the range lock is released, and still be replayed in the right
+ * order.  When the journal gets much larger than the set of leases it
+ * describes, a compaction thread rewrites it from a snapshot of the
+ * leases, and atomically renames it over the old one.  Records written
+ * while the snapshot is taken are kept in memory, and appended to the
+ * new journal before the rename, so workers only ever hold the journal
+ * lock for an append.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "isc_dhcp leases"
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/trie.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include "isc_lease.h"
+
+/** Largest range we allow
+ *
+ */
+#define ISC_LEASE_RANGE_MAX	(1 << 20)
+
+/** Journal records we allow beyond the compacted size, before compacting again
+ *
+ */
+#define ISC_LEASE_JOURNAL_SLACK	(1024)
+
+/** Whether the journal should be compacted
+ *
+ * Must be called with the pool mutex held.
+ */
+#define JOURNAL_TOO_LARGE(_pool) ((_pool)->records > (((_pool)->compacted * 2) + ISC_LEASE_JOURNAL_SLACK))
+
+typedef enum {
+	ISC_LEASE_FREE = 0,
+	ISC_LEASE_OFFERED,
+	ISC_LEASE_ACTIVE,
+	ISC_LEASE_ABANDONED,
+	ISC_LEASE_MAX
+} isc_lease_state_t;
+
+static fr_table_num_sorted_t const isc_lease_state_table[] = {
+	{ L("abandoned"),	ISC_LEASE_ABANDONED	},
+	{ L("active"),		ISC_LEASE_ACTIVE	},
+	{ L("free"),		ISC_LEASE_FREE		},
+	{ L("offered"),		ISC_LEASE_OFFERED	}
+};
+static size_t isc_lease_state_table_len = NUM_ELEMENTS(isc_lease_state_table);
+
+typedef struct isc_lease_range_s isc_lease_range_t;
+
+/** One address in a range
+ *
+ */
+typedef struct {
+	uint32_t		addr;		//!< In host byte order.
+	isc_lease_state_t	state;
+	fr_heap_index_t		heap_id;	//!< Entry in the range's expiry heap.
+	uint64_t		seq;		//!< Sequence number of the last change.
+	fr_time_t		expires;	//!< When an offered, active or abandoned lease ends.
+	fr_rb_node_t		node;		//!< Entry in the range's by-client tree.
+	uint8_t			client_len;	//!< 0 if not bound to a client.
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+} isc_lease_t;
+
+struct isc_lease_range_s {
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+
+	uint32_t		start;		//!< First address, in host byte order.
+	uint32_t		end;		//!< Last address, in host byte order.
+	uint32_t		cursor;		//!< Where the next search for a free address starts.
+
+	uint64_t		*free;		//!< Bitmap of free addresses.
+	isc_lease_t		*leases;	//!< One per address.
+	fr_heap_t		*expiry;	//!< Leases which will expire, ordered by expiry time.
+	fr_rb_tree_t		*clients;	//!< Bound leases, by client.
+	uint32_t		count[ISC_LEASE_MAX];	//!< Number of leases in each state.
+
+	isc_lease_subnet_t	*subnet;	//!< Which this range belongs to.
+};
+
+struct isc_lease_subnet_s {
+	uint32_t		addr;		//!< In network byte order.
+	uint8_t			bits;
+	isc_lease_range_t	**ranges;
+	atomic_uint_fast32_t	next;		//!< Which range to try first.
+};
+
+struct isc_lease_pool_s {
+	char const		*filename;	//!< Of the journal.  May be NULL.
+
+	fr_trie_t		*subnets;	//!< Used while parsing.
+	fr_trie_frozen_t	*frozen;	//!< Used at run time.
+	isc_lease_range_t	**ranges;	//!< All ranges, in all subnets.
+
+	atomic_uint_fast64_t	seq;		//!< Next sequence number.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	int			fd;		//!< Of the journal.
+	uint64_t		records;	//!< In the journal.
+	uint64_t		compacted;	//!< Records in the journal after the last compaction.
+
+	char			*backlog;	//!< Records written since the compaction snapshot started.
+	uint64_t		backlog_records;	//!< Number of records in the backlog.
+	bool			compacting;	//!< A snapshot is being written, so records go to
+						//!< the backlog as well as to the journal.
+
+	pthread_t		thread;		//!< Compacts the journal.
+	pthread_cond_t		wakeup;		//!< Signalled when the journal needs compacting, or on exit.
+	bool			thread_running;	//!< Whether the compaction thread has been started.
+	bool			compact;	//!< The journal needs compacting.
+	bool			stop;		//!< The compaction thread should exit.
+};
+
+static int8_t lease_client_cmp(void const *one, void const *two)
+{
+	isc_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->client_len, b->client_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->client, b->client, a->client_len);
+	return CMP(ret, 0);
+}
+
+static int8_t lease_expiry_cmp(void const *one, void const *two)
+{
+	isc_lease_t const *a = one, *b = two;
+
+	return fr_time_cmp(a->expires, b->expires);
+}
+
+static int _range_free(isc_lease_range_t *range)
+{
+	pthread_mutex_destroy(&range->mutex);
+	return 0;
+}
+
+static int _pool_free(isc_lease_pool_t *pool)
+{
+	if (pool->thread_running) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->stop = true;
+		pthread_cond_signal(&pool->wakeup);
+		pthread_mutex_unlock(&pool->mutex);
+
+		pthread_join(pool->thread, NULL);
+	}
+
+	if (pool->fd >= 0) close(pool->fd);
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->mutex);
+	return 0;
+}
+
+/** Allocate a pool of leases
+ *
+ * @param[in] ctx	to allocate the pool in.
+ * @param[in] filename	of the lease journal.  May be NULL, in which case
+ *			leases are only kept in memory.
+ * @return
+ *	- A new pool on success.
+ *	- NULL on error.
+ */
+isc_lease_pool_t *isc_lease_pool_alloc(TALLOC_CTX *ctx, char const *filename)
+{
+	isc_lease_pool_t *pool;
+
+	pool = talloc_zero(ctx, isc_lease_pool_t);
+	if (!pool) return NULL;
+
+	pool->subnets = fr_trie_alloc(pool, NULL, NULL);
+	pool->ranges = talloc_array(pool, isc_lease_range_t *, 0);
+	if (!pool->subnets || !pool->ranges) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	pool->filename = filename;
+	pool->fd = -1;
+	atomic_init(&pool->seq, 1);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+	talloc_set_destructor(pool, _pool_free);
+
+	return pool;
+}
+
+/** Add a range of addresses to a subnet
+ *
+ * @param[in] pool	to add the range to.
+ * @param[in] subnet	which the range is in, in network byte order.
+ * @param[in] bits	length of the subnet prefix.
+ * @param[in] start	first address in the range, in network byte order.
+ * @param[in] end	last address in the range, in network byte order.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int isc_lease_range_add(isc_lease_pool_t *pool, uint32_t subnet, uint8_t bits, uint32_t start, uint32_t end)
+{
+	isc_lease_subnet_t	*sn;
+	isc_lease_range_t	*range;
+	uint32_t		num, i;
+	size_t			j;
+
+	start = ntohl(start);
+	end = ntohl(end);
+
+	if (start > end) {
+		uint32_t tmp = start;
+
+		start = end;
+		end = tmp;
+	}
+
+	if ((end - start) >= ISC_LEASE_RANGE_MAX) {
+		fr_strerror_printf("range is too large, it can contain at most %u addresses", ISC_LEASE_RANGE_MAX);
+		return -1;
+	}
+	num = end - start + 1;
+
+	for (j = 0; j < talloc_array_length(pool->ranges); j++) {
+		if ((start <= pool->ranges[j]->end) && (end >= pool->ranges[j]->start)) {
+			fr_strerror_const("range overlaps with an existing range");
+			return -1;
+		}
+	}
+
+	sn = fr_trie_match_by_key(pool->subnets, &subnet, bits);
+	if (!sn) {
+		sn = talloc_zero(pool, isc_lease_subnet_t);
+		if (!sn) {
+		oom:
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+		sn->addr = subnet;
+		sn->bits = bits;
+		sn->ranges = talloc_array(sn, isc_lease_range_t *, 0);
+		if (!sn->ranges) goto oom;
+		atomic_init(&sn->next, 0);
+
+		if (fr_trie_insert_by_key(pool->subnets, &sn->addr, bits, sn) < 0) return -1;
+	}
+
+	range = talloc_zero(sn, isc_lease_range_t);
+	if (!range) goto oom;
+
+	pthread_mutex_init(&range->mutex, NULL);
+	talloc_set_destructor(range, _range_free);
+
+	range->start = start;
+	range->end = end;
+	range->subnet = sn;
+
+	range->free = talloc_zero_array(range, uint64_t, (num + 63) / 64);
+	range->leases = talloc_zero_array(range, isc_lease_t, num);
+	range->expiry = fr_heap_alloc(range, lease_expiry_cmp, isc_lease_t, heap_id, num);
+	range->clients = fr_rb_inline_alloc(range, isc_lease_t, node, lease_client_cmp, NULL);
+	if (!range->free || !range->leases || !range->expiry || !range->clients) {
+		talloc_free(range);
+		goto oom;
+	}
+
+	for (i = 0; i < num; i++) {
+		range->leases[i].addr = start + i;
+		range->free[i / 64] |= ((uint64_t) 1) << (i % 64);
+	}
+	range->count[ISC_LEASE_FREE] = num;
+
+	MEM(sn->ranges = talloc_realloc(sn, sn->ranges, isc_lease_range_t *, talloc_array_length(sn->ranges) + 1));
+	sn->ranges[talloc_array_length(sn->ranges) - 1] = range;
+
+	MEM(pool->ranges = talloc_realloc(pool, pool->ranges, isc_lease_range_t *, talloc_array_length(pool->ranges) + 1));
+	pool->ranges[talloc_array_length(pool->ranges) - 1] = range;
+
+	return 0;
+}
+
+/** Find the subnet containing an address
+ *
+ * @param[in] pool	to search.
+ * @param[in] addr	in network byte order.
+ * @return
+ *	- The subnet.
+ *	- NULL if the address isn't in a subnet which has ranges.
+ */
+isc_lease_subnet_t *isc_lease_subnet_find(isc_lease_pool_t const *pool, uint32_t addr)
+{
+	if (pool->frozen) return fr_trie_frozen_lookup_by_key(pool->frozen, &addr, 32);
+
+	return fr_trie_lookup_by_key(pool->subnets, &addr, 32);
+}
+
+/** Find the range containing an address
+ *
+ */
+static isc_lease_range_t *range_find(isc_lease_pool_t const *pool, uint32_t addr)
+{
+	isc_lease_subnet_t	*sn;
+	size_t			i;
+
+	sn = isc_lease_subnet_find(pool, addr);
+	if (!sn) return NULL;
+
+	addr = ntohl(addr);
+	for (i = 0; i < talloc_array_length(sn->ranges); i++) {
+		if ((addr >= sn->ranges[i]->start) && (addr <= sn->ranges[i]->end)) return sn->ranges[i];
+	}
+
+	return NULL;
+}
+
+/** Change the state of a lease, and keep the bitmap and the counters in sync
+ *
+ */
+static void lease_state_set(isc_lease_range_t *range, isc_lease_t *lease, isc_lease_state_t state)
+{
+	uint32_t	idx = lease->addr - range->start;
+	uint64_t	bit = ((uint64_t) 1) << (idx % 64);
+
+	if (state == ISC_LEASE_FREE) {
+		if (fr_heap_entry_inserted(lease->heap_id)) fr_heap_extract(range->expiry, lease);
+		range->free[idx / 64] |= bit;
+
+	} else if (lease->state == ISC_LEASE_FREE) {
+		range->free[idx / 64] &= ~bit;
+	}
+
+	range->count[lease->state]--;
+	range->count[state]++;
+	lease->state = state;
+}
+
+/** Set when a lease expires
+ *
+ */
+static void lease_expires_set(isc_lease_range_t *range, isc_lease_t *lease, fr_time_t expires)
+{
+	if (fr_heap_entry_inserted(lease->heap_id)) fr_heap_extract(range->expiry, lease);
+	lease->expires = expires;
+	fr_heap_insert(range->expiry, lease);
+}
+
+/** Bind a lease to a client, or unbind it
+ *
+ * Any other lease the client has in this range is freed.
+ */
+static void lease_bind(isc_lease_range_t *range, isc_lease_t *lease, uint8_t const *client, size_t client_len)
+{
+	isc_lease_t	find, *old;
+
+	if (lease->client_len) {
+		if ((lease->client_len == client_len) && (memcmp(lease->client, client, client_len) == 0)) return;
+
+		fr_rb_remove(range->clients, lease);
+		lease->client_len = 0;
+	}
+
+	if (!client_len) return;
+
+	find.client_len = client_len;
+	memcpy(find.client, client, client_len);
+
+	old = fr_rb_remove(range->clients, &find);
+	if (old) {
+		old->client_len = 0;
+		if (old->state != ISC_LEASE_ABANDONED) lease_state_set(range, old, ISC_LEASE_FREE);
+	}
+
+	lease->client_len = client_len;
+	memcpy(lease->client, client, client_len);
+	fr_rb_insert(range->clients, lease);
+}
+
+/** Find the lease bound to a client
+ *
+ */
+static isc_lease_t *lease_by_client(isc_lease_range_t *range, uint8_t const *client, size_t client_len)
+{
+	isc_lease_t	find;
+
+	find.client_len = client_len;
+	memcpy(find.client, client, client_len);
+
+	return fr_rb_find(range->clients, &find);
+}
+
+/** Free leases which have expired
+ *
+ * Expired leases stay bound to their client, so that the client can have
+ * the same address back if it asks again.  Abandoned leases aren't bound
+ * to anyone.
+ */
+static void range_reap(isc_lease_range_t *range, fr_time_t now)
+{
+	isc_lease_t	*lease;
+
+	while ((lease = fr_heap_peek(range->expiry)) && fr_time_lteq(lease->expires, now)) {
+		lease_state_set(range, lease, ISC_LEASE_FREE);
+	}
+}
+
+/** Find a free address in a range
+ *
+ */
+static isc_lease_t *range_alloc(isc_lease_range_t *range)
+{
+	uint32_t	words = (range->end - range->start) / 64 + 1;
+	uint32_t	word = range->cursor / 64;
+	uint32_t	i;
+
+	if (!range->count[ISC_LEASE_FREE]) return NULL;
+
+	for (i = 0; i <= words; i++, word++) {
+		uint64_t	map;
+		uint32_t	idx;
+
+		if (word >= words) word = 0;
+
+		map = range->free[word];
+
+		/*
+		 *	Next fit.  Skip the addresses before the
+		 *	cursor the first time we look at its word.
+		 */
+		if (i == 0) map &= ~((((uint64_t) 1) << (range->cursor % 64)) - 1);
+		if (!map) continue;
+
+		idx = word * 64 + __builtin_ctzll(map);
+		range->cursor = idx + 1;
+		if (range->cursor > (range->end - range->start)) range->cursor = 0;
+
+		return &range->leases[idx];
+	}
+
+	return NULL;
+}
+
+static void lease_addr_print(char *out, size_t outlen, uint32_t addr)
+{
+	snprintf(out, outlen, "%u.%u.%u.%u",
+		 (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+}
+
+/** Format a journal record for a lease
+ *
+ * seq state address expires client
+ */
+static size_t lease_record(char *out, size_t outlen, isc_lease_t const *lease)
+{
+	static char const hex[] = "0123456789abcdef";
+	char	addr[INET_ADDRSTRLEN];
+	char	*p, *end = out + outlen;
+	int	len;
+	size_t	i;
+
+	lease_addr_print(addr, sizeof(addr), lease->addr);
+
+	len = snprintf(out, outlen, "%" PRIu64 " %s %s %" PRId64 " ", lease->seq,
+		       fr_table_str_by_value(isc_lease_state_table, lease->state, "free"), addr,
+		       (lease->state == ISC_LEASE_FREE) ? (int64_t) 0 : fr_time_to_sec(lease->expires));
+	p = out + len;
+
+	if (!lease->client_len) {
+		*(p++) = '-';
+	} else {
+		for (i = 0; (i < lease->client_len) && (p < (end - 3)); i++) {
+			*(p++) = hex[lease->client[i] >> 4];
+			*(p++) = hex[lease->client[i] & 0x0f];
+		}
+	}
+	*(p++) = '\n';
+	*p = '\0';
+
+	return p - out;
+}
+
+/** Write a snapshot of the leases
+ *
+ * Takes each range mutex in turn.
+ *
+ * @return the number of records written.
+ */
+static uint64_t journal_snapshot(isc_lease_pool_t *pool, FILE *fp)
+{
+	size_t		i;
+	uint32_t	j;
+	uint64_t	records = 0;
+	char		buffer[256];
+
+	for (i = 0; i < talloc_array_length(pool->ranges); i++) {
+		isc_lease_range_t *range = pool->ranges[i];
+
+		pthread_mutex_lock(&range->mutex);
+		for (j = 0; j <= (range->end - range->start); j++) {
+			isc_lease_t *lease = &range->leases[j];
+
+			/*
+			 *	Offers aren't written to the journal.
+			 *	Free leases are only interesting if
+			 *	someone used them.
+			 */
+			if (lease->state == ISC_LEASE_OFFERED) continue;
+			if ((lease->state == ISC_LEASE_FREE) && !lease->client_len) continue;
+
+			lease_record(buffer, sizeof(buffer), lease);
+			fputs(buffer, fp);
+			records++;
+		}
+		pthread_mutex_unlock(&range->mutex);
+	}
+
+	return records;
+}
+
+/** Rewrite the journal from the current state of the leases
+ *
+ * Must be called without the pool mutex held.  It's only taken to start
+ * the backlog, and again to swap the new journal in.
+ */
+static int journal_compact(isc_lease_pool_t *pool)
+{
+	char		*tmp;
+	FILE		*fp;
+	int		fd;
+	uint64_t	records;
+	size_t		len;
+	ssize_t		slen;
+
+	tmp = talloc_asprintf(NULL, "%s.tmp", pool->filename);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ERROR("Failed creating %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	/*
+	 *	Anything which changes after this point is in
+	 *	the backlog, even if it's also in the snapshot.
+	 *	Replaying it twice is harmless, as the sequence
+	 *	numbers are the same.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	pool->compacting = true;
+	pool->backlog_records = 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	records = journal_snapshot(pool, fp);
+
+	if ((fflush(fp) != 0) || (fsync(fileno(fp)) < 0)) {
+		ERROR("Failed writing %s: %s", tmp, fr_syserror(errno));
+	error:
+		fclose(fp);
+		unlink(tmp);
+		talloc_free(tmp);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->compacting = false;
+		TALLOC_FREE(pool->backlog);
+		pthread_mutex_unlock(&pool->mutex);
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		ERROR("Failed opening %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	len = talloc_array_length(pool->backlog);
+	if (len > 1) {
+		do {
+			slen = write(fd, pool->backlog, len - 1);
+		} while ((slen < 0) && (errno == EINTR));
+
+		if (slen != (ssize_t)(len - 1)) {
+			ERROR("Failed writing %s: %s", tmp, (slen < 0) ? fr_syserror(errno) : "short write");
+		fail:
+			pthread_mutex_unlock(&pool->mutex);
+			close(fd);
+			goto error;
+		}
+	}
+
+	if (rename(tmp, pool->filename) < 0) {
+		ERROR("Failed renaming %s to %s: %s", tmp, pool->filename, fr_syserror(errno));
+		goto fail;
+	}
+
+	if (pool->fd >= 0) close(pool->fd);
+	pool->fd = fd;
+	pool->compacted = records;
+	pool->records = records + pool->backlog_records;
+	pool->compacting = false;
+	TALLOC_FREE(pool->backlog);
+	pthread_mutex_unlock(&pool->mutex);
+
+	fclose(fp);
+	talloc_free(tmp);
+
+	DEBUG2("Compacted %s to %" PRIu64 " records", pool->filename, records);
+
+	return 0;
+}
+
+/** Compact the journal whenever a worker says it's too large
+ *
+ */
+static void *journal_compactor(void *uctx)
+{
+	isc_lease_pool_t	*pool = talloc_get_type_abort(uctx, isc_lease_pool_t);
+	int			ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && !pool->compact) pthread_cond_wait(&pool->wakeup, &pool->mutex);
+		if (pool->stop) break;
+		pthread_mutex_unlock(&pool->mutex);
+
+		ret = journal_compact(pool);
+
+		/*
+		 *	The backlog may have been large enough to
+		 *	need another pass.  If compaction failed,
+		 *	wait for the next write before trying again.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		pool->compact = (ret == 0) && JOURNAL_TOO_LARGE(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Append a record to the journal, and ask for it to be compacted if it's too large
+ *
+ */
+static void journal_write(isc_lease_pool_t *pool, char const *record, size_t len)
+{
+	ssize_t	slen;
+
+	if (!pool->filename) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->fd < 0) goto done;
+
+	/*
+	 *	The file is opened O_APPEND, and records are small,
+	 *	so the write is atomic.
+	 */
+	do {
+		slen = write(pool->fd, record, len);
+	} while ((slen < 0) && (errno == EINTR));
+
+	if (slen < 0) {
+		ERROR("Failed writing to %s: %s", pool->filename, fr_syserror(errno));
+		goto done;
+	}
+
+	if (pool->compacting) {
+		MEM(pool->backlog = talloc_strndup_append_buffer(pool->backlog, record, len));
+		pool->backlog_records++;
+	}
+
+	pool->records++;
+	if (!pool->compact && pool->thread_running && JOURNAL_TOO_LARGE(pool)) {
+		pool->compact = true;
+		pthread_cond_signal(&pool->wakeup);
+	}
+
+done:
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static int hex_decode(uint8_t *out, size_t outlen, char const *hex)
+{
+	size_t	len = strlen(hex);
+	size_t	i;
+
+	if ((len & 0x01) || ((len / 2) > outlen)) return -1;
+
+	for (i = 0; i < len; i += 2) {
+		unsigned int byte;
+
+		if (!isxdigit((uint8_t) hex[i]) || !isxdigit((uint8_t) hex[i + 1])) return -1;
+		if (sscanf(hex + i, "%2x", &byte) != 1) return -1;
+		out[i / 2] = byte;
+	}
+
+	return len / 2;
+}
+
+/** Apply a record from the journal
+ *
+ * Records for addresses which are no longer in a range are ignored, as
+ * are records older than the ones we already have.
+ */
+static int journal_apply(isc_lease_pool_t *pool, char const *line, fr_time_t now)
+{
+	uint64_t		seq;
+	char			state_str[16], addr_str[INET_ADDRSTRLEN], client_str[(ISC_LEASE_CLIENT_MAX * 2) + 1];
+	int64_t			expires;
+	isc_lease_state_t	state;
+	struct in_addr		addr;
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+	int			client_len = 0;
+
+	if (sscanf(line, "%" SCNu64 " %15s %15s %" SCNd64 " %128s",
+		   &seq, state_str, addr_str, &expires, client_str) != 5) {
+		fr_strerror_const("malformed record");
+		return -1;
+	}
+
+	state = fr_table_value_by_str(isc_lease_state_table, state_str, ISC_LEASE_MAX);
+	if ((state == ISC_LEASE_MAX) || (state == ISC_LEASE_OFFERED)) {
+		fr_strerror_printf("invalid state '%s'", state_str);
+		return -1;
+	}
+
+	if (inet_pton(AF_INET, addr_str, &addr) != 1) {
+		fr_strerror_printf("invalid address '%s'", addr_str);
+		return -1;
+	}
+
+	if (strcmp(client_str, "-") != 0) {
+		client_len = hex_decode(client, sizeof(client), client_str);
+		if (client_len <= 0) {
+			fr_strerror_printf("invalid client '%s'", client_str);
+			return -1;
+		}
+	}
+
+	if (seq >= atomic_load(&pool->seq)) atomic_store(&pool->seq, seq + 1);
+
+	range = range_find(pool, addr.s_addr);
+	if (!range) return 0;
+
+	lease = &range->leases[ntohl(addr.s_addr) - range->start];
+	if (seq <= lease->seq) return 0;
+	lease->seq = seq;
+
+	lease_bind(range, lease, client, client_len);
+	lease_state_set(range, lease, ISC_LEASE_FREE);
+
+	if (state == ISC_LEASE_FREE) return 0;
+
+	/*
+	 *	Active leases which expired while we were down are
+	 *	free, but stay bound to their client.
+	 */
+	if (fr_time_lteq(fr_time_from_sec(expires), now)) return 0;
+
+	lease_state_set(range, lease, state);
+	lease_expires_set(range, lease, fr_time_from_sec(expires));
+
+	return 0;
+}
+
+/** Finish setting up the pool, and recover leases from the journal
+ *
+ * Must be called after all of the ranges have been added.
+ *
+ * @param[in] pool	to open.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int isc_lease_pool_open(isc_lease_pool_t *pool)
+{
+	FILE		*fp;
+	char		buffer[512];
+	int		lineno = 0;
+	int		ret;
+	fr_time_t	now = fr_time();
+
+	pool->frozen = fr_trie_freeze(pool, pool->subnets);
+	if (!pool->frozen) return -1;
+
+	if (!pool->filename) return 0;
+
+	fp = fopen(pool->filename, "r");
+	if (!fp) {
+		if (errno != ENOENT) {
+			fr_strerror_printf("Failed opening %s: %s", pool->filename, fr_syserror(errno));
+			return -1;
+		}
+
+		goto compact;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		lineno++;
+
+		/*
+		 *	A partial record at the end of the file is
+		 *	what's left from a crash.  Ignore it.
+		 */
+		if (!strchr(buffer, '\n')) {
+			WARN("%s[%d]: Ignoring truncated record", pool->filename, lineno);
+			break;
+		}
+
+		if (journal_apply(pool, buffer, now) < 0) {
+			WARN("%s[%d]: Ignoring record - %s", pool->filename, lineno, fr_strerror());
+		}
+	}
+	fclose(fp);
+
+	DEBUG2("Recovered %d records from %s", lineno, pool->filename);
+
+compact:
+	if (journal_compact(pool) < 0) {
+		fr_strerror_printf("Failed writing %s", pool->filename);
+		return -1;
+	}
+
+	ret = pthread_create(&pool->thread, NULL, journal_compactor, pool);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating journal compaction thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	pool->thread_running = true;
+
+	return 0;
+}
+
+/** Offer an address to a client
+ *
+ * In order of preference, the client gets:
+ *
+ *  - the address it already has, or had, in this subnet.
+ *  - the address it asked for, if that is free.
+ *  - any free address.
+ *
+ * @param[out] out		The address, in network byte order.
+ * @param[in] pool		to allocate from.
+ * @param[in] subnet		the client is on.
+ * @param[in] client		key, i.e. Client-Identifier, or hardware address.
+ * @param[in] client_len	Length of the key.
+ * @param[in] requested		address, in network byte order.  May be 0.
+ * @param[in] offer_time	How long to reserve the address for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are no free addresses.
+ */
+int isc_lease_offer(uint32_t *out, isc_lease_pool_t *pool, isc_lease_subnet_t *subnet,
+		    uint8_t const *client, size_t client_len, uint32_t requested, fr_time_delta_t offer_time)
+{
+	fr_time_t		now = fr_time();
+	fr_time_t		expires = fr_time_add(now, offer_time);
+	size_t			i, num = talloc_array_length(subnet->ranges);
+	uint32_t		first;
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+
+	fr_assert(client_len <= ISC_LEASE_CLIENT_MAX);
+
+	/*
+	 *	Does the client already have an address?
+	 */
+	for (i = 0; i < num; i++) {
+		range = subnet->ranges[i];
+
+		pthread_mutex_lock(&range->mutex);
+		range_reap(range, now);
+
+		lease = lease_by_client(range, client, client_len);
+		if (!lease) {
+			pthread_mutex_unlock(&range->mutex);
+			continue;
+		}
+
+		/*
+		 *	Don't shorten an active lease, or revive an
+		 *	abandoned one.
+		 */
+		switch (lease->state) {
+		case ISC_LEASE_FREE:
+			lease_state_set(range, lease, ISC_LEASE_OFFERED);
+			FALL_THROUGH;
+
+		case ISC_LEASE_OFFERED:
+			lease_expires_set(range, lease, expires);
+			lease->seq = atomic_fetch_add(&pool->seq, 1);
+			break;
+
+		default:
+			break;
+		}
+		*out = htonl(lease->addr);
+		pthread_mutex_unlock(&range->mutex);
+		return 0;
+	}
+
+	/*
+	 *	Does it want a particular address?
+	 */
+	if (requested) {
+		range = range_find(pool, requested);
+		if (range && (range->subnet == subnet)) {
+			pthread_mutex_lock(&range->mutex);
+			lease = &range->leases[ntohl(requested) - range->start];
+			if (lease->state == ISC_LEASE_FREE) goto offer;
+			pthread_mutex_unlock(&range->mutex);
+		}
+	}
+
+	/*
+	 *	Start at a different range each time, so that
+	 *	concurrent allocations use different locks.
+	 */
+	first = atomic_fetch_add(&subnet->next, 1);
+	for (i = 0; i < num; i++) {
+		range = subnet->ranges[(first + i) % num];
+
+		pthread_mutex_lock(&range->mutex);
+		lease = range_alloc(range);
+		if (lease) goto offer;
+		pthread_mutex_unlock(&range->mutex);
+	}
+
+	return -1;
+
+offer:
+	lease_bind(range, lease, client, client_len);
+	lease_state_set(range, lease, ISC_LEASE_OFFERED);
+	lease_expires_set(range, lease, expires);
+	lease->seq = atomic_fetch_add(&pool->seq, 1);
+	*out = htonl(lease->addr);
+	pthread_mutex_unlock(&range->mutex);
+
+	return 0;
+}
+
+/** Make a lease active
+ *
+ * @param[in] pool		the address is in.
+ * @param[in] subnet		the client is on.  May be NULL if unknown.
+ * @param[in] client		key, i.e. Client-Identifier, or hardware address.
+ * @param[in] client_len	Length of the key.
+ * @param[in] addr		which the client asked for, in network byte order.
+ * @param[in] lease_time	How long the lease lasts.
+ * @return
+ *	- 1 if the lease is now active.
+ *	- 0 if the address isn't in one of our ranges.
+ *	- -1 if the client can't have the address.
+ */
+int isc_lease_commit(isc_lease_pool_t *pool, isc_lease_subnet_t *subnet,
+		     uint8_t const *client, size_t client_len, uint32_t addr, fr_time_delta_t lease_time)
+{
+	fr_time_t		now = fr_time();
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+	char			buffer[256];
+	size_t			len;
+
+	fr_assert(client_len <= ISC_LEASE_CLIENT_MAX);
+
+	range = range_find(pool, addr);
+	if (!range) return 0;
+
+	/*
+	 *	The address is ours, but it's on a different network.
+	 */
+	if (subnet && (range->subnet != subnet)) return -1;
+
+	pthread_mutex_lock(&range->mutex);
+	range_reap(range, now);
+
+	lease = &range->leases[ntohl(addr) - range->start];
+	switch (lease->state) {
+	case ISC_LEASE_ABANDONED:
+	fail:
+		pthread_mutex_unlock(&range->mutex);
+		return -1;
+
+	case ISC_LEASE_FREE:
+		break;
+
+	default:
+		if ((lease->client_len != client_len) || (memcmp(lease->client, client, client_len) != 0)) goto fail;
+		break;
+	}
+
+	lease_bind(range, lease, client, client_len);
+	lease_state_set(range, lease, ISC_LEASE_ACTIVE);
+	lease_expires_set(range, lease, fr_time_add(now, lease_time));
+	lease->seq = atomic_fetch_add(&pool->seq, 1);
+
+	len = lease_record(buffer, sizeof(buffer), lease);
+	pthread_mutex_unlock(&range->mutex);
+
+	journal_write(pool, buffer, len);
+
+	return 1;
+}
+
+/** Find a lease bound to a client, and lock its range
+ *
+ */
+static isc_lease_t *lease_find_locked(isc_lease_range_t **out, isc_lease_pool_t *pool,
+				      uint8_t const *client, size_t client_len, uint32_t addr)
+{
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+
+	range = range_find(pool, addr);
+	if (!range) return NULL;
+
+	pthread_mutex_lock(&range->mutex);
+	lease = &range->leases[ntohl(addr) - range->start];
+
+	if (((lease->state != ISC_LEASE_OFFERED) && (lease->state != ISC_LEASE_ACTIVE)) ||
+	    (lease->client_len != client_len) || (memcmp(lease->client, client, client_len) != 0)) {
+		pthread_mutex_unlock(&range->mutex);
+		return NULL;
+	}
+
+	*out = range;
+	return lease;
+}
+
+/** Release a lease
+ *
+ * The address stays bound to the client, so the client gets it back if
+ * nobody else has taken it.
+ *
+ * @param[in] pool		the address is in.
+ * @param[in] client		key, i.e. Client-Identifier, or hardware address.
+ * @param[in] client_len	Length of the key.
+ * @param[in] addr		which the client is releasing, in network byte order.
+ * @return
+ *	- 1 if the lease was released.
+ *	- 0 if the client didn't have a lease for the address.
+ */
+int isc_lease_release(isc_lease_pool_t *pool, uint8_t const *client, size_t client_len, uint32_t addr)
+{
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+	char			buffer[256];
+	size_t			len;
+
+	fr_assert(client_len <= ISC_LEASE_CLIENT_MAX);
+
+	lease = lease_find_locked(&range, pool, client, client_len, addr);
+	if (!lease) return 0;
+
+	lease_state_set(range, lease, ISC_LEASE_FREE);
+	lease->seq = atomic_fetch_add(&pool->seq, 1);
+
+	len = lease_record(buffer, sizeof(buffer), lease);
+	pthread_mutex_unlock(&range->mutex);
+
+	journal_write(pool, buffer, len);
+
+	return 1;
+}
+
+/** Mark an address as unusable, because a client says it's in use
+ *
+ * @param[in] pool		the address is in.
+ * @param[in] client		key, i.e. Client-Identifier, or hardware address.
+ * @param[in] client_len	Length of the key.
+ * @param[in] addr		which the client is declining, in network byte order.
+ * @param[in] abandon_time	How long before the address is used again.
+ * @return
+ *	- 1 if the address was abandoned.
+ *	- 0 if the client hadn't been offered the address.
+ */
+int isc_lease_decline(isc_lease_pool_t *pool, uint8_t const *client, size_t client_len, uint32_t addr,
+		      fr_time_delta_t abandon_time)
+{
+	isc_lease_range_t	*range;
+	isc_lease_t		*lease;
+	char			buffer[256];
+	size_t			len;
+
+	fr_assert(client_len <= ISC_LEASE_CLIENT_MAX);
+
+	lease = lease_find_locked(&range, pool, client, client_len, addr);
+	if (!lease) return 0;
+
+	lease_bind(range, lease, NULL, 0);
+	lease_state_set(range, lease, ISC_LEASE_ABANDONED);
+	lease_expires_set(range, lease, fr_time_add(fr_time(), abandon_time));
+	lease->seq = atomic_fetch_add(&pool->seq, 1);
+
+	len = lease_record(buffer, sizeof(buffer), lease);
+	pthread_mutex_unlock(&range->mutex);
+
+	journal_write(pool, buffer, len);
+
+	return 1;
+}
+
+/** Count leases in each state
+ *
+ */
+void isc_lease_stats(isc_lease_stats_t *stats, isc_lease_pool_t *pool)
+{
+	size_t i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < talloc_array_length(pool->ranges); i++) {
+		isc_lease_range_t *range = pool->ranges[i];
+
+		pthread_mutex_lock(&range->mutex);
+		range_reap(range, fr_time());
+		stats->total += (range->end - range->start) + 1;
+		stats->free += range->count[ISC_LEASE_FREE];
+		stats->offered += range->count[ISC_LEASE_OFFERED];
+		stats->active += range->count[ISC_LEASE_ACTIVE];
+		stats->abandoned += range->count[ISC_LEASE_ABANDONED];
+		pthread_mutex_unlock(&range->mutex);
+	}
+}
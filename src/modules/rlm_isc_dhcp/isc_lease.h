@@ -0,0 +1,75 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file isc_lease.h
+ * @brief Dynamic address allocation from ISC DHCP "range" statements.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(isc_lease_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+/** Longest client key we remember
+ *
+ * Longer Client-Identifiers are rejected by the caller, which then falls
+ * back to the hardware address.
+ */
+#define ISC_LEASE_CLIENT_MAX	(64)
+
+typedef struct isc_lease_pool_s isc_lease_pool_t;
+typedef struct isc_lease_subnet_s isc_lease_subnet_t;
+
+/** Lease statistics
+ *
+ */
+typedef struct {
+	uint64_t	total;		//!< Addresses in all ranges.
+	uint64_t	free;		//!< Addresses which can be offered.
+	uint64_t	offered;	//!< Offered, and waiting for a Request.
+	uint64_t	active;		//!< Acknowledged, and not yet expired.
+	uint64_t	abandoned;	//!< Declined by a client.
+} isc_lease_stats_t;
+
+isc_lease_pool_t	*isc_lease_pool_alloc(TALLOC_CTX *ctx, char const *filename);
+
+int			isc_lease_range_add(isc_lease_pool_t *pool, uint32_t subnet, uint8_t bits,
+					    uint32_t start, uint32_t end) CC_HINT(nonnull);
+
+int			isc_lease_pool_open(isc_lease_pool_t *pool) CC_HINT(nonnull);
+
+isc_lease_subnet_t	*isc_lease_subnet_find(isc_lease_pool_t const *pool, uint32_t addr) CC_HINT(nonnull);
+
+int			isc_lease_offer(uint32_t *out, isc_lease_pool_t *pool, isc_lease_subnet_t *subnet,
+					uint8_t const *client, size_t client_len, uint32_t requested,
+					fr_time_delta_t offer_time) CC_HINT(nonnull);
+
+int			isc_lease_commit(isc_lease_pool_t *pool, isc_lease_subnet_t *subnet,
+					 uint8_t const *client, size_t client_len, uint32_t addr,
+					 fr_time_delta_t lease_time) CC_HINT(nonnull(1,3));
+
+int			isc_lease_release(isc_lease_pool_t *pool,
+					  uint8_t const *client, size_t client_len, uint32_t addr) CC_HINT(nonnull);
+
+int			isc_lease_decline(isc_lease_pool_t *pool,
+					  uint8_t const *client, size_t client_len, uint32_t addr,
+					  fr_time_delta_t abandon_time) CC_HINT(nonnull);
+
+void			isc_lease_stats(isc_lease_stats_t *stats, isc_lease_pool_t *pool) CC_HINT(nonnull);
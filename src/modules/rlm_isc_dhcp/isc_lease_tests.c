@@ -0,0 +1,429 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the ISC DHCP lease engine
+ *
+ * @file src/modules/rlm_isc_dhcp/isc_lease_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include "isc_lease.c"
+
+#define CLIENT(_x)	(uint8_t const *)(_x), sizeof(_x) - 1
+
+static uint32_t test_ip(char const *str)
+{
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, str, &addr) != 1) return 0;
+
+	return addr.s_addr;
+}
+
+/** Allocate a pool with one range, 10.0.0.10 - 10.0.0.12
+ *
+ */
+static isc_lease_pool_t *test_pool_alloc(TALLOC_CTX *ctx, char const *filename, isc_lease_subnet_t **subnet)
+{
+	isc_lease_pool_t *pool;
+
+	pool = isc_lease_pool_alloc(ctx, filename);
+	TEST_CHECK(pool != NULL);
+	if (!pool) return NULL;
+
+	TEST_CHECK(isc_lease_range_add(pool, test_ip("10.0.0.0"), 24, test_ip("10.0.0.10"), test_ip("10.0.0.12")) == 0);
+	TEST_CHECK(isc_lease_pool_open(pool) == 0);
+	TEST_MSG("open failed: %s", fr_strerror());
+
+	*subnet = isc_lease_subnet_find(pool, test_ip("10.0.0.1"));
+	TEST_CHECK(*subnet != NULL);
+
+	return pool;
+}
+
+static isc_lease_t *test_lease(isc_lease_pool_t *pool, char const *addr)
+{
+	isc_lease_range_t *range = range_find(pool, test_ip(addr));
+
+	if (!range) return NULL;
+
+	return &range->leases[ntohl(test_ip(addr)) - range->start];
+}
+
+static unsigned int test_file_lines(char const *filename)
+{
+	FILE		*fp;
+	char		buffer[512];
+	unsigned int	lines = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) return 0;
+
+	while (fgets(buffer, sizeof(buffer), fp)) lines++;
+	fclose(fp);
+
+	return lines;
+}
+
+/** Ranges are checked, and may be given in either order
+ *
+ */
+static void test_range_add(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	isc_lease_pool_t	*pool = isc_lease_pool_alloc(ctx, NULL);
+	isc_lease_stats_t	stats;
+
+	TEST_CHECK(isc_lease_range_add(pool, test_ip("10.0.0.0"), 24, test_ip("10.0.0.10"), test_ip("10.0.0.19")) == 0);
+	TEST_CHECK(isc_lease_range_add(pool, test_ip("10.0.0.0"), 24, test_ip("10.0.0.15"), test_ip("10.0.0.25")) < 0);
+	TEST_CHECK(isc_lease_range_add(pool, test_ip("10.0.0.0"), 8, test_ip("10.0.0.0"), test_ip("10.16.0.0")) < 0);
+	TEST_CHECK(isc_lease_range_add(pool, test_ip("10.0.0.0"), 24, test_ip("10.0.0.30"), test_ip("10.0.0.20")) == 0);
+	TEST_CHECK(isc_lease_pool_open(pool) == 0);
+
+	TEST_CHECK(isc_lease_subnet_find(pool, test_ip("10.0.0.1")) != NULL);
+	TEST_CHECK(isc_lease_subnet_find(pool, test_ip("10.0.1.1")) == NULL);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.total == 21);
+	TEST_CHECK(stats.free == 21);
+
+	talloc_free(ctx);
+}
+
+/** Clients get their own address, then the one they asked for, then any free one
+ *
+ */
+static void test_offer(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool = test_pool_alloc(ctx, NULL, &subnet);
+	fr_time_delta_t		offer_time = fr_time_delta_from_sec(60);
+	isc_lease_stats_t	stats;
+	uint32_t		a, b, c, d;
+
+	TEST_CHECK(isc_lease_offer(&a, pool, subnet, CLIENT("a"), 0, offer_time) == 0);
+	TEST_CHECK(a == test_ip("10.0.0.10"));
+
+	TEST_CHECK(isc_lease_offer(&d, pool, subnet, CLIENT("a"), test_ip("10.0.0.12"), offer_time) == 0);
+	TEST_CHECK(d == a);
+
+	TEST_CHECK(isc_lease_offer(&b, pool, subnet, CLIENT("b"), test_ip("10.0.0.12"), offer_time) == 0);
+	TEST_CHECK(b == test_ip("10.0.0.12"));
+
+	TEST_CHECK(isc_lease_offer(&c, pool, subnet, CLIENT("c"), test_ip("10.0.0.12"), offer_time) == 0);
+	TEST_CHECK(c == test_ip("10.0.0.11"));
+
+	TEST_CHECK(isc_lease_offer(&d, pool, subnet, CLIENT("d"), 0, offer_time) < 0);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.offered == 3);
+	TEST_CHECK(stats.free == 0);
+
+	talloc_free(ctx);
+}
+
+/** Commits, releases and declines only apply to the right client
+ *
+ */
+static void test_commit_release_decline(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool = test_pool_alloc(ctx, NULL, &subnet);
+	fr_time_delta_t		t = fr_time_delta_from_sec(60);
+	isc_lease_stats_t	stats;
+	uint32_t		a, b, again;
+
+	TEST_CHECK(isc_lease_offer(&a, pool, subnet, CLIENT("a"), 0, t) == 0);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("a"), a, t) == 1);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), a, t) < 0);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), test_ip("192.168.0.1"), t) == 0);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.active == 1);
+
+	TEST_CHECK(isc_lease_release(pool, CLIENT("b"), a) == 0);
+	TEST_CHECK(isc_lease_release(pool, CLIENT("a"), a) == 1);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.active == 0);
+	TEST_CHECK(stats.free == 3);
+
+	/*
+	 *	Released leases stay bound to the client.
+	 */
+	TEST_CHECK(isc_lease_offer(&again, pool, subnet, CLIENT("a"), 0, t) == 0);
+	TEST_CHECK(again == a);
+
+	TEST_CHECK(isc_lease_offer(&b, pool, subnet, CLIENT("b"), 0, t) == 0);
+	TEST_CHECK(isc_lease_decline(pool, CLIENT("a"), b, t) == 0);
+	TEST_CHECK(isc_lease_decline(pool, CLIENT("b"), b, t) == 1);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.abandoned == 1);
+
+	/*
+	 *	Abandoned addresses aren't offered again,
+	 *	even to the client which declined them.
+	 */
+	TEST_CHECK(isc_lease_offer(&again, pool, subnet, CLIENT("b"), b, t) == 0);
+	TEST_CHECK(again != b);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("c"), b, t) < 0);
+
+	talloc_free(ctx);
+}
+
+/** Leases leave the expiry heap in order, and stay bound when they expire
+ *
+ */
+static void test_expiry(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool = test_pool_alloc(ctx, NULL, &subnet);
+	isc_lease_range_t	*range;
+	isc_lease_stats_t	stats;
+	isc_lease_t		*lease;
+	uint32_t		a, again;
+
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("a"), test_ip("10.0.0.10"), fr_time_delta_from_sec(100)) == 1);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), test_ip("10.0.0.11"), fr_time_delta_from_sec(10)) == 1);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("c"), test_ip("10.0.0.12"), fr_time_delta_from_sec(50)) == 1);
+
+	range = range_find(pool, test_ip("10.0.0.10"));
+	TEST_CHECK(range != NULL);
+	TEST_CHECK(fr_heap_num_elements(range->expiry) == 3);
+
+	lease = fr_heap_pop(range->expiry);
+	TEST_CHECK(lease && (lease->addr == ntohl(test_ip("10.0.0.11"))));
+	lease = fr_heap_pop(range->expiry);
+	TEST_CHECK(lease && (lease->addr == ntohl(test_ip("10.0.0.12"))));
+	lease = fr_heap_pop(range->expiry);
+	TEST_CHECK(lease && (lease->addr == ntohl(test_ip("10.0.0.10"))));
+
+	/*
+	 *	An offer which has already run out.
+	 */
+	TEST_CHECK(isc_lease_release(pool, CLIENT("a"), test_ip("10.0.0.10")) == 1);
+	TEST_CHECK(isc_lease_offer(&a, pool, subnet, CLIENT("a"), 0, fr_time_delta_wrap(0)) == 0);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.offered == 0);
+	TEST_CHECK(stats.free == 1);
+
+	lease = test_lease(pool, "10.0.0.10");
+	TEST_CHECK(lease && (lease->state == ISC_LEASE_FREE));
+	TEST_CHECK(lease && !fr_heap_entry_inserted(lease->heap_id));
+
+	TEST_CHECK(isc_lease_offer(&again, pool, subnet, CLIENT("a"), 0, fr_time_delta_from_sec(60)) == 0);
+	TEST_CHECK(again == a);
+
+	talloc_free(ctx);
+}
+
+/** Journal records are parsed, checked, and applied in sequence order
+ *
+ */
+static void test_journal_apply(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool = test_pool_alloc(ctx, NULL, &subnet);
+	fr_time_t		now = fr_time();
+	int64_t			future = fr_time_to_sec(now) + 3600;
+	isc_lease_t		*lease;
+	char			buffer[256];
+
+	TEST_CHECK(journal_apply(pool, "garbage\n", now) < 0);
+	TEST_CHECK(journal_apply(pool, "5 offered 10.0.0.10 0 -\n", now) < 0);
+	TEST_CHECK(journal_apply(pool, "5 bogus 10.0.0.10 0 -\n", now) < 0);
+	TEST_CHECK(journal_apply(pool, "5 active 10.0.0.300 0 -\n", now) < 0);
+	TEST_CHECK(journal_apply(pool, "5 active 10.0.0.10 0 zz\n", now) < 0);
+	TEST_CHECK(journal_apply(pool, "5 active 10.0.0.10 0 abc\n", now) < 0);
+
+	snprintf(buffer, sizeof(buffer), "5 active 10.0.0.10 %" PRId64 " 0a0b\n", future);
+	TEST_CHECK(journal_apply(pool, buffer, now) == 0);
+
+	lease = test_lease(pool, "10.0.0.10");
+	TEST_ASSERT(lease != NULL);
+	TEST_CHECK(lease->state == ISC_LEASE_ACTIVE);
+	TEST_CHECK(lease->client_len == 2);
+	TEST_CHECK((lease->client[0] == 0x0a) && (lease->client[1] == 0x0b));
+	TEST_CHECK(fr_time_to_sec(lease->expires) == future);
+
+	/*
+	 *	Older records don't override newer ones.
+	 */
+	TEST_CHECK(journal_apply(pool, "4 free 10.0.0.10 0 -\n", now) == 0);
+	TEST_CHECK(lease->state == ISC_LEASE_ACTIVE);
+
+	/*
+	 *	Leases which expired while we were down are
+	 *	free, but still bound.
+	 */
+	TEST_CHECK(journal_apply(pool, "7 active 10.0.0.11 1 0c\n", now) == 0);
+	lease = test_lease(pool, "10.0.0.11");
+	TEST_ASSERT(lease != NULL);
+	TEST_CHECK(lease->state == ISC_LEASE_FREE);
+	TEST_CHECK(lease->client_len == 1);
+
+	/*
+	 *	Addresses which aren't in a range any more.
+	 */
+	TEST_CHECK(journal_apply(pool, "9 active 192.168.0.1 0 -\n", now) == 0);
+	TEST_CHECK(atomic_load(&pool->seq) == 10);
+
+	talloc_free(ctx);
+}
+
+/** Leases survive a restart, and the journal is compacted on open
+ *
+ */
+static void test_journal_replay(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	char			dir[] = "/tmp/isc_lease_tests.XXXXXX";
+	char			*filename;
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool;
+	fr_time_delta_t		t = fr_time_delta_from_sec(3600);
+	isc_lease_stats_t	stats;
+	uint32_t		a, b, c, again;
+
+	TEST_ASSERT(mkdtemp(dir) != NULL);
+	filename = talloc_asprintf(ctx, "%s/leases", dir);
+
+	pool = test_pool_alloc(ctx, filename, &subnet);
+	TEST_ASSERT(pool != NULL);
+
+	TEST_CHECK(isc_lease_offer(&a, pool, subnet, CLIENT("a"), 0, t) == 0);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("a"), a, t) == 1);
+	TEST_CHECK(isc_lease_offer(&b, pool, subnet, CLIENT("b"), 0, t) == 0);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), b, t) == 1);
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), b, t) == 1);
+	TEST_CHECK(isc_lease_release(pool, CLIENT("b"), b) == 1);
+	TEST_CHECK(isc_lease_offer(&c, pool, subnet, CLIENT("c"), 0, t) == 0);
+	TEST_CHECK(isc_lease_decline(pool, CLIENT("c"), c, t) == 1);
+	TEST_CHECK(test_file_lines(filename) == 5);
+
+	talloc_free(pool);
+
+	pool = test_pool_alloc(ctx, filename, &subnet);
+	TEST_ASSERT(pool != NULL);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.active == 1);
+	TEST_CHECK(stats.abandoned == 1);
+	TEST_CHECK(stats.free == 1);
+
+	/*
+	 *	One record for each lease which isn't free and
+	 *	unused.
+	 */
+	TEST_CHECK(test_file_lines(filename) == 3);
+
+	TEST_CHECK(isc_lease_offer(&again, pool, subnet, CLIENT("a"), 0, t) == 0);
+	TEST_CHECK(again == a);
+	TEST_CHECK(isc_lease_offer(&again, pool, subnet, CLIENT("b"), 0, t) == 0);
+	TEST_CHECK(again == b);
+
+	talloc_free(pool);
+
+	unlink(filename);
+	rmdir(dir);
+	talloc_free(ctx);
+}
+
+/** Records written while the compaction thread runs aren't lost
+ *
+ */
+static void test_journal_compact(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	char			dir[] = "/tmp/isc_lease_tests.XXXXXX";
+	char			*filename;
+	isc_lease_subnet_t	*subnet;
+	isc_lease_pool_t	*pool;
+	fr_time_delta_t		t = fr_time_delta_from_sec(3600);
+	isc_lease_stats_t	stats;
+	uint64_t		compacted = 0;
+	bool			busy = true;
+	int			i;
+
+	TEST_ASSERT(mkdtemp(dir) != NULL);
+	filename = talloc_asprintf(ctx, "%s/leases", dir);
+
+	pool = test_pool_alloc(ctx, filename, &subnet);
+	TEST_ASSERT(pool != NULL);
+
+	/*
+	 *	Enough churn to need several compactions.
+	 */
+	for (i = 0; i < (ISC_LEASE_JOURNAL_SLACK * 8); i++) {
+		TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("a"), test_ip("10.0.0.10"), t) == 1);
+		TEST_CHECK(isc_lease_release(pool, CLIENT("a"), test_ip("10.0.0.10")) == 1);
+		TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("b"), test_ip("10.0.0.11"), t) == 1);
+	}
+	TEST_CHECK(isc_lease_commit(pool, subnet, CLIENT("a"), test_ip("10.0.0.10"), t) == 1);
+
+	for (i = 0; (i < 5000) && busy; i++) {
+		pthread_mutex_lock(&pool->mutex);
+		busy = pool->compact;
+		compacted = pool->compacted;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (busy) usleep(1000);
+	}
+	TEST_CHECK(!busy);
+	TEST_CHECK(compacted > 0);
+	TEST_MSG("Journal was never compacted");
+
+	/*
+	 *	The journal never grows much past the slack.
+	 */
+	TEST_CHECK(test_file_lines(filename) < ((ISC_LEASE_JOURNAL_SLACK + 2) * 2));
+
+	talloc_free(pool);
+
+	pool = test_pool_alloc(ctx, filename, &subnet);
+	TEST_ASSERT(pool != NULL);
+
+	isc_lease_stats(&stats, pool);
+	TEST_CHECK(stats.active == 2);
+	TEST_CHECK(test_lease(pool, "10.0.0.10")->state == ISC_LEASE_ACTIVE);
+	TEST_CHECK(test_lease(pool, "10.0.0.11")->state == ISC_LEASE_ACTIVE);
+
+	talloc_free(pool);
+
+	unlink(filename);
+	rmdir(dir);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "range_add",			test_range_add },
+	{ "offer",			test_offer },
+	{ "commit_release_decline",	test_commit_release_decline },
+	{ "expiry",			test_expiry },
+	{ "journal_apply",		test_journal_apply },
+	{ "journal_replay",		test_journal_replay },
+	{ "journal_compact",		test_journal_compact },
+
+	{ NULL }
+};
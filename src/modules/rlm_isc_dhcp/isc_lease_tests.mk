@@ -0,0 +1,8 @@
+TARGET		:= isc_lease_tests
+
+SOURCES		:= isc_lease_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.la libfreeradius-server.a
@@ -31,6 +31,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/map_proc.h>
 
+#include "isc_lease.h"
+
 static fr_dict_t const *dict_dhcpv4;
 
 extern fr_dict_autoload_t rlm_isc_dhcp_dict[];
@@ -46,6 +48,10 @@ static fr_dict_attr_t const *attr_server_name;
 static fr_dict_attr_t const *attr_boot_filename;
 static fr_dict_attr_t const *attr_server_ip_address;
 static fr_dict_attr_t const *attr_server_identifier;
+static fr_dict_attr_t const *attr_client_ip_address;
+static fr_dict_attr_t const *attr_requested_ip_address;
+static fr_dict_attr_t const *attr_ip_address_lease_time;
+static fr_dict_attr_t const *attr_network_subnet;
 
 extern fr_dict_attr_autoload_t rlm_isc_dhcp_dict_attr[];
 fr_dict_attr_autoload_t rlm_isc_dhcp_dict_attr[] = {
@@ -56,6 +62,10 @@ fr_dict_attr_autoload_t rlm_isc_dhcp_dict_attr[] = {
 	{ .out = &attr_boot_filename, .name = "Boot-Filename", .type = FR_TYPE_STRING, .dict = &dict_dhcpv4},
 	{ .out = &attr_server_ip_address, .name = "Server-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
 	{ .out = &attr_server_identifier, .name = "Server-Identifier", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_client_ip_address, .name = "Client-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_requested_ip_address, .name = "Requested-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_ip_address_lease_time, .name = "IP-Address-Lease-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
+	{ .out = &attr_network_subnet, .name = "Network-Subnet", .type = FR_TYPE_IPV4_PREFIX, .dict = &dict_dhcpv4},
 
 	{ NULL }
 };
@@ -89,6 +99,15 @@ typedef struct {
 	 */
 	fr_hash_table_t		*hosts_by_ether;       	//!< by MAC address
 	fr_hash_table_t		*hosts_by_uid;		//!< by client identifier
+
+	/*
+	 *	Dynamic allocation from "range" statements.
+	 */
+	char const		*lease_file;		//!< where leases are saved.
+	fr_time_delta_t		default_lease_time;
+	fr_time_delta_t		offer_time;		//!< how long an offered address is reserved.
+	fr_time_delta_t		abandon_time;		//!< how long a declined address is not used.
+	isc_lease_pool_t	*leases;		//!< NULL if there are no "range" statements.
 } rlm_isc_dhcp_t;
 
 /*
@@ -98,6 +117,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_isc_dhcp_t, filename) },
 	{ FR_CONF_OFFSET("debug", FR_TYPE_BOOL, rlm_isc_dhcp_t, debug) },
 	{ FR_CONF_OFFSET("pedantic", FR_TYPE_BOOL, rlm_isc_dhcp_t, pedantic) },
+	{ FR_CONF_OFFSET("lease_file", FR_TYPE_FILE_OUTPUT, rlm_isc_dhcp_t, lease_file) },
+	{ FR_CONF_OFFSET("default_lease_time", FR_TYPE_TIME_DELTA, rlm_isc_dhcp_t, default_lease_time), .dflt = "43200" },
+	{ FR_CONF_OFFSET("offer_time", FR_TYPE_TIME_DELTA, rlm_isc_dhcp_t, offer_time), .dflt = "10" },
+	{ FR_CONF_OFFSET("abandon_time", FR_TYPE_TIME_DELTA, rlm_isc_dhcp_t, abandon_time), .dflt = "86400" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -195,12 +218,14 @@ struct rlm_isc_dhcp_info_s {
 	fr_hash_table_t		*hosts_by_uid;	//!< by client identifier
 	fr_pair_list_t		options;	//!< DHCP options
 	fr_trie_t		*subnets;
+	fr_trie_frozen_t	*subnets_frozen;	//!< read-only copy of subnets, for lookups.
 	rlm_isc_dhcp_info_t	*child;
 	rlm_isc_dhcp_info_t	**last;		//!< pointer to last child
 };
 
 static int read_file(rlm_isc_dhcp_t *inst, rlm_isc_dhcp_info_t *parent, char const *filename);
 static int parse_section(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info);
+static int subnets_freeze(rlm_isc_dhcp_info_t *info);
 
 static char const *spaces = "                                                                                ";
 
@@ -1526,6 +1551,20 @@ static int parse_host(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info
 /** subnet IPADDR netmask MASK { ... }
  *
  */
+/** Get number of bits set in netmask.
+ *
+ */
+static int netmask_bits(uint32_t netmask)
+{
+	netmask = netmask - ((netmask >> 1) & 0x55555555);
+	netmask = (netmask & 0x33333333) + ((netmask >> 2) & 0x33333333);
+	netmask = (netmask + (netmask >> 4)) & 0x0F0F0F0F;
+	netmask = netmask + (netmask >> 8);
+	netmask = netmask + (netmask >> 16);
+
+	return netmask & 0x0000003F;
+}
+
 static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info)
 {
 	rlm_isc_dhcp_info_t *parent;
@@ -1548,15 +1587,7 @@ static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *in
 		return -1;
 	}
 
-	/*
-	 *	Get number of bits set in netmask.
-	 */
-	netmask = netmask - ((netmask >> 1) & 0x55555555);
-	netmask = (netmask & 0x33333333) + ((netmask >> 2) & 0x33333333);
-	netmask = (netmask + (netmask >> 4)) & 0x0F0F0F0F;
-	netmask = netmask + (netmask >> 8);
-	netmask = netmask + (netmask >> 16);
-	bits = netmask & 0x0000003F;
+	bits = netmask_bits(netmask);
 
 	parent = info->parent;
 	if (parent->subnets) {
@@ -1606,6 +1637,54 @@ static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *in
 	return 2;
 }
 
+/** range IPADDR IPADDR
+ *
+ *	Ranges are kept in the lease pool, keyed by their subnet.
+ */
+static int parse_range(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info)
+{
+	rlm_isc_dhcp_info_t *parent = info->parent;
+	uint32_t subnet, netmask;
+
+	/*
+	 *	We don't do "pool" or "shared-network" yet, so
+	 *	ranges have to be directly inside of a subnet.
+	 */
+	if (!parent->cmd || (parent->cmd->type != ISC_SUBNET)) {
+		fr_strerror_const("'range' must be inside of a 'subnet'");
+		return -1;
+	}
+
+	subnet = parent->argv[0]->vb_ipv4addr;
+	netmask = parent->argv[1]->vb_ipv4addr;
+
+	if (((info->argv[0]->vb_ipv4addr & netmask) != subnet) ||
+	    ((info->argv[1]->vb_ipv4addr & netmask) != subnet)) {
+		fr_strerror_printf("range %pV %pV is not inside of subnet %pV netmask %pV",
+				   info->argv[0], info->argv[1], parent->argv[0], parent->argv[1]);
+		return -1;
+	}
+
+	if (!state->inst->leases) {
+		state->inst->leases = isc_lease_pool_alloc(state->inst, state->inst->lease_file);
+		if (!state->inst->leases) return -1;
+	}
+
+	if (isc_lease_range_add(state->inst->leases, subnet, netmask_bits(netmask),
+				info->argv[0]->vb_ipv4addr, info->argv[1]->vb_ipv4addr) < 0) {
+		fr_strerror_printf("Failed adding range %pV %pV - %s", info->argv[0], info->argv[1], fr_strerror());
+		return -1;
+	}
+
+	IDEBUG("%.*s range %pV %pV", state->braces, spaces, info->argv[0], info->argv[1]);
+
+	/*
+	 *	There's nothing to apply, so don't add it to the
+	 *	child list.
+	 */
+	return 2;
+}
+
 static rlm_isc_dhcp_info_t *get_host(request_t *request, fr_hash_table_t *hosts_by_ether, fr_hash_table_t *hosts_by_uid)
 {
 	fr_pair_t *vp;
@@ -1823,8 +1902,8 @@ subnet:
 	 *	Look in the trie for matching subnets, and apply any
 	 *	subnets that match.
 	 */
-	if (head->subnets && yiaddr) {
-		info = fr_trie_lookup_by_key(head->subnets, &yiaddr->vp_ipv4addr, 32);
+	if (head->subnets_frozen && yiaddr) {
+		info = fr_trie_frozen_lookup_by_key(head->subnets_frozen, &yiaddr->vp_ipv4addr, 32);
 		if (!info) goto recurse;
 
 		child_ret = apply(inst, request, info);
@@ -2021,7 +2100,7 @@ static const rlm_isc_dhcp_cmd_t commands[] = {
 	{ "pool SECTION",			isc_invalid, 0}, // sub pools
 	{ "preferred-lifetime UINT32", 		isc_not_done, 1}, // Lease time interval
 	{ "prefix-length-mode STRING,",        	isc_not_done, 1}, // string options. e.g: opt1, opt2 or opt3 [arg1, ... ]
-	{ "range IPADDR IPADDR",		isc_not_done, 2},
+	{ "range IPADDR IPADDR",		ISC_NOOP, parse_range, NULL, 2},
 	{ "release-on-roam BOOL", 		isc_not_done, 1}, // boolean can be true, false or ignore
 	{ "remote-port UINT16", 		isc_ignore,   1}, // integer uint16_t
 	{ "server-id-check BOOL", 		isc_not_done, 1}, // boolean can be true, false or ignore
@@ -2097,9 +2176,29 @@ static int parse_section(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *i
 
 	IDEBUG("%.*s }", state->braces, spaces);
 
+	if (subnets_freeze(info) < 0) return -1;
+
 	return entries;
 }
 
+/** Freeze the subnets of a section once it has been read
+ *
+ *  No more subnets can be added, so we do lookups in a read-only
+ *  copy of the trie, which is faster.
+ */
+static int subnets_freeze(rlm_isc_dhcp_info_t *info)
+{
+	if (!info->subnets) return 0;
+
+	info->subnets_frozen = fr_trie_freeze(info, info->subnets);
+	if (!info->subnets_frozen) {
+		fr_strerror_const("Failed freezing subnets");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Open a file and read it into a parent.
  *
  */
@@ -2198,14 +2297,250 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (subnets_freeze(info) < 0) {
+		cf_log_err(conf, "%s", fr_strerror());
+		return -1;
+	}
+
 	if (ret == 0) {
 		cf_log_warn(conf, "No configuration read from %s", inst->filename);
 		return 0;
 	}
 
+	if (inst->leases) {
+		isc_lease_stats_t stats;
+
+		if (isc_lease_pool_open(inst->leases) < 0) {
+			cf_log_err(conf, "%s", fr_strerror());
+			return -1;
+		}
+
+		isc_lease_stats(&stats, inst->leases);
+		cf_log_debug(conf, "Dynamic ranges contain %" PRIu64 " addresses, %" PRIu64 " active, %" PRIu64 " abandoned",
+			     stats.total, stats.active, stats.abandoned);
+	}
+
 	return 0;
 }
 
+/** Get the key we use to find a client's lease
+ *
+ *  This is the Client-Identifier if there is one, otherwise it's the
+ *  hardware address, with the hardware type in front, as ISC DHCP does.
+ */
+static ssize_t lease_client_key(uint8_t *out, size_t outlen, request_t *request)
+{
+	fr_pair_t *vp;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_client_identifier, 0);
+	if (vp && (vp->vp_length > 0) && (vp->vp_length <= outlen)) {
+		memcpy(out, vp->vp_octets, vp->vp_length);
+		return vp->vp_length;
+	}
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_client_hardware_address, 0);
+	if (!vp) return -1;
+
+	out[0] = 0x01;
+	memcpy(out + 1, vp->vp_ether, sizeof(vp->vp_ether));
+
+	return 1 + sizeof(vp->vp_ether);
+}
+
+/** Find which subnet the client is on
+ *
+ */
+static isc_lease_subnet_t *lease_subnet(rlm_isc_dhcp_t const *inst, request_t *request)
+{
+	fr_pair_t *vp;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_network_subnet, 0);
+	if (!vp) return NULL;
+
+	return isc_lease_subnet_find(inst->leases, vp->vp_ipv4addr);
+}
+
+/** Add the address and lease time to the reply
+ *
+ */
+static fr_pair_t *lease_reply(rlm_isc_dhcp_t const *inst, request_t *request, uint32_t addr)
+{
+	fr_pair_t *yiaddr, *vp;
+
+	MEM(pair_update_reply(&yiaddr, attr_your_ip_address) >= 0);
+	yiaddr->vp_ipv4addr = addr;
+
+	if (pair_update_reply(&vp, attr_ip_address_lease_time) == 0) {
+		vp->vp_uint32 = fr_time_delta_to_sec(inst->default_lease_time);
+	}
+
+	return yiaddr;
+}
+
+/** Offer an address
+ *
+ *  Fixed addresses take priority over dynamic ones.  Once the client has
+ *  an address, the options for its host and subnet are applied.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_isc_dhcp_t);
+	int			ret;
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+	ssize_t			client_len;
+	isc_lease_subnet_t	*subnet;
+	fr_pair_t		*vp;
+	uint32_t		addr;
+
+	ret = apply_fixed_ip(inst, request);
+	if (ret < 0) RETURN_MODULE_FAIL;
+	if (ret == 2) goto apply;
+
+	if (!inst->leases) goto apply;
+
+	/*
+	 *	Something else already gave the client an address.
+	 */
+	if (fr_pair_find_by_da_idx(&request->reply_pairs, attr_your_ip_address, 0)) goto apply;
+
+	client_len = lease_client_key(client, sizeof(client), request);
+	if (client_len < 0) {
+		REDEBUG("No Client-Identifier or Client-Hardware-Address");
+		RETURN_MODULE_INVALID;
+	}
+
+	subnet = lease_subnet(inst, request);
+	if (!subnet) {
+		RDEBUG2("Client is not on a network with a dynamic range");
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_requested_ip_address, 0);
+
+	if (isc_lease_offer(&addr, inst->leases, subnet, client, client_len, vp ? vp->vp_ipv4addr : 0,
+			    inst->offer_time) < 0) {
+		RWDEBUG("No free addresses on the client's network");
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	vp = lease_reply(inst, request, addr);
+	RDEBUG2("Offering %pV", &vp->data);
+
+apply:
+	ret = apply(inst, request, inst->head);
+	if (ret < 0) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_UPDATED;
+}
+
+/** Make an offered lease active, or extend an active one
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_extend(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_isc_dhcp_t);
+	int			ret;
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+	ssize_t			client_len;
+	fr_pair_t		*vp, *lease_time;
+
+	ret = apply_fixed_ip(inst, request);
+	if (ret < 0) RETURN_MODULE_FAIL;
+	if ((ret == 2) || !inst->leases) goto apply;
+
+	client_len = lease_client_key(client, sizeof(client), request);
+	if (client_len < 0) {
+		REDEBUG("No Client-Identifier or Client-Hardware-Address");
+		RETURN_MODULE_INVALID;
+	}
+
+	/*
+	 *	SELECTING and INIT-REBOOT clients use
+	 *	Requested-IP-Address.  RENEWING and REBINDING clients
+	 *	use Client-IP-Address.
+	 */
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_requested_ip_address, 0);
+	if (!vp || !vp->vp_ipv4addr) {
+		vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_client_ip_address, 0);
+		if (!vp || !vp->vp_ipv4addr) RETURN_MODULE_NOOP;
+	}
+
+	lease_time = fr_pair_find_by_da_idx(&request->reply_pairs, attr_ip_address_lease_time, 0);
+
+	ret = isc_lease_commit(inst->leases, lease_subnet(inst, request), client, client_len, vp->vp_ipv4addr,
+			       lease_time ? fr_time_delta_from_sec(lease_time->vp_uint32) : inst->default_lease_time);
+	if (ret < 0) {
+		RDEBUG2("Client cannot have %pV", &vp->data);
+		RETURN_MODULE_REJECT;
+	}
+
+	/*
+	 *	Not one of ours.  Let another server answer.
+	 */
+	if (ret == 0) RETURN_MODULE_NOOP;
+
+	lease_reply(inst, request, vp->vp_ipv4addr);
+	RDEBUG2("Leasing %pV", &vp->data);
+
+apply:
+	ret = apply(inst, request, inst->head);
+	if (ret < 0) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_UPDATED;
+}
+
+/** Release a lease
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_isc_dhcp_t);
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+	ssize_t			client_len;
+	fr_pair_t		*vp;
+
+	if (!inst->leases) RETURN_MODULE_NOOP;
+
+	client_len = lease_client_key(client, sizeof(client), request);
+	if (client_len < 0) RETURN_MODULE_INVALID;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_client_ip_address, 0);
+	if (!vp) RETURN_MODULE_NOOP;
+
+	if (isc_lease_release(inst->leases, client, client_len, vp->vp_ipv4addr) == 0) RETURN_MODULE_NOTFOUND;
+
+	RDEBUG2("Released %pV", &vp->data);
+
+	RETURN_MODULE_OK;
+}
+
+/** Mark an address which the client says is in use, so we don't offer it again for a while
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_isc_dhcp_t);
+	uint8_t			client[ISC_LEASE_CLIENT_MAX];
+	ssize_t			client_len;
+	fr_pair_t		*vp;
+
+	if (!inst->leases) RETURN_MODULE_NOOP;
+
+	client_len = lease_client_key(client, sizeof(client), request);
+	if (client_len < 0) RETURN_MODULE_INVALID;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_requested_ip_address, 0);
+	if (!vp) RETURN_MODULE_NOOP;
+
+	if (isc_lease_decline(inst->leases, client, client_len, vp->vp_ipv4addr, inst->abandon_time) == 0) {
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	RWDEBUG("Client says %pV is already in use, abandoning it", &vp->data);
+
+	RETURN_MODULE_OK;
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_isc_dhcp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_isc_dhcp_t);
@@ -2247,4 +2582,12 @@ module_t rlm_isc_dhcp = {
 		[MOD_AUTHORIZE]	= mod_authorize,
 		[MOD_POST_AUTH]	= mod_post_auth,
 	},
+	.method_names = (module_method_names_t[]){
+		{ .name1 = "ippool",	.name2 = "allocate",	.method = mod_alloc },
+		{ .name1 = "ippool",	.name2 = "extend",	.method = mod_extend },
+		{ .name1 = "ippool",	.name2 = "release",	.method = mod_release },
+		{ .name1 = "ippool",	.name2 = "mark",	.method = mod_mark },
+
+		MODULE_NAME_TERMINATOR
+	}
 };
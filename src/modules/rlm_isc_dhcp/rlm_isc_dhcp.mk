@@ -0,0 +1,3 @@
+TARGET		:= rlm_isc_dhcp.a
+SOURCES		:= rlm_isc_dhcp.c isc_lease.c
+LOG_ID_LIB	= 23
@@ -105,6 +105,9 @@ typedef struct {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_legacy_t	escape_func;		//!< Escape function.
+		exfile_async_conf_t	async;			//!< Asynchronous writer configuration.
+		bool			async_is_set;		//!< Whether lines should be written by
+								///< a writer thread.
 	} file;
 
 	struct {
@@ -128,6 +131,7 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_linelog_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_linelog_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_linelog_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET_IS_SET("async", FR_TYPE_SUBSECTION, rlm_linelog_t, file.async), .subcs = (void const *) exfile_async_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -327,6 +331,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 			return -1;
 		}
 
+		if (inst->file.async_is_set && (exfile_async_enable(inst->file.ef, &inst->file.async) < 0)) {
+			cf_log_perr(conf, "Failed enabling asynchronous writes");
+			return -1;
+		}
+
 		if (inst->file.group_str) {
 			char *endptr;
 
@@ -660,6 +669,20 @@ build_vector:
 			*p = '/';
 		}
 
+		/*
+		 *	Hand the line off to the writer thread.
+		 */
+		if (inst->file.async_is_set) {
+			if (exfile_async_write(inst->file.ef, path, inst->file.permissions,
+					       inst->file.group_str ? inst->file.group : (gid_t) -1,
+					       vector_p, vector_len) < 0) {
+				RPERROR("Failed queueing line for \"%s\"", path);
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			break;
+		}
+
 		fd = exfile_open(inst->file.ef, path, inst->file.permissions);
 		if (fd < 0) {
 			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
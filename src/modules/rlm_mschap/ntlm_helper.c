@@ -0,0 +1,929 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ntlm_helper.c
+ * @brief NTLM authentication via persistent ntlm_auth helper processes
+ *
+ * Forking ntlm_auth for every authentication costs a fork/exec, and a winbind
+ * connection setup, per request, and blocks the worker while it happens.
+ *
+ * Instead each worker thread keeps a small number of long lived
+ * `ntlm_auth --helper-protocol=ntlm-server-1` processes.  Queries are written
+ * to the helper's stdin, and the replies are read from its stdout by the
+ * worker's event loop.  The helper answers queries in order, so several can
+ * be outstanding on one helper at the same time.
+ *
+ * Helpers which exit, stop responding, or send something we don't
+ * understand are killed and restarted.  Any queries outstanding on them
+ * fail.
+ *
+ * A helper which wedges whilst idle would only be noticed when the next
+ * real query timed out, so idle helpers are periodically sent an empty
+ * query.  ntlm_auth answers that with an error, without contacting
+ * winbind, and the usual query timeout applies to the answer.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "ntlm_auth helper"
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec_legacy.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "ntlm_helper.h"
+
+/*
+ *	Longest username or domain we'll send to a helper.
+ */
+#define NTLM_HELPER_MAX_NAME	256
+
+typedef struct ntlm_helper_s ntlm_helper_t;
+
+/** A single authentication query
+ *
+ */
+struct ntlm_helper_call_s {
+	fr_dlist_t		entry;			//!< Entry in the backlog, or a helper's in_flight list.
+
+	ntlm_helper_pool_t	*pool;			//!< Pool we were submitted to.
+	ntlm_helper_t		*helper;		//!< Helper we were sent to.  NULL whilst in the backlog.
+	request_t		*request;		//!< Waiting for the result.  NULL if cancelled.
+
+	char			*query;			//!< Encoded query.
+	size_t			query_len;		//!< Length of the encoded query.
+
+	fr_time_t		queued;			//!< When the query was submitted.
+	fr_time_t		sent;			//!< When the query was written to the helper.
+
+	bool			done;			//!< We have a result, or the query failed.
+	bool			failed;			//!< Query failed and the result is meaningless.
+	bool			authenticated;		//!< Helper said "Authenticated: Yes".
+	bool			have_key;		//!< Helper sent a User-Session-Key.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< Decoded User-Session-Key.
+	char			*error;			//!< Error message sent by the helper.
+};
+
+/** A single ntlm_auth process
+ *
+ */
+struct ntlm_helper_s {
+	ntlm_helper_pool_t	*pool;			//!< Pool this helper belongs to.
+	unsigned int		id;			//!< Helper number, for debug messages.
+
+	pid_t			pid;			//!< Of the helper. -1 if not running.
+	int			stdin_fd;		//!< We write queries to this.  -1 if not running.
+	int			stdout_fd;		//!< We read replies from this.  -1 if not running.
+	fr_time_t		started;		//!< When the helper was last started.
+	fr_time_t		last_reply;		//!< When the helper last finished answering a query.
+
+	fr_dlist_head_t		in_flight;		//!< Queries sent, in the order they were sent.
+
+	char			buff[1024];		//!< Partial reply lines.
+	size_t			used;			//!< How much of buff has been used.
+
+	fr_event_pid_t const	*ev_pid;		//!< Notifies us when the helper exits.
+	fr_event_timer_t const	*ev_timeout;		//!< Fires if the oldest query takes too long.
+	fr_event_timer_t const	*ev_restart;		//!< Delays restarting helpers which exit quickly.
+	fr_event_timer_t const	*ev_probe;		//!< Checks that an idle helper still responds.
+};
+
+/** The helpers for a single worker thread
+ *
+ */
+struct ntlm_helper_pool_s {
+	fr_event_list_t		*el;			//!< Event list of the worker owning the pool.
+	char const		*program;		//!< Command line used to start helpers.
+	uint32_t		max_in_flight;		//!< Maximum queries outstanding on one helper.
+	fr_time_delta_t		timeout;		//!< How long a query may take.
+	fr_time_delta_t		probe_interval;		//!< How long a helper may be idle before
+							///< we check it's still responding.  0 disables.
+
+	ntlm_helper_t		**helpers;		//!< Array of helpers.
+	uint32_t		num_helpers;		//!< How many helpers there are.
+
+	fr_dlist_head_t		backlog;		//!< Queries waiting for a free helper.
+	fr_event_timer_t const	*ev_backlog;		//!< Fires if the oldest queued query takes too long.
+};
+
+static int helper_start(ntlm_helper_t *h);
+static int helper_send(ntlm_helper_t *h, ntlm_helper_call_t *call);
+static void pool_dispatch(ntlm_helper_pool_t *pool);
+
+/** Map an error message from ntlm_auth to the result codes used by do_mschap()
+ *
+ * Status codes are checked first as they're language neutral, then the
+ * various messages ntlm_auth and winbind are known to produce.
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Output from ntlm_auth.  May be modified.
+ * @return
+ *	- -648 password expired.
+ *	- -647 account locked out.
+ *	- -691 account disabled.
+ *	- -2 authentication servers unavailable.
+ *	- -1 any other failure.
+ */
+int ntlm_auth_error(request_t *request, char *buffer)
+{
+	int	result;
+	char	*p;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_EXPIRED") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_MUST_CHANGE") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_LOCKED_OUT") ||
+	    strcasestr(buffer, "Account locked out")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_DISABLED") ||
+	    strcasestr(buffer, "Account disabled")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "NT_STATUS_NO_LOGON_SERVERS") ||
+	    strcasestr(buffer, "No logon servers")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+	if (p) *p = '\0';
+
+	REDEBUG("External script says: %s", buffer);
+	return -1;
+}
+
+/** A query has finished, one way or another
+ *
+ */
+static void call_done(ntlm_helper_call_t *call, bool failed)
+{
+	call->helper = NULL;
+	call->done = true;
+	call->failed = failed;
+
+	/*
+	 *	The request went away whilst the query was
+	 *	outstanding.  Nothing to tell.
+	 */
+	if (!call->request) {
+		talloc_free(call);
+		return;
+	}
+
+	unlang_interpret_mark_runnable(call->request);
+}
+
+/** The oldest query in the backlog has waited too long for a helper
+ *
+ */
+static void pool_backlog_timeout(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	ntlm_helper_pool_t	*pool = talloc_get_type_abort(uctx, ntlm_helper_pool_t);
+	ntlm_helper_call_t	*call;
+
+	while ((call = fr_dlist_head(&pool->backlog))) {
+		if (fr_time_gt(fr_time_add(call->queued, pool->timeout), now)) break;
+
+		fr_dlist_remove(&pool->backlog, call);
+		if (call->request) {
+			request_t *request = call->request;
+
+			REDEBUG("Timed out waiting for a free ntlm_auth helper");
+		}
+		call_done(call, true);
+	}
+
+	if (!call) return;
+
+	if (fr_event_timer_at(pool, pool->el, &pool->ev_backlog, fr_time_add(call->queued, pool->timeout),
+			      pool_backlog_timeout, pool) < 0) {
+		PERROR("Failed inserting backlog timer");
+	}
+}
+
+/** Arm the timer for the oldest query outstanding on a helper
+ *
+ */
+static void helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+static void helper_timeout_set(ntlm_helper_t *h)
+{
+	ntlm_helper_call_t	*head = fr_dlist_head(&h->in_flight);
+
+	if (!head) {
+		fr_event_timer_delete(&h->ev_timeout);
+		return;
+	}
+
+	if (fr_event_timer_at(h, h->pool->el, &h->ev_timeout, fr_time_add(head->sent, h->pool->timeout),
+			      helper_timeout, h) < 0) {
+		PERROR("Helper %u - Failed inserting timeout timer", h->id);
+	}
+}
+
+/** Stop a helper, failing all its outstanding queries
+ *
+ * The helper is restarted when we're notified that the process has exited.
+ */
+static void helper_stop(ntlm_helper_t *h, char const *why)
+{
+	ntlm_helper_call_t	*call;
+
+	WARN("Helper %u (pid %u) - Stopping: %s", h->id, (unsigned int) h->pid, why);
+
+	fr_event_timer_delete(&h->ev_timeout);
+	fr_event_timer_delete(&h->ev_probe);
+
+	if (h->stdout_fd >= 0) {
+		(void) fr_event_fd_delete(h->pool->el, h->stdout_fd, FR_EVENT_FILTER_IO);
+		close(h->stdout_fd);
+		h->stdout_fd = -1;
+	}
+	if (h->stdin_fd >= 0) {
+		close(h->stdin_fd);
+		h->stdin_fd = -1;
+	}
+	h->used = 0;
+
+	if (h->pid > 0) kill(h->pid, SIGTERM);
+
+	while ((call = fr_dlist_pop_head(&h->in_flight))) {
+		if (call->request) {
+			request_t *request = call->request;
+
+			REDEBUG("ntlm_auth helper failed: %s", why);
+		}
+		call_done(call, true);
+	}
+}
+
+static void helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	ntlm_helper_t	*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+
+	helper_stop(h, "Timed out waiting for a response");
+}
+
+static void helper_probe(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Arm the timer which checks an idle helper is still responding
+ *
+ * @param[in] h		to check.
+ * @param[in] from	When the helper was last known to be working.
+ */
+static void helper_probe_set(ntlm_helper_t *h, fr_time_t from)
+{
+	if (!fr_time_delta_ispos(h->pool->probe_interval)) return;
+
+	if (fr_event_timer_at(h, h->pool->el, &h->ev_probe, fr_time_add(from, h->pool->probe_interval),
+			      helper_probe, h) < 0) {
+		PERROR("Helper %u - Failed inserting probe timer", h->id);
+	}
+}
+
+/** Send an empty query to a helper which has been idle for probe_interval
+ *
+ * The reply is discarded.  If there isn't one, the helper times out, and
+ * is restarted, as it would be for a real query.
+ */
+static void helper_probe(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	ntlm_helper_t		*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+	ntlm_helper_call_t	*call;
+
+	/*
+	 *	The helper has answered a query since the timer
+	 *	was set, so it's not idle.
+	 */
+	if (fr_time_lt(now, fr_time_add(h->last_reply, h->pool->probe_interval))) {
+		helper_probe_set(h, h->last_reply);
+		return;
+	}
+
+	/*
+	 *	Busy helpers are covered by the query timeout.
+	 */
+	if (fr_dlist_num_elements(&h->in_flight) > 0) {
+		helper_probe_set(h, now);
+		return;
+	}
+
+	DEBUG3("Helper %u - Checking helper is still responding", h->id);
+
+	MEM(call = talloc_zero(h->pool, ntlm_helper_call_t));
+	call->pool = h->pool;
+	MEM(call->query = talloc_typed_strdup(call, ".\n"));
+	call->query_len = talloc_array_length(call->query) - 1;
+	call->queued = now;
+
+	if (helper_send(h, call) < 0) {
+		talloc_free(call);
+		return;
+	}
+
+	helper_probe_set(h, now);
+}
+
+static void helper_restart(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	ntlm_helper_t	*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+
+	if (helper_start(h) < 0) return;
+
+	pool_dispatch(h->pool);
+}
+
+/** Schedule a helper restart
+ *
+ * Helpers which die immediately after starting (bad arguments, winbind not
+ * running) are restarted after a delay so we don't spin.
+ */
+static void helper_restart_set(ntlm_helper_t *h)
+{
+	fr_time_delta_t	delay = fr_time_delta_wrap(0);
+
+	if (fr_time_lt(fr_time(), fr_time_add(h->started, fr_time_delta_from_sec(1)))) {
+		delay = fr_time_delta_from_sec(1);
+	}
+
+	if (fr_event_timer_in(h, h->pool->el, &h->ev_restart, delay, helper_restart, h) < 0) {
+		PERROR("Helper %u - Failed inserting restart timer", h->id);
+	}
+}
+
+static void helper_exited(UNUSED fr_event_list_t *el, pid_t pid, UNUSED int status, void *uctx)
+{
+	ntlm_helper_t	*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+	int		wait_status = 0;
+
+	/*
+	 *	ev_pid has already been freed and NULLed.
+	 */
+	(void) waitpid(pid, &wait_status, WNOHANG);
+	h->pid = -1;
+
+	if (h->stdin_fd >= 0) helper_stop(h, "Process exited");
+
+	helper_restart_set(h);
+}
+
+/** Process a single line of reply from a helper
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the helper should be stopped.
+ */
+static int helper_line(ntlm_helper_t *h, char *line)
+{
+	ntlm_helper_call_t	*call = fr_dlist_head(&h->in_flight);
+	char			*value;
+
+	if (!call) {
+		ERROR("Helper %u - Unsolicited output: %s", h->id, line);
+		return -1;
+	}
+
+	/*
+	 *	End of the reply to the oldest query.
+	 */
+	if (strcmp(line, ".") == 0) {
+		(void) fr_dlist_remove(&h->in_flight, call);
+		call_done(call, false);
+		helper_timeout_set(h);
+		h->last_reply = fr_time();
+		return 0;
+	}
+
+	value = strstr(line, ": ");
+	if (!value) {
+		ERROR("Helper %u - Malformed output: %s", h->id, line);
+		return -1;
+	}
+	*value = '\0';
+	value += 2;
+
+	if (strcmp(line, "Authenticated") == 0) {
+		call->authenticated = (strcmp(value, "Yes") == 0);
+		return 0;
+	}
+
+	if (strcmp(line, "User-Session-Key") == 0) {
+		size_t len = strlen(value);
+
+		if ((len != (NT_DIGEST_LENGTH * 2)) ||
+		    (fr_base16_decode(NULL, &FR_DBUFF_TMP(call->nthashhash, NT_DIGEST_LENGTH),
+				      &FR_SBUFF_IN(value, len), false) != NT_DIGEST_LENGTH)) {
+			ERROR("Helper %u - Invalid User-Session-Key", h->id);
+			return -1;
+		}
+		call->have_key = true;
+		return 0;
+	}
+
+	if ((strcmp(line, "Authentication-Error") == 0) || (strcmp(line, "Error") == 0)) {
+		talloc_free(call->error);
+		call->error = talloc_typed_strdup(call, value);
+		return 0;
+	}
+
+	/*
+	 *	Other attributes, e.g. LANMAN-Session-Key, are
+	 *	ignored.
+	 */
+	return 0;
+}
+
+static void helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	ntlm_helper_t	*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+	ssize_t		slen;
+	char		*start, *end;
+
+	for (;;) {
+		slen = read(h->stdout_fd, h->buff + h->used, sizeof(h->buff) - h->used - 1);
+		if (slen == 0) {
+			helper_stop(h, "Unexpected EOF");
+			goto dispatch;
+		}
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			if (errno == EINTR) continue;
+
+			helper_stop(h, fr_syserror(errno));
+			goto dispatch;
+		}
+		h->used += slen;
+		h->buff[h->used] = '\0';
+
+		/*
+		 *	Process all complete lines.
+		 */
+		start = h->buff;
+		while ((end = memchr(start, '\n', h->used - (start - h->buff)))) {
+			*end = '\0';
+			if ((end > start) && (end[-1] == '\r')) end[-1] = '\0';
+
+			if (helper_line(h, start) < 0) {
+				helper_stop(h, "Protocol error");
+				goto dispatch;
+			}
+			start = end + 1;
+		}
+
+		h->used -= (start - h->buff);
+		if (h->used > 0) memmove(h->buff, start, h->used);
+
+		if (h->used >= (sizeof(h->buff) - 1)) {
+			helper_stop(h, "Response line too long");
+			goto dispatch;
+		}
+	}
+
+dispatch:
+	pool_dispatch(h->pool);
+}
+
+static void helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	ntlm_helper_t	*h = talloc_get_type_abort(uctx, ntlm_helper_t);
+
+	helper_stop(h, fd_errno ? fr_syserror(fd_errno) : "Connection closed");
+	pool_dispatch(h->pool);
+}
+
+/** Start a helper process
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  A restart has been scheduled.
+ */
+static int helper_start(ntlm_helper_t *h)
+{
+	ntlm_helper_pool_t	*pool = h->pool;
+	pid_t			pid;
+
+	h->started = fr_time();
+	h->used = 0;
+
+	pid = radius_start_program_legacy(&h->stdin_fd, &h->stdout_fd, NULL, pool->program, NULL, true, NULL, false);
+	if (pid < 0) {
+		PERROR("Helper %u - Failed starting \"%s\"", h->id, pool->program);
+		h->stdin_fd = h->stdout_fd = -1;
+	error:
+		helper_restart_set(h);
+		return -1;
+	}
+	h->pid = pid;
+
+	if ((fr_nonblock(h->stdin_fd) < 0) || (fr_nonblock(h->stdout_fd) < 0) ||
+	    (fr_event_fd_insert(h, pool->el, h->stdout_fd, helper_read, NULL, helper_error, h) < 0)) {
+		PERROR("Helper %u - Failed registering pipes", h->id);
+	kill:
+		close(h->stdin_fd);
+		close(h->stdout_fd);
+		h->stdin_fd = h->stdout_fd = -1;
+		kill(h->pid, SIGKILL);
+		fr_event_pid_reap(pool->el, h->pid, NULL, NULL);
+		h->pid = -1;
+		goto error;
+	}
+
+	if (fr_event_pid_wait(h, pool->el, &h->ev_pid, h->pid, helper_exited, h) < 0) {
+		PERROR("Helper %u - Failed watching pid %u", h->id, (unsigned int) h->pid);
+		(void) fr_event_fd_delete(pool->el, h->stdout_fd, FR_EVENT_FILTER_IO);
+		goto kill;
+	}
+
+	h->last_reply = h->started;
+	helper_probe_set(h, h->started);
+
+	DEBUG2("Helper %u - Started pid %u", h->id, (unsigned int) h->pid);
+
+	return 0;
+}
+
+/** Write a query to a helper
+ *
+ * Queries are small, so the pipe should always have space for them.
+ * If it doesn't, the helper isn't keeping up, and is treated as broken.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The helper has been stopped, and the call has not been sent.
+ */
+static int helper_send(ntlm_helper_t *h, ntlm_helper_call_t *call)
+{
+	ssize_t	slen;
+
+	do {
+		slen = write(h->stdin_fd, call->query, call->query_len);
+	} while ((slen < 0) && (errno == EINTR));
+
+	if (slen < 0) {
+		helper_stop(h, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	A partial write leaves the helper expecting the
+	 *	rest of the query, so it can't be reused.
+	 */
+	if ((size_t)slen != call->query_len) {
+		helper_stop(h, "Pipe full");
+		return -1;
+	}
+
+	call->helper = h;
+	call->sent = fr_time();
+	fr_dlist_insert_tail(&h->in_flight, call);
+
+	if (!h->ev_timeout) helper_timeout_set(h);
+
+	return 0;
+}
+
+/** Send as many queries from the backlog as the helpers will accept
+ *
+ */
+static void pool_dispatch(ntlm_helper_pool_t *pool)
+{
+	ntlm_helper_call_t	*call;
+
+	while ((call = fr_dlist_head(&pool->backlog))) {
+		ntlm_helper_t	*h = NULL;
+		uint32_t	i;
+
+		/*
+		 *	Pick the least loaded running helper.
+		 */
+		for (i = 0; i < pool->num_helpers; i++) {
+			ntlm_helper_t *c = pool->helpers[i];
+
+			if (c->stdin_fd < 0) continue;
+			if (fr_dlist_num_elements(&c->in_flight) >= pool->max_in_flight) continue;
+
+			if (!h || (fr_dlist_num_elements(&c->in_flight) < fr_dlist_num_elements(&h->in_flight))) h = c;
+		}
+		if (!h) break;
+
+		(void) fr_dlist_remove(&pool->backlog, call);
+		if (helper_send(h, call) < 0) fr_dlist_insert_head(&pool->backlog, call);
+	}
+
+	if (!call) {
+		fr_event_timer_delete(&pool->ev_backlog);
+		return;
+	}
+
+	if (!pool->ev_backlog) pool_backlog_timeout(pool->el, fr_time(), pool);
+}
+
+static int _ntlm_helper_pool_free(ntlm_helper_pool_t *pool)
+{
+	uint32_t	i;
+
+	fr_event_timer_delete(&pool->ev_backlog);
+
+	for (i = 0; i < pool->num_helpers; i++) {
+		ntlm_helper_t *h = pool->helpers[i];
+
+		fr_event_timer_delete(&h->ev_timeout);
+		fr_event_timer_delete(&h->ev_restart);
+		fr_event_timer_delete(&h->ev_probe);
+
+		if (h->stdout_fd >= 0) {
+			(void) fr_event_fd_delete(pool->el, h->stdout_fd, FR_EVENT_FILTER_IO);
+			close(h->stdout_fd);
+		}
+		if (h->stdin_fd >= 0) close(h->stdin_fd);
+
+		if (h->pid > 0) {
+			if (h->ev_pid) talloc_const_free(h->ev_pid);
+			kill(h->pid, SIGTERM);
+
+			/*
+			 *	Let the event loop collect the process
+			 *	when it exits.
+			 */
+			fr_event_pid_reap(pool->el, h->pid, NULL, NULL);
+		}
+	}
+
+	return 0;
+}
+
+/** Allocate a pool of ntlm_auth helpers for a worker thread
+ *
+ * @param[in] ctx		to allocate the pool in.
+ * @param[in] el		of the worker thread.
+ * @param[in] program		Command line for the helpers, e.g.
+ *				`/usr/bin/ntlm_auth --helper-protocol=ntlm-server-1`.
+ * @param[in] num_helpers	How many helper processes to run.
+ * @param[in] max_in_flight	Maximum queries outstanding on one helper.
+ * @param[in] timeout		How long to wait for a response.
+ * @param[in] probe_interval	How long a helper may be idle before we check
+ *				it's still responding.  0 disables the check.
+ * @return
+ *	- A new pool on success.
+ *	- NULL on failure.
+ */
+ntlm_helper_pool_t *ntlm_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, char const *program,
+					   uint32_t num_helpers, uint32_t max_in_flight, fr_time_delta_t timeout,
+					   fr_time_delta_t probe_interval)
+{
+	ntlm_helper_pool_t	*pool;
+	uint32_t		i;
+
+	MEM(pool = talloc_zero(ctx, ntlm_helper_pool_t));
+	pool->el = el;
+	pool->program = talloc_typed_strdup(pool, program);
+	pool->max_in_flight = max_in_flight;
+	pool->timeout = timeout;
+	pool->probe_interval = probe_interval;
+	pool->num_helpers = num_helpers;
+	fr_dlist_talloc_init(&pool->backlog, ntlm_helper_call_t, entry);
+
+	MEM(pool->helpers = talloc_zero_array(pool, ntlm_helper_t *, num_helpers));
+	for (i = 0; i < num_helpers; i++) {
+		ntlm_helper_t *h;
+
+		MEM(h = pool->helpers[i] = talloc_zero(pool->helpers, ntlm_helper_t));
+		h->pool = pool;
+		h->id = i;
+		h->pid = -1;
+		h->stdin_fd = h->stdout_fd = -1;
+		fr_dlist_talloc_init(&h->in_flight, ntlm_helper_call_t, entry);
+	}
+	talloc_set_destructor(pool, _ntlm_helper_pool_free);
+
+	/*
+	 *	Failures here are retried, so the server
+	 *	can start even if winbind isn't up yet.
+	 */
+	for (i = 0; i < num_helpers; i++) (void) helper_start(pool->helpers[i]);
+
+	return pool;
+}
+
+/** Add a "name:: <base64>" line to a query
+ *
+ * Base64 means usernames containing newlines can't inject additional
+ * attributes into the query.
+ */
+static int query_add_name(request_t *request, char **query, char const *name, char const *value)
+{
+	char	buff[((NTLM_HELPER_MAX_NAME + 2) / 3) * 4 + 1];
+	ssize_t	slen;
+	size_t	len = strlen(value);
+
+	if (len > NTLM_HELPER_MAX_NAME) {
+		REDEBUG("%s too long (%zu > %u bytes)", name, len, NTLM_HELPER_MAX_NAME);
+		return -1;
+	}
+
+	slen = fr_base64_encode(&FR_SBUFF_OUT(buff, sizeof(buff)), &FR_DBUFF_TMP((uint8_t const *)value, len), true);
+	if (slen < 0) {
+		RPEDEBUG("Failed encoding %s", name);
+		return -1;
+	}
+
+	MEM(*query = talloc_asprintf_append_buffer(*query, "%s:: %.*s\n", name, (int)slen, buff));
+
+	return 0;
+}
+
+/** Submit an MS-CHAP authentication to the helpers
+ *
+ * The caller should yield the request.  It will be marked runnable when the
+ * result is available, at which point #ntlm_helper_result should be called.
+ *
+ * @param[in] pool		to submit the query to.
+ * @param[in] request		to mark runnable when the result is available.
+ * @param[in] username		to authenticate.
+ * @param[in] domain		of the user.  May be NULL.
+ * @param[in] challenge		MS-CHAPv1 style challenge.
+ * @param[in] nt_response	from the client.
+ * @return
+ *	- A new call on success.
+ *	- NULL on failure.
+ */
+ntlm_helper_call_t *ntlm_helper_call(ntlm_helper_pool_t *pool, request_t *request,
+				     char const *username, char const *domain,
+				     uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+				     uint8_t const nt_response[static 24])
+{
+	ntlm_helper_call_t	*call;
+	char			*query;
+	char			challenge_hex[(MSCHAP_CHALLENGE_LENGTH * 2) + 1];
+	char			response_hex[(24 * 2) + 1];
+
+	MEM(call = talloc_zero(pool, ntlm_helper_call_t));
+	call->pool = pool;
+	call->request = request;
+
+	MEM(query = talloc_strdup(call, ""));
+	if (query_add_name(request, &query, "Username", username) < 0) {
+	error:
+		talloc_free(call);
+		return NULL;
+	}
+	if (domain && *domain && (query_add_name(request, &query, "NT-Domain", domain) < 0)) goto error;
+
+	fr_base16_encode(&FR_SBUFF_OUT(challenge_hex, sizeof(challenge_hex)),
+			 &FR_DBUFF_TMP(challenge, MSCHAP_CHALLENGE_LENGTH));
+	fr_base16_encode(&FR_SBUFF_OUT(response_hex, sizeof(response_hex)),
+			 &FR_DBUFF_TMP(nt_response, 24));
+
+	MEM(query = talloc_asprintf_append_buffer(query,
+						  "LANMAN-Challenge: %s\n"
+						  "NT-Response: %s\n"
+						  "Request-User-Session-Key: Yes\n"
+						  ".\n",
+						  challenge_hex, response_hex));
+	call->query = query;
+	call->query_len = talloc_array_length(query) - 1;
+	call->queued = fr_time();
+
+	fr_dlist_insert_tail(&pool->backlog, call);
+	pool_dispatch(pool);
+
+	return call;
+}
+
+/** Get the result of a call, and free it
+ *
+ * @param[in] request		The current request.
+ * @param[in] call		to get the result of.
+ * @param[out] nthashhash	from the helper's User-Session-Key.
+ * @return The same values as do_mschap().
+ */
+int ntlm_helper_result(request_t *request, ntlm_helper_call_t *call, uint8_t nthashhash[static NT_DIGEST_LENGTH])
+{
+	int	ret = -1;
+
+	memset(nthashhash, 0, NT_DIGEST_LENGTH);
+
+	if (!call->done || call->failed) {
+		ret = -2;
+		goto finish;
+	}
+
+	if (!call->authenticated) {
+		if (!call->error) {
+			REDEBUG("ntlm_auth helper rejected the user without giving a reason");
+			goto finish;
+		}
+		ret = ntlm_auth_error(request, call->error);
+		goto finish;
+	}
+
+	if (!call->have_key) {
+		REDEBUG("Invalid output from ntlm_auth helper: No User-Session-Key");
+		goto finish;
+	}
+
+	memcpy(nthashhash, call->nthashhash, NT_DIGEST_LENGTH);
+	ret = 0;
+
+finish:
+	talloc_free(call);
+	return ret;
+}
+
+/** Abandon a call
+ *
+ * Calls which have already been sent to a helper are freed when the helper
+ * responds, so that the response stays in step with the queries.
+ */
+void ntlm_helper_cancel(ntlm_helper_call_t *call)
+{
+	if (call->helper) {
+		call->request = NULL;
+		return;
+	}
+
+	if (!call->done) (void) fr_dlist_remove(&call->pool->backlog, call);
+	talloc_free(call);
+}
@@ -0,0 +1,27 @@
+#pragma once
+/* @copyright 2021 The FreeRADIUS server project */
+RCSIDH(ntlm_helper_h, "$Id$")
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+
+#include "mschap.h"
+
+typedef struct ntlm_helper_pool_s ntlm_helper_pool_t;
+typedef struct ntlm_helper_call_s ntlm_helper_call_t;
+
+ntlm_helper_pool_t	*ntlm_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, char const *program,
+						uint32_t num_helpers, uint32_t max_in_flight, fr_time_delta_t timeout,
+						fr_time_delta_t probe_interval);
+
+ntlm_helper_call_t	*ntlm_helper_call(ntlm_helper_pool_t *pool, request_t *request,
+					  char const *username, char const *domain,
+					  uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+					  uint8_t const nt_response[static 24]);
+
+int			ntlm_helper_result(request_t *request, ntlm_helper_call_t *call,
+					   uint8_t nthashhash[static NT_DIGEST_LENGTH]);
+
+void			ntlm_helper_cancel(ntlm_helper_call_t *call);
+
+int			ntlm_auth_error(request_t *request, char *buffer);
@@ -46,6 +46,7 @@ RCSID("$Id$")
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "smbdes.h"
+#include "ntlm_helper.h"
 
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
@@ -74,6 +75,10 @@ int od_mschap_auth(request_t *request, fr_pair_t *challenge, fr_pair_t * usernam
 #define ACB_AUTOLOCK	0x04000000	//!< Account auto locked.
 #define ACB_FR_EXPIRED	0x00020000	//!< Password Expired.
 
+typedef struct {
+	ntlm_helper_pool_t	*ntlm_helpers;		//!< This worker's ntlm_auth helper processes.
+} rlm_mschap_thread_t;
+
 static const CONF_PARSER passchange_config[] = {
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_cpw) },
 	{ FR_CONF_OFFSET("ntlm_auth_username", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_cpw_username) },
@@ -82,6 +87,16 @@ static const CONF_PARSER passchange_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	{ FR_CONF_OFFSET("helpers", FR_TYPE_UINT32, rlm_mschap_t, ntlm_helpers), .dflt = "2" },
+	{ FR_CONF_OFFSET("max_in_flight", FR_TYPE_UINT32, rlm_mschap_t, ntlm_helper_max_in_flight), .dflt = "8" },
+	{ FR_CONF_OFFSET("probe_interval", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_helper_probe_interval), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER winbind_config[] = {
 	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, wb_username) },
 	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, wb_domain) },
@@ -103,6 +118,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -1188,84 +1204,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program_legacy(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1774,21 +1713,50 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method)
+/** State for a single MS-CHAP authentication
+ *
+ * Lives for as long as the authentication, which may span a yield
+ * whilst an ntlm_auth helper processes the request.
+ */
+typedef struct {
+	rlm_mschap_t const	*inst;
+	MSCHAP_AUTH_METHOD	method;			//!< How to check the response.
+	int			mschap_version;		//!< 1 or 2.
+	bool			done;			//!< Result decided before checking the response.
+
+	fr_pair_t		*smb_ctrl;
+	fr_pair_t		*nt_password;		//!< May be NULL if the response is checked externally.
+	bool			ephemeral;		//!< nt_password was created by us and must be freed.
+
+	fr_pair_t		*challenge;
+	fr_pair_t		*response;
+
+	uint8_t			auth_challenge[MSCHAP_CHALLENGE_LENGTH];	//!< MS-CHAPv1 style challenge to check.
+	uint8_t const		*peer_challenge;	//!< MS-CHAPv2 peer challenge.
+	char const		*username_str;		//!< MS-CHAPv2 username, without the domain.
+	size_t			username_len;
+
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+
+	ntlm_helper_call_t	*call;			//!< Outstanding ntlm_auth helper query.
+} mschap_auth_ctx_t;
+
+static int _mschap_auth_ctx_free(mschap_auth_ctx_t *auth_ctx)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	if (auth_ctx->call) ntlm_helper_cancel(auth_ctx->call);
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
 
-	*mschap_version = 1;
+	return 0;
+}
+
+static CC_HINT(nonnull) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
+								mschap_auth_ctx_t *auth_ctx,
+								request_t *request)
+{
+	fr_pair_t		*challenge = auth_ctx->challenge;
+	fr_pair_t		*response = auth_ctx->response;
+
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1817,41 +1785,26 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
-
-	/*
-	 *	Do the MS-CHAP authentication.
-	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
+	memcpy(auth_ctx->auth_challenge, challenge->vp_octets, MSCHAP_CHALLENGE_LENGTH);
 
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl);
+	RETURN_MODULE_OK;
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result,
+								   mschap_auth_ctx_t *auth_ctx,
+								   request_t *request)
 {
-		uint8_t		mschap_challenge[16];
-		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
-		char const	*username_str;
-		size_t		username_len;
-		int		mschap_result;
-		rlm_rcode_t	rcode;
-		char		msch2resp[42];
+		rlm_mschap_t const	*inst = auth_ctx->inst;
+		fr_pair_t		*challenge = auth_ctx->challenge;
+		fr_pair_t		*response = auth_ctx->response;
+		fr_pair_t		*user_name, *name_vp, *response_name, *peer_challenge_attr;
+		char const		*username_str;
+		size_t			username_len;
+#ifdef __APPLE__
+		rlm_rcode_t		rcode;
+#endif
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1918,18 +1871,21 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
-			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
+			if (rcode != RLM_MODULE_NOOP) {
+				auth_ctx->done = true;
+				RETURN_MODULE_RCODE(rcode);
+			}
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da_idx(&request->control_pairs, attr_ms_chap_peer_challenge, 0);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
 		/*
@@ -1941,28 +1897,49 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 */
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
-		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+		mschap_challenge_hash(auth_ctx->auth_challenge,	/* resulting challenge */
+				      auth_ctx->peer_challenge,		/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
+		auth_ctx->username_str = username_str;
+		auth_ctx->username_len = username_len;
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+		RETURN_MODULE_OK;
+}
+
+/** Act on the result of checking the MS-CHAP response
+ *
+ * Adds MS-CHAP-Error or MS-CHAP2-Success, and the MPPE keys.
+ */
+static unlang_action_t CC_HINT(nonnull) mschap_auth_finish(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx,
+							   request_t *request, int mschap_result)
+{
+	rlm_mschap_t const	*inst = auth_ctx->inst;
+	fr_pair_t		*response = auth_ctx->response;
+	uint8_t			*nthashhash = auth_ctx->nthashhash;
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *response->vp_octets,
+		     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (auth_ctx->mschap_version == 2) {
+		char const	*username_str = auth_ctx->username_str;
+		char		msch2resp[42];
 
 #ifdef WITH_AUTH_WINBIND
 		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
 			response_name = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_user_name, 0);
 			if (response_name) {
 				if (strcmp(username_str, response_name->vp_strvalue)) {
 					RDEBUG2("Normalising username %pV -> %pV",
-						fr_box_strvalue_len(username_str, username_len),
+						fr_box_strvalue_len(username_str, auth_ctx->username_len),
 						&response_name->data);
 					username_str = response_name->vp_strvalue;
 				}
@@ -1971,15 +1948,127 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 #endif
 
 		mschap_auth_response(username_str,		/* without the domain */
-				     username_len,		/* Length of username str */
+				     auth_ctx->username_len,	/* Length of username str */
 				     nthashhash,		/* nt-hash-hash */
 				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
 				     msch2resp);		/* calculated MPPE key */
 		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
+	}
 
-		RETURN_MODULE_OK;
+	/* now create MPPE attributes */
+	if (inst->use_mppe) {
+		fr_pair_t	*vp;
+		uint8_t		mppe_sendkey[34];
+		uint8_t		mppe_recvkey[34];
+
+		switch (auth_ctx->mschap_version) {
+		case 1:
+			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+			memset(mppe_sendkey, 0, 32);
+
+			/*
+			 *	According to RFC 2548 we
+			 *	should send NT hash.  But in
+			 *	practice it doesn't work.
+			 *	Instead, we should send nthashhash
+			 *
+			 *	This is an error in RFC 2548.
+			 */
+			/*
+			 *	do_mschap cares to zero nthashhash if NT hash
+			 *	is not available.
+			 */
+			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
+			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
+			break;
+
+		case 2:
+			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+
+			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
+			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
+			break;
+
+		default:
+			fr_assert(0);
+			break;
+		}
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
+		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
+		vp->vp_uint32 = inst->require_strong ? 4 : 6;
+	} /* else we weren't asked to use MPPE */
+
+finish:
+	talloc_free(auth_ctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+	ntlm_helper_call_t	*call = auth_ctx->call;
+
+	auth_ctx->call = NULL;
+
+	return mschap_auth_finish(p_result, auth_ctx, request,
+				  ntlm_helper_result(request, call, auth_ctx->nthashhash));
+}
+
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(auth_ctx);
+}
+
+/** Check the MS-CHAP response, using whichever method is configured
+ *
+ * ntlm_auth helper queries yield the request until the helper responds.
+ */
+static unlang_action_t CC_HINT(nonnull) mschap_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						    mschap_auth_ctx_t *auth_ctx, request_t *request)
+{
+	rlm_mschap_t const	*inst = auth_ctx->inst;
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+	char			*username = NULL, *domain = NULL;
+
+	if (auth_ctx->method != AUTH_NTLMAUTH_HELPER) {
+		return mschap_auth_finish(p_result, auth_ctx, request,
+					  do_mschap(inst, request, auth_ctx->nt_password, auth_ctx->auth_challenge,
+						    auth_ctx->response->vp_octets + 26, auth_ctx->nthashhash,
+						    auth_ctx->method));
+	}
+
+	if (tmpl_aexpand(auth_ctx, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		RPEDEBUG("Unable to expand username for ntlm_auth helper");
+	error:
+		return mschap_auth_finish(p_result, auth_ctx, request, -1);
+	}
+
+	if (inst->ntlm_helper_domain &&
+	    (tmpl_aexpand(auth_ctx, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0)) {
+		RPEDEBUG("Unable to expand domain for ntlm_auth helper");
+		goto error;
+	}
+
+	RDEBUG2("Sending query for \"%s\" to ntlm_auth helper", username);
+
+	auth_ctx->call = ntlm_helper_call(t->ntlm_helpers, request, username, domain,
+					  auth_ctx->auth_challenge, auth_ctx->response->vp_octets + 26);
+	talloc_free(username);
+	talloc_free(domain);
+	if (!auth_ctx->call) goto error;
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, auth_ctx);
 }
 
 /*
@@ -2001,15 +2090,12 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
-	fr_pair_t		*challenge = NULL;
+	mschap_auth_ctx_t	*auth_ctx;
 	fr_pair_t		*response = NULL;
 	fr_pair_t		*cpw = NULL;
-	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
+	fr_pair_t		*smb_ctrl;
 
 	MSCHAP_AUTH_METHOD	method;
-	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
 	/*
@@ -2056,6 +2142,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		}
 	}
 
+	MEM(auth_ctx = talloc_zero(request, mschap_auth_ctx_t));
+	talloc_set_destructor(auth_ctx, _mschap_auth_ctx_free);
+	auth_ctx->inst = inst;
+	auth_ctx->method = method;
+	auth_ctx->smb_ctrl = smb_ctrl;
+
 	/*
 	 *	Look for or create an NT-Password
 	 *
@@ -2063,7 +2155,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 *	input attribute, and we're calling out to an
 	 *	external password store.
 	 */
-	if (nt_password_find(&ephemeral, &nt_password, mctx->inst->data, request) < 0) RETURN_MODULE_FAIL;
+	if (nt_password_find(&auth_ctx->ephemeral, &auth_ctx->nt_password, mctx->inst->data, request) < 0) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
 
 	/*
 	 *	Check to see if this is a change password request, and process
@@ -2073,7 +2168,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	if (cpw) {
 		uint8_t		*p;
 
-		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, nt_password);
+		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, auth_ctx->nt_password);
 		if (rcode != RLM_MODULE_OK) goto finish;
 
 		/*
@@ -2101,8 +2196,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		memcpy(p + 2, cpw->vp_octets + 18, 48);
 	}
 
-	challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_challenge, 0);
-	if (!challenge) {
+	auth_ctx->challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_challenge, 0);
+	if (!auth_ctx->challenge) {
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s",
 			mctx->inst->name, attr_ms_chap_challenge->name);
 		rcode = RLM_MODULE_INVALID;
@@ -2112,22 +2207,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	/*
 	 *	We also require an MS-CHAP-Response.
 	 */
-	if ((response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_response, 0))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method);
-		if (rcode != RLM_MODULE_OK) goto finish;
-	} else if ((response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap2_response, 0))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method);
+	if ((auth_ctx->response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_response, 0))) {
+		mschap_process_response(&rcode, auth_ctx, request);
 		if (rcode != RLM_MODULE_OK) goto finish;
+	} else if ((auth_ctx->response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap2_response, 0))) {
+		mschap_process_v2_response(&rcode, auth_ctx, request);
+		if ((rcode != RLM_MODULE_OK) || auth_ctx->done) goto finish;
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
 			mctx->inst->name, attr_ms_chap_response->name, attr_ms_chap2_response->name);
@@ -2135,55 +2220,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
-			break;
-
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
-			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
-			break;
-
-		default:
-			fr_assert(0);
-			break;
-		}
-
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
-
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	return mschap_auth(p_result, mctx, auth_ctx, request);
 
 finish:
-	if (ephemeral) TALLOC_FREE(nt_password);
+	talloc_free(auth_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -2228,6 +2268,25 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/*
+	 *	...unless persistent ntlm_auth helpers are configured,
+	 *	which do the same job without a fork per request.
+	 */
+	if (inst->ntlm_helper) {
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(conf, "'ntlm_auth_helper { username = ... }' must be set when using "
+				   "ntlm_auth helpers");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.helpers", inst->ntlm_helpers, >=, 1);
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.helpers", inst->ntlm_helpers, <=, 64);
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.max_in_flight", inst->ntlm_helper_max_in_flight, >=, 1);
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.max_in_flight", inst->ntlm_helper_max_in_flight, <=, 256);
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2235,6 +2294,9 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating via persistent 'ntlm_auth' helpers");
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
@@ -2262,6 +2324,21 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	t->ntlm_helpers = ntlm_helper_pool_alloc(t, mctx->el, inst->ntlm_helper,
+						 inst->ntlm_helpers, inst->ntlm_helper_max_in_flight,
+						 inst->ntlm_auth_timeout, inst->ntlm_helper_probe_interval);
+	if (!t->ntlm_helpers) return -1;
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_mschap_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_mschap_t);
@@ -2303,6 +2380,9 @@ module_t rlm_mschap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_inst_type	= "rlm_mschap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
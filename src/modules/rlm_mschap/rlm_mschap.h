@@ -13,10 +13,11 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	AUTH_WBCLIENT       	= 2,
 #endif
+	AUTH_NTLMAUTH_HELPER	= 3
 } MSCHAP_AUTH_METHOD;
 
 extern HIDDEN fr_dict_attr_t const *attr_auth_type;
@@ -61,6 +62,12 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;		//!< ntlm_auth in helper protocol mode.
+	tmpl_t			*ntlm_helper_username;
+	tmpl_t			*ntlm_helper_domain;
+	uint32_t		ntlm_helpers;		//!< Helper processes per worker thread.
+	uint32_t		ntlm_helper_max_in_flight;	//!< Maximum queries outstanding on one helper.
+	fr_time_delta_t		ntlm_helper_probe_interval;	//!< Idle time before a helper is checked.
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -7,8 +7,9 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("override_cert_url", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, override_url), .dflt = "no" },
 	{ FR_CONF_OFFSET("url", FR_TYPE_STRING, fr_tls_ocsp_conf_t, url) },
 	{ FR_CONF_OFFSET("use_nonce", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, use_nonce), .dflt = "yes" },
-	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, fr_tls_ocsp_conf_t, timeout), .dflt = "5" },
 	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
+	{ FR_CONF_OFFSET("response_cache_size", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, response_cache_size), .dflt = "1024" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -58,13 +59,33 @@ static CONF_PARSER ocsp_config[] = {
 	 * 	Initialize OCSP Revocation Store
 	 */
 	if (conf->ocsp.enable) {
+		if (!fr_time_delta_ispos(conf->ocsp.timeout)) {
+			ERROR("ocsp.timeout must be greater than zero");
+			goto error;
+		}
+
 		conf->ocsp.store = conf_ocsp_revocation_store(conf);
 		if (conf->ocsp.store == NULL) goto error;
+
+		if (conf->ocsp.response_cache_size > 0) {
+			conf->ocsp.response_cache = fr_tls_ocsp_cache_alloc(conf, conf->ocsp.response_cache_size);
+			if (!conf->ocsp.response_cache) goto error;
+		}
 	}
 
 	if (conf->staple.enable) {
+		if (!fr_time_delta_ispos(conf->staple.timeout)) {
+			ERROR("staple.timeout must be greater than zero");
+			goto error;
+		}
+
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
+
+		if (conf->staple.response_cache_size > 0) {
+			conf->staple.response_cache = fr_tls_ocsp_cache_alloc(conf, conf->staple.response_cache_size);
+			if (!conf->staple.response_cache) goto error;
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
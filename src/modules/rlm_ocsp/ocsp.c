@@ -33,13 +33,17 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/util/debug.h>
-
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rb.h>
 
 #include <freeradius-devel/unlang/compile.h>
 
 #include <openssl/ocsp.h>
 
+#include <poll.h>
+#include <pthread.h>
+
 #include "attrs.h"
 #include "base.h"
 #include "log.h"
@@ -96,6 +100,259 @@ static int ocsp_cert_url_parse(X509 *cert, char **host_out, char **port_out, cha
 DIAG_ON(used-but-marked-unused)
 DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 
+/** In-memory cache of OCSP responses
+ *
+ * Shared by all worker threads.  Entries are keyed by the DER encoded
+ * OCSP_CERTID, i.e. the issuer name hash, issuer key hash and serial
+ * number, and expire at the nextUpdate time given by the responder.
+ * Responses without a nextUpdate are never cached, as the responder is
+ * telling us newer information may be available at any time.
+ */
+struct fr_tls_ocsp_cache_s {
+	pthread_mutex_t		mutex;			//!< Protects the tree and LRU list.
+	fr_rb_tree_t		*tree;			//!< Entries by key.
+	fr_dlist_head_t		lru;			//!< Least recently used entry at the head.
+	uint32_t		max_entries;		//!< Evict the LRU entry past this many.
+};
+
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the tree.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+
+	uint8_t			*key;			//!< DER encoded OCSP_CERTID.
+	size_t			key_len;
+
+	uint8_t			*der;			//!< DER encoded OCSP_RESPONSE, for stapling.
+	size_t			der_len;
+
+	int			status;			//!< V_OCSP_CERTSTATUS_* value.
+	int			reason;			//!< Revocation reason, or -1.
+	time_t			next_update;		//!< When the entry expires.
+} ocsp_cache_entry_t;
+
+static int8_t ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	ret = memcmp(a->key, b->key, a->key_len);
+	return (ret > 0) - (ret < 0);
+}
+
+static int _ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a shared OCSP response cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of responses to cache.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on failure.
+ */
+fr_tls_ocsp_cache_t *fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	fr_tls_ocsp_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, fr_tls_ocsp_cache_t));
+	MEM(cache->tree = fr_rb_inline_talloc_alloc(cache, ocsp_cache_entry_t, node, ocsp_cache_entry_cmp, NULL));
+	fr_dlist_talloc_init(&cache->lru, ocsp_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	return cache;
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ * @note Must be called with the mutex held.
+ */
+static void ocsp_cache_entry_free(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry)
+{
+	(void) fr_rb_remove(cache->tree, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Look up a cached response for a certificate
+ *
+ * @param[in] request	The current request.
+ * @param[in] cache	to search.
+ * @param[in] certid	of the certificate being checked.
+ * @param[out] status	V_OCSP_CERTSTATUS_* value from the response.
+ * @param[out] reason	Revocation reason, or -1.
+ * @param[out] ttl	Seconds until the response expires.
+ * @param[out] resp	If not NULL, a copy of the cached response.
+ * @return
+ *	- 1 if a response was found.
+ *	- 0 if there's no (unexpired) response.
+ */
+static int ocsp_cache_find(request_t *request, fr_tls_ocsp_cache_t *cache, OCSP_CERTID *certid,
+			   int *status, int *reason, uint32_t *ttl, OCSP_RESPONSE **resp)
+{
+	ocsp_cache_entry_t	find, *found;
+	uint8_t			*key = NULL;
+	int			len;
+	time_t			now = time(NULL);
+	int			ret = 0;
+
+	len = i2d_OCSP_CERTID(certid, &key);
+	if (len <= 0) return 0;
+
+	find.key = key;
+	find.key_len = len;
+
+	pthread_mutex_lock(&cache->mutex);
+	found = fr_rb_find(cache->tree, &find);
+	if (!found) goto done;
+
+	if (found->next_update <= now) {
+		RDEBUG2("Cached OCSP response has expired");
+		ocsp_cache_entry_free(cache, found);
+		goto done;
+	}
+
+	if (resp) {
+		uint8_t const *p = found->der;
+
+		*resp = d2i_OCSP_RESPONSE(NULL, &p, found->der_len);
+		if (!*resp) goto done;
+	}
+
+	*status = found->status;
+	*reason = found->reason;
+	*ttl = found->next_update - now;
+
+	/*
+	 *	Most recently used goes to the tail.
+	 */
+	fr_dlist_remove(&cache->lru, found);
+	fr_dlist_insert_tail(&cache->lru, found);
+	ret = 1;
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+	OPENSSL_free(key);
+
+	return ret;
+}
+
+/** Add a verified response to the cache
+ *
+ * @param[in] cache		to add the response to.
+ * @param[in] certid		of the certificate the response is for.
+ * @param[in] resp		to cache.
+ * @param[in] status		V_OCSP_CERTSTATUS_* value from the response.
+ * @param[in] reason		Revocation reason, or -1.
+ * @param[in] next_update	from the response.
+ */
+static void ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, OCSP_CERTID *certid, OCSP_RESPONSE *resp,
+			      int status, int reason, time_t next_update)
+{
+	ocsp_cache_entry_t	*entry, *old;
+	uint8_t			*p;
+	int			len;
+
+	MEM(entry = talloc_zero(NULL, ocsp_cache_entry_t));
+	entry->status = status;
+	entry->reason = reason;
+	entry->next_update = next_update;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if (len <= 0) {
+	error:
+		talloc_free(entry);
+		return;
+	}
+	MEM(entry->key = p = talloc_array(entry, uint8_t, len));
+	entry->key_len = i2d_OCSP_CERTID(certid, &p);
+
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) goto error;
+	MEM(entry->der = p = talloc_array(entry, uint8_t, len));
+	entry->der_len = i2d_OCSP_RESPONSE(resp, &p);
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_rb_find(cache->tree, entry);
+	if (old) ocsp_cache_entry_free(cache, old);
+
+	while (fr_rb_num_elements(cache->tree) >= cache->max_entries) {
+		ocsp_cache_entry_free(cache, fr_dlist_head(&cache->lru));
+	}
+
+	talloc_steal(cache, entry);
+	fr_rb_insert(cache->tree, entry);
+	fr_dlist_insert_tail(&cache->lru, entry);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Send an OCSP request, and wait for the response
+ *
+ * The connection is non-blocking, and we sleep in poll() until the
+ * responder's socket is ready, rather than spinning on OCSP_sendreq_nbio().
+ *
+ * @note This still blocks the worker thread for up to timeout.  The
+ *	check is made from the OpenSSL verify callback, so it can't
+ *	yield to the event loop.
+ *
+ * @param[in] request	The current request.
+ * @param[in] conn	to the OCSP responder.
+ * @param[in] ctx	containing the request to send.
+ * @param[out] resp	The response.
+ * @param[in] timeout	How long to wait for the response.  Must be greater than zero.
+ * @return
+ *	- 1 on success.
+ *	- 0 on error.
+ *	- -1 on timeout.
+ */
+static int ocsp_sendreq(request_t *request, BIO *conn, OCSP_REQ_CTX *ctx, OCSP_RESPONSE **resp,
+			fr_time_delta_t timeout)
+{
+	fr_time_t	deadline = fr_time_add(fr_time(), timeout);
+	int		fd = -1;
+	int		rc;
+
+	for (;;) {
+		struct pollfd	pfd;
+		fr_time_delta_t	left;
+
+		rc = OCSP_sendreq_nbio(resp, ctx);
+		if (rc != -1) return rc;
+
+		if (!BIO_should_retry(conn)) return 0;
+
+		if ((fd < 0) && (BIO_get_fd(conn, &fd) < 0)) {
+			REDEBUG("Couldn't get OCSP responder socket");
+			return 0;
+		}
+
+		left = fr_time_sub(deadline, fr_time());
+		if (!fr_time_delta_ispos(left)) return -1;
+
+		pfd.fd = fd;
+		pfd.events = BIO_should_read(conn) ? POLLIN : POLLOUT;
+		pfd.revents = 0;
+
+		rc = poll(&pfd, 1, fr_time_delta_to_msec(left) + 1);
+		if (rc == 0) return -1;
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+
+			REDEBUG("Failed waiting for OCSP responder: %s", fr_syserror(errno));
+			return 0;
+		}
+	}
+}
+
 /** Set the OCSP TLS stapling extension for a SSL session, from cached response data
  *
  * @param ssl		The current SSL session.
@@ -184,7 +441,7 @@ DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
 int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 {
 	fr_tls_ocsp_conf_t	*conf = data;	/* Alloced as part of fr_tls_conf_t (not talloced) */
-	request_t		*request = fr_tls_session_request(tls_session);
+	request_t		*request = fr_tls_session_request(ssl);
 
 	X509			*cert;
 	X509			*issuer_cert;
@@ -211,8 +468,6 @@ int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 		goto error;
 	}
 
-	if (SSL_get0_chain_certs(ssl, &our_chain) == 0) {
-
 	/*
 	 *	Ignore the return code for older versions of
 	 *	OpenSSL.
@@ -221,7 +476,6 @@ int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 	 */
 	(void)SSL_get0_chain_certs(ssl, &our_chain);
 	if (!our_chain) {
-#endif
 		fr_tls_log_error(request, "Failed retrieving chain certificates from current SSL session");
 		goto error;
 	}
@@ -354,12 +608,12 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	BIO		*conn = NULL, *ssl_log = NULL;
 	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
 	ocsp_status_t	status;
-	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
+	ASN1_GENERALIZEDTIME *rev = NULL, *this_update, *next_update;
 	int		reason;
-	OCSP_REQ_CTX	*ctx;
+	OCSP_REQ_CTX	*ctx = NULL;
 	int		rc;
+	uint32_t	ttl;
 
-	fr_time_t	start;
 	fr_pair_t	*vp;
 
 	if (conf->cache_server) {
@@ -449,6 +703,24 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	OCSP_request_add0_id(req, certid);
 	if (conf->use_nonce) OCSP_request_add1_nonce(req, NULL, 8);
 
+	/*
+	 *	Repeat checks of the same certificate are answered
+	 *	from memory until the responder's nextUpdate time.
+	 */
+	if (conf->response_cache &&
+	    ocsp_cache_find(request, conf->response_cache, certid, (int *)&status, &reason, &ttl,
+			    staple_response ? &resp : NULL)) {
+		RDEBUG2("Using cached OCSP response");
+
+		MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
+		vp->vp_uint32 = ttl;
+		RINDENT();
+		RDEBUG2("&%pP", vp);
+		REXDENT();
+
+		goto cert_status;
+	}
+
 	/*
 	 *	Send OCSP Request and get OCSP Response
 	 */
@@ -500,11 +772,10 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	/* Setup BIO socket to OCSP responder */
 	conn = BIO_new_connect(host);
 	BIO_set_conn_port(conn, port);
-
-	if (conf->timeout) BIO_set_nbio(conn, 1);
+	BIO_set_nbio(conn, 1);
 
 	rc = BIO_do_connect(conn);
-	if ((rc <= 0) && ((!conf->timeout) || !BIO_should_retry(conn))) {
+	if ((rc <= 0) && !BIO_should_retry(conn)) {
 		REDEBUG("Couldn't connect to OCSP responder");
 		ocsp_status = OCSP_STATUS_SKIPPED;
 		goto finish;
@@ -529,22 +800,16 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		goto finish;
 	}
 
-	start = fr_time();
-	do {
-		rc = OCSP_sendreq_nbio(&resp, ctx);
-		if (conf->timeout) {
-			if (conf->timeout > (fr_time() - start)) break;
-		}
-	} while ((rc == -1) && BIO_should_retry(conn));
+	rc = ocsp_sendreq(request, conn, ctx, &resp, conf->timeout);
+	OCSP_REQ_CTX_free(ctx);
+	ctx = NULL;
 
-	if (conf->timeout && (rc == -1) && BIO_should_retry(conn)) {
+	if (rc < 0) {
 		REDEBUG("Response timed out");
 		ocsp_status = OCSP_STATUS_SKIPPED;
 		goto finish;
 	}
 
-	OCSP_REQ_CTX_free(ctx);
-
 	if (rc == 0) {
 		REDEBUG("Couldn't get OCSP response");
 		FR_OPENSSL_DRAIN_ERROR_QUEUE(REDEBUG, "", ssl_log);
@@ -642,6 +907,14 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 			RINDENT();
 			RDEBUG2("&%pP", vp);
 			REXDENT();
+
+			/*
+			 *	Only definitive answers are worth caching.
+			 */
+			if (conf->response_cache &&
+			    ((status == V_OCSP_CERTSTATUS_GOOD) || (status == V_OCSP_CERTSTATUS_REVOKED))) {
+				ocsp_cache_insert(conf->response_cache, certid, resp, status, reason, next);
+			}
 		} else {
 			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
 		}
@@ -649,6 +922,7 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
 	}
 
+cert_status:
 	switch (status) {
 	case V_OCSP_CERTSTATUS_GOOD:
 		RDEBUG2("Cert status: good");
@@ -664,7 +938,7 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		 *	Print any messages we may have accumulated
 		 */
 		FR_OPENSSL_DRAIN_LOG_QUEUE(RDEBUG, "", ssl_log);
-		if (RDEBUG_ENABLED2) {
+		if (rev && RDEBUG_ENABLED2) {
 			RDEBUG2("Revocation time:");
 			ASN1_GENERALIZEDTIME_print(ssl_log, rev);
 			RINDENT();
@@ -744,6 +1018,7 @@ finish:
 		}
 	}
 	/* Free OCSP Stuff */
+	if (ctx) OCSP_REQ_CTX_free(ctx);
 	OCSP_REQUEST_free(req);
 	OCSP_BASICRESP_free(bresp);
 	OCSP_RESPONSE_free(resp);
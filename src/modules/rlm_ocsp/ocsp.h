@@ -1,3 +1,5 @@
+typedef struct fr_tls_ocsp_cache_s fr_tls_ocsp_cache_t;
+
 /** OCSP Configuration
  *
  */
@@ -9,9 +11,12 @@ typedef struct {
 	char const	*url;
 	bool		use_nonce;
 	X509_STORE	*store;
-	uint32_t	timeout;
+	fr_time_delta_t	timeout;
 	bool		softfail;
 
+	uint32_t	response_cache_size;		//!< Maximum number of responses to keep in memory.
+	fr_tls_ocsp_cache_t *response_cache;		//!< Responses shared between all worker threads.
+
 
 	fr_tls_cache_t	cache;				//!< Cached cache section pointers.  Means we don't have
 							///< to look them up at runtime.
@@ -36,3 +41,5 @@ int		fr_tls_ocsp_check(request_t *request, SSL *ssl,
 int		fr_tls_ocsp_state_cache_compile(fr_tls_cache_t *sections, CONF_SECTION *server_cs);
 
 int		fr_tls_ocsp_staple_cache_compile(fr_tls_cache_t *sections, CONF_SECTION *server_cs);
+
+fr_tls_ocsp_cache_t *fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries);
@@ -31,6 +31,8 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/tls/log.h>
+#include <freeradius-devel/unlang/compute.h>
+#include <freeradius-devel/unlang/module.h>
 
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/debug.h>
@@ -49,6 +51,9 @@ USES_APPLE_DEPRECATED_API
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <openssl/evp.h>
+#  include <openssl/err.h>
+#else
+#  define EVP_MAX_MD_SIZE	64
 #endif
 
 /*
@@ -70,12 +75,55 @@ static pthread_mutex_t fr_crypt_mutex = PTHREAD_MUTEX_INITIALIZER;
 typedef struct {
 	fr_dict_enum_value_t	*auth_type;
 	bool			normify;
+
+	uint32_t		offload_threads;	//!< How many threads to hash slow passwords in.
+	uint32_t		offload_max_queue;	//!< Fail when more than this many are waiting.
+	unlang_compute_pool_t	*pool;			//!< Shared by all workers.
 } rlm_pap_t;
 
-typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_pair_t const *);
+typedef struct {
+	unlang_compute_thread_t	*compute;		//!< This worker's end of the compute pool.
+} rlm_pap_thread_t;
+
+/** A password hash being computed outside of the worker
+ *
+ * Everything the hash needs is copied here, as the "known good"
+ * password may be freed, and the request may be cancelled, while
+ * the hash is being computed.
+ */
+typedef struct {
+	char const		*name;			//!< Of the hash, for log messages.
+#ifdef HAVE_OPENSSL_EVP_H
+	EVP_MD const		*md;			//!< Digest for PBKDF2.
+	unsigned long		error;			//!< OpenSSL error from the compute thread.
+#endif
+	uint8_t			*password;		//!< Copy of the User-Password, \0 terminated.
+	size_t			password_len;
+
+	uint8_t			*known_good;		//!< Copy of the expected digest, \0 terminated.
+	size_t			known_good_len;
+
+	uint8_t const		*salt;			//!< Points into known_good, or is a child of the job.
+	size_t			salt_len;
+	uint32_t		iterations;		//!< For PBKDF2.
+
+	uint8_t			digest[EVP_MAX_MD_SIZE];	//!< What we calculated.
+	size_t			digest_len;
+
+	rlm_rcode_t		rcode;			//!< Result of the comparison.
+} pap_job_t;
+
+typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, fr_pair_t const *, fr_pair_t const *);
+
+static const CONF_PARSER offload_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_pap_t, offload_threads), .dflt = "4" },
+	{ FR_CONF_OFFSET("max_queue", FR_TYPE_UINT32, rlm_pap_t, offload_max_queue), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("offload", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -161,12 +209,139 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	RETURN_MODULE_UPDATED;
 }
 
+/** Log the final result of authentication
+ *
+ */
+static unlang_action_t pap_auth_return(rlm_rcode_t *p_result, request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Allocate a job to hash the password outside of the worker
+ *
+ */
+static pap_job_t *pap_job_alloc(request_t *request, char const *name, fr_pair_t const *password)
+{
+	pap_job_t	*job;
+
+	MEM(job = talloc_zero(request, pap_job_t));
+	job->name = name;
+	job->rcode = RLM_MODULE_INVALID;
+
+	MEM(job->password = talloc_array(job, uint8_t, password->vp_length + 1));
+	memcpy(job->password, password->vp_octets, password->vp_length);
+	job->password[password->vp_length] = '\0';
+	job->password_len = password->vp_length;
+
+	return job;
+}
+
+/** Copy the "known good" password, or the decoded digest into the job
+ *
+ */
+static void pap_job_known_good(pap_job_t *job, uint8_t const *known_good, size_t len)
+{
+	MEM(job->known_good = talloc_array(job, uint8_t, len + 1));
+	memcpy(job->known_good, known_good, len);
+	job->known_good[len] = '\0';
+	job->known_good_len = len;
+}
+
+/** Report the result of a hash computed by a job, and free it
+ *
+ */
+static unlang_action_t pap_job_result(rlm_rcode_t *p_result, request_t *request, pap_job_t *job)
+{
+	rlm_rcode_t	rcode = job->rcode;
+
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("%s digest does not match \"known good\" digest", job->name);
+		if (!job->digest_len) break;
+
+		if (job->salt_len) REDEBUG3("Salt       : %pH", fr_box_octets(job->salt, job->salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(job->digest, job->digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(job->known_good, job->digest_len));
+		break;
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case RLM_MODULE_INVALID:
+		if (job->error) {
+			char buffer[256];
+
+			ERR_error_string_n(job->error, buffer, sizeof(buffer));
+			REDEBUG("%s digest failure: %s", job->name, buffer);
+		} else {
+			REDEBUG("%s digest failure", job->name);
+		}
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	talloc_free(job);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Called when a job completes in a compute thread
+ *
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	pap_job_t	*job = talloc_get_type_abort(mctx->rctx, pap_job_t);
+	rlm_rcode_t	rcode;
+
+	pap_job_result(&rcode, request, job);
+
+	return pap_auth_return(p_result, request, rcode);
+}
+
+/** Hash the password in a compute thread, and yield the request until it's done
+ *
+ * If the compute pool is disabled, the hash is done inline.  If it's
+ * full, the request fails.
+ */
+static unlang_action_t pap_job_submit(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				      pap_job_t *job, unlang_compute_func_t func)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+
+	switch (unlang_compute_submit(t->compute, request, func, job)) {
+	case 0:
+		return unlang_module_yield(request, mod_authenticate_resume, unlang_compute_signal, job);
+
+	case 1:
+		return pap_job_result(p_result, request, job);
+
+	default:
+		RPERROR("Failed hashing password");
+		talloc_free(job);
+		RETURN_MODULE_FAIL;
+	}
+}
+
 /*
  *	PAP authentication functions
  */
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       UNUSED module_ctx_t const *mctx, request_t *request,
 						       fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	if ((known_good->vp_length != password->vp_length) ||
@@ -180,48 +355,59 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
 }
 
 #ifdef HAVE_CRYPT
-static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
-						       fr_pair_t const *known_good, fr_pair_t const *password)
+/** Run crypt() in a compute thread
+ *
+ * bcrypt and friends are deliberately slow, so we don't want
+ * to run them in the worker.
+ */
+static void pap_job_crypt(void *uctx)
 {
-	char	*crypt_out;
-	int	cmp = 0;
+	pap_job_t	*job = uctx;
+	char		*crypt_out;
+	int		cmp = 0;
 
 #ifdef HAVE_CRYPT_R
 	struct crypt_data crypt_data = { .initialized = 0 };
 
-	crypt_out = crypt_r(password->vp_strvalue, known_good->vp_strvalue, &crypt_data);
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	crypt_out = crypt_r((char const *)job->password, (char const *)job->known_good, &crypt_data);
+	if (crypt_out) cmp = strcmp((char const *)job->known_good, crypt_out);
 #else
 	/*
 	 *	Ensure we're thread-safe, as crypt() isn't.
 	 */
 	pthread_mutex_lock(&fr_crypt_mutex);
-	crypt_out = crypt(password->vp_strvalue, known_good->vp_strvalue);
+	crypt_out = crypt((char const *)job->password, (char const *)job->known_good);
 
 	/*
 	 *	Got something, check it within the lock.  This is
 	 *	faster than copying it to a local buffer, and the
 	 *	time spent within the lock is critical.
 	 */
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	if (crypt_out) cmp = strcmp((char const *)job->known_good, crypt_out);
 	pthread_mutex_unlock(&fr_crypt_mutex);
 #endif
 
 	/*
 	 *	Error.
 	 */
-	if (!crypt_out || (cmp != 0)) {
-		REDEBUG("Crypt digest does not match \"known good\" digest");
-		RETURN_MODULE_REJECT;
-	}
+	job->rcode = (!crypt_out || (cmp != 0)) ? RLM_MODULE_REJECT : RLM_MODULE_OK;
+}
 
-	RETURN_MODULE_OK;
+static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
+						       module_ctx_t const *mctx, request_t *request,
+						       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	pap_job_t	*job;
+
+	job = pap_job_alloc(request, "Crypt", password);
+	pap_job_known_good(job, known_good->vp_octets, known_good->vp_length);
+
+	return pap_job_submit(p_result, mctx, request, job, pap_job_crypt);
 }
 #endif
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_md5(rlm_rcode_t *p_result,
-						     UNUSED rlm_pap_t const *inst, request_t *request,
+						     UNUSED module_ctx_t const *mctx, request_t *request,
 						     fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	uint8_t digest[MD5_DIGEST_LENGTH];
@@ -246,7 +432,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_md5(rlm_rcode_t *p_result,
 
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_smd5(rlm_rcode_t *p_result,
-						      UNUSED rlm_pap_t const *inst, request_t *request,
+						      UNUSED module_ctx_t const *mctx, request_t *request,
 						      fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_md5_ctx_t	*md5_ctx;
@@ -278,7 +464,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_smd5(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_sha1(rlm_rcode_t *p_result,
-						      UNUSED rlm_pap_t const *inst, request_t *request,
+						      UNUSED module_ctx_t const *mctx, request_t *request,
 						      fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -305,7 +491,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_sha1(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_ssha1(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       UNUSED module_ctx_t const *mctx, request_t *request,
 						       fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -337,7 +523,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_ssha1(rlm_rcode_t *p_result,
 
 #ifdef HAVE_OPENSSL_EVP_H
 static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md(rlm_rcode_t *p_result,
-						    	UNUSED rlm_pap_t const *inst, request_t *request,
+						    	UNUSED module_ctx_t const *mctx, request_t *request,
 						    	fr_pair_t const *known_good, fr_pair_t const *password,
 						    	char const *name, EVP_MD const *md)
 {
@@ -365,7 +551,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md_salted(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst, request_t *request,
+							       UNUSED module_ctx_t const *mctx, request_t *request,
 							       fr_pair_t const *known_good, fr_pair_t const *password,
 							       char const *name, EVP_MD const *md)
 {
@@ -374,6 +560,12 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md_salted(rlm_rcode_t *p_re
 	unsigned int	digest_len, min_len;
 
 	min_len = EVP_MD_size(md);
+	if (known_good->vp_length <= min_len) {
+		REDEBUG("\"known-good\" %s-Password has incorrect length, expected > %u got %zu",
+			name, min_len, known_good->vp_length);
+		RETURN_MODULE_INVALID;
+	}
+
 	ctx = EVP_MD_CTX_create();
 	EVP_DigestInit_ex(ctx, md, NULL);
 	EVP_DigestUpdate(ctx, password->vp_octets, password->vp_length);
@@ -404,10 +596,10 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md_salted(rlm_rcode_t *p_re
  */
 #define PAP_AUTH_EVP_MD(_func, _new_func, _name, _md) \
 static unlang_action_t CC_HINT(nonnull) _new_func(rlm_rcode_t *p_result, \
-					          rlm_pap_t const *inst, request_t *request, \
+					          module_ctx_t const *mctx, request_t *request, \
 						  fr_pair_t const *known_good, fr_pair_t const *password) \
 { \
-	return _func(p_result, inst, request, known_good, password, _name, _md); \
+	return _func(p_result, mctx, request, known_good, password, _name, _md); \
 }
 
 PAP_AUTH_EVP_MD(pap_auth_evp_md, pap_auth_sha2_224, "SHA2-224", EVP_sha224())
@@ -430,9 +622,41 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
+/** Compute a PBKDF2 digest in a compute thread
+ *
+ */
+static void pap_job_pbkdf2(void *uctx)
+{
+	pap_job_t	*job = uctx;
+
+	if (PKCS5_PBKDF2_HMAC((char const *)job->password, (int)job->password_len,
+			      (unsigned char const *)job->salt, (int)job->salt_len,
+			      (int)job->iterations,
+			      job->md,
+			      (int)job->digest_len, (unsigned char *)job->digest) == 0) {
+		/*
+		 *	The OpenSSL error stack is per-thread, so
+		 *	take the error with us, and leave the stack
+		 *	clean for the next job.
+		 */
+		job->error = ERR_get_error();
+		ERR_clear_error();
+		job->digest_len = 0;
+		job->rcode = RLM_MODULE_INVALID;
+		return;
+	}
+
+	job->rcode = (fr_digest_cmp(job->digest, job->known_good, job->digest_len) != 0) ?
+		     RLM_MODULE_REJECT : RLM_MODULE_OK;
+}
+
 /** Validates Crypt::PBKDF2 LDAP format strings
+ *
+ * The PBKDF2 string is parsed in the worker, and the hash is computed
+ * in a compute thread, as the iteration count is often large.
  *
  * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * @param[in] mctx		calling context for the module.
  * @param[in] request		The current request.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
@@ -448,7 +672,8 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  *	- RLM_MODULE_OK
  */
 static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
-								     request_t *request, const uint8_t *str, size_t len,
+								     module_ctx_t const *mctx, request_t *request,
+								     const uint8_t *str, size_t len,
 								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
 								     char scheme_sep, char iter_sep, char salt_sep,
 								     bool iter_is_base64, fr_pair_t const *password)
@@ -467,7 +692,8 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	uint8_t			*salt = NULL;
 	size_t			salt_len;
 	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
+
+	pap_job_t		*job;
 
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
@@ -643,26 +869,17 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		iterations, salt_len, slen);
 
 	/*
-	 *	Hash and compare
+	 *	Hash and compare in a compute thread
 	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		fr_tls_log_error(request, "PBKDF2 digest failure");
-		goto finish;
-	}
+	job = pap_job_alloc(request, "PBKDF2", password);
+	job->md = evp_md;
+	job->iterations = iterations;
+	job->digest_len = digest_len;
+	job->salt = talloc_steal(job, salt);
+	job->salt_len = salt_len;
+	pap_job_known_good(job, hash, digest_len);
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
-	}
+	return pap_job_submit(p_result, mctx, request, job, pap_job_pbkdf2);
 
 finish:
 	talloc_free(salt);
@@ -671,7 +888,7 @@ finish:
 }
 
 static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
+							       module_ctx_t const *mctx,
 							       request_t *request,
 							       fr_pair_t const *known_good, fr_pair_t const *password)
 {
@@ -696,7 +913,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', ':', true, password);
 	}
@@ -708,7 +925,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', '$', false, password);
 	}
@@ -722,7 +939,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
 					     '$', '$', '$', false, password);
 	}
@@ -734,7 +951,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 #endif
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_nt(rlm_rcode_t *p_result,
-						    UNUSED rlm_pap_t const *inst, request_t *request,
+						    UNUSED module_ctx_t const *mctx, request_t *request,
 						    fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	ssize_t len;
@@ -770,7 +987,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_nt(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_lm(rlm_rcode_t *p_result,
-						    UNUSED rlm_pap_t const *inst, request_t *request,
+						    UNUSED module_ctx_t const *mctx, request_t *request,
 						    fr_pair_t const *known_good, UNUSED fr_pair_t const *password)
 {
 	uint8_t	digest[MD4_DIGEST_LENGTH];
@@ -800,7 +1017,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_lm(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_ns_mta_md5(rlm_rcode_t *p_result,
-							    UNUSED rlm_pap_t const *inst, request_t *request,
+							    UNUSED module_ctx_t const *mctx, request_t *request,
 							    fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	uint8_t digest[128];
@@ -864,7 +1081,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_ns_mta_md5(rlm_rcode_t *p_resul
  *
  */
 static unlang_action_t CC_HINT(nonnull) pap_auth_dummy(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, UNUSED request_t *request,
+						       UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
 						       UNUSED fr_pair_t const *known_good, UNUSED fr_pair_t const *password)
 {
 	RETURN_MODULE_FAIL;
@@ -925,6 +1142,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
 	bool			ephemeral;
+	unlang_action_t		ua;
 
 	password = fr_pair_find_by_da_idx(&request->request_pairs, attr_user, 0);
 	if (!password) {
@@ -973,23 +1191,16 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 
 	/*
 	 *	Authenticate, and return.
+	 *
+	 *	Slow hashes yield, and are completed in
+	 *	mod_authenticate_resume.  They have their
+	 *	own copy of the "known good" password.
 	 */
-	auth_func(&rcode, inst, request, known_good, password);
+	ua = auth_func(&rcode, mctx, request, known_good, password);
 	if (ephemeral) TALLOC_FREE(known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
-
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
-
-	default:
-		break;
-	}
+	if (ua == UNLANG_ACTION_YIELD) return ua;
 
-	RETURN_MODULE_RCODE(rcode);
+	return pap_auth_return(p_result, request, rcode);
 }
 
 static int mod_instantiate(module_inst_ctx_t const *mctx)
@@ -1002,6 +1213,48 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		     mctx->inst->name);
 	}
 
+	if (inst->offload_threads > 0) {
+		inst->pool = unlang_compute_pool_alloc(inst, mctx->inst->name,
+						       inst->offload_threads, inst->offload_max_queue);
+		if (!inst->pool) {
+			PERROR("Failed creating offload pool");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+
+	if (!inst->pool) return 0;
+
+	t->compute = unlang_compute_thread_alloc(t, inst->pool, mctx->el);
+	if (!t->compute) {
+		PERROR("Failed connecting to offload pool");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_pap_t);
+	unlang_compute_stats_t	stats;
+
+	if (!inst->pool) return 0;
+
+	unlang_compute_pool_stats(&stats, inst->pool);
+
+	DEBUG("%s - Offloaded %" PRIu64 " hashes (%" PRIu64 " cancelled), refused %" PRIu64 " with the queue full, "
+	      "max queue depth %u, max wait %pVs, max run %pVs",
+	      mctx->inst->name, stats.completed, stats.cancelled, stats.full, stats.depth_max,
+	      fr_box_time_delta(stats.wait_max), fr_box_time_delta(stats.run_max));
+
 	return 0;
 }
 
@@ -1072,13 +1325,17 @@ static void mod_unload(void)
  */
 extern module_t rlm_pap;
 module_t rlm_pap = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "pap",
-	.inst_size	= sizeof(rlm_pap_t),
-	.onload		= mod_load,
-	.unload		= mod_unload,
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "pap",
+	.inst_size		= sizeof(rlm_pap_t),
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.thread_inst_type	= "rlm_pap_thread_t",
+	.onload			= mod_load,
+	.unload			= mod_unload,
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.detach			= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -27,6 +27,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
 
 struct mypasswd {
@@ -152,10 +153,10 @@ static void release_hash_table(struct hashtable * ht){
 	ht->tablesize = 0;
 }
 
-static void release_ht(struct hashtable * ht){
-	if (!ht) return;
+static int _release_hash_table(struct hashtable *ht)
+{
 	release_hash_table(ht);
-	talloc_free(ht);
+	return 0;
 }
 
 static struct hashtable * build_hash_table (char const * file, int num_fields,
@@ -194,6 +195,7 @@ static struct hashtable * build_hash_table (char const * file, int num_fields,
 	 */
 	memset(ht->buffer, 0, 1024);
 	MEM(ht->table = talloc_zero_array(ht, struct mypasswd *, tablesize));
+	talloc_set_destructor(ht, _release_hash_table);
 	while (fgets(buffer, 1024, ht->fp)) {
 		if(*buffer && *buffer!='\n' && (!ignorenis || (*buffer != '+' && *buffer != '-')) ){
 			hashentry = mypasswd_alloc(buffer, num_fields, &len);
@@ -352,12 +354,12 @@ int main(void){
 		printpw(pw,4);
 		while ((pw = get_next(buffer, ht, &last_found))) printpw(pw,4);
 	}
-	release_ht(ht);
+	talloc_free(ht);
 }
 
 #else  /* TEST */
 typedef struct {
-	struct hashtable	*ht;
+	reload_t		*reload;	//!< Current and previous hash tables.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
 	char const		*format;
@@ -365,6 +367,7 @@ typedef struct {
 	bool			allow_multiple;
 	bool			ignore_nislike;
 	uint32_t		hash_size;
+	fr_time_delta_t		reload_check_interval;
 	uint32_t		num_fields;
 	uint32_t		key_field;
 	uint32_t		listable;
@@ -384,9 +387,31 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_check_interval", FR_TYPE_TIME_DELTA, rlm_passwd_t, reload_check_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	(Re-)read the passwd file into a new hash table.
+ */
+static int passwd_load(TALLOC_CTX *ctx, void **out, UNUSED bool at_runtime, void *uctx)
+{
+	rlm_passwd_t const	*inst = talloc_get_type_abort_const(uctx, rlm_passwd_t);
+	struct hashtable	*ht;
+
+	ht = build_hash_table(inst->filename, inst->num_fields, inst->key_field, inst->listable,
+			      inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+	if (!ht) {
+		ERROR("Can't build hashtable from passwd file %s", inst->filename);
+		return -1;
+	}
+
+	*out = talloc_steal(ctx, ht);
+
+	return 0;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	int			num_fields = 0, key_field = -1, listable = 0;
@@ -443,24 +468,13 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
 	if (!inst->pwd_fmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -475,8 +489,6 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 	if (!*inst->pwd_fmt->field[key_field]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -484,8 +496,6 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 						  inst->pwd_fmt->field[key_field], true, true);
 	if (!da) {
 		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -497,7 +507,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
 	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
 
-	return 0;
+	inst->reload = reload_alloc(inst, mctx->inst->name, passwd_load, inst, inst->reload_check_interval);
+	if (!inst->reload) return -1;
+
+	reload_file_add(inst->reload, inst->filename);
+
+	return reload_load(inst->reload);
 
 #undef inst
 }
@@ -505,10 +520,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_passwd_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_passwd_t);
-	if (inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+
 	talloc_free(inst->pwd_fmt);
 	return 0;
 }
@@ -543,10 +555,14 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 	struct mypasswd		*pw, *last_found;
 	fr_dcursor_t		cursor;
 	int			found = 0;
+	struct hashtable	*ht;
+	reload_gen_t		*gen;
 
 	key = fr_pair_find_by_da_idx(&request->request_pairs, inst->keyattr, 0);
 	if (!key) RETURN_MODULE_NOTFOUND;
 
+	ht = reload_acquire(&gen, inst->reload);
+
 	for (i = fr_pair_dcursor_by_da_init(&cursor, &request->request_pairs, inst->keyattr);
 	     i;
 	     i = fr_dcursor_next(&cursor)) {
@@ -561,20 +577,22 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 		buffer[0] = '\0';
 #endif
 		fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), i, T_BARE_WORD);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
+		pw = get_pw_nam(buffer, ht, &last_found);
 		if (!pw) continue;
 
 		do {
 			result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
 			result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
 			result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		} while ((pw = get_next(buffer, ht, &last_found)));
 
 		found++;
 
 		if (!inst->allow_multiple) break;
 	}
 
+	reload_release(gen);
+
 	if (!found) RETURN_MODULE_NOTFOUND;
 
 	RETURN_MODULE_OK;
@@ -35,11 +35,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
-
-static CONF_PARSER module_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/xlat.h>
 
 /** rlm_redis module instance
  *
@@ -49,8 +47,46 @@ typedef struct {
 						//!< Must be first field in this struct.
 
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the trunk to each cluster node.
 } rlm_redis_t;
 
+/** rlm_redis thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Trunks to each of the cluster nodes.
+} rlm_redis_thread_t;
+
+/** Thread instance data for the redis xlat
+ *
+ */
+typedef struct {
+	rlm_redis_t const	*inst;		//!< Module instance.
+	rlm_redis_thread_t	*t;		//!< Module thread instance.
+} redis_xlat_thread_inst_t;
+
+/** Resume context for the redis xlat
+ *
+ */
+typedef struct {
+	fr_redis_command_set_t	*cmds;		//!< Commands currently being executed.
+	bool			read_only;	//!< The command was wrapped in READONLY/READWRITE.
+	bool			failed;		//!< The commands couldn't be executed.
+
+	redisReply		*replies[3];	//!< Must be equal to the maximum number of
+						///< pipelined commands.
+	size_t			reply_cnt;	//!< How many replies we received.
+} redis_xlat_rctx_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
+	CONF_PARSER_TERMINATOR
+};
+
 /** Change the state of a connection to READONLY execute a command and switch to READWRITE
  *
  * @param[out] status_out Where to write the status from the command.
@@ -265,145 +301,304 @@ static xlat_arg_parser_t const redis_args[] = {
 	XLAT_ARG_PARSER_TERMINATOR
 };
 
-/** Xlat to make calls to redis
- *
-@verbatim
-%{redis:<redis command>}
-@endverbatim
+/** Copy the xlat arguments into an argv array
  *
- * @ingroup xlat_functions
+ * @return
+ *	- The number of arguments.
+ *	- -1 if there were no arguments, or too many arguments.
  */
-static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
-				request_t *request, void const *xlat_inst,
-				UNUSED void *xlat_thread_inst,
-				fr_value_box_list_t *in)
+static int redis_xlat_argv(request_t *request, char const **argv, size_t *arg_len, fr_value_box_list_t *in)
 {
+	int argc = 0;
 
-	rlm_redis_t const	*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_redis_t);
-	xlat_action_t		action = XLAT_ACTION_DONE;
-	fr_redis_conn_t		*conn;
+	fr_dlist_foreach(in, fr_value_box_t, vb) {
+		if (argc == MAX_REDIS_ARGS) {
+			REDEBUG("Too many arguments (%i)", argc);
+			return -1;
+		}
+
+		argv[argc] = vb->vb_strvalue;
+		arg_len[argc] = vb->vb_length;
+		argc++;
+	}
 
-	bool			read_only = false;
-	uint8_t	const		*key = NULL;
-	size_t			key_len = 0;
+	if (argc == 0) {
+		REDEBUG("Missing command");
+		return -1;
+	}
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
+	RDEBUG2("Executing command: %.*s", (int)arg_len[0], argv[0]);
+	if (argc > 1) {
+		RDEBUG2("With arguments");
+		RINDENT();
+		for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
+		REXDENT();
+	}
 
-	redisReply		*reply = NULL;
-	int			s_ret;
+	return argc;
+}
 
-	fr_value_box_t		*first = fr_dlist_head(in);
-	fr_sbuff_t		sbuff = FR_SBUFF_IN(first->vb_strvalue, first->vb_length);
+/** Convert a redis reply to a value box, and add it to the output cursor
+ *
+ */
+static xlat_action_t redis_xlat_reply(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *request, redisReply *reply)
+{
+	fr_value_box_t	*vb_out;
 
-	int			argc = 0;
+	MEM(vb_out = fr_value_box_alloc_null(ctx));
+	if (fr_redis_reply_to_value_box(ctx, vb_out, reply, FR_TYPE_VOID, NULL, false, false) < 0) {
+		RPERROR("Failed processing reply");
+		talloc_free(vb_out);
+		return XLAT_ACTION_FAIL;
+	}
+	fr_dcursor_append(out, vb_out);
+
+	return XLAT_ACTION_DONE;
+}
+
+/** Run a command against a specific node, bypassing the normal node selection
+ *
+ * This is a hack to allow querying against a specific node for testing,
+ * so it uses the blocking connection pool for the node.
+ */
+static xlat_action_t redis_xlat_node(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *request,
+				     rlm_redis_t const *inst, fr_sbuff_t *sbuff, bool read_only,
+				     fr_value_box_list_t *in)
+{
+	xlat_action_t		action = XLAT_ACTION_FAIL;
+	fr_socket_t		node_addr;
+	fr_pool_t		*pool;
+	fr_redis_conn_t		*conn;
+	fr_redis_rcode_t	status;
+	redisReply		*reply = NULL;
+
+	int			argc;
 	char const		*argv[MAX_REDIS_ARGS];
 	size_t			arg_len[MAX_REDIS_ARGS];
 
-	fr_value_box_t		*vb_out;
+	RDEBUG3("Overriding node selection");
 
-	if (fr_sbuff_next_if_char(&sbuff, '-')) read_only = true;
+	if (fr_inet_pton_port(&node_addr.inet.dst_ipaddr, &node_addr.inet.dst_port,
+			      fr_sbuff_current(sbuff), fr_sbuff_remaining(sbuff),
+			      AF_UNSPEC, true, true) < 0) {
+		RPEDEBUG("Failed parsing node address");
+		return XLAT_ACTION_FAIL;
+	}
 
-	/*
-	 *	Hack to allow querying against a specific node for testing
-	 */
-	if (fr_sbuff_next_if_char(&sbuff, '@')) {
-		fr_socket_t	node_addr;
-		fr_pool_t	*pool;
+	if (fr_redis_cluster_pool_by_node_addr(&pool, inst->cluster, &node_addr, true) < 0) {
+		RPEDEBUG("Failed locating cluster node");
+		return XLAT_ACTION_FAIL;
+	}
 
-		RDEBUG3("Overriding node selection");
+	fr_dlist_talloc_free_head(in);	/* Remove and free server arg */
 
-		if (fr_inet_pton_port(&node_addr.inet.dst_ipaddr, &node_addr.inet.dst_port,
-				      fr_sbuff_current(&sbuff), fr_sbuff_remaining(&sbuff),
-				      AF_UNSPEC, true, true) < 0) {
-			RPEDEBUG("Failed parsing node address");
-			return XLAT_ACTION_FAIL;
-		}
+	argc = redis_xlat_argv(request, argv, arg_len, in);
+	if (argc <= 0) return XLAT_ACTION_FAIL;
 
-		if (fr_redis_cluster_pool_by_node_addr(&pool, inst->cluster, &node_addr, true) < 0) {
-			RPEDEBUG("Failed locating cluster node");
-			return XLAT_ACTION_FAIL;
-		}
+	conn = fr_pool_connection_get(pool, request);
+	if (!conn) {
+		REDEBUG("No connections available for cluster node");
+		return XLAT_ACTION_FAIL;
+	}
 
-		conn = fr_pool_connection_get(pool, request);
-		if (!conn) {
-			REDEBUG("No connections available for cluster node");
-			return XLAT_ACTION_FAIL;
-		}
+	if (!read_only) {
+		reply = redisCommandArgv(conn->handle, argc, argv, arg_len);
+		status = fr_redis_command_status(conn, reply);
+	} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
+		goto close_conn;
+	}
 
-		fr_dlist_talloc_free_head(in);	/* Remove and free server arg */
+	if (!reply) goto release;
 
-		fr_dlist_foreach(in, fr_value_box_t, vb) {
-			if (argc == NUM_ELEMENTS(argv)) {
-				REDEBUG("Too many arguments (%i)", argc);
-				REXDENT();
-				goto fail;
-			}
+	switch (status) {
+	case REDIS_RCODE_MOVE:
+	{
+		fr_value_box_t vb;
 
-			argv[argc] = vb->vb_strvalue;
-			arg_len[argc] = vb->vb_length;
-			argc++;
+		if (fr_redis_reply_to_value_box(NULL, &vb, reply, FR_TYPE_STRING, NULL, false, true) == 0) {
+			REDEBUG("Key served by a different node: %pV", &vb);
 		}
+		break;
+	}
 
-		RDEBUG2("Executing command: %pV", fr_dlist_head(in));
-		if (argc > 1) {
-			RDEBUG2("With arguments");
-			RINDENT();
-			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
-			REXDENT();
-		}
+	case REDIS_RCODE_SUCCESS:
+		action = redis_xlat_reply(ctx, out, request, reply);
+		break;
 
-		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, arg_len);
-			status = fr_redis_command_status(conn, reply);
-		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
-			goto close_conn;
-		}
+	case REDIS_RCODE_RECONNECT:
+	close_conn:
+		fr_pool_connection_close(pool, request, conn);
+		fr_redis_reply_free(&reply);
+		return XLAT_ACTION_FAIL;
 
-		if (!reply) goto fail;
+	default:
+		break;
+	}
 
-		switch (status) {
-		case REDIS_RCODE_MOVE:
-		{
-			fr_value_box_t vb;
+release:
+	fr_pool_connection_release(pool, request, conn);
+	fr_redis_reply_free(&reply);
 
-			if (fr_redis_reply_to_value_box(NULL, &vb, reply, FR_TYPE_STRING, NULL, false, true) == 0) {
-				REDEBUG("Key served by a different node: %pV", &vb);
-			}
-			goto fail;
-		}
+	return action;
+}
 
-		case REDIS_RCODE_SUCCESS:
-			goto reply_parse;
+/** Free any replies we're still holding
+ *
+ */
+static int _redis_xlat_rctx_free(redis_xlat_rctx_t *rctx)
+{
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+	rctx->reply_cnt = 0;
 
-		case REDIS_RCODE_RECONNECT:
-		close_conn:
-			fr_pool_connection_close(pool, request, conn);
-			action = XLAT_ACTION_FAIL;
-			goto finish;
+	return 0;
+}
 
-		default:
-		fail:
-			fr_pool_connection_release(pool, request, conn);
-			action = XLAT_ACTION_FAIL;
-			goto finish;
-		}
+/** Grab the replies we need before the command set is freed
+ *
+ */
+static void redis_xlat_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+	fr_redis_command_t	*cmd;
+
+	rctx->cmds = NULL;	/* Freed when we return */
+
+	for (cmd = fr_dlist_head(completed);
+	     cmd && (rctx->reply_cnt < NUM_ELEMENTS(rctx->replies));
+	     cmd = fr_dlist_next(completed, cmd)) {
+		rctx->replies[rctx->reply_cnt++] = fr_redis_command_steal_result(cmd);
 	}
 
-	RDEBUG2("REDIS command arguments");
-	RINDENT();
-	fr_dlist_foreach(in, fr_value_box_t, vb) {
-		if (argc == NUM_ELEMENTS(argv)) {
-			REDEBUG("Too many arguments (%i)", argc);
-			REXDENT();
-			goto finish;
-		}
+	unlang_interpret_mark_runnable(request);
+}
 
-		argv[argc] = vb->vb_strvalue;
-		arg_len[argc] = vb->vb_length;
-		argc++;
+/** Record that the commands couldn't be executed
+ *
+ */
+static void redis_xlat_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+
+	rctx->cmds = NULL;	/* Freed when we return */
+	rctx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Stop waiting for the commands if the request is cancelled
+ *
+ */
+static void redis_xlat_signal(UNUSED request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+			      void *rctx, fr_state_signal_t action)
+{
+	redis_xlat_rctx_t	*our_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (our_rctx->cmds) {
+		fr_redis_command_set_signal_cancel(our_rctx->cmds);
+		our_rctx->cmds = NULL;
+	}
+}
+
+/** Process the reply to a pipelined redis command
+ *
+ */
+static xlat_action_t redis_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				       request_t *request, UNUSED void const *xlat_inst,
+				       UNUSED void *xlat_thread_inst,
+				       UNUSED fr_value_box_list_t *in, void *rctx)
+{
+	redis_xlat_rctx_t	*our_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+	redisReply		**replies = our_rctx->replies;
+	size_t			i = our_rctx->read_only ? 1 : 0;	/* Skip the READONLY reply */
+	size_t			j;
+
+	if (our_rctx->failed) {
+		REDEBUG("Failed executing command");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (RDEBUG_ENABLED3) for (j = 0; j < our_rctx->reply_cnt; j++) {
+		fr_redis_reply_print(L_DBG_LVL_3, replies[j], request, j);
+	}
+
+	if (our_rctx->reply_cnt <= i) {
+		REDEBUG("Expected at least %zu replies, got %zu", i + 1, our_rctx->reply_cnt);
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (our_rctx->read_only && (fr_redis_command_status(NULL, replies[0]) != REDIS_RCODE_SUCCESS)) {
+		REDEBUG("Setting READONLY failed");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_redis_command_status(NULL, replies[i]) != REDIS_RCODE_SUCCESS) {
+		RPERROR("Command failed");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (our_rctx->read_only && ((our_rctx->reply_cnt < 3) ||
+				    (fr_redis_command_status(NULL, replies[2]) != REDIS_RCODE_SUCCESS))) {
+		RWDEBUG("Setting READWRITE failed");
+	}
+
+	return redis_xlat_reply(ctx, out, request, replies[i]);
+}
+
+/** Xlat to make calls to redis
+ *
+@verbatim
+%{redis:<redis command>}
+@endverbatim
+ *
+ * Commands are pipelined over the thread's trunk to the cluster node
+ * responsible for the key, and the request yields until the reply arrives.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				request_t *request, UNUSED void const *xlat_inst,
+				void *xlat_thread_inst,
+				fr_value_box_list_t *in)
+{
+	redis_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, redis_xlat_thread_inst_t);
+	redis_xlat_rctx_t		*rctx;
+	fr_redis_command_set_t		*cmds;
+
+	bool				read_only = false;
+	uint8_t	const			*key = NULL;
+	size_t				key_len = 0;
+
+	fr_value_box_t			*first = fr_dlist_head(in);
+	fr_sbuff_t			sbuff = FR_SBUFF_IN(first->vb_strvalue, first->vb_length);
+
+	int				argc;
+	char const			*argv[MAX_REDIS_ARGS];
+	size_t				arg_len[MAX_REDIS_ARGS];
+
+	if (fr_sbuff_next_if_char(&sbuff, '-')) read_only = true;
+
+	/*
+	 *	Hack to allow querying against a specific node for testing
+	 */
+	if (fr_sbuff_next_if_char(&sbuff, '@')) return redis_xlat_node(ctx, out, request, xt->inst,
+									&sbuff, read_only, in);
+
+	argc = redis_xlat_argv(request, argv, arg_len, in);
+	if (argc <= 0) return XLAT_ACTION_FAIL;
+
+	/*
+	 *	Strip the read only marker from the command
+	 */
+	if (read_only) {
+		argv[0]++;
+		arg_len[0]--;
+		if (arg_len[0] == 0) {
+			REDEBUG("Missing command");
+			return XLAT_ACTION_FAIL;
+		}
 	}
-	REXDENT();
 
 	/*
 	 *	If we've got multiple arguments, the second one is usually the key.
@@ -417,46 +612,40 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	 	key_len = arg_len[1];
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		RDEBUG2("Executing command: %pV", fr_dlist_head(in));
-		if (argc > 1) {
-			RDEBUG2("With arguments");
-			RINDENT();
-			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
-			REXDENT();
-		}
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), redis_xlat_rctx_t));
+	talloc_set_destructor(rctx, _redis_xlat_rctx_free);
+	rctx->read_only = read_only;
 
-		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, arg_len);
-			status = fr_redis_command_status(conn, reply);
-		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
-			state.close_conn = true;
-		}
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		action = XLAT_ACTION_FAIL;
-		goto finish;
+	/*
+	 *	Read only commands are sent to a slave where possible.
+	 *	The connection is switched back to READWRITE straight
+	 *	afterwards, as it's shared with other requests.
+	 */
+	cmds = fr_redis_command_set_alloc(NULL, request, redis_xlat_complete, redis_xlat_fail, rctx);
+	if ((read_only && (fr_redis_command_add(cmds, "READONLY") != FR_REDIS_PIPELINE_OK)) ||
+	    (fr_redis_command_argv_add(cmds, argc, argv, arg_len) != FR_REDIS_PIPELINE_OK) ||
+	    (read_only && (fr_redis_command_add(cmds, "READWRITE") != FR_REDIS_PIPELINE_OK)) ||
+	    (fr_redis_cluster_command_set_enqueue(xt->t->cluster, cmds, key, key_len,
+						  read_only) != FR_REDIS_PIPELINE_OK)) {
+		talloc_free(cmds);
+		talloc_free(rctx);
+		return XLAT_ACTION_FAIL;
 	}
+	rctx->cmds = cmds;
 
-	if (!fr_cond_assert(reply)) {
-		action = XLAT_ACTION_FAIL;
-		goto finish;
-	}
+	return unlang_xlat_yield(request, redis_xlat_resume, redis_xlat_signal, rctx);
+}
 
-reply_parse:
-	MEM(vb_out = fr_value_box_alloc_null(ctx));
-	if (fr_redis_reply_to_value_box(ctx, vb_out, reply, FR_TYPE_VOID, NULL, false, false) < 0) {
-		RPERROR("Failed processing reply");
-		return XLAT_ACTION_FAIL;
-	}
-	fr_dcursor_append(out, vb_out);
+static int redis_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+					 UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_redis_t			*inst = talloc_get_type_abort(uctx, rlm_redis_t);
+	redis_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, redis_xlat_thread_inst_t);
 
-finish:
-	fr_redis_reply_free(&reply);
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_redis_thread_t);
 
-	return action;
+	return 0;
 }
 
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
@@ -465,9 +654,9 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	char		*name;
 	xlat_t		*xlat;
 
-	xlat = xlat_register(inst, mctx->inst->name, redis_xlat, false);
+	xlat = xlat_register(inst, mctx->inst->name, redis_xlat, true);
 	xlat_func_args(xlat, redis_args);
-	xlat_async_instantiate_set(xlat, redis_xlat_instantiate, rlm_redis_t *, NULL, inst);
+	xlat_async_thread_instantiate_set(xlat, redis_xlat_thread_instantiate, redis_xlat_thread_inst_t, NULL, inst);
 
 	/*
 	 *	%(redis_node:<key>[ idx])
@@ -497,6 +686,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+/** Create the trunks for this thread
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, mctx->el, &inst->trunk_conf,
+						   inst->cluster, &inst->conf, mctx->inst->name);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_thread_t);
+
+	TALLOC_FREE(t->cluster);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -506,12 +719,16 @@ static int mod_load(void)
 
 extern module_t rlm_redis;
 module_t rlm_redis = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "redis",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_redis_t),
-	.config		= module_config,
-	.onload		= mod_load,
-	.bootstrap	= mod_bootstrap,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "redis",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_redis_t),
+	.thread_inst_size	= sizeof(rlm_redis_thread_t),
+	.thread_inst_type	= "rlm_redis_thread_t",
+	.config			= module_config,
+	.onload			= mod_load,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 };
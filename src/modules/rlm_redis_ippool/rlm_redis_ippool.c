@@ -50,6 +50,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
 #include "redis_ippool.h"
 
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
@@ -97,9 +100,19 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
-	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+	fr_redis_cluster_t	*cluster;	//!< Redis cluster.  Used to map pools to cluster nodes,
+						//!< and to check the server version.
+
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the trunk to each cluster node.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Trunks to each of the cluster nodes.
+} rlm_redis_ippool_thread_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -134,6 +147,8 @@ static CONF_PARSER module_config[] = {
 	 *	minimum of config changes.
 	 */
 	{ FR_CONF_POINTER("redis", FR_TYPE_SUBSECTION, NULL), .subcs = redis_config },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -453,139 +468,240 @@ static void ippool_action_print(request_t *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+/** Resume context for a lease operation
  *
- * Handles uploading the script to the server if required.
+ */
+typedef struct {
+	rlm_redis_ippool_thread_t	*t;		//!< Thread instance.
+	ippool_action_t			action;		//!< What we're doing to the lease.
+
+	uint8_t				*key_prefix;	//!< Pool name.  Used to find the cluster node.
+	size_t				key_prefix_len;	//!< Length of the pool name.
+
+	char				*ip_str;	//!< Address being updated or released.
+	uint32_t			expires;	//!< Lease time.
+
+	char const			*digest;	//!< SHA1 digest of the script being run.
+	char const			*script;	//!< Script to load if the node doesn't have it cached.
+	char				*evalsha;	//!< EVALSHA command in the redis protocol format, so
+							///< it can be sent again after loading the script.
+	size_t				evalsha_len;	//!< Length of the EVALSHA command.
+
+	fr_redis_command_set_t		*cmds;		//!< Commands currently being executed.
+	bool				loading;	//!< We sent the script along with the EVALSHA.
+	bool				failed;		//!< The commands couldn't be executed.
+
+	redisReply			*replies[5];	//!< Must be equal to the maximum number of
+							///< pipelined commands.
+	size_t				reply_cnt;	//!< How many replies we received.
+} redis_ippool_rctx_t;
+
+/** Free any replies we're still holding
  *
- * @note All replies will be freed on error.
+ */
+static int _redis_ippool_rctx_free(redis_ippool_rctx_t *rctx)
+{
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+	rctx->reply_cnt = 0;
+
+	return 0;
+}
+
+/** Format the EVALSHA command for a script
  *
- * @param[out] out		Where to write Redis reply object resulting from the command.
- * @param[in] request		The current request.
- * @param[in] cluster		configuration.
- * @param[in] key		to use to determine the cluster node.
- * @param[in] key_len		length of the key.
- * @param[in] wait_num		If > 0 wait until this many slaves have replicated the data
- *				from the last command.
- * @param[in] wait_timeout	How long to wait for slaves to replicate the data.
- * @param[in] digest		of script.
- * @param[in] script		to upload.
- * @param[in] cmd		EVALSHA command to execute.
- * @param[in] ...		Arguments for the eval command.
- * @return status of the command.
+ * The command is formatted once, as it may need to be sent twice if the
+ * script hasn't yet been loaded on the node.
+ *
+ * @param[in] rctx	to write the command to.
+ * @param[in] digest	of script.
+ * @param[in] script	to upload.
+ * @param[in] cmd	EVALSHA command to execute.
+ * @param[in] ...	Arguments for the eval command.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, fr_time_delta_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static int ippool_script_format(redis_ippool_rctx_t *rctx, char const digest[], char const *script,
+				char const *cmd, ...)
 {
-	fr_redis_conn_t			*conn;
-	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
-	size_t				reply_cnt = 0, i;
+	va_list	ap;
+	char	*formatted;
+	int	len;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		s_ret, status;
-	unsigned int			pipelined = 0;
+	va_start(ap, cmd);
+	len = redisvFormatCommand(&formatted, cmd, ap);
+	va_end(ap);
+	if (len < 0) return -1;
 
-	va_list				ap;
+	MEM(rctx->evalsha = talloc_memdup(rctx, formatted, (size_t)len));
+	rctx->evalsha_len = (size_t)len;
+	redisFreeCommand(formatted);
 
-	*out = NULL;
+	rctx->digest = digest;
+	rctx->script = script;
 
-#ifndef NDEBUG
-	memset(replies, 0, sizeof(replies));
-#endif
+	return 0;
+}
 
-	va_start(ap, cmd);
+/** Grab the replies we need before the command set is freed
+ *
+ */
+static void ippool_script_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_ippool_rctx_t);
+	fr_redis_command_t	*cmd;
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
-	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		pipelined = 1;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
-		}
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status != REDIS_RCODE_NO_SCRIPT) continue;
+	rctx->cmds = NULL;	/* Freed when we return */
 
-		/*
-		 *	Clear out the existing reply
-		 */
-		fr_redis_pipeline_free(replies, reply_cnt);
+	for (cmd = fr_dlist_head(completed);
+	     cmd && (rctx->reply_cnt < NUM_ELEMENTS(rctx->replies));
+	     cmd = fr_dlist_next(completed, cmd)) {
+		rctx->replies[rctx->reply_cnt++] = fr_redis_command_steal_result(cmd);
+	}
 
-		/*
-		 *	Last command failed with NOSCRIPT, this means
-		 *	we have to send the Lua script up to the node
-		 *	so it can be cached.
-		 */
-	     	RDEBUG3("Loading script 0x%s", digest);
-		redisAppendCommand(conn->handle, "MULTI");
-		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		redisAppendCommand(conn->handle, "EXEC");
-		pipelined = 4;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the commands couldn't be executed
+ *
+ */
+static void ippool_script_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_ippool_rctx_t);
+
+	rctx->cmds = NULL;	/* Freed when we return */
+	rctx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Send a script to the cluster node responsible for the pool
+ *
+ * If the script has previously been found not to be cached on the node, it's
+ * uploaded along with the EVALSHA, in a transaction.
+ *
+ * @param[in] request	The current request.
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] rctx	containing the EVALSHA command and the pool name.
+ * @return
+ *	- 0 if the commands were enqueued.
+ *	- -1 on failure.
+ */
+static int ippool_script_enqueue(request_t *request, rlm_redis_ippool_t const *inst, redis_ippool_rctx_t *rctx)
+{
+	fr_redis_command_set_t	*cmds;
+
+	cmds = fr_redis_command_set_alloc(NULL, request, ippool_script_complete, ippool_script_fail, rctx);
+
+	if (!rctx->loading) {
+		RDEBUG3("Calling script 0x%s", rctx->digest);
+	} else {
+		RDEBUG3("Loading script 0x%s", rctx->digest);
+		if (fr_redis_command_add(cmds, "MULTI") != FR_REDIS_PIPELINE_OK) {
+		error:
+			talloc_free(cmds);
+			return -1;
 		}
+		if (fr_redis_command_add(cmds, "SCRIPT LOAD %s", rctx->script) != FR_REDIS_PIPELINE_OK) goto error;
+	}
 
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status == REDIS_RCODE_SUCCESS) {
-			if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) {
-				fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
-			}
+	fr_redis_command_formatted_add(cmds, rctx->evalsha, rctx->evalsha_len);
 
-			if (replies[3]->type != REDIS_REPLY_ARRAY) {
-				RERROR("Bad response to EXEC, expected array got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
-			error:
-				fr_redis_pipeline_free(replies, reply_cnt);
-				status = REDIS_RCODE_ERROR;
-				goto finish;
-			}
-			if (replies[3]->elements != 2) {
-				RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
-				       replies[3]->elements);
-				goto error;
-			}
-			if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
-				RERROR("Bad response to SCRIPT LOAD, expected string got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
-				goto error;
-			}
-			if (strcmp(replies[3]->element[0]->str, digest) != 0) {
-				RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
-					digest, replies[3]->element[0]->str);
-				goto error;
-			}
+	if (rctx->loading && (fr_redis_command_add(cmds, "EXEC") != FR_REDIS_PIPELINE_OK)) goto error;
+
+	if (inst->wait_num && (fr_redis_command_add(cmds, "WAIT %i %i",
+						     inst->wait_num,
+						     fr_time_delta_to_msec(inst->wait_timeout)) != FR_REDIS_PIPELINE_OK)) {
+		goto error;
+	}
+
+	if (fr_redis_cluster_command_set_enqueue(rctx->t->cluster, cmds,
+						 rctx->key_prefix, rctx->key_prefix_len, false) != FR_REDIS_PIPELINE_OK) goto error;
+
+	rctx->cmds = cmds;
+
+	return 0;
+}
+
+/** Extract the result of the EVALSHA from the replies
+ *
+ * @note All replies will be freed on error.
+ *
+ * @param[out] out	Where to write Redis reply object resulting from the command.
+ * @param[in] request	The current request.
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] rctx	holding the replies.
+ * @return status of the command.
+ */
+static fr_redis_rcode_t ippool_script_result(redisReply **out, request_t *request,
+					     rlm_redis_ippool_t const *inst, redis_ippool_rctx_t *rctx)
+{
+	redisReply		**replies = rctx->replies;
+	size_t			i;
+	fr_redis_rcode_t	status = REDIS_RCODE_SUCCESS;
+
+	*out = NULL;
+
+	if (RDEBUG_ENABLED3) for (i = 0; i < rctx->reply_cnt; i++) {
+		fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+	}
+
+	for (i = 0; i < rctx->reply_cnt; i++) {
+		status = fr_redis_command_status(NULL, replies[i]);
+		if (status != REDIS_RCODE_SUCCESS) {
+			if ((status == REDIS_RCODE_NO_SCRIPT) && !rctx->loading) return status;
+
+			RPERROR("Command failed");
+		error:
+			fr_redis_pipeline_free(replies, rctx->reply_cnt);
+			rctx->reply_cnt = 0;
+			return REDIS_RCODE_ERROR;
+		}
+	}
+
+	if (rctx->loading) {
+		if (rctx->reply_cnt < 4) {
+			RERROR("Expected at least 4 replies, got %zu", rctx->reply_cnt);
+			goto error;
+		}
+		if (replies[3]->type != REDIS_REPLY_ARRAY) {
+			RERROR("Bad response to EXEC, expected array got %s",
+			       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
+			goto error;
+		}
+		if (replies[3]->elements != 2) {
+			RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
+			       replies[3]->elements);
+			goto error;
+		}
+		if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
+			RERROR("Bad response to SCRIPT LOAD, expected string got %s",
+			       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
+			goto error;
 		}
+		if (strcmp(replies[3]->element[0]->str, rctx->digest) != 0) {
+			RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
+				rctx->digest, replies[3]->element[0]->str);
+			goto error;
+		}
+	} else if (rctx->reply_cnt < 1) {
+		RERROR("Expected at least 1 reply, got none");
+		goto error;
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) goto error;
 
-	switch (reply_cnt) {
+	switch (rctx->reply_cnt) {
 	case 2:	/* EVALSHA with wait */
-		if (ippool_wait_check(request, wait_num, replies[1]) < 0) goto error;
+		if (ippool_wait_check(request, inst->wait_num, replies[1]) < 0) goto error;
 		fr_redis_reply_free(&replies[1]);	/* Free the wait response */
-		break;
+		FALL_THROUGH;
 
 	case 1:	/* EVALSHA */
 		*out = replies[0];
+		replies[0] = NULL;
 		break;
 
 	case 5: /* LOADSCRIPT + EVALSHA + WAIT */
-		if (ippool_wait_check(request, wait_num, replies[4]) < 0) goto error;
+		if (ippool_wait_check(request, inst->wait_num, replies[4]) < 0) goto error;
 		fr_redis_reply_free(&replies[4]);	/* Free the wait response */
 		FALL_THROUGH;
 
@@ -598,31 +714,24 @@ static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_r
 		fr_redis_reply_free(&replies[3]);	/* This works because hiredis checks for NULL elements */
 		break;
 
-	case 0:
-		break;
+	default:
+		RERROR("Unexpected number of replies %zu", rctx->reply_cnt);
+		goto error;
 	}
+	rctx->reply_cnt = 0;
 
-finish:
-	va_end(ap);
-	return s_ret;
+	return status;
 }
 
-/** Allocate a new IP address from a pool
+/** Format the command to allocate a new IP address from a pool
  *
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *owner, size_t owner_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static int redis_ippool_allocate(redis_ippool_rctx_t *rctx,
+				 uint8_t const *owner, size_t owner_len,
+				 uint8_t const *gateway_id, size_t gateway_id_len)
 {
 	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	fr_assert(key_prefix);
 	fr_assert(owner);
 
 	now = fr_time_to_timeval(fr_time());
@@ -632,20 +741,22 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 	 */
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       owner, owner_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
+	return ippool_script_format(rctx, lua_alloc_digest, lua_alloc_cmd,
+				    "EVALSHA %s 1 %b %u %u %b %b",
+				    lua_alloc_digest,
+				    rctx->key_prefix, rctx->key_prefix_len,
+				    (unsigned int)now.tv_sec, rctx->expires,
+				    owner, owner_len,
+				    gateway_id, gateway_id_len);
+}
+
+/** Process the result of allocating a new IP address
+ *
+ */
+static ippool_rcode_t redis_ippool_allocate_result(rlm_redis_ippool_t const *inst, request_t *request,
+						   redisReply *reply)
+{
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
@@ -798,26 +909,15 @@ finish:
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Format the command to update an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *owner, size_t owner_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
-					  uint32_t expires)
+static int redis_ippool_update(rlm_redis_ippool_t const *inst, redis_ippool_rctx_t *rctx,
+			       fr_ipaddr_t *ip,
+			       uint8_t const *owner, size_t owner_len,
+			       uint8_t const *gateway_id, size_t gateway_id_len)
 {
 	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	tmpl_t		range_rhs;
-	map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
-
-	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
 	now = fr_time_to_timeval(fr_time());
 
@@ -828,37 +928,41 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
 	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
+		return ippool_script_format(rctx, lua_update_digest, lua_update_cmd,
+					    "EVALSHA %s 1 %b %u %u %u %b %b",
+					    lua_update_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    (unsigned int)now.tv_sec, rctx->expires,
+					    htonl(ip->addr.v4.s_addr),
+					    owner, owner_len,
+					    gateway_id, gateway_id_len);
 	} else {
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
 		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return ippool_script_format(rctx, lua_update_digest, lua_update_cmd,
+					    "EVALSHA %s 1 %b %u %u %s %b %b",
+					    lua_update_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    (unsigned int)now.tv_sec, rctx->expires,
+					    ip_buff,
+					    owner, owner_len,
+					    gateway_id, gateway_id_len);
 	}
+}
+
+/** Process the result of updating an existing IP address
+ *
+ */
+static ippool_rcode_t redis_ippool_update_result(rlm_redis_ippool_t const *inst, request_t *request,
+						 redisReply *reply, uint32_t expires)
+{
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	tmpl_t		range_rhs;
+	map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
+
+	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
@@ -940,19 +1044,14 @@ finish:
 	return ret;
 }
 
-/** Release an existing IP address in a pool
+/** Format the command to release an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
-					   uint8_t const *key_prefix, size_t key_prefix_len,
-					   fr_ipaddr_t *ip,
-					   uint8_t const *owner, size_t owner_len)
+static int redis_ippool_release(rlm_redis_ippool_t const *inst, redis_ippool_rctx_t *rctx,
+				fr_ipaddr_t *ip,
+				uint8_t const *owner, size_t owner_len)
 {
 	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	now = fr_time_to_timeval(fr_time());
 
@@ -962,35 +1061,33 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, reque
 	if (!owner) owner = (uint8_t const *)"";
 
 	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len);
+		return ippool_script_format(rctx, lua_release_digest, lua_release_cmd,
+					    "EVALSHA %s 1 %b %u %u %b",
+					    lua_release_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    (unsigned int)now.tv_sec,
+					    htonl(ip->addr.v4.s_addr),
+					    owner, owner_len);
 	} else {
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
 		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       ip_buff,
-				       owner, owner_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return ippool_script_format(rctx, lua_release_digest, lua_release_cmd,
+					    "EVALSHA %s 1 %b %u %s %b",
+					    lua_release_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    (unsigned int)now.tv_sec,
+					    ip_buff,
+					    owner, owner_len);
 	}
+}
+
+/** Process the result of releasing an existing IP address
+ *
+ */
+static ippool_rcode_t redis_ippool_release_result(request_t *request, redisReply *reply)
+{
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
@@ -1023,6 +1120,7 @@ finish:
 	return ret;
 }
 
+
 /** Find the pool name we'll be allocating from
  *
  * @param[out] out	Where to write the pool name.
@@ -1062,19 +1160,181 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst, request_t *request, ippool_action_t action)
+
+/** Convert the result of a lease operation to a module rcode
+ *
+ */
+static unlang_action_t ippool_action_result(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst,
+					    request_t *request, redis_ippool_rctx_t *rctx, redisReply *reply)
 {
-	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], owner_buff[256], gateway_id_buff[256];
-	uint8_t const	*key_prefix, *owner = NULL, *gateway_id = NULL;
-	size_t		key_prefix_len, owner_len = 0, gateway_id_len = 0;
-	ssize_t		slen;
-	fr_ipaddr_t	ip;
-	char		expires_buff[20];
-	char const	*expires_str;
-	unsigned long	expires = 0;
-	char		*q;
-
-	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		switch (redis_ippool_allocate_result(inst, request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address lease allocated");
+			RETURN_MODULE_UPDATED;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			RETURN_MODULE_NOTFOUND;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_UPDATE:
+		switch (redis_ippool_update_result(inst, request, reply, rctx->expires)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("Requested IP address' \"%s\" lease updated", rctx->ip_str);
+
+			/*
+			 *	Copy over the input IP address to the reply attribute
+			 */
+			if (inst->copy_on_update) {
+				tmpl_t ip_rhs = {
+					.name = "",
+					.type = TMPL_TYPE_DATA,
+					.quote = T_BARE_WORD,
+				};
+				map_t ip_map = {
+					.lhs = inst->allocated_address_attr,
+					.op = T_OP_SET,
+					.rhs = &ip_rhs
+				};
+
+				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, rctx->ip_str, false);
+
+				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) RETURN_MODULE_FAIL;
+			}
+			RETURN_MODULE_UPDATED;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", rctx->ip_str);
+			RETURN_MODULE_NOTFOUND;
+
+		case IPPOOL_RCODE_EXPIRED:
+			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", rctx->ip_str);
+			RETURN_MODULE_INVALID;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", rctx->ip_str);
+			RETURN_MODULE_INVALID;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_RELEASE:
+		switch (redis_ippool_release_result(request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address \"%s\" released", rctx->ip_str);
+			RETURN_MODULE_UPDATED;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", rctx->ip_str);
+			RETURN_MODULE_NOTFOUND;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", rctx->ip_str);
+			RETURN_MODULE_INVALID;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+
+	default:
+		fr_assert(0);
+		fr_redis_reply_free(&reply);
+		RETURN_MODULE_FAIL;
+	}
+}
+
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
+/** Stop waiting for the commands if the request is cancelled
+ *
+ */
+static void mod_action_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	redis_ippool_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) {
+		fr_redis_command_set_signal_cancel(rctx->cmds);
+		rctx->cmds = NULL;
+	}
+}
+
+/** Process the replies to the script, loading the script if the node didn't have it cached
+ *
+ */
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	redis_ippool_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, redis_ippool_rctx_t);
+	redisReply			*reply;
+
+	if (rctx->failed) {
+		REDEBUG("Failed executing script");
+		RETURN_MODULE_FAIL;
+	}
+
+	switch (ippool_script_result(&reply, request, inst, rctx)) {
+	case REDIS_RCODE_SUCCESS:
+		break;
+
+	/*
+	 *	Last command failed with NOSCRIPT, this means
+	 *	we have to send the Lua script up to the node
+	 *	so it can be cached.
+	 */
+	case REDIS_RCODE_NO_SCRIPT:
+		fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+		rctx->reply_cnt = 0;
+		rctx->loading = true;
+
+		if (ippool_script_enqueue(request, inst, rctx) < 0) RETURN_MODULE_FAIL;
+
+		return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
+
+	default:
+		RETURN_MODULE_FAIL;
+	}
+
+	return ippool_action_result(p_result, inst, request, rctx, reply);
+}
+
+static unlang_action_t mod_action(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  ippool_action_t action)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	redis_ippool_rctx_t		*rctx;
+	uint8_t				key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], owner_buff[256], gateway_id_buff[256];
+	uint8_t const			*key_prefix, *owner = NULL, *gateway_id = NULL;
+	size_t				key_prefix_len, owner_len = 0, gateway_id_len = 0;
+	ssize_t				slen;
+	fr_ipaddr_t			ip;
+	char				expires_buff[20];
+	char const			*expires_str;
+	unsigned long			expires = 0;
+	char				*q;
+	char				ip_buff[INET6_ADDRSTRLEN + 4];
+	char const			*ip_str;
+	int				ret;
+
+	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_buff), inst, request);
 	if (slen < 0) RETURN_MODULE_FAIL;
 	if (slen == 0) RETURN_MODULE_NOOP;
 
@@ -1102,176 +1362,111 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		gateway_id_len = (size_t)slen;
 	}
 
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), redis_ippool_rctx_t));
+	talloc_set_destructor(rctx, _redis_ippool_rctx_free);
+	rctx->t = t;
+	rctx->action = action;
+	MEM(rctx->key_prefix = talloc_memdup(rctx, key_prefix, key_prefix_len));
+	rctx->key_prefix_len = key_prefix_len;
+
 	switch (action) {
 	case POOL_ACTION_ALLOCATE:
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->offer_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
+		error:
+			talloc_free(rctx);
 			RETURN_MODULE_FAIL;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid offer_time.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		rctx->expires = (uint32_t)expires;
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      owner, owner_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease allocated");
-			RETURN_MODULE_UPDATED;
-
-		case IPPOOL_RCODE_POOL_EMPTY:
-			RWDEBUG("Pool contains no free addresses");
-			RETURN_MODULE_NOTFOUND;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
+		ret = redis_ippool_allocate(rctx, owner, owner_len, gateway_id, gateway_id_len);
+		break;
 
 	case POOL_ACTION_UPDATE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->lease_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid expires.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		rctx->expires = (uint32_t)expires;
 
 		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		MEM(rctx->ip_str = talloc_typed_strdup(rctx, ip_str));
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, owner, owner_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) RETURN_MODULE_FAIL;
-			}
-			RETURN_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
-			RETURN_MODULE_INVALID;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
-	}
+		ret = redis_ippool_update(inst, rctx, &ip, owner, owner_len, gateway_id, gateway_id_len);
+		break;
 
 	case POOL_ACTION_RELEASE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
 		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		MEM(rctx->ip_str = talloc_typed_strdup(rctx, ip_str));
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, owner, owner_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, owner, owner_len)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address \"%s\" released", ip_str);
-			RETURN_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
-	}
+		ret = redis_ippool_release(inst, rctx, &ip, owner, owner_len);
+		break;
 
 	case POOL_ACTION_BULK_RELEASE:
 		RDEBUG2("Bulk release not yet implemented");
+		talloc_free(rctx);
 		RETURN_MODULE_NOOP;
 
 	default:
 		fr_assert(0);
-		RETURN_MODULE_FAIL;
+		goto error;
+	}
+
+	if (ret < 0) {
+		REDEBUG("Failed formatting script command");
+		goto error;
 	}
+
+	if (ippool_script_enqueue(request, inst, rctx) < 0) goto error;
+
+	return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
 	 *	IP-Pool.Action override
 	 */
 	vp = fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_action, 0);
-	if (vp) return mod_action(p_result, inst, request, vp->vp_uint32);
+	if (vp) return mod_action(p_result, mctx, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1284,14 +1479,14 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 	if ((vp->vp_uint32 == enum_acct_status_type_start->vb_uint32) ||
 	    (vp->vp_uint32 == enum_acct_status_type_interim_update->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_UPDATE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_UPDATE);
 
 	} else if (vp->vp_uint32 == enum_acct_status_type_stop->vb_uint32) {
-		return mod_action(p_result, inst, request, POOL_ACTION_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_RELEASE);
 
 	} else if ((vp->vp_uint32 == enum_acct_status_type_on->vb_uint32) ||
 		   (vp->vp_uint32 == enum_acct_status_type_off->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_BULK_RELEASE);
 
 	}
 
@@ -1300,7 +1495,6 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1308,12 +1502,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 	ippool_action_t			action = POOL_ACTION_ALLOCATE;
 
@@ -1339,12 +1532,11 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	}
 
 run:
-	return mod_action(p_result, inst, request, action);
+	return mod_action(p_result, mctx, request, action);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1353,12 +1545,11 @@ static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1367,7 +1558,7 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
 }
 
 static int mod_instantiate(module_inst_ctx_t const *mctx)
@@ -1420,6 +1611,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+/** Create the trunks for this thread
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, mctx->el, &inst->trunk_conf,
+						   inst->cluster, &inst->conf, mctx->inst->name);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+
+	TALLOC_FREE(t->cluster);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1429,13 +1644,17 @@ static int mod_load(void)
 
 extern module_t rlm_redis_ippool;
 module_t rlm_redis_ippool = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "redis",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_redis_ippool_t),
-	.config		= module_config,
-	.onload		= mod_load,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "redis",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_redis_ippool_t),
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
+	.config			= module_config,
+	.onload			= mod_load,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
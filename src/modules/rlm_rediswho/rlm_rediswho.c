@@ -35,6 +35,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
 
 typedef struct {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
@@ -49,8 +52,17 @@ typedef struct {
 	char const		*insert;	//!< Command for inserting session data
 	char const		*trim;		//!< Command for trimming the session list.
 	char const		*expire;	//!< Command for expiring entries.
+
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the trunk to each cluster node.
 } rlm_rediswho_t;
 
+/** rlm_rediswho thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Trunks to each of the cluster nodes.
+} rlm_rediswho_thread_t;
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -63,6 +75,8 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("trim_count", FR_TYPE_INT32, rlm_rediswho_t, trim_count), .dflt = "-1" },
 
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_rediswho_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	/*
 	 *	These all smash the same variables, because we don't care about them right now.
 	 *	In 3.1, we should have a way of saying "parse a set of sub-sections according to a template"
@@ -93,19 +107,84 @@ fr_dict_attr_autoload_t rlm_rediswho_dict_attr[] = {
 	{ NULL }
 };
 
-/*
- *	Query the database executing a command with no result rows
+/** Which command in the sequence was sent last
+ *
+ */
+typedef enum {
+	REDISWHO_INIT = 0,				//!< Nothing sent yet.
+	REDISWHO_INSERT,				//!< Waiting for the insert command.
+	REDISWHO_TRIM,					//!< Waiting for the trim command.
+	REDISWHO_EXPIRE					//!< Waiting for the expire command.
+} rediswho_stage_t;
+
+/** Resume context for an accounting request
+ *
+ */
+typedef struct {
+	rlm_rediswho_thread_t	*t;		//!< Thread instance.
+	rediswho_stage_t	stage;		//!< Which command we're waiting for.
+
+	char const		*insert;	//!< Command for inserting session data.
+	char const		*trim;		//!< Command for trimming the session list.
+	char const		*expire;	//!< Command for expiring entries.
+
+	fr_redis_command_set_t	*cmds;		//!< Commands currently being executed.
+	bool			failed;		//!< The commands couldn't be executed.
+	redisReply		*reply;		//!< Reply to the last command.
+} rediswho_rctx_t;
+
+/** Free any reply we're still holding
+ *
+ */
+static int _rediswho_rctx_free(rediswho_rctx_t *rctx)
+{
+	fr_redis_reply_free(&rctx->reply);
+
+	return 0;
+}
+
+/** Grab the reply before the command set is freed
+ *
  */
-static int rediswho_command(rlm_rediswho_t const *inst, request_t *request, char const *fmt)
+static void rediswho_command_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
 {
-	fr_redis_conn_t		*conn;
+	rediswho_rctx_t		*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
+	fr_redis_command_t	*cmd;
+
+	rctx->cmds = NULL;	/* Freed when we return */
+
+	cmd = fr_dlist_head(completed);
+	if (cmd) rctx->reply = fr_redis_command_steal_result(cmd);
 
-	int 			ret = -1;
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the command couldn't be executed
+ *
+ */
+static void rediswho_command_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_rctx_t		*rctx = talloc_get_type_abort(uctx, rediswho_rctx_t);
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
-	redisReply		*reply = NULL;
-	int			s_ret;
+	rctx->cmds = NULL;	/* Freed when we return */
+	rctx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Expand a command and send it to the cluster node responsible for its key
+ *
+ * @param[in] request	The current request.
+ * @param[in] rctx	to record the command set in.
+ * @param[in] fmt	Command to expand.
+ * @return
+ *	- 1 if the command was enqueued.
+ *	- 0 if there was no command to send.
+ *	- -1 on failure.
+ */
+static int rediswho_command_enqueue(request_t *request, rediswho_rctx_t *rctx, char const *fmt)
+{
+	fr_redis_command_set_t	*cmds;
 
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
@@ -134,19 +213,40 @@ static int rediswho_command(rlm_rediswho_t const *inst, request_t *request, char
 	 	key_len = strlen((char const *)key);
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
+	cmds = fr_redis_command_set_alloc(NULL, request, rediswho_command_complete, rediswho_command_fail, rctx);
+	if (fr_redis_command_argv_add(cmds, argc, argv, NULL) != FR_REDIS_PIPELINE_OK) {
+	error:
+		talloc_free(cmds);
+		return -1;
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+
+	if (fr_redis_cluster_command_set_enqueue(rctx->t->cluster, cmds, key, key_len, false) != FR_REDIS_PIPELINE_OK) {
+		RERROR("Failed inserting accounting data");
+		goto error;
+	}
+
+	rctx->cmds = cmds;
+
+	return 1;
+}
+
+/** Check the reply to the last command
+ *
+ * @param[in] request	The current request.
+ * @param[in] rctx	holding the reply.
+ * @return
+ *	- >0 the integer the command returned.
+ *	- -1 if the command failed, or didn't return a positive integer.
+ */
+static int rediswho_command_result(request_t *request, rediswho_rctx_t *rctx)
+{
+	redisReply	*reply = rctx->reply;
+	int		ret = -1;
+
+	if (rctx->failed || !reply) {
 		RERROR("Failed inserting accounting data");
-	error:
-		fr_redis_reply_free(&reply);
 		return -1;
 	}
-	if (!fr_cond_assert(reply)) goto error;
 
 	/*
 	 *	Write the response to the debug log
@@ -170,39 +270,96 @@ static int rediswho_command(rlm_rediswho_t const *inst, request_t *request, char
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
 		break;
 	}
-	fr_redis_reply_free(&reply);
+	fr_redis_reply_free(&rctx->reply);
 
 	return ret;
 }
 
-static unlang_action_t mod_accounting_all(rlm_rcode_t *p_result, rlm_rediswho_t const *inst, request_t *request,
-					  char const *insert,
-					  char const *trim,
-					  char const *expire)
+static unlang_action_t mod_accounting_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
+/** Stop waiting for the command if the request is cancelled
+ *
+ */
+static void mod_accounting_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
 {
-	int ret;
+	rediswho_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, rediswho_rctx_t);
 
-	ret = rediswho_command(inst, request, insert);
-	if (ret < 0) RETURN_MODULE_FAIL;
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) {
+		fr_redis_command_set_signal_cancel(rctx->cmds);
+		rctx->cmds = NULL;
+	}
+}
 
-	/* Only trim if necessary */
-	if ((inst->trim_count >= 0) && (ret > inst->trim_count)) {
-		if (rediswho_command(inst, request, trim) < 0) RETURN_MODULE_FAIL;
+/** Send the next command in the sequence, skipping any which aren't needed
+ *
+ * @param[out] p_result	Result of the accounting call.
+ * @param[in] inst	of rlm_rediswho.
+ * @param[in] request	The current request.
+ * @param[in] rctx	tracking which command was sent last.
+ * @param[in] ret	Result of the last command.
+ */
+static unlang_action_t rediswho_command_next(rlm_rcode_t *p_result, rlm_rediswho_t const *inst,
+					     request_t *request, rediswho_rctx_t *rctx, int ret)
+{
+	char const *fmt;
+
+	for (;;) {
+		switch (rctx->stage) {
+		case REDISWHO_INIT:
+			rctx->stage = REDISWHO_INSERT;
+			fmt = rctx->insert;
+			break;
+
+		case REDISWHO_INSERT:
+			rctx->stage = REDISWHO_TRIM;
+
+			/* Only trim if necessary */
+			if ((inst->trim_count < 0) || (ret <= inst->trim_count)) continue;
+			fmt = rctx->trim;
+			break;
+
+		case REDISWHO_TRIM:
+			rctx->stage = REDISWHO_EXPIRE;
+			fmt = rctx->expire;
+			break;
+
+		case REDISWHO_EXPIRE:
+		default:
+			RETURN_MODULE_OK;
+		}
+
+		ret = rediswho_command_enqueue(request, rctx, fmt);
+		if (ret < 0) RETURN_MODULE_FAIL;
+		if (ret > 0) return unlang_module_yield(request, mod_accounting_resume, mod_accounting_signal, rctx);
 	}
+}
 
-	if (rediswho_command(inst, request, expire) < 0) RETURN_MODULE_FAIL;
-	RETURN_MODULE_OK;
+/** Process the reply to the last command, and send the next one
+ *
+ */
+static unlang_action_t mod_accounting_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_rediswho_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_rediswho_t);
+	rediswho_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, rediswho_rctx_t);
+	int			ret;
+
+	ret = rediswho_command_result(request, rctx);
+	if (ret < 0) RETURN_MODULE_FAIL;
+
+	return rediswho_command_next(p_result, inst, request, rctx, ret);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_rediswho_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
 	CONF_SECTION		*conf = mctx->inst->conf;
-	rlm_rcode_t		rcode;
 	fr_pair_t		*vp;
 	fr_dict_enum_value_t	*dv;
 	CONF_SECTION		*cs;
-	char const		*insert, *trim, *expire;
+	rediswho_rctx_t		*rctx;
 
 	vp = fr_pair_find_by_da_idx(&request->request_pairs, attr_acct_status_type, 0);
 	if (!vp) {
@@ -222,11 +379,14 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 		RETURN_MODULE_NOOP;
 	}
 
-	insert = cf_pair_value(cf_pair_find(cs, "insert"));
-	trim = cf_pair_value(cf_pair_find(cs, "trim"));
-	expire = cf_pair_value(cf_pair_find(cs, "expire"));
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), rediswho_rctx_t));
+	talloc_set_destructor(rctx, _rediswho_rctx_free);
+	rctx->t = t;
+	rctx->insert = cf_pair_value(cf_pair_find(cs, "insert"));
+	rctx->trim = cf_pair_value(cf_pair_find(cs, "trim"));
+	rctx->expire = cf_pair_value(cf_pair_find(cs, "expire"));
 
-	return mod_accounting_all(&rcode, inst, request, insert, trim, expire);
+	return rediswho_command_next(p_result, inst, request, rctx, 0);
 }
 
 static int mod_instantiate(module_inst_ctx_t const *mctx)
@@ -240,6 +400,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+/** Create the trunks for this thread
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_rediswho_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, mctx->el, &inst->trunk_conf,
+						   inst->cluster, &inst->conf, mctx->inst->name);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
+
+	TALLOC_FREE(t->cluster);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -249,13 +433,17 @@ static int mod_load(void)
 
 extern module_t rlm_rediswho;
 module_t rlm_rediswho = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "rediswho",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_rediswho_t),
-	.config		= module_config,
-	.onload		= mod_load,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "rediswho",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_rediswho_t),
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.thread_inst_type	= "rlm_rediswho_thread_t",
+	.config			= module_config,
+	.onload			= mod_load,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
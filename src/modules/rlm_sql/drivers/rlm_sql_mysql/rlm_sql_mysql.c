@@ -69,6 +69,13 @@ DIAG_ON(strict-prototypes)
 #define HAVE_TLS_VERIFY_OPTIONS 0
 #endif
 
+/*
+ *	Only MariaDB's client library has a non-blocking API.
+ */
+#if defined(MARIADB_BASE_VERSION) && defined(MYSQL_WAIT_READ)
+#define HAVE_MYSQL_NONBLOCK	1
+#endif
+
 #include "rlm_sql.h"
 
 typedef enum {
@@ -88,6 +95,11 @@ typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+#ifdef HAVE_MYSQL_NONBLOCK
+	int		async_status;		//!< Events the non-blocking API is waiting for.
+	int		async_err;		//!< Result of the non-blocking query.
+	bool		async_store;		//!< Reading the query's rows, rather than running it.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -163,11 +175,19 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
+#ifdef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	Abandoned part way through connecting
+	 */
+	else if (conn->async_status) {
+		mysql_close(&conn->db);
+	}
+#endif
 
 	return 0;
 }
 
-static int mod_instantiate(UNUSED rlm_sql_config_t const *config, void *instance, UNUSED CONF_SECTION *cs)
+static int mod_instantiate(rlm_sql_config_t const *config, void *instance, UNUSED CONF_SECTION *cs)
 {
 	rlm_sql_mysql_t		*inst = talloc_get_type_abort(instance, rlm_sql_mysql_t);
 	int			warnings;
@@ -179,6 +199,17 @@ static int mod_instantiate(UNUSED rlm_sql_config_t const *config, void *instance
 	}
 	inst->warnings = (rlm_sql_mysql_warnings)warnings;
 
+#ifndef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	Oracle's client library has no non-blocking API.
+	 */
+	if (config->async) {
+		ERROR("async = yes requires rlm_sql_mysql to be built against MariaDB's client library, "
+		      "not %s", mysql_get_client_info());
+		return -1;
+	}
+#endif
+
 #if HAVE_TLS_VERIFY_OPTIONS
 	if (inst->tls_check_cert && !inst->tls_required) {
 		WARN("Implicitly setting tls_required = yes, as tls_check_cert = yes");
@@ -217,7 +248,12 @@ static int mod_load(void)
 	return 0;
 }
 
-static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config, fr_time_delta_t timeout)
+/** Allocate a connection, and set its options
+ *
+ * @return the client flags to connect with.
+ */
+static unsigned long sql_connect_init(rlm_sql_mysql_conn_t **out, rlm_sql_handle_t *handle,
+				      rlm_sql_config_t const *config, fr_time_delta_t timeout)
 {
 	rlm_sql_mysql_conn_t *conn;
 	rlm_sql_mysql_t *inst = config->driver;
@@ -273,6 +309,14 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t co
 
 	mysql_options(&(conn->db), MYSQL_READ_DEFAULT_GROUP, "freeradius");
 
+#ifdef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	The blocking API still works on non-blocking
+	 *	connections, so this only affects async queries.
+	 */
+	if (config->async) mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 	/*
 	 *	We need to know about connection errors, and are capable
 	 *	of reconnecting automatically.
@@ -323,14 +367,17 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t co
 #ifdef CLIENT_MULTI_STATEMENTS
 	sql_flags |= CLIENT_MULTI_STATEMENTS;
 #endif
-	conn->sock = mysql_real_connect(&(conn->db),
-					config->sql_server,
-					config->sql_login,
-					config->sql_password,
-					config->sql_db,
-					config->sql_port,
-					NULL,
-					sql_flags);
+
+	*out = conn;
+
+	return sql_flags;
+}
+
+/** Log the result of connecting
+ *
+ */
+static sql_rcode_t sql_connect_result(rlm_sql_mysql_conn_t *conn, rlm_sql_config_t const *config)
+{
 	if (!conn->sock) {
 		ERROR("Couldn't connect to MySQL server %s@%s:%s", config->sql_login,
 		      config->sql_server, config->sql_db);
@@ -347,6 +394,25 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t co
 	return RLM_SQL_OK;
 }
 
+static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config, fr_time_delta_t timeout)
+{
+	rlm_sql_mysql_conn_t	*conn;
+	unsigned long		sql_flags;
+
+	sql_flags = sql_connect_init(&conn, handle, config, timeout);
+
+	conn->sock = mysql_real_connect(&(conn->db),
+					config->sql_server,
+					config->sql_login,
+					config->sql_password,
+					config->sql_db,
+					config->sql_port,
+					NULL,
+					sql_flags);
+
+	return sql_connect_result(conn, config);
+}
+
 /** Analyse the last error that occurred on the socket, and determine an action
  *
  * @param server Socket from which to extract the server error. May be NULL.
@@ -441,6 +507,138 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t c
 	return RLM_SQL_OK;
 }
 
+#ifdef HAVE_MYSQL_NONBLOCK
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	/*
+	 *	conn->sock is only set once we're connected.
+	 */
+	return mysql_get_socket(&conn->db);
+}
+
+/** Convert the events MariaDB is waiting for
+ *
+ * @return true if MariaDB is waiting, false if the operation is complete.
+ */
+static bool sql_wait_for(int *wait_for, int async_status)
+{
+	*wait_for = 0;
+
+	if (!async_status) return false;
+
+	if (async_status & (MYSQL_WAIT_READ | MYSQL_WAIT_EXCEPT)) *wait_for |= RLM_SQL_WAIT_READ;
+	if (async_status & MYSQL_WAIT_WRITE) *wait_for |= RLM_SQL_WAIT_WRITE;
+
+	/*
+	 *	Only waiting for the library's own timeout.
+	 *	connect_timeout and query_timeout are enforced
+	 *	by rlm_sql.
+	 */
+	if (!*wait_for) *wait_for = RLM_SQL_WAIT_READ;
+
+	return true;
+}
+
+static sql_rcode_t sql_connect_start(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+				     fr_time_delta_t timeout)
+{
+	rlm_sql_mysql_conn_t	*conn;
+	unsigned long		sql_flags;
+
+	sql_flags = sql_connect_init(&conn, handle, config, timeout);
+
+	conn->async_status = mysql_real_connect_start(&conn->sock, &(conn->db),
+						      config->sql_server,
+						      config->sql_login,
+						      config->sql_password,
+						      config->sql_db,
+						      config->sql_port,
+						      NULL,
+						      sql_flags);
+	if (sql_wait_for(wait_for, conn->async_status)) return RLM_SQL_OK;
+
+	return sql_connect_result(conn, config);
+}
+
+static sql_rcode_t sql_connect_continue(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	conn->async_status = mysql_real_connect_cont(&conn->sock, &(conn->db), conn->async_status);
+	if (sql_wait_for(wait_for, conn->async_status)) return RLM_SQL_OK;
+
+	return sql_connect_result(conn, config);
+}
+
+/** Check the result of a query, once MariaDB has stopped waiting
+ *
+ * Queries which return rows have their results read without blocking
+ * too, so they're available to sql_fetch_row.
+ */
+static sql_rcode_t sql_query_status(int *wait_for, rlm_sql_mysql_conn_t *conn)
+{
+	sql_rcode_t rcode;
+	char const *info;
+
+	if (sql_wait_for(wait_for, conn->async_status)) return RLM_SQL_OK;
+
+	if (conn->async_store) {
+		conn->async_store = false;
+		if (!conn->result) return sql_check_error(conn->sock, 0);
+
+		return RLM_SQL_OK;
+	}
+
+	rcode = sql_check_error(conn->sock, 0);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	if (mysql_field_count(conn->sock) > 0) {
+		conn->async_store = true;
+		conn->async_status = mysql_store_result_start(&conn->result, conn->sock);
+
+		return sql_query_status(wait_for, conn);
+	}
+
+	/* Only returns non-null string for INSERTS */
+	info = mysql_info(conn->sock);
+	if (info) DEBUG2("%s", info);
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_start(int *wait_for, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config,
+				   char const *query)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	*wait_for = 0;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->async_status = mysql_real_query_start(&conn->async_err, conn->sock, query, strlen(query));
+
+	return sql_query_status(wait_for, conn);
+}
+
+static sql_rcode_t sql_query_continue(int *wait_for, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (conn->async_store) {
+		conn->async_status = mysql_store_result_cont(&conn->result, conn->sock, conn->async_status);
+	} else {
+		conn->async_status = mysql_real_query_cont(&conn->async_err, conn->sock, conn->async_status);
+	}
+
+	return sql_query_status(wait_for, conn);
+}
+#endif
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -864,5 +1062,12 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+#ifdef HAVE_MYSQL_NONBLOCK
+	.sql_fd				= sql_fd,
+	.sql_connect_start		= sql_connect_start,
+	.sql_connect_continue		= sql_connect_continue,
+	.sql_query_start		= sql_query_start,
+	.sql_query_continue		= sql_query_continue
+#endif
 };
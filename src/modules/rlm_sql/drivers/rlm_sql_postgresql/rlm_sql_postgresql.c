@@ -261,6 +261,140 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
+/** Convert what libpq is waiting for whilst connecting
+ *
+ */
+static sql_rcode_t sql_connect_status(int *wait_for, rlm_sql_postgres_conn_t *conn, PostgresPollingStatusType status)
+{
+	*wait_for = 0;
+
+	switch (status) {
+	case PGRES_POLLING_READING:
+		*wait_for = RLM_SQL_WAIT_READ;
+		return RLM_SQL_OK;
+
+	case PGRES_POLLING_WRITING:
+		*wait_for = RLM_SQL_WAIT_WRITE;
+		return RLM_SQL_OK;
+
+	case PGRES_POLLING_OK:
+		DEBUG2("Connected to database '%s' on '%s' server version %i, protocol version %i, backend PID %i ",
+		       PQdb(conn->db), PQhost(conn->db), PQserverVersion(conn->db), PQprotocolVersion(conn->db),
+		       PQbackendPID(conn->db));
+		return RLM_SQL_OK;
+
+	default:
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_ERROR;
+	}
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_connect_continue(int *wait_for, rlm_sql_handle_t *handle,
+							 UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	return sql_connect_status(wait_for, conn, PQconnectPoll(conn->db));
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_connect_start(int *wait_for, rlm_sql_handle_t *handle,
+						      rlm_sql_config_t const *config, UNUSED fr_time_delta_t timeout)
+{
+	rlm_sql_postgresql_t	*inst = config->driver;
+	rlm_sql_postgres_conn_t	*conn;
+
+	*wait_for = 0;
+
+	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
+	talloc_set_destructor(conn, _sql_socket_destructor);
+
+	DEBUG2("Connecting using parameters: %s", inst->db_string);
+	conn->db = PQconnectStart(inst->db_string);
+	if (!conn->db) {
+		ERROR("Connection failed: Out of memory");
+		return RLM_SQL_ERROR;
+	}
+	if (PQstatus(conn->db) == CONNECTION_BAD) {
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_ERROR;
+	}
+
+	/*
+	 *	libpq expects PQconnectPoll to be called once the
+	 *	socket is writable, the first time.
+	 */
+	return sql_connect_status(wait_for, conn, PGRES_POLLING_WRITING);
+}
+
+/** Classify the result of a query, once all results have been read
+ *
+ */
+static sql_rcode_t sql_query_result(rlm_sql_postgres_conn_t *conn, rlm_sql_postgresql_t *inst)
+{
+	int			numfields = 0;
+	ExecStatusType		status;
+
+	/*
+	 *  As this error COULD be a connection error OR an out-of-memory
+	 *  condition return value WILL be wrong SOME of the time
+	 *  regardless! Pick your poison...
+	 */
+	if (!conn->result) {
+		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	status = PQresultStatus(conn->result);
+	switch (status){
+	/*
+	 *  Successful completion of a command returning no data.
+	 */
+	case PGRES_COMMAND_OK:
+		/*
+		 *  Affected_rows function only returns the number of affected rows of a command
+		 *  returning no data...
+		 */
+		conn->affected_rows = affected_rows(conn->result);
+		DEBUG2("query affected rows = %i", conn->affected_rows);
+		break;
+	/*
+	 *  Successful completion of a command returning data (such as a SELECT or SHOW).
+	 */
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+	case PGRES_SINGLE_TUPLE:
+#endif
+	case PGRES_TUPLES_OK:
+		conn->cur_row = 0;
+		conn->affected_rows = PQntuples(conn->result);
+		numfields = PQnfields(conn->result); /*Check row storing functions..*/
+		DEBUG2("query returned rows = %i, fields = %i", conn->affected_rows, numfields);
+		break;
+
+#ifdef HAVE_PGRES_COPY_BOTH
+	case PGRES_COPY_BOTH:
+#endif
+	case PGRES_COPY_OUT:
+	case PGRES_COPY_IN:
+		DEBUG2("Data transfer started");
+		break;
+
+	/*
+	 *  Weird.. this shouldn't happen.
+	 */
+	case PGRES_EMPTY_QUERY:
+	case PGRES_BAD_RESPONSE:	/* The server's response was not understood */
+	case PGRES_NONFATAL_ERROR:
+	case PGRES_FATAL_ERROR:
+#ifdef HAVE_PGRES_PIPELINE_SYNC
+	case PGRES_PIPELINE_SYNC:
+	case PGRES_PIPELINE_ABORTED:
+#endif
+		break;
+	}
+
+	return sql_classify_error(inst, status, conn->result);
+}
+
 static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
 					      char const *query)
 {
@@ -270,8 +404,6 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	fr_time_t		start;
 	int			sockfd;
 	PGresult		*tmp_result;
-	int			numfields = 0;
-	ExecStatusType		status;
 
 	if (!conn->db) {
 		ERROR("Socket not connected");
@@ -339,65 +471,93 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	while ((tmp_result = PQgetResult(conn->db)) != NULL)
 		PQclear(tmp_result);
 
-	/*
-	 *  As this error COULD be a connection error OR an out-of-memory
-	 *  condition return value WILL be wrong SOME of the time
-	 *  regardless! Pick your poison...
-	 */
-	if (!conn->result) {
-		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+	return sql_query_result(conn, inst);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
+/** Send any remaining query data, and read any results that are available
+ *
+ * Stops once the last result has been read, or when libpq needs to
+ * wait for the socket.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_continue(int *wait_for, rlm_sql_handle_t *handle,
+						       rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgresql_t	*inst = config->driver;
+	PGresult		*tmp_result;
+
+	*wait_for = 0;
+
+	switch (PQflush(conn->db)) {
+	case 0:
+		break;
+
+	case 1:
+		*wait_for = RLM_SQL_WAIT_READ | RLM_SQL_WAIT_WRITE;
+		return RLM_SQL_OK;
+
+	default:
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
 		return RLM_SQL_RECONNECT;
 	}
 
-	status = PQresultStatus(conn->result);
-	switch (status){
-	/*
-	 *  Successful completion of a command returning no data.
-	 */
-	case PGRES_COMMAND_OK:
-		/*
-		 *  Affected_rows function only returns the number of affected rows of a command
-		 *  returning no data...
-		 */
-		conn->affected_rows = affected_rows(conn->result);
-		DEBUG2("query affected rows = %i", conn->affected_rows);
-		break;
-	/*
-	 *  Successful completion of a command returning data (such as a SELECT or SHOW).
-	 */
-#ifdef HAVE_PGRES_SINGLE_TUPLE
-	case PGRES_SINGLE_TUPLE:
-#endif
-	case PGRES_TUPLES_OK:
-		conn->cur_row = 0;
-		conn->affected_rows = PQntuples(conn->result);
-		numfields = PQnfields(conn->result); /*Check row storing functions..*/
-		DEBUG2("query returned rows = %i, fields = %i", conn->affected_rows, numfields);
-		break;
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
 
-#ifdef HAVE_PGRES_COPY_BOTH
-	case PGRES_COPY_BOTH:
-#endif
-	case PGRES_COPY_OUT:
-	case PGRES_COPY_IN:
-		DEBUG2("Data transfer started");
-		break;
+	while (!PQisBusy(conn->db)) {
+		tmp_result = PQgetResult(conn->db);
+		if (!tmp_result) return sql_query_result(conn, inst);
+
+		/* Discard results for appended queries */
+		if (conn->result) {
+			PQclear(tmp_result);
+			continue;
+		}
+		conn->result = tmp_result;
+	}
+
+	*wait_for = RLM_SQL_WAIT_READ;
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_start(int *wait_for, rlm_sql_handle_t *handle,
+						    rlm_sql_config_t const *config, char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	*wait_for = 0;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
 
 	/*
-	 *  Weird.. this shouldn't happen.
+	 *  Stop PQsendQuery blocking if the query is larger
+	 *  than the socket buffer.
 	 */
-	case PGRES_EMPTY_QUERY:
-	case PGRES_BAD_RESPONSE:	/* The server's response was not understood */
-	case PGRES_NONFATAL_ERROR:
-	case PGRES_FATAL_ERROR:
-#ifdef HAVE_PGRES_PIPELINE_SYNC
-	case PGRES_PIPELINE_SYNC:
-	case PGRES_PIPELINE_ABORTED:
-#endif
-		break;
+	if (!PQisnonblocking(conn->db) && (PQsetnonblocking(conn->db, 1) < 0)) {
+		ERROR("Failed setting connection to non-blocking: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
 	}
 
-	return sql_classify_error(inst, status, conn->result);;
+	return sql_query_continue(wait_for, handle, config);
 }
 
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t const *config, char const *query)
@@ -684,5 +844,10 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_fd				= sql_fd,
+	.sql_connect_start		= sql_connect_start,
+	.sql_connect_continue		= sql_connect_continue,
+	.sql_query_start		= sql_query_start,
+	.sql_query_continue		= sql_query_continue
 };
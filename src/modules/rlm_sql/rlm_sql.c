@@ -109,6 +109,12 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_TIME_DELTA, rlm_sql_config_t, query_timeout) },
 
+	/*
+	 *	As does this.
+	 */
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, rlm_sql_config_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_sql_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
@@ -1025,6 +1031,37 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	return 0;
 }
 
+/** Create a trunk for asynchronous queries
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+
+	if (!inst->config.async) return 0;
+
+	t->trunk = sql_trunk_alloc(t, mctx->el, inst);
+	if (!t->trunk) {
+		ERROR("Failed creating connection trunk");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+
+	TALLOC_FREE(t->trunk);
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_sql_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sql_t);
@@ -1206,6 +1243,9 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->sql_query			= rlm_sql_query;
 	inst->sql_select_query		= rlm_sql_select_query;
 	inst->sql_fetch_row		= rlm_sql_fetch_row;
+	inst->query_reserve		= rlm_sql_query_reserve;
+	inst->query_run			= rlm_sql_query_run;
+	inst->query_release		= rlm_sql_query_release;
 
 	/*
 	 *	Either use the module specific escape function
@@ -1215,6 +1255,22 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 				inst->driver->sql_escape_func :
 				sql_escape_func;
 
+	/*
+	 *	Each asynchronous query has a connection to itself,
+	 *	which the request drives, so the trunk never needs
+	 *	to write to the connection.
+	 */
+	if (inst->config.async) {
+		if (!inst->driver->sql_query_start || !inst->driver->sql_connect_start) {
+			cf_log_err(conf, "Driver %s does not support asynchronous queries", inst->config.sql_driver_name);
+			return -1;
+		}
+
+		inst->trunk_conf.always_writable = true;
+		inst->trunk_conf.max_req_per_conn = 1;
+		inst->trunk_conf.target_req_per_conn = 1;
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, fr_time_delta_from_sec(30), true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -1477,41 +1533,32 @@ release:
 	RETURN_MODULE_RCODE(rcode);
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
+/** Find the first of a set of redundant queries
  *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
- *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+ * Uses the same principle as rlm_linelog, expanding the 'reference' config
+ * item using xlat to figure out what query it should execute.
  *
+ * @param[out] out	The first matching config pair.
+ * @param[in] request	The current request.
+ * @param[in] section	to search for queries in.
+ * @return
+ *	- RLM_MODULE_OK if a query was found.
+ *	- RLM_MODULE_NOOP if there's no such query.
+ *	- RLM_MODULE_FAIL if the reference couldn't be expanded.
  */
-static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section)
+static rlm_rcode_t acct_reference_find(CONF_PAIR **out, request_t *request, sql_acct_section_t const *section)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
 	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
 
 	fr_assert(section);
 
 	if (section->reference[0] != '.') *p++ = '.';
 
 	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
@@ -1521,28 +1568,48 @@ static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *in
 	item = cf_reference_item(NULL, section->cs, path);
 	if (!item) {
 		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 	if (cf_item_is_section(item)){
 		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
+	*out = cf_item_to_pair(item);
 
-	RDEBUG2("Using query template '%s'", attr);
+	RDEBUG2("Using query template '%s'", cf_pair_attr(*out));
 
-	handle = fr_pool_connection_get(inst->pool, request);
-	if (!handle) {
-		rcode = RLM_MODULE_FAIL;
+	return RLM_MODULE_OK;
+}
 
-		goto finish;
-	}
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t const *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+	int			sql_ret;
+	int			numaffected = 0;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+
+	char			*expanded = NULL;
+
+	rcode = acct_reference_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+
+	attr = cf_pair_attr(pair);
+
+	handle = fr_pool_connection_get(inst->pool, request);
+	if (!handle) RETURN_MODULE_FAIL;
 
 	sql_set_user(inst, request, NULL);
 
@@ -1645,6 +1712,190 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** State for running redundant queries asynchronously
+ *
+ */
+typedef struct {
+	rlm_sql_query_t			query;		//!< The query currently being run.
+	sql_acct_section_t const	*section;	//!< Section the queries are in.
+	CONF_PAIR			*pair;		//!< Query currently being run.
+	char const			*attr;		//!< Name of the set of redundant queries.
+} sql_acct_rctx_t;
+
+static unlang_action_t acct_redundant_async_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						   request_t *request);
+
+/** Give the connection back if the request is cancelled
+ *
+ */
+static void acct_redundant_async_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	sql_acct_rctx_t *rctx = talloc_get_type_abort(mctx->rctx, sql_acct_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	sql_trunk_query_release(&rctx->query);
+}
+
+/** Wait for the query to finish, or for a connection to become available
+ *
+ */
+static inline unlang_action_t acct_redundant_async_yield(request_t *request, sql_acct_rctx_t *rctx)
+{
+	return unlang_module_yield(request, acct_redundant_async_resume, acct_redundant_async_signal, rctx);
+}
+
+/** Run queries on the connection assigned to us, and process their results
+ *
+ * Does the same as #acct_redundant, but yields instead of blocking
+ * when waiting for the database.
+ */
+static unlang_action_t acct_redundant_async_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						   request_t *request)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	sql_acct_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, sql_acct_rctx_t);
+	rlm_sql_query_t		*query = &rctx->query;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			sql_ret;
+	int			numaffected;
+	char const		*value;
+	char			*expanded = NULL;
+
+	if (!query->handle || query->failed) {
+		REDEBUG("No connection available");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	A query is in progress.
+	 */
+	if (query->wait_for || query->timed_out) {
+		sql_ret = sql_trunk_query_continue(query);
+		goto result;
+	}
+
+	while (true) {
+		value = cf_pair_value(rctx->pair);
+		if (!value) {
+			RDEBUG2("Ignoring null query");
+			rcode = RLM_MODULE_NOOP;
+
+			goto finish;
+		}
+
+		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, query->handle) < 0) {
+			rcode = RLM_MODULE_FAIL;
+
+			goto finish;
+		}
+
+		if (!*expanded) {
+			RDEBUG2("Ignoring null query");
+			rcode = RLM_MODULE_NOOP;
+
+			goto finish;
+		}
+
+		rlm_sql_query_log(inst, request, rctx->section, expanded);
+
+		sql_ret = sql_trunk_query_start(query, expanded);
+		TALLOC_FREE(expanded);
+
+	result:
+		if (query->wait_for) {
+			if (sql_trunk_query_wait(query) < 0) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+
+			return acct_redundant_async_yield(request, rctx);
+		}
+
+		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
+
+		switch (sql_ret) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_ERROR:
+		case RLM_SQL_RECONNECT:
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+
+		case RLM_SQL_QUERY_INVALID:
+			rcode = RLM_MODULE_INVALID;
+			goto finish;
+
+		case RLM_SQL_ALT_QUERY:
+			goto next;
+		}
+
+		numaffected = (inst->driver->sql_affected_rows)(query->handle, &inst->config);
+		(inst->driver->sql_finish_query)(query->handle, &inst->config);
+		RDEBUG2("%i record(s) updated", numaffected);
+
+		if (numaffected > 0) break;	/* A query succeeded, were done! */
+	next:
+		rctx->pair = cf_pair_find_next(rctx->section->cs, rctx->pair, rctx->attr);
+		if (!rctx->pair) {
+			RDEBUG2("No additional queries configured");
+			rcode = RLM_MODULE_NOOP;
+
+			goto finish;
+		}
+
+		RDEBUG2("Trying next query...");
+	}
+
+finish:
+	talloc_free(expanded);
+	sql_trunk_query_release(query);
+	sql_unset_user(inst, request);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Run a set of redundant queries on the thread's trunk
+ *
+ */
+static unlang_action_t acct_redundant_async(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					    sql_acct_section_t const *section)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+	sql_acct_rctx_t		*rctx;
+	CONF_PAIR		*pair;
+	rlm_rcode_t		rcode;
+
+	rcode = acct_reference_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+
+	MEM(rctx = talloc(unlang_interpret_frame_talloc_ctx(request), sql_acct_rctx_t));
+	*rctx = (sql_acct_rctx_t) {
+		.query = {
+			.inst = inst
+		},
+		.section = section,
+		.pair = pair,
+		.attr = cf_pair_attr(pair)
+	};
+
+	if (sql_trunk_query_enqueue(&rctx->query, t->trunk, request) < 0) RETURN_MODULE_FAIL;
+
+	sql_set_user(inst, request, NULL);
+
+	/*
+	 *	A connection was available immediately.
+	 */
+	if (rctx->query.handle) return acct_redundant_async_resume(p_result, MODULE_CTX(mctx->inst, mctx->thread, rctx),
+								   request);
+
+	return acct_redundant_async_yield(request, rctx);
+}
+
 /*
  *	Accounting: Insert or update session data in our sql table
  */
@@ -1653,6 +1904,8 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
 
 	if (inst->config.accounting.reference_cp) {
+		if (inst->config.async) return acct_redundant_async(p_result, mctx, request, &inst->config.accounting);
+
 		return acct_redundant(p_result, inst, request, &inst->config.accounting);
 	}
 
@@ -1667,6 +1920,8 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sql_t);
 
 	if (inst->config.postauth.reference_cp) {
+		if (inst->config.async) return acct_redundant_async(p_result, mctx, request, &inst->config.postauth);
+
 		return acct_redundant(p_result, inst, request, &inst->config.postauth);
 	}
 
@@ -1688,6 +1943,10 @@ module_t rlm_sql = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
+	.thread_inst_type	= "rlm_sql_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting,
@@ -29,6 +29,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/exfile.h>
 
@@ -122,6 +123,10 @@ typedef struct {
 	char const		*allowed_chars;			//!< Chars which done need escaping..
 	fr_time_delta_t		query_timeout;			//!< How long to allow queries to run for.
 
+	bool			async;				//!< Run accounting and post-auth queries on
+								//!< per-thread connection trunks, without
+								//!< blocking the worker.
+
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
@@ -155,6 +160,12 @@ extern size_t sql_rcode_description_table_len;
 extern fr_table_num_sorted_t const sql_rcode_table[];
 extern size_t sql_rcode_table_len;
 
+/*
+ *	Events a driver is waiting for before an asynchronous query can progress
+ */
+#define RLM_SQL_WAIT_READ	0x01				//!< Wait for the socket to become readable.
+#define RLM_SQL_WAIT_WRITE	0x02				//!< Wait for the socket to become writable.
+
 /*
  *	Capabilities flags for drivers
  */
@@ -211,11 +222,35 @@ typedef struct {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
 
 	xlat_escape_legacy_t	sql_escape_func;
+
+	/*
+	 *	Optional.  For drivers which can connect and run queries without blocking.
+	 *
+	 *	sql_connect_start, sql_query_start and the matching continue functions
+	 *	write the events they're waiting for to wait_for.  When wait_for is 0
+	 *	the operation is complete, and the return code is the same as
+	 *	sql_socket_init or sql_query would have returned.  The results of
+	 *	queries which return rows are available to sql_fetch_row.
+	 *
+	 *	sql_fd may return a different socket after each call to
+	 *	sql_connect_continue.
+	 */
+	int (*sql_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+	sql_rcode_t (*sql_connect_start)(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+					 fr_time_delta_t timeout);
+	sql_rcode_t (*sql_connect_continue)(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+	sql_rcode_t (*sql_query_start)(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
+				       char const *query);
+	sql_rcode_t (*sql_query_continue)(int *wait_for, rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
 } rlm_sql_driver_t;
 
+typedef struct rlm_sql_query_s rlm_sql_query_t;
+
 struct sql_inst {
 	rlm_sql_config_t	config; /* HACK */
 	fr_pool_t		*pool;
+	fr_trunk_conf_t		trunk_conf;		//!< Configuration for the per-thread trunks
+							//!< used by asynchronous queries.
 
 	fr_dict_attr_t const	*sql_user;		//!< Cached pointer to SQL-User-Name
 							//!< dictionary attribute.
@@ -230,10 +265,50 @@ struct sql_inst {
 	sql_rcode_t (*sql_select_query)(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query);
 	sql_rcode_t (*sql_fetch_row)(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle);
 
+	unlang_action_t (*query_reserve)(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					 rlm_sql_query_t *query, module_method_t resume, void *rctx);
+	unlang_action_t (*query_run)(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				     rlm_sql_query_t *query, char const *query_str, bool select,
+				     module_method_t resume, void *rctx);
+	void (*query_release)(rlm_sql_query_t *query);
+
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
 };
 
+/** Thread specific instance data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	fr_trunk_t		*trunk;			//!< Connections for asynchronous queries.
+							//!< NULL unless async is enabled.
+} rlm_sql_thread_t;
+
+/** An asynchronous query, and the connection it runs on
+ *
+ * The trunk assigns a connection to the query, and the query keeps
+ * exclusive use of it until it's released.  That means the driver's
+ * escape function, redundant queries, and transactions can use the
+ * same connection.
+ */
+struct rlm_sql_query_s {
+	rlm_sql_t const		*inst;			//!< Module instance.
+	request_t		*request;		//!< Request the query is being run for.
+	fr_trunk_request_t	*treq;			//!< Trunk request reserving the connection.
+
+	rlm_sql_handle_t	*handle;		//!< Connection handle, once one has been assigned.
+	int			fd;			//!< The connection's socket.
+	int			wait_for;		//!< Events the driver is waiting for.
+	bool			timed_out;		//!< The query ran for longer than query_timeout.
+	bool			failed;			//!< The connection was lost.
+
+	sql_rcode_t		rcode;			//!< Result of the last query run by #rlm_sql_query_run.
+	module_method_t		resume;			//!< Called once the connection or the query is ready.
+	void			*rctx;			//!< Passed to resume.
+};
+
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
 struct rlm_sql_grouplist_s {
 	char			*name;
@@ -247,8 +322,25 @@ sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, bool force_debug);
+unlang_action_t	rlm_sql_query_reserve(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				      rlm_sql_query_t *query, module_method_t resume, void *rctx) CC_HINT(nonnull(1,2,3,4,5));
+unlang_action_t	rlm_sql_query_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  rlm_sql_query_t *query, char const *query_str, bool select,
+				  module_method_t resume, void *rctx) CC_HINT(nonnull(1,2,3,4,5,7));
+void		rlm_sql_query_release(rlm_sql_query_t *query) CC_HINT(nonnull);
 int		sql_set_user(rlm_sql_t const *inst, request_t *request, char const *username);
 
+/*
+ *	sql_trunk.c
+ */
+fr_trunk_t	*sql_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, rlm_sql_t const *inst);
+int		sql_trunk_query_enqueue(rlm_sql_query_t *query, fr_trunk_t *trunk, request_t *request) CC_HINT(nonnull);
+sql_rcode_t	sql_trunk_query_start(rlm_sql_query_t *query, char const *query_str) CC_HINT(nonnull);
+sql_rcode_t	sql_trunk_query_continue(rlm_sql_query_t *query) CC_HINT(nonnull);
+int		sql_trunk_query_wait(rlm_sql_query_t *query) CC_HINT(nonnull);
+void		sql_trunk_query_unwait(rlm_sql_query_t *query) CC_HINT(nonnull);
+void		sql_trunk_query_release(rlm_sql_query_t *query) CC_HINT(nonnull);
+
 /*
  *	sql_state.c
  */
@@ -29,6 +29,7 @@ RCSID("$Id$")
 #define LOG_PREFIX inst->name
 
 #include	<freeradius-devel/server/base.h>
+#include	<freeradius-devel/unlang/base.h>
 #include	<freeradius-devel/util/debug.h>
 
 #include	<sys/file.h>
@@ -567,6 +568,178 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_
 }
 
 
+/** Call the function waiting for a connection, or for a query to complete
+ *
+ */
+static inline unlang_action_t sql_query_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					       request_t *request, rlm_sql_query_t *query)
+{
+	return query->resume(p_result, MODULE_CTX(mctx->inst, mctx->thread, query->rctx), request);
+}
+
+/** Give the connection back if the request is cancelled whilst waiting
+ *
+ * The caller may be part way through a transaction, so a connection
+ * which was assigned is closed rather than being reused.
+ */
+static void _sql_query_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	rlm_sql_query_t *query = mctx->rctx;
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (query->handle) query->failed = true;
+	sql_trunk_query_release(query);
+}
+
+/** The trunk assigned a connection to the query, or gave up
+ *
+ */
+static unlang_action_t _sql_query_reserved(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return sql_query_resume(p_result, mctx, request, mctx->rctx);
+}
+
+/** The connection's socket is ready, or the query timed out or failed
+ *
+ */
+static unlang_action_t _sql_query_run_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sql_query_t *query = mctx->rctx;
+
+	query->rcode = sql_trunk_query_continue(query);
+	if (query->wait_for) {
+		if (sql_trunk_query_wait(query) < 0) {
+			query->failed = true;
+			query->wait_for = 0;
+			query->rcode = RLM_SQL_RECONNECT;
+
+			return sql_query_resume(p_result, mctx, request, query);
+		}
+
+		return unlang_module_yield(request, _sql_query_run_resume, _sql_query_signal, query);
+	}
+
+	return sql_query_resume(p_result, mctx, request, query);
+}
+
+/** Reserve a connection for one or more queries
+ *
+ * Modules which run queries using another module's connections, e.g.
+ * rlm_sqlippool, should use this, and #rlm_sql_query_run, so they don't
+ * block the worker when "async" is enabled.  Without "async", the
+ * connection comes from the pool, and resume is called immediately.
+ *
+ * @param[out] p_result	passed to resume.
+ * @param[in] mctx	of the calling module.
+ * @param[in] request	the query is being run for.
+ * @param[in] query	to reserve a connection for.  Should be zeroed,
+ *			apart from the inst, and have the same lifetime
+ *			as rctx.
+ * @param[in] resume	called once a connection is reserved, or none could be.
+ *			query->handle is NULL in the latter case.
+ * @param[in] rctx	passed to resume.
+ * @return the result of resume, or #UNLANG_ACTION_YIELD.
+ */
+unlang_action_t rlm_sql_query_reserve(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				      rlm_sql_query_t *query, module_method_t resume, void *rctx)
+{
+	rlm_sql_t const		*inst = query->inst;
+	rlm_sql_thread_t	*t;
+
+	query->request = request;
+	query->resume = resume;
+	query->rctx = rctx;
+
+	if (!inst->config.async) {
+		query->handle = fr_pool_connection_get(inst->pool, request);
+		if (!query->handle) REDEBUG("Failed reserving SQL connection");
+
+		return sql_query_resume(p_result, mctx, request, query);
+	}
+
+	t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_sql_thread_t);
+	if ((sql_trunk_query_enqueue(query, t->trunk, request) < 0) || query->handle) {
+		return sql_query_resume(p_result, mctx, request, query);
+	}
+
+	return unlang_module_yield(request, _sql_query_reserved, _sql_query_signal, query);
+}
+
+/** Run a query on a reserved connection
+ *
+ * Does the same as #rlm_sql_query or #rlm_sql_select_query, but yields
+ * instead of blocking when "async" is enabled.  Results are then read
+ * from query->handle as usual.
+ *
+ * @param[out] p_result		passed to resume.
+ * @param[in] mctx		of the calling module.
+ * @param[in] request		the query is being run for.
+ * @param[in] query		with a connection reserved by #rlm_sql_query_reserve.
+ * @param[in] query_str		to run.
+ * @param[in] select		whether the query returns rows.  Asynchronous drivers
+ *				make rows available whenever there are any.
+ * @param[in] resume		called once the query has completed.  The result is
+ *				in query->rcode, and query->handle is NULL if the
+ *				connection was lost.
+ * @param[in] rctx		passed to resume.
+ * @return the result of resume, or #UNLANG_ACTION_YIELD.
+ */
+unlang_action_t rlm_sql_query_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  rlm_sql_query_t *query, char const *query_str, bool select,
+				  module_method_t resume, void *rctx)
+{
+	rlm_sql_t const *inst = query->inst;
+
+	query->resume = resume;
+	query->rctx = rctx;
+
+	if (!query->handle || query->failed) {
+		query->rcode = RLM_SQL_RECONNECT;
+
+		return sql_query_resume(p_result, mctx, request, query);
+	}
+
+	if (!inst->config.async) {
+		query->rcode = select ? rlm_sql_select_query(inst, request, &query->handle, query_str) :
+					rlm_sql_query(inst, request, &query->handle, query_str);
+
+		return sql_query_resume(p_result, mctx, request, query);
+	}
+
+	query->rcode = sql_trunk_query_start(query, query_str);
+	if (query->wait_for) {
+		if (sql_trunk_query_wait(query) < 0) {
+			query->failed = true;
+			query->wait_for = 0;
+			query->rcode = RLM_SQL_RECONNECT;
+
+			return sql_query_resume(p_result, mctx, request, query);
+		}
+
+		return unlang_module_yield(request, _sql_query_run_resume, _sql_query_signal, query);
+	}
+
+	return sql_query_resume(p_result, mctx, request, query);
+}
+
+/** Give back the connection reserved by #rlm_sql_query_reserve
+ *
+ * @param[in] query	to release the connection of.
+ */
+void rlm_sql_query_release(rlm_sql_query_t *query)
+{
+	rlm_sql_t const *inst = query->inst;
+
+	if (!inst->config.async) {
+		if (query->handle) fr_pool_connection_release(inst->pool, query->request, query->handle);
+		query->handle = NULL;
+		return;
+	}
+
+	sql_trunk_query_release(query);
+}
+
 /*************************************************************************
  *
  *	Function: sql_getvpdata
@@ -0,0 +1,600 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_trunk.c
+ * @brief Run queries asynchronously on per-thread connection trunks.
+ *
+ * Each trunk request reserves a connection for one rlm_sql_query_t.  The
+ * request then drives the driver's non-blocking query functions itself,
+ * yielding until the connection's socket is readable or writable.
+ *
+ * Most client libraries only allow one outstanding query per connection,
+ * so the trunk is limited to one request per connection, and opens more
+ * connections as load increases.  Requests beyond the connection limit
+ * wait in the trunk's backlog instead of blocking a worker.
+ *
+ * Connections are opened, and the connect_query run, using the driver's
+ * non-blocking functions as well, driven by the thread's event loop.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_sql.h"
+
+/** A trunk connection
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance.
+	fr_connection_t		*conn;			//!< Connection this is the state for.
+	rlm_sql_handle_t	*handle;		//!< Handle, whilst the connection is being opened.
+	int			fd;			//!< Socket we're waiting on, or -1.
+	int			wait_for;		//!< Events the driver is waiting for.
+	bool			connect_query;		//!< Connected, and running the connect_query.
+} sql_trunk_conn_t;
+
+static void _sql_connection_io(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void _sql_connection_io_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+
+/** Stop waiting on the socket of a connection being opened
+ *
+ */
+static void sql_connection_unwait(sql_trunk_conn_t *sconn)
+{
+	if (sconn->fd < 0) return;
+
+	(void) fr_event_fd_delete(sconn->conn->el, sconn->fd, FR_EVENT_FILTER_IO);
+	sconn->fd = -1;
+}
+
+/** Move on to the next stage of opening a connection
+ *
+ * Waits for the events the driver asked for, runs the connect_query
+ * once the driver is connected, and signals the connection once that's
+ * done.
+ *
+ * @param[in] sconn	being opened.
+ * @param[in] rcode	from the driver's last connect or query function.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection failed, and should be closed.
+ */
+static int sql_connection_next(sql_trunk_conn_t *sconn, sql_rcode_t rcode)
+{
+	rlm_sql_t const		*inst = sconn->inst;
+	rlm_sql_handle_t	*handle = sconn->handle;
+
+	if (sconn->wait_for) {
+		sconn->fd = inst->driver->sql_fd(handle, &inst->config);
+		if (sconn->fd < 0) {
+			ERROR("Driver provided no socket to wait on");
+			return -1;
+		}
+
+		if (fr_event_fd_insert(sconn, sconn->conn->el, sconn->fd,
+				       (sconn->wait_for & RLM_SQL_WAIT_READ) ? _sql_connection_io : NULL,
+				       (sconn->wait_for & RLM_SQL_WAIT_WRITE) ? _sql_connection_io : NULL,
+				       _sql_connection_io_error, sconn) < 0) {
+			PERROR("Failed inserting connection socket into event loop");
+			sconn->fd = -1;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (!sconn->connect_query) {
+		if (rcode != RLM_SQL_OK) return -1;
+
+		if (inst->config.connect_query) {
+			sconn->connect_query = true;
+			DEBUG2("Executing connect query: %s", inst->config.connect_query);
+
+			rcode = inst->driver->sql_query_start(&sconn->wait_for, handle, &inst->config,
+							      inst->config.connect_query);
+			return sql_connection_next(sconn, rcode);
+		}
+	} else {
+		if (rcode != RLM_SQL_OK) {
+			rlm_sql_print_error(inst, NULL, handle, false);
+			return -1;
+		}
+		(inst->driver->sql_finish_query)(handle, &inst->config);
+	}
+
+	sconn->handle = NULL;
+	fr_connection_signal_connected(sconn->conn);
+
+	return 0;
+}
+
+/** Called when the socket of a connection being opened is ready
+ *
+ */
+static void _sql_connection_io(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_trunk_conn_t	*sconn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sconn->inst;
+	sql_rcode_t		rcode;
+
+	/*
+	 *	Remove the events before the driver can close
+	 *	the socket, e.g. to try the next host.
+	 */
+	sql_connection_unwait(sconn);
+
+	if (!sconn->connect_query) {
+		rcode = inst->driver->sql_connect_continue(&sconn->wait_for, sconn->handle, &inst->config);
+	} else {
+		rcode = inst->driver->sql_query_continue(&sconn->wait_for, sconn->handle, &inst->config);
+	}
+
+	if (sql_connection_next(sconn, rcode) < 0) fr_connection_signal_reconnect(sconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Called if there's an error on the socket of a connection being opened
+ *
+ */
+static void _sql_connection_io_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				     int fd_errno, void *uctx)
+{
+	sql_trunk_conn_t	*sconn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sconn->inst;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	sql_connection_unwait(sconn);
+	fr_connection_signal_reconnect(sconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Start opening a new connection for the trunk
+ *
+ * The driver connects, and runs the connect_query, without blocking.
+ * The connection is signalled once that's done.
+ */
+static fr_connection_state_t _sql_connection_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	sql_trunk_conn_t	*sconn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+	rlm_sql_t const		*inst = sconn->inst;
+	rlm_sql_handle_t	*handle;
+	sql_rcode_t		rcode;
+
+	MEM(handle = talloc_zero(conn, rlm_sql_handle_t));
+	MEM(handle->log_ctx = talloc_pool(handle, 2048));
+	handle->inst = inst;
+
+	sconn->handle = handle;
+	sconn->fd = -1;
+	sconn->wait_for = 0;
+	sconn->connect_query = false;
+
+	rcode = inst->driver->sql_connect_start(&sconn->wait_for, handle, &inst->config,
+						inst->trunk_conf.conn_conf->connection_timeout);
+	if (sql_connection_next(sconn, rcode) < 0) {
+		sql_connection_unwait(sconn);
+		sconn->handle = NULL;
+		talloc_free(handle);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	*h_out = handle;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Close a trunk connection
+ *
+ * The connection may still be being opened, so stop waiting on its
+ * socket before the driver closes it.
+ */
+static void _sql_connection_close(UNUSED fr_event_list_t *el, void *h, void *uctx)
+{
+	sql_trunk_conn_t *sconn = talloc_get_type_abort(uctx, sql_trunk_conn_t);
+
+	sql_connection_unwait(sconn);
+	sconn->handle = NULL;
+
+	talloc_free(h);
+}
+
+/** Allocate a connection for the trunk
+ *
+ */
+static fr_connection_t *sql_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						   fr_connection_conf_t const *conf,
+						   char const *log_prefix, void *uctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	sql_trunk_conn_t	*sconn;
+
+	MEM(sconn = talloc_zero(tconn, sql_trunk_conn_t));
+	sconn->inst = inst;
+	sconn->fd = -1;
+
+	sconn->conn = fr_connection_alloc(tconn, el,
+					  &(fr_connection_funcs_t){
+						.init = _sql_connection_init,
+						.close = _sql_connection_close
+					  },
+					  conf, log_prefix, sconn);
+	if (!sconn->conn) {
+		talloc_free(sconn);
+		return NULL;
+	}
+
+	return sconn->conn;
+}
+
+/** Assign connections to queries
+ *
+ * Nothing is written here.  The query is run by the request that owns it,
+ * once it's resumed.
+ *
+ * Queries which lost their previous connection are moved here by the trunk,
+ * but can't be continued, so they're failed instead.
+ */
+static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				  fr_connection_t *conn, void *uctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	rlm_sql_handle_t	*handle = talloc_get_type_abort(conn->h, rlm_sql_handle_t);
+	fr_trunk_request_t	*treq;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		rlm_sql_query_t *query;
+
+		if (!treq) break;
+
+		query = treq->preq;
+		if (query->failed) {
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		query->handle = handle;
+		query->fd = inst->driver->sql_fd(handle, &inst->config);
+
+		fr_trunk_request_signal_sent(treq);
+
+		if (treq->request) unlang_interpret_mark_runnable(treq->request);
+	}
+}
+
+/** The query no longer has use of the connection
+ *
+ * If the query was abandoned part way through, the connection can't be
+ * reused, as the next query would see the results of this one.
+ */
+static void sql_trunk_request_cancel(fr_connection_t *conn, void *preq, fr_trunk_cancel_reason_t reason,
+				     UNUSED void *uctx)
+{
+	rlm_sql_query_t *query = preq;
+
+	switch (reason) {
+	/*
+	 *	The query was released.  Its flags all refer to
+	 *	this connection, as queries which lost a previous
+	 *	connection are failed before they're assigned
+	 *	another.
+	 */
+	case FR_TRUNK_CANCEL_REASON_SIGNAL:
+		if (query->wait_for || query->timed_out || query->failed) {
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		}
+		break;
+
+	/*
+	 *	The connection failed while we were using it.  The
+	 *	trunk moves the request to another connection, and
+	 *	sql_trunk_request_mux() fails it there.
+	 */
+	default:
+		sql_trunk_query_unwait(query);
+		query->failed = true;
+		if (query->request) unlang_interpret_mark_runnable(query->request);
+		break;
+	}
+
+	query->handle = NULL;
+	query->wait_for = 0;
+}
+
+/** No connection could be assigned to the query
+ *
+ */
+static void sql_trunk_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+				   UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	rlm_sql_query_t *query = preq;
+
+	sql_trunk_query_unwait(query);
+
+	query->treq = NULL;		/* Freed by the trunk */
+	query->handle = NULL;
+	query->wait_for = 0;
+	query->failed = true;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+/** Allocate a trunk for asynchronous queries
+ *
+ * @param[in] ctx	to allocate the trunk in.
+ * @param[in] el	to run queries in.
+ * @param[in] inst	of rlm_sql.
+ * @return
+ *	- A new trunk.
+ *	- NULL on error.
+ */
+fr_trunk_t *sql_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, rlm_sql_t const *inst)
+{
+	return fr_trunk_alloc(ctx, el,
+			      &(fr_trunk_io_funcs_t){
+					.connection_alloc = sql_trunk_connection_alloc,
+					.request_mux = sql_trunk_request_mux,
+					.request_cancel = sql_trunk_request_cancel,
+					.request_fail = sql_trunk_request_fail
+			      },
+			      &inst->trunk_conf, inst->name, inst, false);
+}
+
+/** Ask the trunk for a connection to run a query on
+ *
+ * If a connection is available, it's assigned before this function
+ * returns, and query->handle will be set.  Otherwise the request should
+ * yield, and will be marked runnable when a connection is assigned, or
+ * when the trunk gives up.
+ *
+ * @param[in] query	to enqueue.  Should be zeroed, apart from the inst.
+ * @param[in] trunk	to enqueue the query on.
+ * @param[in] request	the query is being run for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the trunk can't accept any more requests.
+ */
+int sql_trunk_query_enqueue(rlm_sql_query_t *query, fr_trunk_t *trunk, request_t *request)
+{
+	query->request = request;
+	query->fd = -1;
+
+	switch (fr_trunk_request_enqueue(&query->treq, trunk, request, query, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return 0;
+
+	default:
+		REDEBUG("Unable to enqueue query");
+		if (query->treq) fr_trunk_request_free(&query->treq);
+		return -1;
+	}
+}
+
+/** Called if the query runs for longer than query_timeout
+ *
+ */
+static void _sql_query_timeout(module_ctx_t const *mctx, request_t *request, UNUSED fr_time_t fired)
+{
+	rlm_sql_query_t *query = mctx->rctx;
+
+	(void) unlang_module_fd_delete(request, query, query->fd);
+	query->timed_out = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Called when the connection's socket is ready for the driver to continue
+ *
+ */
+static void _sql_query_io(UNUSED module_ctx_t const *mctx, request_t *request, UNUSED int fd)
+{
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Called if there's an error on the connection's socket
+ *
+ */
+static void _sql_query_io_error(module_ctx_t const *mctx, request_t *request, UNUSED int fd)
+{
+	rlm_sql_query_t *query = mctx->rctx;
+
+	query->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Log errors from a finished query, and tidy up after it
+ *
+ * Does the same as #rlm_sql_query, apart from reconnecting.
+ */
+static sql_rcode_t sql_trunk_query_done(rlm_sql_query_t *query, sql_rcode_t rcode)
+{
+	rlm_sql_t const	*inst = query->inst;
+	request_t	*request = query->request;
+
+	(void) unlang_module_timeout_delete(request, query);
+
+	switch (rcode) {
+	case RLM_SQL_OK:
+	case RLM_SQL_NO_MORE_ROWS:
+		break;
+
+	/*
+	 *	The trunk will open a new connection.
+	 */
+	case RLM_SQL_RECONNECT:
+		query->failed = true;
+		break;
+
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, query->handle, false);
+		(inst->driver->sql_finish_query)(query->handle, &inst->config);
+		break;
+
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, query->handle, false);
+			(inst->driver->sql_finish_query)(query->handle, &inst->config);
+			break;
+		}
+		rcode = RLM_SQL_ALT_QUERY;
+		FALL_THROUGH;
+
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, query->handle, true);
+		(inst->driver->sql_finish_query)(query->handle, &inst->config);
+		break;
+	}
+
+	return rcode;
+}
+
+/** Start running a query on the connection assigned to it
+ *
+ * @param[in] query	with a connection assigned.
+ * @param[in] query_str	to run.
+ * @return the same codes as #rlm_sql_query.  If the query is still running
+ *	query->wait_for will be non-zero, and #sql_trunk_query_wait should
+ *	be called.
+ */
+sql_rcode_t sql_trunk_query_start(rlm_sql_query_t *query, char const *query_str)
+{
+	rlm_sql_t const	*inst = query->inst;
+	request_t	*request = query->request;
+	sql_rcode_t	rcode;
+
+	fr_assert(query->handle);
+
+	if (query_str[0] == '\0') {
+		REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	RDEBUG2("Executing query: %s", query_str);
+
+	rcode = inst->driver->sql_query_start(&query->wait_for, query->handle, &inst->config, query_str);
+	if (!query->wait_for) return sql_trunk_query_done(query, rcode);
+	if (!fr_time_delta_ispos(inst->config.query_timeout)) return rcode;
+
+	if (unlang_module_timeout_add(request, _sql_query_timeout, query,
+				      fr_time_add(fr_time(), inst->config.query_timeout)) < 0) {
+		RPEDEBUG("Failed setting query timeout");
+		return RLM_SQL_ERROR;
+	}
+
+	return rcode;
+}
+
+/** Continue running a query after sql_trunk_query_wait's event fired
+ *
+ * @param[in] query	being run.
+ * @return the same codes as #rlm_sql_query.
+ */
+sql_rcode_t sql_trunk_query_continue(rlm_sql_query_t *query)
+{
+	rlm_sql_t const	*inst = query->inst;
+	request_t	*request = query->request;
+	sql_rcode_t	rcode;
+
+	sql_trunk_query_unwait(query);
+
+	/*
+	 *	The query is abandoned, so stop waiting for it.  The
+	 *	connection is reconnected when it's released, as
+	 *	timed_out or failed is set.
+	 */
+	if (query->timed_out) {
+		REDEBUG("Query timed out after %pVs", fr_box_time_delta(inst->config.query_timeout));
+		query->wait_for = 0;
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (query->failed || !query->handle) {
+		REDEBUG("Connection failed during query");
+		(void) unlang_module_timeout_delete(request, query);
+		query->wait_for = 0;
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = inst->driver->sql_query_continue(&query->wait_for, query->handle, &inst->config);
+	if (!query->wait_for) return sql_trunk_query_done(query, rcode);
+
+	return rcode;
+}
+
+/** Wait for the events the driver asked for
+ *
+ * @param[in] query	being run.
+ * @return
+ *	- 0 on success.  The request should yield.
+ *	- -1 on failure.
+ */
+int sql_trunk_query_wait(rlm_sql_query_t *query)
+{
+	request_t *request = query->request;
+
+	if (unlang_module_fd_add(request,
+				 (query->wait_for & RLM_SQL_WAIT_READ) ? _sql_query_io : NULL,
+				 (query->wait_for & RLM_SQL_WAIT_WRITE) ? _sql_query_io : NULL,
+				 _sql_query_io_error, query, query->fd) < 0) {
+		RPEDEBUG("Failed waiting for query");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop waiting for events on the connection
+ *
+ */
+void sql_trunk_query_unwait(rlm_sql_query_t *query)
+{
+	if (!query->request || (query->fd < 0)) return;
+
+	(void) unlang_module_fd_delete(query->request, query, query->fd);
+}
+
+/** Give the connection back to the trunk
+ *
+ * If the query is still running, the connection is reconnected.
+ *
+ * @param[in] query	to release the connection for.
+ */
+void sql_trunk_query_release(rlm_sql_query_t *query)
+{
+	sql_trunk_query_unwait(query);
+	if (query->request) (void) unlang_module_timeout_delete(query->request, query);
+
+	if (query->treq) {
+		if (query->handle && !query->wait_for && !query->timed_out && !query->failed) {
+			fr_trunk_request_signal_complete(query->treq);
+		} else {
+			fr_trunk_request_signal_cancel(query->treq);
+		}
+		query->treq = NULL;
+	}
+
+	query->handle = NULL;
+	query->wait_for = 0;
+}
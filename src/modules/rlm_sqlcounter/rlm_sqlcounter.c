@@ -29,6 +29,9 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/unlang/base.h>
+
+#include <rlm_sql.h>
 
 #include <ctype.h>
 
@@ -66,6 +69,7 @@ typedef struct {
 	tmpl_t	*key;  		//!< User-Name
 
 	char const	*sqlmod_inst;	//!< Instance of SQL module to use, usually just 'sql'.
+	rlm_sql_t const	*sql_inst;	//!< The SQL module instance.
 	char const	*query;		//!< SQL query to retrieve current session time.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
@@ -73,6 +77,15 @@ typedef struct {
 	fr_time_t	last_reset;
 } rlm_sqlcounter_t;
 
+/** State for running the counter query
+ *
+ */
+typedef struct {
+	rlm_sql_query_t	query;		//!< Connection reserved for the counter query.
+	char		*subst;		//!< Query, with %b and %e expanded.
+	char		*expanded;	//!< Query being run.
+} sqlcounter_rctx_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -368,68 +381,47 @@ static int counter_cmp(void *instance, request_t *request, UNUSED fr_pair_list_t
 }
 
 /*
- *	Find the named user in this modules database.  Create the set
- *	of attribute-value pairs to check and reply with for this user
- *	from the database. The authentication code only needs to check
- *	the password, the rest is done here.
+ *	The counter query has been run.  Compare the result against the limit.
  */
-static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_sqlcounter_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlcounter_t);
-	uint64_t		counter, res;
+	rlm_sqlcounter_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlcounter_t);
+	sqlcounter_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, sqlcounter_rctx_t);
+	uint64_t		counter = 0, res;
 	fr_pair_t		*limit;
 	fr_pair_t		*reply_item;
+	rlm_sql_row_t		row = NULL;
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
-	/*
-	 *	Before doing anything else, see if we have to reset
-	 *	the counters.
-	 */
-	if (fr_time_eq(inst->reset_time, fr_time_wrap(0)) &&
-	    (fr_time_lteq(inst->reset_time, request->packet->timestamp))) {
-		/*
-		 *	Re-set the next time and prev_time for this counters range
-		 */
-		inst->last_reset = inst->reset_time;
-		find_next_reset(inst, request->packet->timestamp);
-	}
-
-	if (tmpl_find_vp(&limit, request, inst->limit_attr) < 0) {
-		RWDEBUG2("Couldn't find limit attribute, %s, doing nothing...", inst->limit_attr->name);
-		RETURN_MODULE_NOOP;
-	}
-
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
+	if ((rctx->query.rcode != RLM_SQL_OK) || !rctx->query.handle) {
+		inst->sql_inst->query_release(&rctx->query);
 		RETURN_MODULE_FAIL;
 	}
 
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		RETURN_MODULE_FAIL;
+	ret = inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, &rctx->query.handle);
+	if (rctx->query.handle) {
+		(inst->sql_inst->driver->sql_finish_select_query)(rctx->query.handle, &inst->sql_inst->config);
 	}
 
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
+	if ((ret == RLM_SQL_OK) && row && row[0]) {
+		if (sscanf(row[0], "%" PRIu64, &counter) != 1) {
+			RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+				row[0]);
+			counter = 0;
+		}
+	} else if (ret < 0) {
+		inst->sql_inst->query_release(&rctx->query);
 		RETURN_MODULE_FAIL;
+	} else {
+		RDEBUG2("No integer found in result string \"\".  May be first session, setting counter to 0");
 	}
-	talloc_free(expanded);
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
+	inst->sql_inst->query_release(&rctx->query);
+
+	if (tmpl_find_vp(&limit, request, inst->limit_attr) < 0) {
+		RWDEBUG2("Couldn't find limit attribute, %s, doing nothing...", inst->limit_attr->name);
+		RETURN_MODULE_NOOP;
 	}
 
 	/*
@@ -542,6 +534,80 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	RETURN_MODULE_OK;
 }
 
+/*
+ *	A connection has been reserved.  Expand and run the counter query.
+ */
+static unlang_action_t mod_authorize_reserved(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlcounter_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlcounter_t);
+	sqlcounter_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, sqlcounter_rctx_t);
+
+	if (!rctx->query.handle) {
+		REDEBUG("Failed reserving SQL connection");
+		RETURN_MODULE_FAIL;
+	}
+
+	if (xlat_aeval(rctx, &rctx->expanded, request, rctx->subst, inst->sql_inst->sql_escape_func,
+		       rctx->query.handle) < 0) {
+		inst->sql_inst->query_release(&rctx->query);
+		RETURN_MODULE_FAIL;
+	}
+
+	return inst->sql_inst->query_run(p_result, mctx, request, &rctx->query, rctx->expanded, true,
+					 mod_authorize_resume, rctx);
+}
+
+/*
+ *	Find the named user in this modules database.  Create the set
+ *	of attribute-value pairs to check and reply with for this user
+ *	from the database. The authentication code only needs to check
+ *	the password, the rest is done here.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlcounter_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlcounter_t);
+	sqlcounter_rctx_t	*rctx;
+	fr_pair_t		*limit;
+	char			subst[MAX_QUERY_LEN];
+
+	/*
+	 *	Before doing anything else, see if we have to reset
+	 *	the counters.
+	 */
+	if (fr_time_eq(inst->reset_time, fr_time_wrap(0)) &&
+	    (fr_time_lteq(inst->reset_time, request->packet->timestamp))) {
+		/*
+		 *	Re-set the next time and prev_time for this counters range
+		 */
+		inst->last_reset = inst->reset_time;
+		find_next_reset(inst, request->packet->timestamp);
+	}
+
+	if (tmpl_find_vp(&limit, request, inst->limit_attr) < 0) {
+		RWDEBUG2("Couldn't find limit attribute, %s, doing nothing...", inst->limit_attr->name);
+		RETURN_MODULE_NOOP;
+	}
+
+	/* First, expand %k, %b and %e in query */
+	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
+		REDEBUG("Insufficient query buffer space");
+
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) RETURN_MODULE_FAIL;
+
+	/*
+	 *	Then run it on a connection from the SQL module, yielding
+	 *	if the connection is asynchronous.
+	 */
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), sqlcounter_rctx_t));
+	rctx->query.inst = inst->sql_inst;
+	MEM(rctx->subst = talloc_typed_strdup(rctx, subst));
+
+	return inst->sql_inst->query_reserve(p_result, mctx, request, &rctx->query, mod_authorize_reserved, rctx);
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -556,6 +622,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_sqlcounter_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlcounter_t);
 	CONF_SECTION    	*conf = mctx->inst->conf;
+	module_instance_t	*sql_inst;
 
 	fr_assert(inst->query && *inst->query);
 
@@ -576,6 +643,19 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	sql_inst = module_by_name(NULL, inst->sqlmod_inst);
+	if (!sql_inst) {
+		cf_log_err(conf, "failed to find sql instance named %s", inst->sqlmod_inst);
+		return -1;
+	}
+
+	inst->sql_inst = (rlm_sql_t *) sql_inst->dl_inst->data;
+
+	if (strcmp(talloc_get_name(inst->sql_inst), "rlm_sql_t") != 0) {
+		cf_log_err(conf, "Module \"%s\" is not an instance of the rlm_sql module", inst->sqlmod_inst);
+		return -1;
+	}
+
 	return 0;
 }
 
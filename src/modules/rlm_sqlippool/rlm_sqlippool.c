@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <rlm_sql.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/radius/radius.h>
 
 #include <ctype.h>
@@ -266,108 +267,139 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 	return strlen(out);
 }
 
+/** Where we are in the allocation sequence
+ *
+ * Each state is the query which was last run.
+ */
+typedef enum {
+	IPPOOL_ALLOC_RESERVED = 0,			//!< No query yet, a connection was reserved.
+	IPPOOL_ALLOC_BEGIN,
+	IPPOOL_ALLOC_EXISTING,
+	IPPOOL_ALLOC_REQUESTED,
+	IPPOOL_ALLOC_FIND,
+	IPPOOL_ALLOC_NOTFOUND_COMMIT,
+	IPPOOL_ALLOC_POOL_CHECK,
+	IPPOOL_ALLOC_INVALID_COMMIT,
+	IPPOOL_ALLOC_UPDATE,
+	IPPOOL_ALLOC_COMMIT
+} sqlippool_alloc_state_t;
+
+/** State for running a sequence of queries on one connection
+ *
+ */
+typedef struct {
+	rlm_sql_query_t		query;			//!< Connection reserved for the sequence.
+	char			*expanded;		//!< Query being run.
+	bool			skipped;		//!< The query isn't configured, so wasn't run.
+	bool			ran;			//!< A query has been started.
+
+	char			*param;			//!< Substituted for %I.
+	int			param_len;
+
+	sqlippool_alloc_state_t	state;			//!< Of an allocation.
+	char			allocation[FR_MAX_STRING_LEN];
+	int			allocation_len;
+	fr_pair_t		*vp;			//!< Holding the allocated address.
+
+	char const		*cmds[4];		//!< Of an update, release etc.  May be NULL if not configured.
+	unsigned int		num_cmds;
+	int			affected[4];		//!< Rows affected by each of cmds.
+	unsigned int		cmd;			//!< Index of the command being run.
+	module_method_t		done;			//!< Called once all cmds have been run.
+} sqlippool_rctx_t;
+
 /** Perform a single sqlippool query
  *
  * Mostly wrapper around sql_query which does some special sqlippool sequence substitutions and expands
- * the format string.
+ * the format string.  The query runs on the connection reserved for the sequence.
  *
- * @param fmt sql query to expand.
- * @param handle sql connection handle.
- * @param data Instance of rlm_sqlippool.
- * @param request Current request.
- * @param param ip address string.
- * @param param_len ip address string len.
- * @return
- *	- 0 on success.
- *	- < 0 on error.
+ * @param[out] p_result	passed to resume.
+ * @param[in] mctx	of this module.
+ * @param[in] request	Current request.
+ * @param[in] rctx	for the sequence.  param is substituted for %I.
+ * @param[in] fmt	sql query to expand.
+ * @param[in] select	whether the query returns a row.
+ * @param[in] resume	called once the query is complete.
+ * @return the result of resume, or #UNLANG_ACTION_YIELD.
  */
-static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
-			     rlm_sqlippool_t const *data, request_t *request,
-			     char *param, int param_len)
+static unlang_action_t sqlippool_command(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					 sqlippool_rctx_t *rctx, char const *fmt, bool select, module_method_t resume)
 {
-	char query[MAX_QUERY_LEN];
-	char *expanded = NULL;
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+	char			query[MAX_QUERY_LEN];
 
-	int ret;
-	int affected;
+	TALLOC_FREE(rctx->expanded);
+	rctx->skipped = false;
+	rctx->ran = true;
 
 	/*
 	 *	If we don't have a command, do nothing.
 	 */
-	if (!fmt || !*fmt) return 0;
-
-	/*
-	 *	No handle?  That's an error.
-	 */
-	if (!handle || !*handle) return -1;
+	if (!fmt || !*fmt) {
+		rctx->skipped = true;
+		return resume(p_result, MODULE_CTX(mctx->inst, mctx->thread, rctx), request);
+	}
 
 	/*
 	 *	@todo this needs to die (should just be done in xlat expansion)
 	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
-
-	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) return -1;
+	sqlippool_expand(query, sizeof(query), fmt, inst, rctx->param, rctx->param_len);
 
-	ret = data->sql_inst->sql_query(data->sql_inst, request, handle, expanded);
-	if (ret < 0){
-		talloc_free(expanded);
-		return -1;
+	if (xlat_aeval(rctx, &rctx->expanded, request, query, inst->sql_inst->sql_escape_func,
+		       rctx->query.handle) < 0) {
+		rctx->query.rcode = RLM_SQL_ERROR;
+		return resume(p_result, MODULE_CTX(mctx->inst, mctx->thread, rctx), request);
 	}
-	talloc_free(expanded);
+
+	return inst->sql_inst->query_run(p_result, mctx, request, &rctx->query, rctx->expanded, select, resume, rctx);
+}
+
+/** Get the number of rows a command affected
+ *
+ * @return
+ *	- >= 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_command_result(rlm_sqlippool_t const *inst, sqlippool_rctx_t *rctx)
+{
+	rlm_sql_handle_t	*handle = rctx->query.handle;
+	int			affected;
+
+	if (rctx->skipped) return 0;
 
 	/*
 	 *	No handle, we can't continue.
 	 */
-	if (!*handle) return -1;
+	if ((rctx->query.rcode < 0) || !handle) return -1;
 
-	affected = (data->sql_inst->driver->sql_affected_rows)(*handle, &data->sql_inst->config);
+	affected = (inst->sql_inst->driver->sql_affected_rows)(handle, &inst->sql_inst->config);
 
-	(data->sql_inst->driver->sql_finish_query)(*handle, &data->sql_inst->config);
+	(inst->sql_inst->driver->sql_finish_query)(handle, &inst->sql_inst->config);
 
 	return affected;
 }
 
-/*
- *	Don't repeat yourself
- */
-#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, 0) <0) goto error
-
-/*
- * Query the database expecting a single result row
+/** Get the single result row of a query
+ *
+ * @return the length of the result, or 0 if there wasn't one.
  */
-static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen, char const *fmt,
-							  rlm_sql_handle_t **handle, rlm_sqlippool_t *data,
-							  request_t *request, char *param, int param_len)
+static int sqlippool_query1_result(char *out, int outlen, rlm_sqlippool_t const *inst, request_t *request,
+				   sqlippool_rctx_t *rctx)
 {
-	char query[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	int rlen, retval;
-
-	rlm_sql_row_t row;
-
-	/*
-	 *	@todo this needs to die (should just be done in xlat expansion)
-	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	rlm_sql_handle_t	*handle = rctx->query.handle;
+	rlm_sql_row_t		row;
+	int			rlen, retval = 0;
 
 	*out = '\0';
 
-	/*
-	 *	Do an xlat on the provided string
-	 */
-	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) {
-		return 0;
-	}
-	retval = data->sql_inst->sql_select_query(data->sql_inst, request, handle, expanded);
-	talloc_free(expanded);
+	if (rctx->skipped || !rctx->expanded) return 0;
 
-	if ((retval != 0) || !*handle) {
-		REDEBUG("database query error on '%s'", query);
+	if ((rctx->query.rcode != RLM_SQL_OK) || !handle) {
+		REDEBUG("database query error on '%s'", rctx->expanded);
 		return 0;
 	}
 
-	if (data->sql_inst->sql_fetch_row(&row, data->sql_inst, request, handle) < 0) {
+	if (inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, &rctx->query.handle) < 0) {
 		REDEBUG("Failed fetching query result");
 		goto finish;
 	}
@@ -392,11 +424,99 @@ static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen,
 	retval = rlen;
 
 finish:
-	(data->sql_inst->driver->sql_finish_select_query)(*handle, &data->sql_inst->config);
+	if (rctx->query.handle) {
+		(inst->sql_inst->driver->sql_finish_select_query)(rctx->query.handle, &inst->sql_inst->config);
+	}
 
 	return retval;
 }
 
+/** Allocate the state for a sequence of queries
+ *
+ */
+static sqlippool_rctx_t *sqlippool_rctx_alloc(rlm_sqlippool_t const *inst, request_t *request)
+{
+	sqlippool_rctx_t	*rctx;
+
+	MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), sqlippool_rctx_t));
+	rctx->query.inst = inst->sql_inst;
+
+	return rctx;
+}
+
+/** Reserve a connection, and call resume with it
+ *
+ */
+static unlang_action_t sqlippool_reserve(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					 sqlippool_rctx_t *rctx, module_method_t resume)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+
+	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
+		talloc_free(rctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	return inst->sql_inst->query_reserve(p_result, mctx, request, &rctx->query, resume, rctx);
+}
+
+/** Run each of the commands in rctx->cmds, then call rctx->done
+ *
+ * Does the same as running DO_PART on each of them.  Fails if any of
+ * them fail.
+ */
+static unlang_action_t sqlippool_sequence_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						 request_t *request)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+	sqlippool_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, sqlippool_rctx_t);
+
+	if (!rctx->query.handle) {
+		REDEBUG("Failed reserving SQL connection");
+		inst->sql_inst->query_release(&rctx->query);
+		RETURN_MODULE_FAIL;
+	}
+
+	/*
+	 *	The previous command completed.
+	 */
+	if (rctx->ran) {
+		rctx->affected[rctx->cmd] = sqlippool_command_result(inst, rctx);
+		if (rctx->affected[rctx->cmd] < 0) {
+			inst->sql_inst->query_release(&rctx->query);
+			RETURN_MODULE_FAIL;
+		}
+		rctx->cmd++;
+	}
+
+	if (rctx->cmd == rctx->num_cmds) {
+		TALLOC_FREE(rctx->expanded);
+		inst->sql_inst->query_release(&rctx->query);
+		return rctx->done(p_result, mctx, request);
+	}
+
+	return sqlippool_command(p_result, mctx, request, rctx, rctx->cmds[rctx->cmd], false,
+				 sqlippool_sequence_resume);
+}
+
+/** Run a sequence of commands on one connection
+ *
+ */
+static unlang_action_t sqlippool_sequence(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					  char const *cmds[], size_t num, module_method_t done)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+	sqlippool_rctx_t	*rctx = sqlippool_rctx_alloc(inst, request);
+
+	fr_assert(num <= NUM_ELEMENTS(rctx->cmds));
+
+	memcpy(rctx->cmds, cmds, sizeof(rctx->cmds[0]) * num);
+	rctx->num_cmds = num;
+	rctx->done = done;
+
+	return sqlippool_reserve(p_result, mctx, request, rctx, sqlippool_sequence_resume);
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_sqlippool_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
@@ -499,214 +619,223 @@ static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t
 /*
  *	Allocate an IP number from the pool.
  */
-static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t mod_alloc_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
-	char			allocation[FR_MAX_STRING_LEN];
-	int			allocation_len;
-	fr_pair_t		*vp = NULL;
-	rlm_sql_handle_t	*handle;
-
-	/*
-	 *	If there is a Framed-IP-Address attribute in the reply do nothing
-	 */
-	if (fr_pair_find_by_da_idx(&request->reply_pairs, inst->allocated_address_da, 0) != NULL) {
-		RDEBUG2("%s already exists", inst->allocated_address_da->name);
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+	sqlippool_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, sqlippool_rctx_t);
+
+	switch (rctx->state) {
+	case IPPOOL_ALLOC_RESERVED:
+		if (!rctx->query.handle) {
+			REDEBUG("Failed reserving SQL connection");
+			RETURN_MODULE_FAIL;
+		}
 
-		return do_logging(p_result, inst, request, inst->log_exists, RLM_MODULE_NOOP);
-	}
+		rctx->state = IPPOOL_ALLOC_BEGIN;
+		return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_begin, false, mod_alloc_resume);
 
-	if (fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_name, 0) == NULL) {
-		RDEBUG2("No %s defined", attr_pool_name->name);
+	case IPPOOL_ALLOC_BEGIN:
+		if (sqlippool_command_result(inst, rctx) < 0) goto error;
 
-		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
-	}
+		/*
+		 *	If there is a query for finding the existing IP
+		 *	run that first
+		 */
+		if (inst->alloc_existing && *inst->alloc_existing) {
+			rctx->state = IPPOOL_ALLOC_EXISTING;
+			return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_existing, true,
+						 mod_alloc_resume);
+		}
+		goto requested;
 
-	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!handle) {
-		REDEBUG("Failed reserving SQL connection");
-		RETURN_MODULE_FAIL;
-	}
+	case IPPOOL_ALLOC_EXISTING:
+		rctx->allocation_len = sqlippool_query1_result(rctx->allocation, sizeof(rctx->allocation),
+							       inst, request, rctx);
+		if (!rctx->query.handle) goto error;
+		if (rctx->allocation_len) goto found;
 
-	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
+	requested:
+		/*
+		 *	If no existing IP was found and we have a requested IP address
+		 *	and a query to find whether it is available then try that
+		 */
+		if (inst->alloc_requested && *inst->alloc_requested) {
+			char buffer[128];
+			char *ip = NULL;
+			ssize_t slen;
+
+			slen = tmpl_expand(&ip, buffer, sizeof(buffer), request, inst->requested_address, NULL, NULL);
+			if (slen < 0) goto error;
+
+			if (slen > 0) {
+				rctx->state = IPPOOL_ALLOC_REQUESTED;
+				return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_requested, true,
+							 mod_alloc_resume);
+			}
+		}
+		goto find;
 
-	DO_PART(alloc_begin);
+	case IPPOOL_ALLOC_REQUESTED:
+		rctx->allocation_len = sqlippool_query1_result(rctx->allocation, sizeof(rctx->allocation),
+							       inst, request, rctx);
+		if (!rctx->query.handle) goto error;
+		if (rctx->allocation_len) goto found;
 
-	/*
-	 *	If there is a query for finding the existing IP
-	 *	run that first
-	 */
-	if (inst->alloc_existing && *inst->alloc_existing) {
-		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-						  inst->alloc_existing, &handle,
-						  inst, request, (char *) NULL, 0);
-		if (!handle) RETURN_MODULE_FAIL;
-	} else {
-		allocation_len = 0;
-	}
+	find:
+		/*
+		 *	If no existing IP was found (or no query was run),
+		 *	run the query to find a free IP
+		 */
+		rctx->state = IPPOOL_ALLOC_FIND;
+		return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_find, true, mod_alloc_resume);
 
-	/*
-	 *	If no existing IP was found and we have a requested IP address
-	 *	and a query to find whether it is available then try that
-	 */
-	if ((allocation_len == 0) && inst->alloc_requested && *inst->alloc_requested) {
-		char buffer[128];
-		char *ip = NULL;
-		ssize_t slen;
-
-		slen = tmpl_expand(&ip, buffer, sizeof(buffer), request, inst->requested_address, NULL, NULL);
-		if (slen < 0) RETURN_MODULE_FAIL;
-
-		if (slen > 0) {
-			allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-							  inst->alloc_requested, &handle,
-							  inst, request, (char *) NULL, 0);
-			if (!handle) RETURN_MODULE_FAIL;
-		}
-	}
+	case IPPOOL_ALLOC_FIND:
+		rctx->allocation_len = sqlippool_query1_result(rctx->allocation, sizeof(rctx->allocation),
+							       inst, request, rctx);
+		if (!rctx->query.handle) goto error;
+		if (rctx->allocation_len) goto found;
 
-	/*
-	 *	If no existing IP was found (or no query was run),
-	 *	run the query to find a free IP
-	 */
-	if (allocation_len == 0) {
-		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-						  inst->alloc_find, &handle,
-						  inst, request, (char *) NULL, 0);
-		if (!handle) RETURN_MODULE_FAIL;
-	}
+		/*
+		 *	Nothing found...
+		 */
+		rctx->state = IPPOOL_ALLOC_NOTFOUND_COMMIT;
+		return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_commit, false, mod_alloc_resume);
 
-	/*
-	 *	Nothing found...
-	 */
-	if (allocation_len == 0) {
-		DO_PART(alloc_commit);
+	case IPPOOL_ALLOC_NOTFOUND_COMMIT:
+		if (sqlippool_command_result(inst, rctx) < 0) goto error;
 
 		/*
-		 *Should we perform pool-check ?
+		 *	Should we perform pool-check ?
 		 */
 		if (inst->pool_check && *inst->pool_check) {
-
 			/*
-			 *Ok, so the allocate-find query found nothing ...
-			 *Let's check if the pool exists at all
+			 *	Ok, so the allocate-find query found nothing ...
+			 *	Let's check if the pool exists at all
 			 */
-			allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-							  inst->pool_check, &handle, inst, request,
-							  (char *) NULL, 0);
-			if (!handle) RETURN_MODULE_FAIL;
-
-			fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-
-			if (allocation_len) {
-
-				/*
-				 *	Pool exists after all... So,
-				 *	the failure to allocate the IP
-				 *	address was most likely due to
-				 *	the depletion of the pool. In
-				 *	that case, we should return
-				 *	NOTFOUND
-				 */
-				RDEBUG2("pool appears to be full");
-				return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
-			}
-
-			/*
-			 *	Pool doesn't exist in the table. It
-			 *	may be handled by some other instance of
-			 *	sqlippool, so we should just ignore this
-			 *	allocation failure and return NOOP
-			 */
-			RDEBUG2("IP address could not be allocated as no pool exists with that name");
-			RETURN_MODULE_NOOP;
-
+			rctx->state = IPPOOL_ALLOC_POOL_CHECK;
+			return sqlippool_command(p_result, mctx, request, rctx, inst->pool_check, true,
+						 mod_alloc_resume);
 		}
 
-		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+		inst->sql_inst->query_release(&rctx->query);
 
 		RDEBUG2("IP address could not be allocated");
 		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOOP);
-	}
 
-	/*
-	 *	See if we can create the VP from the returned data.  If not,
-	 *	error out.  If so, add it to the list.
-	 */
-	MEM(vp = fr_pair_afrom_da(request->reply_ctx, inst->allocated_address_da));
-	if (fr_pair_value_from_str(vp, allocation, allocation_len, NULL, true) < 0) {
-		DO_PART(alloc_commit);
+	case IPPOOL_ALLOC_POOL_CHECK:
+		rctx->allocation_len = sqlippool_query1_result(rctx->allocation, sizeof(rctx->allocation),
+							       inst, request, rctx);
+		if (!rctx->query.handle) goto error;
 
-		talloc_free(vp);
-		RDEBUG2("Invalid IP number [%s] returned from instbase query.", allocation);
-		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOOP);
-	}
+		inst->sql_inst->query_release(&rctx->query);
 
-	/*
-	 *	UPDATE
-	 */
-	if (sqlippool_command(inst->alloc_update, &handle, inst, request,
-			      allocation, allocation_len) < 0) {
-	error:
-		talloc_free(vp);
-		if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-		RETURN_MODULE_FAIL;
-	}
+		if (rctx->allocation_len) {
+			/*
+			 *	Pool exists after all... So,
+			 *	the failure to allocate the IP
+			 *	address was most likely due to
+			 *	the depletion of the pool. In
+			 *	that case, we should return
+			 *	NOTFOUND
+			 */
+			RDEBUG2("pool appears to be full");
+			return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+		}
+
+		/*
+		 *	Pool doesn't exist in the table. It
+		 *	may be handled by some other instance of
+		 *	sqlippool, so we should just ignore this
+		 *	allocation failure and return NOOP
+		 */
+		RDEBUG2("IP address could not be allocated as no pool exists with that name");
+		RETURN_MODULE_NOOP;
+
+	found:
+		/*
+		 *	See if we can create the VP from the returned data.  If not,
+		 *	error out.  If so, add it to the list.
+		 */
+		MEM(rctx->vp = fr_pair_afrom_da(request->reply_ctx, inst->allocated_address_da));
+		if (fr_pair_value_from_str(rctx->vp, rctx->allocation, rctx->allocation_len, NULL, true) < 0) {
+			RDEBUG2("Invalid IP number [%s] returned from instbase query.", rctx->allocation);
+			TALLOC_FREE(rctx->vp);
+
+			rctx->state = IPPOOL_ALLOC_INVALID_COMMIT;
+			return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_commit, false,
+						 mod_alloc_resume);
+		}
 
-	DO_PART(alloc_commit);
+		/*
+		 *	UPDATE
+		 */
+		rctx->param = rctx->allocation;
+		rctx->param_len = rctx->allocation_len;
+		rctx->state = IPPOOL_ALLOC_UPDATE;
+		return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_update, false, mod_alloc_resume);
 
-	RDEBUG2("Allocated IP %s", allocation);
-	fr_pair_append(&request->reply_pairs, vp);
+	case IPPOOL_ALLOC_INVALID_COMMIT:
+		if (sqlippool_command_result(inst, rctx) < 0) goto error;
 
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+		inst->sql_inst->query_release(&rctx->query);
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOOP);
 
-	return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
-}
+	case IPPOOL_ALLOC_UPDATE:
+		if (sqlippool_command_result(inst, rctx) < 0) goto error;
 
-/*
- *	Update a lease.
- */
-static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
-{
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
-	rlm_sql_handle_t	*handle;
-	int			affected;
+		rctx->param = NULL;
+		rctx->param_len = 0;
+		rctx->state = IPPOOL_ALLOC_COMMIT;
+		return sqlippool_command(p_result, mctx, request, rctx, inst->alloc_commit, false, mod_alloc_resume);
 
-	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!handle) {
-		REDEBUG("Failed reserving SQL connection");
-		RETURN_MODULE_FAIL;
-	}
+	case IPPOOL_ALLOC_COMMIT:
+		if (sqlippool_command_result(inst, rctx) < 0) goto error;
 
-	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
-		RETURN_MODULE_FAIL;
+		RDEBUG2("Allocated IP %s", rctx->allocation);
+		fr_pair_append(&request->reply_pairs, rctx->vp);
+		rctx->vp = NULL;
+
+		inst->sql_inst->query_release(&rctx->query);
+		return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
 	}
 
-	DO_PART(update_begin);
+error:
+	TALLOC_FREE(rctx->vp);
+	inst->sql_inst->query_release(&rctx->query);
+	RETURN_MODULE_FAIL;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
 
 	/*
-	 *  An optional query which can be used to tidy up before updates
-	 *  primarily intended for multi-server setups sharing a common database
-	 *  allowing for tidy up of multiple offered addresses in a DHCP context.
+	 *	If there is a Framed-IP-Address attribute in the reply do nothing
 	 */
-	DO_PART(update_free);
+	if (fr_pair_find_by_da_idx(&request->reply_pairs, inst->allocated_address_da, 0) != NULL) {
+		RDEBUG2("%s already exists", inst->allocated_address_da->name);
 
-	affected = sqlippool_command(inst->update_update, &handle, inst, request, NULL, 0);
+		return do_logging(p_result, inst, request, inst->log_exists, RLM_MODULE_NOOP);
+	}
 
-	if (affected < 0) {
-	error:
-		if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-		RETURN_MODULE_FAIL;
+	if (fr_pair_find_by_da_idx(&request->control_pairs, attr_pool_name, 0) == NULL) {
+		RDEBUG2("No %s defined", attr_pool_name->name);
+
+		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
-	DO_PART(update_commit);
+	return sqlippool_reserve(p_result, mctx, request, sqlippool_rctx_alloc(inst, request), mod_alloc_resume);
+}
 
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+/*
+ *	The lease update sequence has been run.
+ */
+static unlang_action_t mod_update_done(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+	sqlippool_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, sqlippool_rctx_t);
 
-	if (affected > 0) {
+	if (rctx->affected[2] > 0) {
 		/*
 		 * The lease has been updated - return OK
 		 */
@@ -720,33 +849,42 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 }
 
 /*
- *	Release a lease.
+ *	Update a lease.
  */
-static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
-	rlm_sql_handle_t	*handle;
-
-	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!handle) {
-		REDEBUG("Failed reserving SQL connection");
-		RETURN_MODULE_FAIL;
-	}
-
-	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
 
-	DO_PART(release_begin);
-	DO_PART(release_clear);
-	DO_PART(release_commit);
+	/*
+	 *  update_free is an optional query which can be used to tidy up before updates
+	 *  primarily intended for multi-server setups sharing a common database
+	 *  allowing for tidy up of multiple offered addresses in a DHCP context.
+	 */
+	return sqlippool_sequence(p_result, mctx, request,
+				  (char const *[]){ inst->update_begin, inst->update_free,
+						    inst->update_update, inst->update_commit }, 4,
+				  mod_update_done);
+}
 
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+/*
+ *	A release, bulk release, or mark sequence has been run.
+ */
+static unlang_action_t mod_sequence_done(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					 UNUSED request_t *request)
+{
 	RETURN_MODULE_OK;
+}
 
-	error:
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-	RETURN_MODULE_FAIL;
+/*
+ *	Release a lease.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
+
+	return sqlippool_sequence(p_result, mctx, request,
+				  (char const *[]){ inst->release_begin, inst->release_clear, inst->release_commit }, 3,
+				  mod_sequence_done);
 }
 
 /*
@@ -754,29 +892,12 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
  */
 static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
-	rlm_sql_handle_t	*handle;
-
-	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!handle) {
-		REDEBUG("Failed reserving SQL connection");
-		RETURN_MODULE_FAIL;
-	}
-
-	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
 
-	DO_PART(bulk_release_begin);
-	DO_PART(bulk_release_clear);
-	DO_PART(bulk_release_commit);
-
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-	RETURN_MODULE_OK;
-
-	error:
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-	RETURN_MODULE_FAIL;
+	return sqlippool_sequence(p_result, mctx, request,
+				  (char const *[]){ inst->bulk_release_begin, inst->bulk_release_clear,
+						    inst->bulk_release_commit }, 3,
+				  mod_sequence_done);
 }
 
 /*
@@ -785,29 +906,11 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
  */
 static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
-	rlm_sql_handle_t	*handle;
-
-	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!handle) {
-		REDEBUG("Failed reserving SQL connection");
-		RETURN_MODULE_FAIL;
-	}
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_sqlippool_t);
 
-	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
-
-	DO_PART(mark_begin);
-	DO_PART(mark_update);
-	DO_PART(mark_commit);
-
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-	RETURN_MODULE_OK;
-
-	error:
-	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-	RETURN_MODULE_FAIL;
+	return sqlippool_sequence(p_result, mctx, request,
+				  (char const *[]){ inst->mark_begin, inst->mark_update, inst->mark_commit }, 3,
+				  mod_sequence_done);
 }
 
 /*
@@ -0,0 +1,9 @@
+TARGETNAME	:= process_metrics
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= base.c
+
+TGT_PREREQS	:= libfreeradius-util.a
@@ -0,0 +1,50 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file src/process/metrics/base.c
+ * @brief METRICS processing.
+ *
+ * The metrics listener answers scrapes itself, in the network thread,
+ * so no packets are ever passed to this module.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/server/process.h>
+#include <freeradius-devel/util/debug.h>
+
+static fr_dict_t const *dict_freeradius;
+
+extern fr_dict_autoload_t process_metrics_dict[];
+fr_dict_autoload_t process_metrics_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ NULL }
+};
+
+static unlang_action_t mod_process(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx, UNUSED request_t *request)
+{
+	RETURN_MODULE_FAIL;
+}
+
+extern fr_process_module_t process_metrics;
+fr_process_module_t process_metrics = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "process_metrics",
+	.process	= mod_process,
+	.dict		= &dict_freeradius,
+};
@@ -59,6 +59,7 @@ test: \
 		test.auth	\
 		test.digest	\
 		test.radmin	\
+		test.metrics	\
 		test.eap	\
 		test.tacacs	\
 		test.vmps	\
@@ -0,0 +1,73 @@
+#
+#	Tests for the metrics listener against the radiusd.
+#
+
+#
+#	Test name
+#
+TEST  := test.metrics
+FILES := $(subst $(DIR)/,,$(wildcard $(DIR)/*.txt))
+
+#
+#  The responses are fetched with curl.  If we don't have it,
+#  then there's nothing to run.
+#
+ifeq "$(shell which curl 2>/dev/null)" ""
+FILES :=
+endif
+
+$(eval $(call TEST_BOOTSTRAP))
+
+#
+#	Config settings
+#
+METRICS_RADIUS_LOG := $(OUTPUT)/radiusd.log
+METRICS_URL        := http://127.0.0.1:$(PORT)/metrics
+
+#
+#  Generic rules to start / stop the radius service.
+#
+CLIENT := radiusd
+include src/tests/radiusd.mk
+$(eval $(call RADIUSD_SERVICE,metrics,$(OUTPUT)))
+
+#
+#	Scrape the metrics, and check the response.
+#
+#	Each line of the test file is a regular expression which
+#	must match a line of the response.  Lines starting with
+#	"!" must not match any line of the response.  An "ACCEPT:"
+#	comment sets the Accept header of the request.
+#
+$(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
+	@echo "METRICS-TEST $(notdir $@)"
+	${Q} [ -f $(dir $@)/radiusd.pid ] || exit 1
+	$(eval FOUND  := $(patsubst %.txt,%.out,$@))
+	$(eval ACCEPT := $(shell grep "#.*ACCEPT:" $< | cut -f2- -d ':'))
+	${Q}if ! curl -s -f -H "Accept:$(ACCEPT)" -o $(FOUND) $(METRICS_URL); then \
+		echo "METRICS FAILED $@"; \
+		echo "RADIUSD: $(RADIUSD_RUN)"; \
+		echo "CURL   : curl -s -f -H \"Accept:$(ACCEPT)\" $(METRICS_URL)"; \
+		tail -n 20 "$(METRICS_RADIUS_LOG)"; \
+		rm -f $(BUILD_DIR)/tests/test.metrics; \
+		$(MAKE) --no-print-directory test.metrics.radiusd_kill; \
+		exit 1; \
+	fi
+	${Q}grep -v '^#' $< | while read -r re; do \
+		case "$$re" in \
+		!*)	if grep -qE -- "$${re#!}" $(FOUND); then echo "Unexpected match for $${re#!}"; exit 1; fi ;; \
+		*)	if ! grep -qE -- "$$re" $(FOUND); then echo "No match for $$re"; exit 1; fi ;; \
+		esac; \
+	done || { \
+		echo "METRICS FAILED $@"; \
+		echo "CURL   : curl -s -f -H \"Accept:$(ACCEPT)\" $(METRICS_URL)"; \
+		echo "Response was in $(FOUND)"; \
+		rm -f $(BUILD_DIR)/tests/test.metrics; \
+		$(MAKE) --no-print-directory test.metrics.radiusd_kill; \
+		exit 1; \
+	}
+	${Q}touch $@
+
+$(TEST):
+	${Q}$(MAKE) --no-print-directory $@.radiusd_stop
+	@touch $(BUILD_DIR)/tests/$@
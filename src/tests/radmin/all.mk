@@ -49,15 +49,36 @@ $(OUTPUT)/depends.mk: $(addprefix $(DIR)/,$(FILES)) | $(OUTPUT)
 	done
 -include $(OUTPUT)/depends.mk
 
+#
+#  Tests with a ".radclient" file send its packets to the "test"
+#  virtual server before the radmin commands are run.
+#
+RADMIN_RADCLIENT_FILES := $(patsubst %.radclient,%.txt,$(subst $(DIR)/,,$(wildcard $(DIR)/*.radclient)))
+$(foreach x,$(RADMIN_RADCLIENT_FILES),$(eval $(OUTPUT)/$x: $(TEST_BIN_DIR)/radclient))
+
 #
 #	Run the radmin commands against the radiusd.
 #
+#	Timings can't be predicted, so the values of "*_usec"
+#	entries are removed before the output is compared.
+#
 $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 	@echo "RADMIN-TEST $(notdir $@)"
 	${Q} [ -f $(dir $@)/radiusd.pid ] || exit 1
 	$(eval EXPECTED := $(patsubst %.txt,%.out,$<))
 	$(eval FOUND    := $(patsubst %.txt,%.out,$@))
 	$(eval TARGET   := $(patsubst %.txt,%,$(notdir $@)))
+	$(eval RADCLIENT_TEST := $(patsubst %.txt,%.radclient,$<))
+	${Q}if [ -e "$(RADCLIENT_TEST)" ] && ! $(TEST_BIN)/radclient $$(grep "#.*ARGV:" $(RADCLIENT_TEST) | cut -f2 -d ':') \
+		-f $(RADCLIENT_TEST) -d $(RADMIN_CONFIG_PATH) -D share/dictionary 127.0.0.1:$(PORT) auth $(SECRET) > $(OUTPUT)/$(TARGET).radclient.out 2>&1; then \
+		echo "RADMIN FAILED $@"; \
+		echo "RADIUSD  : $(RADIUSD_RUN)"; \
+		echo "RADCLIENT: $(TEST_BIN)/radclient -f $(RADCLIENT_TEST) -d $(RADMIN_CONFIG_PATH) -D share/dictionary 127.0.0.1:$(PORT) auth $(SECRET)"; \
+		cat $(OUTPUT)/$(TARGET).radclient.out; \
+		rm -f $(BUILD_DIR)/tests/test.radmin; \
+		$(MAKE) --no-print-directory test.radmin.radiusd_kill; \
+		exit 1; \
+	fi
 	${Q}if ! $(TEST_BIN)/radmin -q -f $(RADMIN_SOCKET_FILE) < $< > $(FOUND) 2>&1; then\
 		echo "--------------------------------------------------"; \
 		tail -n 20 "$(RADMIN_RADIUS_LOG)"; \
@@ -69,6 +90,8 @@ $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 		$(MAKE) --no-print-directory test.radmin.radiusd_kill; \
 		exit 1; \
 	fi; \
+	mv -f $(FOUND) $(FOUND).bak; \
+	sed 's/_usec[[:space:]].*/_usec/' $(FOUND).bak > $(FOUND); \
 	if ! cmp -s $(FOUND) $(EXPECTED); then \
 		echo "RADMIN FAILED $@"; \
 		echo "RADIUSD: $(RADIUSD_RUN)"; \
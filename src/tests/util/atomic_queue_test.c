@@ -22,7 +22,7 @@
 
 RCSID("$Id$")
 
-#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/talloc.h>
 #include <stdint.h>
@@ -2,6 +2,6 @@ TARGET := atomic_queue_test
 
 SOURCES		:= atomic_queue_test.c
 
-TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a
+TGT_PREREQS	:= libfreeradius-util.la
 TGT_LDLIBS	:= $(LIBS)
 
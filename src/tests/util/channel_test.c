@@ -1,5 +1,5 @@
 /*
- * channel_test.c	Tests for channels
+ * channel_test.c	Tests and benchmarks for channels
  *
  * Version:	$Id$
  *
@@ -25,6 +25,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/talloc.h>
 
@@ -33,24 +34,43 @@ RCSID("$Id$")
 #endif
 
 #include <pthread.h>
-#include <sys/event.h>
 
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
-#define MAX_KEVENTS		(10)
+#define MAX_OUTSTANDING		(1024)		/* same as the size of the channel atomic queues */
 
 #define MPRINT1 if (debug_lvl) printf
 #define MPRINT2 if (debug_lvl > 1) printf
 
 static int			debug_lvl = 0;
-static int			kq_master, kq_worker;
-static fr_atomic_queue_t	*aq_master, *aq_worker;
+static fr_event_list_t		*el_master, *el_worker;
 static fr_control_t		*control_master, *control_worker;
 static int			max_messages = 10;
 static int			max_control_plane = 0;
 static int			max_outstanding = 1;
 static bool			touch_memory = false;
 
+/*
+ *	Master state.  Only touched by the master thread.
+ */
+static fr_message_set_t		*master_ms;
+static int			num_messages;
+static int			num_replies;
+static int			num_outstanding;
+static uint64_t			master_signals;		//!< data ready signals received by the master
+static bool			master_running;
+static bool			signaled_close;
+
+/*
+ *	Worker state.  Only touched by the worker thread.
+ */
+static fr_message_set_t		*worker_ms;
+static fr_channel_data_t	*worker_queue[MAX_OUTSTANDING];
+static int			worker_queued;
+static int			worker_messages;
+static uint64_t			worker_signals;		//!< data ready signals received by the worker
+static bool			worker_running;
+
 /**********************************************************************/
 typedef struct request_s request_t;
 
@@ -77,124 +97,247 @@ static NEVER_RETURNS void usage(void)
 	fr_exit_now(EXIT_FAILURE);
 }
 
-static void *channel_master(void *arg)
+static void touch(fr_channel_data_t *cd)
 {
-	bool			running, signaled_close;
-	int			rcode, i, num_events;
-	int			num_outstanding, num_messages;
-	int			num_replies;
-	fr_message_set_t	*ms;
-	TALLOC_CTX		*ctx;
-	fr_channel_t		*channel = arg;
+	size_t j, k;
+
+	for (j = k = 0; j < cd->m.data_size; j++) {
+		k += cd->m.data[j];
+	}
+
+	cd->m.data[4] = k;
+}
+
+/*
+ *	Called from fr_channel_recv_reply()
+ */
+static void master_recv_reply(UNUSED void *ctx, UNUSED fr_channel_t *ch, fr_channel_data_t *reply)
+{
+	num_replies++;
+	num_outstanding--;
+	MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
+		num_replies, num_outstanding, num_messages, max_messages);
+	fr_message_done(&reply->m);
+}
+
+/*
+ *	Called from fr_channel_recv_request().  Queue the request, and
+ *	reply to it once the input has been drained.  That's what the
+ *	real worker does, and it lets the channel coalesce signals.
+ */
+static void worker_recv_request(UNUSED void *ctx, UNUSED fr_channel_t *ch, fr_channel_data_t *cd)
+{
+	fr_assert(worker_queued < MAX_OUTSTANDING);
+
+	worker_messages++;
+	MPRINT1("\tWorker got message %d\n", worker_messages);
+	worker_queue[worker_queued++] = cd;
+}
+
+static void master_send(fr_channel_t *ch)
+{
+	int i, num_to_send;
+
+	if (num_messages >= max_messages) return;
+
+	num_to_send = max_outstanding - num_outstanding;
+	if ((num_messages + num_to_send) > max_messages) {
+		num_to_send = max_messages - num_messages;
+	}
+	MPRINT1("Master sending %d messages\n", num_to_send);
+
+	for (i = 0; i < num_to_send; i++) {
+		fr_channel_data_t *cd;
+
+		cd = (fr_channel_data_t *) fr_message_alloc(master_ms, NULL, 100);
+		fr_assert(cd != NULL);
+
+		num_outstanding++;
+		num_messages++;
+
+		cd->m.when = fr_time();
+
+		if (touch_memory) touch(cd);
+
+		memcpy(cd->m.data, &num_messages, sizeof(num_messages));
+
+		MPRINT1("Master sent message %d\n", num_messages);
+		if (fr_channel_send_request(ch, cd) < 0) {
+			fprintf(stderr, "Failed sending request: %s\n", fr_strerror());
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+}
+
+static void master_channel_callback(void *ctx, void const *data, size_t data_size, fr_time_t now)
+{
+	fr_channel_t		*ch = ctx;
 	fr_channel_t		*new_channel;
 	fr_channel_event_t	ce;
-	struct kevent		events[MAX_KEVENTS];
 
-	MEM(ctx = talloc_init_const("channel_master"));
+	ce = fr_channel_service_message(now, &new_channel, data, data_size);
+	MPRINT1("Master got channel event %d\n", ce);
 
-	ms = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
-	if (!ms) {
-		fprintf(stderr, "Failed creating message set\n");
-		fr_exit_now(EXIT_FAILURE);
-	}
+	switch (ce) {
+	case FR_CHANNEL_DATA_READY_REQUESTOR:
+		MPRINT1("Master got data ready signal\n");
+		fr_assert(new_channel == ch);
 
-	MPRINT1("Master started.\n");
+		master_signals++;
+		if (!fr_channel_recv_reply(ch)) {
+			MPRINT1("Master SIGNAL WITH NO DATA!\n");
+			break;
+		}
+		while (fr_channel_recv_reply(ch));
+		break;
 
-	/*
-	 *	Signal the worker that the channel is open
-	 */
-	rcode = fr_channel_signal_open(channel);
-	if (rcode < 0) {
-		fprintf(stderr, "Failed signaling open: %s\n", fr_syserror(errno));
-		fr_exit_now(EXIT_FAILURE);
+	case FR_CHANNEL_CLOSE:
+		MPRINT1("Master received close signal\n");
+		fr_assert(new_channel == ch);
+		fr_assert(signaled_close == true);
+		master_running = false;
+		break;
+
+	case FR_CHANNEL_NOOP:
+		MPRINT1("Master got NOOP\n");
+		break;
+
+	default:
+		fprintf(stderr, "Master got unexpected CE %d\n", ce);
+
+		/*
+		 *	Not written yet!
+		 */
+		fr_assert(0 == 1);
+		break;
 	}
+}
 
-	/*
-	 *	Bootstrap the queue with messages.
-	 */
-	num_replies = num_outstanding = num_messages = 0;
+static void worker_channel_callback(void *ctx, void const *data, size_t data_size, fr_time_t now)
+{
+	fr_channel_t		*ch = ctx;
+	fr_channel_t		*new_channel;
+	fr_channel_event_t	ce;
+	int			i;
 
-	running = true;
-	signaled_close = false;
+	ce = fr_channel_service_message(now, &new_channel, data, data_size);
+	MPRINT1("\tWorker got channel event %d\n", ce);
+
+	switch (ce) {
+	case FR_CHANNEL_OPEN:
+		MPRINT1("\tWorker received a new channel\n");
+		fr_assert(new_channel == ch);
+		break;
 
-	while (running) {
-		fr_time_t now;
-		int num_to_send;
-		fr_channel_data_t *cd, *reply;
+	case FR_CHANNEL_CLOSE:
+		MPRINT1("\tWorker requested to close the channel.\n");
+		fr_assert(new_channel == ch);
+		worker_running = false;
 
-#if 0
 		/*
-		 *	Drain the input queues before sleeping.
+		 *	Drain the input before we ACK the exit.
 		 */
-		while ((reply = fr_channel_recv_reply(channel)) != NULL) {
-			num_replies++;
-			num_outstanding--;
-			MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
-				num_replies, num_outstanding, num_messages, max_messages);
-			fr_message_done(&reply->m);
+		while (fr_channel_recv_request(ch));
+		for (i = 0; i < worker_queued; i++) fr_message_done(&worker_queue[i]->m);
+		worker_queued = 0;
+
+		(void) fr_channel_responder_ack_close(ch);
+		break;
+
+	case FR_CHANNEL_DATA_READY_RESPONDER:
+		MPRINT1("\tWorker got data ready signal\n");
+		fr_assert(new_channel == ch);
+
+		worker_signals++;
+		if (!fr_channel_recv_request(ch)) {
+			MPRINT1("\tWorker SIGNAL WITH NO DATA!\n");
+			break;
 		}
-#endif
+		while (fr_channel_recv_request(ch));
 
 		/*
-		 *	Ensure we have outstanding messages.
+		 *	fr_channel_send_reply() also drains the input,
+		 *	so the queue may grow while we're replying.
 		 */
-		if (num_messages >= max_messages) {
-			MPRINT1("Master DONE sending\n");
-			goto check_close;
-		}
+		for (i = 0; i < worker_queued; i++) {
+			fr_channel_data_t *cd = worker_queue[i];
+			fr_channel_data_t *reply;
 
-		num_to_send = max_outstanding - num_outstanding;
-		if ((num_messages + num_to_send) > max_messages) {
-			num_to_send = max_messages - num_messages;
+			reply = (fr_channel_data_t *) fr_message_alloc(worker_ms, NULL, 100);
+			fr_assert(reply != NULL);
+
+			reply->m.when = fr_time();
+			fr_message_done(&cd->m);
+
+			if (touch_memory) touch(reply);
+
+			MPRINT1("\tWorker sending reply\n");
+			if (fr_channel_send_reply(ch, reply) < 0) {
+				fprintf(stderr, "Failed sending reply: %s\n", fr_strerror());
+				fr_exit_now(EXIT_FAILURE);
+			}
 		}
-		MPRINT1("Master sending %d messages\n", num_to_send);
+		worker_queued = 0;
+		break;
 
-		for (i = 0; i < num_to_send; i++) {
-			cd = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
-			fr_assert(cd != NULL);
+	case FR_CHANNEL_NOOP:
+		MPRINT1("\tWorker got NOOP\n");
+		fr_assert(new_channel == ch);
+		break;
 
-			num_outstanding++;
-			num_messages++;
+	default:
+		fprintf(stderr, "\tWorker got unexpected CE %d\n", ce);
 
-			cd->m.when = fr_time();
+		/*
+		 *	Not written yet!
+		 */
+		fr_assert(0 == 1);
+		break;
+	}
+}
 
-			if (touch_memory) {
-				size_t j, k;
+static void *channel_master(void *arg)
+{
+	int			rcode;
+	TALLOC_CTX		*ctx;
+	fr_channel_t		*channel = arg;
 
-				for (j = k = 0; j < cd->m.data_size; j++) {
-					k += cd->m.data[j];
-				}
+	MEM(ctx = talloc_init_const("channel_master"));
 
-				cd->m.data[4] = k;
-			}
+	master_ms = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
+	if (!master_ms) {
+		fprintf(stderr, "Failed creating message set\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
 
-			memcpy(cd->m.data, &num_messages, sizeof(num_messages));
+	MPRINT1("Master started.\n");
 
-			MPRINT1("Master sent message %d\n", num_messages);
-			rcode = fr_channel_send_request(channel, cd, &reply);
-			if (rcode < 0) {
-				fprintf(stderr, "Failed sending request: %s\n", fr_syserror(errno));
-			}
-			fr_assert(rcode == 0);
-			if (reply) {
-				num_replies++;
-				num_outstanding--;
-				MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
-					num_replies, num_outstanding, num_messages, max_messages);
-				fr_message_done(&reply->m);
-			}
-		}
+	/*
+	 *	Signal the worker that the channel is open
+	 */
+	rcode = fr_channel_signal_open(channel);
+	if (rcode < 0) {
+		fprintf(stderr, "Failed signaling open: %s\n", fr_strerror());
+		fr_exit_now(EXIT_FAILURE);
+	}
 
+	master_running = true;
+	signaled_close = false;
+
+	while (master_running) {
 		/*
-		 *	Signal close only when done.
+		 *	Ensure we have outstanding messages.
 		 */
-check_close:
+		master_send(channel);
 
+		/*
+		 *	Signal close only when done.
+		 */
 		if (!signaled_close && (num_messages >= max_messages) && (num_outstanding == 0)) {
 			MPRINT1("Master signaling worker to exit.\n");
 			rcode = fr_channel_signal_responder_close(channel);
 			if (rcode < 0) {
-				fprintf(stderr, "Failed signaling close: %s\n", fr_syserror(errno));
+				fprintf(stderr, "Failed signaling close: %s\n", fr_strerror());
 				fr_exit_now(EXIT_FAILURE);
 			}
 
@@ -204,84 +347,14 @@ check_close:
 		MPRINT1("Master waiting on events.\n");
 		fr_assert(num_messages <= max_messages);
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("Master kevent returned %d\n", num_events);
-
-		if (num_events < 0) {
-			if (num_events == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", fr_syserror(errno));
+		rcode = fr_event_corral(el_master, fr_time(), true);
+		if (rcode < 0) {
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			fr_exit_now(EXIT_FAILURE);
 		}
 
-		if (num_events == 0) continue;
-
-		/*
-		 *	Service the events.
-		 */
-		for (i = 0; i < num_events; i++) {
-			(void) fr_channel_service_kevent(channel, control_master, &events[i]);
-		}
-
-		now = fr_time();
-
-		MPRINT1("Master servicing control-plane aq %p\n", aq_master);
-
-		while (true) {
-			uint32_t id;
-			size_t data_size;
-			char data[256];
-
-			data_size = fr_control_message_pop(aq_master, &id, data, sizeof(data));
-			if (!data_size) break;
-
-			fr_assert(id == FR_CONTROL_ID_CHANNEL);
-
-			ce = fr_channel_service_message(now, &new_channel, data, data_size);
-			MPRINT1("Master got channel event %d\n", ce);
-
-			switch (ce) {
-			case FR_CHANNEL_DATA_READY_REQUESTOR:
-				MPRINT1("Master got data ready signal\n");
-				fr_assert(new_channel == channel);
-
-				reply = fr_channel_recv_reply(channel);
-				if (!reply) {
-					MPRINT1("Master SIGNAL WITH NO DATA!\n");
-					continue;
-				}
-
-				do {
-					num_replies++;
-					num_outstanding--;
-					MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
-						num_replies, num_outstanding, num_messages, max_messages);
-					fr_message_done(&reply->m);
-				} while ((reply = fr_channel_recv_reply(channel)) != NULL);
-				break;
-
-			case FR_CHANNEL_CLOSE:
-				MPRINT1("Master received close signal\n");
-				fr_assert(new_channel == channel);
-				fr_assert(signaled_close == true);
-				running = false;
-				break;
-
-			case FR_CHANNEL_NOOP:
-				MPRINT1("Master got NOOP\n");
-				break;
-
-			default:
-				fprintf(stderr, "Master got unexpected CE %d\n", ce);
-
-				/*
-				 *	Not written yet!
-				 */
-				fr_assert(0 == 1);
-				break;
-			} /* switch over signal returned */
-		} /* drain the control plane */
-	} /* loop until told to exit */
+		fr_event_service(el_master);
+	}
 
 	MPRINT1("Master exiting.\n");
 
@@ -289,14 +362,14 @@ check_close:
 	 *	Force all messages to be garbage collected
 	 */
 	MPRINT2("GC\n");
-	fr_message_set_gc(ms);
+	fr_message_set_gc(master_ms);
 
-	if (debug_lvl > 1) fr_message_set_debug(ms, stdout);
+	if (debug_lvl > 1) fr_message_set_debug(master_ms, stdout);
 
 	/*
 	 *	After the garbage collection, all messages marked "done" MUST also be marked "free".
 	 */
-	rcode = fr_message_set_messages_used(ms);
+	rcode = fr_message_set_messages_used(master_ms);
 	MPRINT2("Master messages used = %d\n", rcode);
 	fr_assert(rcode == 0);
 
@@ -305,157 +378,33 @@ check_close:
 	return NULL;
 }
 
-static void *channel_worker(void *arg)
+static void *channel_worker(UNUSED void *arg)
 {
-	bool running = true;
-	int rcode, num_events;
-	int worker_messages = 0;
-	fr_message_set_t *ms;
-	TALLOC_CTX *ctx;
-	fr_channel_t *channel = arg;
-	fr_channel_event_t ce;
-	struct kevent events[MAX_KEVENTS];
+	int			rcode;
+	TALLOC_CTX		*ctx;
 
 	MEM(ctx = talloc_init_const("channel_worker"));
 
-	ms = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
-	if (!ms) {
+	worker_ms = fr_message_set_create(ctx, MAX_MESSAGES, sizeof(fr_channel_data_t), MAX_MESSAGES * 1024);
+	if (!worker_ms) {
 		fprintf(stderr, "Failed creating message set\n");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
 	MPRINT1("\tWorker started.\n");
 
-	while (running) {
-		int i;
-		fr_time_t now;
-		fr_channel_t *new_channel;
+	worker_running = true;
 
+	while (worker_running) {
 		MPRINT1("\tWorker waiting on events.\n");
 
-		num_events = kevent(kq_worker, NULL, 0, events, MAX_KEVENTS, NULL);
-		MPRINT1("\tWorker kevent returned %d events\n", num_events);
-
-		if (num_events < 0) {
-			if (errno == EINTR) continue;
-
-			fprintf(stderr, "Failed waiting for kevent: %s\n", fr_syserror(errno));
+		rcode = fr_event_corral(el_worker, fr_time(), true);
+		if (rcode < 0) {
+			fprintf(stderr, "Failed waiting for events: %s\n", fr_strerror());
 			fr_exit_now(EXIT_FAILURE);
 		}
 
-		if (num_events == 0) continue;
-
-		for (i = 0; i < num_events; i++) {
-			(void) fr_channel_service_kevent(channel, control_worker, &events[i]);
-		}
-
-		MPRINT1("\tWorker servicing control-plane aq %p\n", aq_worker);
-
-		now = fr_time();
-
-		while (true) {
-			uint32_t id;
-			size_t data_size;
-			char data[256];
-			fr_channel_data_t *cd, *reply;
-
-			data_size = fr_control_message_pop(aq_worker, &id, data, sizeof(data));
-			if (!data_size) break;
-
-			fr_assert(id == FR_CONTROL_ID_CHANNEL);
-
-			ce = fr_channel_service_message(now, &new_channel, data, data_size);
-			MPRINT1("\tWorker got channel event %d\n", ce);
-
-			switch (ce) {
-
-			case FR_CHANNEL_OPEN:
-				MPRINT1("\tWorker received a new channel\n");
-				fr_assert(new_channel == channel);
-				break;
-
-			case FR_CHANNEL_CLOSE:
-				MPRINT1("\tWorker requested to close the channel.\n");
-				fr_assert(new_channel == channel);
-				running = false;
-
-				/*
-				 *	Drain the input before we ACK the exit.
-				 */
-				while ((cd = fr_channel_recv_request(channel)) != NULL) {
-					worker_messages++;
-					MPRINT1("\tWorker got message %d\n", worker_messages);
-					fr_message_done(&cd->m);
-				}
-
-				(void) fr_channel_responder_ack_close(channel);
-				break;
-
-			case FR_CHANNEL_DATA_READY_RESPONDER:
-				MPRINT1("\tWorker got data ready signal\n");
-				fr_assert(new_channel == channel);
-
-				cd = fr_channel_recv_request(channel);
-				if (!cd) {
-					MPRINT1("\tWorker SIGNAL WITH NO DATA!\n");
-					break;
-				}
-
-				while (cd) {
-					int message_id;
-
-					worker_messages++;
-
-					fr_assert(cd->m.data != NULL);
-					memcpy(&message_id, cd->m.data, sizeof(message_id));
-					MPRINT1("\tWorker got message %d (says %d)\n", worker_messages, message_id);
-
-					reply = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
-					fr_assert(reply != NULL);
-
-					reply->m.when = fr_time();
-					fr_message_done(&cd->m);
-
-					if (touch_memory) {
-						size_t j, k;
-
-						for (j = k = 0; j < reply->m.data_size; j++) {
-							k += reply->m.data[j];
-						}
-
-						reply->m.data[4] = k;
-					}
-
-
-					MPRINT1("\tWorker sending reply to messages %d\n", worker_messages);
-					rcode = fr_channel_send_reply(channel, reply, &cd);
-					if (rcode < 0) {
-						fprintf(stderr, "Failed sending reply: %s\n", fr_syserror(errno));
-					}
-					fr_assert(rcode == 0);
-				}
-				break;
-
-			case FR_CHANNEL_NOOP:
-				MPRINT1("\tWorker got NOOP\n");
-				fr_assert(new_channel == channel);
-				break;
-
-			default:
-				fprintf(stderr, "\tWorker got unexpected CE %d\n", ce);
-
-				/*
-				 *	Not written yet!
-				 */
-				fr_assert(0 == 1);
-				break;
-			} /* switch over signals */
-
-			/*
-			 *	Get a new idea of "now".
-			 */
-			now = fr_time();
-		} /* drain the control plane */
+		fr_event_service(el_worker);
 	}
 
 	MPRINT1("\tWorker exiting.\n");
@@ -464,14 +413,14 @@ static void *channel_worker(void *arg)
 	 *	Force all messages to be garbage collected
 	 */
 	MPRINT2("Worker GC\n");
-	fr_message_set_gc(ms);
+	fr_message_set_gc(worker_ms);
 
-	if (debug_lvl > 1) fr_message_set_debug(ms, stdout);
+	if (debug_lvl > 1) fr_message_set_debug(worker_ms, stdout);
 
 	/*
 	 *	After the garbage collection, all messages marked "done" MUST also be marked "free".
 	 */
-	rcode = fr_message_set_messages_used(ms);
+	rcode = fr_message_set_messages_used(worker_ms);
 	fr_cond_assert(rcode == 0);
 
 	talloc_free(ctx);
@@ -486,8 +435,11 @@ int main(int argc, char *argv[])
 	int			c;
 	fr_channel_t		*channel;
 	TALLOC_CTX		*autofree = talloc_autofree_context();
+	fr_atomic_queue_t	*aq_master, *aq_worker;
 	pthread_attr_t		attr;
 	pthread_t		master_id, worker_id;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
 
 	fr_time_start();
 
@@ -518,22 +470,19 @@ int main(int argc, char *argv[])
 	}
 
 	if (max_outstanding > max_messages) max_outstanding = max_messages;
+	if (max_outstanding > MAX_OUTSTANDING) max_outstanding = MAX_OUTSTANDING;
+	if (max_outstanding < 1) max_outstanding = 1;
 
 	if (!max_control_plane) {
 		max_control_plane = MAX_CONTROL_PLANE;
 		if (max_outstanding > max_control_plane) max_control_plane = max_outstanding;
 	}
 
-#if 0
-	argc -= (optind - 1);
-	argv += (optind - 1);
-#endif
+	el_master = fr_event_list_alloc(autofree, NULL, NULL);
+	fr_assert(el_master != NULL);
 
-	kq_master = kqueue();
-	fr_assert(kq_master >= 0);
-
-	kq_worker = kqueue();
-	fr_assert(kq_worker >= 0);
+	el_worker = fr_event_list_alloc(autofree, NULL, NULL);
+	fr_assert(el_worker != NULL);
 
 	aq_master = fr_atomic_queue_alloc(autofree, max_control_plane);
 	fr_assert(aq_master != NULL);
@@ -541,10 +490,10 @@ int main(int argc, char *argv[])
 	aq_worker = fr_atomic_queue_alloc(autofree, max_control_plane);
 	fr_assert(aq_worker != NULL);
 
-	control_master = fr_control_create(autofree, kq_master, aq_master, 1024);
+	control_master = fr_control_create(autofree, el_master, aq_master);
 	fr_assert(control_master != NULL);
 
-	control_worker = fr_control_create(autofree, kq_worker, aq_worker, 1025);
+	control_worker = fr_control_create(autofree, el_worker, aq_worker);
 	fr_assert(control_worker != NULL);
 
 	channel = fr_channel_create(autofree, control_master, control_worker, false);
@@ -553,22 +502,41 @@ int main(int argc, char *argv[])
 		fr_exit_now(EXIT_FAILURE);
 	}
 
+	fr_channel_set_recv_reply(channel, NULL, master_recv_reply);
+	fr_channel_set_recv_request(channel, NULL, worker_recv_request);
+
+	(void) fr_control_callback_add(control_master, FR_CONTROL_ID_CHANNEL, channel, master_channel_callback);
+	(void) fr_control_callback_add(control_worker, FR_CONTROL_ID_CHANNEL, channel, worker_channel_callback);
+
 	/*
 	 *	Start the two threads, with the channel.
 	 */
 	(void) pthread_attr_init(&attr);
 	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	start = fr_time();
+
 	(void) pthread_create(&master_id, &attr, channel_master, channel);
 	(void) pthread_create(&worker_id, &attr, channel_worker, channel);
 
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq_master);
-	close(kq_worker);
+	elapsed = fr_time_sub(fr_time(), start);
 
-	fr_channel_debug(channel, stdout);
+	/*
+	 *	Without signal suppression, there is one signal in
+	 *	each direction for every packet.
+	 */
+	printf("messages %d, outstanding %d, time %.6fs, %.0f packets/s\n",
+	       num_replies, max_outstanding,
+	       fr_time_delta_unwrap(elapsed) / (double) NSEC,
+	       num_replies / (fr_time_delta_unwrap(elapsed) / (double) NSEC));
+	printf("signals to worker %" PRIu64 " (%.3f/packet), signals to master %" PRIu64 " (%.3f/packet)\n",
+	       worker_signals, num_replies ? (double) worker_signals / num_replies : 0,
+	       master_signals, num_replies ? (double) master_signals / num_replies : 0);
+
+	if (debug_lvl) fr_channel_stats_log(channel, &default_log, __FILE__, __LINE__);
 
 	fr_exit_now(EXIT_SUCCESS);
 }